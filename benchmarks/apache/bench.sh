@@ -0,0 +1,87 @@
+#!/bin/bash
+# A scaling benchmark of the detector on apache: for each backend and each
+# 'ab' concurrency level start httpd under the backend, run 'ab', stop httpd
+# and append one line to a CSV file.
+#
+# Backends (BACKENDS, space separated):
+#   native    - no detector, the baseline for the overhead multipliers.
+#   pin       - ThreadSanitizer/Pin, via $PIN_TSAN (tsan/tsan_pin.sh).
+#   valgrind  - ThreadSanitizer/Valgrind, via $VALGRIND_TSAN (the 'tsan'
+#               script of the self-contained valgrind).
+#   llvm      - apache compiled with llvm/scripts/gcc, in $LLVM_BIN.
+#   relite    - apache compiled with gcc/scripts/gcc, in $RELITE_BIN.
+# The instrumented builds are made by build.sh with CC set to the wrapper
+# and BUILD set to a separate directory, e.g.
+#   CC=/path/to/llvm/scripts/gcc BUILD=build-llvm ./build.sh
+#
+# CSV columns:
+#   backend,concurrency,requests,failed,rps,p50_ms,p99_ms,max_rss_kb,
+#   n_seg_hb,n_vts_hb,n_vts_hb_cached,stacks,forgets
+# The last five are from --show_stats and are empty for the backends
+# which do not print them (native, relite).
+
+set -e
+
+DIR=`dirname $0`
+BIN=${BIN:-"./build/inst/bin"}
+LLVM_BIN=${LLVM_BIN:-"./build-llvm/inst/bin"}
+RELITE_BIN=${RELITE_BIN:-"./build-relite/inst/bin"}
+PIN_TSAN=${PIN_TSAN:-"tsan_pin.sh"}
+VALGRIND_TSAN=${VALGRIND_TSAN:-"tsan"}
+SUPP=${SUPP:-"--suppressions=$DIR/tsan_apache.supp"}
+SIZE=${SIZE:-10000}
+BACKENDS=${BACKENDS:-"native pin valgrind llvm relite"}
+CONCURRENCY=${CONCURRENCY:-"1 2 4 8 16 32 64 128 256"}
+STARTUP=${STARTUP:-5}  # Seconds to wait for httpd to initialize.
+OUT=${OUT:-"bench.csv"}
+LOGS=${LOGS:-"bench_logs"}
+
+mkdir -p $LOGS
+if [ ! -f $OUT ]; then
+  echo "backend,concurrency,requests,failed,rps,p50_ms,p99_ms,max_rss_kb,"\
+"n_seg_hb,n_vts_hb,n_vts_hb_cached,stacks,forgets" > $OUT
+fi
+
+# Prints the value of a "name = 1,234" or "name: 1,234" stats line.
+stat_value() {
+  grep -m1 "$1" $2 | sed "s/.*$1[ =:]*\([0-9,']*\).*/\1/" | tr -d ",'"
+}
+
+for backend in $BACKENDS; do
+  bin=$BIN
+  case $backend in
+    native)   prefix="" ;;
+    pin)      prefix="$PIN_TSAN --show_stats=1 $SUPP --" ;;
+    valgrind) prefix="$VALGRIND_TSAN --show_stats=1 $SUPP" ;;
+    llvm)     prefix=""; bin=$LLVM_BIN ;;
+    relite)   prefix=""; bin=$RELITE_BIN ;;
+    *) echo "Unknown backend: $backend"; exit 1 ;;
+  esac
+  pidfile=`dirname $bin`/logs/httpd.pid
+  for c in $CONCURRENCY; do
+    log=$LOGS/$backend-$c
+    echo "$backend, concurrency $c"
+    rm -f $pidfile
+    TSAN_ARGS="--show_stats=1 $SUPP" \
+      $prefix ${bin}/httpd -X -k start 2> $log.tsan &
+    sleep $STARTUP
+    pid=`cat $pidfile`
+    ${bin}/ab -n $SIZE -c $c http://localhost:8000/ > $log.ab 2>&1 || true
+    # VmHWM is the peak RSS of the process, the tool's own memory included.
+    rss=`grep VmHWM /proc/$pid/status | awk '{print $2}'`
+    ${bin}/httpd -X -k stop
+    wait
+    requests=`grep 'Complete requests' $log.ab | awk '{print $3}'`
+    failed=`grep 'Failed requests' $log.ab | awk '{print $3}'`
+    rps=`grep 'Requests per second' $log.ab | awk '{print $4}'`
+    p50=`grep '^ *50%' $log.ab | awk '{print $2}'`
+    p99=`grep '^ *99%' $log.ab | awk '{print $2}'`
+    seg_hb=`stat_value 'n_seg_hb ' $log.tsan`
+    vts_hb=`stat_value 'n_vts_hb ' $log.tsan`
+    vts_hb_cached=`stat_value 'n_vts_hb_cached ' $log.tsan`
+    stacks=`grep -m1 'Stack depot' $log.tsan | awk '{print $3}' | tr -d ,`
+    forgets=`stat_value 'Forget all history' $log.tsan`
+    echo "$backend,$c,$requests,$failed,$rps,$p50,$p99,$rss,"\
+"$seg_hb,$vts_hb,$vts_hb_cached,$stacks,$forgets" >> $OUT
+  done
+done
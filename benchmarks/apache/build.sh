@@ -3,9 +3,12 @@
 # extracted apache (see get.sh).
 # Configure apache with mpm=worker so that it runs in multiple threads.
 # Also, define USE_ATOMICS_GENERIC so that pthread mutexes are used.
+# Set CC and BUILD to make an instrumented build in another directory
+# (see bench.sh).
 set -e
 set -x
-mkdir build && cd build
+BUILD=${BUILD:-build}
+mkdir $BUILD && cd $BUILD
 CFLAGS="-O0 -g -DUSE_ATOMICS_GENERIC=1 " \
   ../httpd-2.2.21/configure  --prefix=`pwd`/inst --with-mpm=worker
 make -j && make install
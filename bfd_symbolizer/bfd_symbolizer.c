@@ -692,6 +692,28 @@ static int process_demangle(char* symbol, int symbol_size, bfds_opts_e opts) {
 }
 
 
+// Resolves an address in an already found module. ctx.mtx must be held.
+static int process_addr(lib_t* lib, void* addr, bfds_opts_e opts, char* symbol, int symbol_size, char* filename, int filename_size, int* source_line, int* symbol_offset) {
+  if (opts & bfds_opt_data) {
+    if (process_data(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
+      ERR("symbol for data address %p is not found\n", addr);
+      return 1;
+    }
+  } else {
+    if (process_code(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
+      ERR("symbol for code address %p is not found\n", addr);
+      return 1;
+    }
+  }
+
+  if (process_demangle(symbol, symbol_size, opts)) {
+    ERR("demangling for address %p is failed\n", addr);
+    return 1;
+  }
+  return 0;
+}
+
+
 int   bfds_symbolize    (void*                  addr,
                          bfds_opts_e            opts,
                          char*                  symbol,
@@ -714,22 +736,7 @@ int   bfds_symbolize    (void*                  addr,
     return 1;
   }
 
-  if (opts & bfds_opt_data) {
-    if (process_data(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
-      ERR("symbol for data address %p is not found\n", addr);
-      pthread_mutex_unlock(&ctx.mtx);
-      return 1;
-    }
-  } else {
-    if (process_code(lib, addr, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
-      ERR("symbol for code address %p is not found\n", addr);
-      pthread_mutex_unlock(&ctx.mtx);
-      return 1;
-    }
-  }
-
-  if (process_demangle(symbol, symbol_size, opts)) {
-    ERR("demangling for address %p is failed\n", addr);
+  if (process_addr(lib, addr, opts, symbol, symbol_size, filename, filename_size, source_line, symbol_offset)) {
     pthread_mutex_unlock(&ctx.mtx);
     return 1;
   }
@@ -744,6 +751,112 @@ int   bfds_symbolize    (void*                  addr,
 }
 
 
+static int entry_sort_pred(void const* p1, void const* p2) {
+  void*                 a1;
+  void*                 a2;
+
+  a1 = (*(bfds_entry_t* const*)p1)->addr;
+  a2 = (*(bfds_entry_t* const*)p2)->addr;
+  if (a1 < a2)
+    return -1;
+  return a1 > a2;
+}
+
+
+static void entry_copy(bfds_entry_t* dst, bfds_entry_t const* src) {
+  strcopy(dst->symbol, dst->symbol_size, src->symbol_size ? src->symbol : "");
+  strcopy(dst->module, dst->module_size, src->module_size ? src->module : "");
+  strcopy(dst->filename, dst->filename_size, src->filename_size ? src->filename : "");
+  dst->source_line = src->source_line;
+  dst->symbol_offset = src->symbol_offset;
+  dst->result = src->result;
+}
+
+
+int   bfds_symbolize_batch
+                        (bfds_entry_t*          entries,
+                         int                    count,
+                         bfds_opts_e            opts) {
+  bfds_entry_t**        sorted;
+  bfds_entry_t*         e;
+  bfds_entry_t*         prev;
+  lib_t*                lib;
+  int                   libs_updated;
+  int                   nfailed;
+  int                   i;
+
+  if (count <= 0)
+    return 0;
+  sorted = (bfds_entry_t**)malloc(count * sizeof(*sorted));
+  if (sorted == 0)
+    return count;
+  for (i = 0; i != count; i += 1)
+    sorted[i] = &entries[i];
+  qsort(sorted, count, sizeof(*sorted), entry_sort_pred);
+
+  pthread_mutex_lock(&ctx.mtx);
+
+  DBG("batch request for %d addresses\n", count);
+
+  libs_updated = 0;
+  if (opts & bfds_opt_update_libs) {
+    update_libs();
+    libs_updated = 1;
+  }
+
+  nfailed = 0;
+  lib = 0;
+  prev = 0;
+  for (i = 0; i != count; i += 1) {
+    e = sorted[i];
+    e->result = 1;
+    e->source_line = 0;
+    e->symbol_offset = 0;
+    strcopy(e->symbol, e->symbol_size, "");
+    strcopy(e->module, e->module_size, "");
+    strcopy(e->filename, e->filename_size, "");
+
+    // The same address as the previous one: copy the previous result,
+    // if the previous buffers were big enough to hold it.
+    if (prev != 0 && prev->addr == e->addr
+        && prev->symbol_size >= e->symbol_size
+        && prev->module_size >= e->module_size
+        && prev->filename_size >= e->filename_size) {
+      entry_copy(e, prev);
+      nfailed += e->result != 0;
+      continue;
+    }
+
+    if (lib == 0 || e->addr < lib->begin || e->addr >= lib->end) {
+      lib = find_lib(e->addr);
+      if (lib == 0 && libs_updated == 0) {
+        update_libs();
+        libs_updated = 1;
+        lib = find_lib(e->addr);
+      }
+      if (lib != 0 && lib->bfd == 0 && init_lib(lib))
+        lib = 0;
+    }
+
+    if (lib == 0) {
+      ERR("module for address %p is not found\n", e->addr);
+    } else {
+      strcopy(e->module, e->module_size, lib->name);
+      e->result = process_addr(lib, e->addr, opts,
+                               e->symbol, e->symbol_size,
+                               e->filename, e->filename_size,
+                               &e->source_line, &e->symbol_offset);
+    }
+    nfailed += e->result != 0;
+    prev = e;
+  }
+
+  pthread_mutex_unlock(&ctx.mtx);
+  free(sorted);
+  return nfailed;
+}
+
+
 #ifdef BFDS_UNWIND
 int   bfds_unwind       (void**                 stack,
                          int                    count,
@@ -67,6 +67,40 @@ int   bfds_symbolize    (void*                  addr,
                          int*                   symbol_offset);
 
 
+/** An element of a bfds_symbolize_batch() request.
+ *  The output buffers are optional, as for bfds_symbolize().
+ */
+typedef struct bfds_entry_t {
+  void*                 addr;           // [in]  An address to resolve.
+  char*                 symbol;         // [out] Symbol name.
+  int                   symbol_size;    // [in]  Size of the symbol buffer.
+  char*                 module;         // [out] Module name.
+  int                   module_size;    // [in]  Size of the module buffer.
+  char*                 filename;       // [out] Source filename.
+  int                   filename_size;  // [in]  Size of the filename buffer.
+  int                   source_line;    // [out] Source line.
+  int                   symbol_offset;  // [out] Offset from the symbol.
+  int                   result;         // [out] 0 - success.
+} bfds_entry_t;
+
+
+/** Resolves a number of addresses at once, same as calling bfds_symbolize()
+ *  for every entry, but faster. The addresses are processed in sorted
+ *  order, so the addresses of a module are resolved together, the map of
+ *  dynamic libraries is updated at most once and duplicate addresses are
+ *  resolved once.
+ *
+ *  @param entries       [in/out] The requests.
+ *  @param count         [in]     Number of entries.
+ *  @param opts          [in]     Various options, applied to all entries.
+ *  @return                       Number of entries which failed to resolve.
+ */
+int   bfds_symbolize_batch
+                        (bfds_entry_t*          entries,
+                         int                    count,
+                         bfds_opts_e            opts);
+
+
 /** Helpers for dynamic linking.
  */
 #define BFDS_SYMBOLIZE_FUNC "bfds_symbolize"
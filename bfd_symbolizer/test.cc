@@ -74,6 +74,45 @@ int foobar(void** stack, int size) {
   return barbaz(stack, size);
 }
 
+void test_batch(char const* exename, char const* staname) {
+  printf("%-40s...", "batch");
+  void* addrs [] = {(void*)&foo2, dyn1(0, 0), (void*)&foo1, (void*)&foo2, malloc(0)};
+  char const* exp_symbol [] = {"foo2", "dyn1", "foo1", "foo2", ""};
+  char const* exp_module [] = {exename, staname, exename, exename, ""};
+  int exp_line [] = {foo2_line, dyn1_line, foo1_line, foo2_line, 0};
+  int const cnt = sizeof(addrs)/sizeof(*addrs);
+  bfds_entry_t entries [cnt];
+  char symbols [cnt][1024];
+  char modules [cnt][1024];
+  char files [cnt][1024];
+  for (int i = 0; i < cnt; i++) {
+    memset(&entries[i], 0, sizeof(entries[i]));
+    entries[i].addr = addrs[i];
+    entries[i].symbol = symbols[i];
+    entries[i].symbol_size = sizeof(symbols[i]);
+    entries[i].module = modules[i];
+    entries[i].module_size = sizeof(modules[i]);
+    entries[i].filename = files[i];
+    entries[i].filename_size = sizeof(files[i]);
+  }
+  int nfailed = bfds_symbolize_batch(entries, cnt, bfds_opt_demangle);
+  if (nfailed != 1 || entries[cnt - 1].result == 0) {
+    printf("unexpected failures: %d\n", nfailed);
+    exit(1);
+  }
+  for (int i = 0; i < cnt - 1; i++) {
+    if (entries[i].result != 0
+        || strcmp(symbols[i], exp_symbol[i])
+        || strstr(modules[i], exp_module[i]) == 0
+        || entries[i].source_line != exp_line[i]) {
+      printf("entry %d: '%s' '%s' %d\n", i, symbols[i], modules[i],
+             entries[i].source_line);
+      exit(1);
+    }
+  }
+  printf("OK\n");
+}
+
 void test_stack_unwind() {
   printf("%-40s...", "unwind");
   void* stack [64];
@@ -214,6 +253,7 @@ int main() {
     exit(1);
   }
  
+  test_batch(exename, staname);
   test_stack_unwind();
  
   printf("OK\n");
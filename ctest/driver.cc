@@ -14,6 +14,7 @@
 #include <assert.h>
 
 #include <dlfcn.h>
+#include <time.h>
 
 #include <iostream>
 #include <iomanip>
@@ -44,7 +45,25 @@ struct test_desc_t {
 };
 
 
+/* Per-test numbers gathered with --timing: the density of the
+ * instrumentation (mops and superblocks reported per run vs mops
+ * annotated in test_source.cc) and the cost of a run compared to
+ * the same test built without instrumentation (test_source_base.so).
+ */
+struct test_stat_t {
+  std::string           name;
+  size_t                annotated_mops;
+  double                rt_mops;
+  double                rt_sblocks;
+  double                ns;
+  double                base_ns;
+};
+
+
 static std::vector<mop_desc_t> rt_mops;
+static bool             is_timing;
+static size_t           rt_mop_count;
+static size_t           rt_sblock_count;
 typedef std::vector<test_desc_t> test_list_t;
 
 
@@ -54,10 +73,31 @@ int                     init                () {return 0;}
 
 
 void                    frontend_mop_cb     (mop_desc_t const& mop) {
+  if (is_timing) {
+    rt_mop_count += 1;
+    rt_sblock_count += mop.is_sblock != 0;
+    return;
+  }
   rt_mops.push_back(mop);
 }
 
 
+static double           now_ns              () {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static double           time_test           (void(*func)(),
+                                             int iterations) {
+  double start = now_ns();
+  for (int i = 0; i != iterations; i += 1)
+    func();
+  return (now_ns() - start) / iterations;
+}
+
+
 static std::ostream&    operator <<         (std::ostream&      s,
                                              test_mop_desc_t const& mop) {
   s << (mop.is_store ? "ST" : "LD");
@@ -157,15 +197,39 @@ void                    parse_source        (char const*        file_name,
 }
 
 
-int main() {
+int main(int argc, char** argv) {
+  int iterations = 0;
+  char const* filter = 0;
+  for (int i = 1; i != argc; i += 1) {
+    if (strcmp(argv[i], "--timing") == 0)
+      iterations = 100000;
+    else if (strncmp(argv[i], "--timing=", 9) == 0)
+      iterations = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "--filter=", 9) == 0)
+      filter = argv[i] + 9;
+    else
+      printf("usage: %s [--timing[=iterations]] [--filter=substr]\n",
+             argv[0]), exit(1);
+  }
+
   frontend_init();
 
+  /* The same tests compiled without instrumentation, if built. */
+  void* base = 0;
+  if (iterations != 0)
+    base = dlopen("./test_source_base.so", RTLD_NOW | RTLD_LOCAL);
+  std::vector<test_stat_t> stats;
+
   test_list_t test_list;
   parse_source("test_source.cc", test_list);
   
   int failed_count = 0;
+  int run_count = 0;
   for (size_t test_idx = 0; test_idx != test_list.size(); test_idx += 1) {
     test_desc_t& test = test_list[test_idx];
+    if (filter != 0 && strstr(test.name.c_str(), filter) == 0)
+      continue;
+    run_count += 1;
     int fill_len = 40 - test.name.length();
     if (fill_len < 0)
       fill_len = 0;
@@ -231,11 +295,46 @@ int main() {
     else 
       failed_count += 1;
     std::cout << std::endl;
+
+    if (iterations == 0)
+      continue;
+    test_stat_t stat = {test.name, test.mops.size()};
+    is_timing = true;
+    rt_mop_count = 0;
+    rt_sblock_count = 0;
+    frontend_test_begin();
+    stat.ns = time_test(func, iterations);
+    frontend_test_end(&error_desc);
+    is_timing = false;
+    stat.rt_mops = (double)rt_mop_count / iterations;
+    stat.rt_sblocks = (double)rt_sblock_count / iterations;
+    void(*base_func)() = base ? (void(*)())dlsym(base, mangled) : 0;
+    stat.base_ns = base_func ? time_test(base_func, iterations) : 0;
+    stats.push_back(stat);
   }
  
-  std::cout << "failed/total " << failed_count << "/" << test_list.size() << std::endl;
+  std::cout << "failed/total " << failed_count << "/" << run_count << std::endl;
+
+  if (iterations != 0) {
+    std::cout << std::endl << std::left << std::setw(40) << "test"
+        << std::right << std::setw(6) << "ann" << std::setw(8) << "mops"
+        << std::setw(8) << "sblk" << std::setw(10) << "ns"
+        << std::setw(10) << "base ns" << std::setw(8) << "x" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i != stats.size(); i += 1) {
+      test_stat_t const& stat = stats[i];
+      std::cout << std::left << std::setw(40) << stat.name
+          << std::right << std::setw(6) << stat.annotated_mops
+          << std::setw(8) << stat.rt_mops << std::setw(8) << stat.rt_sblocks
+          << std::setw(10) << stat.ns;
+      if (stat.base_ns != 0)
+        std::cout << std::setw(10) << stat.base_ns
+            << std::setw(8) << stat.ns / stat.base_ns;
+      std::cout << std::endl;
+    }
+  }
 
-  return 0;
+  return failed_count != 0;
 }
 
 
@@ -0,0 +1,107 @@
+/* Compiler instrumentation test suite (CITS)
+ * Copyright (c) 2011, Google Inc. All rights reserved.
+ *
+ * CITS is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3, or (at your option) any later
+ * version. See http://www.gnu.org/licenses/
+ */
+
+/* The frontend for the tests instrumented by the LLVM pass
+ * (llvm/opt/ThreadSanitizer). It provides the part of the tsan_rtl ABI
+ * the pass emits calls to: the mops of a trace are put into TLEB and
+ * bb_flush_current()/bb_flush_mop() hand them over to us.
+ */
+
+#include "frontend.h"
+#include "../tsan/thread_sanitizer.h"
+#include "../tsan/ts_trace_info.h"
+#include "../bfd_symbolizer/bfd_symbolizer.h"
+
+
+static size_t const     kTLEBSize           = 4096;  // as in tsan_rtl.cc
+
+
+extern "C" {
+__thread CallStackPod   __tsan_shadow_stack;
+__thread int            __tsan_thread_ignore;
+__thread int            LTID;
+__thread uintptr_t      TLEB [kTLEBSize];
+}
+
+
+void                    frontend_init       () {
+}
+
+
+void                    frontend_test_begin () {
+  __tsan_shadow_stack.end_ = __tsan_shadow_stack.pcs_;
+}
+
+
+bool                    frontend_test_end   (std::string* error_desc) {
+  if (__tsan_shadow_stack.end_ != __tsan_shadow_stack.pcs_) {
+    *error_desc = "CORRUPTED SHADOW STACK";
+    return false;
+  }
+  return true;
+}
+
+
+static void             report_mop          (MopInfo* mop_info,
+                                             uintptr_t addr,
+                                             bool is_sblock) {
+  mop_desc_t mop = {};
+  mop.addr = (void*)addr;
+  mop.pc = (void*)mop_info->pc();
+  mop.is_sblock = is_sblock;
+  mop.is_store = mop_info->is_write();
+  mop.msize = mop_info->size();
+  bfds_symbolize(mop.pc, bfds_opt_none, 0, 0, 0, 0, 0, 0,
+                 &mop.source_line, 0);
+  frontend_mop_cb(mop);
+}
+
+
+extern "C" void         bb_flush_current    (TraceInfoPOD* trace) {
+  bool is_sblock = true;
+  for (size_t i = 0; i != trace->n_mops_; i += 1) {
+    if (TLEB[i] == 0)
+      continue;
+    report_mop(&trace->mops_[i], TLEB[i], is_sblock);
+    is_sblock = false;
+    TLEB[i] = 0;
+  }
+}
+
+
+extern "C" void         bb_flush_mop        (TraceInfoPOD* trace,
+                                             uintptr_t addr) {
+  if (addr)
+    report_mop(&trace->mops_[0], addr, true);
+}
+
+
+extern "C" void         bb_flush_sampled    (TraceInfoPOD* trace) {
+  bb_flush_current(trace);
+}
+
+
+extern "C" void         bb_flush_mop_sampled(TraceInfoPOD* trace,
+                                             uintptr_t addr) {
+  bb_flush_mop(trace, addr);
+}
+
+
+extern "C" void         flush_tleb          () {
+}
+
+
+extern "C" void         rtn_call            (void* addr) {
+  *__tsan_shadow_stack.end_++ = (uintptr_t)addr;
+}
+
+
+extern "C" void         rtn_exit            () {
+  __tsan_shadow_stack.end_ -= 1;
+}
@@ -223,6 +223,32 @@ void DYNAMIC_ANNOTATIONS_NAME(AnnotateFlushState)(
     const char *file, int line)
 {DYNAMIC_ANNOTATIONS_IMPL}
 
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateTargetMemoryRange)(
+    const char *file, int line, const volatile void *address, long size)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateUntargetMemoryRange)(
+    const char *file, int line, const volatile void *address, long size)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeMany)(
+    const char *file, int line, const volatile void *const *objs, long n)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterMany)(
+    const char *file, int line, const volatile void *const *objs, long n)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeArray)(
+    const char *file, int line, const volatile void *array, long n,
+    long elem_size)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterArray)(
+    const char *file, int line, const volatile void *array, long n,
+    long elem_size)
+{DYNAMIC_ANNOTATIONS_IMPL}
+
 #endif  /* DYNAMIC_ANNOTATIONS_ENABLED == 1
     && DYNAMIC_ANNOTATIONS_EXTERNAL_IMPL == 0 */
 
@@ -267,3 +293,16 @@ int RunningOnValgrind(void) {
 
 #endif /* DYNAMIC_ANNOTATIONS_PROVIDE_RUNNING_ON_VALGRIND == 1
     && DYNAMIC_ANNOTATIONS_EXTERNAL_IMPL == 0 */
+
+#if DYNAMIC_ANNOTATIONS_EXTERNAL_IMPL == 0
+/* See the comments in dynamic_annotations.h */
+int DYNAMIC_ANNOTATIONS_NAME(DynamicAnnotationsEnabled) = -1;
+
+#if DYNAMIC_ANNOTATIONS_PROVIDE_RUNNING_ON_VALGRIND == 1 && defined(__GNUC__)
+/* The tools intercept RunningOnValgrind() before the constructors run. */
+static void __attribute__((constructor)) InitDynamicAnnotationsEnabled(void) {
+  if (DYNAMIC_ANNOTATIONS_NAME(DynamicAnnotationsEnabled) == -1)
+    DYNAMIC_ANNOTATIONS_NAME(DynamicAnnotationsEnabled) = RunningOnValgrind();
+}
+#endif
+#endif  /* DYNAMIC_ANNOTATIONS_EXTERNAL_IMPL == 0 */
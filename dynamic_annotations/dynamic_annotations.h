@@ -45,7 +45,14 @@
       Macros are defined empty.
    - ThreadSanitizer, Helgrind, DRD (DYNAMIC_ANNOTATIONS_ENABLED is 1).
       Macros are defined as calls to non-inlinable empty functions
-      that are intercepted by Valgrind. */
+      that are intercepted by Valgrind.
+   - Same, but cheap when no tool is attached (DYNAMIC_ANNOTATIONS_ENABLED
+      and DYNAMIC_ANNOTATIONS_GUARDED are 1). Each macro first checks
+      DynamicAnnotationsEnabled, which is set at startup from
+      RunningOnValgrind() (the tools intercept it), and skips the call if
+      it is 0. Until it is set the calls are made.
+      The macros are then conditional expressions of type void, so use
+      them as statements only. */
 
 #ifndef __DYNAMIC_ANNOTATIONS_H__
 #define __DYNAMIC_ANNOTATIONS_H__
@@ -81,6 +88,25 @@
 # define DYNAMIC_ANNOTATIONS_ENABLED 0
 #endif
 
+#ifndef DYNAMIC_ANNOTATIONS_GUARDED
+# define DYNAMIC_ANNOTATIONS_GUARDED 0
+#endif
+
+/* DYNAMIC_ANNOTATIONS_CALL(name) is what the macros below call. */
+#if DYNAMIC_ANNOTATIONS_GUARDED != 0
+# ifdef __GNUC__
+#  define DYNAMIC_ANNOTATIONS_UNLIKELY(x) __builtin_expect(!!(x), 0)
+# else
+#  define DYNAMIC_ANNOTATIONS_UNLIKELY(x) (x)
+# endif
+# define DYNAMIC_ANNOTATIONS_CALL(name) \
+  !DYNAMIC_ANNOTATIONS_UNLIKELY( \
+      DYNAMIC_ANNOTATIONS_NAME(DynamicAnnotationsEnabled)) ? (void)0 : \
+  DYNAMIC_ANNOTATIONS_NAME(name)
+#else
+# define DYNAMIC_ANNOTATIONS_CALL(name) DYNAMIC_ANNOTATIONS_NAME(name)
+#endif
+
 #if DYNAMIC_ANNOTATIONS_ENABLED != 0
 
   /* -------------------------------------------------------------
@@ -124,37 +150,59 @@
   /* Report that wait on the condition variable at address "cv" has succeeded
      and the lock at address "lock" is held. */
   #define ANNOTATE_CONDVAR_LOCK_WAIT(cv, lock) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateCondVarWait)(__FILE__, __LINE__, cv, lock)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateCondVarWait)(__FILE__, __LINE__, cv, lock)
 
   /* Report that wait on the condition variable at "cv" has succeeded.  Variant
      w/o lock. */
   #define ANNOTATE_CONDVAR_WAIT(cv) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateCondVarWait)(__FILE__, __LINE__, cv, NULL)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateCondVarWait)(__FILE__, __LINE__, cv, NULL)
 
   /* Report that we are about to signal on the condition variable at address
      "cv". */
   #define ANNOTATE_CONDVAR_SIGNAL(cv) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateCondVarSignal)(__FILE__, __LINE__, cv)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateCondVarSignal)(__FILE__, __LINE__, cv)
 
   /* Report that we are about to signal_all on the condition variable at address
      "cv". */
   #define ANNOTATE_CONDVAR_SIGNAL_ALL(cv) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateCondVarSignalAll)(__FILE__, __LINE__, cv)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateCondVarSignalAll)(__FILE__, __LINE__, cv)
 
   /* Annotations for user-defined synchronization mechanisms. */
   #define ANNOTATE_HAPPENS_BEFORE(obj) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBefore)(__FILE__, __LINE__, obj)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensBefore)(__FILE__, __LINE__, obj)
   #define ANNOTATE_HAPPENS_AFTER(obj) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfter)(__FILE__, __LINE__, obj)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensAfter)(__FILE__, __LINE__, obj)
+
+  /* The same as ANNOTATE_HAPPENS_BEFORE/AFTER on each of the n pointers
+     objs[0], ..., objs[n-1], but cheaper for the race detector: the whole
+     batch is one synchronization event. E.g. a thread pool can publish the
+     results of all its workers at once:
+
+     ANNOTATE_HAPPENS_AFTER_MANY(worker_done_flags, n_workers); */
+  #define ANNOTATE_HAPPENS_BEFORE_MANY(objs, n) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensBeforeMany)(__FILE__, __LINE__, \
+        (const volatile void *const *)(objs), n)
+  #define ANNOTATE_HAPPENS_AFTER_MANY(objs, n) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensAfterMany)(__FILE__, __LINE__, \
+        (const volatile void *const *)(objs), n)
+
+  /* The same as ANNOTATE_HAPPENS_BEFORE/AFTER on &array[0], ..., &array[n-1]
+     as one synchronization event. */
+  #define ANNOTATE_HAPPENS_BEFORE_ARRAY(array, n) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensBeforeArray)(__FILE__, __LINE__, \
+        array, n, sizeof(*(array)))
+  #define ANNOTATE_HAPPENS_AFTER_ARRAY(array, n) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateHappensAfterArray)(__FILE__, __LINE__, \
+        array, n, sizeof(*(array)))
 
   /* DEPRECATED. Don't use it. */
   #define ANNOTATE_PUBLISH_MEMORY_RANGE(pointer, size) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotatePublishMemoryRange)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotatePublishMemoryRange)(__FILE__, __LINE__, \
         pointer, size)
 
   /* DEPRECATED. Don't use it. */
   #define ANNOTATE_UNPUBLISH_MEMORY_RANGE(pointer, size) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateUnpublishMemoryRange)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateUnpublishMemoryRange)(__FILE__, __LINE__, \
         pointer, size)
 
   /* DEPRECATED. Don't use it. */
@@ -172,18 +220,18 @@
      happens-before detectors this is a no-op. For more details see
      http://code.google.com/p/data-race-test/wiki/PureHappensBeforeVsHybrid . */
   #define ANNOTATE_PURE_HAPPENS_BEFORE_MUTEX(mu) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateMutexIsUsedAsCondVar)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateMutexIsUsedAsCondVar)(__FILE__, __LINE__, \
         mu)
 
   /* Opposite to ANNOTATE_PURE_HAPPENS_BEFORE_MUTEX.
      Instruct the tool to NOT create h-b arcs between Unlock and Lock, even in
      pure happens-before mode. For a hybrid mode this is a no-op. */
   #define ANNOTATE_NOT_HAPPENS_BEFORE_MUTEX(mu) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateMutexIsNotPHB)(__FILE__, __LINE__, mu)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateMutexIsNotPHB)(__FILE__, __LINE__, mu)
 
   /* Deprecated. Use ANNOTATE_PURE_HAPPENS_BEFORE_MUTEX. */
   #define ANNOTATE_MUTEX_IS_USED_AS_CONDVAR(mu) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateMutexIsUsedAsCondVar)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateMutexIsUsedAsCondVar)(__FILE__, __LINE__, \
         mu)
 
   /* -------------------------------------------------------------
@@ -195,7 +243,7 @@
      is about to be reused, or when a the locking discipline for a variable
      changes. */
   #define ANNOTATE_NEW_MEMORY(address, size) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateNewMemory)(__FILE__, __LINE__, address, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateNewMemory)(__FILE__, __LINE__, address, \
         size)
 
   /* -------------------------------------------------------------
@@ -207,21 +255,21 @@
      should be used only for FIFO queues.  For non-FIFO queues use
      ANNOTATE_HAPPENS_BEFORE (for put) and ANNOTATE_HAPPENS_AFTER (for get). */
   #define ANNOTATE_PCQ_CREATE(pcq) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotatePCQCreate)(__FILE__, __LINE__, pcq)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotatePCQCreate)(__FILE__, __LINE__, pcq)
 
   /* Report that the queue at address "pcq" is about to be destroyed. */
   #define ANNOTATE_PCQ_DESTROY(pcq) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotatePCQDestroy)(__FILE__, __LINE__, pcq)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotatePCQDestroy)(__FILE__, __LINE__, pcq)
 
   /* Report that we are about to put an element into a FIFO queue at address
      "pcq". */
   #define ANNOTATE_PCQ_PUT(pcq) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotatePCQPut)(__FILE__, __LINE__, pcq)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotatePCQPut)(__FILE__, __LINE__, pcq)
 
   /* Report that we've just got an element from a FIFO queue at address
      "pcq". */
   #define ANNOTATE_PCQ_GET(pcq) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotatePCQGet)(__FILE__, __LINE__, pcq)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotatePCQGet)(__FILE__, __LINE__, pcq)
 
   /* -------------------------------------------------------------
      Annotations that suppress errors.  It is usually better to express the
@@ -233,13 +281,13 @@
      point where "pointer" has been allocated, preferably close to the point
      where the race happens.  See also ANNOTATE_BENIGN_RACE_STATIC. */
   #define ANNOTATE_BENIGN_RACE(pointer, description) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBenignRaceSized)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBenignRaceSized)(__FILE__, __LINE__, \
         pointer, sizeof(*(pointer)), description)
 
   /* Same as ANNOTATE_BENIGN_RACE(address, description), but applies to
      the memory range [address, address+size). */
   #define ANNOTATE_BENIGN_RACE_SIZED(address, size, description) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBenignRaceSized)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBenignRaceSized)(__FILE__, __LINE__, \
         address, size, description)
 
   /* Request the analysis tool to ignore all reads in the current thread
@@ -248,19 +296,19 @@
      other reads and all writes.
      See also ANNOTATE_UNPROTECTED_READ. */
   #define ANNOTATE_IGNORE_READS_BEGIN() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreReadsBegin)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreReadsBegin)(__FILE__, __LINE__)
 
   /* Stop ignoring reads. */
   #define ANNOTATE_IGNORE_READS_END() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreReadsEnd)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreReadsEnd)(__FILE__, __LINE__)
 
   /* Similar to ANNOTATE_IGNORE_READS_BEGIN, but ignore writes. */
   #define ANNOTATE_IGNORE_WRITES_BEGIN() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreWritesBegin)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreWritesBegin)(__FILE__, __LINE__)
 
   /* Stop ignoring writes. */
   #define ANNOTATE_IGNORE_WRITES_END() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreWritesEnd)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreWritesEnd)(__FILE__, __LINE__)
 
   /* Start ignoring all memory accesses (reads and writes). */
   #define ANNOTATE_IGNORE_READS_AND_WRITES_BEGIN() \
@@ -279,18 +327,18 @@
   /* Similar to ANNOTATE_IGNORE_READS_BEGIN, but ignore synchronization events:
      RWLOCK* and CONDVAR*. */
   #define ANNOTATE_IGNORE_SYNC_BEGIN() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreSyncBegin)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreSyncBegin)(__FILE__, __LINE__)
 
   /* Stop ignoring sync events. */
   #define ANNOTATE_IGNORE_SYNC_END() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateIgnoreSyncEnd)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateIgnoreSyncEnd)(__FILE__, __LINE__)
 
 
   /* Enable (enable!=0) or disable (enable==0) race detection for all threads.
      This annotation could be useful if you want to skip expensive race analysis
      during some period of program execution, e.g. during initialization. */
   #define ANNOTATE_ENABLE_RACE_DETECTION(enable) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateEnableRaceDetection)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateEnableRaceDetection)(__FILE__, __LINE__, \
         enable)
 
   /* -------------------------------------------------------------
@@ -298,11 +346,11 @@
 
   /* Request to trace every access to "address". */
   #define ANNOTATE_TRACE_MEMORY(address) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateTraceMemory)(__FILE__, __LINE__, address)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateTraceMemory)(__FILE__, __LINE__, address)
 
   /* Report the current thread name to a race detector. */
   #define ANNOTATE_THREAD_NAME(name) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateThreadName)(__FILE__, __LINE__, name)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateThreadName)(__FILE__, __LINE__, name)
 
   /* -------------------------------------------------------------
      Annotations useful when implementing locks.  They are not
@@ -311,21 +359,21 @@
 
   /* Report that a lock has been created at address "lock". */
   #define ANNOTATE_RWLOCK_CREATE(lock) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateRWLockCreate)(__FILE__, __LINE__, lock)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateRWLockCreate)(__FILE__, __LINE__, lock)
 
   /* Report that the lock at address "lock" is about to be destroyed. */
   #define ANNOTATE_RWLOCK_DESTROY(lock) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateRWLockDestroy)(__FILE__, __LINE__, lock)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateRWLockDestroy)(__FILE__, __LINE__, lock)
 
   /* Report that the lock at address "lock" has been acquired.
      is_w=1 for writer lock, is_w=0 for reader lock. */
   #define ANNOTATE_RWLOCK_ACQUIRED(lock, is_w) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateRWLockAcquired)(__FILE__, __LINE__, lock, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateRWLockAcquired)(__FILE__, __LINE__, lock, \
         is_w)
 
   /* Report that the lock at address "lock" is about to be released. */
   #define ANNOTATE_RWLOCK_RELEASED(lock, is_w) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateRWLockReleased)(__FILE__, __LINE__, lock, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateRWLockReleased)(__FILE__, __LINE__, lock, \
         is_w)
 
   /* -------------------------------------------------------------
@@ -337,22 +385,22 @@
    If 'reinitialization_allowed' is true, initialization is allowed to happen
    multiple times w/o calling barrier_destroy() */
   #define ANNOTATE_BARRIER_INIT(barrier, count, reinitialization_allowed) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBarrierInit)(__FILE__, __LINE__, barrier, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBarrierInit)(__FILE__, __LINE__, barrier, \
         count, reinitialization_allowed)
 
   /* Report that we are about to enter barrier_wait("barrier"). */
   #define ANNOTATE_BARRIER_WAIT_BEFORE(barrier) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBarrierWaitBefore)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBarrierWaitBefore)(__FILE__, __LINE__, \
         barrier)
 
   /* Report that we just exited barrier_wait("barrier"). */
   #define ANNOTATE_BARRIER_WAIT_AFTER(barrier) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBarrierWaitAfter)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBarrierWaitAfter)(__FILE__, __LINE__, \
         barrier)
 
   /* Report that the "barrier" has been destroyed. */
   #define ANNOTATE_BARRIER_DESTROY(barrier) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateBarrierDestroy)(__FILE__, __LINE__, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateBarrierDestroy)(__FILE__, __LINE__, \
         barrier)
 
   /* -------------------------------------------------------------
@@ -361,20 +409,30 @@
   /* Report that we expect a race on the variable at "address".
      Use only in unit tests for a race detector. */
   #define ANNOTATE_EXPECT_RACE(address, description) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateExpectRace)(__FILE__, __LINE__, address, \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateExpectRace)(__FILE__, __LINE__, address, \
         description)
 
   #define ANNOTATE_FLUSH_EXPECTED_RACES() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateFlushExpectedRaces)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateFlushExpectedRaces)(__FILE__, __LINE__)
 
   /* A no-op. Insert where you like to test the interceptors. */
   #define ANNOTATE_NO_OP(arg) \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateNoOp)(__FILE__, __LINE__, arg)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateNoOp)(__FILE__, __LINE__, arg)
 
   /* Force the race detector to flush its state. The actual effect depends on
    * the implementation of the detector. */
   #define ANNOTATE_FLUSH_STATE() \
-    DYNAMIC_ANNOTATIONS_NAME(AnnotateFlushState)(__FILE__, __LINE__)
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateFlushState)(__FILE__, __LINE__)
+
+  /* Restrict the race detection to the given memory ranges: once any range
+   * is targeted, the accesses to the untargeted memory are not tracked.
+   * May be called at any time; untargeting the memory forgets its state. */
+  #define ANNOTATE_TARGET_MEMORY_RANGE(address, size) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateTargetMemoryRange)(__FILE__, __LINE__, \
+        address, size)
+  #define ANNOTATE_UNTARGET_MEMORY_RANGE(address, size) \
+    DYNAMIC_ANNOTATIONS_CALL(AnnotateUntargetMemoryRange)(__FILE__, __LINE__, \
+        address, size)
 
 
 #else  /* DYNAMIC_ANNOTATIONS_ENABLED == 0 */
@@ -393,6 +451,10 @@
   #define ANNOTATE_CONDVAR_SIGNAL_ALL(cv) /* empty */
   #define ANNOTATE_HAPPENS_BEFORE(obj) /* empty */
   #define ANNOTATE_HAPPENS_AFTER(obj) /* empty */
+  #define ANNOTATE_HAPPENS_BEFORE_MANY(objs, n) /* empty */
+  #define ANNOTATE_HAPPENS_AFTER_MANY(objs, n) /* empty */
+  #define ANNOTATE_HAPPENS_BEFORE_ARRAY(array, n) /* empty */
+  #define ANNOTATE_HAPPENS_AFTER_ARRAY(array, n) /* empty */
   #define ANNOTATE_PUBLISH_MEMORY_RANGE(address, size) /* empty */
   #define ANNOTATE_UNPUBLISH_MEMORY_RANGE(address, size)  /* empty */
   #define ANNOTATE_SWAP_MEMORY_RANGE(address, size)  /* empty */
@@ -420,6 +482,8 @@
   #define ANNOTATE_ENABLE_RACE_DETECTION(enable) /* empty */
   #define ANNOTATE_NO_OP(arg) /* empty */
   #define ANNOTATE_FLUSH_STATE() /* empty */
+  #define ANNOTATE_TARGET_MEMORY_RANGE(address, size) /* empty */
+  #define ANNOTATE_UNTARGET_MEMORY_RANGE(address, size) /* empty */
 
 #endif  /* DYNAMIC_ANNOTATIONS_ENABLED */
 
@@ -468,6 +532,22 @@ void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBefore)(
 void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfter)(
     const char *file, int line,
     const volatile void *obj) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeMany)(
+    const char *file, int line,
+    const volatile void *const *objs,
+    long n) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterMany)(
+    const char *file, int line,
+    const volatile void *const *objs,
+    long n) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeArray)(
+    const char *file, int line,
+    const volatile void *array, long n,
+    long elem_size) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterArray)(
+    const char *file, int line,
+    const volatile void *array, long n,
+    long elem_size) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
 void DYNAMIC_ANNOTATIONS_NAME(AnnotatePublishMemoryRange)(
     const char *file, int line,
     const volatile void *address, long size) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
@@ -531,6 +611,16 @@ void DYNAMIC_ANNOTATIONS_NAME(AnnotateNoOp)(
     const volatile void *arg) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
 void DYNAMIC_ANNOTATIONS_NAME(AnnotateFlushState)(
     const char *file, int line) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateTargetMemoryRange)(
+    const char *file, int line,
+    const volatile void *address, long size) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateUntargetMemoryRange)(
+    const char *file, int line,
+    const volatile void *address, long size) DYNAMIC_ANNOTATIONS_ATTRIBUTE_WEAK;
+
+/* Non-zero if the annotations should be reported to the tool, see
+   DYNAMIC_ANNOTATIONS_GUARDED. -1 until it is known. */
+extern int DYNAMIC_ANNOTATIONS_NAME(DynamicAnnotationsEnabled);
 
 #if DYNAMIC_ANNOTATIONS_PROVIDE_RUNNING_ON_VALGRIND == 1
 /* Return non-zero value if running under valgrind.
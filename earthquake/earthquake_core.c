@@ -54,8 +54,22 @@ struct hist_event_t {
 
 
 #define HIST_SIZE 4
-static __thread struct hist_event_t hist [HIST_SIZE];
-static __thread int hist_pos;
+
+// Every 'SERIES_SHAKE_PERIOD'-th event of a series of events with the same
+// ctx (a spin loop on an atomic, a lock taken again and again)
+// gets the highest strength.
+#define SERIES_SHAKE_PERIOD 16
+
+// All the scheduler state is per-thread, so the shakes do not make
+// the threads contend on anything but the program's own objects.
+struct thread_state_t {
+  unsigned              rand_state;
+  unsigned              hist_pos;
+  unsigned              series;     // events in a row with the same ctx
+  struct hist_event_t   hist [HIST_SIZE];
+};
+
+static __thread struct thread_state_t thr;
 
 
 static unsigned rdtsc()
@@ -74,12 +88,14 @@ static void processor_yield()
 
 
 unsigned eq_rand() {
-  static __thread unsigned state = 0;
+  unsigned state = thr.rand_state;
   if (state == 0) {
-    state = rdtsc();
+    // Threads started together read close rdtsc values,
+    // mix in the address of the thread's state.
+    state = rdtsc() ^ (unsigned)((size_t)&thr * 2654435761u);
   }
   unsigned rnd = state * 1103515245 + 12345;
-  state = rnd;
+  thr.rand_state = rnd;
   rnd = rnd >> 16;
   return rnd;
 }
@@ -181,13 +197,16 @@ static int is_mutex_lock(enum shake_event_e const ev) {
 
 static enum shake_strength_e calculate_strength(enum shake_event_e const ev,
                                                 void* const ctx) {
-  struct hist_event_t const* prev = &hist[(hist_pos - 1) % HIST_SIZE];
+  struct hist_event_t const* prev = &thr.hist[(thr.hist_pos - 1) % HIST_SIZE];
+  int const is_series_peak = prev->ctx == ctx
+      && (thr.series % SERIES_SHAKE_PERIOD) == SERIES_SHAKE_PERIOD - 1;
 
   if (is_atomic(ev)) {
-    if (prev->ctx == ctx)
+    if (is_series_peak)
       // There are series of atomic operations,
-      // so do more shakes to stress it.
-      return strength_above_normal; //!!! strength_highest;
+      // so do more shakes to stress it
+      // (but not on each of them, that would stall spin loops).
+      return strength_highest;
     else
       return strength_above_normal;
 
@@ -205,6 +224,8 @@ static enum shake_strength_e calculate_strength(enum shake_event_e const ev,
     if (prev->ev == shake_cond_wait || prev->ev == shake_cond_timedwait)
       // We've just done shake in cond wait
       return strength_none;
+    else if (is_series_peak)
+      return strength_highest;
     else if (prev->ctx == ctx)
       // Series of locks on the same mutex,
       // that's suspicious.
@@ -228,10 +249,15 @@ void eq_sched_shake_impl(enum shake_event_e const ev,
   enum shake_strength_e strength = calculate_strength(ev, ctx);
   shake_delay(strength);
 
-  struct hist_event_t* hev = &hist[hist_pos % HIST_SIZE];
+  struct hist_event_t* prev = &thr.hist[(thr.hist_pos - 1) % HIST_SIZE];
+  if (prev->ctx == ctx)
+    thr.series += 1;
+  else
+    thr.series = 0;
+  struct hist_event_t* hev = &thr.hist[thr.hist_pos % HIST_SIZE];
   hev->ev = ev;
   hev->ctx = ctx;
-  hist_pos += 1;
+  thr.hist_pos += 1;
 }
 
 
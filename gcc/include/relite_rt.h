@@ -31,6 +31,8 @@ extern "C" {
 extern __thread char**  __tsan_shadow_stack;
 extern __thread int     __tsan_thread_ignore;
 extern          void    __tsan_handle_mop (void* addr, unsigned flags);
+extern __thread unsigned long __tsan_mop_buffer [];
+extern          void    __tsan_handle_mop_batch (unsigned n);
 extern          void*   __builtin_return_address (unsigned int level);
 
 #ifdef __cplusplus
@@ -127,6 +127,7 @@ int                     plugin_init         (struct plugin_name_args* info,
 
   int do_pause = 0;
   g_ctx.opt_sblock_size  = 5;
+  g_ctx.opt_batch        = 16;
   for (int i = 0; i != info->argc; i += 1) {
     if (strcmp(info->argv[i].key, "pause") == 0)
       do_pause = 1;
@@ -137,6 +138,10 @@ int                     plugin_init         (struct plugin_name_args* info,
     else if (strcmp(info->argv[i].key, "sblock-size") == 0
         && atoi(info->argv[i].value) > 0)
       g_ctx.opt_sblock_size = atoi(info->argv[i].value);
+    else if (strcmp(info->argv[i].key, "batch") == 0
+        && atoi(info->argv[i].value) >= 0
+        && atoi(info->argv[i].value) <= MAX_MOP_BATCH)
+      g_ctx.opt_batch = atoi(info->argv[i].value);
     else if (strcmp(info->argv[i].key, "ignore") == 0)
       g_ctx.opt_ignore = xstrdup(info->argv[i].value);
   }
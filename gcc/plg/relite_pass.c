@@ -130,19 +130,10 @@ static void             instr_func          (struct relite_context_t* ctx,
 }
 
 
-static void             instr_mop           (struct relite_context_t* ctx,
-                                             tree expr,
-                                             location_t loc,
+static unsigned         mop_flags           (tree expr,
                                              int is_store,
-                                             int is_sblock,
-                                             gimple_seq* gseq) {
-  // Builds the following gimple sequence:
-  // tsan_rtl_mop(&expr, (is_sblock | (is_store << 1) | ((sizeof(expr)-1) << 2)
-
-  gcc_assert(gseq != 0 && *gseq == 0);
-  gcc_assert(is_gimple_addressable(expr));
-
-  tree addr_expr = build_addr(expr, current_function_decl);
+                                             int is_sblock) {
+  // is_sblock | (is_store << 1) | ((sizeof(expr)-1) << 2)
   tree expr_type = TREE_TYPE(expr);
   //TODO(dvyukov): try to remove that WTF, and see if compiler crashes w/o that
   while (TREE_CODE(expr_type) == ARRAY_TYPE)
@@ -157,7 +148,24 @@ static void             instr_mop           (struct relite_context_t* ctx,
   if (size.low > MAX_MOP_BYTES)
     size.low = MAX_MOP_BYTES;
   size.low = size.low - 1;
-  unsigned flags = ((!!is_sblock << 0) + (!!is_store << 1) + (size.low << 2));
+  return ((!!is_sblock << 0) + (!!is_store << 1) + (size.low << 2));
+}
+
+
+static void             instr_mop           (struct relite_context_t* ctx,
+                                             tree expr,
+                                             location_t loc,
+                                             int is_store,
+                                             int is_sblock,
+                                             gimple_seq* gseq) {
+  // Builds the following gimple sequence:
+  // tsan_rtl_mop(&expr, (is_sblock | (is_store << 1) | ((sizeof(expr)-1) << 2)
+
+  gcc_assert(gseq != 0 && *gseq == 0);
+  gcc_assert(is_gimple_addressable(expr));
+
+  tree addr_expr = build_addr(expr, current_function_decl);
+  unsigned flags = mop_flags(expr, is_store, is_sblock);
   tree flags_expr = build_int_cst(unsigned_type_node, flags);
 
   tree call_expr = build_call_expr(ctx->rtl_mop, 2, addr_expr, flags_expr);
@@ -165,6 +173,44 @@ static void             instr_mop           (struct relite_context_t* ctx,
 }
 
 
+static void             instr_mop_batched   (struct relite_context_t* ctx,
+                                             tree expr,
+                                             int is_store,
+                                             int is_sblock,
+                                             unsigned idx,
+                                             gimple_seq* gseq) {
+  // Builds the following gimple sequence:
+  // __tsan_mop_buffer[idx] = (unsigned long)&expr | (flags << 58)
+
+  gcc_assert(gseq != 0 && *gseq == 0);
+  gcc_assert(is_gimple_addressable(expr));
+
+  tree addr_expr = build_addr(expr, current_function_decl);
+  unsigned HOST_WIDE_INT flags = mop_flags(expr, is_store, is_sblock);
+  tree flags_expr = build_int_cst_wide(long_unsigned_type_node,
+      flags << MOP_BATCH_FLAGS_SHIFT, 0);
+  tree val_expr = build2(BIT_IOR_EXPR, long_unsigned_type_node,
+      fold_convert(long_unsigned_type_node, addr_expr), flags_expr);
+  val_expr = force_gimple_operand(val_expr, gseq, true, NULL_TREE);
+  tree elem_expr = build4(ARRAY_REF, long_unsigned_type_node,
+      ctx->rtl_mop_buffer, build_int_cst(integer_type_node, idx),
+      NULL_TREE, NULL_TREE);
+  gimple_seq_add_stmt(gseq, gimple_build_assign(elem_expr, val_expr));
+}
+
+
+static void             instr_mop_flush     (struct relite_context_t* ctx,
+                                             unsigned count,
+                                             gimple_seq* gseq) {
+  // Builds the following gimple sequence:
+  // __tsan_handle_mop_batch(count)
+
+  tree count_expr = build_int_cst(unsigned_type_node, count);
+  tree call_expr = build_call_expr(ctx->rtl_mop_batch, 1, count_expr);
+  force_gimple_operand(call_expr, gseq, true, 0);
+}
+
+
 static void             instr_vptr_store    (struct relite_context_t* ctx,
                                              tree expr,
                                              tree rhs,
@@ -775,6 +821,55 @@ static void             check_func          (relite_context_t* ctx) {
 }
 
 
+// Returns non-zero if the mop at 'ix' accesses the same lvalue as some
+// previous mop of the block w/o calls in between (so it can't be separated
+// from it by synchronization), and that one is a store or both are loads.
+// The pass runs on SSA, so equal expressions denote the same address.
+static int              is_redundant_mop    (VEC(mop_desc_t, heap)* mop_list,
+                                             int ix) {
+  // Limit the quadratic search in huge blocks.
+  int const max_distance = 64;
+  mop_desc_t* mop = VEC_index(mop_desc_t, mop_list, ix);
+  if (mop->dtor_vptr_expr != 0)
+    return 0;
+  unsigned const size = mop_flags(mop->expr, 0, 0);
+  int i;
+  for (i = ix - 1; i >= 0 && i >= ix - max_distance; i -= 1) {
+    mop_desc_t* prev = VEC_index(mop_desc_t, mop_list, i);
+    if (prev->is_call != 0)
+      return 0;
+    if (prev->dtor_vptr_expr != 0
+        || (prev->is_store == 0 && mop->is_store != 0))
+      continue;
+    if (operand_equal_p(prev->expr, mop->expr, 0)
+        && mop_flags(prev->expr, 0, 0) == size)
+      return 1;
+  }
+  return 0;
+}
+
+
+// Flushes the batched mops after the last of them, or before its statement
+// if it's a call (its arguments are loaded before the call)
+// or the last statement of the block.
+static void             flush_mop_batch     (relite_context_t* ctx,
+                                             gimple_stmt_iterator* gsi,
+                                             unsigned* count) {
+  if (*count == 0)
+    return;
+  gimple stmt = gsi_stmt(*gsi);
+  gimple_seq flush_seq = 0;
+  instr_mop_flush(ctx, *count, &flush_seq);
+  set_location(flush_seq, gimple_location(stmt));
+  if (is_gimple_call(stmt) || stmt_ends_bb_p(stmt))
+    gsi_insert_seq_before(gsi, flush_seq, GSI_SAME_STMT);
+  else
+    gsi_insert_seq_after(gsi, flush_seq, GSI_NEW_STMT);
+  ctx->stat_batch += 1;
+  *count = 0;
+}
+
+
 static void             instrument_bblock   (relite_context_t* ctx,
                                              bb_data_t* bbd,
                                              basic_block bb) {
@@ -795,14 +890,26 @@ static void             instrument_bblock   (relite_context_t* ctx,
 
 #if 1
   dbg(ctx, "instrumenting %d mops", VEC_length(mop_desc_t, mop_list));
+  // The consecutive mops w/o calls in between go to the thread's mop buffer
+  // and the runtime is called once for all of them.
+  unsigned batch_count = 0;
+  gimple_stmt_iterator batch_gsi = gsi_start_bb(bb);
   mop_desc_t* mop = 0;
   for (int ix = 0; VEC_iterate(mop_desc_t, mop_list, ix, mop); ix += 1) {
     if (mop->is_call != 0) {
       dbg(ctx, "call -> reset sblock info");
+      flush_mop_batch(ctx, &batch_gsi, &batch_count);
       bbd->has_sb = 0;
       continue;
     }
 
+    if (is_redundant_mop(mop_list, ix)) {
+      dbg_dump_mop(ctx, mop->is_store ? "store to" : "load of",
+          gimple_location(gsi_stmt(mop->gsi)), mop->expr, 0, "redundant");
+      ctx->stat_redundant += 1;
+      continue;
+    }
+
     ctx->func_mops += 1;
     if (mop->is_store)
       ctx->stat_store_instrumented += 1;
@@ -842,8 +949,28 @@ static void             instrument_bblock   (relite_context_t* ctx,
       bbd->sb_line_max = eloc.line + ctx->opt_sblock_size;
     }
 
+    // The store of a call result goes after the call,
+    // so it would get into the next batch.
+    int const is_batched = ctx->opt_batch != 0
+        && mop->dtor_vptr_expr == 0
+        && !(is_gimple_call(stmt) && mop->is_store == 1);
+    if (is_batched && batch_count != 0) {
+      // Do not split the mops of one statement, the next batch
+      // would be stored into the buffer before the statement
+      // and so before this batch is flushed.
+      if (gsi_stmt(batch_gsi) != stmt
+          ? batch_count >= (unsigned)ctx->opt_batch
+          : batch_count == MAX_MOP_BATCH)
+        flush_mop_batch(ctx, &batch_gsi, &batch_count);
+    } else if (is_batched == 0) {
+      flush_mop_batch(ctx, &batch_gsi, &batch_count);
+    }
+
     gimple_seq instr_seq = 0;
-    if (mop->dtor_vptr_expr == 0)
+    if (is_batched && batch_count < MAX_MOP_BATCH)
+      instr_mop_batched(ctx, mop->expr, mop->is_store, is_sblock,
+                        batch_count, &instr_seq);
+    else if (mop->dtor_vptr_expr == 0)
       instr_mop(ctx, mop->expr, loc, mop->is_store, is_sblock, &instr_seq);
     else
       instr_vptr_store(ctx, mop->expr, mop->dtor_vptr_expr, loc,
@@ -854,7 +981,12 @@ static void             instrument_bblock   (relite_context_t* ctx,
       gsi_insert_seq_after(&mop->gsi, instr_seq, GSI_NEW_STMT);
     else // dtor_vptr_expr != 0
       gsi_insert_seq_before(&mop->gsi, instr_seq, GSI_SAME_STMT);
+    if (is_batched && batch_count < MAX_MOP_BATCH) {
+      batch_count += 1;
+      batch_gsi = mop->gsi;
+    }
   }
+  flush_mop_batch(ctx, &batch_gsi, &batch_count);
 #endif
 }
 
@@ -1044,6 +1176,15 @@ void                    relite_prepass      (relite_context_t* ctx) {
   ctx->rtl_mop = lookup_name(get_identifier("__tsan_handle_mop"));
   if (ctx->rtl_mop == 0)
     printf("relite: can't find __tsan_handle_mop() rtl decl\n"), exit(1);
+  if (ctx->opt_batch != 0) {
+    ctx->rtl_mop_buffer = lookup_name(get_identifier("__tsan_mop_buffer"));
+    if (ctx->rtl_mop_buffer == 0)
+      printf("relite: can't find __tsan_mop_buffer rtl decl\n"), exit(1);
+    ctx->rtl_mop_batch = lookup_name(get_identifier("__tsan_handle_mop_batch"));
+    if (ctx->rtl_mop_batch == 0)
+      printf("relite: can't find __tsan_handle_mop_batch() rtl decl\n"),
+          exit(1);
+  }
   ctx->rtl_retaddr = lookup_name(get_identifier("__builtin_return_address"));
   if (ctx->rtl_retaddr == 0)
     printf("relite: can't find __builtin_return_address() rtl decl\n"), exit(1);
@@ -1072,6 +1213,10 @@ void                    relite_finish       (relite_context_t* ctx) {
         ctx->stat_sblock, mop_count);
     printf("replaced: %d\n",
         ctx->stat_replaced);
+    printf("mop batches: %d\n",
+        ctx->stat_batch);
+    printf("redundant mops: %d\n",
+        ctx->stat_redundant);
   }
 }
 
@@ -16,6 +16,11 @@
 #define RELITE_ATTR_IGNORE  "tsan_ignore"
 #define RELITE_ATTR_REPLACE "tsan_replace"
 
+// The size of __tsan_mop_buffer and the position of the mop flags
+// in its elements, must match the runtime (see __tsan_handle_mop_batch()).
+#define MAX_MOP_BATCH       64
+#define MOP_BATCH_FLAGS_SHIFT 58
+
 
 typedef struct replace_t {
   struct replace_t*     next;
@@ -28,12 +33,15 @@ typedef struct relite_context_t {
   int                   opt_debug;
   int                   opt_stat;
   int                   opt_sblock_size;
+  int                   opt_batch;  // max mops per batch, 0 - no batching
   char const*           opt_ignore;
 
   int                   setup_completed;
   tree                  rtl_stack;  // thread local shadow stack
   tree                  rtl_ignore; // thread local recursive ignore
   tree                  rtl_mop;    // mop handling function
+  tree                  rtl_mop_buffer; // thread local mop buffer
+  tree                  rtl_mop_batch; // batched mop handling function
   tree                  rtl_retaddr; // builtin __builtin_return_address
   int                   ignore_file;
 
@@ -52,6 +60,8 @@ typedef struct relite_context_t {
   int                   stat_sblock;
   int                   stat_bb_total;
   int                   stat_replaced;
+  int                   stat_batch;
+  int                   stat_redundant;
 } relite_context_t;
 
 
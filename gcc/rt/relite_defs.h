@@ -32,6 +32,19 @@
 
 //#define RELITE_API_AMBUSH
 #define RELITE_SCHED_SHAKE
+// Keep up to that many accesses per shadow cell (a power of two, at most 8),
+// see handle_access_slots() in relite_rt.c. Tracks races at the granularity
+// of RELITE_SHADOW_SLOTS bytes instead of 1 byte.
+//#define RELITE_SHADOW_SLOTS     4
+// Map the shadow from .preinit_array (only works if the runtime is linked
+// into the executable).
+//#define RELITE_PREINIT
+// Do not check that the shadow is mapped on instrumented loads and stores,
+// making them a pure address transform plus a load. The shadow has to be
+// mapped before any instrumented code runs; it is, if the instrumented code
+// does not run from constructors of modules the runtime does not precede,
+// or with RELITE_PREINIT.
+//#define RELITE_SHADOW_PREMAPPED
 
 
 typedef                 void const volatile*addr_t;
@@ -40,8 +53,9 @@ typedef                 uint64_t            timestamp_t;
 typedef                 uint64_t            state_t;
 
 
-//#define MAX_THREADS             (64*1024)
-#define MAX_THREADS             (1000)
+// Clocks are sized by the number of threads actually seen, so the limit
+// only costs address space (thread ids have 16 bits in the state).
+#define MAX_THREADS             (64*1024)
 #define THR_MASK_SIZE           (MAX_THREADS / sizeof(size_t) / 8)
 #define SHADOW_BASE             ((atomic_uint64_t*)0x00000D0000000000ull)
 #define SHADOW_SIZE             (0x0000800000000000ull - 0x00000E38E38E3800ull)
@@ -49,6 +49,21 @@
 #define RELITE_PRINT_STACK
 
 
+#define REPORT_STACK_SIZE       64
+// The number of distinct reports remembered, a power of two.
+#define REPORT_SET_SIZE         4096
+// The number of reports waiting for symbolization, a power of two.
+#define REPORT_QUEUE_SIZE       256
+#define MAX_SECTIONS            64
+
+
+typedef struct section_info_t {
+  bfd_vma                                   vma;
+  bfd_size_type                             size;
+  asection*                                 section;
+} section_info_t;
+
+
 typedef struct libtrace_data_t {
   atomic_uint32_t                           mtx;
   bfd_boolean                               unwind_inlines;
@@ -56,9 +71,32 @@ typedef struct libtrace_data_t {
   asymbol**                                 syms;
   bfd*                                      abfd;
   asection*                                 section;
+  int                                       section_count;
+  section_info_t                            sections [MAX_SECTIONS];
 } libtrace_data_t;
 
 
+// A report which is not printed yet.
+typedef struct pending_report_t {
+  atomic_uint32_t                           ready;
+  relite_report_t                           report;
+  int                                       stack_size;
+  void*                                     stack [REPORT_STACK_SIZE];
+} pending_report_t;
+
+
+// Hashes of the (report type, stack) of the reported races,
+// so a hot race is printed once. Lock-free, 0 is an empty slot.
+static atomic_uint64_t  g_report_set [REPORT_SET_SIZE];
+
+// Any thread adds a report to the queue, the one that holds
+// g_libtrace_data.mtx symbolizes and prints all the queued reports,
+// the others do not wait for it.
+static pending_report_t g_report_queue [REPORT_QUEUE_SIZE];
+static atomic_uint64_t  g_report_queue_head;
+static atomic_uint64_t  g_report_queue_tail;
+
+
 typedef struct sym_info_t {
   bfd_vma pc;
   const char* filename;
@@ -75,6 +113,7 @@ static libtrace_data_t g_libtrace_data = {
   .syms                                     = NULL,
   .abfd                                     = NULL,
   .section                                  = NULL,
+  .section_count                            = 0,
 };
 
 
@@ -116,34 +155,35 @@ void                    relite_report_init  () {
   if (symcount < 0)
     relite_fatal("bfd_read_minisymbols() failed");
   g_libtrace_data.syms = syms;
-}
-
-
-static void             find_address_in_section (bfd* abfd,
-                                                 asection* section,
-                                                 void* data) {
-  bfd_vma vma;
-  bfd_size_type size;
-  sym_info_t* psi = (sym_info_t*)data;
 
-  if (psi->found)
-    return;
-
-  if ((bfd_get_section_flags(abfd, section) & SEC_ALLOC) == 0)
-    return;
+  asection* section;
+  for (section = abfd->sections; section != 0; section = section->next) {
+    if ((bfd_get_section_flags(abfd, section) & SEC_ALLOC) == 0)
+      continue;
+    if (g_libtrace_data.section_count == MAX_SECTIONS)
+      break;
+    section_info_t* si = &g_libtrace_data.sections[
+        g_libtrace_data.section_count++];
+    si->vma = bfd_get_section_vma(abfd, section);
+    si->size = bfd_get_section_size(section);
+    si->section = section;
+  }
+}
 
-  vma = bfd_get_section_vma(abfd, section);
-  if (psi->pc < vma)
-    return;
 
-  size = bfd_get_section_size(section);
-  if (psi->pc >= vma + size)
+static void             find_address         (bfd* abfd,
+                                              sym_info_t* psi) {
+  int i;
+  for (i = 0; i != g_libtrace_data.section_count; i += 1) {
+    section_info_t const* si = &g_libtrace_data.sections[i];
+    if (psi->pc < si->vma || psi->pc >= si->vma + si->size)
+      continue;
+    psi->found = bfd_find_nearest_line(abfd, si->section,
+                   g_libtrace_data.syms, psi->pc - si->vma,
+                   &psi->filename, &psi->functionname,
+                   &psi->line);
     return;
-
-  psi->found = bfd_find_nearest_line(abfd, section,
-                 g_libtrace_data.syms, psi->pc - vma,
-                 &psi->filename, &psi->functionname,
-                 &psi->line);
+  }
 }
 
 
@@ -153,12 +193,10 @@ static void             translate_addresses (bfd* abfd,
                                              size_t buf_func_len,
                                              char* buf_file,
                                              size_t buf_file_len) {
-  char addr [(CHAR_BIT/4) * (sizeof(void*)) + 2] = {0};
-  sprintf(addr, "%p", xaddr);
   sym_info_t si = {0};
-  si.pc = bfd_scan_vma (addr, NULL, 16);
+  si.pc = (bfd_vma)(uintptr_t)xaddr;
   si.found = FALSE;
-  bfd_map_over_sections(abfd, find_address_in_section, &si);
+  find_address(abfd, &si);
 
   if (si.found == 0) {
     if (buf_func != 0 && buf_func_len != 0)
@@ -205,6 +243,138 @@ static void             translate_addresses (bfd* abfd,
 }
 
 
+// Returns non-zero if the report was not seen before (or the set is full).
+static int              report_is_new       (relite_report_t const* report,
+                                             void* const* stack,
+                                             int stack_size) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ report->type;
+  int i;
+  for (i = 0; i != stack_size; i += 1)
+    hash = (hash ^ (uint64_t)(uintptr_t)stack[i]) * 0x100000001b3ull;
+  if (stack_size == 0)
+    hash ^= (uint64_t)(uintptr_t)report->addr;
+  if (hash == 0)
+    hash = 1;
+  size_t idx = (size_t)(hash ^ (hash >> 32)) & (REPORT_SET_SIZE - 1);
+  for (i = 0; i != REPORT_SET_SIZE; i += 1) {
+    atomic_uint64_t* slot = &g_report_set[(idx + i) & (REPORT_SET_SIZE - 1)];
+    uint64_t cur = atomic_uint64_load(slot, memory_order_relaxed);
+    if (cur == 0 && atomic_uint64_compare_exchange(slot, &cur, hash,
+                                                   memory_order_relaxed))
+      return 1;
+    if (cur == hash)
+      return 0;
+  }
+  return 1;
+}
+
+
+static void             report_enqueue      (relite_report_t const* report,
+                                             void* const* stack,
+                                             int stack_size) {
+  uint64_t head = atomic_uint64_load(&g_report_queue_head,
+                                     memory_order_relaxed);
+  for (;;) {
+    uint64_t const tail = atomic_uint64_load(&g_report_queue_tail,
+                                             memory_order_acquire);
+    if (head - tail >= REPORT_QUEUE_SIZE) {
+      // the printer lags far behind, drop the report
+      return;
+    }
+    if (atomic_uint64_compare_exchange(&g_report_queue_head, &head, head + 1,
+                                       memory_order_relaxed))
+      break;
+  }
+  pending_report_t* pending = &g_report_queue[head % REPORT_QUEUE_SIZE];
+  pending->report = *report;
+  pending->stack_size = stack_size;
+  memcpy(pending->stack, stack, stack_size * sizeof(stack[0]));
+  atomic_uint32_store(&pending->ready, 1, memory_order_release);
+}
+
+
+static void             report_print        (pending_report_t const* pending) {
+  FILE* out = stdout;
+#ifdef RELITE_PRINT_STACK
+  fprintf(out, "\n--------------------------------\n");
+#endif
+  fprintf(out, "%s on %p (%u bytes)\n",
+          relite_report_str(pending->report.type),
+          pending->report.addr,
+          pending->report.size);
+
+#ifdef RELITE_PRINT_STACK
+  int i;
+  int pos = 0;
+  for (i = 0; i != pending->stack_size; i += 1) {
+    char buf_func [PATH_MAX + 1];
+    char buf_file [PATH_MAX + 1];
+    translate_addresses(g_libtrace_data.abfd,
+                        pending->stack[i],
+                        buf_func, sizeof(buf_func)/sizeof(buf_func[0]) - 1,
+                        buf_file, sizeof(buf_file)/sizeof(buf_file[0]) - 1);
+    if (strcmp(buf_func, "relite_thread_wrapper()") == 0)
+      break;
+    if (strncmp(buf_func, "relite_", sizeof("relite_") - 1) == 0)
+      continue;
+    fprintf(out, "  #%d %s, %s\n",
+            pos, buf_func, buf_file);
+    pos += 1;
+    if (strcmp(buf_func, "main()") == 0)
+      break;
+  }
+  fprintf(out, "--------------------------------\n\n");
+#endif
+}
+
+
+// Prints the queued reports unless another thread does it already
+// (then it will print ours too), or waits for it if 'wait' is set.
+static void             report_flush        (unsigned my_tid, int wait) {
+  for (;;) {
+    if (atomic_uint64_load(&g_report_queue_tail, memory_order_relaxed)
+        == atomic_uint64_load(&g_report_queue_head, memory_order_relaxed))
+      return;
+    if (atomic_uint32_exchange
+        (&g_libtrace_data.mtx, my_tid, memory_order_acquire) != 0) {
+      if (wait == 0)
+        return;
+      sched_yield();
+      continue;
+    }
+    uint64_t tail = atomic_uint64_load(&g_report_queue_tail,
+                                       memory_order_relaxed);
+    int is_blocked = 0;
+    while (tail != atomic_uint64_load(&g_report_queue_head,
+                                      memory_order_relaxed)) {
+      pending_report_t* pending = &g_report_queue[tail % REPORT_QUEUE_SIZE];
+      if (atomic_uint32_load(&pending->ready, memory_order_acquire) == 0) {
+        // still being filled, its thread will flush it
+        is_blocked = 1;
+        break;
+      }
+      report_print(pending);
+      atomic_uint32_store(&pending->ready, 0, memory_order_relaxed);
+      tail += 1;
+      atomic_uint64_store(&g_report_queue_tail, tail, memory_order_release);
+    }
+    fflush(stdout);
+    atomic_uint32_store(&g_libtrace_data.mtx, 0, memory_order_release);
+    // the thread of the blocked report may have failed to get the mutex
+    // before we released it, so do not leave the report in the queue
+    if (is_blocked)
+      sched_yield();
+  }
+}
+
+
+static void             report_fini         () __attribute__((destructor));
+
+static void             report_fini         () {
+  report_flush(1, 1);
+}
+
+
 void                    relite_report       (addr_t addr,
                                              state_t state,
                                              int is_load) {
@@ -241,48 +411,19 @@ void                    relite_report       (addr_t addr,
   unsigned my_tid = (unsigned)pthread_self();
   if (my_tid == 0)
     my_tid = 1;
+  // a report from the printing of reports
   if (atomic_uint32_load(&g_libtrace_data.mtx, memory_order_relaxed) == my_tid)
     return;
-  while (atomic_uint32_exchange
-      (&g_libtrace_data.mtx, my_tid, memory_order_acquire) != 0)
-    sched_yield();
-
-  FILE* out = stdout;
-#ifdef RELITE_PRINT_STACK
-  fprintf(out, "\n--------------------------------\n");
-#endif
-  fprintf(out, "%s on %p (%u bytes)\n",
-          relite_report_str(report.type),
-          addr,
-          report.size);
 
+  void* stack [REPORT_STACK_SIZE];
+  int stack_size = 0;
 #ifdef RELITE_PRINT_STACK
-  void* stacktrace [64];
-  int stacktrace_size = backtrace(
-      stacktrace, sizeof(stacktrace)/sizeof(stacktrace[0]));
-  int i;
-  int pos = 0;
-  for (i = 0; i != stacktrace_size; i += 1) {
-    char buf_func [PATH_MAX + 1];
-    char buf_file [PATH_MAX + 1];
-    translate_addresses(g_libtrace_data.abfd,
-                        stacktrace[i],
-                        buf_func, sizeof(buf_func)/sizeof(buf_func[0]) - 1,
-                        buf_file, sizeof(buf_file)/sizeof(buf_file[0]) - 1);
-    if (strcmp(buf_func, "relite_thread_wrapper()") == 0)
-      break;
-    if (strncmp(buf_func, "relite_", sizeof("relite_") - 1) == 0)
-      continue;
-    fprintf(out, "  #%d %s, %s\n",
-            pos, buf_func, buf_file);
-    pos += 1;
-    if (strcmp(buf_func, "main()") == 0)
-      break;
-  }
-  fprintf(out, "--------------------------------\n\n");
+  stack_size = backtrace(stack, REPORT_STACK_SIZE);
 #endif
-
-  atomic_uint32_store(&g_libtrace_data.mtx, 0, memory_order_release);
+  if (report_is_new(&report, stack, stack_size) == 0)
+    return;
+  report_enqueue(&report, stack, stack_size);
+  report_flush(my_tid, 0);
 }
 
 
@@ -41,6 +41,13 @@
 #include <memory.h>
 #include <sched.h>
 #include <sys/mman.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#include <smmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 
@@ -81,12 +88,24 @@ typedef struct rl_rt_context_t {
 } rl_rt_context_t;
 
 
+// Only the first clock_size elements of a clock may be non-zero.
+// Thread ids are allocated densely (and reused), so this is about the number
+// of threads ever seen rather than MAX_THREADS.
+// The sync object occupies a page and keeps its clock inline
+// while it fits, later the clock is moved to a separate mapping.
 typedef struct rl_rt_sync_t {
   size_t                        clock_size;
-  timestamp_t                   clock [MAX_THREADS];
+  size_t                        clock_capacity;
+  timestamp_t*                  clock;
+  timestamp_t                   inline_clock [1];
 } rl_rt_sync_t;
 
 
+#define SYNC_ALLOC_SIZE         4096
+#define SYNC_INLINE_CLOCK_SIZE  ((SYNC_ALLOC_SIZE - sizeof(rl_rt_sync_t)) \
+                                  / sizeof(timestamp_t) + 1)
+
+
 typedef struct debug_info_t {
   char const*                   file;
   int                           line;
@@ -162,6 +181,17 @@ void            rl_rt_init      () {
 }
 
 
+#ifdef RELITE_PREINIT
+// When the runtime is linked into the executable, map the shadow before
+// any constructor (instrumented ones included) runs.
+// .preinit_array is ignored in shared objects, there the constructor above
+// does the job: the instrumented modules depend on the runtime,
+// so the loader initializes it first.
+static void (*rl_rt_preinit)() __attribute__((section(".preinit_array"), used))
+    = rl_rt_init;
+#endif
+
+
 /*
 void __wrap___libc_csu_init() {
   rl_rt_init();
@@ -201,10 +231,18 @@ void                    relite_sched_shake  () {
 
 
 
-static inline atomic_uint64_t* get_shadow(addr_t addr) {
-  //TODO(dvyukov): how to eliminate it on fast-path?
-  if (g_ctx.shadow_mem == 0)
+// The entry points which are not on the load/store fast path call it
+// before touching the shadow, in case they run before rl_rt_init().
+static inline void ensure_shadow() {
+  if (UNLIKELY(g_ctx.shadow_mem == 0))
     rl_rt_init();
+}
+
+
+static inline atomic_uint64_t* get_shadow(addr_t addr) {
+#ifndef RELITE_SHADOW_PREMAPPED
+  ensure_shadow();
+#endif
   uintptr_t const offset = (uintptr_t)addr
     - (SHADOW_SIZE & ((uintptr_t)(addr < (addr_t)SHADOW_BASE) - 1));
   atomic_uint64_t* shadow = SHADOW_BASE + offset;
@@ -212,188 +250,612 @@ static inline atomic_uint64_t* get_shadow(addr_t addr) {
 }
 
 
-static void   clock_assign_max    (timestamp_t* dest, timestamp_t const* src) {
-  int i;
-  for (i = 0; i != MAX_THREADS; i += 1) {
+// dest[i] = max(dest[i], src[i]) for i < src_size.
+static void   clock_assign_max    (timestamp_t* dest,
+                                   size_t* dest_size,
+                                   timestamp_t const* src,
+                                   size_t src_size) {
+  size_t i = 0;
+#ifdef __SSE4_2__
+  // Timestamps are 44 bits, so the signed compare is fine.
+  for (; i + 2 <= src_size; i += 2) {
+    __m128i const d = _mm_loadu_si128((__m128i const*)(dest + i));
+    __m128i const s = _mm_loadu_si128((__m128i const*)(src + i));
+    __m128i const gt = _mm_cmpgt_epi64(s, d);
+    _mm_storeu_si128((__m128i*)(dest + i), _mm_blendv_epi8(d, s, gt));
+  }
+#endif
+  for (; i != src_size; i += 1) {
     if (dest[i] < src[i])
       dest[i] = src[i];
   }
+  if (*dest_size < src_size)
+    *dest_size = src_size;
 }
 
-/*
-static int is_aligned(uintptr_t addr, size_t sz) {
-  return ((addr & ((1 << (3 - sz)) - 1)) == 0);
+
+static rl_rt_sync_t* sync_alloc           () {
+  rl_rt_sync_t* sync = relite_malloc(SYNC_ALLOC_SIZE);
+  if (sync == 0)
+    return 0;
+  relite_memset(sync, 0, SYNC_ALLOC_SIZE);
+  sync->clock = sync->inline_clock;
+  sync->clock_capacity = SYNC_INLINE_CLOCK_SIZE;
+  return sync;
 }
 
 
-static void handle_access_splitted(atomic_uint64_t* shadow,
-                                  uintptr_t addr,
-                                  size_t sz,
-                                  int is_load) {
-  assert(shadow != 0 && addr != 0);
-  assert(is_aligned(addr, sz));
-  assert(sz != SZ_8);
-  uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-  if (UNLIKELY((state & STATE_SYNC_MASK) == 0)) {
-    // something wicked
+static void   sync_free           (rl_rt_sync_t* sync) {
+  if (sync->clock != sync->inline_clock)
+    munmap(sync->clock, sync->clock_capacity * sizeof(timestamp_t));
+  relite_free(sync);
+}
+
+
+static int    sync_reserve_clock  (rl_rt_sync_t* sync, size_t size) {
+  if (LIKELY(size <= sync->clock_capacity))
+    return 1;
+  size_t capacity = sync->clock_capacity;
+  while (capacity < size)
+    capacity *= 2;
+  if (capacity > MAX_THREADS)
+    capacity = MAX_THREADS;
+  timestamp_t* clock = (timestamp_t*)mmap(0, capacity * sizeof(timestamp_t),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (clock == MAP_FAILED)
+    return 0;
+  size_t i;
+  for (i = 0; i != sync->clock_size; i += 1)
+    clock[i] = sync->clock[i];
+  if (sync->clock != sync->inline_clock)
+    munmap(sync->clock, sync->clock_capacity * sizeof(timestamp_t));
+  sync->clock = clock;
+  sync->clock_capacity = capacity;
+  return 1;
+}
+
+// Accesses of any size and alignment.
+// The state of an access is kept in the shadow word of its first byte
+// and carries the size of the access. A state is meaningful only
+// at an address aligned to its size: alloc and free fill every word, and
+// the words of a wider access which are not its first byte keep garbage.
+// An access is split into naturally aligned pieces (at most 4 per 8-byte
+// word, see g_split), each piece is checked against all the meaningful
+// states which overlap it and then stored into its word with one CAS.
+
+typedef struct mop_piece_t {
+  uint8_t                       offset;
+  uint8_t                       sz;     // SZ_1 ... SZ_8
+} mop_piece_t;
+
+
+typedef struct mop_split_t {
+  int                           count;
+  mop_piece_t                   pieces [4];
+} mop_split_t;
+
+
+// g_split[offset][size - 1] splits the access of 'size' bytes
+// at 'offset' within an 8-byte word, so that offset + size <= 8.
+static mop_split_t const g_split [8][8] = {
+  { // offset 0
+    {1, {{0, 3}}},
+    {1, {{0, 2}}},
+    {2, {{0, 2}, {2, 3}}},
+    {1, {{0, 1}}},
+    {2, {{0, 1}, {4, 3}}},
+    {2, {{0, 1}, {4, 2}}},
+    {3, {{0, 1}, {4, 2}, {6, 3}}},
+    {1, {{0, 0}}},
+  },
+  { // offset 1
+    {1, {{1, 3}}},
+    {2, {{1, 3}, {2, 3}}},
+    {2, {{1, 3}, {2, 2}}},
+    {3, {{1, 3}, {2, 2}, {4, 3}}},
+    {3, {{1, 3}, {2, 2}, {4, 2}}},
+    {4, {{1, 3}, {2, 2}, {4, 2}, {6, 3}}},
+    {3, {{1, 3}, {2, 2}, {4, 1}}},
+    {0},
+  },
+  { // offset 2
+    {1, {{2, 3}}},
+    {1, {{2, 2}}},
+    {2, {{2, 2}, {4, 3}}},
+    {2, {{2, 2}, {4, 2}}},
+    {3, {{2, 2}, {4, 2}, {6, 3}}},
+    {2, {{2, 2}, {4, 1}}},
+    {0},
+    {0},
+  },
+  { // offset 3
+    {1, {{3, 3}}},
+    {2, {{3, 3}, {4, 3}}},
+    {2, {{3, 3}, {4, 2}}},
+    {3, {{3, 3}, {4, 2}, {6, 3}}},
+    {2, {{3, 3}, {4, 1}}},
+    {0},
+    {0},
+    {0},
+  },
+  { // offset 4
+    {1, {{4, 3}}},
+    {1, {{4, 2}}},
+    {2, {{4, 2}, {6, 3}}},
+    {1, {{4, 1}}},
+    {0},
+    {0},
+    {0},
+    {0},
+  },
+  { // offset 5
+    {1, {{5, 3}}},
+    {2, {{5, 3}, {6, 3}}},
+    {2, {{5, 3}, {6, 2}}},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+  },
+  { // offset 6
+    {1, {{6, 3}}},
+    {1, {{6, 2}}},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+  },
+  { // offset 7
+    {1, {{7, 3}}},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+    {0},
+  },
+};
+
+
+static inline size_t state_size(uint64_t state) {
+  return 8 >> ((state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT);
+}
+
+
+static inline int state_is_meaningful(uint64_t state, uintptr_t addr) {
+  return state != 0
+      && (state & STATE_SYNC_MASK) == 0
+      && (addr & (state_size(state) - 1)) == 0;
+}
+
+
+static void   check_state         (uint64_t state,
+                                   addr_t addr,
+                                   int is_load,
+                                   int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  size_t const thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
+  timestamp_t const ts = (state & STATE_TIMESTAMP_MASK);
+  int const state_is_load = (state & STATE_LOAD_MASK) != 0;
+  if (*is_race_detected)
     return;
+  if (ts >= STATE_FREED) {
+    // uninitialized, out of bounds or freed memory
+    if (is_load || ts != STATE_UNITIALIZED) {
+      *is_race_detected = 1;
+      relite_report(addr, state, is_load);
+    }
+  } else if (thrid != self->id && ts > self->clock[thrid]
+      && (is_load == 0 || state_is_load == 0)) {
+    *is_race_detected = 1;
+    relite_report(addr, state, is_load);
   }
-  size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
 }
 
 
-static void handle_access_aligned(atomic_uint64_t* shadow,
-                                  uintptr_t addr,
-                                  size_t sz,
-                                  int is_load) {
-  assert(shadow != 0 && addr != 0);
-  assert(is_aligned(addr, sz));
-  assert(sz != SZ_8);
-  uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-  if (UNLIKELY((state & STATE_SYNC_MASK) == 0)) {
-    // something wicked
+static NOINLINE void handle_piece_slow(atomic_uint64_t* shadow,
+                                       uintptr_t addr,
+                                       size_t sz,
+                                       uint64_t my_state,
+                                       int is_load,
+                                       int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  size_t const size = 8 >> sz;
+  uint64_t own = atomic_uint64_load(shadow, memory_order_relaxed);
+  // the address was used as a sync variable,
+  // so do not track races on it
+  if (UNLIKELY((own & STATE_SYNC_MASK) != 0))
     return;
+  // the wider accesses which start before the piece
+  size_t wider;
+  for (wider = SZ_8; wider != sz; wider += 1) {
+    uintptr_t const start = addr & ~(uintptr_t)((8 >> wider) - 1);
+    if (start == addr)
+      continue;
+    uint64_t const state = atomic_uint64_load(shadow - (addr - start),
+                                              memory_order_relaxed);
+    if (state_is_meaningful(state, start)
+        && start + state_size(state) > addr)
+      check_state(state, (addr_t)addr, is_load, is_race_detected);
   }
-  size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
-  if (real_sz == SZ_8 && (addr % 8) != 0) {
-    // unused as of now slot, covered by some previous slot
+  // the access at the piece itself and the narrower ones inside it
+  int const own_is_meaningful = state_is_meaningful(own, addr);
+  if (own_is_meaningful)
+    check_state(own, (addr_t)addr, is_load, is_race_detected);
+  size_t i;
+  for (i = 1; i != size; i += 1) {
+    uint64_t const state = atomic_uint64_load(shadow + i,
+                                              memory_order_relaxed);
+    if (state_is_meaningful(state, addr + i))
+      check_state(state, (addr_t)(addr + i), is_load, is_race_detected);
   }
 
-  if (sz < real_sz) {
-    assert(sz != SZ_1);
-    if (sz == SZ_2) {
-      handle_access_splitted(shadow,     addr,     SZ_1);
-      handle_access_splitted(shadow + 1, addr + 1, SZ_1);
-    } else {
-      assert(sz == SZ_4);
-      if (real_sz == SZ_2) {
-        handle_access_splitted(shadow,     addr,     SZ_2);
-        handle_access_splitted(shadow + 2, addr + 2, SZ_2);
-      } else {
-        assert(real_sz == SZ_1);
-        handle_access_splitted(shadow,     addr,     SZ_1);
-        handle_access_splitted(shadow + 1, addr + 1, SZ_1);
-        handle_access_splitted(shadow + 2, addr + 2, SZ_1);
-        handle_access_splitted(shadow + 3, addr + 3, SZ_1);
+  if (own_is_meaningful) {
+    size_t const own_sz = (own & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
+    size_t const own_thrid = (own & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
+    timestamp_t const own_ts = (own & STATE_TIMESTAMP_MASK);
+    int const own_is_load = (own & STATE_LOAD_MASK) != 0;
+    if (is_load && own_sz == sz && own_ts < STATE_FREED) {
+      // a load does not replace my store (we better preserve the fact)
+      // nor a load of another thread
+      if (own_thrid == self->id ? own_is_load == 0 : own_is_load)
+        return;
+    }
+    if (own_sz < sz) {
+      // the word holds a wider access, keep it for the rest of its bytes:
+      // [addr + size, addr + own_size) is split into the aligned pieces
+      // of size, 2*size, ..., own_size/2 bytes
+      size_t const own_size = 8 >> own_sz;
+      size_t rest;
+      for (rest = size; rest != own_size; rest *= 2) {
+        uint64_t const state = atomic_uint64_load(shadow + rest,
+                                                  memory_order_relaxed);
+        if (state_is_meaningful(state, addr + rest) == 0) {
+          uint64_t const rest_sz = SZ_1 - __builtin_ctzl(rest);
+          atomic_uint64_store(shadow + rest, (own & ~STATE_SIZE_MASK)
+              | (rest_sz << STATE_SIZE_SHIFT), memory_order_relaxed);
+        }
       }
     }
-  } else {
-    handle_access_splitted(shadow, addr, sz);
+  }
+  if (atomic_uint64_compare_exchange(shadow, &own,
+                                     my_state, memory_order_relaxed) == 0)
+    return;
+  // a store supersedes the narrower accesses inside it
+  // (and the markers of the bytes)
+  if (is_load == 0) {
+    for (i = 1; i != size; i += 1) {
+      uint64_t state = atomic_uint64_load(shadow + i, memory_order_relaxed);
+      if (state_is_meaningful(state, addr + i))
+        atomic_uint64_compare_exchange(shadow + i, &state,
+                                       0, memory_order_relaxed);
+    }
   }
 }
 
 
-static void handle_access_unaligned(atomic_uint64_t* shadow,
-                                    uintptr_t addr,
-                                    size_t sz,
-                                    int is_load) {
-  assert(shadow != 0 && addr != 0);
-  if (is_aligned(addr, sz) == 0) {
-    // the access is unaligned,
-    // split it into several aligned accesses
-    assert(sz != SZ_1);
-    if (sz == SZ_2) {
-      handle_access_aligned(shadow,     addr,     SZ_1, is_load);
-      handle_access_aligned(shadow + 1, addr + 1, SZ_1, is_load);
-    } else if (sz == SZ_4) {
-      if (((uintptr_t)addr % 2) == 0) {
-        handle_access_aligned(shadow,     addr,     SZ_2, is_load);
-        handle_access_aligned(shadow + 2, addr + 2, SZ_2, is_load);
-      } else {
-        handle_access_aligned(shadow,     addr,     SZ_1, is_load);
-        handle_access_aligned(shadow + 1, addr + 1, SZ_2, is_load);
-        handle_access_aligned(shadow + 3, addr + 3, SZ_1, is_load);
-      }
-    } else {
-      assert(sz == SZ_8);
-      if (((uintptr_t)addr % 4) == 0) {
-        handle_access_aligned(shadow,     addr,     SZ_4, is_load);
-        handle_access_aligned(shadow + 4, addr + 4, SZ_4, is_load);
-      } else if (((uintptr_t)addr % 2) == 0) {
-        handle_access_aligned(shadow,     addr,     SZ_2, is_load);
-        handle_access_aligned(shadow + 2, addr + 2, SZ_4, is_load);
-        handle_access_aligned(shadow + 6, addr + 6, SZ_2, is_load);
-      } else {
-        handle_access_aligned(shadow,     addr,     SZ_1, is_load);
-        handle_access_aligned(shadow + 1, addr + 1, SZ_2, is_load);
-        handle_access_aligned(shadow + 3, addr + 3, SZ_4, is_load);
-        handle_access_aligned(shadow + 7, addr + 7, SZ_1, is_load);
-      }
+static inline void handle_piece   (uintptr_t addr,
+                                   size_t sz,
+                                   int is_load,
+                                   int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  uint64_t const my_state = ((uint64_t)sz << STATE_SIZE_SHIFT)
+      | (is_load ? STATE_LOAD_MASK : 0)
+      | ((uint64_t)self->id << STATE_THRID_SHIFT)
+      | self->clock[self->id];
+  atomic_uint64_t* shadow = get_shadow((addr_t)addr);
+  uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
+  // the same access was already checked,
+  // for a load my store at the same time will do too
+  if (LIKELY(state == my_state
+      || (is_load && state == (my_state & ~STATE_LOAD_MASK))))
+    return;
+  handle_piece_slow(shadow, addr, sz, my_state, is_load, is_race_detected);
+}
+
+
+static inline void handle_access  (addr_t addr,
+                                   size_t size,
+                                   int is_load) {
+  int is_race_detected = 0;
+  uintptr_t p = (uintptr_t)addr;
+  assert(size != 0);
+  if (LIKELY((p & (size - 1)) == 0 && size <= 8
+      && (size & (size - 1)) == 0)) {
+    // aligned access, the only piece is the access itself
+    handle_piece(p, SZ_1 - __builtin_ctzl(size), is_load, &is_race_detected);
+    return;
+  }
+  while (size != 0) {
+    uintptr_t const offset = p & 7;
+    size_t const chunk = size < 8 - offset ? size : 8 - offset;
+    mop_split_t const* split = &g_split[offset][chunk - 1];
+    int i;
+    for (i = 0; i != split->count; i += 1) {
+      mop_piece_t const* piece = &split->pieces[i];
+      handle_piece(p - offset + piece->offset, piece->sz,
+                   is_load, &is_race_detected);
     }
-  } else {
-    handle_access_aligned(shadow, addr, sz);
+    p += chunk;
+    size -= chunk;
   }
 }
 
 
 
-static NOINLINE void handle_load_slow(atomic_uint64_t* shadow,
-                                      addr_t addr,
-                                      size_t sz) {
-  handle_access_unaligned(shadow, (uintptr_t)addr, sz, 1);
+
+#ifdef RELITE_SHADOW_SLOTS
+// Multi-slot shadow cells.
+// The cell of an access is the RELITE_SHADOW_SLOTS shadow words of the
+// RELITE_SHADOW_SLOTS-byte granule which contains the address, that is the
+// words the one-slot scheme uses for the individual bytes of the granule.
+// Each slot holds an access (thread, timestamp, load/store) in the usual
+// state encoding. 0 is an empty slot (thread 0 never has timestamp 0);
+// a marker (STATE_MINE_ZONE etc.) stored by handle_mem_init() occupies
+// a slot until the next access.
+// So read-shared data keeps a load of each reader and stays on the fast path,
+// and a store is checked against all the remembered accesses.
+// The slots are updated with CAS w/o any locks, an update which loses
+// a race with a concurrent update of the same slot is dropped.
+
+#if (RELITE_SHADOW_SLOTS & (RELITE_SHADOW_SLOTS - 1)) != 0 \
+    || RELITE_SHADOW_SLOTS > 8
+# error "RELITE_SHADOW_SLOTS must be a power of two, at most 8"
+#endif
+
+
+static inline atomic_uint64_t* get_shadow_cell(addr_t addr) {
+  uintptr_t const granule = (uintptr_t)addr
+      & ~(uintptr_t)(RELITE_SHADOW_SLOTS - 1);
+  return get_shadow((addr_t)granule);
 }
 
 
-static NOINLINE void handle_store_slow(atomic_uint64_t* shadow,
+// Returns non-zero if the cell already remembers the access 'state'
+// (for a load, the store of the same thread at the same time will do too).
+static inline int cell_has_state(atomic_uint64_t const* cell,
+                                 uint64_t state,
+                                 int is_load) {
+  uint64_t const store_state = state & ~STATE_LOAD_MASK;
+#if defined(__SSE2__) && RELITE_SHADOW_SLOTS == 4
+  __m128i const v = _mm_set1_epi64x(state);
+  __m128i const s = _mm_set1_epi64x(is_load ? store_state : state);
+  __m128i const c0 = _mm_loadu_si128((__m128i const*)cell);
+  __m128i const c1 = _mm_loadu_si128((__m128i const*)(cell + 2));
+  __m128i eq = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi32(c0, v), _mm_cmpeq_epi32(c1, v)),
+      _mm_or_si128(_mm_cmpeq_epi32(c0, s), _mm_cmpeq_epi32(c1, s)));
+  // A 64-bit slot matches only if both of its halves do.
+  eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+  if (LIKELY(_mm_movemask_epi8(eq) == 0))
+    return 0;
+  // The or above may have mixed the halves of different slots, re-check.
+#endif
+  int i;
+  for (i = 0; i != RELITE_SHADOW_SLOTS; i += 1) {
+    uint64_t const slot = cell[i].v;
+    if (slot == state || (is_load && slot == store_state))
+      return 1;
+  }
+  return 0;
+}
+
+
+static NOINLINE void handle_cell_slow(atomic_uint64_t* cell,
                                       addr_t addr,
-                                      size_t sz) {
-  handle_access_unaligned(shadow, (uintptr_t)addr, sz, 0);
+                                      uint64_t my_state,
+                                      int is_load,
+                                      int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  uint64_t slots [RELITE_SHADOW_SLOTS];
+  // How good a slot is to store my_state into:
+  // 3 - my own access of the same kind (or my load, if this is a store),
+  // 2 - empty or a marker, 1 - an access which happens before this one
+  // (for a load, only another load), 0 - has to be kept.
+  int score [RELITE_SHADOW_SLOTS];
+  int i;
+  for (i = 0; i != RELITE_SHADOW_SLOTS; i += 1) {
+    slots[i] = atomic_uint64_load(&cell[i], memory_order_relaxed);
+    // the address was used as a sync variable,
+    // so do not track races on it
+    if (UNLIKELY((slots[i] & STATE_SYNC_MASK) != 0))
+      return;
+  }
+  int target = -1;
+  for (i = 0; i != RELITE_SHADOW_SLOTS; i += 1) {
+    uint64_t const state = slots[i];
+    size_t const thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
+    timestamp_t const ts = (state & STATE_TIMESTAMP_MASK);
+    int const slot_is_load = (state & STATE_LOAD_MASK) != 0;
+    score[i] = 0;
+    if (state == 0) {
+      score[i] = 2;
+    } else if (ts >= STATE_FREED) {
+      // uninitialized, out of bounds or freed memory
+      if (*is_race_detected == 0 && (is_load || ts != STATE_UNITIALIZED)) {
+        *is_race_detected = 1;
+        relite_report(addr, state, is_load);
+      }
+      score[i] = 2;
+    } else if (thrid == self->id) {
+      if (slot_is_load == is_load || is_load == 0)
+        score[i] = 3;
+    } else if (ts > self->clock[thrid]) {
+      // check for a race:
+      // at least one of the accesses is a store
+      // and they are not ordered by happens-before
+      if (*is_race_detected == 0 && (is_load == 0 || slot_is_load == 0)) {
+        *is_race_detected = 1;
+        relite_report(addr, state, is_load);
+      }
+    } else if (is_load == 0 || slot_is_load) {
+      score[i] = 1;
+    }
+    if (score[i] != 0 && (target == -1 || score[i] > score[target]))
+      target = i;
+  }
+  if (target == -1)
+    target = relite_rand(RELITE_SHADOW_SLOTS);
+  atomic_uint64_compare_exchange(&cell[target], &slots[target],
+                                 my_state, memory_order_relaxed);
+  // a store supersedes all the accesses which happen before it
+  if (is_load == 0) {
+    for (i = 0; i != RELITE_SHADOW_SLOTS; i += 1) {
+      if (i != target && score[i] != 0 && slots[i] != 0)
+        atomic_uint64_compare_exchange(&cell[i], &slots[i],
+                                       0, memory_order_relaxed);
+    }
+  }
 }
-*/
 
 
+static inline void handle_access_slots(addr_t addr,
+                                       int is_load,
+                                       int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  uint64_t const my_state = ((uint64_t)self->id << STATE_THRID_SHIFT)
+      | (is_load ? STATE_LOAD_MASK : 0)
+      | self->clock[self->id];
+  atomic_uint64_t* cell = get_shadow_cell(addr);
+  DBG("checking %s at %p (slots)", is_load ? "load" : "store", addr);
+  if (LIKELY(cell_has_state(cell, my_state, is_load)))
+    return;
+  handle_cell_slow(cell, addr, my_state, is_load, is_race_detected);
+}
+
 
+static void   handle_region_slots (addr_t begin,
+                                   addr_t end,
+                                   int is_load) {
+  int is_race_detected = 0;
+  uintptr_t p = (uintptr_t)begin & ~(uintptr_t)(RELITE_SHADOW_SLOTS - 1);
+  for (; p < (uintptr_t)end; p += RELITE_SHADOW_SLOTS)
+    handle_access_slots((addr_t)p, is_load, &is_race_detected);
+}
+#endif
+
+
+// flags: (size - 1) << 2, as in __tsan_handle_mop().
 void            relite_load    (addr_t addr, unsigned flags) {
-  int sz = 0;
+  size_t const size = ((flags >> 2) & 0xF) + 1;
   assert(addr != 0);
-  assert(sz < 4);
-  atomic_uint64_t* shadow = get_shadow(addr);
+  DBG("checking load at %p (flags=%u)", addr, flags);
+#ifdef RELITE_SHADOW_SLOTS
+  if (LIKELY(((uintptr_t)addr & (RELITE_SHADOW_SLOTS - 1)) + size
+      <= RELITE_SHADOW_SLOTS)) {
+    int is_race_detected = 0;
+    handle_access_slots(addr, 1, &is_race_detected);
+  } else {
+    handle_region_slots(addr, (char const volatile*)addr + size, 1);
+  }
+  return;
+#endif
+  handle_access(addr, size, 1);
+}
+
+
+void            relite_store   (addr_t addr, unsigned flags) {
+  size_t const size = ((flags >> 2) & 0xF) + 1;
+  assert(addr != 0);
+  DBG("checking store at %p (flags=%u)", addr, flags);
+#ifdef RELITE_SHADOW_SLOTS
+  if (LIKELY(((uintptr_t)addr & (RELITE_SHADOW_SLOTS - 1)) + size
+      <= RELITE_SHADOW_SLOTS)) {
+    int is_race_detected = 0;
+    handle_access_slots(addr, 0, &is_race_detected);
+  } else {
+    handle_region_slots(addr, (char const volatile*)addr + size, 0);
+  }
+  return;
+#endif
+  handle_access(addr, size, 0);
+}
+
+
+// The words of a region are processed by blocks of 8 shadow words
+// (an aligned 8-byte word of the application).
+// A block is skipped if its first word holds 'state' as an 8-byte access
+// and the rest of the words are not meaningful, which is what a region
+// access of the same thread in the same epoch leaves behind.
+#define REGION_BLOCK_SIZE       8
+
+static inline int region_block_is_checked(atomic_uint64_t const* block,
+                                          uint64_t state,
+                                          uint64_t alt_state) {
+  uint64_t const first = block[0].v;
+  if (first != state && first != alt_state)
+    return 0;
+#ifdef __SSE2__
+  __m128i const mask = _mm_set1_epi64x(STATE_SYNC_MASK | STATE_SIZE_MASK);
+  __m128i const first_lane = _mm_set_epi64x(0, -1);
+  __m128i rest = _mm_andnot_si128(first_lane,
+      _mm_load_si128((__m128i const*)block));
+  rest = _mm_or_si128(rest, _mm_load_si128((__m128i const*)(block + 2)));
+  rest = _mm_or_si128(rest, _mm_load_si128((__m128i const*)(block + 4)));
+  rest = _mm_or_si128(rest, _mm_load_si128((__m128i const*)(block + 6)));
+  rest = _mm_and_si128(rest, mask);
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(rest, _mm_setzero_si128()))
+      == 0xFFFF;
+#else
+  uint64_t rest = 0;
+  int i;
+  for (i = 1; i != REGION_BLOCK_SIZE; i += 1)
+    rest |= block[i].v;
+  return (rest & (STATE_SYNC_MASK | STATE_SIZE_MASK)) == 0;
+#endif
+}
+
+
+static inline void region_load_word(atomic_uint64_t* shadow,
+                                    addr_t addr,
+                                    uint64_t state_templ,
+                                    int* is_race_detected) {
+  relite_thr_t* self = g_thr;
+  timestamp_t const own_clock = self->own_clock;
   uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-  DBG("checking load at %p (flags=%u), state=%llx",
-      addr, flags, (unsigned long long)state);
   // ensure that the address was not used as a sync variable
   if (LIKELY((state & STATE_SYNC_MASK) == 0)) {
-    //size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
-    // ensure that the address is accessed with the expected size
-    // and that the access is aligned
-    //if (LIKELY((real_sz == sz) & is_aligned((uintptr_t)addr, sz))) {
+    // check that the address is occupied
+    size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
+    if (UNLIKELY(real_sz != SZ_8 || ((uintptr_t)shadow % 64) == 0)) {
       size_t prev_thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
-      relite_thr_t* self = g_thr;
+      timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
       // ensure that the previous access was from another thread
       if (UNLIKELY(prev_thrid != self->id)) {
         // ensure that the previous access was a store
-        if (UNLIKELY((state & STATE_LOAD_MASK) == 0)) {
-          timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
+        if (LIKELY((state & STATE_LOAD_MASK) == 0)) {
           // check for a race:
-          // the previous store should happen before current load
-          if (UNLIKELY(prev_ts > self->clock[prev_thrid])) {
-            relite_report(addr, state, 1);
+          // the previous access should happen before current store
+          if (UNLIKELY(prev_ts > (self->clock[prev_thrid]))) {
+            if (*is_race_detected == 0) {
+              *is_race_detected = 1;
+              relite_report(addr, state, 1);
+            }
           }
           // calculate and store new state
-          uint64_t const new_state = ((uint64_t)sz << STATE_SIZE_SHIFT)
-            | STATE_LOAD_MASK | ((uint64_t)self->id << STATE_THRID_SHIFT)
-            | self->clock[self->id];
+          uint64_t const new_state = state_templ
+              | ((uint64_t)real_sz << STATE_SIZE_SHIFT);
           atomic_uint64_store(shadow, new_state, memory_order_relaxed);
         } else {
-          // the previous access was a load,
-          // so do nothing
+          // the previous access was a load, so do nothing
         }
       } else {
         // the previous access was from the same thread,
         // if it was a load then update the timestamp
         // (if it was a store, then we better preserve the fact)
         if (LIKELY((state & STATE_LOAD_MASK) != 0)) {
-          uint64_t const new_state = (state & ~STATE_TIMESTAMP_MASK)
-            | self->clock[self->id];
-          atomic_uint64_store(shadow, new_state, memory_order_relaxed);
+          if (UNLIKELY(prev_ts != own_clock)) {
+            uint64_t const new_state = (state & ~STATE_TIMESTAMP_MASK)
+                | (state_templ & STATE_TIMESTAMP_MASK);
+            atomic_uint64_store(shadow, new_state, memory_order_relaxed);
+          }
         }
       }
-    //} else {
-    //  // the address is accessed with an unexpected size
-    //  // or the access is unaligned,
-    //  // so fall to slow-path to handle it
-    //  handle_load_slow(shadow, addr, sz);
-    //}
+    }
   } else {
     // the address was used as a sync variable,
     // so do not track races on it
@@ -401,129 +863,97 @@ void            relite_load    (addr_t addr, unsigned flags) {
 }
 
 
-void            relite_store   (addr_t addr, unsigned flags) {
-  int sz = 0;
-  assert(addr != 0);
-  assert(sz < 4);
-  atomic_uint64_t* shadow = get_shadow(addr);
-  uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-  DBG("checking store at %p (flags=%u), state=%llx",
-      addr, flags, (unsigned long long)state);
+// Returns non-zero if the state was stored.
+static inline int region_store_word(atomic_uint64_t* shadow,
+                                    addr_t addr,
+                                    uint64_t state_templ,
+                                    int* is_race_detected) {
   relite_thr_t* self = g_thr;
-  timestamp_t const own_clock = self->own_clock;
+  uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
   // ensure that the address was not used as a sync variable
   if (LIKELY((state & STATE_SYNC_MASK) == 0)) {
-    //size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
-    // ensure that the address is accessed with the expected size
-    // and that the access is aligned
-    //if (LIKELY((real_sz == sz) & is_aligned((uintptr_t)addr, sz))) {
+    // check that the address is occupied
+    size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
+    if (UNLIKELY(real_sz != SZ_8 || ((uintptr_t)shadow % 64) == 0)) {
       size_t prev_thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
-      timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
       // ensure that the previous access was from another thread
       if (UNLIKELY(prev_thrid != self->id)) {
+        timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
         // check for a race:
         // the previous access should happen before current store
         if (UNLIKELY(prev_ts > (self->clock[prev_thrid]))) {
           if (UNLIKELY(prev_ts != STATE_UNITIALIZED)) {
-            relite_report(addr, state, 0);
+            if (*is_race_detected == 0) {
+              *is_race_detected = 1;
+              relite_report(addr, state, 0);
+            }
           }
         }
-        // calculate and store new state
-        uint64_t const volatile new_state = ((uint64_t)sz << STATE_SIZE_SHIFT)
-            | ((uint64_t)self->id << STATE_THRID_SHIFT)
-            | self->clock[self->id];
-        atomic_uint64_store(shadow, new_state, memory_order_relaxed);
-      } else {
-        if (UNLIKELY(prev_ts != own_clock)) {
-          // calculate and store new state
-          uint64_t const volatile new_state = ((uint64_t)sz << STATE_SIZE_SHIFT)
-            | ((uint64_t)self->id << STATE_THRID_SHIFT)
-            | self->clock[self->id];
-          atomic_uint64_store(shadow, new_state, memory_order_relaxed);
-        }
       }
-    //} else {
-    //  // the address is accessed with an unexpected size
-    //  // or the access is unaligned,
-    //  // so fall to slow-path to handle it
-    //  handle_store_slow(shadow, addr, sz);
-    //}
+      // calculate and store new state
+      uint64_t const new_state = state_templ
+          | ((uint64_t)real_sz << STATE_SIZE_SHIFT);
+      atomic_uint64_store(shadow, new_state, memory_order_relaxed);
+    }
+    return 1;
   } else {
     // the address was used as a sync variable,
     // so do not track races on it
+    return 0;
   }
 }
 
 
 void                    handle_region_load  (void const volatile* begin,
                                              void const volatile* end) {
+  ensure_shadow();
   //TODO(dvyukov): properly handle unaligned head and tail of the region
   assert(begin != 0 && begin <= end);
   DBG("checking region load %p-%p", begin, end);
+#ifdef RELITE_SHADOW_SLOTS
+  handle_region_slots(begin, end, 1);
+  return;
+#endif
   relite_thr_t* self = g_thr;
   uint64_t const my_ts = self->clock[self->id];
   uint64_t const state_templ = ((uint64_t)self->id << STATE_THRID_SHIFT)
       | STATE_LOAD_MASK
       | my_ts;
-  timestamp_t const own_clock = self->own_clock;
   int is_race_detected = 0;
   atomic_uint64_t* shadow = get_shadow(begin);
   atomic_uint64_t* shadow_end = get_shadow(end);
+  atomic_uint64_t* const shadow_begin = shadow;
   assert(shadow <= shadow_end);
-  for (; shadow != shadow_end; shadow += 1) {
-    uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-    // ensure that the address was not used as a sync variable
-    if (LIKELY((state & STATE_SYNC_MASK) == 0)) {
-      // check that the address is occupied
-      size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
-      if (UNLIKELY(real_sz != SZ_8 || ((uintptr_t)shadow % 64) == 0)) {
-        size_t prev_thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
-        timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
-        // ensure that the previous access was from another thread
-        if (UNLIKELY(prev_thrid != self->id)) {
-          // ensure that the previous access was a store
-          if (LIKELY((state & STATE_LOAD_MASK) == 0)) {
-            // check for a race:
-            // the previous access should happen before current store
-            if (UNLIKELY(prev_ts > (self->clock[prev_thrid]))) {
-              if (is_race_detected == 0) {
-                is_race_detected = 1;
-                relite_report(begin + (shadow - get_shadow(begin)), state, 1);
-              }
-            }
-            // calculate and store new state
-            uint64_t const new_state = state_templ
-                | ((uint64_t)real_sz << STATE_SIZE_SHIFT);
-            atomic_uint64_store(shadow, new_state, memory_order_relaxed);
-          } else {
-            // the previous access was a load, so do nothing
-          }
-        } else {
-          // the previous access was from the same thread,
-          // if it was a load then update the timestamp
-          // (if it was a store, then we better preserve the fact)
-          if (LIKELY((state & STATE_LOAD_MASK) != 0)) {
-            if (UNLIKELY(prev_ts != own_clock)) {
-              uint64_t const new_state = (state & ~STATE_TIMESTAMP_MASK)
-                  | my_ts;
-              atomic_uint64_store(shadow, new_state, memory_order_relaxed);
-            }
-          }
-        }
-      }
-    } else {
-      // the address was used as a sync variable,
-      // so do not track races on it
-    }
+  for (; shadow != shadow_end && ((uintptr_t)shadow % 64) != 0; shadow += 1)
+    region_load_word(shadow, begin + (shadow - shadow_begin),
+                     state_templ, &is_race_detected);
+  // a load is done if there is my load or my store
+  for (; shadow_end - shadow >= REGION_BLOCK_SIZE;
+      shadow += REGION_BLOCK_SIZE) {
+    if (LIKELY(region_block_is_checked(shadow, state_templ,
+                                       state_templ & ~STATE_LOAD_MASK)))
+      continue;
+    int i;
+    for (i = 0; i != REGION_BLOCK_SIZE; i += 1)
+      region_load_word(shadow + i, begin + (shadow + i - shadow_begin),
+                       state_templ, &is_race_detected);
   }
+  for (; shadow != shadow_end; shadow += 1)
+    region_load_word(shadow, begin + (shadow - shadow_begin),
+                     state_templ, &is_race_detected);
 }
 
 
 void                    handle_region_store (void const volatile* begin,
                                              void const volatile* end) {
+  ensure_shadow();
   //TODO(dvyukov): properly handle unaligned head and tail of the region
   assert(begin != 0 && begin <= end);
   DBG("checking region store %p-%p", begin, end);
+#ifdef RELITE_SHADOW_SLOTS
+  handle_region_slots(begin, end, 0);
+  return;
+#endif
   relite_thr_t* self = g_thr;
   uint64_t const my_ts = self->clock[self->id];
   uint64_t const state_templ = ((uint64_t)self->id << STATE_THRID_SHIFT)
@@ -531,45 +961,48 @@ void                    handle_region_store (void const volatile* begin,
   int is_race_detected = 0;
   atomic_uint64_t* shadow = get_shadow(begin);
   atomic_uint64_t* shadow_end = get_shadow(end);
+  atomic_uint64_t* const shadow_begin = shadow;
   assert(shadow <= shadow_end);
-  for (; shadow != shadow_end; shadow += 1) {
-    uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
-    // ensure that the address was not used as a sync variable
-    if (LIKELY((state & STATE_SYNC_MASK) == 0)) {
-      // check that the address is occupied
-      size_t const real_sz = (state & STATE_SIZE_MASK) >> STATE_SIZE_SHIFT;
-      if (UNLIKELY(real_sz != SZ_8 || ((uintptr_t)shadow % 64) == 0)) {
-        size_t prev_thrid = (state & STATE_THRID_MASK) >> STATE_THRID_SHIFT;
-        // ensure that the previous access was from another thread
-        if (UNLIKELY(prev_thrid != self->id)) {
-          timestamp_t prev_ts = (state & STATE_TIMESTAMP_MASK);
-          // check for a race:
-          // the previous access should happen before current store
-          if (UNLIKELY(prev_ts > (self->clock[prev_thrid]))) {
-            if (UNLIKELY(prev_ts != STATE_UNITIALIZED)) {
-              if (is_race_detected == 0) {
-                is_race_detected = 1;
-                relite_report(begin + (shadow - get_shadow(begin)), state, 0);
-              }
-            }
-          }
-        }
-        // calculate and store new state
-        uint64_t const new_state = state_templ
-            | ((uint64_t)real_sz << STATE_SIZE_SHIFT);
-        atomic_uint64_store(shadow, new_state, memory_order_relaxed);
-      }
-    } else {
-      // the address was used as a sync variable,
-      // so do not track races on it
+  for (; shadow != shadow_end && ((uintptr_t)shadow % 64) != 0; shadow += 1)
+    region_store_word(shadow, begin + (shadow - shadow_begin),
+                      state_templ, &is_race_detected);
+  for (; shadow_end - shadow >= REGION_BLOCK_SIZE;
+      shadow += REGION_BLOCK_SIZE) {
+    if (LIKELY(region_block_is_checked(shadow, state_templ, state_templ)))
+      continue;
+    int is_sync = 0;
+    int i;
+    for (i = 0; i != REGION_BLOCK_SIZE; i += 1)
+      is_sync |= region_store_word(shadow + i,
+                                   begin + (shadow + i - shadow_begin),
+                                   state_templ, &is_race_detected) == 0;
+    // the whole word is stored, so it supersedes the narrower accesses,
+    // make the block look like one 8-byte store to skip it next time
+    if (LIKELY(is_sync == 0)) {
+      uint64_t const new_state = state_templ
+          | ((uint64_t)SZ_8 << STATE_SIZE_SHIFT);
+#ifdef __SSE2__
+      __m128i const v = _mm_set1_epi64x(new_state);
+      _mm_store_si128((__m128i*)shadow, v);
+      _mm_store_si128((__m128i*)(shadow + 2), v);
+      _mm_store_si128((__m128i*)(shadow + 4), v);
+      _mm_store_si128((__m128i*)(shadow + 6), v);
+#else
+      for (i = 0; i != REGION_BLOCK_SIZE; i += 1)
+        atomic_uint64_store(shadow + i, new_state, memory_order_relaxed);
+#endif
     }
   }
+  for (; shadow != shadow_end; shadow += 1)
+    region_store_word(shadow, begin + (shadow - shadow_begin),
+                      state_templ, &is_race_detected);
 }
 
 
 void                    handle_mem_init     (addr_t begin,
                                              addr_t end,
                                              state_t state) {
+  ensure_shadow();
   assert(begin != 0 && begin <= end);
   uint64_t const state_templ = state | ((state_t)SZ_1 << STATE_SIZE_SHIFT);
   atomic_uint64_t* shadow = get_shadow(begin);
@@ -583,6 +1016,7 @@ void                    handle_mem_init     (addr_t begin,
 
 void                    handle_mem_alloc    (addr_t begin,
                                              addr_t end) {
+  ensure_shadow();
   assert(begin != 0 && begin <= end);
   relite_thr_t* self = g_thr;
   uint64_t const state_templ = ((uint64_t)SZ_8 << STATE_SIZE_SHIFT)
@@ -591,14 +1025,24 @@ void                    handle_mem_alloc    (addr_t begin,
   atomic_uint64_t* shadow = get_shadow(begin);
   atomic_uint64_t* shadow_end = get_shadow(end);
   assert(shadow <= shadow_end);
+#ifdef RELITE_SHADOW_SLOTS
+  // the allocation is the only access, the rest of the slots are empty
+  uintptr_t p = (uintptr_t)begin;
+  for (; shadow != shadow_end; shadow += 1, p += 1) {
+    uint64_t const state = (p % RELITE_SHADOW_SLOTS) == 0 ? state_templ : 0;
+    atomic_uint64_store(shadow, state, memory_order_relaxed);
+  }
+#else
   for (; shadow != shadow_end; shadow += 1) {
     atomic_uint64_store(shadow, state_templ, memory_order_relaxed);
   }
+#endif
 }
 
 
 void                    handle_mem_free     (addr_t begin,
                                              addr_t end) {
+  ensure_shadow();
   //TODO(dvyukov): properly handle unaligned head and tail of the region
   assert(begin != 0 && begin <= end);
   relite_thr_t* self = g_thr;
@@ -633,11 +1077,11 @@ void                    handle_mem_free     (addr_t begin,
 
 
 void            handle_sync_create   (addr_t addr) {
+  ensure_shadow();
   DBG("sync_create at %p", addr);
-  rl_rt_sync_t* sync = relite_malloc(sizeof(rl_rt_sync_t));
+  rl_rt_sync_t* sync = sync_alloc();
   if (sync == 0)
     return;
-  relite_memset(sync, 0, sizeof(rl_rt_sync_t));
   //!!! assert(sync);
   assert(((uint64_t)sync & STATE_SYNC_MASK) == 0);
   atomic_uint64_t* shadow = get_shadow(addr);
@@ -647,6 +1091,7 @@ void            handle_sync_create   (addr_t addr) {
 
 
 void                    handle_sync_destroy (addr_t addr) {
+  ensure_shadow();
   atomic_uint64_t* shadow = get_shadow(addr);
   uint64_t const state = atomic_uint64_load(shadow, memory_order_relaxed);
   DBG("sync_destroy at %p, state=%llx", addr, (unsigned long long)state);
@@ -654,13 +1099,14 @@ void                    handle_sync_destroy (addr_t addr) {
     return;
   rl_rt_sync_t* sync = (rl_rt_sync_t*)(state & ~STATE_SYNC_MASK);
   assert(sync != 0);
-  relite_free(sync);
+  sync_free(sync);
   //TODO(dvyukov): mute use CAS,
   // otherwise 2 threads(rl_rt_sync_t*)(state & ~STATE_SYNC_MASK) can free sync simultaneously
 }
 
 
 void            handle_sync_acquire  (addr_t addr, int is_mtx) {
+  ensure_shadow();
   //TODO(dvyukov): add scheduler shake
   // however, it should be placed *before* the load
   atomic_uint64_t* shadow = get_shadow(addr);
@@ -670,11 +1116,13 @@ void            handle_sync_acquire  (addr_t addr, int is_mtx) {
     return;
   rl_rt_sync_t* sync = (rl_rt_sync_t*)(state & ~STATE_SYNC_MASK);
   relite_thr_t* self = g_thr;
-  clock_assign_max(self->clock, sync->clock);
+  clock_assign_max(self->clock, &self->clock_size,
+                   sync->clock, sync->clock_size);
 }
 
 
 void            handle_sync_release  (addr_t addr, int is_mtx) {
+  ensure_shadow();
   if (is_mtx == 0)
     relite_sched_shake();
   atomic_uint64_t* shadow = get_shadow(addr);
@@ -682,10 +1130,9 @@ void            handle_sync_release  (addr_t addr, int is_mtx) {
   DBG("release at %p, state=%llx", addr, (unsigned long long)state);
   rl_rt_sync_t* sync;
   if ((state & STATE_SYNC_MASK) == 0) {
-    sync = relite_malloc(sizeof(rl_rt_sync_t));
+    sync = sync_alloc();
     if (sync == 0)
       return;
-    relite_memset(sync, 0, sizeof(rl_rt_sync_t));
     uint64_t new_state = STATE_SYNC_MASK | (uint64_t)sync;
     //TODO(dvyukov): perhaps it's better to do that with CAS
     // in order to prevent potential races and memory leaks
@@ -696,7 +1143,10 @@ void            handle_sync_release  (addr_t addr, int is_mtx) {
   relite_thr_t* self = g_thr;
   self->own_clock += 1;
   self->clock[self->id] += 1;
-  clock_assign_max(sync->clock, self->clock);
+  if (sync_reserve_clock(sync, self->clock_size) == 0)
+    relite_fatal("failed to allocate sync object clock");
+  clock_assign_max(sync->clock, &sync->clock_size,
+                   self->clock, self->clock_size);
 }
 
 
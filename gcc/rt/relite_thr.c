@@ -71,8 +71,8 @@ relite_thr_t*           relite_thr_init     () {
     cache->free_head = cache->free_head->prev;
     cache->free_head->next = 0;
     cache->free_count -= 1;
-    int i;
-    for (i = 0; i != MAX_THREADS; i += 1) {
+    size_t i;
+    for (i = 0; i != thr->clock_size; i += 1) {
       thr->clock[i] = 0;
     }
   } else if (cache->total_count < MAX_THREADS) {
@@ -113,6 +113,7 @@ relite_thr_t*           relite_thr_init     () {
   relite_dbg_tid = thr->id;
   thr->own_clock += 1;
   thr->clock[thr->id] = thr->own_clock;
+  thr->clock_size = thr->id + 1;
   return thr;
 }
 
@@ -29,6 +29,7 @@
 #define RELITE_THR_H_INCLUDED
 
 #include "relite_defs.h"
+#include <stddef.h>
 
 
 typedef struct relite_thr_t {
@@ -37,6 +38,8 @@ typedef struct relite_thr_t {
   thrid_t                                   id;
   unsigned                                  rand;
   timestamp_t                               own_clock;
+  // Only the first clock_size elements of clock may be non-zero.
+  size_t                                    clock_size;
   timestamp_t                               clock [MAX_THREADS];
 } relite_thr_t;
 
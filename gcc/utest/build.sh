@@ -1,4 +1,3 @@
 ${GCCTSAN_GCC_BIN} -c -fno-inline -fno-exceptions -fplugin=../plg/Debug/librelite.so -include../rt/relite_rt.h main.cc
 ${GCCTSAN_GCC_BIN} -o test -lpthread -lstdc++ -L../rt/Debug -lrelitert main.o
-
-
+${GCCTSAN_GCC_BIN} -O2 -o mop_bench -lpthread -lstdc++ -L../rt/Debug -lrelitert mop_bench.cc
@@ -0,0 +1,82 @@
+/* Relite
+ * Copyright (c) 2011, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// The cost of relite_load()/relite_store() for all the sizes and offsets
+// within an 8-byte word, the accesses are not instrumented,
+// the runtime is called directly.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../rt/relite_rt.h"
+
+static int const iter_count = 10000000;
+
+static char volatile buf [64] __attribute__((aligned(64)));
+
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// Returns the average time of the access in ns.
+static double bench(size_t size, size_t offset, bool is_load) {
+  void const volatile* addr = buf + 8 + offset;
+  unsigned const flags = (unsigned)(size - 1) << 2;
+  double const start = now();
+  if (is_load) {
+    for (int i = 0; i != iter_count; i += 1)
+      relite_load(addr, flags);
+  } else {
+    for (int i = 0; i != iter_count; i += 1)
+      relite_store(addr, flags);
+  }
+  return (now() - start) / iter_count;
+}
+
+
+int main() {
+  static size_t const sizes [] = {1, 2, 4, 8};
+  for (int is_load = 1; is_load >= 0; is_load -= 1) {
+    printf("%s, ns per access\n", is_load ? "load" : "store");
+    printf("size/offset");
+    for (size_t offset = 0; offset != 8; offset += 1)
+      printf("%7d", (int)offset);
+    printf("\n");
+    for (size_t s = 0; s != sizeof(sizes)/sizeof(sizes[0]); s += 1) {
+      printf("%11d", (int)sizes[s]);
+      for (size_t offset = 0; offset != 8; offset += 1)
+        printf("%7.1f", bench(sizes[s], offset, is_load != 0));
+      printf("\n");
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -11,8 +11,11 @@
 
 int GLOB = 0;
 
+// Usage: main [index_dir]
+// With index_dir the addresses are looked up in the symbol indices first.
 int main(int argc, char *argv[]) {
-  SymbolTable *st = new SymbolTable(argv[0]);
+  const char *index_dir = argc > 1 ? argv[1] : NULL;
+  SymbolTable *st = new SymbolTable(argv[0], index_dir);
   char symbol[100], file[1000];
   int line;
   typedef void*(malloc_fun)(size_t);
@@ -27,8 +30,8 @@ int main(int argc, char *argv[]) {
   };
   for (int i = 0; i < sizeof(addresses) / sizeof(void*); ++i) {
     void *addr = addresses[i];
-    if (st->GetAddrInfoNocache(addr, symbol, sizeof(symbol),
-                               file, sizeof(file), &line)) {
+    if (st->GetAddrInfo(addr, symbol, sizeof(symbol),
+                        file, sizeof(file), &line)) {
       printf("%p is <%s> at line %d of %s\n", addr, symbol, line, file);
     } else {
       printf("symbolization of %p failed\n", addr);
@@ -0,0 +1,625 @@
+// Copyright (c) 2011, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// SymbolIndex implementation: reading the ELF symbols and the DWARF line
+// table (versions 2 to 5) and the index file.
+
+#include "symbol_index.h"
+
+#include <assert.h>
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+static const char kIndexMagic[8] = {'S', 'Y', 'M', 'I', 'D', 'X', '0', '1'};
+static const int kMaxIndexSegments = 16;
+
+struct SymbolIndex::IndexSegment {
+  uint64_t offset;
+  uint64_t vaddr;
+};
+
+struct SymbolIndex::IndexHeader {
+  char magic[8];
+  uint64_t binary_size;
+  uint64_t binary_mtime;
+  uint32_t is_pic;
+  uint32_t n_segments;
+  IndexSegment segments[kMaxIndexSegments];
+  uint64_t n_symbols, symbols_offset;
+  uint64_t n_lines, lines_offset;
+  uint64_t n_files, files_offset;
+  uint64_t strings_size, strings_offset;
+};
+
+struct SymbolIndex::IndexSymbol {
+  uint64_t addr;
+  uint64_t size;
+  uint32_t name;  // Offset in the strings.
+  uint32_t pad;
+};
+
+struct SymbolIndex::IndexLine {
+  uint64_t addr;
+  uint32_t file;  // Index in the files.
+  uint32_t line;  // 0 ends a sequence.
+};
+
+namespace {
+
+struct Symbol {
+  uint64_t addr, size;
+  std::string name;
+  bool operator<(const Symbol &other) const { return addr < other.addr; }
+};
+
+struct LineRow {
+  uint64_t addr;
+  uint32_t file, line;
+  // The end of a sequence goes before a row starting at the same address.
+  bool operator<(const LineRow &other) const {
+    if (addr != other.addr) return addr < other.addr;
+    return (line != 0) < (other.line != 0);
+  }
+};
+
+// What the builder collects from the binary.
+struct IndexData {
+  bool is_pic;
+  std::vector<std::pair<uint64_t, uint64_t> > segments;  // (offset, vaddr)
+  std::vector<Symbol> symbols;
+  std::vector<LineRow> lines;
+  std::vector<std::string> files;
+};
+
+// A section of the binary.
+struct Section {
+  const uint8_t *data;
+  size_t size;
+};
+
+// DWARF line table.
+class DwarfReader {
+ public:
+  DwarfReader(const uint8_t *p, const uint8_t *end) : p_(p), end_(end) { }
+  bool ok() const { return p_ <= end_; }
+  bool done() const { return p_ >= end_; }
+  const uint8_t *pos() const { return p_; }
+  void Seek(const uint8_t *p) { p_ = p; }
+  void Skip(size_t n) { p_ += n; }
+
+  uint64_t Fixed(int n) {
+    uint64_t x = 0;
+    if (p_ + n > end_) { p_ = end_ + 1; return 0; }
+    for (int i = 0; i < n; i++)  // Little-endian only.
+      x |= (uint64_t)p_[i] << (8 * i);
+    p_ += n;
+    return x;
+  }
+  uint64_t U8() { return Fixed(1); }
+  uint64_t U16() { return Fixed(2); }
+  uint64_t U32() { return Fixed(4); }
+
+  uint64_t Uleb() {
+    uint64_t x = 0;
+    for (int shift = 0; p_ < end_; shift += 7) {
+      uint8_t b = *p_++;
+      if (shift < 64) x |= (uint64_t)(b & 0x7f) << shift;
+      if (b < 0x80) return x;
+    }
+    p_ = end_ + 1;
+    return 0;
+  }
+
+  int64_t Sleb() {
+    int64_t x = 0;
+    int shift = 0;
+    uint8_t b = 0x80;
+    while (p_ < end_ && (b & 0x80)) {
+      b = *p_++;
+      if (shift < 64) x |= (int64_t)(b & 0x7f) << shift;
+      shift += 7;
+    }
+    if (b & 0x80) { p_ = end_ + 1; return 0; }
+    if (shift < 64 && (b & 0x40)) x |= -((int64_t)1 << shift);
+    return x;
+  }
+
+  const char *String() {
+    const char *s = (const char*)p_;
+    while (p_ < end_ && *p_) p_++;
+    if (p_ >= end_) { p_ = end_ + 1; return ""; }
+    p_++;
+    return s;
+  }
+
+ private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+static const char *SectionString(const Section &section, uint64_t offset) {
+  if (!section.data || offset >= section.size) return "";
+  const char *s = (const char*)section.data + offset;
+  if (!memchr(s, 0, section.size - offset)) return "";
+  return s;
+}
+
+enum {
+  kDwFormBlock = 0x09, kDwFormData1 = 0x0b, kDwFormData2 = 0x05,
+  kDwFormData4 = 0x06, kDwFormData8 = 0x07, kDwFormData16 = 0x1e,
+  kDwFormString = 0x08, kDwFormStrp = 0x0e, kDwFormUdata = 0x0f,
+  kDwFormLineStrp = 0x1f,
+  kDwLnctPath = 1, kDwLnctDirectoryIndex = 2
+};
+
+// Reads an entry of a DWARF 5 directory or file name table.
+static bool ReadEntry(DwarfReader *r, const std::vector<uint64_t> &format,
+                      bool dwarf64, const Section &debug_str,
+                      const Section &debug_line_str,
+                      std::string *path, uint64_t *dir) {
+  for (size_t i = 0; i < format.size(); i += 2) {
+    uint64_t type = format[i], form = format[i + 1];
+    uint64_t value = 0;
+    const char *str = NULL;
+    switch (form) {
+      case kDwFormString: str = r->String(); break;
+      case kDwFormStrp:
+        str = SectionString(debug_str, r->Fixed(dwarf64 ? 8 : 4));
+        break;
+      case kDwFormLineStrp:
+        str = SectionString(debug_line_str, r->Fixed(dwarf64 ? 8 : 4));
+        break;
+      case kDwFormUdata: value = r->Uleb(); break;
+      case kDwFormData1: value = r->U8(); break;
+      case kDwFormData2: value = r->U16(); break;
+      case kDwFormData4: value = r->U32(); break;
+      case kDwFormData8: value = r->Fixed(8); break;
+      case kDwFormData16: r->Skip(16); break;
+      case kDwFormBlock: r->Skip(r->Uleb()); break;
+      default: return false;
+    }
+    if (type == kDwLnctPath && str) *path = str;
+    if (type == kDwLnctDirectoryIndex) *dir = value;
+  }
+  return r->ok();
+}
+
+static std::string JoinPath(const std::string &dir, const std::string &name) {
+  if (dir.empty() || name.empty() || name[0] == '/') return name;
+  return dir + "/" + name;
+}
+
+// Appends the rows of all the line programs in .debug_line to 'data'.
+static void ReadLineTable(const Section &debug_line, const Section &debug_str,
+                          const Section &debug_line_str, IndexData *data) {
+  DwarfReader r(debug_line.data, debug_line.data + debug_line.size);
+  while (!r.done() && r.ok()) {
+    uint64_t unit_length = r.U32();
+    bool dwarf64 = false;
+    if (unit_length == 0xffffffff) {
+      unit_length = r.Fixed(8);
+      dwarf64 = true;
+    }
+    const uint8_t *unit_end = r.pos() + unit_length;
+    if (!r.ok() || unit_end > debug_line.data + debug_line.size) return;
+    int version = r.U16();
+    if (version < 2 || version > 5) {
+      r.Seek(unit_end);
+      continue;
+    }
+    if (version >= 5) r.Skip(2);  // address_size, segment_selector_size.
+    uint64_t header_length = r.Fixed(dwarf64 ? 8 : 4);
+    const uint8_t *program = r.pos() + header_length;
+    int min_inst_length = r.U8();
+    if (version >= 4) r.U8();  // maximum_operations_per_instruction.
+    bool default_is_stmt = r.U8();
+    (void)default_is_stmt;
+    int line_base = (int8_t)r.U8();
+    int line_range = r.U8();
+    int opcode_base = r.U8();
+    std::vector<int> opcode_lengths(opcode_base > 0 ? opcode_base : 1);
+    for (int i = 1; i < opcode_base; i++)
+      opcode_lengths[i] = r.U8();
+    if (!r.ok() || line_range == 0) return;
+
+    // The unit's file names become indices in data->files.
+    std::vector<uint32_t> files;
+    std::vector<std::string> dirs;
+    if (version < 5) {
+      dirs.push_back("");
+      while (true) {
+        const char *dir = r.String();
+        if (!*dir || !r.ok()) break;
+        dirs.push_back(dir);
+      }
+      files.push_back(0);  // The file numbers are 1-based.
+      while (true) {
+        std::string name = r.String();
+        if (name.empty() || !r.ok()) break;
+        uint64_t dir = r.Uleb();
+        r.Uleb();  // mtime.
+        r.Uleb();  // length.
+        files.push_back(data->files.size());
+        data->files.push_back(
+            JoinPath(dir < dirs.size() ? dirs[dir] : "", name));
+      }
+    } else {
+      for (int table = 0; table < 2; table++) {
+        std::vector<uint64_t> format(2 * r.U8());
+        for (size_t i = 0; i < format.size(); i++)
+          format[i] = r.Uleb();
+        uint64_t count = r.Uleb();
+        for (uint64_t i = 0; i < count && r.ok(); i++) {
+          std::string path;
+          uint64_t dir = 0;
+          if (!ReadEntry(&r, format, dwarf64, debug_str, debug_line_str,
+                         &path, &dir)) {
+            r.Seek(unit_end + 1);
+            break;
+          }
+          if (table == 0) {
+            dirs.push_back(path);
+          } else {
+            files.push_back(data->files.size());
+            // Directory 0 is the compilation directory; gdb shows the
+            // names relative to it as they are.
+            data->files.push_back(
+                JoinPath(dir > 0 && dir < dirs.size() ? dirs[dir] : "",
+                         path));
+          }
+        }
+      }
+    }
+    if (!r.ok() || program > unit_end) return;
+
+    // Run the line program.
+    r.Seek(program);
+    uint64_t address = 0, file = 1, line = 1;
+    while (r.pos() < unit_end && r.ok()) {
+      int op = r.U8();
+      bool emit = false;
+      if (op >= opcode_base) {
+        int adj = op - opcode_base;
+        address += (adj / line_range) * min_inst_length;
+        line += line_base + adj % line_range;
+        emit = true;
+      } else if (op == 0) {
+        uint64_t len = r.Uleb();
+        const uint8_t *next = r.pos() + len;
+        int sub_op = len ? r.U8() : 0;
+        if (sub_op == 1) {  // DW_LNE_end_sequence.
+          LineRow row = { address, 0, 0 };
+          data->lines.push_back(row);
+          address = 0;
+          file = 1;
+          line = 1;
+        } else if (sub_op == 2) {  // DW_LNE_set_address.
+          address = r.Fixed(len - 1);
+        }
+        r.Seek(next);
+      } else {
+        switch (op) {
+          case 1: emit = true; break;  // DW_LNS_copy.
+          case 2: address += r.Uleb() * min_inst_length; break;
+          case 3: line += r.Sleb(); break;
+          case 4: file = r.Uleb(); break;
+          case 8:  // DW_LNS_const_add_pc.
+            address += ((255 - opcode_base) / line_range) * min_inst_length;
+            break;
+          case 9: address += r.U16(); break;  // DW_LNS_fixed_advance_pc.
+          default:
+            for (int i = 0; i < opcode_lengths[op]; i++)
+              r.Uleb();
+        }
+      }
+      if (emit && file < files.size() && line > 0) {
+        LineRow row = { address, files[file], (uint32_t)line };
+        data->lines.push_back(row);
+      }
+    }
+    r.Seek(unit_end);
+  }
+}
+
+// ELF.
+template <class Ehdr, class Phdr, class Shdr, class Sym>
+static bool ReadElf(const uint8_t *image, size_t size, IndexData *data) {
+  const Ehdr *ehdr = (const Ehdr*)image;
+  if (size < sizeof(Ehdr) || ehdr->e_shoff + (uint64_t)ehdr->e_shnum *
+                             sizeof(Shdr) > size ||
+      ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Phdr) > size)
+    return false;
+  data->is_pic = ehdr->e_type == ET_DYN;
+  const Phdr *phdrs = (const Phdr*)(image + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD)
+      data->segments.push_back(std::make_pair((uint64_t)phdrs[i].p_offset,
+                                              (uint64_t)phdrs[i].p_vaddr));
+  }
+  const Shdr *shdrs = (const Shdr*)(image + ehdr->e_shoff);
+  if (ehdr->e_shstrndx >= ehdr->e_shnum) return false;
+  Section shstrtab = { image + shdrs[ehdr->e_shstrndx].sh_offset,
+                       shdrs[ehdr->e_shstrndx].sh_size };
+  Section debug_line = { NULL, 0 }, debug_str = { NULL, 0 },
+          debug_line_str = { NULL, 0 };
+  const Shdr *symtab = NULL, *dynsym = NULL;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    const Shdr &shdr = shdrs[i];
+    if (shdr.sh_type != SHT_NOBITS && shdr.sh_offset + shdr.sh_size > size)
+      continue;
+    if (shdr.sh_type == SHT_SYMTAB) symtab = &shdr;
+    if (shdr.sh_type == SHT_DYNSYM) dynsym = &shdr;
+    if (shdr.sh_flags & SHF_COMPRESSED) continue;
+    const char *name = SectionString(shstrtab, shdr.sh_name);
+    Section section = { image + shdr.sh_offset, shdr.sh_size };
+    if (!strcmp(name, ".debug_line")) debug_line = section;
+    if (!strcmp(name, ".debug_str")) debug_str = section;
+    if (!strcmp(name, ".debug_line_str")) debug_line_str = section;
+  }
+
+  if (!symtab) symtab = dynsym;
+  if (symtab && symtab->sh_link < ehdr->e_shnum) {
+    const Shdr &strtab_shdr = shdrs[symtab->sh_link];
+    Section strtab = { image + strtab_shdr.sh_offset, strtab_shdr.sh_size };
+    const Sym *syms = (const Sym*)(image + symtab->sh_offset);
+    size_t n_syms = symtab->sh_size / sizeof(Sym);
+    for (size_t i = 0; i < n_syms; i++) {
+      int type = syms[i].st_info & 0xf;
+      if ((type != STT_FUNC && type != STT_OBJECT) ||
+          syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0)
+        continue;
+      const char *name = SectionString(strtab, syms[i].st_name);
+      if (!*name) continue;
+      Symbol symbol;
+      symbol.addr = syms[i].st_value;
+      symbol.size = syms[i].st_size;
+      int status = 0;
+      char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+      symbol.name = status == 0 && demangled ? demangled : name;
+      free(demangled);
+      data->symbols.push_back(symbol);
+    }
+  }
+  if (debug_line.data)
+    ReadLineTable(debug_line, debug_str, debug_line_str, data);
+  return true;
+}
+
+static bool ReadBinary(const uint8_t *image, size_t size, IndexData *data) {
+  if (size < EI_NIDENT || memcmp(image, ELFMAG, SELFMAG) != 0) return false;
+  if (image[EI_CLASS] == ELFCLASS64)
+    return ReadElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Sym>(image, size,
+                                                                  data);
+  return ReadElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Sym>(image, size,
+                                                                data);
+}
+
+template <class T>
+static void Append(std::string *out, const T *items, size_t n) {
+  out->append((const char*)items, n * sizeof(T));
+}
+
+}  // namespace
+
+SymbolIndex::SymbolIndex() : data_(NULL), size_(0) { }
+
+SymbolIndex::~SymbolIndex() {
+  if (data_) munmap((void*)data_, size_);
+}
+
+bool SymbolIndex::Map(const char *path, size_t binary_size,
+                      uint64_t binary_mtime) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  const IndexHeader *h = (const IndexHeader*)data;
+  if (memcmp(h->magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+      h->binary_size != binary_size || h->binary_mtime != binary_mtime ||
+      h->strings_offset + h->strings_size != (uint64_t)st.st_size) {
+    munmap(data, st.st_size);
+    return false;
+  }
+  data_ = (const char*)data;
+  size_ = st.st_size;
+  return true;
+}
+
+bool SymbolIndex::Open(const char *binary, const char *index_dir) {
+  struct stat st;
+  if (stat(binary, &st) != 0) return false;
+  std::string index_path = binary;
+  for (size_t i = 0; i < index_path.size(); i++) {
+    if (index_path[i] == '/') index_path[i] = '_';
+  }
+  index_path = std::string(index_dir) + "/" + index_path + ".symidx";
+  if (Map(index_path.c_str(), st.st_size, st.st_mtime)) return true;
+
+  // Build the index.
+  int fd = open(binary, O_RDONLY);
+  if (fd < 0) return false;
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) return false;
+  IndexData data;
+  bool ok = ReadBinary((const uint8_t*)image, st.st_size, &data);
+  munmap(image, st.st_size);
+  if (!ok) return false;
+
+  std::sort(data.symbols.begin(), data.symbols.end());
+  std::stable_sort(data.lines.begin(), data.lines.end());
+  std::string strings;
+  std::map<std::string, uint32_t> string_offsets;
+  std::vector<IndexSymbol> symbols(data.symbols.size());
+  for (size_t i = 0; i < symbols.size(); i++) {
+    const Symbol &symbol = data.symbols[i];
+    std::map<std::string, uint32_t>::iterator it =
+        string_offsets.find(symbol.name);
+    if (it == string_offsets.end()) {
+      it = string_offsets.insert(
+          std::make_pair(symbol.name, (uint32_t)strings.size())).first;
+      strings.append(symbol.name.c_str(), symbol.name.size() + 1);
+    }
+    IndexSymbol s = { symbol.addr, symbol.size, it->second, 0 };
+    symbols[i] = s;
+  }
+  std::vector<uint32_t> files(data.files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    files[i] = strings.size();
+    strings.append(data.files[i].c_str(), data.files[i].size() + 1);
+  }
+  std::vector<IndexLine> lines(data.lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    IndexLine l = { data.lines[i].addr, data.lines[i].file,
+                    data.lines[i].line };
+    lines[i] = l;
+  }
+
+  IndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kIndexMagic, sizeof(kIndexMagic));
+  h.binary_size = st.st_size;
+  h.binary_mtime = st.st_mtime;
+  h.is_pic = data.is_pic;
+  h.n_segments = std::min(data.segments.size(), (size_t)kMaxIndexSegments);
+  for (uint32_t i = 0; i < h.n_segments; i++) {
+    h.segments[i].offset = data.segments[i].first;
+    h.segments[i].vaddr = data.segments[i].second;
+  }
+  h.n_symbols = symbols.size();
+  h.symbols_offset = sizeof(h);
+  h.n_lines = lines.size();
+  h.lines_offset = h.symbols_offset + symbols.size() * sizeof(IndexSymbol);
+  h.n_files = files.size();
+  h.files_offset = h.lines_offset + lines.size() * sizeof(IndexLine);
+  h.strings_size = strings.size();
+  h.strings_offset = h.files_offset + files.size() * sizeof(uint32_t);
+  std::string out;
+  Append(&out, &h, 1);
+  if (!symbols.empty()) Append(&out, &symbols[0], symbols.size());
+  if (!lines.empty()) Append(&out, &lines[0], lines.size());
+  if (!files.empty()) Append(&out, &files[0], files.size());
+  out += strings;
+
+  // Write a temporary file and rename it, so that concurrent runs see either
+  // no index or a complete one.
+  char tmp_path[1100];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", index_path.c_str(),
+           getpid());
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool written = write(fd, out.data(), out.size()) == (ssize_t)out.size();
+  close(fd);
+  if (!written || rename(tmp_path, index_path.c_str()) != 0) {
+    unlink(tmp_path);
+    return false;
+  }
+  return Map(index_path.c_str(), st.st_size, st.st_mtime);
+}
+
+// Returns the last element of 'items' with addr <= 'addr', or NULL.
+template <class T>
+static const T *FindLast(const T *items, uint64_t n, uint64_t addr) {
+  uint64_t lo = 0, hi = n;  // The answer is items[lo - 1].
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (items[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo ? &items[lo - 1] : NULL;
+}
+
+static void CopyString(char *out, int out_size, const char *s) {
+  if (out_size <= 0) return;
+  strncpy(out, s, out_size - 1);
+  out[out_size - 1] = '\0';
+}
+
+bool SymbolIndex::Lookup(uintptr_t vaddr,
+                         /*out*/char *symbol, int symbol_size,
+                         /*out*/char *file, int file_size,
+                         /*out*/int *line) const {
+  const IndexHeader *h = header();
+  const char *strings = data_ + h->strings_offset;
+  symbol[0] = '\0';
+  file[0] = '\0';
+  *line = 0;
+  bool found = false;
+  const IndexSymbol *s = FindLast((const IndexSymbol*)(data_ +
+                                                       h->symbols_offset),
+                                  h->n_symbols, vaddr);
+  // A symbol w/o a size covers everything up to the next one.
+  if (s && (s->size == 0 || vaddr < s->addr + s->size)) {
+    CopyString(symbol, symbol_size, strings + s->name);
+    found = true;
+  }
+  const IndexLine *l = FindLast((const IndexLine*)(data_ + h->lines_offset),
+                                h->n_lines, vaddr);
+  if (l && l->line != 0 && l->file < h->n_files) {
+    const uint32_t *files = (const uint32_t*)(data_ + h->files_offset);
+    CopyString(file, file_size, strings + files[l->file]);
+    *line = l->line;
+    found = true;
+  }
+  return found;
+}
+
+uintptr_t SymbolIndex::SegmentVaddr(uintptr_t offset) const {
+  const IndexHeader *h = header();
+  for (uint32_t i = 0; i < h->n_segments; i++) {
+    // The mappings start at page boundaries.
+    if ((h->segments[i].offset & ~(uint64_t)0xfff) == offset)
+      return (h->segments[i].vaddr & ~(uint64_t)0xfff);
+  }
+  return (uintptr_t)-1;
+}
+
+bool SymbolIndex::IsPositionIndependent() const {
+  return header()->is_pic;
+}
@@ -0,0 +1,53 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+
+#ifndef SYMBOL_INDEX_H_
+#define SYMBOL_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A sorted address index of one ELF binary: its function and object symbols
+// from .symtab (or .dynsym) and the line table from .debug_line.
+// The index is built once per binary and saved into a file which later runs
+// just mmap. The file is rebuilt when the binary changes (its size or mtime).
+//
+// Index file layout (native endianness, all offsets from the file start):
+//   IndexHeader
+//   IndexSymbol symbols[n_symbols]   sorted by addr
+//   IndexLine lines[n_lines]         sorted by addr, line 0 ends a sequence
+//   uint32_t files[n_files]          offsets of the file names in strings
+//   char strings[strings_size]       0-terminated names
+class SymbolIndex {
+ public:
+  SymbolIndex();
+  ~SymbolIndex();
+  // Opens the index of 'binary' in 'index_dir', building it if needed.
+  bool Open(const char *binary, const char *index_dir);
+  // Looks up an address relative to the image of the binary (i.e. an ELF
+  // virtual address). Returns false if neither a symbol nor a line is found.
+  // If there is no line info, *line is 0 and file is empty.
+  bool Lookup(uintptr_t vaddr,
+              /*out*/char *symbol, int symbol_size,
+              /*out*/char *file, int file_size,
+              /*out*/int *line) const;
+  // Returns the image address of the PT_LOAD segment of the binary at file
+  // offset 'offset', or -1 if there is none.
+  uintptr_t SegmentVaddr(uintptr_t offset) const;
+  bool IsPositionIndependent() const;
+
+ private:
+  struct IndexHeader;
+  struct IndexSymbol;
+  struct IndexLine;
+  struct IndexSegment;
+
+  bool Map(const char *path, size_t binary_size, uint64_t binary_mtime);
+  const IndexHeader *header() const {
+    return (const IndexHeader*)data_;
+  }
+
+  const char *data_;
+  size_t size_;
+};
+
+#endif  // SYMBOL_INDEX_H_
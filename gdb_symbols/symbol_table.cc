@@ -34,8 +34,10 @@
 // (http://code.google.com/p/google-perftools/)
 
 #include "symbol_table.h"
+#include "symbol_index.h"
 
 #include <stdio.h>  // TODO(glider): remove
+#include <stdlib.h>
 
 #include <assert.h>
 #include <fcntl.h>
@@ -44,22 +46,40 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-SymbolTable::SymbolTable(const char *binary) {
+SymbolTable::SymbolTable(const char *binary, const char *index_dir_) {
   gdb_in = -1;
   gdb_out = -1;
+  gdb_started = false;
   finalized = false;
+  index_dir = index_dir_;
+  memset(binary_name, 0, sizeof(binary_name));
   if (binary) {
-    strncpy(binary_name, binary, sizeof(binary_name));
+    strncpy(binary_name, binary, sizeof(binary_name) - 1);
   } else {
-    readlink("/proc/self/exe", binary_name, sizeof(binary_name));
+    readlink("/proc/self/exe", binary_name, sizeof(binary_name) - 1);
+  }
+  if (index_dir) {
+    LoadModules();
+  } else {
+    StartGdb();
   }
-  OpenPipe();
-  MapBinary(binary_name, strlen(binary_name));
-  LoadProcMaps();
 }
 
 SymbolTable::~SymbolTable() {
   if (!finalized) Finalize();
+  for (size_t i = 0; i < modules.size(); i++) {
+    delete modules[i].index;
+  }
+}
+
+bool SymbolTable::StartGdb() {
+  if (!gdb_started) {
+    gdb_started = true;
+    OpenPipe();
+    MapBinary(binary_name, strlen(binary_name));
+    LoadProcMaps();
+  }
+  return gdb_in != -1;
 }
 
 // TODO(glider): {Before,After}Fork* should execute callbacks set by the user.
@@ -240,10 +260,88 @@ void SymbolTable::MapSharedLibrary(const char *path, int path_size,
   ConsumeLines();
 }
 
+bool SymbolTable::GetAddrInfo(void *addr,
+                              /*out*/char *symbol, int symbol_size,
+                              /*out*/char *file, int file_size,
+                              /*out*/int *line) {
+  std::map<uintptr_t, CachedAddrInfo>::iterator it =
+      cache.find((uintptr_t)addr);
+  if (it == cache.end()) {
+    char symbol_buf[1000], file_buf[1000];
+    int line_buf = 0;
+    symbol_buf[0] = file_buf[0] = '\0';
+    CachedAddrInfo info;
+    info.found = GetAddrInfoFromIndex((uintptr_t)addr,
+                                      symbol_buf, sizeof(symbol_buf),
+                                      file_buf, sizeof(file_buf), &line_buf) ||
+                 GetAddrInfoNocache(addr, symbol_buf, sizeof(symbol_buf),
+                                    file_buf, sizeof(file_buf), &line_buf);
+    info.symbol = symbol_buf;
+    info.file = file_buf;
+    info.line = line_buf;
+    it = cache.insert(std::make_pair((uintptr_t)addr, info)).first;
+  }
+  const CachedAddrInfo &info = it->second;
+  if (symbol_size > (int)info.symbol.size()) {
+    strcpy(symbol, info.symbol.c_str());
+  } else if (symbol_size > 0) {
+    symbol[0] = '\0';
+  }
+  if (file_size > (int)info.file.size()) {
+    strcpy(file, info.file.c_str());
+  } else if (file_size > 0) {
+    file[0] = '\0';
+  }
+  *line = info.line;
+  return info.found;
+}
+
+bool SymbolTable::GetAddrInfoFromIndex(uintptr_t addr,
+                                       /*out*/char *symbol, int symbol_size,
+                                       /*out*/char *file, int file_size,
+                                       /*out*/int *line) {
+  if (!index_dir) return false;
+  // Find the last module starting at or below addr.
+  size_t lo = 0, hi = modules.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (modules[mid].start <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || addr >= modules[lo - 1].end) return false;
+  Module *module = &modules[lo - 1];
+  if (!module->index_tried) {
+    module->index_tried = true;
+    SymbolIndex *index = new SymbolIndex;
+    if (index->Open(module->path.c_str(), index_dir)) {
+      module->index = index;
+    } else {
+      delete index;
+    }
+  }
+  if (!module->index) return false;
+  uintptr_t vaddr = addr;
+  if (module->index->IsPositionIndependent()) {
+    uintptr_t segment = module->index->SegmentVaddr(module->offset);
+    if (segment == (uintptr_t)-1) return false;
+    vaddr = addr - module->start + segment;
+  }
+  if (!module->index->Lookup(vaddr, symbol, symbol_size,
+                             file, file_size, line))
+    return false;
+  // Like gdb, name the module if there is no line info.
+  if (!file[0] && file_size > (int)module->path.size())
+    strcpy(file, module->path.c_str());
+  return true;
+}
+
 bool SymbolTable::GetAddrInfoNocache(void *addr,
                                      /*out*/char *symbol, int symbol_buf_size,
                                      /*out*/char *file, int file_size,
                                      /*out*/int *line) {
+  if (!StartGdb()) return false;
   write(gdb_in, "info line *", 11);
   WriteHexAddr((uintptr_t)addr);
   write(gdb_in, "\n", 1);
@@ -357,6 +455,46 @@ void SymbolTable::ProcessProcMapsLine(char *line) {
   }
 }
 
+// Collects the file mappings from /proc/self/maps. The mappings of a file
+// make one module, from its first mapping to the end of its last one.
+void SymbolTable::LoadModules() {
+  std::string maps;
+  char read_buf[4096];
+  int maps_fd = open("/proc/self/maps", 0);
+  if (maps_fd < 0) return;
+  int num_read;
+  while ((num_read = read(maps_fd, read_buf, sizeof(read_buf))) > 0) {
+    maps.append(read_buf, num_read);
+  }
+  close(maps_fd);
+  size_t line_start = 0;
+  while (line_start < maps.size()) {
+    size_t line_end = maps.find('\n', line_start);
+    if (line_end == std::string::npos) line_end = maps.size();
+    std::string line = maps.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    size_t path_start = line.find('/');
+    if (path_start == std::string::npos) continue;
+    Module module;
+    char perms[5];
+    unsigned long start, end, offset;
+    if (sscanf(line.c_str(), "%lx-%lx %4s %lx", &start, &end, perms,
+               &offset) != 4)
+      continue;
+    module.path = line.substr(path_start);
+    if (!modules.empty() && modules.back().path == module.path) {
+      modules.back().end = end;
+      continue;
+    }
+    module.start = start;
+    module.end = end;
+    module.offset = offset;
+    module.index = NULL;
+    module.index_tried = false;
+    modules.push_back(module);
+  }
+}
+
 void SymbolTable::LoadProcMaps() {
   char maps_line[1000];
   memset(maps_line, 0, sizeof(maps_line));
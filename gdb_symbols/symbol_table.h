@@ -6,14 +6,28 @@
 
 #include <stdint.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
 static const char kGdbPath[] = "/usr/bin/gdb";
 
+class SymbolIndex;
+
 class SymbolTable {
  public:
-  explicit SymbolTable(const char *binary);
+  // If index_dir is not NULL, GetAddrInfo() first looks the addresses up in
+  // the symbol indices (see symbol_index.h) of the mapped modules, which are
+  // kept in index_dir. gdb is then started only if an address is not found.
+  explicit SymbolTable(const char *binary, const char *index_dir = NULL);
   ~SymbolTable();
   void MapBinary(const char *path, int path_size);
   void MapSharedLibrary(const char *path, int path_size, uintptr_t offset);
+  // Same as GetAddrInfoNocache(), but remembers the results.
+  bool GetAddrInfo(void *addr,
+                   /*out*/char *symbol, int symbol_size,
+                   /*out*/char *file, int file_size,
+                   /*out*/int *line);
   bool GetAddrInfoNocache(void *addr,
                           /*out*/char *symbol, int symbol_size,
                           /*out*/char *file, int file_size,
@@ -30,10 +44,35 @@ class SymbolTable {
   void LoadProcMaps();
   void ProcessProcMapsLine(char *line);
   int ReadBuffer(char *buf, int size);
+  bool StartGdb();
+  void LoadModules();
+  bool GetAddrInfoFromIndex(uintptr_t addr,
+                            /*out*/char *symbol, int symbol_size,
+                            /*out*/char *file, int file_size,
+                            /*out*/int *line);
+
+  // A module mapped into the process, with its index opened on demand.
+  struct Module {
+    uintptr_t start, end;
+    uintptr_t offset;  // The file offset at 'start'.
+    std::string path;
+    SymbolIndex *index;
+    bool index_tried;
+  };
+  struct CachedAddrInfo {
+    bool found;
+    std::string symbol, file;
+    int line;
+  };
+
   // File descriptors used to interact with gdb.
   int gdb_in, gdb_out;
+  bool gdb_started;
   bool finalized;
   char binary_name[1000];
+  const char *index_dir;
+  std::vector<Module> modules;  // Sorted by start.
+  std::map<uintptr_t, CachedAddrInfo> cache;
 };
 
 #endif  // SYMBOL_TABLE_H_
@@ -9,6 +9,7 @@
 #include "string"
 
 #include "thread_sanitizer.h"
+#include "ts_lock.h"
 #include "ts_util.h"
 
 typedef uintptr_t pc_t;
@@ -26,22 +27,163 @@ const int kNumEvents = sizeof(kEventNames)/sizeof(kEventNames[0]);
 int g_numEventsRead = 0;
 int g_eventsCount[kNumEvents];
 
+static CallStackPod *NewShadowStack() {
+  CallStackPod *__tsan_shadow_stack = new CallStackPod;
+  __tsan_shadow_stack->end_ = __tsan_shadow_stack->pcs_ + kCallStackReserve;
+  memset(__tsan_shadow_stack->pcs_, 0, kCallStackReserve * sizeof(__tsan_shadow_stack->pcs_[0]));
+  return __tsan_shadow_stack;
+}
+
+static void PutEvent(EventType type, int32_t tid, uintptr_t pc,
+                     uintptr_t a, uintptr_t info) {
+  ++g_eventsCount[type];
+  ++g_numEventsRead;
+  Event event(type, tid, pc, a, info);
+  ThreadSanitizerHandleOneEvent(&event);
+}
+
+// -------- Goroutine TIDs ------ {{{1
+// By default the goroutine ids are the TIDs, and the TIDs never die,
+// so a program which creates many goroutines runs out of max_n_threads.
+// With --max_goroutine_tids=N the goroutines get TIDs from a pool of N.
+// The TID of an ended goroutine goes to a new goroutine w/o THR_END and
+// THR_START: the new goroutine waits for a signal from its parent and
+// continues the segments of the old one. So the old goroutine's
+// accesses happen-before the ones of the new goroutine, and the races
+// between the two are missed.
+static TSLock g_tid_lock;
+static map<int32_t, int32_t> *g_goid_to_tid;
+static vector<int32_t> *g_free_tids;
+static int32_t g_n_tids;
+static CallStackPod **g_tid_stacks;  // Indexed by TID.
+static uintptr_t *g_tid_start_sync;  // The sync objects for the reuses.
+
+static bool UseTidPool() { return G_flags->max_goroutine_tids > 0; }
+
+static int32_t GoidToTid(int32_t goid) {
+  if (!UseTidPool()) return goid;
+  ScopedLock lock(&g_tid_lock);
+  map<int32_t, int32_t>::iterator it = g_goid_to_tid->find(goid);
+  CHECK(it != g_goid_to_tid->end());
+  return it->second;
+}
+
+static void GoroutineStart(int32_t goid, int32_t parent_goid) {
+  int32_t parent_tid = -1;
+  int32_t tid = -1;
+  bool reuse = false;
+  {
+    ScopedLock lock(&g_tid_lock);
+    map<int32_t, int32_t>::iterator it = g_goid_to_tid->find(parent_goid);
+    if (parent_goid >= 0 && it != g_goid_to_tid->end())
+      parent_tid = it->second;
+    if (!g_free_tids->empty()) {
+      tid = g_free_tids->back();
+      g_free_tids->pop_back();
+      reuse = true;
+    } else {
+      if (g_n_tids >= G_flags->max_goroutine_tids) {
+        Printf("FATAL: more than %ld running goroutines, "
+               "increase --max_goroutine_tids\n",
+               G_flags->max_goroutine_tids);
+        exit(1);
+      }
+      tid = g_n_tids++;
+      g_tid_stacks[tid] = NewShadowStack();
+    }
+    (*g_goid_to_tid)[goid] = tid;
+  }
+  if (!reuse) {
+    PutEvent(THR_START, tid, (uintptr_t)g_tid_stacks[tid], 0, parent_tid);
+    return;
+  }
+  CallStackPod *stack = g_tid_stacks[tid];
+  stack->end_ = stack->pcs_ + kCallStackReserve;
+  if (parent_tid >= 0) {
+    PutEvent(SIGNAL, parent_tid, 0, (uintptr_t)&g_tid_start_sync[tid], 0);
+    PutEvent(WAIT, tid, 0, (uintptr_t)&g_tid_start_sync[tid], 0);
+  }
+}
+
+static void GoroutineEnd(int32_t goid) {
+  ScopedLock lock(&g_tid_lock);
+  map<int32_t, int32_t>::iterator it = g_goid_to_tid->find(goid);
+  CHECK(it != g_goid_to_tid->end());
+  g_free_tids->push_back(it->second);
+  g_goid_to_tid->erase(it);
+}
+
+static void InitTidPool() {
+  if (!UseTidPool()) return;
+  CHECK(G_flags->max_goroutine_tids <= G_flags->max_n_threads);
+  g_goid_to_tid = new map<int32_t, int32_t>;
+  g_free_tids = new vector<int32_t>;
+  g_tid_stacks = new CallStackPod*[G_flags->max_goroutine_tids];
+  g_tid_start_sync = new uintptr_t[G_flags->max_goroutine_tids];
+}
+
+// -------- Events ------ {{{1
 extern "C"
 void SPut(EventType type, int32_t tid, uintptr_t pc,
           uintptr_t a, uintptr_t info) {
+  if (UseTidPool()) {
+    if (type == THR_START) {
+      GoroutineStart(tid, (int32_t)info);
+      return;
+    }
+    if (type == THR_END) {
+      GoroutineEnd(tid);
+      return;
+    }
+    tid = GoidToTid(tid);
+  }
+
   if (type == THR_START) {
-    CallStackPod *__tsan_shadow_stack = new CallStackPod;
-    __tsan_shadow_stack->end_ = __tsan_shadow_stack->pcs_ + kCallStackReserve;
-    memset(__tsan_shadow_stack->pcs_, 0, kCallStackReserve * sizeof(__tsan_shadow_stack->pcs_[0]));
-    pc = (uintptr_t)__tsan_shadow_stack;
+    pc = (uintptr_t)NewShadowStack();
   }
 
-  ++g_eventsCount[type];
-  ++g_numEventsRead;
-  Event event(type, tid, pc, a, info);
-  ThreadSanitizerHandleOneEvent(&event);
+  PutEvent(type, tid, pc, a, info);
 }
 
+// An event of SPutBatch(), the goroutine is the same for the whole batch.
+struct GoEvent {
+  uintptr_t pc;
+  uintptr_t a;
+  uint32_t  type;  // EventType.
+  uint32_t  info;
+};
+
+// Handles the events of one goroutine at once, so the Go side crosses
+// into C once per batch rather than per event. The memory accesses go
+// straight to the trace handling, as the accesses of an instrumented
+// block do, the rest of the events is handled one by one.
+extern "C"
+void SPutBatch(int32_t goid, GoEvent *events, int32_t n) {
+  int32_t tid = GoidToTid(goid);
+  TSanThread *thr = ThreadSanitizerGetThreadByTid(tid);
+  for (int32_t i = 0; i < n; i++) {
+    GoEvent *e = &events[i];
+    EventType type = (EventType)e->type;
+    if ((type == READ || type == WRITE) && e->info != 0 &&
+        e->info <= MopInfo::kMaxSize) {
+      ++g_eventsCount[type];
+      ++g_numEventsRead;
+      MopInfo mop(e->pc, e->info, type == WRITE, false);
+      ThreadSanitizerHandleOneMemoryAccess(thr, mop, e->a);
+      continue;
+    }
+    CHECK(type != THR_START);
+    if (type == THR_END) {
+      SPut(type, goid, e->pc, e->a, e->info);
+      CHECK(i == n - 1);
+      return;
+    }
+    PutEvent(type, tid, e->pc, e->a, e->info);
+  }
+}
+
+// end. {{{1
+
 void PcToStrings(uintptr_t pc, bool demangle,
                  string *img_name, string *rtn_name,
                  string *file_name, int *line_no) {
@@ -87,6 +229,7 @@ bool initialize() {
 
   ThreadSanitizerParseFlags(&args);
   ThreadSanitizerInit();
+  InitTidPool();
 
   // Depends on when initialize() is called: before goroutine 0
   // was created or after.
@@ -3,19 +3,30 @@
 #include "ThreadSanitizer.h"
 
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/CallingConv.h"
 #include "llvm/DerivedTypes.h"
 #include "llvm/Function.h"
 #include "llvm/InlineAsm.h"
 #include "llvm/InstrTypes.h"
 #include "llvm/IntrinsicInst.h"
+#include "llvm/Support/CallSite.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Instrumentation.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Type.h"
 
 #if 0
@@ -23,6 +34,7 @@
 #include "common_util.h"
 #endif
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -116,12 +128,54 @@ static cl::opt<bool>
                                 "be ignored. Experimental feature."),
                       cl::init(true));
 
+static cl::opt<bool>
+    IgnoreThreadLocalMops("ignore-thread-local-mops",
+                          cl::desc("Do not instrument the accesses to the "
+                                   "allocas and malloc()ed objects whose "
+                                   "address never escapes the function"),
+                          cl::init(true));
+
+static cl::opt<bool>
+    UseMopFilter("use-mop-filter",
+                 cl::desc("Do not pass to the runtime the accesses which the "
+                          "current thread has already reported in its "
+                          "current segment (needs --mop_filter at run time)"),
+                 cl::init(false));
+
+static cl::opt<bool>
+    InstrumentLoopRanges("instrument-loop-ranges",
+                         cl::desc("Report the affine memory accesses in "
+                                  "simple loops with a single range event "
+                                  "in the loop preheader"),
+                         cl::init(true));
+
+static cl::opt<bool>
+    CloneForIgnore("clone-for-ignore",
+                   cl::desc("Keep an uninstrumented copy of each small "
+                            "function with memory operations and call it "
+                            "instead of the instrumented one while the "
+                            "current thread ignores all accesses"),
+                   cl::init(false));
+
+static cl::opt<int>
+    CloneMaxSize("clone-max-size",
+                 cl::desc("The maximal number of instructions in a function "
+                          "cloned with -clone-for-ignore"),
+                 cl::init(200));
+
 static cl::opt<bool>
     SkipFunctionsWithoutMops("skip-functions-without-mops",
                              cl::desc("Do not instrument functions "
                                       "containing no memory operations"),
                              cl::init(false));
 
+static cl::opt<string>
+    SharingProfileFile("sharing-profile",
+                       cl::desc("File written by a run with "
+                                "--sharing_profile_file. The functions listed "
+                                "there are instrumented in the sampling-only "
+                                "mode"));
+
 // TODO(glider): descriptions.
 static cl::opt<bool>
     UseTleb("use-tleb",
@@ -147,7 +201,7 @@ static cl::opt<int>
     DTlebSize("dynamic-tleb-size",
               cl::desc("The size of DTLEB (dynamic TLEB), "
                        "should be a multiple of page size "),
-              cl::init(4096));  // kDTLEBSize in tsan_rtl.cc
+              cl::init(4096));  // See writeModuleTlebInfo()
 
 
 // TODO(glider): a silly name for an option. Maybe -use-dynamic-tleb is enough?
@@ -174,6 +228,25 @@ static cl::opt<bool>
         cl::desc("Pass blocks containing a single mop via TLEB"),
         cl::init(false));
 
+static cl::opt<int>
+    InlineMemTransferLimit("inline-memtransfer-limit",
+        cl::desc("Replace llvm.memcpy and llvm.memmove of a constant length "
+                 "up to this many bytes with loads and stores that go into "
+                 "the trace passport (0 to disable)"),
+        cl::init(64));
+
+static cl::opt<int>
+    TraceBuilderThreads("trace-builder-threads",
+        cl::desc("Build the traces of the module's functions in this many "
+                 "threads before instrumenting them"),
+        cl::init(1));
+
+static cl::opt<bool>
+    StaticTlebBounds("static-tleb-bounds",
+        cl::desc("Check for the dynamic TLEB overflow once at the function "
+                 "entry if the function writes a bounded number of events"),
+        cl::init(true));
+
 // }}}
 
 
@@ -224,6 +297,9 @@ ThreadSanitizer::ThreadSanitizer() : ModulePass(ID) {
   if (IgnoreFile.size()) {
     parseIgnoreFile(IgnoreFile);
   }
+  if (SharingProfileFile.size()) {
+    parseSharingProfile(SharingProfileFile);
+  }
 }
 
 // instruction_address = function_address + c_offset
@@ -291,88 +367,70 @@ bool ThreadSanitizer::isDtor(const string &mangled_name) {
   return false;
 }
 
+// Appends |str| to the zero-separated string table |raw| unless it is
+// already there and returns its byte offset in the table.
+static uint32_t addDebugString(const string &str,
+                               map<string, uint32_t> &offsets,
+                               vector<Constant*> &raw, IntegerType *Int8) {
+  map<string, uint32_t>::iterator it = offsets.find(str);
+  if (it != offsets.end()) return it->second;
+  uint32_t offset = raw.size();
+  offsets[str] = offset;
+  for (size_t i = 0; i < str.size(); i++) {
+    raw.push_back(ConstantInt::get(Int8, str.c_str()[i]));
+  }
+  raw.push_back(ConstantInt::get(Int8, 0));
+  return offset;
+}
+
 void ThreadSanitizer::writeModuleDebugInfo(Module &M) {
   // The debug info is stored in a per-module global structure named
   // "rtl_debug_info${ModuleID}".
   // TODO(glider): this may lead to name collisions.
-  vector<Constant*> dummy;
-  dummy.push_back(ConstantInt::get(const_cast<IntegerType*>(PlatformInt),
-                                   ModuleID));
-  map<string, size_t> files;
-  map<string, size_t> paths;
-  map<string, size_t> symbols;
-  uintptr_t files_size = 0, files_count = 0;
-  uintptr_t paths_size = 0, paths_count = 0;
-  uintptr_t symbols_size = 0, symbols_count = 0;
-  uintptr_t pcs_size = 0;
+  //
+  // The layout is chosen so that the runtime can use the section in place:
+  // the strings are referenced by their byte offsets and the file names are
+  // already joined with their directories, so no string is copied or
+  // split at startup. Must be in sync with tsan_rtl_symbolize_llvm.cc.
+  map<string, uint32_t> files;
+  map<string, uint32_t> symbols;
   vector<Constant*> files_raw;
-  for (set<string>::iterator it = debug_file_set.begin();
-       it != debug_file_set.end();
-       ++it) {
-    files[*it] = files_count;
-    files_count++;
-    files_size += (it->size() + 1);
-    for (size_t i = 0; i < it->size(); i++) {
-      files_raw.push_back(ConstantInt::get(Int8,
-                                           it->c_str()[i]));
-    }
-    files_raw.push_back(ConstantInt::get(Int8, 0));
-  }
-
-  vector<Constant*> paths_raw;
-  for (set<string>::iterator it = debug_path_set.begin();
-       it != debug_path_set.end();
-       ++it) {
-    paths[*it] = paths_count;
-    paths_count++;
-    paths_size += (it->size() + 1);
-    for (size_t i = 0; i < it->size(); i++) {
-      paths_raw.push_back(ConstantInt::get(Int8,
-                                           it->c_str()[i]));
-    }
-    paths_raw.push_back(ConstantInt::get(Int8, 0));
-  }
-
   vector<Constant*> symbols_raw;
-  for (set<string>::iterator it = debug_symbol_set.begin();
-       it != debug_symbol_set.end();
-       ++it) {
-    symbols[*it] = symbols_count;
-    symbols_count++;
-    symbols_size += (it->size() + 1);
-    for (size_t i = 0; i < it->size(); i++) {
-      symbols_raw.push_back(ConstantInt::get(Int8,
-                                             it->c_str()[i]));
-    }
-    symbols_raw.push_back(ConstantInt::get(Int8, 0));
-  }
   vector<Constant*> pcs;
 
-  // pc, symbol, path, file, line
-  StructType *PcInfo = StructType::get(PlatformInt, PlatformInt,
-                                       PlatformInt,
-                                       PlatformInt, PlatformInt,
+  // pc, symbol, file, line
+  StructType *PcInfo = StructType::get(PlatformInt, Int32, Int32, Int32,
                                        NULL);
   for (map<Constant*, DebugPcInfo>::iterator it = debug_pc_map.begin();
        it != debug_pc_map.end();
        ++it) {
+    const DebugPcInfo &info = it->second;
+    string fullpath = info.file;
+    if (!info.file.empty() && !info.path.empty()) {
+      if (info.path[info.path.size() - 1] != '/') {
+        fullpath = info.path + "/" + info.file;
+      } else {
+        fullpath = info.path + info.file;
+      }
+    }
     vector<Constant*> pc;
-    ///pc.push_back(ConstantInt::get(PlatformInt, it->first));
     pc.push_back(it->first);
-    pc.push_back(ConstantInt::get(PlatformInt, symbols[it->second.symbol]));
-    pc.push_back(ConstantInt::get(PlatformInt, paths[it->second.path]));
-    pc.push_back(ConstantInt::get(PlatformInt, files[it->second.file]));
-    pc.push_back(ConstantInt::get(PlatformInt, it->second.line));
+    pc.push_back(ConstantInt::get(Int32,
+        addDebugString(info.symbol, symbols, symbols_raw, Int8)));
+    pc.push_back(ConstantInt::get(Int32,
+        addDebugString(fullpath, files, files_raw, Int8)));
+    pc.push_back(ConstantInt::get(Int32, info.line));
     pcs.push_back(ConstantStruct::get(PcInfo, pc));
-    pcs_size++;
   }
+  uintptr_t files_size = files_raw.size();
+  uintptr_t symbols_size = symbols_raw.size();
+  uintptr_t pcs_size = pcs.size();
   // magic,
-  // paths_size, files_size, symbols_size, pcs_size,
-  // paths[], files[], symbols[], pcs[]
+  // files_size, symbols_size, pcs_size,
+  // files[], symbols[], pcs[]
   StructType *DebugInfoType = StructType::get(
       Int32,
-      PlatformInt, PlatformInt, PlatformInt, PlatformInt,
-      ArrayType::get(Int8, paths_size),
+      PlatformInt, PlatformInt, PlatformInt,
       ArrayType::get(Int8, files_size),
       ArrayType::get(Int8, symbols_size),
       ArrayType::get(PcInfo, pcs_size),
@@ -380,13 +438,10 @@ void ThreadSanitizer::writeModuleDebugInfo(Module &M) {
 
   vector<Constant*> debug_info;
   debug_info.push_back(ConstantInt::get(Int32, kDebugInfoMagicNumber));
-  debug_info.push_back(ConstantInt::get(PlatformInt, paths_size));
   debug_info.push_back(ConstantInt::get(PlatformInt, files_size));
   debug_info.push_back(ConstantInt::get(PlatformInt, symbols_size));
   debug_info.push_back(ConstantInt::get(PlatformInt, pcs_size));
 
-  debug_info.push_back(
-      ConstantArray::get(ArrayType::get(Int8, paths_size), paths_raw));
   debug_info.push_back(
       ConstantArray::get(ArrayType::get(Int8, files_size), files_raw));
   debug_info.push_back(
@@ -412,8 +467,37 @@ void ThreadSanitizer::writeModuleDebugInfo(Module &M) {
   GV->setSection("tsan_rtl_debug_info");
 }
 
-BlockSet &ThreadSanitizer::getPredecessors(BasicBlock *bb) {
-  return predecessors[bb];
+// The largest trace and the DTLEB size of the module are stored in a global
+// named "rtl_tleb_info${ModuleID}" in the tsan_rtl_tleb_info section. The
+// runtime checks the trace size once at startup instead of doing that on
+// each flush and sizes the dynamic TLEBs to match the index wrap-around.
+// Must be in sync with ReadModuleTlebInfo() in tsan_rtl.cc.
+void ThreadSanitizer::writeModuleTlebInfo(Module &M) {
+  // max_trace_mops, dtleb_size
+  StructType *TlebInfoType = StructType::get(PlatformInt, PlatformInt, NULL);
+  vector<Constant*> tleb_info;
+  tleb_info.push_back(ConstantInt::get(PlatformInt, max_trace_mops));
+  tleb_info.push_back(ConstantInt::get(PlatformInt,
+                                       UseDynamicTleb ? DTlebSize : 0));
+  char var_id_str[50];
+  snprintf(var_id_str, sizeof(var_id_str), "rtl_tleb_info%d%s",
+           ModuleID, ModuleLetters.c_str());
+  GlobalValue *GV = new GlobalVariable(
+      M,
+      TlebInfoType,
+      /*isConstant*/true,
+      GlobalValue::ExternalLinkage,
+      ConstantStruct::get(TlebInfoType, tleb_info),
+      var_id_str,
+      /*ThreadLocal*/false,
+      /*AddressSpace*/0
+  );
+  GV->setSection("tsan_rtl_tleb_info");
+}
+
+BlockSet &ThreadSanitizer::getPredecessors(Trace &trace, BasicBlock *bb) {
+  assert(trace.predecessors);
+  return (*trace.predecessors)[bb];
 }
 
 bool ThreadSanitizer::visit(BasicBlock *node,
@@ -469,7 +553,7 @@ bool ThreadSanitizer::validateTrace(Trace &trace) {
   // Find all the entry points.
   for (BlockSet::iterator BB = trace.blocks.begin(), E = trace.blocks.end();
        BB != E; ++BB) {
-    BlockSet &pred = getPredecessors(*BB);
+    BlockSet &pred = getPredecessors(trace, *BB);
     Function *F = (*BB)->getParent();
     BasicBlock *entry = F->begin();
 #ifdef DEBUG_TRACES
@@ -618,7 +702,9 @@ void ThreadSanitizer::buildClosureInner(Trace &trace, BlockSet &used) {
         }
       }
     } else {
+#ifdef DEBUG_TRACES
       errs() << "Has cycles\n";
+#endif
       for (BlockSet::iterator CI = children.begin(),
                               CE = children.end();
                CI != CE; ++CI) {
@@ -648,7 +734,8 @@ void ThreadSanitizer::buildClosure(Trace &trace, BlockSet &used) {
 }
 
 // Cache the predecessors for each basic block within a function.
-void ThreadSanitizer::cachePredecessors(Function &F) {
+void ThreadSanitizer::cachePredecessors(Function &F,
+                                        PredecessorMap &predecessors) {
   for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
     TerminatorInst *BBTerm = BB->getTerminator();
     for (int i = 0, e = BBTerm->getNumSuccessors(); i != e; ++i) {
@@ -658,12 +745,16 @@ void ThreadSanitizer::cachePredecessors(Function &F) {
   }
 }
 
+// Only reads the IR of |F| and touches no state of the pass, so it may build
+// the traces of different functions concurrently, see
+// buildTracesInParallel().
 TraceVector ThreadSanitizer::buildTraces(Function &F) {
   TraceVector traces;
   BlockSet used_bbs;
   BlockVector to_see;
   BlockSet visited;
-  cachePredecessors(F);
+  PredecessorMap predecessors;
+  cachePredecessors(F, predecessors);
   Trace *current_trace = new Trace;
   to_see.push_back(F.begin());
   for (size_t i = 0; i < to_see.size(); ++i) {
@@ -671,6 +762,7 @@ TraceVector ThreadSanitizer::buildTraces(Function &F) {
     if (!used_bbs.count(current_bb)) {
       assert(current_trace->blocks.size() == 0);
       current_trace->entry = current_bb;
+      current_trace->predecessors = &predecessors;
       current_trace->blocks.insert(current_bb);
       buildClosure(*current_trace, used_bbs);
       for (BlockSet::iterator SI = current_trace->blocks.begin(),
@@ -679,6 +771,7 @@ TraceVector ThreadSanitizer::buildTraces(Function &F) {
         used_bbs.insert(*SI);
       }
       assert(current_trace->exits.size());
+      current_trace->predecessors = NULL;
       traces.push_back(current_trace);
       current_trace = new Trace;
     }
@@ -694,6 +787,59 @@ TraceVector ThreadSanitizer::buildTraces(Function &F) {
   return traces;
 }
 
+namespace {
+struct TraceBuilderTask {
+  ThreadSanitizer *pass;
+  vector<Function*> *functions;
+  vector<TraceVector> *traces;
+  intptr_t next;  // The index of the next function to process.
+};
+}  // namespace
+
+static void *TraceBuilderThread(void *arg) {
+  TraceBuilderTask *task = (TraceBuilderTask*)arg;
+  for (;;) {
+    size_t i = __sync_fetch_and_add(&task->next, 1);
+    if (i >= task->functions->size()) break;
+    (*task->traces)[i] = task->pass->buildTraces(*(*task->functions)[i]);
+  }
+  return NULL;
+}
+
+// Builds the traces of all the functions to be instrumented in
+// |TraceBuilderThreads| threads and stores them into |prebuilt_traces| for
+// runOnFunction().
+// Only the trace building is done in parallel: the rest of the per-function
+// work queries the analyses and creates constants, and neither the pass
+// manager nor LLVMContext can be used concurrently. The instrumentation then
+// proceeds in the module order, so the ids and the output do not depend on
+// the thread interleaving.
+void ThreadSanitizer::buildTracesInParallel(Module &M) {
+  prebuilt_traces.clear();
+  if (TraceBuilderThreads <= 1) return;
+  vector<Function*> functions;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->isDeclaration() || clones.count(F)) continue;
+    if (shouldIgnoreFunction(*F) || shouldIgnoreFunctionRecursively(*F))
+      continue;
+    functions.push_back(F);
+  }
+  vector<TraceVector> traces(functions.size());
+  TraceBuilderTask task = { this, &functions, &traces, 0 };
+  vector<pthread_t> threads(TraceBuilderThreads);
+  for (size_t i = 0; i < threads.size(); i++) {
+    int res = pthread_create(&threads[i], NULL, TraceBuilderThread, &task);
+    assert(res == 0);
+    (void)res;
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (size_t i = 0; i < functions.size(); i++) {
+    prebuilt_traces[functions[i]].swap(traces[i]);
+  }
+}
+
 // Insert the code that updates the shadow stack with the value of |addr|.
 // This effectively adds the following instructions:
 //
@@ -847,6 +993,9 @@ void ThreadSanitizer::runOnFunction(Module::iterator &F) {
 
   if (F->isDeclaration()) return;
   if (shouldIgnoreFunction(*F)) return;
+  captured_objects.clear();
+  sample_current_function = sampled_functions.count(F->getName().str());
+  function_tleb_bound = -1;
 
   if (!shouldIgnoreFunctionRecursively(*F)) {
     // We shouldn't ignore the function -- instrument it.
@@ -872,26 +1021,47 @@ void ThreadSanitizer::runOnFunction(Module::iterator &F) {
 
     instrumentation_stats.newFunction();
     instrumentation_stats.newBasicBlocks(F->size());
+    if (sample_current_function) instrumentation_stats.newSampledFunction();
 #if (defined(DEBUG_TRACES) || defined(DEBUG_IGNORE_MOPS))
     errs() << "\n\nFUNCTION: " << F->getName() << "\n";
     F->dump();
 #endif
 
+    // Each getAnalysis() call recomputes the analyses on the fly, so get all
+    // of them before using any.
+    SE = &getAnalysis<ScalarEvolution>(*F);
+    LI = &getAnalysis<LoopInfo>(*F);
+    DT = &getAnalysis<DominatorTree>(*F);
+    collectLoopRangeMops(*F);
+
     // Build the traces. Note that every basic block should belong to some
     // trace, even if it doesn't contain any memory operations.
-    TraceVector traces(buildTraces(*F));
+    TraceVector traces;
+    map<Function*, TraceVector>::iterator PT = prebuilt_traces.find(F);
+    if (PT != prebuilt_traces.end()) {
+      traces.swap(PT->second);
+    } else {
+      traces = buildTraces(*F);
+    }
     for (size_t i = 0; i < traces.size(); ++i) {
       assert(traces[i]->exits.size());
       markMopsToInstrument(*traces[i]);
       num_mops_in_traces += traces[i]->num_mops;
+      if (traces[i]->num_mops > max_trace_mops)
+        max_trace_mops = traces[i]->num_mops;
     }
+    function_tleb_bound = getFunctionTlebBound(*F, traces);
+    if (function_tleb_bound > 0) instrumentation_stats.newBoundedFunction();
 
     // TODO(glider): if we skip the function instrumentation, we also do not
     // update the shadow stack frame. This may speed up small functions (there
     // are lots of them if we compile with -fno-inline-functions), but we may
     // also lose stack pecision if the skipped function calls instrumented
     // functions. Controversial, need to evaluate.
-    if (SkipFunctionsWithoutMops && !num_mops_in_traces) return;
+    if (SkipFunctionsWithoutMops && !num_mops_in_traces &&
+        loop_range_mops.empty()) {
+      return;
+    }
     // runOnTrace() instruments function calls, so we need to check
     // SkipFunctionsWithoutMops first.
 
@@ -901,6 +1071,7 @@ void ThreadSanitizer::runOnFunction(Module::iterator &F) {
       runOnTrace(*(traces[i]), first_dtor_bb);
       first_dtor_bb = false;
     }
+    instrumentLoopRanges();
   } else {
     // Ignore the memory operations in the function.
     ignore_recursively = true;
@@ -916,6 +1087,10 @@ void ThreadSanitizer::runOnFunction(Module::iterator &F) {
   // let the optimizer do its job.
   BasicBlock::iterator First = F->begin()->begin();
   insertRtnCall(getInstructionAddr(0, First, PlatformInt), First);
+  // Without RTN_CALL the entry check has to be inserted separately.
+  if (function_tleb_bound > 0 && !EnableFunctionInstrumentation) {
+    insertMaybeFlushTleb(First, DTlebSize - function_tleb_bound);
+  }
   if (ignore_recursively) insertIgnoreInc(First);
   BlockVector to_see;
   BlockSet visited;
@@ -1165,6 +1340,17 @@ void ThreadSanitizer::setupRuntimeGlobals() {
     DTLEB = NULL;
     DTlebIndex = NULL;
   }
+  MopFilter = NULL;
+  if (UseMopFilter && !UseDynamicTleb) {
+    MopFilter = new GlobalVariable(*ThisModule,
+                                   ArrayType::get(Int64, kMopFilterSize),
+                                   /*isConstant*/false,
+                                   GlobalValue::ExternalWeakLinkage,
+                                   /*Initializer*/0,
+                                   "__tsan_mop_filter",
+                                   /*InsertBefore*/0,
+                                   /*ThreadLocal*/true);
+  }
   // void* bb_flush_current(cur_mops)
   // TODO(glider): need another name, because we now flush superblocks, not
   // basic blocks.
@@ -1182,6 +1368,26 @@ void ThreadSanitizer::setupRuntimeGlobals() {
   cast<Function>(BBFlushCurrentFn)->
       setLinkage(Function::ExternalWeakLinkage);
 
+  // void bb_flush_sampled(cur_mops)
+  BBFlushSampledFn =
+      ThisModule->getOrInsertFunction("bb_flush_sampled",
+                                      Void,
+                                      TraceInfoTypePtr, (Type*)0);
+
+  // void bb_flush_mop_sampled(cur_mop, addr)
+  BBFlushMopSampledFn =
+      ThisModule->getOrInsertFunction("bb_flush_mop_sampled",
+                                      Void,
+                                      TraceInfoTypePtr, UIntPtr, (Type*)0);
+
+  // void bb_flush_range(pc, addr, stride, count, size, is_write)
+  BBFlushRangeFn =
+      ThisModule->getOrInsertFunction("bb_flush_range",
+                                      Void,
+                                      PlatformInt, PlatformInt, PlatformInt,
+                                      PlatformInt, PlatformInt, PlatformInt,
+                                      (Type*)0);
+
   // void flush_tleb()
   FlushTlebFn = ThisModule->getOrInsertFunction("flush_tleb",
                                                 Void, (Type*)0);
@@ -1237,6 +1443,7 @@ bool ThreadSanitizer::runOnModule(Module &M) {
   InstrumentedTraceCount = 0;
   ModuleFunctionCount = 0;
   ModuleMopCount = 0;
+  max_trace_mops = 0;
   ModuleID = getModuleID(M);
   ModuleLetters = getModuleLetters(M);
   ThisModule = &M;
@@ -1248,6 +1455,8 @@ bool ThreadSanitizer::runOnModule(Module &M) {
   setupFlags();
   setupDataTypes();
   setupRuntimeGlobals();
+  // Clone before the functions are changed by the splitting below.
+  cloneFunctionsForIgnore(M);
 
   // Split each basic block into smaller blocks containing no more than one
   // call instruction at the end.
@@ -1262,6 +1471,7 @@ bool ThreadSanitizer::runOnModule(Module &M) {
   //  TODO(glider): split blocks that have more than kTLEBSize/kDTLEBSize
   //  memory operations. Now we'll just assert the blocks are not too big.
   for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (clones.count(F)) continue;
     // We do not want to split on a call instruction more than once.
     SmallSet<Instruction*, 32> already_splitted;
     for (Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
@@ -1292,6 +1502,11 @@ bool ThreadSanitizer::runOnModule(Module &M) {
           }
           break;
         }
+        if (isa<MemTransferInst>(BI) && lowerSmallMemTransfer(BI)) {
+          // |BI| now points to the last of the new stores.
+          need_split = true;
+          continue;
+        }
         // A call may not occur inside of a basic block, iff this is not a
         // call to @llvm.dbg.declare
         if (isaCallOrInvoke(BI)) {
@@ -1317,10 +1532,15 @@ bool ThreadSanitizer::runOnModule(Module &M) {
       }
     }
   }
+  buildTracesInParallel(M);
   for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (clones.count(F)) continue;
     runOnFunction(F);
+    if (uninstrumented_clones.count(F))
+      insertIgnoreDispatch(*F, uninstrumented_clones[F]);
   }
   writeModuleDebugInfo(M);
+  writeModuleTlebInfo(M);
   if (PrintStats) instrumentation_stats.printStats();
   if (DumpModule) M.dump();
 
@@ -1352,6 +1572,116 @@ void ThreadSanitizer::insertIgnoreDec(
 
 }
 
+// Uninstrumented clones {{{1
+// While a thread ignores all its accesses (ANNOTATE_IGNORE_READS_AND_WRITES,
+// --ignore_in_dtor, etc.) the instrumented code still fills the TLEB and
+// maintains the shadow stack, and the runtime throws all of it away. With
+// -clone-for-ignore the pass keeps an uninstrumented copy of each small
+// function that has memory operations, and the instrumented version starts
+// with
+//   if (__tsan_thread_ignore) return uninstrumented_copy(args);
+// The copy calls the original (dispatching) versions of other functions, so
+// the code called from an ignored region runs uninstrumented as long as the
+// region lasts.
+// A function which may end the ignored region itself (calls an annotation)
+// is not cloned, since its copy would run uninstrumented after that.
+bool ThreadSanitizer::shouldCloneForIgnore(Function &F) {
+  if (F.isDeclaration() || F.isVarArg()) return false;
+  if (shouldIgnoreFunction(F) || shouldIgnoreFunctionRecursively(F))
+    return false;
+  // See runOnFunction().
+  if ((F.getName()).find("_Znw") != string::npos) return false;
+  if ((F.getName()).find("_Zdl") != string::npos) return false;
+  int size = 0;
+  bool has_mops = false;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::iterator BI = BB->begin(), BE = BB->end();
+         BI != BE; ++BI) {
+      if (++size > CloneMaxSize) return false;
+      if (isa<LoadInst>(BI) || isa<StoreInst>(BI)) has_mops = true;
+      if (isaCallOrInvoke(BI)) {
+        CallSite CS(&*BI);
+        Function *Callee = CS.getCalledFunction();
+        // We can't tell what an indirect call or the RTL does.
+        if (!Callee && !isa<InlineAsm>(CS.getCalledValue())) return false;
+        if (Callee && (Callee->getName().startswith("Annotate") ||
+                       Callee->getName().startswith("__tsan") ||
+                       Callee->getName().startswith("tsan_")))
+          return false;
+      }
+    }
+  }
+  return has_mops;
+}
+
+void ThreadSanitizer::cloneFunctionsForIgnore(Module &M) {
+  uninstrumented_clones.clear();
+  clones.clear();
+  if (!CloneForIgnore || !EnableMemoryInstrumentation) return;
+  vector<Function*> to_clone;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (shouldCloneForIgnore(*F)) to_clone.push_back(F);
+  }
+  for (size_t i = 0; i < to_clone.size(); i++) {
+    Function *F = to_clone[i];
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(F, VMap, /*ModuleLevelChanges*/false);
+    Clone->setName(F->getName().str() + ".tsan_uninstrumented");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    Clone->setVisibility(GlobalValue::DefaultVisibility);
+    M.getFunctionList().push_back(Clone);
+    uninstrumented_clones[F] = Clone;
+    clones.insert(Clone);
+    instrumentation_stats.newClonedFunction();
+  }
+}
+
+// Called after |F| has been instrumented, so the dispatch goes before the
+// shadow stack update.
+void ThreadSanitizer::insertIgnoreDispatch(Function &F, Function *Clone) {
+  LLVMContext &Context = F.getContext();
+  BasicBlock *OldEntry = &F.getEntryBlock();
+  BasicBlock *Dispatch =
+      BasicBlock::Create(Context, "tsan_dispatch", &F, OldEntry);
+  BasicBlock *CallClone =
+      BasicBlock::Create(Context, "tsan_call_uninstrumented", &F, OldEntry);
+
+  // __tsan_thread_ignore is an int in the runtime.
+  Value *IgnorePtr =
+      BitCastInst::CreatePointerCast(ThreadLocalIgnore,
+                                     PointerType::get(Int32, 0),
+                                     "", Dispatch);
+  Value *Ignore = new LoadInst(IgnorePtr, "", Dispatch);
+  Value *IsIgnored = new ICmpInst(*Dispatch, ICmpInst::ICMP_NE, Ignore,
+                                  ConstantInt::get(Int32, 0), "");
+  BranchInst::Create(/*ifTrue*/CallClone, /*ifFalse*/OldEntry, IsIgnored,
+                     Dispatch);
+
+  vector<Value*> Args;
+  for (Function::arg_iterator A = F.arg_begin(), E = F.arg_end();
+       A != E; ++A) {
+    Args.push_back(A);
+  }
+  CallInst *Call = CallInst::Create(Clone, Args, "", CallClone);
+  Call->setCallingConv(F.getCallingConv());
+  Call->setAttributes(F.getAttributes());
+  if (F.getReturnType()->isVoidTy()) {
+    ReturnInst::Create(Context, CallClone);
+  } else {
+    ReturnInst::Create(Context, Call, CallClone);
+  }
+
+  // Keep the static allocas in the entry block.
+  TerminatorInst *DispatchTerm = Dispatch->getTerminator();
+  for (BasicBlock::iterator BI = OldEntry->begin(), BE = OldEntry->end();
+       BI != BE; ) {
+    Instruction *Inst = BI++;
+    AllocaInst *AI = dyn_cast<AllocaInst>(Inst);
+    if (AI && isa<Constant>(AI->getArraySize())) AI->moveBefore(DispatchTerm);
+  }
+}
+// }}}
+
 // Code for contiguous TLEB usage {{{1
 // Instead of flushing each basic block independently, we write the following
 // events:
@@ -1408,7 +1738,8 @@ void ThreadSanitizer::insertIgnoreDec(
 
 // TODO(glider): when we split a block after the traces have been built, need
 // to make sure that both parts still belong to the same trace.
-void ThreadSanitizer::insertMaybeFlushTleb(Instruction *Before) {
+void ThreadSanitizer::insertMaybeFlushTleb(Instruction *Before,
+                                           int threshold) {
   // If the user chose to flush using SEGV, we do not need to insert any code.
   if (FlushUsingSegv) return;
   if (EnableLiteRaceSampling) {
@@ -1440,7 +1771,7 @@ void ThreadSanitizer::insertMaybeFlushTleb(Instruction *Before) {
   Value *FlushCond = new ICmpInst(BBOldTerm,
                                   ICmpInst::ICMP_SGT,
                                   IndexValue,
-                                  ConstantInt::get(PlatformInt, DTlebSize),
+                                  ConstantInt::get(PlatformInt, threshold),
                                   "");
   BranchInst *BBNewTerm = BranchInst::Create(/*ifTrue*/FlushBB,
                                              /*ifFalse*/FinishBB,
@@ -1467,6 +1798,50 @@ void ThreadSanitizer::insertMaybeFlushTleb(Instruction *Before) {
 #endif
 }
 
+// Returns the maximal number of DTLEB slots a single invocation of |F| may
+// take, or -1 if it can't be bounded statically. A function is bounded if its
+// CFG has no cycles and it calls nothing (so no other function flushes the
+// DTLEB behind its back): then each trace is entered at most once and takes
+// at most 1 + num_mops slots (SBLOCK_ENTER and the mops), plus RTN_CALL and
+// RTN_EXIT. For such functions a single overflow check at the entry replaces
+// the checks at the trace and function exits.
+int ThreadSanitizer::getFunctionTlebBound(Function &F, TraceVector &traces) {
+  if (!StaticTlebBounds || !UseDynamicTleb || FlushUsingSegv) return -1;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::iterator BI = BB->begin(), BE = BB->end();
+         BI != BE; ++BI) {
+      if (isaCallOrInvoke(BI) && !isa<DbgInfoIntrinsic>(BI)) return -1;
+    }
+  }
+  // Look for back edges with an iterative DFS.
+  BlockSet visited, on_stack;
+  vector<pair<BasicBlock*, unsigned> > stack;
+  stack.push_back(make_pair(&F.getEntryBlock(), 0U));
+  visited.insert(&F.getEntryBlock());
+  on_stack.insert(&F.getEntryBlock());
+  while (!stack.empty()) {
+    BasicBlock *BB = stack.back().first;
+    TerminatorInst *BBTerm = BB->getTerminator();
+    if (stack.back().second == BBTerm->getNumSuccessors()) {
+      on_stack.erase(BB);
+      stack.pop_back();
+      continue;
+    }
+    BasicBlock *child = BBTerm->getSuccessor(stack.back().second++);
+    if (on_stack.count(child)) return -1;
+    if (visited.count(child)) continue;
+    visited.insert(child);
+    on_stack.insert(child);
+    stack.push_back(make_pair(child, 0U));
+  }
+  int bound = 2;  // RTN_CALL, RTN_EXIT
+  for (size_t i = 0; i < traces.size(); ++i) {
+    if (traces[i]->num_mops) bound += 1 + traces[i]->num_mops;
+    if (bound > DTlebSize) return -1;
+  }
+  return bound;
+}
+
 void ThreadSanitizer::writeValueIntoTleb(Value *EventValue,
                                               BasicBlock::iterator &Before) {
   // Store the value into the dynamic TLEB:
@@ -1516,7 +1891,12 @@ void ThreadSanitizer::writeRtnCallToTleb(Constant *Addr,
                                           "", Before);
   Value *Call = new IntToPtrInst(CallInt, UIntPtr, "", Before);
   writeValueIntoTleb(Call, Before);
-  insertMaybeFlushTleb(Before);
+  if (function_tleb_bound > 0) {
+    // Reserve the space for the rest of the function's events at once.
+    insertMaybeFlushTleb(Before, DTlebSize - (function_tleb_bound - 1));
+  } else {
+    insertMaybeFlushTleb(Before, DTlebSize);
+  }
 }
 
 void ThreadSanitizer::writeRtnExitToTleb(BasicBlock::iterator &Before) {
@@ -1530,7 +1910,9 @@ void ThreadSanitizer::writeRtnExitToTleb(BasicBlock::iterator &Before) {
   }
   Value *Exit = new IntToPtrInst(ExitInt, UIntPtr, "", Before);
   writeValueIntoTleb(Exit, Before);
-  insertMaybeFlushTleb(Before);
+  // RTN_EXIT has been accounted for by the entry check.
+  if (function_tleb_bound > 0) return;
+  insertMaybeFlushTleb(Before, DTlebSize);
 }
 
 void ThreadSanitizer::writeSblockEnterForTrace(Trace &trace) {
@@ -1619,7 +2001,8 @@ void ThreadSanitizer::insertFlushCurrentCall(Trace &trace,
                                              "",
                                              Before);
     if (EnableTraceFlushing) {
-      CallInst::Create(BBFlushCurrentFn,
+      CallInst::Create(sample_current_function ? BBFlushSampledFn
+                                               : BBFlushCurrentFn,
                        Args, "", Before);
     }
   } else {
@@ -1766,7 +2149,8 @@ void ThreadSanitizer::insertFlushCurrentCall(Trace &trace,
                                                FlushTerm);
       // TODO(glider): We'll get a mess if
       // EnableLiteRaceSampling == true and EnableTraceFlushing == false
-      CallInst::Create(BBFlushCurrentFn,
+      CallInst::Create(sample_current_function ? BBFlushSampledFn
+                                               : BBFlushCurrentFn,
                        Args,
                        "", FlushTerm);
     } else {
@@ -1790,7 +2174,9 @@ void ThreadSanitizer::insertFlushCurrentCall(Trace &trace,
                                                "",
                                                FlushTerm);
       Args[1] = MopAddr;
-      CallInst::Create(BBFlushMop, Args, "", FlushTerm);
+      CallInst::Create(sample_current_function ? BBFlushMopSampledFn
+                                               : BBFlushMop,
+                       Args, "", FlushTerm);
     }
   }
 }
@@ -1829,9 +2215,9 @@ void ThreadSanitizer::runOnTrace(Trace &trace,
         if (!UseDynamicTleb) {
           insertFlushCurrentCall(trace, (*EI)->getTerminator(),
                                  /*useTLEB*/true, NULL);
-        } else {
+        } else if (function_tleb_bound <= 0) {
 ///          errs() << "Putting a check before the trace exit\n";
-          insertMaybeFlushTleb((*EI)->getTerminator());
+          insertMaybeFlushTleb((*EI)->getTerminator(), DTlebSize);
         }
       }
     } else {
@@ -1972,6 +2358,136 @@ bool ThreadSanitizer::ignoreInlinedMop(BasicBlock::iterator &BI) {
   return false;
 }
 
+// True if the memory operation on 'MopPtr' can't race, because it accesses
+// an alloca or a malloc()ed object of the current function which is never
+// captured, i.e. no other thread can ever get its address.
+bool ThreadSanitizer::isThreadLocalMop(Value *MopPtr) {
+  if (!IgnoreThreadLocalMops) return false;
+  Value *Obj = GetUnderlyingObject(MopPtr, TD);
+  if (!isa<AllocaInst>(Obj) && !isMalloc(Obj)) return false;
+  map<Value*, bool>::iterator it = captured_objects.find(Obj);
+  if (it == captured_objects.end()) {
+    bool captured = PointerMayBeCaptured(Obj, /*ReturnCaptures*/true,
+                                         /*StoreCaptures*/true);
+    it = captured_objects.insert(make_pair(Obj, captured)).first;
+  }
+  return !it->second;
+}
+
+// Loop-range instrumentation. {{{1
+// A load or store in an innermost loop whose address is an affine function
+// of the loop's induction variable is not instrumented. Instead, the loop
+// preheader calls bb_flush_range() with the first address, the stride and
+// the number of iterations, so the loop body runs w/o touching the TLEB.
+// We do this only if
+//  -- the loop has a preheader, its latch is the only exiting block and the
+//     backedge-taken count is computable, so the count is exact;
+//  -- the mop dominates the latch, i.e. is executed on every iteration;
+//  -- the loop has no calls and no memory operations other than plain loads
+//     and stores, so all its accesses belong to a single segment and may be
+//     reported before the loop is run.
+void ThreadSanitizer::collectLoopRangeMops(Function &F) {
+  loop_range_mops.clear();
+  loop_range_candidates.clear();
+  if (!InstrumentLoopRanges || InstrumentAll || !EnableMemoryInstrumentation)
+    return;
+  // bb_flush_range() is not sampled, leave the loops to the traces.
+  if (sample_current_function) return;
+  vector<Loop*> loops(LI->begin(), LI->end());
+  while (!loops.empty()) {
+    Loop *L = loops.back();
+    loops.pop_back();
+    if (!L->empty()) {
+      loops.insert(loops.end(), L->begin(), L->end());
+      continue;
+    }
+    BasicBlock *Latch = L->getLoopLatch();
+    if (!L->getLoopPreheader() || !Latch || L->getExitingBlock() != Latch)
+      continue;
+    if (isa<SCEVCouldNotCompute>(SE->getBackedgeTakenCount(L))) continue;
+    vector<Instruction*> mops;
+    bool simple = true;
+    for (Loop::block_iterator LB = L->block_begin(), LE = L->block_end();
+         simple && LB != LE; ++LB) {
+      for (BasicBlock::iterator BI = (*LB)->begin(), BE = (*LB)->end();
+           BI != BE; ++BI) {
+        if (LoadInst *Load = dyn_cast<LoadInst>(BI)) {
+          if (Load->isVolatile() || Load->isAtomic()) simple = false;
+          else mops.push_back(BI);
+        } else if (StoreInst *Store = dyn_cast<StoreInst>(BI)) {
+          if (Store->isVolatile() || Store->isAtomic()) simple = false;
+          else mops.push_back(BI);
+        } else if (isaCallOrInvoke(BI)) {
+          if (!isa<DbgInfoIntrinsic>(BI)) simple = false;
+        } else if (BI->mayReadFromMemory() || BI->mayWriteToMemory()) {
+          simple = false;
+        }
+        if (!simple) break;
+      }
+    }
+    if (!simple) continue;
+    for (size_t i = 0; i < mops.size(); i++) {
+      Instruction *mop = mops[i];
+      bool is_store = isa<StoreInst>(mop);
+      Value *MopPtr = is_store ? cast<StoreInst>(mop)->getPointerOperand()
+                               : cast<LoadInst>(mop)->getPointerOperand();
+      if (!DT->dominates(mop->getParent(), Latch)) continue;
+      // Leave the mops which are not instrumented anyway to
+      // markMopsToInstrument().
+      BasicBlock::iterator BI = mop;
+      if (isThreadLocalMop(MopPtr) || ignoreInlinedMop(BI)) continue;
+      const SCEVAddRecExpr *AR =
+          dyn_cast<SCEVAddRecExpr>(SE->getSCEV(MopPtr));
+      if (!AR || AR->getLoop() != L || !AR->isAffine()) continue;
+      const SCEVConstant *Step =
+          dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+      if (!Step || !SE->isLoopInvariant(AR->getStart(), L)) continue;
+      LoopRangeMop range;
+      range.mop = mop;
+      range.loop = L;
+      range.addr = AR;
+      range.stride = Step->getValue()->getSExtValue();
+      range.size = getMopPtrSize(MopPtr, is_store) / 8;
+      range.is_write = is_store;
+      loop_range_candidates.push_back(range);
+      loop_range_mops.insert(mop);
+    }
+  }
+}
+
+// Insert the bb_flush_range() calls for the mops found by
+// collectLoopRangeMops(). Runs after the traces are instrumented so that the
+// calls are not mistaken for the client calls.
+void ThreadSanitizer::instrumentLoopRanges() {
+  if (loop_range_candidates.empty()) return;
+  SCEVExpander Expander(*SE, "tsan");
+  for (size_t i = 0; i < loop_range_candidates.size(); i++) {
+    LoopRangeMop &range = loop_range_candidates[i];
+    Instruction *Before = range.loop->getLoopPreheader()->getTerminator();
+    const SCEV *Start = range.addr->getStart();
+    const SCEV *Count =
+        SE->getAddExpr(SE->getTruncateOrZeroExtend(
+                           SE->getBackedgeTakenCount(range.loop), PlatformInt),
+                       SE->getConstant(PlatformInt, 1));
+    vector <Value*> arg(6);
+    BasicBlock::iterator MopIt = range.mop;
+    FunctionMopCount++;
+    arg[0] = getInstructionAddr(FunctionMopCount, MopIt, PlatformInt);
+    arg[1] = CastInst::CreatePointerCast(
+        Expander.expandCodeFor(Start, Start->getType(), Before),
+        PlatformInt, "", Before);
+    arg[2] = ConstantInt::getSigned(PlatformInt, range.stride);
+    arg[3] = Expander.expandCodeFor(Count, PlatformInt, Before);
+    arg[4] = ConstantInt::get(PlatformInt, range.size);
+    arg[5] = ConstantInt::get(PlatformInt, range.is_write);
+    BasicBlock::iterator CallIt = CallInst::Create(BBFlushRangeFn, arg, "",
+                                                   Before);
+    instrumentCall(CallIt);
+    instrumentation_stats.newLoopRangeMop();
+  }
+  loop_range_candidates.clear();
+}
+
 void ThreadSanitizer::markMopsToInstrument(Trace &trace) {
   bool isStore = false, isMop = false;
   int size;
@@ -2007,6 +2523,7 @@ void ThreadSanitizer::markMopsToInstrument(Trace &trace) {
           continue;
         }
         if (ignoreInlinedMop(BI)) continue;
+        if (loop_range_mops.count(BI)) continue;
         // Falling through to the alias-analysis-based optimization.
         // If two operations in the same trace access the same memory
         // location, then we can instrument only one of them (the latter
@@ -2023,6 +2540,10 @@ void ThreadSanitizer::markMopsToInstrument(Trace &trace) {
         } else {
           MopPtr = (static_cast<LoadInst&>(IN).getPointerOperand());
         }
+        if (isThreadLocalMop(MopPtr)) {
+          instrumentation_stats.newThreadLocalMop();
+          continue;
+        }
         size = getMopPtrSize(MopPtr, isStore);
 
         bool has_alias = false;
@@ -2131,11 +2652,76 @@ void ThreadSanitizer::markMopsToInstrument(Trace &trace) {
       }
     }
   }
+  if (!InstrumentAll) dropDominatedMops(trace);
   trace.num_mops = trace.mops_to_instrument.size();
   assert(trace.num_mops < TlebSize);
   assert(trace.num_mops < DTlebSize);
 }
 
+// The per-block deduplication above keeps only the last of the aliasing
+// mops in a basic block. Across the blocks of a trace a mop can be dropped
+// if it is subsumed by a mop in a block that dominates its own one: the
+// latter is always executed (and flushed in the same trace) before it. A
+// store subsumes a load or a store of the same location and size, a load
+// subsumes a load. The later access can't be stronger here, as dropping the
+// earlier one would also require post-dominance.
+// This is done only for the traces w/o calls and atomic operations, so that
+// there may be no synchronization between the two mops.
+void ThreadSanitizer::dropDominatedMops(Trace &trace) {
+  vector<Instruction*> mops;
+  for (BlockSet::iterator TI = trace.blocks.begin(),
+                          TE = trace.blocks.end();
+       TI != TE; ++TI) {
+    for (BasicBlock::iterator BI = (*TI)->begin(), BE = (*TI)->end();
+         BI != BE; ++BI) {
+      if (LoadInst *Load = dyn_cast<LoadInst>(BI)) {
+        if (Load->isVolatile() || Load->isAtomic()) return;
+      } else if (StoreInst *Store = dyn_cast<StoreInst>(BI)) {
+        if (Store->isVolatile() || Store->isAtomic()) return;
+      } else if (isaCallOrInvoke(BI)) {
+        if (!isa<DbgInfoIntrinsic>(BI)) return;
+        continue;
+      } else {
+        if (BI->mayReadFromMemory() || BI->mayWriteToMemory()) return;
+        continue;
+      }
+      if (trace.mops_to_instrument.count(BI)) mops.push_back(BI);
+    }
+  }
+  if (mops.size() < 2) return;
+  vector<Value*> ptrs(mops.size());
+  vector<int> sizes(mops.size());
+  for (size_t i = 0; i < mops.size(); i++) {
+    bool is_store = isa<StoreInst>(mops[i]);
+    ptrs[i] = is_store ? cast<StoreInst>(mops[i])->getPointerOperand()
+                       : cast<LoadInst>(mops[i])->getPointerOperand();
+    sizes[i] = getMopPtrSize(ptrs[i], is_store);
+  }
+  // Decide on all the mops before dropping any, so that the result doesn't
+  // depend on the order of the blocks.
+  vector<Instruction*> to_drop;
+  for (size_t i = 0; i < mops.size(); i++) {
+    BasicBlock *BB = mops[i]->getParent();
+    bool is_store = isa<StoreInst>(mops[i]);
+    for (size_t j = 0; j < mops.size(); j++) {
+      BasicBlock *Dom = mops[j]->getParent();
+      if (Dom == BB || !DT->dominates(Dom, BB)) continue;
+      if (is_store && !isa<StoreInst>(mops[j])) continue;
+      if (sizes[i] != sizes[j]) continue;
+      if (AA->alias(ptrs[i], sizes[i], ptrs[j], sizes[j]) !=
+          AliasAnalysis::MustAlias) {
+        continue;
+      }
+      to_drop.push_back(mops[i]);
+      break;
+    }
+  }
+  for (size_t i = 0; i < to_drop.size(); i++) {
+    trace.mops_to_instrument.erase(to_drop[i]);
+    instrumentation_stats.newMopUninstrumentedByAA();
+  }
+}
+
 bool ThreadSanitizer::makeTracePassport(Trace &trace) {
   Passport passport;
   bool isStore = false, isMop;
@@ -2227,6 +2813,9 @@ bool ThreadSanitizer::makeTracePassport(Trace &trace) {
       );
       // TODO(glider): this can be moved to .bss -- need to check.
       LiteRaceStorageGlob->setSection(".data");
+      // A row of counters per LTID is kLiteRaceStorageSize * 8 = 64 bytes;
+      // keep every row in a cache line of its own.
+      LiteRaceStorageGlob->setAlignment(64);
     }
 
     TracePassportType = ArrayType::get(MopType64, TraceNumMops);
@@ -2290,6 +2879,7 @@ bool ThreadSanitizer::instrumentMop(BasicBlock::iterator &BI,
   } else {
     MopAddr = (static_cast<LoadInst&>(IN).getPointerOperand());
   }
+  int size = getMopPtrSize(MopAddr, isStore) / 8;
 
   if (!check_ident_store || !isStore ||
       !(static_cast<StoreInst&>(IN).getOperand(0)->getType()->isPointerTy())) {
@@ -2328,6 +2918,7 @@ bool ThreadSanitizer::instrumentMop(BasicBlock::iterator &BI,
   // MopAddr is calculated regardless of |useTLEB| value.
   if (useTLEB) {
     if (!UseDynamicTleb) {
+      if (MopFilter) MopAddr = filterMop(MopAddr, size, isStore, BI);
       // Store the pointer into TLEB[TLEBIndex].
       vector <Value*> idx;
       idx.push_back(ConstantInt::get(Int32, 0));
@@ -2356,6 +2947,105 @@ bool ThreadSanitizer::instrumentMop(BasicBlock::iterator &BI,
   return true;
 }
 
+// With -use-mop-filter, returns NULL instead of |MopAddr| if the access
+// is found in __tsan_mop_filter, see "Mop filter" in tsan_rtl.cc:
+//   %addr  = ptrtoint %MopAddr to i64
+//   %key   = or (shl %addr, 5), ((size - 1) << 1) | is_write
+//   %entry = load __tsan_mop_filter[(%addr >> 3) & (kMopFilterSize - 1)]
+//   %res   = select (icmp eq %entry, %key), null, %MopAddr
+// For a load both sides are or-ed with 1, so that a store entry matches.
+Value *ThreadSanitizer::filterMop(Value *MopAddr, int size, bool isStore,
+                                  BasicBlock::iterator &BI) {
+  Value *Addr = new PtrToIntInst(MopAddr, Int64, "", BI);
+  Value *Key = BinaryOperator::Create(
+      Instruction::Or,
+      BinaryOperator::Create(Instruction::Shl, Addr,
+                             ConstantInt::get(Int64, 5), "", BI),
+      ConstantInt::get(Int64, ((size - 1) << 1) | (isStore ? 1 : 0)),
+      "", BI);
+  Value *Index = BinaryOperator::Create(
+      Instruction::And,
+      BinaryOperator::Create(Instruction::LShr, Addr,
+                             ConstantInt::get(Int64, 3), "", BI),
+      ConstantInt::get(Int64, kMopFilterSize - 1), "", BI);
+  vector <Value*> idx;
+  idx.push_back(ConstantInt::get(Int32, 0));
+  idx.push_back(Index);
+  Value *Slot = GetElementPtrInst::Create(MopFilter, idx, "", BI);
+  Value *Entry = new LoadInst(Slot, "", BI);
+  if (!isStore) {
+    Entry = BinaryOperator::Create(Instruction::Or, Entry,
+                                   ConstantInt::get(Int64, 1), "", BI);
+    Key = BinaryOperator::Create(Instruction::Or, Key,
+                                 ConstantInt::get(Int64, 1), "", BI);
+  }
+  Value *Hit = new ICmpInst(BI, ICmpInst::ICMP_EQ, Entry, Key, "");
+  return SelectInst::Create(Hit, ConstantPointerNull::get(UIntPtr), MopAddr,
+                            "", BI);
+}
+
+// Replace an llvm.memcpy or llvm.memmove of a small constant length with
+// loads and stores of at most 8 bytes each, like the code generator does:
+//   %v0 = load i64* (src + 0)
+//   %v1 = load i32* (src + 8)
+//   store i64 %v0, i64* (dst + 0)
+//   store i32 %v1, i32* (dst + 8)
+// The new mops are instrumented as usual, i.e. go into the passport of the
+// enclosing trace instead of calling rtl_memcpy() and starting a new trace.
+// All the loads precede the stores, so this is correct for memmove as well.
+// Returns false if the transfer should be passed to the RTL. Otherwise |BI|
+// points to the last new store.
+bool ThreadSanitizer::lowerSmallMemTransfer(BasicBlock::iterator &BI) {
+  if (!EnableMemoryInstrumentation) return false;
+  MemTransferInst &IN = static_cast<MemTransferInst&>(*BI);
+  ConstantInt *Length = dyn_cast<ConstantInt>(IN.getLength());
+  if (!Length || Length->isZero()) return false;
+  uint64_t length = Length->getZExtValue();
+  if (length > (uint64_t)InlineMemTransferLimit) return false;
+  bool is_volatile = IN.isVolatile();
+  unsigned align = IN.getAlignment();
+  if (!align) align = 1;
+  Value *Dest = BitCastInst::CreatePointerCast(IN.getDest(), Int8Ptr, "", BI);
+  Value *Src = BitCastInst::CreatePointerCast(IN.getSource(), Int8Ptr, "",
+                                              BI);
+  vector<Instruction*> new_insts;
+  vector<Value*> values;
+  vector<Value*> dest_ptrs;
+  vector<unsigned> aligns;
+  for (uint64_t offset = 0; offset < length; ) {
+    uint64_t chunk = 8;
+    while (chunk > length - offset) chunk /= 2;
+    IntegerType *ChunkTy = IntegerType::get(*ThisModuleContext, chunk * 8);
+    PointerType *ChunkPtrTy = PointerType::getUnqual(ChunkTy);
+    vector <Value*> idx;
+    idx.push_back(ConstantInt::get(PlatformInt, offset));
+    Value *SrcPtr = BitCastInst::CreatePointerCast(
+        GetElementPtrInst::Create(Src, idx, "", BI), ChunkPtrTy, "", BI);
+    Value *DestPtr = BitCastInst::CreatePointerCast(
+        GetElementPtrInst::Create(Dest, idx, "", BI), ChunkPtrTy, "", BI);
+    unsigned chunk_align = offset ? MinAlign(align, offset) : align;
+    LoadInst *Load = new LoadInst(SrcPtr, "", is_volatile, chunk_align, BI);
+    new_insts.push_back(Load);
+    values.push_back(Load);
+    dest_ptrs.push_back(DestPtr);
+    aligns.push_back(chunk_align);
+    offset += chunk;
+  }
+  for (size_t i = 0; i < values.size(); i++) {
+    new_insts.push_back(
+        new StoreInst(values[i], dest_ptrs[i], is_volatile, aligns[i], BI));
+  }
+  // The mops should be reported at the location of the transfer.
+  for (size_t i = 0; i < new_insts.size(); i++) {
+    new_insts[i]->setDebugLoc(IN.getDebugLoc());
+  }
+  instrumentation_stats.newInlinedMemTransfer();
+  Instruction *Last = new_insts.back();
+  BI->eraseFromParent();
+  BI = Last;
+  return true;
+}
+
 // Instrument llvm.memcpy and llvm.memmove.
 void ThreadSanitizer::instrumentMemTransfer(BasicBlock::iterator &BI) {
   if (!EnableMemoryInstrumentation) return;
@@ -2461,6 +3151,9 @@ void ThreadSanitizer::runOnBasicBlock(BasicBlock *BB,
 void ThreadSanitizer::getAnalysisUsage(AnalysisUsage &AU) const {
 //  AU.addRequired<TargetData>();
   AU.addRequired<AliasAnalysis>();
+  AU.addRequired<DominatorTree>();
+  AU.addRequired<LoopInfo>();
+  AU.addRequired<ScalarEvolution>();
 }
 
 void ThreadSanitizer::parseIgnoreFile(string &file) {
@@ -2471,6 +3164,26 @@ void ThreadSanitizer::parseIgnoreFile(string &file) {
 #endif
 }
 
+// The profile lists one mangled function name per line.
+void ThreadSanitizer::parseSharingProfile(const string &file) {
+  FILE *f = fopen(file.c_str(), "r");
+  if (!f) {
+    errs() << "Could not open the sharing profile " << file << "\n";
+    assert(false);
+    return;
+  }
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), f)) {
+    string name(buf);
+    while (!name.empty() && (name[name.size() - 1] == '\n' ||
+                             name[name.size() - 1] == '\r')) {
+      name.erase(name.size() - 1);
+    }
+    if (!name.empty()) sampled_functions.insert(name);
+  }
+  fclose(f);
+}
+
 bool ThreadSanitizer::shouldIgnoreFunction(Function &F) {
 #if 0
   // TODO(glider): clang integration.
@@ -2501,6 +3214,10 @@ bool ThreadSanitizer::shouldIgnoreFunctionRecursively(Function &F) {
 // InstrumentationStats implementation {{{1
 InstrumentationStats::InstrumentationStats() {
   num_functions = 0;
+  num_sampled_functions = 0;
+  num_cloned_functions = 0;
+  num_bounded_functions = 0;
+  num_inlined_memtransfers = 0;
   num_traces = 0;
   num_bbs = 0;
   num_inst_bbs = 0;
@@ -2522,6 +3239,8 @@ InstrumentationStats::InstrumentationStats() {
   num_uninst_mops_aa = 0;
   num_uninst_mops_flag = 0;
   num_uninst_mops_ignored = 0;
+  num_uninst_mops_local = 0;
+  num_uninst_mops_range = 0;
   for (int i = 0; i < kNumStats; i++) {
     num_traces_with_n_inst_bbs[i] = 0;
   }
@@ -2535,6 +3254,22 @@ void InstrumentationStats::newFunction() {
   num_inst_traces_in_function = 0;
 }
 
+void InstrumentationStats::newSampledFunction() {
+  num_sampled_functions++;
+}
+
+void InstrumentationStats::newClonedFunction() {
+  num_cloned_functions++;
+}
+
+void InstrumentationStats::newBoundedFunction() {
+  num_bounded_functions++;
+}
+
+void InstrumentationStats::newInlinedMemTransfer() {
+  num_inlined_memtransfers++;
+}
+
 void InstrumentationStats::newTrace() {
   num_traces++;
   if (num_inst_bbs_in_trace > 0) {
@@ -2588,6 +3323,16 @@ void InstrumentationStats::newMopUninstrumentedByAA() {
   num_uninst_mops_aa++;
 }
 
+void InstrumentationStats::newThreadLocalMop() {
+  num_uninst_mops++;
+  num_uninst_mops_local++;
+}
+
+void InstrumentationStats::newLoopRangeMop() {
+  num_uninst_mops++;
+  num_uninst_mops_range++;
+}
+
 void InstrumentationStats::newMopUninstrumentedByFlag() {
   num_uninst_mops++;
   num_uninst_mops_flag++;
@@ -2627,6 +3372,14 @@ void InstrumentationStats::printStats() {
   finalize();
   errs() << "\n  INSTRUMENTATION STATS\n\n";
   errs() << "# of functions in the module: " << num_functions << "\n";
+  errs() << "# of functions instrumented in the sampling-only mode: "
+         << num_sampled_functions << "\n";
+  errs() << "# of functions with an uninstrumented clone: "
+         << num_cloned_functions << "\n";
+  errs() << "# of functions with a single DTLEB check: "
+         << num_bounded_functions << "\n";
+  errs() << "# of memcpy/memmove replaced with loads and stores: "
+         << num_inlined_memtransfers << "\n";
   errs() << "# of traces in the module: " << num_traces << "\n";
   errs() << "# of instrumented traces in the module: "
          << num_inst_traces << "\n";
@@ -2646,6 +3399,10 @@ void InstrumentationStats::printStats() {
          << num_uninst_mops_ignored << "\n";
   errs() << "  # of aliasing mops in the same trace: "
          << num_uninst_mops_aa << "\n";
+  errs() << "  # of mops on non-escaping allocas and heap objects: "
+         << num_uninst_mops_local << "\n";
+  errs() << "  # of loop mops reported as ranges: "
+         << num_uninst_mops_range << "\n";
   errs() << "  # of mops ignored because of "
             "-enable-memory-instrumentation=false: "
          << num_uninst_mops_flag << "\n";
@@ -2662,6 +3419,8 @@ void InstrumentationStats::printStats() {
   if (!UseTleb) return;  // TODO(glider) the assertions below are broken.
   assert(num_mops == num_inst_mops + num_uninst_mops);
   assert(num_uninst_mops == num_uninst_mops_aa + num_uninst_mops_ignored
+                                               + num_uninst_mops_local
+                                               + num_uninst_mops_range
                                                + num_uninst_mops_flag);
   assert(num_traces >= num_inst_traces);
   assert(num_traces == num_traces_in_buckets);
@@ -2680,6 +3439,9 @@ INITIALIZE_PASS_BEGIN(ThreadSanitizer, "tsan",
                       false, false)
 //INITIALIZE_PASS_DEPENDENCY(TargetData)
 INITIALIZE_AG_DEPENDENCY(AliasAnalysis)
+INITIALIZE_PASS_DEPENDENCY(DominatorTree)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolution)
 INITIALIZE_PASS_END(ThreadSanitizer, "tsan",
                     "Compile-time instrumentation for runtime "
                     "data race detection with ThreadSanitizer",
@@ -4,6 +4,9 @@
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Constants.h"
 #include "llvm/Instructions.h"
 #include "llvm/Module.h"
@@ -36,6 +39,7 @@ struct DebugPcInfo {
 typedef llvm::SmallSet<llvm::Instruction*, 32> InstSet;
 typedef llvm::SmallSet<llvm::BasicBlock*, 16> BlockSet;
 typedef std::vector<llvm::BasicBlock*> BlockVector;
+typedef std::map<llvm::BasicBlock*, BlockSet> PredecessorMap;
 
 struct Trace {
   BlockSet blocks;
@@ -43,12 +47,26 @@ struct Trace {
   BlockSet exits;
   InstSet mops_to_instrument;
   int num_mops;
+  // The predecessors of the blocks in the function. Only valid while the
+  // trace is being built, see ThreadSanitizer::buildTraces().
+  PredecessorMap *predecessors;
 
-  Trace() : num_mops(0) {}
+  Trace() : num_mops(0), predecessors(NULL) {}
 };
 
 typedef std::vector<Trace*> TraceVector;
 
+// A loop mop reported by a single bb_flush_range() call, see
+// ThreadSanitizer::collectLoopRangeMops().
+struct LoopRangeMop {
+  llvm::Instruction *mop;
+  llvm::Loop *loop;
+  const llvm::SCEVAddRecExpr *addr;
+  int64_t stride;
+  int size;  // In bytes.
+  bool is_write;
+};
+
 struct InstrumentationStats {
   enum { kNumStats = 20 };
   InstrumentationStats();
@@ -61,13 +79,23 @@ struct InstrumentationStats {
   void newInstrumentedMop();
   void newIgnoredInlinedMop();
   void newMopUninstrumentedByAA();
+  void newThreadLocalMop();
+  void newLoopRangeMop();
   void newMopUninstrumentedByFlag();
+  void newSampledFunction();
+  void newClonedFunction();
+  void newBoundedFunction();
+  void newInlinedMemTransfer();
   void finalize();
   void printStats();
 
   std::vector<int> traces_bbs, traces_mops;
   // numbers
   int num_functions;
+  int num_sampled_functions;
+  int num_cloned_functions;
+  int num_bounded_functions;
+  int num_inlined_memtransfers;
   int num_traces;
   int num_inst_traces;
   int num_inst_traces_in_function;
@@ -83,6 +111,8 @@ struct InstrumentationStats {
   int num_uninst_mops;
   int num_uninst_mops_ignored;
   int num_uninst_mops_aa;
+  int num_uninst_mops_local;
+  int num_uninst_mops_range;
   int num_uninst_mops_flag;
 
   // medians
@@ -108,6 +138,7 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
                                      llvm::BasicBlock::iterator &cur_inst,
                                      const llvm::IntegerType *ResultType);
   void parseIgnoreFile(std::string &file);
+  void parseSharingProfile(const std::string &file);
   llvm::DILocation getTopInlinedLocation(llvm::BasicBlock::iterator &BI);
   void dumpInstructionDebugInfo(llvm::Constant *addr,
                                 const llvm::BasicBlock::iterator BI);
@@ -118,19 +149,25 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   void setupRuntimeGlobals();
   bool isDtor(const std::string &mangled_name);
   void writeModuleDebugInfo(llvm::Module &M);
-  BlockSet &getPredecessors(llvm::BasicBlock *bb);
+  void writeModuleTlebInfo(llvm::Module &M);
+  BlockSet &getPredecessors(Trace &trace, llvm::BasicBlock *bb);
   bool visit(llvm::BasicBlock *node, Trace &trace, BlockSet &visited);
   bool traceHasCycles(Trace &trace);
   bool validateTrace(Trace &trace);
   void buildClosureInner(Trace &trace, BlockSet &used);
   void buildClosure(Trace &trace, BlockSet &used);
-  void cachePredecessors(llvm::Function &F);
+  void cachePredecessors(llvm::Function &F, PredecessorMap &predecessors);
   TraceVector buildTraces(llvm::Function &F);
+  void buildTracesInParallel(llvm::Module &M);
   bool isaCallOrInvoke(llvm::BasicBlock::iterator &BI);
   int numMopsInFunction(llvm::Module::iterator &F);
   int getMopPtrSize(llvm::Value *mopPtr, bool isStore);
   bool ignoreInlinedMop(llvm::BasicBlock::iterator &BI);
+  bool isThreadLocalMop(llvm::Value *MopPtr);
   void markMopsToInstrument(Trace &trace);
+  void dropDominatedMops(Trace &trace);
+  void collectLoopRangeMops(llvm::Function &F);
+  void instrumentLoopRanges();
   bool makeTracePassport(Trace &trace);
   bool shouldIgnoreFunction(llvm::Function &F);
   bool shouldIgnoreFunctionRecursively(llvm::Function &F);
@@ -145,17 +182,24 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   void writeSblockEnterForTrace(Trace &trace);
   void insertIgnoreInc(llvm::BasicBlock::iterator &Before);
   void insertIgnoreDec(llvm::BasicBlock::iterator &Before);
+  bool shouldCloneForIgnore(llvm::Function &F);
+  void cloneFunctionsForIgnore(llvm::Module &M);
+  void insertIgnoreDispatch(llvm::Function &F, llvm::Function *Clone);
   void insertFlushCurrentCall(Trace &trace, llvm::Instruction *Before,
                               bool useTLEB, llvm::Value *MopAddr);
-  void insertMaybeFlushTleb(llvm::Instruction *Before);
+  void insertMaybeFlushTleb(llvm::Instruction *Before, int threshold);
+  int getFunctionTlebBound(llvm::Function &F, TraceVector &traces);
   void writeValueIntoTleb(llvm::Value *EventValue,
                           llvm::BasicBlock::iterator &Before);
+  llvm::Value *filterMop(llvm::Value *MopAddr, int size, bool isStore,
+                         llvm::BasicBlock::iterator &BI);
 
   bool instrumentMop(llvm::BasicBlock::iterator &BI,
                      bool isStore,
                      bool check_ident_store,
                      Trace &trace,
                      bool useTLEB);
+  bool lowerSmallMemTransfer(llvm::BasicBlock::iterator &BI);
   void instrumentMemTransfer(llvm::BasicBlock::iterator &BI);
   void instrumentCall(llvm::BasicBlock::iterator &BI);
 
@@ -173,7 +217,8 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   llvm::Value *TracePassportGlob;
   llvm::GlobalVariable *LiteRaceStorageGlob;
   // Functions provided by the RTL.
-  llvm::Constant *BBFlushCurrentFn, *BBFlushMop, *FlushTlebFn;
+  llvm::Constant *BBFlushCurrentFn, *BBFlushMop, *BBFlushRangeFn, *FlushTlebFn;
+  llvm::Constant *BBFlushSampledFn, *BBFlushMopSampledFn;
   llvm::Constant *RtnCallFn, *RtnExitFn, *ShadowStackCheckFn;
   llvm::Constant *MemCpyFn, *MemMoveFn, *MemSetIntrinsicFn;
   // Basic types.
@@ -200,9 +245,14 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   llvm::Value *ShadowStack, *CurrentStackEnd;
   llvm::Value *TLEB, *DTLEB, *DTlebIndex, *LiteraceTid;
   llvm::Value *ThreadLocalIgnore;
+  llvm::Value *MopFilter;  // NULL unless -use-mop-filter.
 
   llvm::AliasAnalysis *AA;
   llvm::TargetData *TD;
+  // For the current function.
+  llvm::ScalarEvolution *SE;
+  llvm::LoopInfo *LI;
+  llvm::DominatorTree *DT;
 
   // Constants.
   // TODO(glider): hashing constants and BB addresses should be different on
@@ -214,10 +264,13 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   //static const int kFNV1aPrime = 104729, kFNV1aModulo = 65536;
   static const int kFNV1aPrime = 1299827, kFNV1aModulo = 2097152;
   static const int kMaxAddr = 1 << 30;
-  static const int kDebugInfoMagicNumber = 0xdb914f0;
+  // Must be in sync with tsan_rtl_symbolize_llvm.cc
+  static const int kDebugInfoMagicNumber = 0xdb914f1;
   // TODO(glider): must be in sync with ts_trace_info.h
   static const int kLiteRaceNumTids = 8;
   static const int kLiteRaceStorageSize = 8;
+  // Must be in sync with tsan_rtl.cc
+  static const int kMopFilterSize = 256;
   static const size_t kMaxCallStackSize = 1 << 12;
   static const uintptr_t kRtnMask32 = 1L<<31;
   static const uintptr_t kRtnMask64 = 1L<<63;
@@ -230,15 +283,33 @@ struct ThreadSanitizer : public llvm::ModulePass { // {{{1
   std::set<std::string> debug_path_set;
   std::map<llvm::Constant*, DebugPcInfo> debug_pc_map;
 
-  // TODO(glider): box the trace into a class that provides the set of
-  // predecessors.
-  std::map<llvm::BasicBlock*, BlockSet> predecessors;
+  // The traces built by buildTracesInParallel().
+  std::map<llvm::Function*, TraceVector> prebuilt_traces;
   llvm::Module *ThisModule;
   llvm::LLVMContext *ThisModuleContext;
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
 
 private:
   InstSet calls_to_instrument;
+  // Whether an alloca or a malloc() call of the current function may be
+  // captured, see isThreadLocalMop().
+  std::map<llvm::Value*, bool> captured_objects;
+  // The mops of the current function reported by bb_flush_range().
+  InstSet loop_range_mops;
+  std::vector<LoopRangeMop> loop_range_candidates;
+  // The functions which have touched only thread-local memory in a
+  // profiling run, see parseSharingProfile().
+  std::set<std::string> sampled_functions;
+  // Whether the current function is in |sampled_functions|.
+  bool sample_current_function;
+  // Function => its uninstrumented clone, see cloneFunctionsForIgnore().
+  std::map<llvm::Function*, llvm::Function*> uninstrumented_clones;
+  std::set<llvm::Function*> clones;
+  // The number of DTLEB slots the current function may take,
+  // see getFunctionTlebBound().
+  int function_tleb_bound;
+  // The largest trace in the module, see writeModuleTlebInfo().
+  int max_trace_mops;
 };  // }}}
 
 }  // namespace
@@ -25,7 +25,6 @@
 
 #include "race_checker.h"
 
-#include <map>
 #include <set>
 #include <vector>
 
@@ -36,6 +35,7 @@
 #pragma comment(lib, "dbghelp.lib")
 #else
 #include <execinfo.h>
+#include <unistd.h>
 #include <pthread.h>
 #endif
 
@@ -85,36 +85,95 @@ static int race_checker_level     = ReadIntFromEnv("RACECHECKER", 0);
 static int race_checker_sleep_ms  = ReadIntFromEnv("RACECHECKER_SLEEP_MS", 1);
 static int race_checker_verbosity = ReadIntFromEnv("RACECHECKER_VERBOSITY", 0);
 
-struct CallSite {         // Data about a call site.
-  RaceChecker::ThreadId thread;
-  int nstack;
-  void *stack[20];
-};
+// The accesses in flight are kept in a fixed open-addressing table of slots.
+// An access of 'id' takes a free slot among the kMaxProbe slots starting at
+// SlotIndex(id) and then looks for the other accesses of 'id' in the same
+// window, so the checkers of different ids do not touch the same slots and
+// no lock is taken unless a race is found. The slot only points to the
+// RaceChecker object, which lives on the stack of its thread until End().
+static const int kTableSize = 4096;
+static const int kMaxProbe = 64;
+static const uintptr_t kSlotBusy = 1;  // A slot being filled in.
 
-struct TypedCallsites {
-  std::vector<CallSite> type[2];    // Index 0 is for reads, index 1 is for writes.
+struct Slot {
+  volatile uintptr_t id;  // 0 if free.
+  const RaceChecker *checker;
 };
 
-typedef std::map<std::string, TypedCallsites> AddressMap;
+static Slot race_checker_slots[kTableSize];
+
+#ifdef _MSC_VER
+static uintptr_t AtomicCas(volatile uintptr_t *p, uintptr_t old_value,
+                           uintptr_t new_value) {
+  return (uintptr_t)InterlockedCompareExchangePointer(
+      (PVOID volatile*)p, (PVOID)new_value, (PVOID)old_value);
+}
+static void MemoryFence() { MemoryBarrier(); }
+#else
+static uintptr_t AtomicCas(volatile uintptr_t *p, uintptr_t old_value,
+                           uintptr_t new_value) {
+  return __sync_val_compare_and_swap(p, old_value, new_value);
+}
+static void MemoryFence() { __sync_synchronize(); }
+#endif
+
+static int SlotIndex(uintptr_t id) {
+  return (int)(((id >> 3) * 2654435761U) % kTableSize);
+}
 
-static Mutex race_checker_mu;
-static AddressMap *race_checker_map;  // Under race_checker_mu.
+// Taken while a race is being reported. While race_checker_reporting is set,
+// End() waits for the reporter before letting its RaceChecker go.
+static Mutex race_checker_report_mu;
+static volatile int race_checker_reporting;
 
-// Return a string decribing the callsites of the threads
-// accessing a location.
-static void DescribeAccesses(std::string id, TypedCallsites *c) {
-  fprintf(stderr, "Race on '%s' found between these points\n", id.c_str());
+// The interned string ids.
+static Mutex race_checker_intern_mu;
+static std::set<std::string> *race_checker_ids;  // Under race_checker_intern_mu.
+
+void RaceChecker::Intern(const std::string &id) {
+  if (id.empty()) {
+    id_ = 0;
+    name_ = NULL;
+    return;
+  }
+  race_checker_intern_mu.Lock();
+  if (race_checker_ids == 0) {
+    race_checker_ids = new std::set<std::string>;
+  }
+  const std::string &interned = *race_checker_ids->insert(id).first;
+  race_checker_intern_mu.Unlock();
+  id_ = (uintptr_t)&interned;
+  name_ = interned.c_str();
+}
+
+// Print the callsites of the threads accessing a location.
+// Called with race_checker_report_mu held and race_checker_reporting set.
+void RaceChecker::DescribeAccesses(uintptr_t id, const char *name) {
+  if (name) {
+    fprintf(stderr, "Race on '%s' found between these points\n", name);
+  } else {
+    fprintf(stderr, "Race on '%p' found between these points\n", (void*)id);
+  }
+  std::vector<const RaceChecker*> accessors;
+  int first = SlotIndex(id);
+  for (int i = 0; i < kMaxProbe; i++) {
+    Slot *slot = &race_checker_slots[(first + i) % kTableSize];
+    if (slot->id == id)
+      accessors.push_back(slot->checker);
+  }
   std::set<RaceChecker::ThreadId> reported_accessors;
   for (int t = 1; t >= 0; t--) {  // Iterate starting from writers.
-    for (size_t i = 0; i != c->type[t].size(); i++) {
-      CallSite *s = &c->type[t][i];
-      if (reported_accessors.insert(s->thread).second) {
+    for (size_t i = 0; i != accessors.size(); i++) {
+      const RaceChecker *s = accessors[i];
+      if (s->type_ != t)
+        continue;
+      if (reported_accessors.insert(s->thread_).second) {
         // Report each accessor just once.
         fprintf(stderr, "%s\n", (t == 0? "=== reader: " : "=== writer: "));
       #ifdef _MSC_VER
         // From http://msdn.microsoft.com/en-us/library/ms680578(VS.85).aspx
-        for (int i = 2; i < s->nstack; i++) {
-          DWORD frame = (DWORD)s->stack[i];
+        for (int i = 2; i < s->nstack_; i++) {
+          DWORD frame = (DWORD)s->stack_[i];
           ULONG64 buffer[(sizeof(SYMBOL_INFO) +
                          MAX_SYM_NAME * sizeof(TCHAR) +
                          sizeof(ULONG64) - 1) /
@@ -141,17 +200,18 @@ static void DescribeAccesses(std::string id, TypedCallsites *c) {
             fprintf(stderr, "[0x%X] <%s>\n", frame, pSymbol->Name);
         }
       #else
-        backtrace_symbols_fd(s->stack+2, s->nstack-2, 2/*stderr*/);
+        backtrace_symbols_fd((void**)s->stack_+2, s->nstack_-2, 2/*stderr*/);
       #endif
       }
     }
   }
 }
 
-// Record an access of type "type_" by the calling thread to "address_".
+// Record an access of type "type_" by the calling thread to "id_".
 // type_ is 0 for reads or 1 or for writes.
-// address_ addresses a variable on which a race is suspected.
+// id_ identifies a variable on which a race is suspected.
 void RaceChecker::Start() {
+  this->slot_ = -1;
   if (race_checker_level <= 0 || IdIsEmpty())
     return;
 
@@ -161,47 +221,70 @@ void RaceChecker::Start() {
   this->thread_ = pthread_self();
 #endif
   if (race_checker_verbosity > 0) {
-    fprintf(stderr, "RaceChecker::%s instance created for '%s' on thread 0x%X\n",
-            this->type_ == WRITE ? "WRITE" : "READ ",
-            this->id_.c_str(), (unsigned int)this->thread_);
+    if (this->name_) {
+      fprintf(stderr, "RaceChecker::%s instance created for '%s' on thread 0x%X\n",
+              this->type_ == WRITE ? "WRITE" : "READ ",
+              this->name_, (unsigned int)this->thread_);
+    } else {
+      fprintf(stderr, "RaceChecker::%s instance created for '%p' on thread 0x%X\n",
+              this->type_ == WRITE ? "WRITE" : "READ ",
+              (void*)this->id_, (unsigned int)this->thread_);
+    }
   }
-  CallSite callsite;
-  callsite.nstack =
+  this->nstack_ =
 #ifdef _MSC_VER
       CaptureStackBackTrace(0,
-                sizeof(callsite.stack)/sizeof(callsite.stack[0]),
-                callsite.stack, NULL);
+                sizeof(this->stack_)/sizeof(this->stack_[0]),
+                this->stack_, NULL);
 #else
-      backtrace(callsite.stack,
-                sizeof(callsite.stack)/sizeof(callsite.stack[0]));
+      backtrace(this->stack_,
+                sizeof(this->stack_)/sizeof(this->stack_[0]));
 #endif
-  callsite.thread = this->thread_;
-  race_checker_mu.Lock();
-  if (race_checker_map == 0) {
-    race_checker_map = new AddressMap;
+  int first = SlotIndex(this->id_);
+  for (int i = 0; i < kMaxProbe; i++) {
+    int idx = (first + i) % kTableSize;
+    if (race_checker_slots[idx].id == 0 &&
+        AtomicCas(&race_checker_slots[idx].id, 0, kSlotBusy) == 0) {
+      race_checker_slots[idx].checker = this;
+      MemoryFence();
+      race_checker_slots[idx].id = this->id_;
+      this->slot_ = idx;
+      break;
+    }
   }
-  TypedCallsites *c = &(*race_checker_map)[this->id_];
-  c->type[this->type_].push_back(callsite);
-  // A race requires at least one writer and at least two accessors.
-  if (c->type[WRITE].size() != 0 &&
-      c->type[READ].size() + c->type[WRITE].size() > 1) {
-    // Race only if a writer is a different thread from another accessor.
-    bool is_race = false;
-    for (size_t w = 0; !is_race && w != c->type[WRITE].size(); w++) {
-      for (int t = 0; !is_race && t != 2; t++) {
-        for (size_t i = 0; !is_race && i != c->type[t].size(); i++) {
-          is_race = (c->type[WRITE][w].thread != c->type[t][i].thread);
-        }
-      }
+  if (this->slot_ < 0) {
+    static bool warned = false;
+    if (!warned) {
+      warned = true;
+      fprintf(stderr, "RaceChecker: too many accesses in flight, "
+              "some of them are not checked\n");
     }
-    if (is_race) {
-      DescribeAccesses(this->id_, c);
-      if (race_checker_level >= 2) {
-        exit(1);
-      }
+    return;
+  }
+  MemoryFence();
+
+  // A race requires at least one writer and at least two accessors.
+  // Race only if a writer is a different thread from another accessor.
+  bool is_race = false;
+  for (int i = 0; !is_race && i < kMaxProbe; i++) {
+    int idx = (first + i) % kTableSize;
+    if (idx == this->slot_ || race_checker_slots[idx].id != this->id_)
+      continue;
+    const RaceChecker *other = race_checker_slots[idx].checker;
+    is_race = (this->type_ == WRITE || other->type_ == WRITE) &&
+              other->thread_ != this->thread_;
+  }
+  if (is_race) {
+    race_checker_report_mu.Lock();
+    race_checker_reporting = 1;
+    MemoryFence();
+    DescribeAccesses(this->id_, this->name_);
+    if (race_checker_level >= 2) {
+      exit(1);
     }
+    race_checker_reporting = 0;
+    race_checker_report_mu.Unlock();
   }
-  race_checker_mu.Unlock();
   if (race_checker_sleep_ms != 0) {
     #ifdef _MSC_VER
     Sleep(race_checker_sleep_ms);
@@ -211,25 +294,17 @@ void RaceChecker::Start() {
   }
 }
 
-// Remove the access recorded by this->Start(). Assumes that a single thread
-// call Start/End in a correctly-nested fashion on a single address.
+// Remove the access recorded by this->Start().
 void RaceChecker::End() {
-  if (race_checker_level <= 0 || IdIsEmpty())
+  if (this->slot_ < 0)
     return;
 
-  race_checker_mu.Lock();
-  TypedCallsites *c = &(*race_checker_map)[this->id_];
-  std::vector<CallSite> &vec = c->type[this->type_];
-  int i;
-  for (i = vec.size() - 1; i >= 0; --i) {
-    if (vec[i].thread == this->thread_) {
-      vec.erase(vec.begin() + i);
-      break;
-    }
-  }
-  CHECK(i >= 0);
-  if (c->type[READ].size() + c->type[WRITE].size() == 0) {
-    race_checker_map->erase(this->id_);
+  Slot *slot = &race_checker_slots[this->slot_];
+  CHECK(slot->checker == this);
+  CHECK(AtomicCas(&slot->id, this->id_, 0) == this->id_);
+  // A reporter may be reading this object.
+  if (race_checker_reporting) {
+    race_checker_report_mu.Lock();
+    race_checker_report_mu.Unlock();
   }
-  race_checker_mu.Unlock();
 }
@@ -132,28 +132,30 @@ class RaceChecker {
  public:
   enum Type { READ = 0, WRITE = 1 };
   RaceChecker(Type type, const volatile void *address)
-    : type_(type), id_(AddressToString(address)) {
+    : type_(type), id_((uintptr_t)address), name_(NULL) {
     this->Start();
   }
   RaceChecker(Type type, const char *id)
-    : type_(type), id_(id) {
+    : type_(type) {
+    Intern(id);
     this->Start();
   }
   RaceChecker(Type type, const wchar_t *id)
     : type_(type) {
     // HACK
     std::wstring w(id);
-    id_ = std::string(w.begin(), w.end());
+    Intern(std::string(w.begin(), w.end()));
     this->Start();
   }
   RaceChecker(Type type, const std::string &id)
-    : type_(type), id_(id) {
+    : type_(type) {
+    Intern(id);
     this->Start();
   }
   RaceChecker(Type type, const std::wstring &id)
     : type_(type) {
     // HACK
-    id_ = std::string(id.begin(), id.end());
+    Intern(std::string(id.begin(), id.end()));
     this->Start();
   }
   ~RaceChecker() {
@@ -167,24 +169,24 @@ class RaceChecker {
   typedef pthread_t ThreadId;
 #endif
  private:
-  std::string AddressToString(const volatile void *ptr) {
-    char tmp[100] = "";
-  #ifdef _MSC_VER
-    _snprintf_s(tmp, sizeof(tmp), _TRUNCATE, "0x%X", ptr);
-  #else
-    snprintf(tmp, sizeof(tmp), "%p", ptr);
-  #endif
-    return tmp;
-  }
+  // The string ids are interned, the id of a checker is the address of its
+  // interned string (or the checked address itself), 0 if it is empty.
+  void Intern(const std::string &id);
   bool IdIsEmpty() {
-    return id_ == "" || id_ == AddressToString(NULL);
+    return id_ == 0;
   }
+  static void DescribeAccesses(uintptr_t id, const char *name);
 
   void Start();
   void End();
   int type_;
   ThreadId thread_;
-  std::string id_;
+  uintptr_t id_;
+  const char *name_;  // The interned string id, NULL for an address.
+  int slot_;          // The slot of this access, -1 if not registered.
+  // The call site of this access; read by the thread that reports a race.
+  int nstack_;
+  void *stack_[20];
 };
 
 #endif  // RACE_CHECKER_H_
@@ -31,19 +31,56 @@
 
 #include "ts_util.h"
 
+// Storage for the DenseMultimaps which are never destroyed before the arena
+// (e.g. the sets kept by an interning table): the elements are carved out
+// of big chunks instead of being allocated one set at a time.
+template<class T>
+class DenseMultimapArena {
+ public:
+  explicit DenseMultimapArena(size_t chunk_size = 1024)
+    : chunk_size_(chunk_size), pos_(NULL), end_(NULL) { }
+
+  ~DenseMultimapArena() {
+    for (size_t i = 0; i < chunks_.size(); i++)
+      delete [] chunks_[i];
+  }
+
+  T *Allocate(size_t n) {
+    if (pos_ + n > end_) {
+      size_t size = max(n, chunk_size_);
+      pos_ = new T[size];
+      end_ = pos_ + size;
+      chunks_.push_back(pos_);
+    }
+    T *res = pos_;
+    pos_ += n;
+    return res;
+  }
+
+ private:
+  size_t chunk_size_;
+  T *pos_, *end_;
+  vector<T*> chunks_;
+};
+
 // DenseMultimap is imilar to STL multimap, but optimized for memory.
 // DenseMultimap objects are immutable after creation.
 // All CTORs have linear complexity.
+// Up to kPreallocatedElements elements are kept inline, the larger sets are
+// on the heap or, if an arena is given, in the arena.
+// To look a set up w/o building it, Hash() and the probes below describe
+// m+{t} and m-{t} by m and t; they expect T to be a POD.
 template<class T, int kPreallocatedElements>
 class DenseMultimap {
  public:
   typedef const T *const_iterator;
+  typedef DenseMultimapArena<T> Arena;
 
   enum RemoveEnum {REMOVE};
 
   // Create multimap {t1, t2}
-  DenseMultimap(const T &t1, const T &t2) {
-    Allocate(2);
+  DenseMultimap(const T &t1, const T &t2, Arena *arena = NULL) {
+    Allocate(2, arena);
     if (t1 < t2) {
       ptr_[0] = t1;
       ptr_[1] = t2;
@@ -56,14 +93,21 @@ class DenseMultimap {
 
   // Create a copy of m.
   DenseMultimap(const DenseMultimap &m) {
-    Allocate(m.size());
+    Allocate(m.size(), NULL);
+    copy(m.begin(), m.end(), ptr_);
+    Validate();
+  }
+
+  // Ditto, in the arena.
+  DenseMultimap(const DenseMultimap &m, Arena *arena) {
+    Allocate(m.size(), arena);
     copy(m.begin(), m.end(), ptr_);
     Validate();
   }
 
   // Create multimap m+{t}
-  DenseMultimap(const DenseMultimap &m, const T &t) {
-    Allocate(m.size() + 1);
+  DenseMultimap(const DenseMultimap &m, const T &t, Arena *arena = NULL) {
+    Allocate(m.size() + 1, arena);
     const_iterator it = lower_bound(m.begin(), m.end(), t);
     copy(m.begin(), it, ptr_);
     ptr_[it - m.begin()] = t;
@@ -72,10 +116,11 @@ class DenseMultimap {
   }
 
   // Create multimap m-{t}
-  DenseMultimap(const DenseMultimap &m, RemoveEnum remove, const T &t) {
+  DenseMultimap(const DenseMultimap &m, RemoveEnum remove, const T &t,
+                Arena *arena = NULL) {
     const_iterator it = lower_bound(m.begin(), m.end(), t);
     CHECK(it < m.end() && it >= m.begin());
-    Allocate(m.size() - 1);
+    Allocate(m.size() - 1, arena);
     copy(m.begin(), it, ptr_);
     copy(it + 1, m.end(), ptr_ + (it - m.begin()));
     Validate();
@@ -84,7 +129,8 @@ class DenseMultimap {
   ~DenseMultimap() {
     if (size_ > kPreallocatedElements) {
       CHECK(ptr_ != (T*)&array_);
-      delete [] ptr_;
+      if (!in_arena_)
+        delete [] ptr_;
     } else {
       CHECK(ptr_ == (T*)&array_);
     }
@@ -104,6 +150,58 @@ class DenseMultimap {
     return binary_search(begin(), end(), t);
   }
 
+  size_t Hash() const {
+    size_t h = kHashSeed;
+    for (size_t i = 0; i < size(); i++)
+      h = HashStep(h, ptr_[i]);
+    return h;
+  }
+
+  // Hash() of m+{t}.
+  static size_t HashWith(const DenseMultimap &m, const T &t) {
+    const_iterator it = upper_bound(m.begin(), m.end(), t);
+    size_t h = kHashSeed;
+    for (const_iterator i = m.begin(); i != it; ++i)
+      h = HashStep(h, *i);
+    h = HashStep(h, t);
+    for (const_iterator i = it; i != m.end(); ++i)
+      h = HashStep(h, *i);
+    return h;
+  }
+
+  // Hash() of m-{t}, m must have t.
+  static size_t HashWithout(const DenseMultimap &m, const T &t) {
+    const_iterator it = lower_bound(m.begin(), m.end(), t);
+    DCHECK(it < m.end() && *it == t);
+    size_t h = kHashSeed;
+    for (const_iterator i = m.begin(); i != m.end(); ++i) {
+      if (i != it)
+        h = HashStep(h, *i);
+    }
+    return h;
+  }
+
+  // Is this set m+{t}?
+  bool EqualsWith(const DenseMultimap &m, const T &t) const {
+    if (size() != m.size() + 1) return false;
+    size_t pos = upper_bound(m.begin(), m.end(), t) - m.begin();
+    return Equal(m.begin(), pos, ptr_) && ptr_[pos] == t &&
+        Equal(m.begin() + pos, m.size() - pos, ptr_ + pos + 1);
+  }
+
+  // Is this set m-{t}? m must have t.
+  bool EqualsWithout(const DenseMultimap &m, const T &t) const {
+    if (size() + 1 != m.size()) return false;
+    size_t pos = lower_bound(m.begin(), m.end(), t) - m.begin();
+    DCHECK(pos < m.size() && m[pos] == t);
+    return Equal(m.begin(), pos, ptr_) &&
+        Equal(m.begin() + pos + 1, size() - pos, ptr_ + pos);
+  }
+
+  bool operator == (const DenseMultimap &m) const {
+    return size() == m.size() && Equal(begin(), size(), m.begin());
+  }
+
   bool operator < (const DenseMultimap &m) const {
     if (size() != m.size()) return size() < m.size();
     for (size_t i = 0; i < size(); i++) {
@@ -114,11 +212,31 @@ class DenseMultimap {
   }
 
  private:
+  static const size_t kHashSeed = 0x9E3779B9;
+
+  static bool Equal(const T *a, size_t n, const T *b) {
+    for (size_t i = 0; i < n; i++) {
+      if (a[i] != b[i]) return false;
+    }
+    return true;
+  }
+
+  // FNV-1a over the bytes of t.
+  static size_t HashStep(size_t h, const T &t) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&t);
+    for (size_t i = 0; i < sizeof(T); i++)
+      h = (h ^ bytes[i]) * 16777619;
+    return h;
+  }
 
-  void Allocate(int required_size) {
+  void Allocate(int required_size, Arena *arena) {
     size_ = required_size;
+    in_arena_ = false;
     if (size_ <= kPreallocatedElements) {
       ptr_ = (T*)&array_;
+    } else if (arena) {
+      ptr_ = arena->Allocate(size_);
+      in_arena_ = true;
     } else {
       ptr_ = new T[size_];
     }
@@ -132,6 +250,7 @@ class DenseMultimap {
 
   T *ptr_;
   int size_;
+  bool in_arena_;
   T array_[kPreallocatedElements];
 };
 
@@ -105,3 +105,41 @@ bool StringVectorMatch(const vector<string>& v, const string& obj) {
       return true;
   return false;
 }
+
+static bool IsLiteral(const string& pattern) {
+  return !pattern.empty() && pattern.find_first_of("*?") == string::npos;
+}
+
+void IgnoreMatcher::Compile(const vector<IgnoreTriple>& v) {
+  funs_.clear();
+  objs_.clear();
+  files_.clear();
+  rest_.clear();
+  size_ = v.size();
+  for (size_t i = 0; i < v.size(); i++) {
+    const IgnoreTriple &t = v[i];
+    // A literal matches only the equal string, and a <literal, *, *> triple
+    // does not match an empty name (see TripleVectorMatchKnown()), so a
+    // lookup of the non-empty name is exact.
+    if (IsLiteral(t.fun) && t.obj == "*" && t.file == "*") {
+      funs_.insert(t.fun);
+    } else if (t.fun == "*" && IsLiteral(t.obj) && t.file == "*") {
+      objs_.insert(t.obj);
+    } else if (t.fun == "*" && t.obj == "*" && IsLiteral(t.file)) {
+      files_.insert(t.file);
+    } else {
+      rest_.push_back(t);
+    }
+  }
+}
+
+bool IgnoreMatcher::Match(const string& fun, const string& obj,
+                          const string& file) const {
+  if (!fun.empty() && !funs_.empty() && funs_.count(fun))
+    return true;
+  if (!obj.empty() && !objs_.empty() && objs_.count(obj))
+    return true;
+  if (!file.empty() && !files_.empty() && files_.count(file))
+    return true;
+  return TripleVectorMatchKnown(rest_, fun, obj, file);
+}
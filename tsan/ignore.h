@@ -29,10 +29,39 @@ struct IgnoreFile : public IgnoreTriple {
   IgnoreFile(string file) : IgnoreTriple("*", "*", file) {}
 };
 
+// A vector<IgnoreTriple> precompiled for matching, see
+// TripleVectorMatchKnown() for the semantics of Match().
+// Most of the triples have a single component w/o wildcards (e.g. "fun:foo");
+// these are looked up by name. The rest are matched one by one.
+class IgnoreMatcher {
+ public:
+  IgnoreMatcher() : size_(0) { }
+  void Compile(const vector<IgnoreTriple>& v);
+  bool Match(const string& fun, const string& obj, const string& file) const;
+  size_t size() const { return size_; }
+ private:
+  set<string> funs_;
+  set<string> objs_;
+  set<string> files_;
+  vector<IgnoreTriple> rest_;
+  size_t size_;
+};
+
 struct IgnoreLists {
   vector<IgnoreTriple> ignores;
   vector<IgnoreTriple> ignores_r;
   vector<IgnoreTriple> ignores_hist;
+
+  // Compiled versions of the vectors above, valid after Compile().
+  IgnoreMatcher ignores_matcher;
+  IgnoreMatcher ignores_r_matcher;
+  IgnoreMatcher ignores_hist_matcher;
+
+  void Compile() {
+    ignores_matcher.Compile(ignores);
+    ignores_r_matcher.Compile(ignores_r);
+    ignores_hist_matcher.Compile(ignores_hist);
+  }
 };
 
 extern IgnoreLists *g_ignore_lists;
@@ -0,0 +1,50 @@
+# Run with --detect_deadlocks.
+# A mutex created where a destroyed or freed one lived is a new mutex and
+# must not inherit the lock order of the old one.
+# Exactly one potential deadlock is expected, at the end.
+
+# Start thread T0.
+THR_START 0 0 0 0
+RTN_CALL 0 ca000001 ca000002 0
+
+# Two heap mutexes A (abc000) and C (abc100) and a global mutex B (7778).
+MALLOC 0 cdeffedc abc000 200
+LOCK_CREATE 0 ff0 abc000 0
+LOCK_CREATE 0 ff1 7778 0
+LOCK_CREATE 0 ff2 abc100 0
+
+# A then B, C then B.
+WRITER_LOCK 0 a1 abc000 0
+WRITER_LOCK 0 a2 7778 0
+UNLOCK 0 a3 7778 0
+UNLOCK 0 a4 abc000 0
+WRITER_LOCK 0 a5 abc100 0
+WRITER_LOCK 0 a6 7778 0
+UNLOCK 0 a7 7778 0
+UNLOCK 0 a8 abc100 0
+
+# A is destroyed, C is not; both are freed.
+LOCK_DESTROY 0 b1 abc000 0
+FREE 0 b2 abc000 0
+
+# New mutexes at the same addresses.
+MALLOC 0 cdeffedc abc000 200
+LOCK_CREATE 0 c0 abc000 0
+
+# B then the new A, B then the new C: no deadlock.
+WRITER_LOCK 0 c1 7778 0
+WRITER_LOCK 0 c2 abc000 0
+UNLOCK 0 c3 abc000 0
+WRITER_LOCK 0 c4 abc100 0
+UNLOCK 0 c5 abc100 0
+UNLOCK 0 c6 7778 0
+
+############################
+# Potential deadlock here: #
+############################
+#
+# The new A then B, while B then the new A was seen above.
+WRITER_LOCK 0 d1 abc000 0
+WRITER_LOCK 0 d2 7778 0
+UNLOCK 0 d3 7778 0
+UNLOCK 0 d4 abc000 0
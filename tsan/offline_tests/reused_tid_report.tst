@@ -0,0 +1,54 @@
+# Run with --reuse_dead_tids --announce_threads.
+# T3 starts after T1 has been joined, so it gets the slot of T1. The reports
+# must still name the frontend TIDs: the race on 0xabc008 is between T2 and
+# T3, the one on 0xabc000 between T2 and T1, and T1 and T3 are announced
+# with their own creation points. Only the order of the announcements may
+# differ from a run w/o --reuse_dead_tids.
+
+# Start thread T0.
+THR_START 0 0 0 0
+RTN_CALL 0 ca000001 ca000002 0
+MALLOC 0 cdeffedc abc000 100
+
+# T0 creates T1, which writes 0xabc000 and ends.
+RTN_CALL 0 ca000002 ca000101 0
+THR_CREATE_BEFORE 0 ca000101 0 0
+THR_START 1 0 0 0
+THR_CREATE_AFTER 0 ca000101 0 1
+RTN_EXIT 0 0 0 0
+RTN_CALL 1 ca100001 ca100002 0
+SBLOCK_ENTER 1 ca100002 0 0
+WRITE 1 aa100001 abc000 4
+THR_END 1 0 0 0
+
+# T0 creates T2 before joining T1.
+RTN_CALL 0 ca000002 ca000103 0
+THR_CREATE_BEFORE 0 ca000103 0 0
+THR_START 2 0 0 0
+THR_CREATE_AFTER 0 ca000103 0 2
+RTN_EXIT 0 0 0 0
+
+# T0 joins T1 and creates T3, which takes the slot of T1.
+THR_JOIN_AFTER 0 0 1 0
+RTN_CALL 0 ca000002 ca000102 0
+THR_CREATE_BEFORE 0 ca000102 0 0
+THR_START 3 0 0 0
+THR_CREATE_AFTER 0 ca000102 0 3
+RTN_EXIT 0 0 0 0
+RTN_CALL 3 ca300001 ca300002 0
+SBLOCK_ENTER 3 ca300002 0 0
+WRITE 3 aa300001 abc008 4
+
+##############
+# Races here #
+##############
+RTN_CALL 2 ca200001 ca200002 0
+SBLOCK_ENTER 2 ca200002 0 0
+WRITE 2 aa200001 abc008 4
+WRITE 2 aa200002 abc000 4
+
+THR_END 3 0 0 0
+THR_END 2 0 0 0
+THR_JOIN_AFTER 0 0 2 0
+THR_JOIN_AFTER 0 0 3 0
+THR_END 0 0 0 0
@@ -321,12 +321,70 @@ bool ThreadSanitizerParser::NextSuppression(Suppression* supp) {
   return true;
 }
 
+// The suppressions for one tool:warning_name pair, compiled for matching.
+// Templates are numbered in the order of the suppressions file, since the
+// first matching suppression wins.
+struct SuppressionBucket {
+  // Templates starting with a fun: frame w/o wildcards, by that function.
+  map<string, vector<int> > by_first_fun;
+  // All other templates; these have to be tried for every stack.
+  vector<int> others;
+};
+
+struct CompiledTemplate {
+  int supp;  // Index in SuppressionsRep::suppressions.
+  int tmpl;  // Index in Suppression::templates.
+};
+
 struct ThreadSanitizerSuppressions::SuppressionsRep {
+  SuppressionsRep() : compiled(false) {}
+
+  // (Re)builds the buckets after ReadFromString().
+  void Compile();
+
   vector<Suppression> suppressions;
   string error_string_;
   int error_line_no_;
+
+  bool compiled;
+  vector<CompiledTemplate> templates;
+  // Keyed by tool + '\0' + warning_name.
+  map<string, SuppressionBucket> buckets;
 };
 
+static string BucketKey(const string &tool, const string &warning_name) {
+  return tool + '\0' + warning_name;
+}
+
+static bool IsLiteral(const string &name) {
+  return !name.empty() && name.find_first_of("*?") == string::npos;
+}
+
+void ThreadSanitizerSuppressions::SuppressionsRep::Compile() {
+  templates.clear();
+  buckets.clear();
+  for (size_t i = 0; i < suppressions.size(); i++) {
+    Suppression &supp = suppressions[i];
+    for (size_t j = 0; j < supp.templates.size(); j++) {
+      CompiledTemplate ct = {(int)i, (int)j};
+      int id = templates.size();
+      templates.push_back(ct);
+      const vector<Location> &locations = supp.templates[j].locations;
+      for (set<string>::iterator it = supp.tools.begin();
+           it != supp.tools.end(); ++it) {
+        SuppressionBucket &bucket = buckets[BucketKey(*it, supp.warning_name)];
+        if (!locations.empty() && locations[0].type == LT_FUN &&
+            IsLiteral(locations[0].name)) {
+          bucket.by_first_fun[locations[0].name].push_back(id);
+        } else {
+          bucket.others.push_back(id);
+        }
+      }
+    }
+  }
+  compiled = true;
+}
+
 ThreadSanitizerSuppressions::ThreadSanitizerSuppressions()
   : rep_(new SuppressionsRep) {
 }
@@ -341,6 +399,7 @@ int ThreadSanitizerSuppressions::ReadFromString(const string &str) {
   Suppression *supp = new Suppression();
   while (parser->NextSuppression(supp)) {
     rep_->suppressions.push_back(*supp);
+    rep_->compiled = false;
   }
   int res = -1;
   if (parser->GetError()) {
@@ -420,21 +479,39 @@ bool ThreadSanitizerSuppressions::StackTraceSuppressed(const string& tool_name,
     const vector<string>& function_names_demangled,
     const vector<string>& object_names,
     string *name_of_suppression) {
+  if (!rep_->compiled)
+    rep_->Compile();
+  map<string, SuppressionBucket>::iterator bucket_it =
+      rep_->buckets.find(BucketKey(tool_name, warning_name));
+  if (bucket_it == rep_->buckets.end())
+    return false;
+  SuppressionBucket &bucket = bucket_it->second;
+
+  // Collect the templates that may match, in the suppression file order.
+  vector<int> candidates(bucket.others);
+  if (!function_names_mangled.empty()) {
+    map<string, vector<int> >::iterator it;
+    it = bucket.by_first_fun.find(function_names_mangled[0]);
+    if (it != bucket.by_first_fun.end())
+      candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+    if (function_names_demangled[0] != function_names_mangled[0]) {
+      it = bucket.by_first_fun.find(function_names_demangled[0]);
+      if (it != bucket.by_first_fun.end())
+        candidates.insert(candidates.end(),
+                          it->second.begin(), it->second.end());
+    }
+  }
+  sort(candidates.begin(), candidates.end());
+
   MatcherContext ctx(function_names_mangled, function_names_demangled,
       object_names);
-  for (vector<Suppression>::iterator it = rep_->suppressions.begin();
-       it != rep_->suppressions.end(); ++it) {
-    if (it->warning_name != warning_name ||
-        it->tools.find(tool_name) == it->tools.end())
-      continue;
-    for (vector<StackTraceTemplate>::iterator it2 = it->templates.begin();
-         it2 != it->templates.end(); ++it2) {
-      ctx.tmpl = &*it2;
-      bool result = MatchStackTraceRecursive(ctx, 0, 0);
-      if (result) {
-        *name_of_suppression = it->name;
-        return true;
-      }
+  for (size_t i = 0; i < candidates.size(); i++) {
+    CompiledTemplate &ct = rep_->templates[candidates[i]];
+    Suppression &supp = rep_->suppressions[ct.supp];
+    ctx.tmpl = &supp.templates[ct.tmpl];
+    if (MatchStackTraceRecursive(ctx, 0, 0)) {
+      *name_of_suppression = supp.name;
+      return true;
     }
   }
   return false;
@@ -32,6 +32,7 @@
 #include <gtest/gtest.h>
 
 #include "suppressions.h"
+#include "ignore.h"
 
 #define VEC(arr) *(new vector<string>(arr, arr + sizeof(arr) / sizeof(*arr)))
 
@@ -358,6 +359,51 @@ TEST_F(BaseSuppressionsTest, ComparisonAndShiftOperators) {
 }
 
 
+TEST_F(BaseSuppressionsTest, FirstMatchingSuppressionWins) {
+  // Mixes templates starting with exact and wildcard frames, read in
+  // several chunks; the suppressions file order must be preserved.
+  ASSERT_EQ(2, supp_.ReadFromString(
+      "{\n"
+      "  exact_other\n"
+      "  test_tool:test_warning_type\n"
+      "  fun:aa\n"
+      "  fun:zz\n"
+      "}\n"
+      "{\n"
+      "  star\n"
+      "  test_tool:test_warning_type\n"
+      "  ...\n"
+      "  fun:cc\n"
+      "}\n"));
+  ASSERT_EQ(2, supp_.ReadFromString(
+      "{\n"
+      "  exact\n"
+      "  test_tool:test_warning_type\n"
+      "  fun:aa\n"
+      "}\n"
+      "{\n"
+      "  demangled\n"
+      "  test_tool:other_warning_type\n"
+      "  fun:aaa\n"
+      "}\n"));
+  string m[] = {"aa", "bb", "cc"};
+  string d[] = {"aaa", "bbb", "ccc"};
+  string o[] = {"object1", "object2", "object3"};
+  string name;
+  ASSERT_TRUE(supp_.StackTraceSuppressed("test_tool", "test_warning_type",
+      VEC(m), VEC(d), VEC(o), &name));
+  EXPECT_EQ("star", name);
+  ASSERT_TRUE(supp_.StackTraceSuppressed("test_tool", "other_warning_type",
+      VEC(m), VEC(d), VEC(o), &name));
+  EXPECT_EQ("demangled", name);
+  m[2] = d[2] = "dd";
+  ASSERT_TRUE(supp_.StackTraceSuppressed("test_tool", "test_warning_type",
+      VEC(m), VEC(d), VEC(o), &name));
+  EXPECT_EQ("exact", name);
+  ASSERT_FALSE(supp_.StackTraceSuppressed("tool2", "test_warning_type",
+      VEC(m), VEC(d), VEC(o), &name));
+}
+
 class FailingSuppressionsTest : public ::testing::Test {
  protected:
   int ErrorLineNo(string data) {
@@ -603,6 +649,40 @@ TEST(WildcardTest, WildcardCharactersInText) {
   EXPECT_TRUE(ThreadSanitizerStringMatch("*b", "*b"));
 }
 
+// IgnoreMatcher must agree with TripleVectorMatchKnown on the triples it
+// looks up by name and on the ones it matches one by one.
+TEST(IgnoreMatcherTest, AgreesWithTripleVectorMatch) {
+  vector<IgnoreTriple> v;
+  v.push_back(IgnoreFun("foo"));
+  v.push_back(IgnoreFun("bar*"));
+  v.push_back(IgnoreObj("libc.so"));
+  v.push_back(IgnoreObj("*/libpthread*"));
+  v.push_back(IgnoreFile("a.cc"));
+  v.push_back(IgnoreTriple("baz", "libbaz.so", "*"));
+  IgnoreMatcher m;
+  m.Compile(v);
+  EXPECT_EQ(v.size(), m.size());
+
+  const char *funs[] = {"", "foo", "fooo", "bar", "barrr", "baz"};
+  const char *objs[] = {"", "libc.so", "/lib/libpthread.so", "libbaz.so",
+                        "x.so"};
+  const char *files[] = {"", "a.cc", "b.cc"};
+  for (size_t i = 0; i < TS_ARRAY_SIZE(funs); i++) {
+    for (size_t j = 0; j < TS_ARRAY_SIZE(objs); j++) {
+      for (size_t k = 0; k < TS_ARRAY_SIZE(files); k++) {
+        EXPECT_EQ(TripleVectorMatchKnown(v, funs[i], objs[j], files[k]),
+                  m.Match(funs[i], objs[j], files[k]))
+            << funs[i] << " " << objs[j] << " " << files[k];
+      }
+    }
+  }
+  EXPECT_TRUE(m.Match("foo", "", ""));
+  EXPECT_FALSE(m.Match("", "", "x.cc"));
+  // Unknown (empty) names match anything.
+  EXPECT_TRUE(m.Match("baz", "", ""));
+  EXPECT_FALSE(m.Match("baz", "x.so", ""));
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
 
@@ -38,6 +38,13 @@
 #include "ts_lock.h"
 #include "ts_atomic_int.h"
 #include "dense_multimap.h"
+#include "ts_tag_map.h"
+#include "ts_tuple_table.h"
+#include "ts_stack_depot.h"
+#include "ts_history_ring.h"
+#include "ts_report_writer.h"
+#include "ts_vts_simd.h"
+#include "ts_tree_clock.h"
 #include <stdarg.h>
 // -------- Constants --------------- {{{1
 // Segment ID (SID)      is in range [1, kMaxSID-1]
@@ -77,6 +84,7 @@ uintptr_t g_nacl_mem_start = (uintptr_t)-1;
 uintptr_t g_nacl_mem_end = (uintptr_t)-1;
 
 bool g_race_verifier_active = false;
+ReportWriter *G_report_writer;
 
 bool debug_expected_races = false;
 bool debug_benign_races = false;
@@ -107,7 +115,7 @@ class TIL {
     DCHECK(lock_);
     if (need_locking_ && (TS_SERIALIZED == 0)) {
       lock_->Lock();
-      G_stats->lock_sites[lock_site]++;
+      G_stats->Shard()->lock_sites[lock_site]++;
     }
   }
   ~TIL() {
@@ -120,7 +128,6 @@ class TIL {
 };
 
 static TSLock *ts_lock;
-static TSLock *ts_ignore_below_lock;
 
 #ifdef TS_LLVM
 void ThreadSanitizerLockAcquire() {
@@ -132,12 +139,112 @@ void ThreadSanitizerLockRelease() {
 }
 #endif
 
+// True if --locking_scheme=2 is in effect, see "Lock shards" below.
+static bool g_sharded_locking;
+
+static INLINE bool ShardedLocking() {
+  return TS_SERIALIZED == 0 && g_sharded_locking;
+}
+
+// True if every lock is a pure happens-before one: --pure_happens_before
+// is on and no NON_HB_LOCK has been seen. Selects the instantiation of
+// Detector::MemoryStateMachine() that skips the lockset intersections.
+static bool g_pure_hb_engine;
+
 static INLINE void AssertTILHeld() {
-  if (TS_SERIALIZED == 0 && TSAN_DEBUG) {
+  // With sharded locking some of the code which normally runs under ts_lock
+  // runs under the shard locks instead.
+  if (TS_SERIALIZED == 0 && TSAN_DEBUG && !ShardedLocking()) {
     ts_lock->AssertHeld();
   }
 }
 
+// -------- Lock shards --------------- {{{1
+// With --locking_scheme=2 the memory access slow path does not take ts_lock.
+// The SegmentSet map is split into shards by a hash of the key and every
+// shard has its own lock (Cache::storage_ is a lock-free TagMap).
+// Other shared state touched by the slow path gets a lock of its own.
+// Synchronization events and everything else still go under ts_lock.
+// With the default --locking_scheme=1 none of these locks are taken.
+class ShardedLock {
+ public:
+  enum {
+    kNumShardsLog = 4,
+    kNumShards = 1 << kNumShardsLog
+  };
+
+  void Init() {
+    for (int i = 0; i < kNumShards; i++)
+      locks_[i] = new TSLock;
+  }
+
+  TSLock *lock(int shard) { return locks_[shard]; }
+
+  static INLINE int ShardIndex(uintptr_t key) {
+    uint32_t h = (uint32_t)key ^ (uint32_t)((uint64_t)key >> 32);
+    h *= 2654435761U;  // Knuth's multiplicative hash.
+    return h >> (32 - kNumShardsLog);
+  }
+
+ private:
+  TSLock *locks_[kNumShards];
+};
+
+// Scoped lock which is taken only with sharded locking.
+// 'lock' may be NULL (not yet created) otherwise.
+class ShardTIL {
+ public:
+  explicit ShardTIL(TSLock *lock)
+    : lock_(ShardedLocking() ? lock : NULL) {
+    if (lock_) {
+      lock_->Lock();
+    }
+  }
+  ~ShardTIL() {
+    if (lock_)
+      lock_->Unlock();
+  }
+ private:
+  TSLock *lock_;
+};
+
+// Threads running the memory access slow path w/o ts_lock are said to be
+// inside a sharded section. Recycling SegmentSets is not safe while such
+// threads exist, so it is done under ts_lock after blocking new sharded
+// sections and waiting for the running ones to finish.
+// A thread must not hold a cache line when blocking sharded sections.
+static int32_t g_n_sharded_sections;
+static uintptr_t g_sharded_sections_blocked;
+
+class ScopedShardedSection {
+ public:
+  ScopedShardedSection() {
+    DCHECK(ShardedLocking());
+    for (;;) {
+      NoBarrier_AtomicIncrement(&g_n_sharded_sections);
+      if (!*(volatile uintptr_t*)&g_sharded_sections_blocked)
+        break;
+      NoBarrier_AtomicDecrement(&g_n_sharded_sections);
+      while (*(volatile uintptr_t*)&g_sharded_sections_blocked)
+        YIELD();
+    }
+  }
+  ~ScopedShardedSection() {
+    NoBarrier_AtomicDecrement(&g_n_sharded_sections);
+  }
+};
+
+static void BlockShardedSections() {
+  DCHECK(ShardedLocking());
+  AtomicExchange(&g_sharded_sections_blocked, 1);
+  while (*(volatile int32_t*)&g_n_sharded_sections != 0)
+    YIELD();
+}
+
+static void UnblockShardedSections() {
+  ReleaseStore(&g_sharded_sections_blocked, 0);
+}
+
 // -------- Util ----------------------------- {{{1
 
 // Can't use ANNOTATE_UNPROTECTED_READ, it may get instrumented.
@@ -149,6 +256,34 @@ inline T INTERNAL_ANNOTATE_UNPROTECTED_READ(const volatile T &x) {
   return res;
 }
 
+// With --latency_stats, adds the cycles spent in the scope to the latency
+// histogram of 'kind'. The kind may be changed before leaving the scope.
+// With --hw_counters, also adds the perf counters of the thread.
+class ScopedLatency {
+ public:
+  ScopedLatency(LatencyKind kind, bool enabled)
+    : kind_(kind), start_(enabled ? ReadTSC() : 0),
+      hw_(enabled && G_flags->hw_counters) {
+    if (hw_)
+      hw_ = ReadHwCounters(hw_start_);
+  }
+  ~ScopedLatency() {
+    if (hw_) {
+      uint64_t hw_end[HW_LAST];
+      if (ReadHwCounters(hw_end))
+        G_stats->AddHwCounters(kind_, hw_start_, hw_end);
+    }
+    if (start_)
+      G_stats->AddLatency(kind_, ReadTSC() - start_);
+  }
+  void set_kind(LatencyKind kind) { kind_ = kind; }
+ private:
+  LatencyKind kind_;
+  uint64_t start_;
+  bool hw_;
+  uint64_t hw_start_[HW_LAST];
+};
+
 static string RemoveFilePrefix(string str) {
   for (size_t i = 0; i < G_flags->file_prefix_to_cut.size(); i++) {
     string prefix_to_cut = G_flags->file_prefix_to_cut[i];
@@ -163,14 +298,9 @@ static string RemoveFilePrefix(string str) {
   return str;
 }
 
-string PcToRtnNameAndFilePos(uintptr_t pc) {
-  G_stats->pc_to_strings++;
-  string img_name;
-  string file_name;
-  string rtn_name;
-  int line_no = -1;
-  PcToStrings(pc, G_flags->demangle, &img_name, &rtn_name,
-              &file_name, &line_no);
+// Formats the result of PcToStrings(pc, G_flags->demangle, ...).
+static string RtnNameAndFilePos(const string &img_name, string rtn_name,
+                                string file_name, int line_no) {
   if (G_flags->demangle && !G_flags->full_stack_frames)
     rtn_name = NormalizeFunctionName(rtn_name);
   file_name = RemoveFilePrefix(file_name);
@@ -182,6 +312,157 @@ string PcToRtnNameAndFilePos(uintptr_t pc) {
   return rtn_name + " " + file_name + ":" + buff;
 }
 
+string PcToRtnNameAndFilePos(uintptr_t pc) {
+  G_stats->Shard()->pc_to_strings++;
+  string img_name;
+  string file_name;
+  string rtn_name;
+  int line_no = -1;
+  PcToStrings(pc, G_flags->demangle, &img_name, &rtn_name,
+              &file_name, &line_no);
+  return RtnNameAndFilePos(img_name, rtn_name, file_name, line_no);
+}
+
+// -------- SymbolCache ------------- {{{1
+// What the tool told us about a pc. Races come in bursts from a few hot
+// stacks, and symbolizing a pc (debug info lookups, demangling, the client
+// lock in PIN) costs much more than a map lookup, so the report path asks
+// SymbolCache instead of calling PcToStrings() and friends directly.
+struct PcSymbols {
+  string img_name;
+  string rtn_name;              // PcToStrings(pc, false, ...)
+  string file_name;
+  int    line_no;
+  string demangled_rtn_name;    // PcToRtnName(pc, true)
+  string normalized_rtn_name;   // NormalizeFunctionName(demangled_rtn_name)
+  string rtn_name_and_file_pos; // PcToRtnNameAndFilePos(pc)
+};
+
+class SymbolCache {
+ public:
+  static void InitClassMembers() {
+    lock_ = new TSLock;
+    map_ = new map<uintptr_t, PcSymbols>;
+  }
+
+  static void Get(uintptr_t pc, PcSymbols *res) {
+    {
+      TIL til(lock_, 9);
+      map<uintptr_t, PcSymbols>::iterator it = map_->find(pc);
+      if (it != map_->end()) {
+        G_stats->Shard()->symbol_cache_hit++;
+        *res = it->second;
+        return;
+      }
+    }
+    // Don't hold lock_ while symbolizing: the tool may take its own locks.
+    G_stats->Shard()->symbol_cache_miss++;
+    res->line_no = -1;
+    PcToStrings(pc, false, &res->img_name, &res->rtn_name,
+                &res->file_name, &res->line_no);
+    res->demangled_rtn_name = PcToRtnName(pc, true);
+    res->normalized_rtn_name = NormalizeFunctionName(res->demangled_rtn_name);
+    res->rtn_name_and_file_pos = PcToRtnNameAndFilePos(pc);
+    TIL til(lock_, 9);
+    (*map_)[pc] = *res;
+  }
+
+  // Symbolizes the pcs which are not in the cache yet with one call to
+  // the tool's batch symbolizer, if there is one.
+  static void Prefetch(const vector<uintptr_t> &pcs) {
+    if (!batch_cb_) return;
+    vector<uintptr_t> missing;
+    {
+      TIL til(lock_, 9);
+      for (size_t i = 0; i < pcs.size(); i++) {
+        if (pcs[i] && !map_->count(pcs[i]))
+          missing.push_back(pcs[i]);
+      }
+    }
+    if (missing.empty()) return;
+    sort(missing.begin(), missing.end());
+    missing.erase(STD::unique(missing.begin(), missing.end()), missing.end());
+    G_stats->Shard()->symbol_cache_miss += missing.size();
+    G_stats->Shard()->pc_to_strings += missing.size();
+    vector<string> img_names, rtn_names, file_names;
+    vector<string> d_img_names, d_rtn_names, d_file_names;
+    vector<int> line_nos, d_line_nos;
+    batch_cb_(missing, false, &img_names, &rtn_names, &file_names, &line_nos);
+    batch_cb_(missing, true, &d_img_names, &d_rtn_names, &d_file_names,
+              &d_line_nos);
+    CHECK(rtn_names.size() == missing.size());
+    CHECK(d_rtn_names.size() == missing.size());
+    TIL til(lock_, 9);
+    for (size_t i = 0; i < missing.size(); i++) {
+      PcSymbols &symbols = (*map_)[missing[i]];
+      symbols.img_name = img_names[i];
+      symbols.rtn_name = rtn_names[i];
+      symbols.file_name = file_names[i];
+      symbols.line_no = line_nos[i];
+      symbols.demangled_rtn_name = d_rtn_names[i];
+      symbols.normalized_rtn_name = NormalizeFunctionName(d_rtn_names[i]);
+      symbols.rtn_name_and_file_pos = G_flags->demangle
+          ? ::RtnNameAndFilePos(d_img_names[i], d_rtn_names[i],
+                                d_file_names[i], d_line_nos[i])
+          : ::RtnNameAndFilePos(img_names[i], rtn_names[i],
+                                file_names[i], line_nos[i]);
+    }
+  }
+
+  static void SetBatchCallback(ThreadSanitizerSymbolizeBatchCallback cb) {
+    batch_cb_ = cb;
+  }
+
+  static string RtnNameAndFilePos(uintptr_t pc) {
+    return GetField(pc, &PcSymbols::rtn_name_and_file_pos);
+  }
+
+  static string NormalizedRtnName(uintptr_t pc) {
+    return GetField(pc, &PcSymbols::normalized_rtn_name);
+  }
+
+  // Appends all the cached symbols to 'res'.
+  static void GetAll(vector<pair<uintptr_t, PcSymbols> > *res) {
+    TIL til(lock_, 9);
+    res->insert(res->end(), map_->begin(), map_->end());
+  }
+
+  static void Insert(uintptr_t pc, const PcSymbols &symbols) {
+    TIL til(lock_, 9);
+    (*map_)[pc] = symbols;
+  }
+
+  // Forget the pcs in [start, end), e.g. when a library gets unmapped.
+  static void EraseRange(uintptr_t start, uintptr_t end) {
+    TIL til(lock_, 9);
+    map_->erase(map_->lower_bound(start), map_->lower_bound(end));
+  }
+
+ private:
+  // Copies only one of the strings on a hit.
+  static string GetField(uintptr_t pc, string PcSymbols::*field) {
+    {
+      TIL til(lock_, 9);
+      map<uintptr_t, PcSymbols>::iterator it = map_->find(pc);
+      if (it != map_->end()) {
+        G_stats->Shard()->symbol_cache_hit++;
+        return it->second.*field;
+      }
+    }
+    PcSymbols symbols;
+    Get(pc, &symbols);
+    return symbols.*field;
+  }
+
+  static TSLock *lock_;
+  static map<uintptr_t, PcSymbols> *map_;
+  static ThreadSanitizerSymbolizeBatchCallback batch_cb_;
+};
+
+TSLock *SymbolCache::lock_;
+map<uintptr_t, PcSymbols> *SymbolCache::map_;
+ThreadSanitizerSymbolizeBatchCallback SymbolCache::batch_cb_;
+
 // -------- ID ---------------------- {{{1
 // We wrap int32_t into ID class and then inherit various ID type from ID.
 // This is done in an attempt to implement type safety of IDs, i.e.
@@ -299,123 +580,30 @@ static void FlushStateIfOutOfSegments(TSanThread *thr);
 static int32_t raw_tid(TSanThread *t);
 // -------- Simple Cache ------ {{{1
 #include "ts_simple_cache.h"
-// -------- PairCache & IntPairToIntCache ------ {{{1
-template <typename A, typename B, typename Ret,
-         int kHtableSize, int kArraySize = 8>
+// -------- PairCache ------ {{{1
+// SetAssocIntPairToIntCache for the ID types (SSID, SID, ...).
+template <typename A, typename B, typename Ret, int kSetsLog>
 class PairCache {
  public:
-  PairCache() {
-    CHECK(kHtableSize >= 0);
-    CHECK(sizeof(Entry) == sizeof(A) + sizeof(B) + sizeof(Ret));
-    Flush();
-  }
-
   void Flush() {
-    memset(this, 0, sizeof(*this));
-
-    // Change the first hashtable entry so it doesn't match (0,0) on Lookup.
-    if (kHtableSize != 0)
-      memset(&htable_[0], 1, sizeof(Entry));
-
-    // Any Lookup should fail now.
-    for (int i = 0; i < kHtableSize; i++) {
-      Ret tmp;
-      DCHECK(!Lookup(htable_[i].a, htable_[i].b, &tmp));
-    }
-    CHECK(array_pos_    == 0);
-    CHECK(array_filled_ == false);
+    cache_.Flush();
   }
 
   void Insert(A a, B b, Ret v) {
-    // fill the hash table
-    if (kHtableSize != 0) {
-      uint32_t idx  = compute_idx(a, b);
-      htable_[idx].Fill(a, b, v);
-    }
-
-    // fill the array
-    Ret dummy;
-    if (kArraySize != 0 && !ArrayLookup(a, b, &dummy)) {
-      array_[array_pos_ % kArraySize].Fill(a, b, v);
-      array_pos_ = (array_pos_ + 1) % kArraySize;
-      if (array_pos_ > kArraySize)
-        array_filled_ = true;
-    }
+    cache_.Insert(a.raw(), b.raw(), v.raw());
   }
 
   INLINE bool Lookup(A a, B b, Ret *v) {
-    // check the array
-    if (kArraySize != 0 && ArrayLookup(a, b, v)) {
-      G_stats->ls_cache_fast++;
-      return true;
-    }
-    // check the hash table.
-    if (kHtableSize != 0) {
-      uint32_t idx  = compute_idx(a, b);
-      Entry & prev_e = htable_[idx];
-      if (prev_e.Match(a, b)) {
-        *v = prev_e.v;
-        return true;
-      }
-    }
-    return false;
+    int32_t res;
+    if (!cache_.Lookup(a.raw(), b.raw(), &res)) return false;
+    *v = Ret(res);
+    return true;
   }
 
  private:
-  struct Entry {
-    A a;
-    B b;
-    Ret v;
-    void Fill(A a, B b, Ret v) {
-      this->a = a;
-      this->b = b;
-      this->v = v;
-    }
-    bool Match(A a, B b) const {
-      return this->a == a && this->b == b;
-    }
-  };
-
-  INLINE bool ArrayLookup(A a, B b, Ret *v) {
-    for (int i = 0; i < (array_filled_ ? kArraySize : array_pos_); i++) {
-      Entry & entry = array_[i];
-      if (entry.Match(a, b)) {
-        *v = entry.v;
-        return true;
-      }
-    }
-    return false;
-  }
-
-  uint32_t compute_idx(A a, B b) {
-    if (kHtableSize == 0)
-      return 0;
-    else
-      return combine2(a, b) % kHtableSize;
-  }
-
-  static uint32_t combine2(int a, int b) {
-    return (a << 16) ^ b;
-  }
-
-  static uint32_t combine2(SSID a, SID b) {
-    return combine2(a.raw(), b.raw());
-  }
-
-  Entry htable_[kHtableSize];
-
-  Entry array_[kArraySize];
-
-  // array_pos_    - next element to write to the array_ (mod kArraySize)
-  // array_filled_ - set to true once we write the last element of the array
-  int array_pos_;
-  bool array_filled_;
+  SetAssocIntPairToIntCache<kSetsLog> cache_;
 };
 
-template<int kHtableSize, int kArraySize = 8>
-class IntPairToIntCache
-  : public PairCache<int, int, int, kHtableSize, kArraySize> {};
-
 
 
 // -------- FreeList --------------- {{{1
@@ -451,7 +639,8 @@ class FreeList {
  private:
   void AllocateNewChunk() {
     CHECK(list_ == NULL);
-    uint8_t *new_mem = new uint8_t[obj_size_ * chunk_size_];
+    uint8_t *new_mem =
+        (uint8_t*)AllocateFreeListChunk(obj_size_ * chunk_size_);
     if (TSAN_DEBUG) {
       memset(new_mem, 0xab, obj_size_ * chunk_size_);
     }
@@ -470,6 +659,109 @@ class FreeList {
   const int obj_size_;
   const int chunk_size_;
 };
+
+// A FreeList for the objects which the memory access slow path allocates
+// and frees w/o ts_lock (see ShardedLocking()), i.e. the cache lines.
+// Every shard of threads has a magazine of up to kMagazineSize free objects
+// in front of the global list, with a lock of its own. The shard is picked
+// by the stack address, as for Stats::Shard(), so the lock is almost never
+// contended and the objects a thread frees are the ones it gets back.
+// The global lock is taken only to refill an empty magazine or to give
+// half of a full one back. W/o sharded locking it is just a FreeList.
+class ShardedFreeList {
+ public:
+  ShardedFreeList(int obj_size, int chunk_size)
+    : global_(obj_size, chunk_size),
+      global_lock_(NULL),
+      obj_size_(obj_size) {
+    if (!ShardedLocking()) return;
+    global_lock_ = new TSLock;
+    for (int i = 0; i < kNumShards; i++) {
+      magazines_[i].lock = new TSLock;
+      magazines_[i].head = NULL;
+      magazines_[i].n = 0;
+    }
+  }
+
+  void *Allocate() {
+    if (!ShardedLocking())
+      return global_.Allocate();
+    Magazine *m = &magazines_[ShardIndex()];
+    ScopedLock lock(m->lock);
+    if (!m->head)
+      Refill(m);
+    List *head = m->head;
+    m->head = head->next;
+    m->n--;
+    return head;
+  }
+
+  void Deallocate(void *ptr) {
+    if (!ShardedLocking()) {
+      global_.Deallocate(ptr);
+      return;
+    }
+    if (TSAN_DEBUG) {
+      memset(ptr, 0xac, obj_size_);
+    }
+    Magazine *m = &magazines_[ShardIndex()];
+    ScopedLock lock(m->lock);
+    List *new_head = reinterpret_cast<List*>(ptr);
+    new_head->next = m->head;
+    m->head = new_head;
+    if (++m->n == kMagazineSize)
+      Drain(m, kMagazineSize / 2);
+  }
+
+ private:
+  static const int kNumShards = 16;
+  static const int kMagazineSize = 64;
+
+  struct List {
+    struct List *next;
+  };
+  struct Magazine {
+    TSLock *lock;
+    List *head;
+    int n;
+    char padding[64 - 2 * sizeof(void*) - sizeof(int)];
+  };
+
+  // With --numa the shards are per CPU, so the objects are reused on the
+  // node where they were freed.
+  INLINE static int ShardIndex() {
+    if (G_flags->numa) {
+      int cpu = GetCurrentCpu();
+      if (cpu >= 0) return cpu & (kNumShards - 1);
+    }
+    int local;
+    uint64_t h = ((uintptr_t)&local >> 16) * 0x9E3779B97F4A7C15ULL;
+    return (int)(h >> 32) & (kNumShards - 1);
+  }
+
+  void Refill(Magazine *m) {
+    ScopedLock lock(global_lock_);
+    for (; m->n < kMagazineSize / 2; m->n++) {
+      List *obj = reinterpret_cast<List*>(global_.Allocate());
+      obj->next = m->head;
+      m->head = obj;
+    }
+  }
+
+  void Drain(Magazine *m, int n_keep) {
+    ScopedLock lock(global_lock_);
+    for (; m->n > n_keep; m->n--) {
+      List *obj = m->head;
+      m->head = obj->next;
+      global_.Deallocate(obj);
+    }
+  }
+
+  FreeList global_;
+  TSLock *global_lock_;
+  const int obj_size_;
+  Magazine magazines_[kNumShards];
+};
 // -------- StackTrace -------------- {{{1
 class StackTraceFreeList {
  public:
@@ -497,6 +789,10 @@ class StackTraceFreeList {
 };
 
 static StackTraceFreeList *g_stack_trace_free_list;
+static StackDepot *G_stack_depot;
+// --history_ring: the rings of the threads by tid, NULL for the threads
+// which keep their history stacks in G_stack_depot.
+static HistoryRing **g_history_rings;
 
 class StackTrace {
  public:
@@ -553,7 +849,7 @@ class StackTrace {
     char *buff = new char [kBuffSize];
     for (size_t i = 0; i < n; i++) {
       if (!emb_trace[i]) break;
-      string rtn_and_file = PcToRtnNameAndFilePos(emb_trace[i]);
+      string rtn_and_file = SymbolCache::RtnNameAndFilePos(emb_trace[i]);
       if (rtn_and_file.find("(below main) ") == 0 ||
           rtn_and_file.find("ThreadSanitizerStartThread ") == 0)
         break;
@@ -577,7 +873,7 @@ class StackTrace {
         break;
       // ... and after some default functions (see ThreadSanitizerParseFlags())
       // and some more functions specified via command line flag.
-      string rtn = NormalizeFunctionName(PcToRtnName(emb_trace[i], true));
+      string rtn = SymbolCache::NormalizedRtnName(emb_trace[i]);
       if (CutStackBelowFunc(rtn))
         break;
     }
@@ -634,6 +930,8 @@ class StackTrace {
 
 
 // -------- Lock -------------------- {{{1
+static void RemoveLockOrderNode(LID lid);
+
 const char *kLockAllocCC = "kLockAllocCC";
 class Lock {
  public:
@@ -652,27 +950,62 @@ class Lock {
     return res;
   }
 
+  // The lock stays registered, but a destroyed lock is not ordered with the
+  // others any more: a lock created here later is a different mutex.
   static void Destroy(uintptr_t lock_addr) {
 //    Printf("Lock::Destroy: %p\n", lock_addr);
-  //  map_.erase(lock_addr);
+    Lock *lock = Lookup(lock_addr);
+    if (lock && G_flags->detect_deadlocks)
+      RemoveLockOrderNode(lock->lid_);
   }
 
   static NOINLINE Lock *LookupOrCreate(uintptr_t lock_addr) {
-    ScopedMallocCostCenter cc("LockLookup");
-    Lock **lock = &(*map_)[lock_addr];
-    if (*lock == NULL) {
-//      Printf("Lock::LookupOrCreate: %p\n", lock_addr);
+    Slot *slot = FindSlot(lock_addr);
+    if (slot) return slot->lock;
+    Lock *lock;
+    if (!free_locks_->empty()) {
+      lock = free_locks_->back();
+      free_locks_->pop_back();
+      LID lid = lock->lid_;
+      StackTrace::Delete(lock->last_lock_site_);
+      *lock = Lock(lock_addr, lid.raw());
+      G_stats->Shard()->locks_recycled++;
+    } else {
       ScopedMallocCostCenter cc_lock("new Lock");
-      *lock = new Lock(lock_addr, map_->size());
+      lock = new Lock(lock_addr, lids_->size());
+      lids_->push_back(lock);
     }
-    return *lock;
+    (*lock_pages_)[lock_addr >> kPageSizeLog].push_back(lock_addr);
+    Insert(lock);
+    return lock;
   }
 
   static NOINLINE Lock *Lookup(uintptr_t lock_addr) {
-    ScopedMallocCostCenter cc("LockLookup");
-    Map::iterator it = map_->find(lock_addr);
-    if (it == map_->end()) return NULL;
-    return it->second;
+    Slot *slot = FindSlot(lock_addr);
+    return slot ? slot->lock : NULL;
+  }
+
+  // Forgets the locks in [a, b) which are not held. Their Lock objects and
+  // LIDs are given to the next new locks, so both stay bounded by the
+  // number of live locks, not by the number of mutexes ever freed.
+  static void ClearMemoryState(uintptr_t a, uintptr_t b) {
+    if (lock_pages_->empty()) return;
+    uintptr_t first_page = a >> kPageSizeLog;
+    uintptr_t last_page = (b - 1) >> kPageSizeLog;
+    if (last_page - first_page >= lock_pages_->size()) {
+      // A large range: look at the pages which have locks instead.
+      vector<uintptr_t> pages;
+      for (LockPages::iterator it = lock_pages_->begin();
+           it != lock_pages_->end(); ++it) {
+        if (it->first >= first_page && it->first <= last_page)
+          pages.push_back(it->first);
+      }
+      for (size_t i = 0; i < pages.size(); i++)
+        ClearMemoryStateInPage(pages[i], a, b);
+      return;
+    }
+    for (uintptr_t page = first_page; page <= last_page; page++)
+      ClearMemoryStateInPage(page, a, b);
   }
 
   int       rd_held()   const { return rd_held_; }
@@ -740,14 +1073,8 @@ class Lock {
   }
 
   static Lock *LIDtoLock(LID lid) {
-    // slow, but needed only for reports.
-    for (Map::iterator it = map_->begin(); it != map_->end(); ++it) {
-      Lock *l = it->second;
-      if (l->lid_ == lid) {
-        return l;
-      }
-    }
-    return NULL;
+    if (lid.raw() <= 0 || (size_t)lid.raw() >= lids_->size()) return NULL;
+    return (*lids_)[lid.raw()];
   }
 
   static string ToString(LID lid) {
@@ -775,7 +1102,14 @@ class Lock {
   }
 
   static void InitClassMembers() {
-    map_ = new Lock::Map;
+    n_slots_ = kInitialSlots;
+    slots_ = new Slot[n_slots_];
+    memset(slots_, 0, n_slots_ * sizeof(Slot));
+    n_used_slots_ = 0;
+    lids_ = new vector<Lock*>;
+    lids_->push_back(NULL);  // LIDs start with 1.
+    free_locks_ = new vector<Lock*>;
+    lock_pages_ = new LockPages;
   }
 
  private:
@@ -799,13 +1133,107 @@ class Lock {
   const char *name_;
   TID       thread_holding_me_in_write_mode_;
 
-  // Static members
-  typedef map<uintptr_t, Lock*> Map;
-  static Map *map_;
+  // The registry of locks. A lock is found by its address in an
+  // open-addressing table (linear probing, at most half full counting the
+  // deleted slots) and by its LID in lids_. lock_pages_ has the addresses
+  // of the locks in each page, so ClearMemoryState() does not scan the
+  // table. The removed locks wait in free_locks_ for a new address.
+  // An old segment may still have the LID of a removed lock in its
+  // lockset, just as it had the LID of a freed mutex whose address got a
+  // new one. Everything is called under ts_lock.
+  struct Slot {
+    uintptr_t addr;
+    Lock *lock;  // NULL if the slot is empty (addr == 0) or deleted.
+  };
+  typedef unordered_map<uintptr_t, vector<uintptr_t> > LockPages;
+  static const uintptr_t kInitialSlots = 1 << 10;
+  static const uintptr_t kDeletedAddr = ~(uintptr_t)0;
+  static const uintptr_t kPageSizeLog = 12;
+
+  static INLINE uintptr_t SlotIndex(uintptr_t addr) {
+    return (uintptr_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ULL) >> 32) &
+        (n_slots_ - 1);
+  }
+
+  static INLINE Slot *FindSlot(uintptr_t addr) {
+    for (uintptr_t i = SlotIndex(addr); ; i = (i + 1) & (n_slots_ - 1)) {
+      Slot *slot = &slots_[i];
+      if (slot->lock && slot->addr == addr) return slot;
+      if (!slot->lock && slot->addr == 0) return NULL;
+    }
+  }
+
+  static void Insert(Lock *lock) {
+    if ((n_used_slots_ + 1) * 2 > n_slots_)
+      Rehash();
+    uintptr_t i = SlotIndex(lock->lock_addr_);
+    while (slots_[i].lock)
+      i = (i + 1) & (n_slots_ - 1);
+    if (slots_[i].addr == 0)
+      n_used_slots_++;
+    slots_[i].addr = lock->lock_addr_;
+    slots_[i].lock = lock;
+  }
+
+  // Grows the table if more than a quarter of it is live, otherwise just
+  // drops the deleted slots.
+  static void Rehash() {
+    Slot *old_slots = slots_;
+    uintptr_t n_old_slots = n_slots_;
+    uintptr_t n_live = 0;
+    for (uintptr_t i = 0; i < n_old_slots; i++)
+      n_live += old_slots[i].lock != NULL;
+    if ((n_live + 1) * 4 > n_slots_)
+      n_slots_ *= 2;
+    slots_ = new Slot[n_slots_];
+    memset(slots_, 0, n_slots_ * sizeof(Slot));
+    n_used_slots_ = 0;
+    for (uintptr_t i = 0; i < n_old_slots; i++) {
+      if (old_slots[i].lock)
+        Insert(old_slots[i].lock);
+    }
+    delete [] old_slots;
+  }
+
+  static void ClearMemoryStateInPage(uintptr_t page, uintptr_t a,
+                                     uintptr_t b) {
+    LockPages::iterator it = lock_pages_->find(page);
+    if (it == lock_pages_->end()) return;
+    vector<uintptr_t> &addrs = it->second;
+    for (size_t i = 0; i < addrs.size(); ) {
+      uintptr_t addr = addrs[i];
+      Slot *slot = addr >= a && addr < b ? FindSlot(addr) : NULL;
+      if (!slot || slot->lock->rd_held_ || slot->lock->wr_held_) {
+        i++;
+        continue;
+      }
+      if (G_flags->detect_deadlocks)
+        RemoveLockOrderNode(slot->lock->lid_);
+      free_locks_->push_back(slot->lock);
+      slot->addr = kDeletedAddr;
+      slot->lock = NULL;
+      addrs[i] = addrs.back();
+      addrs.pop_back();
+    }
+    if (addrs.empty())
+      lock_pages_->erase(it);
+  }
+
+  static Slot *slots_;
+  static uintptr_t n_slots_;       // A power of two.
+  static uintptr_t n_used_slots_;  // Live and deleted.
+  static vector<Lock*> *lids_;
+  static vector<Lock*> *free_locks_;
+  static LockPages *lock_pages_;
 };
 
 
-Lock::Map *Lock::map_;
+Lock::Slot *Lock::slots_;
+uintptr_t Lock::n_slots_;
+uintptr_t Lock::n_used_slots_;
+vector<Lock*> *Lock::lids_;
+vector<Lock*> *Lock::free_locks_;
+Lock::LockPages *Lock::lock_pages_;
 
 // Returns a string like "L123,L234".
 static string SetOfLocksToString(const set<LID> &locks) {
@@ -848,6 +1276,16 @@ class FixedArray {
 };
 
 // -------- LockSet ----------------- {{{1
+// Multi-lock sets are hash-consed: each distinct sorted multiset of LIDs is
+// stored once in a flat arena and gets an LSID.
+// Add(), Remove(), IntersectionIsEmpty() and the readers don't need ts_lock:
+//  - a set is written to the arena and published in dir_ before its LSID is
+//    published in the intern table, and is never changed afterwards;
+//  - lookups in the intern table and in the transition caches take no locks;
+//  - only creating a new set takes ls_lock_.
+// The first kNumHotLocks locks which appear in multi-lock sets get a bit,
+// and each set also stores the mask of its hot locks. Intersection checks
+// of two sets made of hot locks (the common case) are then a single AND.
 class LockSet {
  public:
   NOINLINE static LSID Add(LSID lsid, Lock *lock) {
@@ -855,23 +1293,27 @@ class LockSet {
     LID lid = lock->lid();
     if (lsid.IsEmpty()) {
       // adding to an empty lock set
-      G_stats->ls_add_to_empty++;
+      G_stats->Shard()->ls_add_to_empty++;
       return LSID(lid.raw());
     }
-    int cache_res;
+    int32_t cache_res;
     if (ls_add_cache_->Lookup(lsid.raw(), lid.raw(), &cache_res)) {
-      G_stats->ls_add_cache_hit++;
+      G_stats->Shard()->ls_add_cache_hit++;
       return LSID(cache_res);
     }
+    G_stats->Shard()->ls_add_cache_miss++;
     LSID res;
     if (lsid.IsSingleton()) {
-      LSSet set(lsid.GetSingleton(), lid);
-      G_stats->ls_add_to_singleton++;
-      res = ComputeId(set);
+      LID other = lsid.GetSingleton();
+      LID set[2] = {min(other, lid), max(other, lid)};
+      G_stats->Shard()->ls_add_to_singleton++;
+      res = ComputeId(LidPieces(set, 2));
     } else {
-      LSSet set(Get(lsid), lid);
-      G_stats->ls_add_to_multi++;
-      res = ComputeId(set);
+      LSView prev_set = Get(lsid);
+      const LID *it = upper_bound(prev_set.begin(), prev_set.end(), lid);
+      G_stats->Shard()->ls_add_to_multi++;
+      res = ComputeId(LidPieces(prev_set.begin(), it, &lid, 1,
+                                it, prev_set.end()));
     }
     ls_add_cache_->Insert(lsid.raw(), lid.raw(), res.raw());
     return res;
@@ -887,24 +1329,25 @@ class LockSet {
     if (lsid.IsSingleton()) {
       // removing the only lock -> LSID(0)
       if (lsid.GetSingleton() != lid) return false;
-      G_stats->ls_remove_from_singleton++;
+      G_stats->Shard()->ls_remove_from_singleton++;
       *new_lsid = LSID(0);
       return true;
     }
 
-    int cache_res;
+    int32_t cache_res;
     if (ls_rem_cache_->Lookup(lsid.raw(), lid.raw(), &cache_res)) {
-      G_stats->ls_rem_cache_hit++;
+      G_stats->Shard()->ls_rem_cache_hit++;
       *new_lsid = LSID(cache_res);
       return true;
     }
+    G_stats->Shard()->ls_rem_cache_miss++;
 
-    LSSet &prev_set = Get(lsid);
-    if (!prev_set.has(lid)) return false;
-    LSSet set(prev_set, LSSet::REMOVE, lid);
-    CHECK(set.size() == prev_set.size() - 1);
-    G_stats->ls_remove_from_multi++;
-    LSID res = ComputeId(set);
+    LSView prev_set = Get(lsid);
+    const LID *it = lower_bound(prev_set.begin(), prev_set.end(), lid);
+    if (it == prev_set.end() || *it != lid) return false;
+    G_stats->Shard()->ls_remove_from_multi++;
+    LSID res = ComputeId(LidPieces(prev_set.begin(), it, NULL, 0,
+                                   it + 1, prev_set.end()));
     ls_rem_cache_->Insert(lsid.raw(), lid.raw(), res.raw());
     *new_lsid = res;
     return true;
@@ -922,39 +1365,55 @@ class LockSet {
 
     // first is singleton, second is not
     if (lsid1.IsSingleton()) {
-      const LSSet &set2 = Get(lsid2);
-      return set2.has(LID(lsid1.raw())) == false;
+      return SetHasLock(Get(lsid2), LID(lsid1.raw())) == false;
     }
 
     // second is singleton, first is not
     if (lsid2.IsSingleton()) {
-      const LSSet &set1 = Get(lsid1);
-      return set1.has(LID(lsid2.raw())) == false;
+      return SetHasLock(Get(lsid1), LID(lsid2.raw())) == false;
     }
 
     // LockSets are equal and not empty
     if (lsid1 == lsid2)
       return false;
 
-    // both are not singletons - slow path.
-    bool ret = true,
-         cache_hit = false;
-    DCHECK(lsid2.raw() < 0);
-    if (ls_intersection_cache_->Lookup(lsid1.raw(), -lsid2.raw(), &ret)) {
+    // both are not singletons.
+    // A common hot lock means a non-empty intersection. If both sets have
+    // only hot locks, the masks are the sets themselves.
+    {
+      LSView set1 = Get(lsid1);
+      LSView set2 = Get(lsid2);
+      if (set1.hot_mask() & set2.hot_mask()) {
+        G_stats->Shard()->ls_intersect_bitset++;
+        return false;
+      }
+      if (set1.all_hot() && set2.all_hot()) {
+        G_stats->Shard()->ls_intersect_bitset++;
+        return true;
+      }
+    }
+
+    // slow path.
+    int32_t cached = 0;
+    bool cache_hit = ls_intersection_cache_->Lookup(lsid1.raw(), lsid2.raw(),
+                                                    &cached);
+    if (cache_hit) {
+      G_stats->Shard()->ls_int_cache_hit++;
       if (!TSAN_DEBUG)
-        return ret;
-      cache_hit = true;
+        return cached != 0;
+    } else {
+      G_stats->Shard()->ls_int_cache_miss++;
     }
-    const LSSet &set1 = Get(lsid1);
-    const LSSet &set2 = Get(lsid2);
+    LSView set1 = Get(lsid1);
+    LSView set2 = Get(lsid2);
 
     FixedArray<LID> intersection(min(set1.size(), set2.size()));
     LID *end = set_intersection(set1.begin(), set1.end(),
                             set2.begin(), set2.end(),
                             intersection.begin());
-    DCHECK(!cache_hit || (ret == (end == intersection.begin())));
-    ret = (end == intersection.begin());
-    ls_intersection_cache_->Insert(lsid1.raw(), -lsid2.raw(), ret);
+    bool ret = (end == intersection.begin());
+    DCHECK(!cache_hit || (ret == (cached != 0)));
+    ls_intersection_cache_->Insert(lsid1.raw(), lsid2.raw(), ret);
     return ret;
   }
 
@@ -964,8 +1423,8 @@ class LockSet {
     if (lsid.IsSingleton())
       return !Lock::LIDtoLock(LID(lsid.raw()))->is_pure_happens_before();
 
-    LSSet &set = Get(lsid);
-    for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it)
+    LSView set = Get(lsid);
+    for (LSView::const_iterator it = set.begin(); it != set.end(); ++it)
       if (!Lock::LIDtoLock(*it)->is_pure_happens_before())
         return true;
     return false;
@@ -977,9 +1436,9 @@ class LockSet {
     } else if (lsid.IsSingleton()) {
       return "{" + Lock::ToString(lsid.GetSingleton()) + "}";
     }
-    const LSSet &set = Get(lsid);
+    LSView set = Get(lsid);
     string res = "{";
-    for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
+    for (LSView::const_iterator it = set.begin(); it != set.end(); ++it) {
       if (it != set.begin()) res += ", ";
       res += Lock::ToString(*it);
     }
@@ -998,8 +1457,8 @@ class LockSet {
                                            locks_reported->count(lid) == 0);
       locks_reported->insert(lid);
     } else {
-      const LSSet &set = Get(lsid);
-      for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
+      LSView set = Get(lsid);
+      for (LSView::const_iterator it = set.begin(); it != set.end(); ++it) {
         LID lid = *it;
         Lock::ReportLockWithOrWithoutContext(lid,
                                      locks_reported->count(lid) == 0);
@@ -1008,13 +1467,29 @@ class LockSet {
     }
   }
 
+  // Puts at most max_locks locks of lsid to 'locks', returns how many.
+  static size_t GetLocks(LSID lsid, LID *locks, size_t max_locks) {
+    if (lsid.IsEmpty() || max_locks == 0) return 0;
+    if (lsid.IsSingleton()) {
+      locks[0] = lsid.GetSingleton();
+      return 1;
+    }
+    LSView set = Get(lsid);
+    size_t n = 0;
+    for (LSView::const_iterator it = set.begin();
+         it != set.end() && n < max_locks; ++it) {
+      locks[n++] = *it;
+    }
+    return n;
+  }
+
   static void AddLocksToSet(LSID lsid, set<LID> *locks) {
     if (lsid.IsEmpty()) return;
     if (lsid.IsSingleton()) {
       locks->insert(lsid.GetSingleton());
     } else {
-      const LSSet &set = Get(lsid);
-      for (LSSet::const_iterator it = set.begin(); it != set.end(); ++it) {
+      LSView set = Get(lsid);
+      for (LSView::const_iterator it = set.begin(); it != set.end(); ++it) {
         locks->insert(*it);
       }
     }
@@ -1022,85 +1497,346 @@ class LockSet {
 
 
   static void InitClassMembers() {
-    map_ = new LockSet::Map;
-    vec_ = new LockSet::Vec;
+    CHECK(sizeof(LID) == sizeof(int32_t));
+    dir_ = new uintptr_t*[kDirSize];
+    memset(dir_, 0, kDirSize * sizeof(*dir_));
+    table_ = NewTable(kInitialTableSizeLog);
     ls_add_cache_ = new LSCache;
     ls_rem_cache_ = new LSCache;
-    ls_rem_cache_ = new LSCache;
-    ls_intersection_cache_ = new LSIntersectionCache;
+    ls_intersection_cache_ = new LSCache;
+    ls_lock_ = new TSLock;
   }
 
  private:
   // No instances are allowed.
   LockSet() { }
 
-  typedef DenseMultimap<LID, 3> LSSet;
+  // Arena record:
+  //   {size, all_hot, hot_mask_lo, hot_mask_hi, lid[0], ..., lid[size-1]}.
+  // all_hot is 1 if every lock of the set had a hot bit when the set was
+  // created, so that hot_mask describes the set completely.
+  enum { kRecordHeader = 4 };
+
+  // A multi-lock set as stored in the arena: sorted LIDs, may repeat.
+  class LSView {
+   public:
+    typedef const LID *const_iterator;
+    explicit LSView(const int32_t *rec)
+      : rec_(rec),
+        begin_((const LID*)(rec + kRecordHeader)), end_(begin_ + rec[0]) { }
+    const_iterator begin() const { return begin_; }
+    const_iterator end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool has(LID lid) const { return binary_search(begin_, end_, lid); }
+    bool all_hot() const { return rec_[1] != 0; }
+    uint64_t hot_mask() const {
+      return (uint32_t)rec_[2] | ((uint64_t)(uint32_t)rec_[3] << 32);
+    }
+   private:
+    const int32_t *rec_;
+    const LID *begin_, *end_;
+  };
+
+  // -------- Hot locks
+  // hot_locks_ maps a LID to its bit: slots hold (lid << 8 | (bit + 1)),
+  // 0 means empty. Written under ls_lock_, read w/o locks.
+  enum { kNumHotLocks = 64, kHotLocksTableSize = 2 * kNumHotLocks };
+
+  static INLINE uintptr_t HotLocksSlot(LID lid) {
+    return ((uint32_t)lid.raw() * 2654435761U) % kHotLocksTableSize;
+  }
+
+  // Returns the bit of the lock or -1.
+  static INLINE int HotLockBit(LID lid) {
+    for (uintptr_t i = HotLocksSlot(lid); ; i = (i + 1) % kHotLocksTableSize) {
+      uintptr_t v = Load(&hot_locks_[i]);
+      if (v == 0) return -1;
+      if ((int32_t)(v >> 8) == lid.raw()) return (int)(v & 0xff) - 1;
+    }
+  }
+
+  // Must be called under ls_lock_.
+  static int GetOrAssignHotLockBit(LID lid) {
+    int bit = HotLockBit(lid);
+    if (bit >= 0 || n_hot_locks_ == kNumHotLocks) return bit;
+    uintptr_t i = HotLocksSlot(lid);
+    while (hot_locks_[i] != 0)
+      i = (i + 1) % kHotLocksTableSize;
+    bit = n_hot_locks_++;
+    ReleaseStore(&hot_locks_[i], ((uintptr_t)lid.raw() << 8) | (bit + 1));
+    return bit;
+  }
+
+  // A lock w/o a bit, or one which got its bit after the set was created,
+  // may still be in the set, so only a set bit or an all-hot set is
+  // conclusive.
+  static INLINE bool SetHasLock(LSView set, LID lid) {
+    int bit = HotLockBit(lid);
+    if (bit >= 0) {
+      if ((set.hot_mask() >> bit) & 1) return true;
+      if (set.all_hot()) return false;
+    }
+    return set.has(lid);
+  }
+
+  static INLINE const int32_t *GetRecord(int32_t idx) {
+    DCHECK(idx >= 0 && idx < n_sets_);
+    uintptr_t *chunk = (uintptr_t*)Load((uintptr_t*)&dir_[idx / kDirChunk]);
+    DCHECK(chunk);
+    return (const int32_t*)Load(&chunk[idx % kDirChunk]);
+  }
 
-  static LSSet &Get(LSID lsid) {
+  static LSView Get(LSID lsid) {
     ScopedMallocCostCenter cc(__FUNCTION__);
-    int idx = -lsid.raw() - 1;
-    DCHECK(idx >= 0);
-    DCHECK(idx < static_cast<int>(vec_->size()));
-    return (*vec_)[idx];
+    return LSView(GetRecord(-lsid.raw() - 1));
+  }
+
+  static INLINE uintptr_t Load(uintptr_t *p) {
+    return *(volatile uintptr_t*)p;
+  }
+
+  // A sorted multiset of LIDs given as the concatenation of up to three
+  // pieces. Add() and Remove() describe {set + lid} and {set - lid} this
+  // way, so that looking them up in the intern table copies nothing; the
+  // LIDs are copied only into the record of a new set.
+  class LidPieces {
+   public:
+    LidPieces(const LID *lids, size_t n) {
+      Init(lids, lids + n, NULL, 0, NULL, NULL);
+    }
+    LidPieces(const LID *lo_begin, const LID *lo_end,
+              const LID *mid, size_t n_mid,
+              const LID *hi_begin, const LID *hi_end) {
+      Init(lo_begin, lo_end, mid, n_mid, hi_begin, hi_end);
+    }
+
+    size_t size() const { return size_; }
+    LID first() const {
+      for (int k = 0; k < 2; k++)
+        if (n_[k]) return p_[k][0];
+      return p_[2][0];
+    }
+
+    uint32_t Hash() const {
+      uint64_t h = size_;
+      for (int k = 0; k < 3; k++) {
+        for (size_t i = 0; i < n_[k]; i++)
+          h = (h ^ (uint32_t)p_[k][i].raw()) * 0x9E3779B97F4A7C15ULL;
+      }
+      return (uint32_t)(h >> 32) ^ (uint32_t)h;
+    }
+
+    bool Equals(const LID *lids) const {
+      for (int k = 0; k < 3; k++) {
+        if (n_[k] && memcmp(lids, p_[k], n_[k] * sizeof(LID)) != 0)
+          return false;
+        lids += n_[k];
+      }
+      return true;
+    }
+
+    void CopyTo(LID *out) const {
+      for (int k = 0; k < 3; k++)
+        out = copy(p_[k], p_[k] + n_[k], out);
+    }
+
+   private:
+    void Init(const LID *lo_begin, const LID *lo_end,
+              const LID *mid, size_t n_mid,
+              const LID *hi_begin, const LID *hi_end) {
+      p_[0] = lo_begin; n_[0] = lo_end - lo_begin;
+      p_[1] = mid;      n_[1] = n_mid;
+      p_[2] = hi_begin; n_[2] = hi_end - hi_begin;
+      size_ = n_[0] + n_[1] + n_[2];
+    }
+
+    const LID *p_[3];
+    size_t n_[3];
+    size_t size_;
+  };
+
+  static INLINE bool RecordEq(int32_t idx, const LidPieces &lids) {
+    const int32_t *rec = GetRecord(idx);
+    return (size_t)rec[0] == lids.size() &&
+        lids.Equals((const LID*)(rec + kRecordHeader));
+  }
+
+  // Open addressing intern table: hash of the set and (index of its record
+  // + 1), 0 means empty. A slot is published by a release store of its id.
+  // When the table grows the old one is leaked: lock-free readers may still
+  // be probing it, and LockSets are never recycled anyway.
+  struct Table {
+    uintptr_t capacity;  // Always a power of two.
+    uint32_t *hashes;
+    uintptr_t *ids;
+  };
+
+  static Table *NewTable(uintptr_t size_log) {
+    Table *t = new Table;
+    t->capacity = (uintptr_t)1 << size_log;
+    t->hashes = new uint32_t[t->capacity];
+    t->ids = new uintptr_t[t->capacity];
+    memset(t->ids, 0, t->capacity * sizeof(uintptr_t));
+    return t;
+  }
+
+  // Returns the index of the record or -1.
+  static int32_t FindInTable(Table *t, uint32_t hash,
+                             const LidPieces &lids) {
+    uintptr_t mask = t->capacity - 1;
+    for (uintptr_t i = hash & mask; ; i = (i + 1) & mask) {
+      uintptr_t id = Load(&t->ids[i]);
+      if (id == 0) return -1;
+      if (t->hashes[i] == hash && RecordEq(id - 1, lids))
+        return id - 1;
+    }
+  }
+
+  static void InsertToTable(Table *t, uint32_t hash, int32_t idx) {
+    uintptr_t mask = t->capacity - 1;
+    uintptr_t i = hash & mask;
+    while (t->ids[i] != 0)
+      i = (i + 1) & mask;
+    t->hashes[i] = hash;
+    ReleaseStore(&t->ids[i], idx + 1);
+  }
+
+  // Must be called under ls_lock_.
+  static NOINLINE void GrowTable() {
+    Table *old_t = table_;
+    uintptr_t size_log = 0;
+    while (((uintptr_t)1 << size_log) < old_t->capacity * 2)
+      size_log++;
+    Table *t = NewTable(size_log);
+    for (uintptr_t j = 0; j < old_t->capacity; j++) {
+      if (old_t->ids[j] != 0)
+        InsertToTable(t, old_t->hashes[j], old_t->ids[j] - 1);
+    }
+    ReleaseStore((uintptr_t*)&table_, (uintptr_t)t);
+  }
+
+  // Must be called under ls_lock_.
+  static int32_t *AllocateRecord(size_t n) {
+    size_t need = n + kRecordHeader;
+    if (arena_pos_ + need > arena_end_) {
+      ScopedMallocCostCenter cc(kLockSetVecAllocCC);
+      size_t size = max((size_t)kArenaChunk, need);
+      arena_pos_ = new int32_t[size];
+      arena_end_ = arena_pos_ + size;
+    }
+    int32_t *res = arena_pos_;
+    arena_pos_ += need;
+    return res;
   }
 
-  static LSID ComputeId(const LSSet &set) {
-    CHECK(set.size() > 0);
-    if (set.size() == 1) {
+  static LSID ComputeId(const LidPieces &pieces) {
+    size_t n = pieces.size();
+    CHECK(n > 0);
+    if (n == 1) {
       // signleton lock set has lsid == lid.
-      return LSID(set.begin()->raw());
+      return LSID(pieces.first().raw());
     }
-    DCHECK(map_);
-    DCHECK(vec_);
+    DCHECK(table_);
     // multiple locks.
     ScopedMallocCostCenter cc("LockSet::ComputeId");
-    int32_t *id = &(*map_)[set];
-    if (*id == 0) {
-      vec_->push_back(set);
-      *id = map_->size();
-      if      (set.size() == 2) G_stats->ls_size_2++;
-      else if (set.size() == 3) G_stats->ls_size_3++;
-      else if (set.size() == 4) G_stats->ls_size_4++;
-      else if (set.size() == 5) G_stats->ls_size_5++;
-      else                      G_stats->ls_size_other++;
-      if (*id >= 4096 && ((*id & (*id - 1)) == 0)) {
-        Report("INFO: %d LockSet IDs have been allocated "
-               "(2: %ld 3: %ld 4: %ld 5: %ld o: %ld)\n",
-               *id,
-               G_stats->ls_size_2, G_stats->ls_size_3,
-               G_stats->ls_size_4, G_stats->ls_size_5,
-               G_stats->ls_size_other
-               );
-      }
-    }
-    return LSID(-*id);
-  }
-
-  typedef map<LSSet, int32_t> Map;
-  static Map *map_;
+    uint32_t hash = pieces.Hash();
+    int32_t idx = FindInTable((Table*)Load((uintptr_t*)&table_),
+                              hash, pieces);
+    if (idx >= 0)
+      return LSID(-idx - 1);
+
+    ShardTIL til(ls_lock_);
+    idx = FindInTable(table_, hash, pieces);
+    if (idx >= 0)
+      return LSID(-idx - 1);
+
+    idx = n_sets_;
+    CHECK(idx + 1 < kMaxLID);
+    int32_t *rec = AllocateRecord(n);
+    LID *lids = (LID*)(rec + kRecordHeader);
+    pieces.CopyTo(lids);
+    uint64_t hot_mask = 0;
+    bool all_hot = true;
+    for (size_t i = 0; i < n; i++) {
+      int bit = GetOrAssignHotLockBit(lids[i]);
+      if (bit >= 0)
+        hot_mask |= 1ULL << bit;
+      else
+        all_hot = false;
+    }
+    rec[0] = n;
+    rec[1] = all_hot;
+    rec[2] = (int32_t)(uint32_t)hot_mask;
+    rec[3] = (int32_t)(uint32_t)(hot_mask >> 32);
+    uintptr_t **chunk = &dir_[idx / kDirChunk];
+    if (*chunk == NULL) {
+      uintptr_t *new_chunk = new uintptr_t[kDirChunk];
+      memset(new_chunk, 0, kDirChunk * sizeof(uintptr_t));
+      ReleaseStore((uintptr_t*)chunk, (uintptr_t)new_chunk);
+    }
+    ReleaseStore(&(*chunk)[idx % kDirChunk], (uintptr_t)rec);
+    n_sets_ = idx + 1;
+    if ((uintptr_t)n_sets_ * 2 > table_->capacity)
+      GrowTable();
+    InsertToTable(table_, hash, idx);
+
+    int32_t id = idx + 1;
+    if      (n == 2) G_stats->Shard()->ls_size_2++;
+    else if (n == 3) G_stats->Shard()->ls_size_3++;
+    else if (n == 4) G_stats->Shard()->ls_size_4++;
+    else if (n == 5) G_stats->Shard()->ls_size_5++;
+    else             G_stats->Shard()->ls_size_other++;
+    if (id >= 4096 && ((id & (id - 1)) == 0)) {
+      Report("INFO: %d LockSet IDs have been allocated "
+             "(2: %ld 3: %ld 4: %ld 5: %ld o: %ld)\n",
+             id,
+             G_stats->Shard()->ls_size_2, G_stats->Shard()->ls_size_3,
+             G_stats->Shard()->ls_size_4, G_stats->Shard()->ls_size_5,
+             G_stats->Shard()->ls_size_other
+             );
+    }
+    return LSID(-id);
+  }
+
+  enum {
+    kInitialTableSizeLog = 10,
+    kArenaChunk = 1 << 16,  // In int32_t.
+    kDirChunk = 1 << 13,
+    kDirSize = kMaxLID / kDirChunk
+  };
+
+  static Table *table_;
+  // dir_[i / kDirChunk][i % kDirChunk] points to the record of the i-th set.
+  static uintptr_t **dir_;
+  static int32_t n_sets_;
+  static int32_t *arena_pos_, *arena_end_;
+  static uintptr_t hot_locks_[kHotLocksTableSize];
+  static int32_t n_hot_locks_;
 
   static const char *kLockSetVecAllocCC;
-  typedef vector<LSSet> Vec;
-  static Vec *vec_;
 
-//  static const int kPrimeSizeOfLsCache = 307;
-//  static const int kPrimeSizeOfLsCache = 499;
-  static const int kPrimeSizeOfLsCache = 1021;
-  typedef IntPairToIntCache<kPrimeSizeOfLsCache> LSCache;
+  // Protects creation of new sets: table_ updates, dir_, n_sets_ and the
+  // arena.
+  static TSLock *ls_lock_;
+
+  typedef SetAssocIntPairToIntCache<8, /*kAtomic=*/true> LSCache;  // 1K.
   static LSCache *ls_add_cache_;
   static LSCache *ls_rem_cache_;
-  static LSCache *ls_int_cache_;
-  typedef IntPairToBoolCache<kPrimeSizeOfLsCache> LSIntersectionCache;
-  static LSIntersectionCache *ls_intersection_cache_;
+  static LSCache *ls_intersection_cache_;  // 1 if the intersection is empty.
 };
 
-LockSet::Map *LockSet::map_;
-LockSet::Vec *LockSet::vec_;
+LockSet::Table *LockSet::table_;
+uintptr_t **LockSet::dir_;
+int32_t LockSet::n_sets_;
+int32_t *LockSet::arena_pos_;
+int32_t *LockSet::arena_end_;
+uintptr_t LockSet::hot_locks_[LockSet::kHotLocksTableSize];
+int32_t LockSet::n_hot_locks_;
+TSLock *LockSet::ls_lock_;
 const char *LockSet::kLockSetVecAllocCC = "kLockSetVecAllocCC";
 LockSet::LSCache *LockSet::ls_add_cache_;
 LockSet::LSCache *LockSet::ls_rem_cache_;
-LockSet::LSCache *LockSet::ls_int_cache_;
-LockSet::LSIntersectionCache *LockSet::ls_intersection_cache_;
+LockSet::LSCache *LockSet::ls_intersection_cache_;
 
 
 static string TwoLockSetsToString(LSID rd_lockset, LSID wr_lockset) {
@@ -1120,8 +1856,179 @@ static string TwoLockSetsToString(LSID rd_lockset, LSID wr_lockset) {
 
 
 
-// -------- VTS ------------------ {{{1
-class VTS {
+// -------- VtsArena ------------------ {{{1
+// Allocator for VTS objects owned by one TSanThread.
+//
+// Blocks are carved from cache-line-aligned chunks. A block of up to a cache
+// line has a power-of-two size and never straddles a line boundary; larger
+// blocks consist of whole lines. So a small VTS touches one line, and the
+// VTSs created by a thread stay close to each other.
+//
+// Allocate() is called only by the owner. Deallocate() may be called by
+// anyone: the block is pushed to a lock-free 'returned' stack and the owner
+// takes the whole stack back when its own free list for that size runs dry.
+//
+// When a thread ends, its arena goes to a pool and is handed to the next
+// new thread, together with whatever was returned to it in the meantime.
+class VtsArena {
+ public:
+  static const size_t kMaxBlockSize = 4096;
+
+  static bool CanAllocate(size_t size) { return size <= kMaxBlockSize; }
+
+  void *Allocate(size_t size) {
+    DCHECK(CanAllocate(size));
+    size_t size_class = SizeClass(size);
+    if (!free_lists_[size_class])
+      TakeReturnedBlocks();
+    Block *res = free_lists_[size_class];
+    if (res) {
+      free_lists_[size_class] = res->next;
+      return res;
+    }
+    return Carve(ClassSize(size_class));
+  }
+
+  // 'size' is the size passed to Allocate().
+  void Deallocate(void *ptr, size_t size) {
+    if (TSAN_DEBUG) {
+      memset(ptr, 0xac, size);
+    }
+    Block *block = reinterpret_cast<Block*>(ptr);
+    block->size_class = SizeClass(size);
+    for (;;) {
+      uintptr_t head = *(volatile uintptr_t*)&returned_;
+      block->next = reinterpret_cast<Block*>(head);
+      if (AtomicCompareAndSwap(&returned_, head, (uintptr_t)block))
+        break;
+    }
+  }
+
+  // Id of this arena, never 0. See Get().
+  int32_t id() const { return id_; }
+
+  static VtsArena *Get(int32_t id) {
+    DCHECK(id > 0 && id <= n_arenas_);
+    return arenas_[id];
+  }
+
+  // Takes an arena from the pool or creates a new one.
+  // Called under the global lock.
+  static VtsArena *Acquire() {
+    if (!pool_->empty()) {
+      VtsArena *res = pool_->back();
+      pool_->pop_back();
+      return res;
+    }
+    CHECK(n_arenas_ < G_flags->max_n_threads);
+    VtsArena *res = new VtsArena(++n_arenas_);
+    arenas_[res->id_] = res;
+    return res;
+  }
+
+  // Called under the global lock.
+  static void Release(VtsArena *arena) {
+    pool_->push_back(arena);
+  }
+
+  // The memory of all the arenas. Reads the counters of the other threads'
+  // arenas w/o a lock, which is fine for the memory governor.
+  static size_t AllocatedBytes() {
+    size_t res = 0;
+    for (int32_t i = 1; i <= n_arenas_; i++)
+      res += arenas_[i]->chunk_bytes_;
+    return res;
+  }
+
+  static void InitClassMembers() {
+    arenas_ = new VtsArena*[G_flags->max_n_threads + 1];
+    memset(arenas_, 0, sizeof(VtsArena*) * (G_flags->max_n_threads + 1));
+    pool_ = new vector<VtsArena*>;
+  }
+
+ private:
+  static const size_t kLineSize = 64;
+  // Size classes: 16, 32, 64, then multiples of kLineSize.
+  static const size_t kNumSizeClasses = 2 + kMaxBlockSize / kLineSize;
+  static const size_t kMinChunkSize = 1024;
+  static const size_t kMaxChunkSize = 1 << 16;
+
+  struct Block {
+    Block *next;
+    size_t size_class;  // Valid only on the 'returned' stack.
+  };
+
+  explicit VtsArena(int32_t id)
+    : id_(id),
+      returned_(0),
+      chunk_pos_(0),
+      chunk_end_(0),
+      chunk_bytes_(0),
+      next_chunk_size_(kMinChunkSize) {
+    memset(free_lists_, 0, sizeof(free_lists_));
+  }
+
+  static size_t SizeClass(size_t size) {
+    if (size <= 16) return 0;
+    if (size <= 32) return 1;
+    return 1 + (size + kLineSize - 1) / kLineSize;
+  }
+
+  static size_t ClassSize(size_t size_class) {
+    if (size_class < 2) return 16 << size_class;
+    return (size_class - 1) * kLineSize;
+  }
+
+  void TakeReturnedBlocks() {
+    if (*(volatile uintptr_t*)&returned_ == 0) return;
+    Block *block = reinterpret_cast<Block*>(AtomicExchange(&returned_, 0));
+    while (block) {
+      Block *next = block->next;
+      DCHECK(block->size_class < kNumSizeClasses);
+      block->next = free_lists_[block->size_class];
+      free_lists_[block->size_class] = block;
+      block = next;
+    }
+  }
+
+  void *Carve(size_t block_size) {
+    size_t align = min(block_size, (size_t)kLineSize);
+    uintptr_t pos = (chunk_pos_ + align - 1) & ~(align - 1);
+    if (pos + block_size > chunk_end_) {
+      // The tail of the old chunk is wasted; it is at most one block.
+      size_t chunk_size = max(next_chunk_size_, block_size);
+      next_chunk_size_ = min(next_chunk_size_ * 2, (size_t)kMaxChunkSize);
+      uint8_t *mem = new uint8_t[chunk_size + kLineSize];
+      chunk_bytes_ += chunk_size + kLineSize;
+      if (TSAN_DEBUG) {
+        memset(mem, 0xab, chunk_size + kLineSize);
+      }
+      pos = ((uintptr_t)mem + kLineSize - 1) & ~(kLineSize - 1);
+      chunk_end_ = pos + chunk_size;
+    }
+    chunk_pos_ = pos + block_size;
+    return reinterpret_cast<void*>(pos);
+  }
+
+  int32_t id_;
+  uintptr_t returned_;  // Block*, the top of the 'returned' stack.
+  uintptr_t chunk_pos_;
+  uintptr_t chunk_end_;
+  size_t chunk_bytes_;  // All the chunks ever carved; they are never freed.
+  size_t next_chunk_size_;
+  Block *free_lists_[kNumSizeClasses];
+
+  static VtsArena **arenas_;  // Indexed by id, G_flags->max_n_threads + 1.
+  static int32_t n_arenas_;
+  static vector<VtsArena*> *pool_;
+};
+
+VtsArena **VtsArena::arenas_;
+int32_t VtsArena::n_arenas_;
+vector<VtsArena*> *VtsArena::pool_;
+
+// -------- VTS ------------------ {{{1
+class VTS {
  public:
   static size_t MemoryRequiredForOneVts(size_t size) {
     return sizeof(VTS) + size * sizeof(TS);
@@ -1134,24 +2041,34 @@ class VTS {
     return (size + 31) & ~31;
   }
 
-  static VTS *Create(size_t size) {
+  // If 'arena' is given (it should belong to the current thread), the VTS is
+  // allocated there unless it is too big.
+  static VTS *Create(size_t size, VtsArena *arena = NULL) {
     DCHECK(size > 0);
     void *mem;
     size_t rounded_size = RoundUpSizeForEfficientUseOfFreeList(size);
     DCHECK(size <= rounded_size);
+    if (arena && VtsArena::CanAllocate(MemoryRequiredForOneVts(size))) {
+      mem = arena->Allocate(MemoryRequiredForOneVts(size));
+      VTS *res = new(mem) VTS(size);
+      res->arena_id_ = arena->id();
+      G_stats->Shard()->vts_create_small++;
+      G_stats->Shard()->vts_total_create += size;
+      return res;
+    }
     if (rounded_size <= kNumberOfFreeLists) {
       // Small chunk, use FreeList.
       ScopedMallocCostCenter cc("VTS::Create (from free list)");
       mem = free_lists_[rounded_size]->Allocate();
-      G_stats->vts_create_small++;
+      G_stats->Shard()->vts_create_small++;
     } else {
       // Large chunk, use new/delete instead of FreeList.
       ScopedMallocCostCenter cc("VTS::Create (from new[])");
       mem = new int8_t[MemoryRequiredForOneVts(size)];
-      G_stats->vts_create_big++;
+      G_stats->Shard()->vts_create_big++;
     }
     VTS *res = new(mem) VTS(size);
-    G_stats->vts_total_create += size;
+    G_stats->Shard()->vts_total_create += size;
     return res;
   }
 
@@ -1160,55 +2077,107 @@ class VTS {
     CHECK_GT(vts->ref_count_, 0);
     if (AtomicDecrementRefcount(&vts->ref_count_) == 0) {
       size_t size = vts->size_;  // can't use vts->size().
+      if (vts->is_delta_) {
+        Delta *delta = vts->delta();
+        delete [] (TS*)delta->flat;
+        Unref(delta->parent);
+        size = kDeltaSlots + delta->n_diff;
+      }
       size_t rounded_size = RoundUpSizeForEfficientUseOfFreeList(size);
-      if (rounded_size <= kNumberOfFreeLists) {
+      if (vts->arena_id_) {
+        VtsArena::Get(vts->arena_id_)->Deallocate(
+            vts, MemoryRequiredForOneVts(size));
+        G_stats->Shard()->vts_delete_small++;
+      } else if (rounded_size <= kNumberOfFreeLists) {
         free_lists_[rounded_size]->Deallocate(vts);
-        G_stats->vts_delete_small++;
+        G_stats->Shard()->vts_delete_small++;
       } else {
-        G_stats->vts_delete_big++;
+        G_stats->Shard()->vts_delete_big++;
         delete vts;
       }
-      G_stats->vts_total_delete += rounded_size;
+      G_stats->Shard()->vts_total_delete += rounded_size;
     }
   }
 
-  static VTS *CreateSingleton(TID tid, int32_t clk = 1) {
-    VTS *res = Create(1);
+  static VTS *CreateSingleton(TID tid, int32_t clk = 1,
+                              VtsArena *arena = NULL) {
+    VTS *res = Create(1, arena);
     res->arr_[0].tid = tid.raw();
     res->arr_[0].clk = clk;
     return res;
   }
 
   VTS *Clone() {
-    G_stats->vts_clone++;
+    G_stats->Shard()->vts_clone++;
     AtomicIncrementRefcount(&ref_count_);
     return this;
   }
 
-  static VTS *CopyAndTick(const VTS *vts, TID id_to_tick) {
+  static VTS *CopyAndTick(const VTS *vts, TID id_to_tick,
+                          VtsArena *arena = NULL) {
     CHECK(vts->ref_count_);
-    VTS *res = Create(vts->size());
-    bool found = false;
-    for (size_t i = 0; i < res->size(); i++) {
-      res->arr_[i] = vts->arr_[i];
-      if (res->arr_[i].tid == id_to_tick.raw()) {
-        res->arr_[i].clk++;
-        found = true;
+    if (G_flags->delta_vts && vts->delta_depth() < kMaxDeltaDepth) {
+      TS ts;
+      ts.tid = id_to_tick.raw();
+      CHECK(vts->FindClk(ts.tid, &ts.clk));
+      ts.clk++;
+      return CreateDelta(vts, vts->size(), &ts, 1, arena);
+    }
+    VTS *res = Create(vts->size(), arena);
+    size_t idx = kernels_->CopyAndFindTid(
+        (const int32_t*)vts->Flat(), (int32_t*)res->arr_, res->size(),
+        id_to_tick.raw());
+    CHECK(idx < res->size());
+    res->arr_[idx].clk++;
+    return res;
+  }
+
+  // Returns 'vts' with the components replaced (or added) by 'diff',
+  // which must be sorted by tid. Used with tree clocks, which tell us what
+  // has changed.
+  static VTS *CopyAndUpdate(const VTS *vts, const TreeClock::Entry *diff,
+                            size_t n_diff, VtsArena *arena = NULL) {
+    CHECK(vts->ref_count_);
+    DCHECK(n_diff > 0);
+    const TS *d = (const TS*)diff;
+    const TS *d_end = d + n_diff;
+    const TS *a = vts->Flat();
+    const TS *a_end = a + vts->size();
+    FixedArray<TS> result_ts(vts->size() + n_diff);
+    TS *t = result_ts.begin();
+    while (a < a_end || d < d_end) {
+      if (d == d_end || (a < a_end && a->tid < d->tid)) {
+        *t++ = *a++;
+      } else {
+        if (a < a_end && a->tid == d->tid) a++;
+        *t++ = *d++;
       }
     }
-    CHECK(found);
+    size_t res_size = t - result_ts.begin();
+    if (G_flags->delta_vts && vts->delta_depth() < kMaxDeltaDepth)
+      return CreateDelta(vts, res_size, (const TS*)diff, n_diff, arena);
+    VTS *res = VTS::Create(res_size, arena);
+    memcpy(res->arr_, result_ts.begin(), res_size * sizeof(TS));
     return res;
   }
 
-  static VTS *Join(const VTS *vts_a, const VTS *vts_b) {
+  static VTS *Join(const VTS *vts_a, const VTS *vts_b,
+                   VtsArena *arena = NULL) {
     CHECK(vts_a->ref_count_);
     CHECK(vts_b->ref_count_);
     FixedArray<TS> result_ts(vts_a->size() + vts_b->size());
     TS *t = result_ts.begin();
-    const TS *a = &vts_a->arr_[0];
-    const TS *b = &vts_b->arr_[0];
+    const TS *a = vts_a->Flat();
+    const TS *b = vts_b->Flat();
     const TS *a_max = a + vts_a->size();
     const TS *b_max = b + vts_b->size();
+    // Fast path for the common prefix with the same tids.
+    size_t n = kernels_->MaxEqualTidPrefix(
+        (const int32_t*)a, (const int32_t*)b, (int32_t*)t,
+        min(vts_a->size(), vts_b->size()));
+    a += n;
+    b += n;
+    t += n;
     while (a < a_max && b < b_max) {
       if (a->tid < b->tid) {
         *t = *a;
@@ -1240,37 +2209,118 @@ class VTS {
       t++;
     }
 
-    VTS *res = VTS::Create(t - result_ts.begin());
+    size_t res_size = t - result_ts.begin();
+    if (G_flags->delta_vts) {
+      VTS *res = JoinAsDelta(vts_a, result_ts.begin(), res_size, arena);
+      if (!res)
+        res = JoinAsDelta(vts_b, result_ts.begin(), res_size, arena);
+      if (res)
+        return res;
+    }
+    VTS *res = VTS::Create(res_size, arena);
     for (size_t i = 0; i < res->size(); i++) {
       res->arr_[i] = result_ts[i];
     }
     return res;
   }
 
+  // Joins n >= 2 VTSs at once: one sort of all the components instead of
+  // n - 1 pairwise joins with n - 2 intermediate VTSs.
+  // With --delta_vts the result may be a delta of vtss[0].
+  static VTS *JoinMany(const VTS *const *vtss, size_t n,
+                       VtsArena *arena = NULL) {
+    CHECK(n >= 2);
+    if (n == 2) return Join(vtss[0], vtss[1], arena);
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+      CHECK(vtss[i]->ref_count_);
+      total += vtss[i]->size();
+    }
+    FixedArray<TS> all_ts(total);
+    TS *t = all_ts.begin();
+    for (size_t i = 0; i < n; i++) {
+      memcpy(t, vtss[i]->Flat(), vtss[i]->size() * sizeof(TS));
+      t += vtss[i]->size();
+    }
+    sort(all_ts.begin(), t, TSTidLess);
+    // Keep the max clk of each tid.
+    TS *res_end = all_ts.begin();
+    for (const TS *a = all_ts.begin(); a < t; a++) {
+      if (res_end != all_ts.begin() && res_end[-1].tid == a->tid) {
+        res_end[-1].clk = max(res_end[-1].clk, a->clk);
+      } else {
+        *res_end++ = *a;
+      }
+    }
+    size_t res_size = res_end - all_ts.begin();
+    if (G_flags->delta_vts) {
+      VTS *res = JoinAsDelta(vtss[0], all_ts.begin(), res_size, arena);
+      if (res)
+        return res;
+    }
+    VTS *res = VTS::Create(res_size, arena);
+    memcpy(res->arr_, all_ts.begin(), res_size * sizeof(TS));
+    return res;
+  }
+
   int32_t clk(TID tid) const {
     // TODO(dvyukov): this function is sub-optimal,
     // we only need thread's own clock.
-    for (size_t i = 0; i < size_; i++) {
-      if (arr_[i].tid == tid.raw()) {
-        return arr_[i].clk;
-      }
-    }
-    return 0;
+    int32_t res = 0;
+    FindClk(tid.raw(), &res);
+    return res;
+  }
+
+  // Same as HappensBefore(vts_a, vts_b) if vts_a is the VTS of a segment
+  // of thread 'tid_a' (FastTrack's epoch test, see --epoch_hb).
+  // A thread ticks its own clock right after it hands its VTS over (signal,
+  // unlock, thread creation, ...), so whoever knows the clock vts_a has for
+  // tid_a got it from a VTS which is not less than vts_a.
+  static INLINE bool EpochHappensBefore(TID tid_a, const VTS *vts_a,
+                                        const VTS *vts_b) {
+    G_stats->Shard()->n_vts_hb_epoch++;
+    return vts_a->clk(tid_a) <= vts_b->clk(tid_a);
   }
 
   static INLINE void FlushHBCache() {
+    for (int i = 0; i < kNumHBShards; i++) {
+      ShardTIL til(hb_shards_[i].lock);
+      hb_shards_[i].cache.Flush();
+    }
+    ShardTIL til(hb_cache_lock_);
     hb_cache_->Flush();
   }
 
+  // The answers are cached in two levels: a small set-associative cache of
+  // the current thread's shard (see HBShardIndex()) and the shared
+  // hb_cache_, which is looked up on a miss in the former.
   static INLINE bool HappensBeforeCached(const VTS *vts_a, const VTS *vts_b) {
     bool res = false;
-    if (hb_cache_->Lookup(vts_a->uniq_id_, vts_b->uniq_id_, &res)) {
-      G_stats->n_vts_hb_cached++;
+    HBShard *shard = &hb_shards_[HBShardIndex()];
+    {
+      ShardTIL til(shard->lock);
+      if (shard->cache.Lookup(vts_a->uniq_id_, vts_b->uniq_id_, &res)) {
+        G_stats->Shard()->n_vts_hb_cached++;
+        G_stats->Shard()->n_vts_hb_cached_l1++;
+        DCHECK(res == HappensBefore(vts_a, vts_b));
+        return res;
+      }
+    }
+    bool cache_hit = false;
+    {
+      ShardTIL til(hb_cache_lock_);
+      cache_hit = hb_cache_->Lookup(vts_a->uniq_id_, vts_b->uniq_id_, &res);
+    }
+    if (cache_hit) {
+      G_stats->Shard()->n_vts_hb_cached++;
       DCHECK(res == HappensBefore(vts_a, vts_b));
-      return res;
+    } else {
+      res = HappensBefore(vts_a, vts_b);
+      ShardTIL til(hb_cache_lock_);
+      hb_cache_->Insert(vts_a->uniq_id_, vts_b->uniq_id_, res);
     }
-    res = HappensBefore(vts_a, vts_b);
-    hb_cache_->Insert(vts_a->uniq_id_, vts_b->uniq_id_, res);
+    ShardTIL til(shard->lock);
+    shard->cache.Insert(vts_a->uniq_id_, vts_b->uniq_id_, res);
     return res;
   }
 
@@ -1278,12 +2328,25 @@ class VTS {
   static NOINLINE bool HappensBefore(const VTS *vts_a, const VTS *vts_b) {
     CHECK(vts_a->ref_count_);
     CHECK(vts_b->ref_count_);
-    G_stats->n_vts_hb++;
-    const TS *a = &vts_a->arr_[0];
-    const TS *b = &vts_b->arr_[0];
+    G_stats->Shard()->n_vts_hb++;
+    // A delta VTS is strictly greater than each of its ancestors.
+    if (vts_b->is_delta_ && vts_b->HasAncestor(vts_a))
+      return true;
+    if (vts_a->is_delta_ && vts_a->HasAncestor(vts_b))
+      return false;
+    const TS *a = vts_a->Flat();
+    const TS *b = vts_b->Flat();
     const TS *a_max = a + vts_a->size();
     const TS *b_max = b + vts_b->size();
     bool a_less_than_b = false;
+    // Fast path for the common prefix with the same tids.
+    bool a_greater = false;
+    size_t n = kernels_->CompareEqualTidPrefix(
+        (const int32_t*)a, (const int32_t*)b,
+        min(vts_a->size(), vts_b->size()), &a_less_than_b, &a_greater);
+    if (a_greater) return false;
+    a += n;
+    b += n;
     while (a < a_max && b < b_max) {
       if (a->tid < b->tid) {
         // a->tid is not present in b.
@@ -1315,12 +2378,18 @@ class VTS {
     return size_;
   }
 
+  // The array of size() elements sorted by tid.
+  const TreeClock::Entry *entries() const {
+    return (const TreeClock::Entry*)Flat();
+  }
+
   string ToString() const {
     DCHECK(ref_count_);
     string res = "[";
+    const TS *arr = Flat();
     for (size_t i = 0; i < size(); i++) {
       char buff[100];
-      snprintf(buff, sizeof(buff), "%d:%d;", arr_[i].tid, arr_[i].clk);
+      snprintf(buff, sizeof(buff), "%d:%d;", arr[i].tid, arr[i].clk);
       if (i) res += " ";
       res += buff;
     }
@@ -1405,7 +2474,19 @@ class VTS {
   }
 
   static void InitClassMembers() {
+    CHECK(sizeof(TS) == 2 * sizeof(int32_t));  // The kernels rely on this.
+    CHECK(sizeof(TS) == sizeof(TreeClock::Entry));
+    kernels_ = G_flags->vts_simd ? GetBestVtsKernels() : &kVtsKernelsScalar;
+    if (G_flags->verbosity >= 2) {
+      Report("INFO: VTS kernels: %s\n", kernels_->name);
+    }
     hb_cache_ = new HBCache;
+    hb_shards_ = new HBShard[kNumHBShards];
+    if (ShardedLocking()) {
+      hb_cache_lock_ = new TSLock;
+      for (int i = 0; i < kNumHBShards; i++)
+        hb_shards_[i].lock = new TSLock;
+    }
     free_lists_ = new FreeList *[kNumberOfFreeLists+1];
     free_lists_[0] = 0;
     for (size_t  i = 1; i <= kNumberOfFreeLists; i++) {
@@ -1419,7 +2500,9 @@ class VTS {
  private:
   explicit VTS(size_t size)
     : ref_count_(1),
-      size_(size) {
+      size_(size),
+      is_delta_(0),
+      arena_id_(0) {
     uniq_id_counter_++;
     // If we've got overflow, we are in trouble, need to have 64-bits...
     CHECK_GT(uniq_id_counter_, 0);
@@ -1432,19 +2515,210 @@ class VTS {
     int32_t clk;
   };
 
+  static bool TSTidLess(const TS &a, const TS &b) {
+    return a.tid < b.tid;
+  }
+
+  // Delta VTS (--delta_vts).
+  // CopyAndTick() and Join() may return a VTS that stores only the
+  // components that differ from one of the arguments (the parent). The
+  // parent is kept alive by the delta. The flat array is built on first use
+  // (Flat()), which the common operations avoid when they can:
+  // HappensBefore() of a VTS and its descendant is answered by walking the
+  // parent chain, and clk() looks up the diffs first.
+  // A delta VTS keeps a Delta object instead of arr_, followed by n_diff
+  // TS elements sorted by tid; each one replaces (or adds) a component of the
+  // parent.
+  struct Delta {
+    VTS *parent;
+    uintptr_t flat;  // TS*: the materialized array of size_ elements, or 0.
+    uint32_t n_diff;
+    uint32_t depth;  // Number of deltas in the parent chain, including this.
+  };
+  // Number of TS slots occupied by the Delta object.
+  static const size_t kDeltaSlots = (sizeof(Delta) + sizeof(TS) - 1) /
+                                    sizeof(TS);
+  // Longer chains make materialization too slow.
+  static const uint32_t kMaxDeltaDepth = 16;
+  // Join() creates a delta only if it is this small.
+  static const size_t kMaxDeltaDiff = 16;
+
+  Delta *delta() const {
+    DCHECK(is_delta_);
+    return (Delta*)arr_;
+  }
+
+  const TS *diff() const {
+    return (const TS*)arr_ + kDeltaSlots;
+  }
+
+  uint32_t delta_depth() const {
+    return is_delta_ ? delta()->depth : 0;
+  }
+
+  // Returns the array of size() elements sorted by tid.
+  const TS *Flat() const {
+    if (!is_delta_) return arr_;
+    uintptr_t flat = *(volatile uintptr_t*)&delta()->flat;
+    if (flat) return (const TS*)flat;
+    return Materialize();
+  }
+
+  // Binary search of 'tid' in a sorted array.
+  static const TS *Find(const TS *arr, size_t size, int32_t tid) {
+    size_t beg = 0, end = size;
+    while (beg < end) {
+      size_t mid = (beg + end) / 2;
+      if (arr[mid].tid == tid) return &arr[mid];
+      if (arr[mid].tid < tid)
+        beg = mid + 1;
+      else
+        end = mid;
+    }
+    return NULL;
+  }
+
+  // Returns false if 'tid' is not present.
+  bool FindClk(int32_t tid, int32_t *clk) const {
+    const VTS *vts = this;
+    while (vts->is_delta_ && !*(volatile uintptr_t*)&vts->delta()->flat) {
+      const TS *ts = Find(vts->diff(), vts->delta()->n_diff, tid);
+      if (ts) {
+        *clk = ts->clk;
+        return true;
+      }
+      vts = vts->delta()->parent;
+    }
+    const TS *ts = Find(vts->Flat(), vts->size(), tid);
+    if (!ts) return false;
+    *clk = ts->clk;
+    return true;
+  }
+
+  bool HasAncestor(const VTS *ancestor) const {
+    for (const VTS *vts = this; vts->is_delta_; vts = vts->delta()->parent) {
+      if (vts->delta()->parent == ancestor) return true;
+    }
+    return false;
+  }
+
+  static VTS *CreateDelta(const VTS *parent, size_t size,
+                          const TS *diff, size_t n_diff, VtsArena *arena) {
+    DCHECK(n_diff > 0);
+    VTS *res = Create(kDeltaSlots + n_diff, arena);
+    res->size_ = size;
+    res->is_delta_ = 1;
+    Delta *delta = res->delta();
+    delta->parent = const_cast<VTS*>(parent)->Clone();
+    delta->flat = 0;
+    delta->n_diff = n_diff;
+    delta->depth = parent->delta_depth() + 1;
+    memcpy((TS*)res->diff(), diff, n_diff * sizeof(TS));
+    G_stats->Shard()->vts_delta_create++;
+    return res;
+  }
+
+  // 'res' is the result of Join(parent, x) for some x, so every component
+  // of 'parent' is present in 'res'. Returns NULL if the diff is too big.
+  static VTS *JoinAsDelta(const VTS *parent, const TS *res, size_t res_size,
+                          VtsArena *arena) {
+    if (parent->delta_depth() >= kMaxDeltaDepth) return NULL;
+    TS diff[kMaxDeltaDiff];
+    size_t n_diff = 0;
+    const TS *p = parent->Flat();
+    const TS *p_end = p + parent->size();
+    for (size_t i = 0; i < res_size; i++) {
+      if (p < p_end && p->tid == res[i].tid) {
+        bool same = p->clk == res[i].clk;
+        p++;
+        if (same) continue;
+      }
+      if (n_diff == kMaxDeltaDiff) return NULL;
+      diff[n_diff++] = res[i];
+    }
+    DCHECK(p == p_end);
+    if (n_diff == 0)
+      return const_cast<VTS*>(parent)->Clone();
+    return CreateDelta(parent, res_size, diff, n_diff, arena);
+  }
+
+  // Builds the flat array of a delta VTS: takes the array of the closest
+  // ancestor that has one and applies the diffs on the way back.
+  NOINLINE const TS *Materialize() const {
+    G_stats->Shard()->vts_delta_materialize++;
+    const VTS *chain[kMaxDeltaDepth];
+    size_t n = 0;
+    const VTS *base = this;
+    while (base->is_delta_ && !*(volatile uintptr_t*)&base->delta()->flat) {
+      CHECK(n < kMaxDeltaDepth);
+      chain[n++] = base;
+      base = base->delta()->parent;
+    }
+    TS *res = new TS[size_];
+    FixedArray<TS> tmp(size_);
+    size_t res_size = base->size();
+    CHECK(res_size <= size_);
+    memcpy(res, base->Flat(), res_size * sizeof(TS));
+    while (n > 0) {
+      const VTS *vts = chain[--n];
+      const TS *d = vts->diff();
+      const TS *d_end = d + vts->delta()->n_diff;
+      size_t i = 0, t = 0;
+      while (i < res_size || d < d_end) {
+        if (d == d_end || (i < res_size && res[i].tid < d->tid)) {
+          tmp[t++] = res[i++];
+        } else {
+          if (i < res_size && res[i].tid == d->tid) i++;
+          tmp[t++] = *d++;
+        }
+      }
+      CHECK(t == vts->size_);
+      res_size = t;
+      memcpy(res, tmp.begin(), res_size * sizeof(TS));
+    }
+    CHECK(res_size == size_);
+    if (!AtomicCompareAndSwap(&delta()->flat, 0, (uintptr_t)res)) {
+      // Somebody else did it concurrently.
+      delete [] res;
+      return (const TS*)delta()->flat;
+    }
+    return res;
+  }
+
 
   // data members
   int32_t ref_count_;
   int32_t uniq_id_;
-  size_t size_;
-  TS     arr_[];  // array of size_ elements.
+  uint32_t size_ : 31;
+  uint32_t is_delta_ : 1;
+  int32_t arena_id_;  // VtsArena::Get(arena_id_) owns the memory, if not 0.
+  TS     arr_[];  // array of size_ elements, or a Delta object.
 
 
   // static data members
   static int32_t uniq_id_counter_;
-  static const int kCacheSize = 4999;  // Has to be prime.
-  typedef IntPairToBoolCache<kCacheSize> HBCache;
+  typedef SetAssocIntPairToBoolCache<10> HBCache;  // 4K.
   static HBCache *hb_cache_;
+  static TSLock *hb_cache_lock_;  // Used only with sharded locking.
+
+  // The first level of the happens-before cache. The callers (SegmentSet,
+  // the state machine) don't know the TSanThread, so instead of being
+  // per TSanThread the caches are sharded by the stack address, as
+  // Stats::Shard(), and a thread almost always has its shard to itself.
+  struct HBShard {
+    HBShard() : lock(NULL) {}
+    TSLock *lock;  // Used only with sharded locking.
+    SetAssocIntPairToBoolCache<8> cache;  // 1K.
+  };
+  static const int kNumHBShards = 16;
+  static HBShard *hb_shards_;  // Array of kNumHBShards elements.
+
+  INLINE static int HBShardIndex() {
+    int local;
+    uint64_t h = ((uintptr_t)&local >> 16) * 0x9E3779B97F4A7C15ULL;
+    return (int)(h >> 32) & (kNumHBShards - 1);
+  }
+  static const VtsKernels *kernels_;
 
   static const size_t kNumberOfFreeLists = 512;  // Must be power of two.
 //  static const size_t kNumberOfFreeLists = 64; // Must be power of two.
@@ -1452,7 +2726,10 @@ class VTS {
 };
 
 int32_t VTS::uniq_id_counter_;
+const VtsKernels *VTS::kernels_;
 VTS::HBCache *VTS::hb_cache_;
+TSLock *VTS::hb_cache_lock_;
+VTS::HBShard *VTS::hb_shards_;
 FreeList **VTS::free_lists_;
 
 
@@ -1521,53 +2798,31 @@ class Mask {
   INLINE void Clear(uintptr_t idx) { m_ &= ~(kOne << idx); }
   INLINE bool Empty() const {return m_ == 0; }
 
-  // Clear bits in range [a,b) and return old [a,b) range.
-  INLINE Mask ClearRangeAndReturnOld(uintptr_t a, uintptr_t b) {
+  // The bits [a,b), 0 <= a < b <= kNBits, w/o a branch for b-a == kNBits.
+  static INLINE uintptr_t RangeBits(uintptr_t a, uintptr_t b) {
     DCHECK(a < b);
     DCHECK(b <= kNBits);
-    uintptr_t res;
-    uintptr_t n_bits_in_mask = (b - a);
-    if (n_bits_in_mask == kNBits) {
-      res = m_;
-      m_ = 0;
-    } else {
-      uintptr_t t = (kOne << n_bits_in_mask);
-      uintptr_t mask = (t - 1) << a;
-      res = m_ & mask;
-      m_ &= ~mask;
-    }
+    return (~(uintptr_t)0 >> (kNBits - (b - a))) << a;
+  }
+
+  // Clear bits in range [a,b) and return old [a,b) range.
+  INLINE Mask ClearRangeAndReturnOld(uintptr_t a, uintptr_t b) {
+    uintptr_t mask = RangeBits(a, b);
+    uintptr_t res = m_ & mask;
+    m_ &= ~mask;
     return Mask(res);
   }
 
   INLINE void ClearRange(uintptr_t a, uintptr_t b) {
-    ClearRangeAndReturnOld(a, b);
+    m_ &= ~RangeBits(a, b);
   }
 
   INLINE void SetRange(uintptr_t a, uintptr_t b) {
-    DCHECK(a < b);
-    DCHECK(b <= kNBits);
-    uintptr_t n_bits_in_mask = (b - a);
-    if (n_bits_in_mask == kNBits) {
-      m_ = ~0;
-    } else {
-      uintptr_t t = (kOne << n_bits_in_mask);
-      uintptr_t mask = (t - 1) << a;
-      m_ |= mask;
-    }
+    m_ |= RangeBits(a, b);
   }
 
   INLINE uintptr_t GetRange(uintptr_t a, uintptr_t b) const {
-    // a bug was fixed here
-    DCHECK(a < b);
-    DCHECK(b <= kNBits);
-    uintptr_t n_bits_in_mask = (b - a);
-    if (n_bits_in_mask == kNBits) {
-      return m_;
-    } else {
-      uintptr_t t = (kOne << n_bits_in_mask);
-      uintptr_t mask = (t - 1) << a;
-      return m_ & mask;
-    }
+    return m_ & RangeBits(a, b);
   }
 
   // Get index of some set bit (asumes mask is non zero).
@@ -1594,11 +2849,14 @@ class Mask {
   }
 
   size_t PopCount() {
-#ifdef VGO_linux
+#ifdef __GNUC__
     return __builtin_popcountl(m_);
 #else
-    CHECK(0);
-    return 0;
+    uintptr_t m = m_;
+    size_t res = 0;
+    for (; m; m &= m - 1)
+      res++;
+    return res;
 #endif
   }
 
@@ -1654,6 +2912,19 @@ class BitSet {
 
   bool empty() { return map_.empty(); }
 
+  // Returns true if the two sets have a common address.
+  bool Intersects(const BitSet &other) const {
+    const Map &small = map_.size() <= other.map_.size() ? map_ : other.map_;
+    const Map &big = map_.size() <= other.map_.size() ? other.map_ : map_;
+    for (Map::const_iterator it = small.begin(); it != small.end(); ++it) {
+      Map::const_iterator it2 = big.find(it->first);
+      if (it2 != big.end() &&
+          !Mask::Intersection(it->second, it2->second).Empty())
+        return true;
+    }
+    return false;
+  }
+
   size_t size() {
     size_t res = 0;
     for (Map::iterator it = map_.begin(); it != map_.end(); ++it) {
@@ -1706,6 +2977,10 @@ class BitSet {
 };
 
 // -------- Segment -------------------{{{1
+static void FlushSegmentSetCaches();
+static void ThreadHasNoSegments(TID tid);
+static int32_t SlotToFrontendTid(TID slot, const VTS *vts);
+
 class Segment {
  public:
   // for debugging...
@@ -1716,44 +2991,69 @@ class Segment {
 
   // non-static methods
 
-  VTS *vts() const { return vts_; }
-  TID tid() const { return TID(tid_); }
+  VTS *vts() const { return hot()->vts; }
+  TID tid() const { return hot()->tid; }
   LSID  lsid(bool is_w) const { return lsid_[is_w]; }
   uint32_t lock_era() const { return lock_era_; }
 
   // static methods
 
-  static INLINE uintptr_t *embedded_stack_trace(SID sid) {
-    DCHECK(sid.valid());
-    DCHECK(kSizeOfHistoryStackTrace > 0);
-    size_t chunk_idx = (unsigned)sid.raw() / kChunkSizeForStacks;
-    size_t idx       = (unsigned)sid.raw() % kChunkSizeForStacks;
-    DCHECK(chunk_idx < n_stack_chunks_);
-    DCHECK(all_stacks_[chunk_idx] != NULL);
-    return &all_stacks_[chunk_idx][idx * kSizeOfHistoryStackTrace];
+  // The thread and the VTS of a live segment, read from the dense hot array
+  // without touching the Segment itself.
+  static INLINE TID Tid(SID sid) {
+    AssertLive(sid, __LINE__);
+    return GetHot(sid)->tid;
+  }
+  static INLINE VTS *Vts(SID sid) {
+    AssertLive(sid, __LINE__);
+    return GetHot(sid)->vts;
   }
 
-  static void ensure_space_for_stack_trace(SID sid) {
-    ScopedMallocCostCenter malloc_cc(__FUNCTION__);
-    DCHECK(sid.valid());
+  // Start loading what HappensBefore(sid, ...) is going to read.
+  static INLINE void Prefetch(SID sid) {
+    Hot *hot = GetHot(sid);
+    PREFETCH(hot);
+    PREFETCH(hot->vts);
+  }
+
+  // The history stack of the segment lives in G_stack_depot.
+  static INLINE uint32_t stack_id(SID sid) {
+    return GetInternal(sid)->stack_id_;
+  }
+
+  static INLINE void set_stack_id(SID sid, uint32_t id) {
+    GetInternal(sid)->stack_id_ = id;
+  }
+
+  // Returns the PCs of the history stack (the top frame first) and sets
+  // *size. Returns NULL if the stack was not filled.
+  // With --history_ring the stack_id is a position in the ring of the
+  // segment's thread and the stack is replayed to a static buffer, valid
+  // until the next call. This happens only when reporting, under ts_lock.
+  static INLINE const uintptr_t *history_stack(SID sid, size_t *size) {
     DCHECK(kSizeOfHistoryStackTrace > 0);
-    size_t chunk_idx = (unsigned)sid.raw() / kChunkSizeForStacks;
-    DCHECK(chunk_idx < n_stack_chunks_);
-    if (all_stacks_[chunk_idx])
-      return;
-    for (size_t i = 0; i <= chunk_idx; i++) {
-      if (all_stacks_[i]) continue;
-      all_stacks_[i] = new uintptr_t[
-          kChunkSizeForStacks * kSizeOfHistoryStackTrace];
-      // we don't clear this memory, it will be clreared later lazily.
-      // We also never delete it because it will be used until the very end.
+    Segment *seg = GetInternal(sid);
+    if (UNLIKELY(g_history_rings != NULL) &&
+        g_history_rings[seg->tid().raw()] != NULL) {
+      static uintptr_t replayed[HistoryRing::kMaxFrames];
+      *size = g_history_rings[seg->tid().raw()]->Replay(
+          seg->stack_id_, replayed,
+          min((size_t)kSizeOfHistoryStackTrace,
+              (size_t)HistoryRing::kMaxFrames));
+      return *size ? replayed : NULL;
     }
+    return G_stack_depot->Get(seg->stack_id_, size);
   }
 
   static string StackTraceString(SID sid) {
     DCHECK(kSizeOfHistoryStackTrace > 0);
-    return StackTrace::EmbeddedStackTraceToString(
-        embedded_stack_trace(sid), kSizeOfHistoryStackTrace);
+    size_t size;
+    const uintptr_t *pcs = history_stack(sid, &size);
+    if (!pcs && g_history_rings && g_history_rings[GetHot(sid)->tid.raw()]) {
+      return "    (the history ring has moved on, "
+          "consider a larger --history_ring)\n";
+    }
+    return StackTrace::EmbeddedStackTraceToString(pcs, size);
   }
 
   // Allocate `n` fresh segments, put SIDs into `fresh_sids`.
@@ -1763,7 +3063,7 @@ class Segment {
     size_t n_reusable = min(n, reusable_sids_->size());
     // First, allocate from reusable_sids_.
     for (; i < n_reusable; i++) {
-      G_stats->seg_reuse++;
+      G_stats->Shard()->seg_reuse++;
       DCHECK(!reusable_sids_->empty());
       SID sid = reusable_sids_->back();
       reusable_sids_->pop_back();
@@ -1777,25 +3077,27 @@ class Segment {
       }
       fresh_sids[i] = sid;
     }
+    // The segment set caches may still have answers about the dead segments
+    // which had these SIDs.
+    if (n_reusable)
+      FlushSegmentSetCaches();
     // allocate the rest from new sids.
     for (; i < n; i++) {
-      G_stats->seg_create++;
+      G_stats->Shard()->seg_create++;
       CHECK(n_segments_ < kMaxSID);
       Segment *seg = GetSegmentByIndex(n_segments_);
 
       // This VTS may not be empty due to ForgetAllState().
-      VTS::Unref(seg->vts_);
-      seg->vts_ = 0;
+      Hot *hot = seg->hot();
+      VTS::Unref(hot->vts);
+      hot->vts = 0;
       seg->seg_ref_count_ = 0;
 
       if (ProfileSeg(SID(n_segments_))) {
        Printf("Segment: allocated SID %d\n", n_segments_);
       }
 
-      SID sid = fresh_sids[i] = SID(n_segments_);
-      if (kSizeOfHistoryStackTrace > 0) {
-        ensure_space_for_stack_trace(sid);
-      }
+      fresh_sids[i] = SID(n_segments_);
       n_segments_++;
     }
   }
@@ -1810,14 +3112,14 @@ class Segment {
     DCHECK(seg);
     DCHECK(seg->seg_ref_count_ == 0);
     seg->seg_ref_count_ = 0;
-    seg->tid_ = tid;
+    seg->hot()->tid = tid;
+    seg->hot()->vts = vts;
+    if (n_segments_of_tid_)
+      NoBarrier_AtomicAdd(&n_segments_of_tid_[tid.raw()], 1);
     seg->lsid_[0] = rd_lockset;
     seg->lsid_[1] = wr_lockset;
-    seg->vts_ = vts;
     seg->lock_era_ = g_lock_era;
-    if (kSizeOfHistoryStackTrace) {
-      embedded_stack_trace(sid)[0] = 0;
-    }
+    seg->stack_id_ = 0;
   }
 
   static INLINE SID AddNewSegment(TID tid, VTS *vts,
@@ -1859,9 +3161,9 @@ class Segment {
   }
 
   static INLINE void RecycleOneFreshSid(SID sid) {
-    Segment *seg = GetInternal(sid);
-    seg->tid_ = TID();
-    seg->vts_ = NULL;
+    Hot *hot = GetHot(sid);
+    hot->tid = TID();
+    hot->vts = NULL;
     reusable_sids_->push_back(sid);
     if (ProfileSeg(sid)) {
       Printf("Segment: recycled SID %d\n", sid.raw());
@@ -1874,11 +3176,21 @@ class Segment {
     DCHECK(seg->seg_ref_count_ == 0);
     DCHECK(sid.raw() < n_segments_);
     if (!seg->vts()) return false;  // Already recycled.
-    VTS::Unref(seg->vts_);
+    VTS::Unref(seg->vts());
+    TID tid = seg->tid();
     RecycleOneFreshSid(sid);
+    if (n_segments_of_tid_ &&
+        NoBarrier_AtomicAdd(&n_segments_of_tid_[tid.raw()], -1) == 0) {
+      ThreadHasNoSegments(tid);
+    }
     return true;
   }
 
+  // --reuse_dead_tids: the number of live segments of the thread.
+  static int32_t NumberOfSegmentsOfTid(TID tid) {
+    return n_segments_of_tid_[tid.raw()];
+  }
+
   int32_t ref_count() const {
     return INTERNAL_ANNOTATE_UNPROTECTED_READ(seg_ref_count_);
   }
@@ -1908,29 +3220,72 @@ class Segment {
     }
   }
 
+  // Adds 'n' (which may be negative) to the refcount. The caller keeps at
+  // least one reference, so this never recycles the segment.
+  static void INLINE AddRefs(SID sid, int32_t n) {
+    Segment *seg = GetInternal(sid);
+    if (ProfileSeg(sid)) {
+      Printf("SegAddRefs: %d ref=%d n=%d\n", sid.raw(), seg->seg_ref_count_, n);
+    }
+    int32_t res = NoBarrier_AtomicAdd(&seg->seg_ref_count_, n);
+    CHECK_GT(res, 0);
+  }
+
+
+  // Give the free SIDs at the top of [1, n_segments_) back, so that
+  // NumberOfSegments() goes down, and make the lowest free SIDs the next to
+  // be reused, so that the top keeps draining as segments die.
+  // We don't renumber the live segments: that would mean rewriting every
+  // shadow value, segment set and thread that refers to them.
+  // Returns the number of SIDs given back.
+  static int32_t CompactFreeSids() {
+    ScopedMallocCostCenter malloc_cc(__FUNCTION__);
+    vector<SID> &free_sids = *reusable_sids_;
+    sort(free_sids.begin(), free_sids.end());
+    int32_t old_n_segments = n_segments_;
+    while (!free_sids.empty() &&
+           free_sids.back().raw() == n_segments_ - 1) {
+      DCHECK(!GetInternal(free_sids.back())->seg_ref_count_);
+      free_sids.pop_back();
+      n_segments_--;
+    }
+    // AllocateFreshSegments() takes from the back.
+    reverse(free_sids.begin(), free_sids.end());
+    G_stats->Shard()->seg_compact++;
+    G_stats->Shard()->seg_compact_trimmed += old_n_segments - n_segments_;
+    return old_n_segments - n_segments_;
+  }
 
   static void ForgetAllState() {
     n_segments_ = 1;
     reusable_sids_->clear();
     // vts_'es will be freed in AddNewSegment.
+    if (n_segments_of_tid_)
+      memset(n_segments_of_tid_, 0,
+             G_flags->max_n_threads * sizeof(*n_segments_of_tid_));
   }
 
   static string ToString(SID sid) {
     char buff[100];
-    snprintf(buff, sizeof(buff), "T%d/S%d", Get(sid)->tid().raw(), sid.raw());
+    Segment *seg = Get(sid);
+    snprintf(buff, sizeof(buff), "T%d/S%d",
+             SlotToFrontendTid(seg->tid(), seg->vts()), sid.raw());
     return buff;
   }
 
   static string ToStringTidOnly(SID sid) {
     char buff[100];
-    snprintf(buff, sizeof(buff), "T%d", Get(sid)->tid().raw());
+    Segment *seg = Get(sid);
+    snprintf(buff, sizeof(buff), "T%d",
+             SlotToFrontendTid(seg->tid(), seg->vts()));
     return buff;
   }
 
   static string ToStringWithLocks(SID sid) {
     char buff[100];
     Segment *seg = Get(sid);
-    snprintf(buff, sizeof(buff), "T%d/S%d ", seg->tid().raw(), sid.raw());
+    snprintf(buff, sizeof(buff), "T%d/S%d ",
+             SlotToFrontendTid(seg->tid(), seg->vts()), sid.raw());
     string res = buff;
     res += TwoLockSetsToString(seg->lsid(false), seg->lsid(true));
     return res;
@@ -1938,19 +3293,22 @@ class Segment {
 
   static bool INLINE HappensBeforeOrSameThread(SID a, SID b) {
     if (a == b) return true;
-    if (Get(a)->tid() == Get(b)->tid()) return true;
+    if (Tid(a) == Tid(b)) return true;
     return HappensBefore(a, b);
   }
 
   static bool INLINE HappensBefore(SID a, SID b) {
     DCHECK(a != b);
-    G_stats->n_seg_hb++;
+    G_stats->Shard()->n_seg_hb++;
     bool res = false;
-    const Segment *seg_a = Get(a);
-    const Segment *seg_b = Get(b);
-    DCHECK(seg_a->tid() != seg_b->tid());
-    const VTS *vts_a = seg_a->vts();
-    const VTS *vts_b = seg_b->vts();
+    DCHECK(Tid(a) != Tid(b));
+    const VTS *vts_a = Vts(a);
+    const VTS *vts_b = Vts(b);
+    if (G_flags->epoch_hb) {
+      res = VTS::EpochHappensBefore(Tid(a), vts_a, vts_b);
+      DCHECK(res == VTS::HappensBefore(vts_a, vts_b));
+      return res;
+    }
     res = VTS::HappensBeforeCached(vts_a, vts_b);
 #if 0
     if (TSAN_DEBUG) {
@@ -1962,6 +3320,10 @@ class Segment {
   }
 
   static int32_t NumberOfSegments() { return n_segments_; }
+  // Segments which are not waiting to be reused.
+  static int32_t NumberOfLiveSegments() {
+    return n_segments_ - reusable_sids_->size();
+  }
 
   static void ShowSegmentStats() {
     Printf("Segment::ShowSegmentStats:\n");
@@ -1980,37 +3342,61 @@ class Segment {
     }
   }
 
+  // Bytes taken by one SID: the Segment and its hot part.
+  static const size_t kSizeOfSegment;
+
   static void InitClassMembers() {
     if (G_flags->keep_history == 0)
       kSizeOfHistoryStackTrace = 0;
     if (G_flags->verbosity >= 0) {
       Report("INFO: Allocating %ldMb (%ld * %ldM) for Segments.\n",
-          (sizeof(Segment) * kMaxSID) >> 20,
-          sizeof(Segment), kMaxSID >> 20);
-      if (kSizeOfHistoryStackTrace) {
-        Report("INFO: Will allocate up to %ldMb for 'previous' stack traces.\n",
-            (kSizeOfHistoryStackTrace * sizeof(uintptr_t) * kMaxSID) >> 20);
-      }
+          (kSizeOfSegment * kMaxSID) >> 20,
+          kSizeOfSegment, kMaxSID >> 20);
     }
 
-    all_segments_  = new Segment[kMaxSID];
-    // initialization all segments to 0.
-    memset(all_segments_, 0, kMaxSID * sizeof(Segment));
+    if (G_flags->numa || G_flags->huge_pages) {
+      // Zeroed already, and not touched here: with --numa every segment is
+      // used by all the threads, so the pages are spread over the nodes.
+      all_segments_ =
+          (Segment*)AllocateTable(kMaxSID * sizeof(Segment));
+      all_hot_ = (Hot*)AllocateTable(kMaxSID * sizeof(Hot));
+    } else {
+      all_segments_  = new Segment[kMaxSID];
+      all_hot_ = new Hot[kMaxSID];
+      // initialization all segments to 0.
+      memset(all_segments_, 0, kMaxSID * sizeof(Segment));
+      memset(all_hot_, 0, kMaxSID * sizeof(Hot));
+    }
     // initialize all_segments_[0] with garbage
     memset(all_segments_, -1, sizeof(Segment));
+    memset(all_hot_, -1, sizeof(Hot));
 
-    if (kSizeOfHistoryStackTrace > 0) {
-      n_stack_chunks_ = kMaxSID / kChunkSizeForStacks;
-      if (n_stack_chunks_ * kChunkSizeForStacks < (size_t)kMaxSID)
-        n_stack_chunks_++;
-      all_stacks_ = new uintptr_t*[n_stack_chunks_];
-      memset(all_stacks_, 0, sizeof(uintptr_t*) * n_stack_chunks_);
-    }
     n_segments_    = 1;
     reusable_sids_ = new vector<SID>;
+    if (G_flags->reuse_dead_tids) {
+      n_segments_of_tid_ = new int32_t[G_flags->max_n_threads];
+      memset(n_segments_of_tid_, 0,
+             G_flags->max_n_threads * sizeof(*n_segments_of_tid_));
+    }
   }
 
  private:
+  // The fields read on every happens-before check. They live in a separate
+  // dense array indexed by SID, so a check does not pull in the rest of
+  // the Segment (refcount, locksets, history) and four of them share
+  // a cache line.
+  struct Hot {
+    VTS *vts;
+    TID  tid;
+  };
+
+  INLINE Hot *hot() const { return &all_hot_[this - all_segments_]; }
+  static INLINE Hot *GetHot(SID sid) {
+    DCHECK(sid.valid());
+    DCHECK(sid.raw() < INTERNAL_ANNOTATE_UNPROTECTED_READ(n_segments_));
+    return &all_hot_[sid.raw()];
+  }
+
   static INLINE Segment *GetSegmentByIndex(int32_t index) {
     return &all_segments_[index];
   }
@@ -2024,34 +3410,30 @@ class Segment {
   // Data members.
   int32_t seg_ref_count_;
   LSID     lsid_[2];
-  TID      tid_;
   uint32_t lock_era_;
-  VTS *vts_;
+  uint32_t stack_id_;  // In G_stack_depot or a HistoryRing, 0 if not filled.
 
   // static class members.
 
   // One large array of segments. The size is set by a command line (--max-sid)
   // and never changes. Once we are out of vacant segments, we flush the state.
   static Segment *all_segments_;
-  // We store stack traces separately because their size is unknown
-  // at compile time and because they are needed less often.
-  // The stacks are stored as an array of chunks, instead of one array, 
-  // so that for small tests we do not require too much RAM.
-  // We don't use vector<> or another resizable array to avoid expensive 
-  // resizing.
-  enum { kChunkSizeForStacks = TSAN_DEBUG ? 512 : 1 * 1024 * 1024 };
-  static uintptr_t **all_stacks_;
-  static size_t      n_stack_chunks_;
+  // all_hot_[i] is the hot part of all_segments_[i].
+  static Hot *all_hot_;
 
   static int32_t n_segments_;
   static vector<SID> *reusable_sids_;
+  // --reuse_dead_tids: the live segments of each thread, indexed by TID.
+  static int32_t *n_segments_of_tid_;
 };
 
 Segment          *Segment::all_segments_;
-uintptr_t       **Segment::all_stacks_;
-size_t            Segment::n_stack_chunks_;
+Segment::Hot     *Segment::all_hot_;
+const size_t      Segment::kSizeOfSegment =
+    sizeof(Segment) + sizeof(Segment::Hot);
 int32_t           Segment::n_segments_;
 vector<SID>      *Segment::reusable_sids_;
+int32_t          *Segment::n_segments_of_tid_;
 
 // -------- SegmentSet -------------- {{{1
 class SegmentSet {
@@ -2063,7 +3445,8 @@ class SegmentSet {
   static INLINE SSID RemoveSegmentFromTupleSS(SSID old_ssid, SID sid_to_remove);
 
   SSID ComputeSSID() {
-    SSID res = map_->GetIdOrZero(this);
+    int shard = MapShard(this);
+    SSID res = map_[shard].GetIdOrZero(this);
     CHECK_NE(res.raw(), 0);
     return res;
   }
@@ -2124,9 +3507,11 @@ class SegmentSet {
     }
     ref_count_ = -1;
 
-    map_->Erase(this);
+    // With sharded locking we get here only while sharded sections
+    // are blocked, so there is no need to take the shard locks.
+    map_[MapShard(this)].Erase(this);
     ready_to_be_reused_->push_back(ssid);
-    G_stats->ss_recycle++;
+    G_stats->Shard()->ss_recycle++;
   }
 
   static void INLINE Ref(SSID ssid, const char *where) {
@@ -2138,7 +3523,11 @@ class SegmentSet {
       SegmentSet *sset = Get(ssid);
       // Printf("SSRef   : %d ref=%d %s\n", ssid.raw(), sset->ref_count_, where);
       DCHECK(sset->ref_count_ >= 0);
-      sset->ref_count_++;
+      if (ShardedLocking()) {
+        AtomicIncrementRefcount(&sset->ref_count_);
+      } else {
+        sset->ref_count_++;
+      }
     }
   }
 
@@ -2146,13 +3535,22 @@ class SegmentSet {
     AssertTILHeld(); // The reference counting logic below is not thread-safe
     DCHECK(ssid.valid());
     if (ssid.IsSingleton()) {
-      Segment::Unref(ssid.GetSingleton(), where);
+      SID sid = ssid.GetSingleton();
+      if (!ShardedLocking()) {
+        Segment::Unref(sid, where);
+      } else if (Segment::UnrefNoRecycle(sid, where) == 0) {
+        // Recycling a SID requires ts_lock, see FlushDeferredRecycling().
+        ShardTIL til(vec_lock_);
+        dead_sids_->push_back(sid);
+      }
     } else {
       SegmentSet *sset = Get(ssid);
       // Printf("SSUnref : %d ref=%d %s\n", ssid.raw(), sset->ref_count_, where);
       DCHECK(sset->ref_count_ > 0);
-      sset->ref_count_--;
-      if (sset->ref_count_ == 0) {
+      int32_t new_ref_count = ShardedLocking()
+          ? AtomicDecrementRefcount(&sset->ref_count_)
+          : --sset->ref_count_;
+      if (new_ref_count == 0) {
         // We don't delete unused SSID straightaway due to performance reasons
         // (to avoid flushing caches too often and because SSID may be reused
         // again soon)
@@ -2171,15 +3569,46 @@ class SegmentSet {
         //       it into ready_to_be_reused_
         // 3) When a new SegmentSet is about to be created, we re-use SSID from
         //    ready_to_be_reused_ (if available)
+        //
+        // With sharded locking FlushRecycleQueue() is deferred until
+        // FlushDeferredRecycling() is called under ts_lock.
+        ShardTIL til(vec_lock_);
         ready_to_be_recycled_->push_back(ssid);
         if (UNLIKELY(ready_to_be_recycled_->size() >
                      2 * G_flags->segment_set_recycle_queue_size)) {
-          FlushRecycleQueue();
+          if (ShardedLocking()) {
+            recycle_queue_is_full_ = true;
+          } else {
+            FlushRecycleQueue();
+          }
         }
       }
     }
   }
 
+  // With sharded locking SegmentSet::Unref() may run w/o ts_lock and
+  // hence it does not recycle anything by itself. This does the delayed
+  // work; must be called under ts_lock while holding no cache lines.
+  static void FlushDeferredRecycling() {
+    if (!ShardedLocking()) return;
+    vector<SID> dead_sids;
+    bool flush_recycle_queue = false;
+    {
+      ShardTIL til(vec_lock_);
+      dead_sids.swap(*dead_sids_);
+      flush_recycle_queue = recycle_queue_is_full_;
+      recycle_queue_is_full_ = false;
+    }
+    for (size_t i = 0; i < dead_sids.size(); i++) {
+      Segment::RecycleOneSid(dead_sids[i]);
+    }
+    if (flush_recycle_queue) {
+      BlockShardedSections();
+      FlushRecycleQueue();
+      UnblockShardedSections();
+    }
+  }
+
   static void FlushRecycleQueue() {
     while (ready_to_be_recycled_->size() >
         G_flags->segment_set_recycle_queue_size) {
@@ -2224,14 +3653,23 @@ class SegmentSet {
     remove_segment_cache_->Flush();
   }
 
+  static void FlushCachesLocked() {
+    ShardTIL til(cache_lock_);
+    FlushCaches();
+  }
+
   static void ForgetAllState() {
     for (size_t i = 0; i < vec_->size(); i++) {
       delete (*vec_)[i];
     }
-    map_->Clear();
+    for (int i = 0; i < ShardedLock::kNumShards; i++) {
+      map_[i].Clear();
+    }
     vec_->clear();
     ready_to_be_reused_->clear();
     ready_to_be_recycled_->clear();
+    dead_sids_->clear();
+    recycle_queue_is_full_ = false;
     FlushCaches();
   }
 
@@ -2244,6 +3682,11 @@ class SegmentSet {
     return Get(ssid)->size();
   }
 
+  const int32_t *raw_sids() const {
+    DCHECK(sizeof(SID) == sizeof(int32_t));
+    return (const int32_t*)sids_;
+  }
+
   SID GetSID(int32_t i) const {
     DCHECK(i >= 0 && i < kMaxSegmentSetSize);
     DCHECK(i == 0 || sids_[i-1].raw() != 0);
@@ -2270,6 +3713,18 @@ class SegmentSet {
     }
   }
 
+  // Start loading the hot parts of the segments of a tuple SSID before
+  // a loop that checks happens-before against each of them.
+  static INLINE void PrefetchSegments(SSID ssid) {
+    if (!ssid.IsTuple()) return;
+    SegmentSet *ss = Get(ssid);
+    for (int i = 0; i < kMaxSegmentSetSize; i++) {
+      SID sid = ss->GetSID(i);
+      if (sid.raw() == 0) break;
+      Segment::Prefetch(sid);
+    }
+  }
+
   static bool INLINE Contains(SSID ssid, SID seg) {
     if (LIKELY(ssid.IsSingleton())) {
       return ssid.GetSingleton() == seg;
@@ -2297,12 +3752,21 @@ class SegmentSet {
 
 
   static void InitClassMembers() {
-    map_    = new Map;
+    map_    = new Map[ShardedLock::kNumShards];
     vec_    = new vector<SegmentSet *>;
     ready_to_be_recycled_ = new deque<SSID>;
     ready_to_be_reused_ = new deque<SSID>;
+    dead_sids_ = new vector<SID>;
     add_segment_cache_ = new SsidSidToSidCache;
     remove_segment_cache_ = new SsidSidToSidCache;
+    if (ShardedLocking()) {
+      map_locks_.Init();
+      vec_lock_ = new TSLock;
+      cache_lock_ = new TSLock;
+      // Get() reads vec_ w/o a lock, so vec_ must never be reallocated.
+      // FlushStateIfOutOfSegments() keeps the number of sets below this.
+      vec_->reserve(kMaxSID);
+    }
   }
 
  private:
@@ -2325,12 +3789,14 @@ class SegmentSet {
     return kMaxSegmentSetSize;
   }
 
-  static INLINE SSID AllocateAndCopy(SegmentSet *ss) {
+  // Must be called with the lock of the map shard held.
+  static INLINE SSID AllocateAndCopy(SegmentSet *ss, int shard) {
     DCHECK(ss->ref_count_ == 0);
     DCHECK(sizeof(int32_t) == sizeof(SID));
     SSID res_ssid;
     SegmentSet *res_ss = 0;
 
+    ShardTIL til(vec_lock_);
     if (!ready_to_be_reused_->empty()) {
       res_ssid = ready_to_be_reused_->front();
       ready_to_be_reused_->pop_front();
@@ -2338,15 +3804,16 @@ class SegmentSet {
       res_ss = (*vec_)[idx];
       DCHECK(res_ss);
       DCHECK(res_ss->ref_count_ == -1);
-      G_stats->ss_reuse++;
+      G_stats->Shard()->ss_reuse++;
       for (int i = 0; i < kMaxSegmentSetSize; i++) {
         res_ss->sids_[i] = SID(0);
       }
     } else {
       // create a new one
       ScopedMallocCostCenter cc("SegmentSet::CreateNewSegmentSet");
-      G_stats->ss_create++;
+      G_stats->Shard()->ss_create++;
       res_ss = new SegmentSet;
+      CHECK(!ShardedLocking() || vec_->size() < vec_->capacity());
       vec_->push_back(res_ss);
       res_ssid = SSID(-((int32_t)vec_->size()));
       CHECK(res_ssid.valid());
@@ -2360,28 +3827,39 @@ class SegmentSet {
       res_ss->SetSID(i, sid);
     }
     DCHECK(res_ss == Get(res_ssid));
-    map_->Insert(res_ss, res_ssid);
+    map_[shard].Insert(res_ss, res_ssid);
     return res_ssid;
   }
 
   static NOINLINE SSID FindExistingOrAlocateAndCopy(SegmentSet *ss) {
     if (TSAN_DEBUG) {
       int size = ss->size();
-      if (size == 2) G_stats->ss_size_2++;
-      if (size == 3) G_stats->ss_size_3++;
-      if (size == 4) G_stats->ss_size_4++;
-      if (size > 4) G_stats->ss_size_other++;
+      if (size == 2) G_stats->Shard()->ss_size_2++;
+      if (size == 3) G_stats->Shard()->ss_size_3++;
+      if (size == 4) G_stats->Shard()->ss_size_4++;
+      if (size > 4) G_stats->Shard()->ss_size_other++;
     }
 
     // First, check if there is such set already.
-    SSID ssid = map_->GetIdOrZero(ss);
+    // The lookup w/o the shard lock can miss a set being inserted
+    // concurrently, so we repeat it under the lock.
+    int shard = MapShard(ss);
+    SSID ssid = map_[shard].GetIdOrZero(ss);
     if (ssid.raw() != 0) {  // Found.
       AssertLive(ssid, __LINE__);
-      G_stats->ss_find++;
+      G_stats->Shard()->ss_find++;
+      return ssid;
+    }
+    ShardTIL til(map_locks_.lock(shard));
+    ssid = map_[shard].GetIdOrZero(ss);
+    if (ssid.raw() != 0) {
+      AssertLive(ssid, __LINE__);
+      G_stats->Shard()->ss_find++;
+      G_stats->Shard()->ss_find_locked++;
       return ssid;
     }
     // If no such set, create one.
-    return AllocateAndCopy(ss);
+    return AllocateAndCopy(ss, shard);
   }
 
   static INLINE SSID DoubletonSSID(SID sid1, SID sid2) {
@@ -2405,32 +3883,6 @@ class SegmentSet {
   }
 
   // static data members
-  struct Less {
-    INLINE bool operator() (const SegmentSet *ss1,
-                            const SegmentSet *ss2) const {
-      for (int i = 0; i < kMaxSegmentSetSize; i++) {
-        SID sid1 = ss1->sids_[i],
-            sid2 = ss2->sids_[i];
-        if (sid1 != sid2) return sid1 < sid2;
-      }
-      return false;
-    }
-  };
-
-  struct SSEq {
-    INLINE bool operator() (const SegmentSet *ss1,
-                            const SegmentSet *ss2) const {
-      G_stats->sseq_calls++;
-
-      for (int i = 0; i < kMaxSegmentSetSize; i++) {
-        SID sid1 = ss1->sids_[i],
-            sid2 = ss2->sids_[i];
-        if (sid1 != sid2) return false;
-      }
-      return true;
-    }
-  };
-
   struct SSHash {
     INLINE size_t operator() (const SegmentSet *ss) const {
       uintptr_t res = 0;
@@ -2438,7 +3890,7 @@ class SegmentSet {
       // We must have even number of SIDs.
       DCHECK((kMaxSegmentSetSize % 2) == 0);
 
-      G_stats->sshash_calls++;
+      G_stats->Shard()->sshash_calls++;
       // xor all SIDs together, half of them bswap-ed.
       for (int i = 0; i < kMaxSegmentSetSize; i += 2) {
         uintptr_t t1 = sids_array[i];
@@ -2450,72 +3902,56 @@ class SegmentSet {
     }
   };
 
-  struct SSTraits {
-    enum {
-      // These values are taken from the hash_compare defaults.
-      bucket_size = 4,  // Must be greater than zero.
-      min_buckets = 8,  // Must be power of 2.
-    };
+  // Interns the sids_ tuples. GetIdOrZero() takes no locks, see TupleTable.
+  class Map {
+   public:
+    SSID GetIdOrZero(const SegmentSet *ss) const {
+      return SSID(table_.Find(ss->raw_sids()));
+    }
 
-    INLINE size_t operator()(const SegmentSet *ss) const {
-      SSHash sshash;
-      return sshash(ss);
+    void Insert(const SegmentSet *ss, SSID id) {
+      table_.Insert(ss->raw_sids(), id.raw());
     }
 
-    INLINE bool operator()(const SegmentSet *ss1, const SegmentSet *ss2) const {
-      Less less;
-      return less(ss1, ss2);
+    void Erase(const SegmentSet *ss) {
+      CHECK(table_.Erase(ss->raw_sids()));
     }
-  };
 
-  template <class MapType>
-  static SSID GetIdOrZeroFromMap(MapType *map, SegmentSet *ss) {
-    typename MapType::iterator it = map->find(ss);
-    if (it == map->end())
-      return SSID(0);
-    return it->second;
-  }
-
-  class Map {
-   public:
-    SSID GetIdOrZero(SegmentSet *ss) {
-      return GetIdOrZeroFromMap(&map_, ss);
-    }
-
-    void Insert(SegmentSet *ss, SSID id) {
-      map_[ss] = id;
-    }
-
-    void Erase(SegmentSet *ss) {
-      CHECK(map_.erase(ss));
-    }
-
-    void Clear() {
-      map_.clear();
-    }
+    void Clear() {
+      table_.Clear();
+    }
 
    private:
-    // TODO(timurrrr): consider making a custom hash_table.
-#if defined(_MSC_VER)
-    typedef stdext::hash_map<SegmentSet*, SSID, SSTraits > MapType__;
-#elif 1
-    typedef unordered_map<SegmentSet*, SSID, SSHash, SSEq > MapType__;
-#else
-    // Old code, may be useful for debugging.
-    typedef map<SegmentSet*, SSID, Less > MapType__;
-#endif
-    MapType__ map_;
+    TupleTable<kMaxSegmentSetSize> table_;
   };
 
-//  typedef map<SegmentSet*, SSID, Less> Map;
 
-  static Map                  *map_;
+  // Index of the map_ shard which holds 'ss'.
+  // W/o sharded locking everything lives in map_[0].
+  static INLINE int MapShard(const SegmentSet *ss) {
+    if (!ShardedLocking()) return 0;
+    SSHash sshash;
+    return ShardedLock::ShardIndex(sshash(ss));
+  }
+
+  // With sharded locking:
+  //  - map_[i] is protected by map_locks_.lock(i);
+  //  - vec_, ready_to_be_*_, dead_sids_ and recycle_queue_is_full_ are
+  //    protected by vec_lock_;
+  //  - add_segment_cache_ and remove_segment_cache_ by cache_lock_.
+  // Lock order: map shard lock, then vec_lock_.
+  static Map                  *map_;  // ShardedLock::kNumShards elements.
   // TODO(kcc): use vector<SegmentSet> instead.
   static vector<SegmentSet *> *vec_;
   static deque<SSID>         *ready_to_be_reused_;
   static deque<SSID>         *ready_to_be_recycled_;
+  static vector<SID>         *dead_sids_;
+  static bool                 recycle_queue_is_full_;
+  static ShardedLock          map_locks_;
+  static TSLock              *vec_lock_;
+  static TSLock              *cache_lock_;
 
-  typedef PairCache<SSID, SID, SSID, 1009, 1> SsidSidToSidCache;
+  typedef PairCache<SSID, SID, SSID, 8> SsidSidToSidCache;  // 1K.
   static SsidSidToSidCache    *add_segment_cache_;
   static SsidSidToSidCache    *remove_segment_cache_;
 
@@ -2529,9 +3965,18 @@ SegmentSet::Map      *SegmentSet::map_;
 vector<SegmentSet *> *SegmentSet::vec_;
 deque<SSID>         *SegmentSet::ready_to_be_reused_;
 deque<SSID>         *SegmentSet::ready_to_be_recycled_;
+vector<SID>         *SegmentSet::dead_sids_;
+bool                 SegmentSet::recycle_queue_is_full_;
+ShardedLock          SegmentSet::map_locks_;
+TSLock              *SegmentSet::vec_lock_;
+TSLock              *SegmentSet::cache_lock_;
 SegmentSet::SsidSidToSidCache    *SegmentSet::add_segment_cache_;
 SegmentSet::SsidSidToSidCache    *SegmentSet::remove_segment_cache_;
 
+static void FlushSegmentSetCaches() {
+  SegmentSet::FlushCachesLocked();
+}
+
 
 
 
@@ -2539,9 +3984,14 @@ SSID SegmentSet::RemoveSegmentFromSS(SSID old_ssid, SID sid_to_remove) {
   DCHECK(old_ssid.IsValidOrEmpty());
   DCHECK(sid_to_remove.valid());
   SSID res;
-  if (remove_segment_cache_->Lookup(old_ssid, sid_to_remove, &res)) {
-    return res;
+  {
+    ShardTIL til(cache_lock_);
+    if (remove_segment_cache_->Lookup(old_ssid, sid_to_remove, &res)) {
+      G_stats->Shard()->ss_rem_cache_hit++;
+      return res;
+    }
   }
+  G_stats->Shard()->ss_rem_cache_miss++;
 
   if (old_ssid.IsEmpty()) {
     res = old_ssid;  // Nothing to remove.
@@ -2554,6 +4004,7 @@ SSID SegmentSet::RemoveSegmentFromSS(SSID old_ssid, SID sid_to_remove) {
   } else {
     res = RemoveSegmentFromTupleSS(old_ssid, sid_to_remove);
   }
+  ShardTIL til(cache_lock_);
   remove_segment_cache_->Insert(old_ssid, sid_to_remove, res);
   return res;
 }
@@ -2586,8 +4037,8 @@ SSID SegmentSet::AddSegmentToSS(SSID old_ssid, SID new_sid) {
       return old_ssid;
     }
 
-    old_tid = Segment::Get(old_sid)->tid();
-    new_tid = Segment::Get(new_sid)->tid();
+    old_tid = Segment::Tid(old_sid);
+    new_tid = Segment::Tid(new_sid);
     if (LIKELY(old_tid == new_tid)) {
       // The new segment is in the same thread - just replace the SID.
       return SSID(new_sid);
@@ -2606,10 +4057,15 @@ SSID SegmentSet::AddSegmentToSS(SSID old_ssid, SID new_sid) {
   }
 
   // Lookup the cache.
-  if (add_segment_cache_->Lookup(old_ssid, new_sid, &res)) {
-    SegmentSet::AssertLive(res, __LINE__);
-    return res;
+  {
+    ShardTIL til(cache_lock_);
+    if (add_segment_cache_->Lookup(old_ssid, new_sid, &res)) {
+      G_stats->Shard()->ss_add_cache_hit++;
+      SegmentSet::AssertLive(res, __LINE__);
+      return res;
+    }
   }
+  G_stats->Shard()->ss_add_cache_miss++;
 
   if (LIKELY(old_ssid.IsSingleton())) {
     // Signleton->Doubleton transition.
@@ -2632,6 +4088,7 @@ SSID SegmentSet::AddSegmentToSS(SSID old_ssid, SID new_sid) {
   }
 
   // Put the result into cache.
+  ShardTIL til(cache_lock_);
   add_segment_cache_->Insert(old_ssid, new_sid, res);
 
   return res;
@@ -2642,6 +4099,7 @@ SSID SegmentSet::RemoveSegmentFromTupleSS(SSID ssid, SID sid_to_remove) {
   DCHECK(ssid.valid());
   AssertLive(ssid, __LINE__);
   SegmentSet *ss = Get(ssid);
+  PrefetchSegments(ssid);
 
   int32_t old_size = 0, new_size = 0;
   SegmentSet tmp;
@@ -2675,10 +4133,10 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
   DCHECK(ssid.valid());
   AssertLive(ssid, __LINE__);
   SegmentSet *ss = Get(ssid);
+  PrefetchSegments(ssid);
 
   Segment::AssertLive(new_sid, __LINE__);
-  const Segment *new_seg = Segment::Get(new_sid);
-  TID            new_tid = new_seg->tid();
+  TID new_tid = Segment::Tid(new_sid);
 
   int32_t old_size = 0, new_size = 0;
   SID tmp_sids[kMaxSegmentSetSize + 1];
@@ -2690,8 +4148,7 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
     if (sid.raw() == 0) break;
     DCHECK(sid.valid());
     Segment::AssertLive(sid, __LINE__);
-    const Segment *seg = Segment::Get(sid);
-    TID            tid = seg->tid();
+    TID tid = Segment::Tid(sid);
 
     if (sid == new_sid) {
       // we are trying to insert a sid which is already there.
@@ -2700,6 +4157,8 @@ SSID SegmentSet::AddSegmentToTupleSS(SSID ssid, SID new_sid) {
     }
 
     if (tid == new_tid) {
+      const Segment *seg = Segment::Get(sid);
+      const Segment *new_seg = Segment::Get(new_sid);
       if (seg->vts() == new_seg->vts() &&
           seg->lsid(true) == new_seg->lsid(true) &&
           seg->lsid(false) == new_seg->lsid(false)) {
@@ -2993,6 +4452,145 @@ INLINE bool GranularityIs1(uintptr_t off, uint16_t gr) {
   return ((gr >> (7 + off_within_8_bytes)) & 1);
 }
 
+// All the bits of one granularity.
+static const uint16_t kGranularity8Bits = 1;         // 0000000000000001
+static const uint16_t kGranularity4Bits = 3 << 1;    // 0000000000000110
+static const uint16_t kGranularity2Bits = 15 << 3;   // 0000000001111000
+static const uint16_t kGranularity1Bits = 255 << 7;  // 0111111110000000
+
+// For each offset within 8 bytes, the 8-, 4-, 2- and 1-byte granularity
+// bits which may cover it. A non-zero granularity mask has exactly one of
+// them set.
+static const uint16_t kGranularityBitsOfOffset[8] = {
+  0x008b, 0x010b, 0x0213, 0x0413, 0x0825, 0x1025, 0x2045, 0x4045
+};
+// The access size of each granularity bit.
+static const uint8_t kGranularityBitSize[15] = {
+  8, 4, 4, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+// The size of the shadow value which covers 'off', for a non-zero 'gr'.
+// Same as trying GranularityIs8/4/2/1 in turn, w/o the branches.
+INLINE size_t GranularitySize(uintptr_t off, uint16_t gr) {
+  uint16_t bits = gr & kGranularityBitsOfOffset[off & 7];
+  DCHECK(bits && (bits & (bits - 1)) == 0);
+  return kGranularityBitSize[Mask(bits).GetSomeSetBit()];
+}
+
+// -------- Fork ------------------ {{{1
+// After fork() the child shares the detector memory with the parent
+// copy-on-write. Most of it is the shadow, i.e. the cache lines, which the
+// child mostly reads or drops (e.g. on a flush) and writes only for the
+// memory it touches itself. So the child never deletes an inherited line:
+// CacheLine::Delete() of a line created before the last fork just forgets
+// it, leaving the memory shared with the parent instead of dirtying it by
+// putting it onto the free list. The lines are told apart by the fork epoch
+// they were created at; ThreadSanitizerAtForkChild() starts a new one.
+static uint8_t g_fork_epoch;  // Under ts_lock.
+
+// -------- PendingShadowResets ------------------ {{{1
+// With --lazy_shadow_reset=N ClearMemoryState() does not look up every line
+// of a range of N or more bytes (a free() of a huge buffer, an munmap()).
+// It clears the lines held by the cache right away and records the range
+// here with a new generation. Every CacheLine remembers the generation it
+// was created or last reset at; a line older than the range covering it is
+// stale. Stale lines are reset when the Cache fetches them from storage,
+// and SweepPendingShadowResets() resets the rest a slice at a time so that
+// the segments they refer to get recycled.
+static uint32_t g_shadow_reset_gen;  // The newest generation. Under ts_lock.
+
+class PendingShadowResets {
+ public:
+  PendingShadowResets() : n_ranges_(0), lock_(NULL) {
+    if (ShardedLocking())
+      lock_ = new TSLock;
+  }
+
+  // Lock-free, but the answer may be stale unless we hold ts_lock.
+  bool empty() { return *(volatile uintptr_t*)&n_ranges_ == 0; }
+
+  // Records [a, b) with generation 'gen' which must be the newest one.
+  // Called under ts_lock.
+  void Add(uintptr_t a, uintptr_t b, uint32_t gen) {
+    ShardTIL til(lock_);
+    RemoveLocked(a, b);
+    Range &range = map_[a];
+    range.end = b;
+    range.gen = gen;
+    n_ranges_ = map_.size();
+  }
+
+  // Forgets [a, b). Called under ts_lock.
+  void Remove(uintptr_t a, uintptr_t b) {
+    ShardTIL til(lock_);
+    RemoveLocked(a, b);
+    n_ranges_ = map_.size();
+  }
+
+  // Returns the generation of the range containing 'a' or 0 if none.
+  uint32_t GenerationAt(uintptr_t a) {
+    ShardTIL til(lock_);
+    Map::iterator it = map_.upper_bound(a);
+    if (it == map_.begin()) return 0;
+    --it;
+    return a < it->second.end ? it->second.gen : 0;
+  }
+
+  // Returns the lowest range. Called under ts_lock.
+  bool GetFirst(uintptr_t *a, uintptr_t *b, uint32_t *gen) {
+    ShardTIL til(lock_);
+    if (map_.empty()) return false;
+    *a = map_.begin()->first;
+    *b = map_.begin()->second.end;
+    *gen = map_.begin()->second.gen;
+    return true;
+  }
+
+  void Clear() {
+    ShardTIL til(lock_);
+    map_.clear();
+    n_ranges_ = 0;
+  }
+
+ private:
+  struct Range {
+    uintptr_t end;
+    uint32_t gen;
+  };
+  typedef map<uintptr_t, Range> Map;
+
+  // Cuts [a, b) out of the ranges. The ranges never overlap.
+  void RemoveLocked(uintptr_t a, uintptr_t b) {
+    Map::iterator it = map_.upper_bound(a);
+    if (it != map_.begin()) {
+      Map::iterator prev = it;
+      --prev;
+      if (prev->second.end > a) {
+        Range tail = prev->second;
+        prev->second.end = a;
+        if (tail.end > b) {
+          map_[b] = tail;
+        }
+        if (prev->first == a) map_.erase(prev);
+      }
+    }
+    while (it != map_.end() && it->first < b) {
+      Range range = it->second;
+      map_.erase(it++);
+      if (range.end > b) {
+        map_[b] = range;
+        break;
+      }
+    }
+  }
+
+  Map map_;
+  uintptr_t n_ranges_;
+  TSLock *lock_;  // Used only with sharded locking.
+};
+
+static PendingShadowResets *g_pending_shadow_resets;
+
 class CacheLine {
  public:
   static const uintptr_t kLineSizeBits = Mask::kNBitsLog;  // Don't change this.
@@ -3002,14 +4600,142 @@ class CacheLine {
     ScopedMallocCostCenter cc("CreateNewCacheLine");
     void *mem = free_list_->Allocate();
     DCHECK(mem);
+    MarkRegionUsed(tag);
     return new (mem) CacheLine(tag);
   }
 
+  // A filter of the kRegionSize-aligned memory regions where lines have
+  // ever been created (with false positives, w/o false negatives).
+  // ClearMemoryState() skips the regions where no line may exist, so
+  // clearing a huge mostly untouched range (e.g. an 8M thread stack on
+  // every thread start and end) does not look up every line in it.
+  static const uintptr_t kRegionSizeBits = 16;
+  static const uintptr_t kRegionSize = 1 << kRegionSizeBits;
+
+  static INLINE bool RegionMayBeUsed(uintptr_t a) {
+    uintptr_t bit = RegionBit(a);
+    uintptr_t word = *(volatile uintptr_t*)&used_regions_[bit / kBitsPerWord];
+    return (word >> (bit % kBitsPerWord)) & 1;
+  }
+
+  static uintptr_t ComputeNextRegion(uintptr_t a) {
+    return (a & ~(kRegionSize - 1)) + kRegionSize;
+  }
+
   static void Delete(CacheLine *line) {
-    free_list_->Deallocate(line);
+    if (line->compressed_)
+      NoBarrier_AtomicDecrement(&n_compressed_[line->compressed_ > 1]);
+    if (line->inherited()) {
+      G_stats->Shard()->cache_abandon_inherited++;
+      return;
+    }
+    if (line->compressed_ == 1)
+      compressed_free_list_->Deallocate(line);
+    else if (line->compressed_)
+      packed_free_list_->Deallocate(line);
+    else
+      free_list_->Deallocate(line);
+  }
+
+  // --compress_cache_lines: a line with a few different present shadow
+  // values may be stored compressed, i.e. as a CacheLine object truncated
+  // after the values (everything before vals_ is kept as is).
+  // If all of them are equal, vals_[0] is the value. With up to
+  // kMaxPackedValues different ones, they are in vals_[0..n) and the 2-bit
+  // index of the value of every offset is in the place of the next two.
+  // Compressed lines live only in Cache::storage_ and are expanded
+  // when fetched from there.
+  // The compressed line holds all the references of the original one.
+  static const int kMaxPackedValues = 4;
+
+  bool compressed() const { return compressed_ != 0; }
+
+  // Returns the compressed copy of 'line' and deletes 'line',
+  // or returns NULL if the line can not be compressed.
+  static CacheLine *Compress(CacheLine *line) {
+    DCHECK(!line->compressed_);
+    ShadowValue vals[kMaxPackedValues];
+    uint64_t index[2] = {0, 0};
+    int n = 0;
+    for (uintptr_t i = 0; i < kLineSize; i++) {
+      if (!line->has_shadow_value_.Get(i)) continue;
+      int v = 0;
+      while (v < n && vals[v] != line->vals_[i]) v++;
+      if (v == n) {
+        if (n == kMaxPackedValues) return NULL;
+        vals[n++] = line->vals_[i];
+      }
+      index[i / 32] |= (uint64_t)v << (2 * (i % 32));
+    }
+    if (n == 0) return NULL;
+    void *mem = n == 1 ? compressed_free_list_->Allocate()
+                       : packed_free_list_->Allocate();
+    CacheLine *res = (CacheLine*)mem;
+    memcpy(mem, line, offsetof(CacheLine, vals_));
+    for (int v = 0; v < n; v++)
+      res->vals_[v] = vals[v];
+    if (n > 1)
+      memcpy(&res->vals_[kMaxPackedValues], index, sizeof(index));
+    res->compressed_ = n;
+    res->fork_epoch_ = g_fork_epoch;
+    NoBarrier_AtomicIncrement(&n_compressed_[n > 1]);
+    Delete(line);
+    return res;
+  }
+
+  // Returns the expanded copy of 'line' and deletes 'line'.
+  static CacheLine *Decompress(CacheLine *line) {
+    DCHECK(line->compressed_);
+    void *mem = free_list_->Allocate();
+    CacheLine *res = (CacheLine*)mem;
+    memcpy(mem, line, offsetof(CacheLine, vals_));
+    res->compressed_ = 0;
+    res->fork_epoch_ = g_fork_epoch;
+    uint64_t index[2] = {0, 0};
+    if (line->compressed_ > 1)
+      memcpy(index, &line->vals_[kMaxPackedValues], sizeof(index));
+    for (uintptr_t i = 0; i < kLineSize; i++) {
+      if (res->has_shadow_value_.Get(i))
+        res->vals_[i] = line->vals_[(index[i / 32] >> (2 * (i % 32))) & 3];
+    }
+    Delete(line);
+    return res;
+  }
+
+  // The clock bit of the cold line compression, see
+  // Cache::CompressColdLines(). Set when the line is fetched from storage.
+  bool referenced() const { return referenced_; }
+  void set_referenced(bool referenced) { referenced_ = referenced; }
+
+  // The memory of 'n_lines' stored lines, the compressed ones at their size.
+  static size_t StoredBytes(size_t n_lines) {
+    size_t uniform = n_compressed_[0], packed = n_compressed_[1];
+    if (uniform + packed > n_lines) return n_lines * sizeof(CacheLine);
+    return (n_lines - uniform - packed) * sizeof(CacheLine) +
+        uniform * compressed_size_ + packed * packed_size_;
   }
 
   const Mask &has_shadow_value() const { return has_shadow_value_;  }
+
+  // True if the line was created before the last fork(), see "Fork" above.
+  bool inherited() const { return fork_epoch_ != g_fork_epoch; }
+  uint32_t reset_gen() const { return reset_gen_; }
+
+  // Clears the line unless it has been created or reset at 'gen' or later,
+  // see PendingShadowResets. Returns true if some shadow values were dropped.
+  bool ResetIfOlderThan(uint32_t gen) {
+    DCHECK(!compressed_);
+    if (reset_gen_ >= gen) return false;
+    reset_gen_ = gen;
+    Mask old_used = ClearRangeAndReturnOldUsed(0, kLineSize);
+    if (old_used.Empty()) return false;
+    while (!old_used.Empty()) {
+      uintptr_t x = old_used.GetSomeSetBit();
+      old_used.Clear(x);
+      vals_[x].Unref("CacheLine::ResetIfOlderThan");
+    }
+    return true;
+  }
   Mask &traced() { return traced_; }
   Mask &published() { return published_; }
   Mask &racey()  { return racey_; }
@@ -3063,6 +4789,14 @@ class CacheLine {
     return true;
   }
 
+  // Drop the shadow values, keep the other attributes.
+  Mask ClearShadowValuesAndReturnOldUsed() {
+    DCHECK(!compressed_);
+    for (size_t i = 0; i < TS_ARRAY_SIZE(granularity_); i++)
+      granularity_[i] = 0;
+    return has_shadow_value_.ClearRangeAndReturnOld(0, kLineSize);
+  }
+
   INLINE Mask ClearRangeAndReturnOldUsed(uintptr_t from, uintptr_t to) {
     traced_.ClearRange(from, to);
     published_.ClearRange(from, to);
@@ -3084,13 +4818,26 @@ class CacheLine {
 
   ShadowValue *GetValuePointer(uintptr_t offset) {
     DCHECK(offset < kLineSize);
+    DCHECK(!compressed_);
     return  &vals_[offset];
   }
   ShadowValue  GetValue(uintptr_t offset) { return *GetValuePointer(offset); }
+  int NumberOfCompressedValues() const { return compressed_; }
+  ShadowValue  GetCompressedValue(int i) {
+    DCHECK(i < compressed_);
+    return vals_[i];
+  }
 
   static uintptr_t ComputeOffset(uintptr_t a) {
     return a & (kLineSize - 1);
   }
+
+  // Start loading the header and the shadow value of 'a'.
+  // Nothing is read, so this is safe on a line we don't own.
+  void Prefetch(uintptr_t a) const {
+    PREFETCH(this);
+    PREFETCH(&vals_[ComputeOffset(a)]);
+  }
   static uintptr_t ComputeTag(uintptr_t a) {
     return a & ~(kLineSize - 1);
   }
@@ -3240,17 +4987,56 @@ class CacheLine {
     if (TSAN_DEBUG) {
       Printf("sizeof(CacheLine) = %ld\n", sizeof(CacheLine));
     }
-    free_list_ = new FreeList(sizeof(CacheLine), 1024);
+    free_list_ = new ShardedFreeList(sizeof(CacheLine), 1024);
+    compressed_size_ = offsetof(CacheLine, vals_) + sizeof(ShadowValue);
+    compressed_free_list_ = new ShardedFreeList(compressed_size_, 1024);
+    // kMaxPackedValues values and the 128 bits of the index.
+    CHECK(kMaxPackedValues <= 4 && kLineSize <= 64);
+    CHECK(sizeof(ShadowValue) == sizeof(uint64_t));
+    packed_size_ = offsetof(CacheLine, vals_) +
+        (kMaxPackedValues + 2) * sizeof(ShadowValue);
+    packed_free_list_ = new ShardedFreeList(packed_size_, 1024);
+    used_regions_ = new uintptr_t[kUsedRegionsBits / kBitsPerWord];
+    memset(used_regions_, 0, kUsedRegionsBits / 8);
   }
 
  private:
   explicit CacheLine(uintptr_t tag) {
     tag_ = tag;
+    compressed_ = 0;
+    referenced_ = false;
+    fork_epoch_ = g_fork_epoch;
+    reset_gen_ = *(volatile uint32_t*)&g_shadow_reset_gen;
     Clear();
   }
   ~CacheLine() { }
 
+  static const uintptr_t kUsedRegionsBits = 1 << 20;
+  static const uintptr_t kBitsPerWord = sizeof(uintptr_t) * 8;
+
+  static INLINE uintptr_t RegionBit(uintptr_t a) {
+    uint64_t region = a >> kRegionSizeBits;
+    return (uintptr_t)((region * 0x9E3779B97F4A7C15ULL) >> 40) %
+        kUsedRegionsBits;
+  }
+
+  static void MarkRegionUsed(uintptr_t a) {
+    if (RegionMayBeUsed(a)) return;
+    uintptr_t bit = RegionBit(a);
+    uintptr_t *word = &used_regions_[bit / kBitsPerWord];
+    uintptr_t mask = (uintptr_t)1 << (bit % kBitsPerWord);
+    for (;;) {
+      uintptr_t old = *(volatile uintptr_t*)word;
+      if ((old & mask) || AtomicCompareAndSwap(word, old, old | mask))
+        break;
+    }
+  }
+
   uintptr_t tag_;
+  uint8_t compressed_;  // The number of values of a compressed line, or 0.
+  bool referenced_;
+  uint8_t fork_epoch_;  // See "Fork".
+  uint32_t reset_gen_;  // See PendingShadowResets.
 
   // data members
   Mask has_shadow_value_;
@@ -3261,10 +5047,22 @@ class CacheLine {
   ShadowValue vals_[kLineSize];
 
   // static data members.
-  static FreeList *free_list_;
+  static ShardedFreeList *free_list_;
+  static ShardedFreeList *compressed_free_list_;
+  static size_t compressed_size_;
+  static ShardedFreeList *packed_free_list_;
+  static size_t packed_size_;
+  static int32_t n_compressed_[2];  // Lines with one value, with a few.
+  static uintptr_t *used_regions_;  // kUsedRegionsBits bits.
 };
 
-FreeList *CacheLine::free_list_;
+ShardedFreeList *CacheLine::free_list_;
+uintptr_t *CacheLine::used_regions_;
+ShardedFreeList *CacheLine::compressed_free_list_;
+size_t CacheLine::compressed_size_;
+ShardedFreeList *CacheLine::packed_free_list_;
+size_t CacheLine::packed_size_;
+int32_t CacheLine::n_compressed_[2];
 
 // If range [a,b) fits into one line, return that line's tag.
 // Else range [a,b) is broken into these ranges:
@@ -3284,6 +5082,112 @@ uintptr_t GetCacheLinesForRange(uintptr_t a, uintptr_t b,
   return 0;
 }
 
+// -------- ParkedLines ------------------ {{{1
+// With --parked_lines=N a thread keeps up to N cache lines acquired after
+// its fast path is done with them, so that its next traces touching them
+// need no AtomicExchange on the Cache slot (see HandleTraceByLines()).
+// The slot of a parked line holds Marker() of the owner instead of
+// kLineIsLocked(). A thread which takes the marker out of the slot in
+// Cache::TryAcquireSlot() has acquired the slot and gets the line itself
+// from the owner with Take(). The entries are touched only under lock_;
+// the owner holds it only while it runs the fast path on a parked line
+// and never waits for anything else meanwhile, so a steal waits at most
+// for one such batch. Only with TS_SERIALIZED == 0.
+class ParkedLines {
+ public:
+  static const int kMaxLines = 8;
+
+  ParkedLines() : lock_(0), n_(0) { }
+
+  CacheLine *Marker() { return (CacheLine*)((uintptr_t)this | 2); }
+  static bool IsMarker(CacheLine *line) {
+    return ((uintptr_t)line & 3) == 2;
+  }
+  static ParkedLines *FromMarker(CacheLine *marker) {
+    return (ParkedLines*)((uintptr_t)marker & ~(uintptr_t)3);
+  }
+
+  bool Empty() const { return n_ == 0; }  // A hint w/o lock_.
+
+  void Lock() {
+    for (int iter = 0; AtomicExchange(&lock_, 1); iter++) {
+      if ((iter % (1 << 6)) == 0) YIELD();
+      else PROCESSOR_YIELD();
+    }
+  }
+  void Unlock() { ReleaseStore(&lock_, 0); }
+
+  // The parked line with 'tag' or NULL.
+  CacheLine *Find(uintptr_t tag) {
+    for (int i = 0; i < n_; i++) {
+      if (entries_[i].line->tag() == tag)
+        return entries_[i].line;
+    }
+    return NULL;
+  }
+
+  // The caller has taken Marker() out of 'slot': returns the line and
+  // forgets it.
+  CacheLine *Take(CacheLine **slot) {
+    for (int i = 0; i < n_; i++) {
+      if (entries_[i].slot != slot) continue;
+      CacheLine *line = entries_[i].line;
+      Remove(i);
+      return line;
+    }
+    CHECK(0);
+    return NULL;
+  }
+
+  // Parks 'line' which the caller holds in 'slot'. If there are 'max'
+  // lines already, the oldest one is released first; returns false (and
+  // does nothing) if it is being stolen right now.
+  bool Park(CacheLine **slot, CacheLine *line, int max) {
+    DCHECK(max > 0 && max <= kMaxLines);
+    if (n_ >= max) {
+      if (!Unpark(0)) return false;
+    }
+    entries_[n_].slot = slot;
+    entries_[n_].line = line;
+    n_++;
+    ReleaseStore((uintptr_t*)slot, (uintptr_t)Marker());
+    return true;
+  }
+
+  // Puts the parked lines back into their slots, except those being
+  // stolen: the thieves take them later.
+  void UnparkAll() {
+    for (int i = n_ - 1; i >= 0; i--)
+      Unpark(i);
+  }
+
+ private:
+  bool Unpark(int i) {
+    if (!AtomicCompareAndSwap((uintptr_t*)entries_[i].slot,
+                              (uintptr_t)Marker(),
+                              (uintptr_t)entries_[i].line)) {
+      return false;
+    }
+    Remove(i);
+    return true;
+  }
+
+  void Remove(int i) {
+    for (int j = i + 1; j < n_; j++)
+      entries_[j - 1] = entries_[j];
+    n_--;
+  }
+
+  struct Entry {
+    CacheLine **slot;
+    CacheLine *line;
+  };
+
+  uintptr_t lock_;
+  int n_;
+  Entry entries_[kMaxLines];
+};
+
 
 // -------- Cache ------------------ {{{1
 class Cache {
@@ -3292,6 +5196,15 @@ class Cache {
     memset(lines_, 0, sizeof(lines_));
     ANNOTATE_BENIGN_RACE_SIZED(lines_, sizeof(lines_),
                                "Cache::lines_ accessed without a lock");
+    direct_ = NULL;
+    direct_leaves_ = NULL;
+    reclaim_pos_ = 0;
+    compress_pos_ = 0;
+    if (G_flags->direct_shadow) {
+      // Large calloc()s are mmap-ed, so the pages are committed lazily.
+      direct_ = (DirectLeaf**)calloc(kDirectTopSize, sizeof(DirectLeaf*));
+      CHECK(direct_);
+    }
   }
 
   INLINE static CacheLine *kLineIsLocked() {
@@ -3306,13 +5219,36 @@ class Cache {
     return kLineIsLocked();
   }
 
+  // Start loading the slot of the line with address 'a'.
+  INLINE void PrefetchSlot(uintptr_t a) {
+    if (!IsDirect(a))
+      PREFETCH(&lines_[ComputeCacheLineIndexInCache(a)]);
+  }
+
+  // Start loading the line with address 'a' if it is in the cache.
+  // The slot is read without acquiring it: a line we see may be evicted
+  // or locked by another thread, which costs a useless prefetch at most.
+  INLINE void PrefetchLine(uintptr_t a) {
+    CacheLine **slot = GetSlot(a, /*create_leaf=*/false);
+    if (!slot) return;
+    CacheLine *line = INTERNAL_ANNOTATE_UNPROTECTED_READ(*slot);
+    if (LineIsNullOrLocked(line) || ParkedLines::IsMarker(line)) return;
+    line->Prefetch(a);
+  }
+
   // Try to get a CacheLine for exclusive use.
   // May return NULL or kLineIsLocked.
   INLINE CacheLine *TryAcquireLine(TSanThread *thr, uintptr_t a, int call_site) {
+    return TryAcquireSlot(thr, GetSlot(a, /*create_leaf=*/true), a, call_site);
+  }
+
+  INLINE CacheLine *TryAcquireSlot(TSanThread *thr, CacheLine **addr,
+                                   uintptr_t a, int call_site) {
     uintptr_t cli = ComputeCacheLineIndexInCache(a);
-    CacheLine **addr = &lines_[cli];
     CacheLine *res = (CacheLine*)AtomicExchange(
            (uintptr_t*)addr, (uintptr_t)kLineIsLocked());
+    if (UNLIKELY(ParkedLines::IsMarker(res)))
+      res = StealParkedLine(addr, res);
     if (TSAN_DEBUG && debug_cache) {
       uintptr_t tag = CacheLine::ComputeTag(a);
       if (res && res != kLineIsLocked())
@@ -3322,23 +5258,50 @@ class Cache {
         Printf("TryAcquire tag=%lx cli=%d site=%d\n", tag, cli, call_site);
     }
     if (res) {
-      ANNOTATE_HAPPENS_AFTER((void*)cli);
+      ANNOTATE_HAPPENS_AFTER((void*)addr);
     }
     return res;
   }
 
+  // We have replaced the 'marker' of a parked line in 'slot' with
+  // kLineIsLocked(), now get the line from its owner.
+  NOINLINE CacheLine *StealParkedLine(CacheLine **slot, CacheLine *marker) {
+    ParkedLines *owner = ParkedLines::FromMarker(marker);
+    owner->Lock();
+    CacheLine *line = owner->Take(slot);
+    owner->Unlock();
+    G_stats->Shard()->parked_line_steal++;
+    return line;
+  }
+
+  // Parks 'line' which 'thr' holds in the slot of 'a' instead of releasing
+  // it, see ParkedLines. Called with parked->Lock() held.
+  INLINE void ParkLine(TSanThread *thr, uintptr_t a, CacheLine *line,
+                       ParkedLines *parked) {
+    DCHECK(TS_SERIALIZED == 0);
+    if (parked->Park(GetSlot(a, false), line, G_flags->parked_lines))
+      G_stats->Shard()->parked_line_park++;
+    else
+      ReleaseLine(thr, a, line, __LINE__);
+  }
+
   INLINE CacheLine *AcquireLine(TSanThread *thr, uintptr_t a, int call_site) {
+    return AcquireSlot(thr, GetSlot(a, /*create_leaf=*/true), a, call_site);
+  }
+
+  INLINE CacheLine *AcquireSlot(TSanThread *thr, CacheLine **addr,
+                                uintptr_t a, int call_site) {
     CacheLine *line = NULL;
     int iter = 0;
     const int max_iter = 1 << 30;
     for (;;) {
-      line = TryAcquireLine(thr, a, call_site);
+      line = TryAcquireSlot(thr, addr, a, call_site);
       if (line != kLineIsLocked())
         break;
       iter++;
       if ((iter % (1 << 6)) == 0) {
         YIELD();
-        G_stats->try_acquire_line_spin++;
+        G_stats->Shard()->try_acquire_line_spin++;
         if (TSAN_DEBUG && debug_cache && ((iter & (iter - 1)) == 0)) {
           Printf("T%d %s a=%p iter=%d\n", raw_tid(thr), __FUNCTION__, a, iter);
         }
@@ -3353,7 +5316,7 @@ class Cache {
         CHECK(iter < max_iter);
       }
     }
-    DCHECK(lines_[ComputeCacheLineIndexInCache(a)] == TidMagic(raw_tid(thr)));
+    DCHECK(*addr == TidMagic(raw_tid(thr)));
     return line;
   }
 
@@ -3362,12 +5325,11 @@ class Cache {
     if (TS_SERIALIZED) return;
     DCHECK(line != kLineIsLocked());
     uintptr_t cli = ComputeCacheLineIndexInCache(a);
-    DCHECK(line == NULL ||
-           cli == ComputeCacheLineIndexInCache(line->tag()));
-    CacheLine **addr = &lines_[cli];
+    CacheLine **addr = GetSlot(a, false);
+    DCHECK(line == NULL || addr == GetSlot(line->tag(), false));
     DCHECK(*addr == TidMagic(raw_tid(thr)));
     ReleaseStore((uintptr_t*)addr, (uintptr_t)line);
-    ANNOTATE_HAPPENS_BEFORE((void*)cli);
+    ANNOTATE_HAPPENS_BEFORE((void*)addr);
     if (TSAN_DEBUG && debug_cache) {
       uintptr_t tag = CacheLine::ComputeTag(a);
       if (line)
@@ -3378,13 +5340,41 @@ class Cache {
     }
   }
 
+  // Same as ReleaseLine(), but a direct line which has become empty (e.g.
+  // in ClearMemoryState()) is deleted and its slot is released as NULL:
+  // the direct shadow has no eviction which would do it later.
+  INLINE void ReleaseOrDeleteEmptyLine(TSanThread *thr, uintptr_t a,
+                                       CacheLine *line, int call_site) {
+    if (!IsDirect(a) || !line->Empty()) {
+      ReleaseLine(thr, a, line, call_site);
+      return;
+    }
+    if (TS_SERIALIZED) *GetSlot(a, false) = NULL;
+    else ReleaseLine(thr, a, NULL, call_site);
+    AddDirectLines(line->tag(), -1);
+    CacheLine::Delete(line);
+    G_stats->Shard()->cache_delete_empty_line++;
+  }
+
   void AcquireAllLines(TSanThread *thr) {
     CHECK(TS_SERIALIZED == 0);
     for (size_t i = 0; i < (size_t)kNumLines; i++) {
       uintptr_t tag = i << CacheLine::kLineSizeBits;
-      AcquireLine(thr, tag, __LINE__);
+      AcquireSlot(thr, &lines_[i], tag, __LINE__);
       CHECK(lines_[i] == kLineIsLocked());
     }
+    if (!direct_) return;
+    // A NULL slot may be held by a fast path thread, but it will be released
+    // with NULL again (lines are created only under the lock).
+    // Lines from the non-NULL slots are moved to storage_ so that
+    // ForgetAllState() deletes them together with the others.
+    vector<uintptr_t> tags;
+    GetDirectTags(&tags);
+    for (size_t i = 0; i < tags.size(); i++) {
+      CacheLine *line = AcquireLine(thr, tags[i], __LINE__);
+      if (line)
+        storage_.Insert(line->tag(), line);
+    }
   }
 
   // Get a CacheLine. This operation should be performed under a lock
@@ -3399,24 +5389,36 @@ class Cache {
     uintptr_t cli = ComputeCacheLineIndexInCache(a);
     CacheLine *res = NULL;
     CacheLine *line = NULL;
+    CacheLine **slot = GetSlot(a, create_new_if_need);
 
-    if (create_new_if_need == false && lines_[cli] == 0) {
+    if (create_new_if_need == false && (slot == NULL || *slot == 0)) {
       // There is no such line in the cache, nor should it be in the storage.
       // Check that the storage indeed does not have this line.
       // Such DCHECK is racey if tsan is multi-threaded.
-      DCHECK(TS_SERIALIZED == 0 || storage_.count(tag) == 0);
+      DCHECK(TS_SERIALIZED == 0 || storage_.Get(tag) == NULL);
       return NULL;
     }
 
     if (TS_SERIALIZED) {
-      line = lines_[cli];
+      line = *slot;
     } else {
-      line = AcquireLine(thr, tag, call_site);
+      line = AcquireSlot(thr, slot, tag, call_site);
     }
 
 
     if (LIKELY(line && line->tag() == tag)) {
       res = line;
+    } else if (IsDirect(a)) {
+      // The direct shadow has no eviction: a NULL slot means no line.
+      DCHECK(line == NULL);
+      if (create_new_if_need) {
+        res = CacheLine::CreateNewCacheLine(tag);
+        if (TS_SERIALIZED) *slot = res;
+        AddDirectLines(tag, 1);
+        G_stats->Shard()->cache_new_line++;
+      } else {
+        ReleaseLine(thr, a, line, call_site);
+      }
     } else {
       res = WriteBackAndFetch(thr, line, tag, cli, create_new_if_need);
       if (!res) {
@@ -3440,19 +5442,37 @@ class Cache {
   }
 
   void ForgetAllState(TSanThread *thr) {
-    for (int i = 0; i < kNumLines; i++) {
-      if (TS_SERIALIZED == 0) CHECK(LineIsNullOrLocked(lines_[i]));
-      lines_[i] = NULL;
+    if (TS_SERIALIZED == 0) {
+      for (int i = 0; i < kNumLines; i++)
+        CHECK(LineIsNullOrLocked(lines_[i]));
+    }
+    // Don't dirty the pages of a forked child's copy of lines_.
+    ZeroMemoryAndDecommit(lines_, sizeof(lines_));
+    if (direct_) {
+      // With TS_SERIALIZED == 0 AcquireAllLines() has already moved
+      // the direct lines to storage_.
+      vector<uintptr_t> tags;
+      GetDirectTags(&tags);
+      for (size_t i = 0; i < tags.size(); i++) {
+        CacheLine **slot = GetSlot(tags[i], false);
+        if (TS_SERIALIZED == 0) CHECK(LineIsNullOrLocked(*slot));
+        else storage_.Insert((*slot)->tag(), *slot);
+        *slot = NULL;
+      }
+      for (DirectLeaf *leaf = direct_leaves_; leaf; leaf = leaf->next)
+        memset(leaf->n_lines, 0, sizeof(leaf->n_lines));
     }
     map<uintptr_t, Mask> racey_masks;
-    for (Map::iterator i = storage_.begin(); i != storage_.end(); ++i) {
-      CacheLine *line = i->second;
+    vector<CacheLine*> all_lines;
+    storage_.GetAll(&all_lines);
+    for (size_t i = 0; i < all_lines.size(); i++) {
+      CacheLine *line = all_lines[i];
       if (!line->racey().Empty()) {
         racey_masks[line->tag()] = line->racey();
       }
       CacheLine::Delete(line);
     }
-    storage_.clear();
+    storage_.Clear();
     // Restore the racey masks.
     for (map<uintptr_t, Mask>::iterator it = racey_masks.begin();
          it != racey_masks.end(); it++) {
@@ -3463,19 +5483,221 @@ class Cache {
     }
   }
 
+  size_t NumberOfStoredLines() { return storage_.size(); }
+
+  // Drop the shadow values of up to 'n' cold lines, i.e. the lines in
+  // storage_ which are not in the cache, and delete the lines which become
+  // empty. Each call continues where the previous one stopped.
+  // Returns the number of lines which had shadow values.
+  // Called under ts_lock.
+  size_t ReclaimColdLines(TSanThread *thr, size_t n) {
+    vector<uintptr_t> tags;
+    storage_.GetSomeKeys(&reclaim_pos_, n, &tags);
+    size_t res = 0;
+    for (size_t i = 0; i < tags.size(); i++) {
+      uintptr_t tag = tags[i];
+      if (IsDirect(tag)) continue;
+      CacheLine **slot = GetSlot(tag, false);
+      // Owning the slot means nobody else touches 'tag' in storage_.
+      CacheLine *hot = TS_SERIALIZED ? *slot
+          : AcquireSlot(thr, slot, tag, __LINE__);
+      CacheLine *line = NULL;
+      if (!hot || hot->tag() != tag)
+        line = storage_.Get(tag);
+      if (line) {
+        if (line->compressed()) {
+          line = CacheLine::Decompress(line);
+          storage_.Erase(tag);
+          storage_.Insert(tag, line);
+        }
+        if (line->inherited() && line->racey().Empty()) {
+          if (DropInheritedLine(tag, line, "Cache::ReclaimColdLines"))
+            res++;
+          ReleaseLine(thr, tag, hot, __LINE__);
+          continue;
+        }
+        Mask old_used = line->ClearShadowValuesAndReturnOldUsed();
+        if (!old_used.Empty()) res++;
+        while (!old_used.Empty()) {
+          uintptr_t x = old_used.GetSomeSetBit();
+          old_used.Clear(x);
+          line->GetValuePointer(x)->Unref("Cache::ReclaimColdLines");
+        }
+        if (line->Empty()) {
+          CHECK(storage_.Erase(tag) == line);
+          CacheLine::Delete(line);
+          G_stats->Shard()->cache_delete_empty_line++;
+        }
+      }
+      ReleaseLine(thr, tag, hot, __LINE__);
+    }
+    return res;
+  }
+
+  // Compresses the cold lines among up to 'n' lines of storage_ which are
+  // not in the cache, like the CLOCK algorithm with the referenced() bit:
+  // a line fetched since the previous visit gets one more round.
+  // Each call continues where the previous one stopped.
+  // Returns the number of lines compressed. Called under ts_lock.
+  size_t CompressColdLines(TSanThread *thr, size_t n) {
+    vector<uintptr_t> tags;
+    storage_.GetSomeKeys(&compress_pos_, n, &tags);
+    size_t res = 0;
+    for (size_t i = 0; i < tags.size(); i++) {
+      uintptr_t tag = tags[i];
+      if (IsDirect(tag)) continue;
+      CacheLine **slot = GetSlot(tag, false);
+      // Owning the slot means nobody else touches 'tag' in storage_.
+      CacheLine *hot = TS_SERIALIZED ? *slot
+          : AcquireSlot(thr, slot, tag, __LINE__);
+      CacheLine *line = NULL;
+      if (!hot || hot->tag() != tag)
+        line = storage_.Get(tag);
+      if (line && !line->compressed()) {
+        if (line->referenced()) {
+          line->set_referenced(false);
+        } else {
+          CacheLine *compressed = CacheLine::Compress(line);
+          if (compressed) {
+            storage_.Erase(tag);
+            storage_.Insert(tag, compressed);
+            G_stats->Shard()->cache_compress++;
+            res++;
+          }
+        }
+      }
+      ReleaseLine(thr, tag, hot, __LINE__);
+    }
+    return res;
+  }
+
+  // Resets the lines in [a, b) which are held in lines_ and are older than
+  // 'gen'; 'a' and 'b' are line-aligned. The lines which are only in
+  // storage_ are left to the lazy reset, see PendingShadowResets.
+  // Looks at no more than kNumLines slots. Called under ts_lock.
+  size_t ResetCachedLines(TSanThread *thr, uintptr_t a, uintptr_t b,
+                          uint32_t gen) {
+    DCHECK(!direct_);
+    size_t res = 0;
+    if (((b - a) >> CacheLine::kLineSizeBits) >= (uintptr_t)kNumLines) {
+      for (uintptr_t i = 0; i < (uintptr_t)kNumLines; i++)
+        res += ResetCachedLine(thr, i, a, b, gen);
+      return res;
+    }
+    for (uintptr_t tag = a; tag < b; ) {
+      if (!CacheLine::RegionMayBeUsed(tag)) {
+        tag = min(CacheLine::ComputeNextRegion(tag), b);
+        continue;
+      }
+      res += ResetCachedLine(thr, ComputeCacheLineIndexInCache(tag), a, b,
+                             gen);
+      tag += CacheLine::kLineSize;
+    }
+    return res;
+  }
+
+  // Resets the lines in [a, b) which are older than 'gen' and deletes the
+  // ones which become empty. Looks at no more than 'max_lines' lines and
+  // returns the address where it stopped. The hot lines are not stale (see
+  // ResetCachedLines()), so only storage_ is looked at and the cache is not
+  // polluted. Called under ts_lock.
+  uintptr_t ResetStaleLines(TSanThread *thr, uintptr_t a, uintptr_t b,
+                            uint32_t gen, size_t max_lines) {
+    DCHECK(!direct_);
+    uintptr_t tag = a;
+    for (size_t n = 0; tag < b && n < max_lines; n++) {
+      if (!CacheLine::RegionMayBeUsed(tag)) {
+        tag = min(CacheLine::ComputeNextRegion(tag), b);
+        continue;
+      }
+      CacheLine **slot = GetSlot(tag, false);
+      CacheLine *hot = TS_SERIALIZED ? *slot
+          : AcquireSlot(thr, slot, tag, __LINE__);
+      CacheLine *line = NULL;
+      if (!hot || hot->tag() != tag)
+        line = storage_.Get(tag);
+      if (line) {
+        if (line->compressed()) {
+          line = CacheLine::Decompress(line);
+          storage_.Erase(tag);
+          storage_.Insert(tag, line);
+        }
+        if (line->inherited() && line->racey().Empty() &&
+            line->reset_gen() < gen) {
+          if (DropInheritedLine(tag, line, "Cache::ResetStaleLines"))
+            G_stats->Shard()->lazy_reset_lines++;
+        } else {
+          if (line->ResetIfOlderThan(gen))
+            G_stats->Shard()->lazy_reset_lines++;
+          if (line->Empty()) {
+            CHECK(storage_.Erase(tag) == line);
+            CacheLine::Delete(line);
+            G_stats->Shard()->cache_delete_empty_line++;
+          }
+        }
+      }
+      ReleaseLine(thr, tag, hot, __LINE__);
+      tag += CacheLine::kLineSize;
+    }
+    return tag;
+  }
+
+  // Removes the cold inherited 'line' from storage_ w/o writing to it, see
+  // "Fork", and drops the references held by its shadow values.
+  // Returns true if the line had shadow values.
+  bool DropInheritedLine(uintptr_t tag, CacheLine *line, const char *where) {
+    DCHECK(line->inherited());
+    DCHECK(line->racey().Empty());
+    Mask used = line->has_shadow_value();
+    bool res = !used.Empty();
+    while (!used.Empty()) {
+      uintptr_t x = used.GetSomeSetBit();
+      used.Clear(x);
+      line->GetValuePointer(x)->Unref(where);
+    }
+    CHECK(storage_.Erase(tag) == line);
+    CacheLine::Delete(line);
+    return res;
+  }
+
   void PrintStorageStats() {
     if (!G_flags->show_stats) return;
     set<ShadowValue> all_svals;
     map<size_t, int> sizes;
-    for (Map::iterator it = storage_.begin(); it != storage_.end(); ++it) {
-      CacheLine *line = it->second;
+    size_t n_compressed = 0;
+    // Called under ts_lock; with sharded locking block the concurrent
+    // storage_ updates while we walk it.
+    if (ShardedLocking()) BlockShardedSections();
+    vector<CacheLine*> all_lines;
+    storage_.GetAll(&all_lines);
+    if (direct_) {
+      vector<uintptr_t> tags;
+      GetDirectTags(&tags);
+      for (size_t i = 0; i < tags.size(); i++) {
+        CacheLine *line = *GetSlot(tags[i], false);
+        // Skip the lines held by the fast path.
+        if (!LineIsNullOrLocked(line))
+          all_lines.push_back(line);
+      }
+    }
+    for (size_t it = 0; it < all_lines.size(); ++it) {
+      CacheLine *line = all_lines[it];
       // uintptr_t cli = ComputeCacheLineIndexInCache(line->tag());
       //if (lines_[cli] == line) {
         // this line is in cache -- ignore it.
       //  continue;
       //}
       set<ShadowValue> s;
+      if (line->compressed()) {
+        n_compressed++;
+        for (int i = 0; i < line->NumberOfCompressedValues(); i++) {
+          ShadowValue sval = line->GetCompressedValue(i);
+          s.insert(sval);
+          all_svals.insert(sval);
+        }
+      }
       for (uintptr_t i = 0; i < CacheLine::kLineSize; i++) {
+        if (line->compressed()) break;
         if (line->has_shadow_value().Get(i)) {
           ShadowValue sval = *(line->GetValuePointer(i));
           s.insert(sval);
@@ -3486,7 +5708,9 @@ class Cache {
       if (size > 10) size = 10;
       sizes[size]++;
     }
-    Printf("Storage sizes: %ld\n", storage_.size());
+    if (ShardedLocking()) UnblockShardedSections();
+    Printf("Storage sizes: %ld (compressed: %ld)\n", all_lines.size(),
+           n_compressed);
     for (size_t size = 0; size <= CacheLine::kLineSize; size++) {
       if (sizes[size]) {
         Printf("  %ld => %d\n", size, sizes[size]);
@@ -3520,52 +5744,161 @@ class Cache {
   }
 
  private:
+  // The direct shadow covers the lower 2^47 bytes (2^32 on 32-bit) which is
+  // all of the user address space on the common 64-bit systems.
+  static const uintptr_t kDirectAddrBits = sizeof(uintptr_t) == 8 ? 47 : 32;
+  static const uintptr_t kDirectLeafBits = 20;
+  static const uintptr_t kDirectLeafSize = (uintptr_t)1 << kDirectLeafBits;
+  static const uintptr_t kDirectTopSize = (uintptr_t)1 <<
+      (kDirectAddrBits - CacheLine::kLineSizeBits - kDirectLeafBits);
+  // 0 means the whole address space.
+  static const uintptr_t kDirectAddrLimit = sizeof(uintptr_t) == 8 ?
+      (uintptr_t)1 << (kDirectAddrBits % (8 * sizeof(uintptr_t))) : 0;
+  // The line counts are kept per block of 2^kDirectBlockBits slots, so
+  // that GetDirectTags() skips the empty parts of a leaf.
+  static const uintptr_t kDirectBlockBits = 9;
+  static const uintptr_t kDirectBlocksPerLeaf =
+      kDirectLeafSize >> kDirectBlockBits;
+  struct DirectLeaf {
+    CacheLine *slots[kDirectLeafSize];
+    int32_t n_lines[kDirectBlocksPerLeaf];  // Non-NULL slots of each block.
+    uintptr_t top_idx;  // The index of this leaf in direct_.
+    DirectLeaf *next;   // The list of all leaves, see direct_leaves_.
+  };
+
   INLINE uintptr_t ComputeCacheLineIndexInCache(uintptr_t addr) {
     return (addr >> CacheLine::kLineSizeBits) & (kNumLines - 1);
   }
 
+  size_t ResetCachedLine(TSanThread *thr, uintptr_t cli, uintptr_t a,
+                         uintptr_t b, uint32_t gen) {
+    CacheLine **slot = &lines_[cli];
+    if (*slot == NULL) return 0;
+    uintptr_t slot_addr = cli << CacheLine::kLineSizeBits;
+    CacheLine *line = TS_SERIALIZED ? *slot
+        : AcquireSlot(thr, slot, slot_addr, __LINE__);
+    size_t res = 0;
+    if (line && line->tag() >= a && line->tag() < b &&
+        line->ResetIfOlderThan(gen)) {
+      res = 1;
+    }
+    ReleaseLine(thr, slot_addr, line, __LINE__);
+    return res;
+  }
+
+  // With --direct_shadow the addresses below kDirectAddrLimit have a
+  // permanent slot in a two-level table indexed by the address.
+  // There is no hashing and no eviction for such addresses.
+  // The other addresses use lines_ and storage_ as usual.
+  INLINE bool IsDirect(uintptr_t a) {
+    return direct_ != NULL && (kDirectAddrLimit == 0 || a < kDirectAddrLimit);
+  }
+
+  // Returns the slot for the line with address 'a'.
+  // May return NULL only if !create_leaf.
+  INLINE CacheLine **GetSlot(uintptr_t a, bool create_leaf) {
+    if (!IsDirect(a))
+      return &lines_[ComputeCacheLineIndexInCache(a)];
+    uintptr_t idx = a >> CacheLine::kLineSizeBits;
+    DirectLeaf *leaf = direct_[idx >> kDirectLeafBits];
+    if (UNLIKELY(leaf == NULL)) {
+      if (!create_leaf) return NULL;
+      leaf = CreateDirectLeaf(idx >> kDirectLeafBits);
+    }
+    return &leaf->slots[idx & (kDirectLeafSize - 1)];
+  }
+
+  NOINLINE DirectLeaf *CreateDirectLeaf(uintptr_t top_idx) {
+    DirectLeaf *leaf = (DirectLeaf*)calloc(1, sizeof(DirectLeaf));
+    CHECK(leaf);
+    leaf->top_idx = top_idx;
+    if (!AtomicCompareAndSwap((uintptr_t*)&direct_[top_idx], 0,
+                              (uintptr_t)leaf)) {
+      // Somebody else was faster.
+      free(leaf);
+      return direct_[top_idx];
+    }
+    // The leaves are never freed, so there is no ABA here.
+    DirectLeaf *head;
+    do {
+      head = direct_leaves_;
+      leaf->next = head;
+    } while (!AtomicCompareAndSwap((uintptr_t*)&direct_leaves_,
+                                   (uintptr_t)head, (uintptr_t)leaf));
+    return leaf;
+  }
+
+  // Adds 'n' (which may be negative) to the number of lines in the direct
+  // slot block of 'tag'.
+  void AddDirectLines(uintptr_t tag, int32_t n) {
+    uintptr_t idx = tag >> CacheLine::kLineSizeBits;
+    DirectLeaf *leaf = direct_[idx >> kDirectLeafBits];
+    int32_t *n_lines = &leaf->n_lines[
+        (idx & (kDirectLeafSize - 1)) >> kDirectBlockBits];
+    NoBarrier_AtomicAdd(n_lines, n);
+    DCHECK(*n_lines >= 0);
+  }
+
+  // Tags of all non-NULL direct slots. Only the blocks of slots which have
+  // lines in them are looked at.
+  void GetDirectTags(vector<uintptr_t> *tags) {
+    for (DirectLeaf *leaf = direct_leaves_; leaf; leaf = leaf->next) {
+      for (uintptr_t b = 0; b < kDirectBlocksPerLeaf; b++) {
+        if (!leaf->n_lines[b]) continue;
+        uintptr_t j_end = (b + 1) << kDirectBlockBits;
+        for (uintptr_t j = b << kDirectBlockBits; j < j_end; j++) {
+          if (leaf->slots[j]) {
+            tags->push_back(((leaf->top_idx << kDirectLeafBits) | j)
+                            << CacheLine::kLineSizeBits);
+          }
+        }
+      }
+    }
+  }
+
   NOINLINE CacheLine *WriteBackAndFetch(TSanThread *thr, CacheLine *old_line,
                                         uintptr_t tag, uintptr_t cli,
                                         bool create_new_if_need) {
     ScopedMallocCostCenter cc("Cache::WriteBackAndFetch");
-    CacheLine *res;
-    size_t old_storage_size = storage_.size();
-    (void)old_storage_size;
-    CacheLine **line_for_this_tag = NULL;
-    if (create_new_if_need) {
-      line_for_this_tag = &storage_[tag];
-    } else {
-      Map::iterator it = storage_.find(tag);
-      if (it == storage_.end()) {
+    // We own the cache slot 'cli', so nobody else touches 'tag' in storage_.
+    CacheLine *res = storage_.Get(tag);
+    DCHECK(old_line != kLineIsLocked());
+    if (res == NULL) {
+      if (!create_new_if_need) {
         if (TSAN_DEBUG && debug_cache) {
           Printf("WriteBackAndFetch: old_line=%ld tag=%lx cli=%ld\n",
                  old_line, tag, cli);
         }
         return NULL;
       }
-      line_for_this_tag = &(it->second);
-    }
-    CHECK(line_for_this_tag);
-    DCHECK(old_line != kLineIsLocked());
-    if (*line_for_this_tag == NULL) {
       // creating a new cache line
-      CHECK(storage_.size() == old_storage_size + 1);
       res = CacheLine::CreateNewCacheLine(tag);
       if (TSAN_DEBUG && debug_cache) {
         Printf("%s %d new line %p cli=%lx\n", __FUNCTION__, __LINE__, res, cli);
       }
-      *line_for_this_tag = res;
-      G_stats->cache_new_line++;
+      storage_.Insert(tag, res);
+      G_stats->Shard()->cache_new_line++;
     } else {
       // taking an existing cache line from storage.
-      res = *line_for_this_tag;
+      if (res->compressed()) {
+        res = CacheLine::Decompress(res);
+        storage_.Erase(tag);
+        storage_.Insert(tag, res);
+        G_stats->Shard()->cache_decompress++;
+      }
+      res->set_referenced(true);
       if (TSAN_DEBUG && debug_cache) {
         Printf("%s %d exi line %p tag=%lx old=%p empty=%d cli=%lx\n",
              __FUNCTION__, __LINE__, res, res->tag(), old_line,
              res->Empty(), cli);
       }
       DCHECK(!res->Empty());
-      G_stats->cache_fetch++;
+      G_stats->Shard()->cache_fetch++;
+      if (UNLIKELY(g_pending_shadow_resets != NULL) &&
+          !g_pending_shadow_resets->empty() &&
+          res->ResetIfOlderThan(g_pending_shadow_resets->GenerationAt(tag))) {
+        G_stats->Shard()->lazy_reset_lines++;
+      }
     }
 
     if (TS_SERIALIZED) {
@@ -3580,19 +5913,29 @@ class Cache {
                old_line, old_line->Empty());
       }
       if (old_line->Empty()) {
-        storage_.erase(old_line->tag());
+        CHECK(storage_.Erase(old_line->tag()) == old_line);
         CacheLine::Delete(old_line);
-        G_stats->cache_delete_empty_line++;
+        G_stats->Shard()->cache_delete_empty_line++;
       } else {
         if (debug_cache) {
           DebugOnlyCheckCacheLineWhichWeReplace(old_line, res);
         }
+        if (G_flags->compress_cache_lines) {
+          uintptr_t old_tag = old_line->tag();
+          CacheLine *compressed = CacheLine::Compress(old_line);
+          if (compressed) {
+            storage_.Erase(old_tag);
+            storage_.Insert(old_tag, compressed);
+            G_stats->Shard()->cache_compress++;
+          }
+        }
       }
     }
     DCHECK(res->tag() == tag);
 
-    if (G_stats->cache_max_storage_size < storage_.size()) {
-      G_stats->cache_max_storage_size = storage_.size();
+    size_t storage_size = storage_.size();
+    if (G_stats->cache_max_storage_size < storage_size) {
+      G_stats->cache_max_storage_size = storage_size;
     }
 
     return res;
@@ -3624,157 +5967,171 @@ class Cache {
   static const int kNumLines = 1 << (TSAN_DEBUG ? 14 : 21);
   CacheLine *lines_[kNumLines];
 
+  DirectLeaf **direct_;  // kDirectTopSize leaves, allocated on demand.
+  DirectLeaf *direct_leaves_;  // All the allocated leaves.
+
   // tag => CacheLine
-  typedef unordered_map<uintptr_t, CacheLine*> Map;
-  Map storage_;
+  TagMap<CacheLine> storage_;
+  uintptr_t reclaim_pos_;  // See ReclaimColdLines().
+  uintptr_t compress_pos_;  // See CompressColdLines().
 };
 
 static  Cache *G_cache;
 
 // -------- Published range -------------------- {{{1
-struct PublishInfo {
-  uintptr_t tag;   // Tag of the cache line where the mem is published.
-  Mask      mask;  // The bits that are actually published.
-  VTS      *vts;   // The point where this range has been published.
-};
+// Published memory is a set of disjoint byte ranges [begin, end), each with
+// the VTS of the publisher. Every range holds one reference to its VTS, so
+// publishing a multi-megabyte buffer costs one map entry, not one per line.
+// The access path never looks here unless the 'published' bit of the
+// CacheLine is set.
+class PublishInfoMap {
+ public:
+  // Returns NULL if 'a' is not published.
+  VTS *Get(uintptr_t a) {
+    Map::iterator it = map_.upper_bound(a);
+    if (it == map_.begin()) return NULL;
+    --it;
+    return a < it->second.end ? it->second.vts : NULL;
+  }
+
+  // Publish [a, b) with 'vts'; whatever was published there is dropped.
+  void Publish(uintptr_t a, uintptr_t b, VTS *vts) {
+    DCHECK(a < b);
+    Unpublish(a, b);
+    Range r = {b, vts->Clone()};
+    map_[a] = r;
+    G_stats->Shard()->publish_set++;
+  }
+
+  // Remove [a, b) from the published ranges, splitting the ranges which
+  // stick out.
+  void Unpublish(uintptr_t a, uintptr_t b) {
+    if (map_.empty()) return;
+    Map::iterator it = map_.upper_bound(a);
+    if (it != map_.begin()) {
+      --it;
+      Range &r = it->second;
+      if (r.end > a) {
+        G_stats->Shard()->publish_clear++;
+        if (r.end > b) {
+          Range right = {r.end, r.vts->Clone()};
+          map_[b] = right;
+        }
+        r.end = a;
+      }
+      if (it->first == r.end) {
+        // Nothing is left of this range.
+        VTS::Unref(r.vts);
+        map_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    while (it != map_.end() && it->first < b) {
+      G_stats->Shard()->publish_clear++;
+      Range r = it->second;
+      map_.erase(it++);
+      if (r.end > b) {
+        // The tail keeps the reference.
+        map_[b] = r;
+        break;
+      }
+      VTS::Unref(r.vts);
+    }
+  }
+
+  bool empty() { return map_.empty(); }
+
+  void clear() { map_.clear(); }
 
+  // The ranges are non-empty, disjoint and have a VTS.
+  bool CheckSanity() {
+    uintptr_t prev_end = 0;
+    for (Map::iterator it = map_.begin(); it != map_.end(); ++it) {
+      CHECK(it->first < it->second.end);
+      CHECK(it->first >= prev_end);
+      CHECK(it->second.vts);
+      prev_end = it->second.end;
+    }
+    return true;
+  }
 
-typedef multimap<uintptr_t, PublishInfo> PublishInfoMap;
+ private:
+  struct Range {
+    uintptr_t end;
+    VTS      *vts;
+  };
+  // begin => Range
+  typedef map<uintptr_t, Range> Map;
+  Map map_;
+};
 
-// Maps 'mem+size' to the PublishInfoMap{mem, size, vts}.
 static PublishInfoMap *g_publish_info_map;
 
+// Set by the first PublishRange() and never cleared. Until then no access
+// can take the NewSegmentForWait() branch of the slow path, which is what
+// HandleTraceByLines() relies on. Written under ts_lock, read w/o it.
+static bool g_memory_was_published;
+
 const int kDebugPublish = 0;
 
 // Get a VTS where 'a' has been published,
 // return NULL if 'a' was not published.
 static const VTS *GetPublisherVTS(uintptr_t a) {
-  uintptr_t tag = CacheLine::ComputeTag(a);
-  uintptr_t off = CacheLine::ComputeOffset(a);
-  typedef PublishInfoMap::iterator Iter;
-
-  pair<Iter, Iter> eq_range = g_publish_info_map->equal_range(tag);
-  for (Iter it = eq_range.first; it != eq_range.second; ++it) {
-    PublishInfo &info = it->second;
-    DCHECK(info.tag == tag);
-    if (info.mask.Get(off)) {
-      G_stats->publish_get++;
-      // Printf("GetPublisherVTS: a=%p vts=%p\n", a, info.vts);
-      return info.vts;
-    }
+  const VTS *res = g_publish_info_map->Get(a);
+  if (res) {
+    G_stats->Shard()->publish_get++;
+    return res;
   }
   Printf("GetPublisherVTS returned NULL: a=%p\n", a);
   return NULL;
 }
 
-static bool CheckSanityOfPublishedMemory(uintptr_t tag, int line) {
+static bool CheckSanityOfPublishedMemory(int line) {
   if (!TSAN_DEBUG) return true;
   if (kDebugPublish)
     Printf("CheckSanityOfPublishedMemory: line=%d\n", line);
-  typedef PublishInfoMap::iterator Iter;
-  pair<Iter, Iter> eq_range = g_publish_info_map->equal_range(tag);
-  Mask union_of_masks(0);
-  // iterate over all entries for this tag
-  for (Iter it = eq_range.first; it != eq_range.second; ++it) {
-    PublishInfo &info = it->second;
-    CHECK(info.tag  == tag);
-    CHECK(it->first == tag);
-    CHECK(info.vts);
-    Mask mask(info.mask);
-    CHECK(!mask.Empty());  // Mask should not be empty..
-    // And should not intersect with other masks.
-    CHECK(Mask::Intersection(union_of_masks, mask).Empty());
-    union_of_masks.Union(mask);
-  }
-  return true;
+  return g_publish_info_map->CheckSanity();
 }
 
-// Clear the publish attribute for the bytes from 'line' that are set in 'mask'
-static void ClearPublishedAttribute(CacheLine *line, Mask mask) {
-  CHECK(CheckSanityOfPublishedMemory(line->tag(), __LINE__));
-  typedef PublishInfoMap::iterator Iter;
-  bool deleted_some = true;
-  if (kDebugPublish)
-    Printf(" ClearPublishedAttribute: %p %s\n",
-           line->tag(), mask.ToString().c_str());
-  while (deleted_some) {
-    deleted_some = false;
-    pair<Iter, Iter> eq_range = g_publish_info_map->equal_range(line->tag());
-    for (Iter it = eq_range.first; it != eq_range.second; ++it) {
-      PublishInfo &info = it->second;
-      DCHECK(info.tag == line->tag());
-      if (kDebugPublish)
-        Printf("?ClearPublishedAttribute: %p %s\n", line->tag(),
-               info.mask.ToString().c_str());
-      info.mask.Subtract(mask);
-      if (kDebugPublish)
-        Printf("+ClearPublishedAttribute: %p %s\n", line->tag(),
-               info.mask.ToString().c_str());
-      G_stats->publish_clear++;
-      if (info.mask.Empty()) {
-        VTS::Unref(info.vts);
-        g_publish_info_map->erase(it);
-        deleted_some = true;
-        break;
-      }
-    }
-  }
-  CHECK(CheckSanityOfPublishedMemory(line->tag(), __LINE__));
-}
-
-// Publish range [a, b) in addr's CacheLine with vts.
-static void PublishRangeInOneLine(TSanThread *thr, uintptr_t addr, uintptr_t a,
-                                  uintptr_t b, VTS *vts) {
-  ScopedMallocCostCenter cc("PublishRangeInOneLine");
+// Set the published bits for [a, b) in addr's CacheLine.
+static void SetPublishedBitsInOneLine(TSanThread *thr, uintptr_t addr,
+                                      uintptr_t a, uintptr_t b) {
   DCHECK(b <= CacheLine::kLineSize);
   DCHECK(a < b);
   uintptr_t tag = CacheLine::ComputeTag(addr);
-  CHECK(CheckSanityOfPublishedMemory(tag, __LINE__));
   CacheLine *line = G_cache->GetLineOrCreateNew(thr, tag, __LINE__);
-
-  if (1 || line->published().GetRange(a, b)) {
-    Mask mask(0);
-    mask.SetRange(a, b);
-    // TODO(timurrrr): add warning for re-publishing.
-    ClearPublishedAttribute(line, mask);
-  }
-
   line->published().SetRange(a, b);
   G_cache->ReleaseLine(thr, tag, line, __LINE__);
-
-  PublishInfo pub_info;
-  pub_info.tag  = tag;
-  pub_info.mask.SetRange(a, b);
-  pub_info.vts  = vts->Clone();
-  g_publish_info_map->insert(make_pair(tag, pub_info));
-  G_stats->publish_set++;
-  if (kDebugPublish)
-    Printf("PublishRange   : [%p,%p) %p %s vts=%p\n",
-           a, b, tag, pub_info.mask.ToString().c_str(), vts);
-  CHECK(CheckSanityOfPublishedMemory(tag, __LINE__));
 }
 
 // Publish memory range [a, b).
 static void PublishRange(TSanThread *thr, uintptr_t a, uintptr_t b, VTS *vts) {
+  ScopedMallocCostCenter cc("PublishRange");
   CHECK(a);
   CHECK(a < b);
   if (kDebugPublish)
-    Printf("PublishRange   : [%p,%p), size=%d, tag=%p\n",
-           a, b, (int)(b - a), CacheLine::ComputeTag(a));
+    Printf("PublishRange   : [%p,%p), size=%d, tag=%p vts=%p\n",
+           a, b, (int)(b - a), CacheLine::ComputeTag(a), vts);
+  // TODO(timurrrr): add warning for re-publishing.
+  g_memory_was_published = true;
+  g_publish_info_map->Publish(a, b, vts);
+  CHECK(CheckSanityOfPublishedMemory(__LINE__));
+
   uintptr_t line1_tag = 0, line2_tag = 0;
   uintptr_t tag = GetCacheLinesForRange(a, b, &line1_tag, &line2_tag);
   if (tag) {
-    PublishRangeInOneLine(thr, tag, a - tag, b - tag, vts);
+    SetPublishedBitsInOneLine(thr, tag, a - tag, b - tag);
     return;
   }
   uintptr_t a_tag = CacheLine::ComputeTag(a);
-  PublishRangeInOneLine(thr, a, a - a_tag, CacheLine::kLineSize, vts);
+  SetPublishedBitsInOneLine(thr, a, a - a_tag, CacheLine::kLineSize);
   for (uintptr_t tag_i = line1_tag; tag_i < line2_tag;
        tag_i += CacheLine::kLineSize) {
-    PublishRangeInOneLine(thr, tag_i, 0, CacheLine::kLineSize, vts);
+    SetPublishedBitsInOneLine(thr, tag_i, 0, CacheLine::kLineSize);
   }
   if (b > line2_tag) {
-    PublishRangeInOneLine(thr, line2_tag, 0, b - line2_tag, vts);
+    SetPublishedBitsInOneLine(thr, line2_tag, 0, b - line2_tag);
   }
 }
 
@@ -3787,6 +6144,7 @@ struct ThreadSanitizerReport {
     UNLOCK_NONLOCKED,
     INVALID_LOCK,
     ATOMICITY_VIOLATION,
+    LOCK_ORDER,
   };
 
   // Common fields.
@@ -3801,6 +6159,7 @@ struct ThreadSanitizerReport {
       case UNLOCK_NONLOCKED: return "UnlockNonLocked";
       case INVALID_LOCK:     return "InvalidLock";
       case ATOMICITY_VIOLATION: return "AtomicityViolation";
+      case LOCK_ORDER:       return "LockOrder";
     }
     CHECK(0);
     return NULL;
@@ -3846,6 +6205,245 @@ struct ThreadSanitizerAtomicityViolationReport : public ThreadSanitizerReport {
   AtomicityRegion *r1, *r2, *r3;
 };
 
+// Report for a cycle in the lock order graph (LOCK_ORDER).
+// stack_trace is where the edge cycle[n-1]->cycle[0] was added,
+// cycle[i]->cycle[i+1] are the edges which were in the graph before.
+struct ThreadSanitizerLockOrderReport : public ThreadSanitizerReport {
+  vector<LID> cycle;
+};
+
+// -------- LockOrderGraph ------------- {{{1
+// With --detect_deadlocks we keep the lock order graph: an edge L1->L2
+// means that some thread acquired L2 while holding L1. A cycle in the graph
+// is a potential deadlock.
+//
+// The graph is kept acyclic and its nodes have a topological order which is
+// maintained incrementally (D. Pearce, P. Kelly, "A Dynamic Topological
+// Sort Algorithm for Directed Acyclic Graphs"): an edge which agrees with
+// the order costs a hash lookup, otherwise only the nodes which are between
+// the edge's ends in the order are visited. An edge which closes a cycle is
+// reported and is not added. The threads remember the edges they have
+// added in a small cache, see TSanThread::HandleLockOrder().
+// When a lock is destroyed or its memory is freed, its edges are removed
+// (RemoveNode()), since its LID may go to a new lock, see Lock::Destroy()
+// and Lock::ClearMemoryState(). The caches of the threads are then stale;
+// generation() tells them so.
+// Called under ts_lock.
+class LockOrderGraph {
+ public:
+  // Returns true if the edge is already known (added or reported).
+  static bool HasEdge(LID from, LID to) {
+    return edges_->count(EdgeKey(from, to)) != 0;
+  }
+
+  // Adds the edge from->to, which is not known yet, and takes the ownership
+  // of stack_trace. If the edge closes a cycle, it is only remembered as
+  // known: returns false and puts the path to, ..., from to 'cycle'.
+  static bool AddEdge(LID from, LID to, StackTrace *stack_trace,
+                      vector<LID> *cycle) {
+    uint64_t key = EdgeKey(from, to);
+    G_stats->Shard()->lock_order_edges++;
+    int32_t x = GetNode(from), y = GetNode(to);
+    int32_t lower = (*nodes_)[y].ord, upper = (*nodes_)[x].ord;
+    if (lower > upper) {
+      (*edges_)[key] = stack_trace;
+      Link(x, y);
+      return true;
+    }
+    // The order has to be fixed in [lower, upper].
+    epoch_++;
+    vector<int32_t> forward, backward;
+    if (!VisitForward(y, x, upper, &forward)) {
+      for (int32_t n = x; n != y; n = (*nodes_)[n].parent)
+        cycle->push_back(LID(n));
+      cycle->push_back(LID(y));
+      reverse(cycle->begin(), cycle->end());
+      StackTrace::Delete(stack_trace);
+      (*edges_)[key] = NULL;
+      (*nodes_)[x].cut.push_back(y);
+      (*nodes_)[y].cut.push_back(x);
+      return false;
+    }
+    VisitBackward(x, lower, &backward);
+    Reorder(&backward, &forward);
+    G_stats->Shard()->lock_order_reorders++;
+    (*edges_)[key] = stack_trace;
+    Link(x, y);
+    return true;
+  }
+
+  // Where the edge was first seen, the edge must be in the graph.
+  static StackTrace *EdgeStack(LID from, LID to) {
+    Edges::iterator it = edges_->find(EdgeKey(from, to));
+    CHECK(it != edges_->end() && it->second);
+    return it->second;
+  }
+
+  // Forgets the edges from and to the lock.
+  static void RemoveNode(LID lid) {
+    int32_t n = lid.raw();
+    if ((size_t)n >= nodes_->size()) return;
+    Node &node = (*nodes_)[n];
+    if (node.out.empty() && node.in.empty() && node.cut.empty()) return;
+    G_stats->Shard()->lock_order_removed++;
+    generation_++;
+    for (size_t i = 0; i < node.out.size(); i++) {
+      EraseEdge(n, node.out[i]);
+      Unlink(&(*nodes_)[node.out[i]].in, n);
+    }
+    for (size_t i = 0; i < node.in.size(); i++) {
+      EraseEdge(node.in[i], n);
+      Unlink(&(*nodes_)[node.in[i]].out, n);
+    }
+    for (size_t i = 0; i < node.cut.size(); i++) {
+      EraseEdge(n, node.cut[i]);
+      EraseEdge(node.cut[i], n);
+      Unlink(&(*nodes_)[node.cut[i]].cut, n);
+    }
+    node.out.clear();
+    node.in.clear();
+    node.cut.clear();
+  }
+
+  // Changes whenever edges are removed.
+  static uint32_t generation() { return generation_; }
+
+  static void InitClassMembers() {
+    edges_ = new Edges;
+    nodes_ = new vector<Node>;
+    epoch_ = 0;
+    generation_ = 0;
+  }
+
+ private:
+  struct Node {
+    int32_t ord;     // The position in the topological order.
+    int32_t parent;  // The previous node on the VisitForward() path.
+    uint32_t epoch;  // Visited by the AddEdge() of this epoch.
+    vector<int32_t> out, in;
+    vector<int32_t> cut;  // The other ends of the reported edges.
+  };
+  typedef unordered_map<uint64_t, StackTrace*> Edges;
+
+  static uint64_t EdgeKey(LID from, LID to) {
+    return ((uint64_t)(uint32_t)from.raw() << 32) | (uint32_t)to.raw();
+  }
+
+  // The nodes are indexed by LID. A new node goes to the end of the order.
+  static int32_t GetNode(LID lid) {
+    int32_t n = lid.raw();
+    CHECK(n > 0);
+    while (nodes_->size() <= (size_t)n) {
+      Node node;
+      node.ord = nodes_->size();
+      node.parent = 0;
+      node.epoch = 0;
+      nodes_->push_back(node);
+    }
+    return n;
+  }
+
+  static void Link(int32_t x, int32_t y) {
+    (*nodes_)[x].out.push_back(y);
+    (*nodes_)[y].in.push_back(x);
+  }
+
+  static void Unlink(vector<int32_t> *v, int32_t n) {
+    for (size_t i = 0; i < v->size(); ) {
+      if ((*v)[i] == n) {
+        (*v)[i] = v->back();
+        v->pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+
+  static void EraseEdge(int32_t x, int32_t y) {
+    Edges::iterator it = edges_->find(EdgeKey(LID(x), LID(y)));
+    if (it == edges_->end()) return;
+    StackTrace::Delete(it->second);
+    edges_->erase(it);
+  }
+
+  // Visits the nodes reachable from n with ord <= upper. Returns false if
+  // 'target' is one of them.
+  static bool VisitForward(int32_t n, int32_t target, int32_t upper,
+                           vector<int32_t> *visited) {
+    vector<int32_t> stack(1, n);
+    (*nodes_)[n].epoch = epoch_;
+    while (!stack.empty()) {
+      int32_t cur = stack.back();
+      stack.pop_back();
+      visited->push_back(cur);
+      vector<int32_t> &out = (*nodes_)[cur].out;
+      for (size_t i = 0; i < out.size(); i++) {
+        Node &next = (*nodes_)[out[i]];
+        if (next.epoch == epoch_ || next.ord > upper) continue;
+        next.epoch = epoch_;
+        next.parent = cur;
+        if (out[i] == target) return false;
+        stack.push_back(out[i]);
+      }
+    }
+    return true;
+  }
+
+  // Visits the nodes which reach n with ord >= lower.
+  static void VisitBackward(int32_t n, int32_t lower,
+                            vector<int32_t> *visited) {
+    vector<int32_t> stack(1, n);
+    (*nodes_)[n].epoch = epoch_;
+    while (!stack.empty()) {
+      int32_t cur = stack.back();
+      stack.pop_back();
+      visited->push_back(cur);
+      vector<int32_t> &in = (*nodes_)[cur].in;
+      for (size_t i = 0; i < in.size(); i++) {
+        Node &prev = (*nodes_)[in[i]];
+        if (prev.epoch == epoch_ || prev.ord < lower) continue;
+        prev.epoch = epoch_;
+        stack.push_back(in[i]);
+      }
+    }
+  }
+
+  struct OrdLess {
+    bool operator()(int32_t a, int32_t b) const {
+      return (*nodes_)[a].ord < (*nodes_)[b].ord;
+    }
+  };
+
+  // Gives the positions of the visited nodes to the backward ones first,
+  // keeping the relative order inside each group.
+  static void Reorder(vector<int32_t> *backward, vector<int32_t> *forward) {
+    sort(backward->begin(), backward->end(), OrdLess());
+    sort(forward->begin(), forward->end(), OrdLess());
+    vector<int32_t> nodes(*backward);
+    nodes.insert(nodes.end(), forward->begin(), forward->end());
+    vector<int32_t> ords(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+      ords[i] = (*nodes_)[nodes[i]].ord;
+    sort(ords.begin(), ords.end());
+    for (size_t i = 0; i < nodes.size(); i++)
+      (*nodes_)[nodes[i]].ord = ords[i];
+  }
+
+  static Edges *edges_;
+  static vector<Node> *nodes_;
+  static uint32_t epoch_;
+  static uint32_t generation_;
+};
+
+LockOrderGraph::Edges *LockOrderGraph::edges_;
+vector<LockOrderGraph::Node> *LockOrderGraph::nodes_;
+uint32_t LockOrderGraph::epoch_;
+uint32_t LockOrderGraph::generation_;
+
+static void RemoveLockOrderNode(LID lid) {
+  LockOrderGraph::RemoveNode(lid);
+}
+
 
 // -------- LockHistory ------------- {{{1
 // For each thread we store a limited amount of history of locks and unlocks.
@@ -3871,18 +6469,18 @@ struct LockHistory {
  public:
   // LockHistory which will track no more than `size` recent locks
   // and the same amount of unlocks.
-  LockHistory(size_t size): size_(size) { }
+  LockHistory(size_t size): locks_(size), unlocks_(size) { }
 
   // Record a Lock event.
   void OnLock(LID lid) {
     g_lock_era++;
-    Push(LockHistoryElement(lid, g_lock_era), &locks_);
+    locks_.Push(LockHistoryElement(lid, g_lock_era));
   }
 
   // Record an Unlock event.
   void OnUnlock(LID lid) {
     g_lock_era++;
-    Push(LockHistoryElement(lid, g_lock_era), &unlocks_);
+    unlocks_.Push(LockHistoryElement(lid, g_lock_era));
   }
 
   // Find locks such that:
@@ -3892,23 +6490,26 @@ struct LockHistory {
   // - Both eras are greater or equal than min_lock_era.
   static bool Intersect(const LockHistory &l, const LockHistory &u,
                         int32_t min_lock_era, set<LID> *locks) {
-    const Queue &lq = l.locks_;
-    const Queue &uq = u.unlocks_;
-    for (size_t i = 0; i < lq.size(); i++) {
+    const Ring &lq = l.locks_;
+    const Ring &uq = u.unlocks_;
+    // The eras grow along a ring, so the first unlock of a lock which is
+    // not older than min_lock_era is the earliest one.
+    map<LID, int32_t> first_unlock_era;
+    for (size_t j = uq.LowerBound(min_lock_era); j < uq.size(); j++) {
+      first_unlock_era.insert(make_pair(uq[j].lid, (int32_t)uq[j].lock_era));
+    }
+    if (first_unlock_era.empty()) return false;
+    for (size_t i = lq.LowerBound(min_lock_era); i < lq.size(); i++) {
       int32_t l_era = lq[i].lock_era;
-      if (l_era < min_lock_era) continue;
       LID lid = lq[i].lid;
+      map<LID, int32_t>::iterator it = first_unlock_era.find(lid);
+      if (it == first_unlock_era.end()) continue;
+      // Report("LockHistory::Intersect: L%d %d %d %d\n", lid.raw(), min_lock_era, it->second, l_era);
+      if (it->second > l_era) continue;
       // We don't want to report pure happens-before locks since
       // they already create h-b arcs.
       if (Lock::LIDtoLock(lid)->is_pure_happens_before()) continue;
-      for (size_t j = 0; j < uq.size(); j++) {
-        int32_t u_era = uq[j].lock_era;
-        if (lid != uq[j].lid) continue;
-        // Report("LockHistory::Intersect: L%d %d %d %d\n", lid.raw(), min_lock_era, u_era, l_era);
-        if (u_era < min_lock_era)  continue;
-        if (u_era > l_era) continue;
-        locks->insert(lid);
-      }
+      locks->insert(lid);
     }
     return !locks->empty();
   }
@@ -3924,18 +6525,46 @@ struct LockHistory {
         : lid(l),
         lock_era(era) {
         }
+    LockHistoryElement() : lid(0), lock_era(0) { }
   };
 
-  typedef deque<LockHistoryElement> Queue;
+  // A fixed-size ring buffer which keeps the last elements pushed.
+  // Element 0 is the oldest one.
+  class Ring {
+   public:
+    explicit Ring(size_t capacity) : elems_(capacity), n_pushed_(0) { }
 
-  void Push(LockHistoryElement e, Queue *q) {
-    CHECK(q->size() <= size_);
-    if (q->size() == size_)
-      q->pop_front();
-    q->push_back(e);
-  }
+    void Push(const LockHistoryElement &e) {
+      elems_[n_pushed_ % elems_.size()] = e;
+      n_pushed_++;
+    }
+
+    size_t size() const { return min(n_pushed_, elems_.size()); }
+
+    const LockHistoryElement &operator[] (size_t i) const {
+      DCHECK(i < size());
+      return elems_[(n_pushed_ - size() + i) % elems_.size()];
+    }
+
+    // The index of the first element with lock_era >= era.
+    size_t LowerBound(int32_t era) const {
+      size_t lo = 0, hi = size();
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((int32_t)(*this)[mid].lock_era < era)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+   private:
+    vector<LockHistoryElement> elems_;
+    size_t n_pushed_;
+  };
 
-  void Print(const Queue *q) const {
+  void Print(const Ring *q) const {
     set<LID> printed;
     for (size_t i = 0; i < q->size(); i++) {
       const LockHistoryElement &e = (*q)[i];
@@ -3946,9 +6575,8 @@ struct LockHistory {
     }
   }
 
-  Queue locks_;
-  Queue unlocks_;
-  size_t size_;
+  Ring locks_;
+  Ring unlocks_;
 };
 
 // -------- RecentSegmentsCache ------------- {{{1
@@ -3959,39 +6587,96 @@ struct LockHistory {
 //
 // We need to flush the cache when current lockset changes or the current
 // VTS changes or we do ForgetAllState.
+//
+// The segments are indexed by a hash of the three top frames of their
+// history stacks, so finding a segment with the same stack is O(1) and
+// does not depend on the cache size.
 // TODO(timurrrr): probably we can cache segments with different LSes and
 // compare their LS with the current LS.
 struct RecentSegmentsCache {
  public:
-  RecentSegmentsCache(int cache_size) : cache_size_(cache_size) {}
-  ~RecentSegmentsCache() { Clear(); }
+  RecentSegmentsCache(int cache_size) : cache_size_(cache_size) {
+    index_size_ = 16;
+    while (index_size_ < cache_size_ * 4)
+      index_size_ *= 2;
+    index_ = new SID[index_size_];
+  }
+  ~RecentSegmentsCache() {
+    Clear();
+    delete [] index_;
+  }
 
   void Clear() {
     ShortenQueue(0);
   }
 
+  // The history stack of 'sid' must be filled by now.
   void Push(SID sid) {
-    queue_.push_front(sid);
+    queue_.push_front(Entry(sid, StackKey(sid)));
+    AddToIndex(queue_.front());
     Segment::Ref(sid, "RecentSegmentsCache::ShortenQueue");
     ShortenQueue(cache_size_);
   }
 
+  // Call when the history stack of a cached segment has been refilled.
+  void Reindex(SID sid) {
+    for (deque<Entry>::iterator it = queue_.begin(); it != queue_.end();
+         ++it) {
+      if (it->sid != sid) continue;
+      RemoveFromIndex(*it);
+      it->key = StackKey(sid);
+      AddToIndex(*it);
+      return;
+    }
+  }
+
   void ForgetAllState() {
     queue_.clear();  // Don't unref - the segments are already dead.
+    for (size_t i = 0; i < index_size_; i++)
+      index_[i] = SID();
   }
 
+  // 'curr_sid_ref_delta' is the difference between the number of
+  // references to 'curr_sid' and its ref_count(),
+  // see TSanThread::RefCurrentSid().
   INLINE SID Search(CallStack *curr_stack,
-                    SID curr_sid, /*OUT*/ bool *needs_refill) {
+                    SID curr_sid, int32_t curr_sid_ref_delta,
+                    /*OUT*/ bool *needs_refill) {
+    // Check three top entries of the call stack of the recent segment.
+    // If they match the current segment stack, don't create a new segment.
+    // This can probably lead to a little bit wrong stack traces in rare
+    // occasions but we don't really care that much.
+    if (kSizeOfHistoryStackTrace > 0 && curr_stack->size() >= 3) {
+      size_t n = curr_stack->size();
+      uintptr_t top[3] = {(*curr_stack)[n-1], (*curr_stack)[n-2],
+                          (*curr_stack)[n-3]};
+      SID sid = index_[Hash(top) & (index_size_ - 1)];
+      if (sid.valid()) {
+        Segment::AssertLive(sid, __LINE__);
+        size_t emb_size;
+        const uintptr_t *emb_trace = Segment::history_stack(sid, &emb_size);
+        if (emb_size >= 3 &&  // This stack trace was filled
+            emb_trace[0] == top[0] &&
+            emb_trace[1] == top[1] &&
+            emb_trace[2] == top[2]) {
+          *needs_refill = false;
+          return sid;
+        }
+      }
+    }
+
     // TODO(timurrrr): we can probably move the matched segment to the head
     // of the queue.
-
-    deque<SID>::iterator it = queue_.begin();
-    for (; it != queue_.end(); it++) {
-      SID sid = *it;
+    size_t n_checks = min(queue_.size(), (size_t)kMaxUnusedChecks);
+    for (size_t i = 0; i < n_checks; i++) {
+      SID sid = queue_[i].sid;
       Segment::AssertLive(sid, __LINE__);
       Segment *seg = Segment::Get(sid);
+      int32_t ref_count = seg->ref_count();
+      if (sid == curr_sid)
+        ref_count += curr_sid_ref_delta;
 
-      if (seg->ref_count() == 1 + (sid == curr_sid)) {
+      if (ref_count == 1 + (sid == curr_sid)) {
         // The current segment is not used anywhere else,
         // so just replace the stack trace in it.
         // The refcount of an unused segment is equal to
@@ -4000,39 +6685,61 @@ struct RecentSegmentsCache {
         *needs_refill = true;
         return sid;
       }
-
-      // Check three top entries of the call stack of the recent segment.
-      // If they match the current segment stack, don't create a new segment.
-      // This can probably lead to a little bit wrong stack traces in rare
-      // occasions but we don't really care that much.
-      if (kSizeOfHistoryStackTrace > 0) {
-        size_t n = curr_stack->size();
-        uintptr_t *emb_trace = Segment::embedded_stack_trace(sid);
-        if(*emb_trace &&  // This stack trace was filled
-           curr_stack->size() >= 3 &&
-           emb_trace[0] == (*curr_stack)[n-1] &&
-           emb_trace[1] == (*curr_stack)[n-2] &&
-           emb_trace[2] == (*curr_stack)[n-3]) {
-          *needs_refill = false;
-          return sid;
-        }
-      }
     }
 
     return SID();
   }
 
  private:
+  // Checking the refcounts is a linear scan, so limit it for large caches.
+  // Unused segments are found among the recent ones most of the time.
+  enum { kMaxUnusedChecks = 16 };
+
+  struct Entry {
+    Entry(SID s, uint32_t k) : sid(s), key(k) { }
+    SID sid;
+    uint32_t key;  // Hash of the 3 top frames, 0 if there are fewer.
+  };
+
+  static INLINE uint32_t Hash(const uintptr_t *top) {
+    uint64_t h = 0;
+    for (int i = 0; i < 3; i++)
+      h = (h ^ (uint64_t)top[i]) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) | 1;
+  }
+
+  static uint32_t StackKey(SID sid) {
+    if (kSizeOfHistoryStackTrace == 0) return 0;
+    size_t emb_size;
+    const uintptr_t *emb_trace = Segment::history_stack(sid, &emb_size);
+    return emb_size >= 3 ? Hash(emb_trace) : 0;
+  }
+
+  // The index keeps only the latest segment for each slot; older ones
+  // with a colliding key are just not found.
+  void AddToIndex(const Entry &e) {
+    if (e.key)
+      index_[e.key & (index_size_ - 1)] = e.sid;
+  }
+
+  void RemoveFromIndex(const Entry &e) {
+    if (e.key && index_[e.key & (index_size_ - 1)] == e.sid)
+      index_[e.key & (index_size_ - 1)] = SID();
+  }
+
   void ShortenQueue(size_t flush_to_length) {
     while (queue_.size() > flush_to_length) {
-      SID sid = queue_.back();
-      Segment::Unref(sid, "RecentSegmentsCache::ShortenQueue");
+      Entry e = queue_.back();
       queue_.pop_back();
+      RemoveFromIndex(e);
+      Segment::Unref(e.sid, "RecentSegmentsCache::ShortenQueue");
     }
   }
 
-  deque<SID> queue_;
+  deque<Entry> queue_;
   size_t cache_size_;
+  SID *index_;  // index_size_ elements, invalid SID means empty.
+  size_t index_size_;
 };
 
 // -------- TraceInfo ------------------ {{{1
@@ -4099,6 +6806,79 @@ void TraceInfo::PrintTraceProfile() {
   }
 }
 
+// -------- SharingProfile --------------- {{{1
+// With --sharing_profile_file=<file> we remember the pc of every memory
+// access and whether an access at that pc ever found the memory accessed by
+// another thread. At exit, the routines which were executed but never
+// touched such memory are written to <file>, one (mangled) name per line.
+// The LLVM pass reads this file (-sharing-profile) and instruments these
+// routines in a cheap sampling-only mode, see bb_flush_sampled() in tsan_rtl.
+// Recording every access is slow, this is meant for profiling runs only.
+class SharingProfile {
+ public:
+  static void InitClassMembers() {
+    if (G_flags->sharing_profile_file.empty()) return;
+    lock_ = new TSLock;
+    pcs_ = new map<uintptr_t, bool>;
+  }
+
+  static INLINE bool enabled() { return pcs_ != NULL; }
+
+  static void OnAccess(uintptr_t pc, bool shared) {
+    TIL til(lock_, 10);
+    bool &seen_shared = (*pcs_)[pc];
+    seen_shared |= shared;
+  }
+
+  // True if the memory with the state 'sval' has been accessed only by
+  // thread 'tid' (or not at all).
+  static bool IsOwnedByThread(ShadowValue sval, TID tid) {
+    SSID ssids[2] = {sval.rd_ssid(), sval.wr_ssid()};
+    for (int i = 0; i < 2; i++) {
+      for (int s = 0; s < SegmentSet::Size(ssids[i]); s++) {
+        SID sid = SegmentSet::GetSID(ssids[i], s, __LINE__);
+        if (Segment::Tid(sid) != tid) return false;
+      }
+    }
+    return true;
+  }
+
+  static void Dump() {
+    if (!enabled()) return;
+    map<string, bool> rtns;  // Routine name => has touched shared memory.
+    {
+      TIL til(lock_, 10);
+      for (map<uintptr_t, bool>::iterator it = pcs_->begin();
+           it != pcs_->end(); ++it) {
+        string rtn = PcToRtnName(it->first, false);
+        if (rtn.empty()) continue;
+        rtns[rtn] |= it->second;
+      }
+    }
+    string res;
+    size_t n_thread_local = 0;
+    for (map<string, bool>::iterator it = rtns.begin();
+         it != rtns.end(); ++it) {
+      if (it->second) continue;
+      res += it->first + "\n";
+      n_thread_local++;
+    }
+    OpenFileWriteStringAndClose(G_flags->sharing_profile_file, res);
+    if (G_flags->verbosity >= 1) {
+      Report("INFO: %ld of %ld routines have touched only thread-local "
+             "memory, see %s\n", n_thread_local, rtns.size(),
+             G_flags->sharing_profile_file.c_str());
+    }
+  }
+
+ private:
+  static TSLock *lock_;
+  static map<uintptr_t, bool> *pcs_;  // pc => has touched shared memory.
+};
+
+TSLock *SharingProfile::lock_;
+map<uintptr_t, bool> *SharingProfile::pcs_;
+
 // -------- Atomicity --------------- {{{1
 // An attempt to detect atomicity violations (aka high level races).
 // Here we try to find a very restrictive pattern:
@@ -4151,7 +6931,7 @@ struct AtomicityRegion {
 
   void Print() {
     Report("T%d era=%d nmss=%ld AtomicityRegion:\n  rd: %s\n  wr: %s\n  %s\n%s",
-           tid.raw(),
+           SlotToFrontendTid(tid, vts),
            lock_era,
            n_mops_since_start,
            access_set[0].ToString().c_str(),
@@ -4167,85 +6947,244 @@ bool SimilarLockSetForAtomicity(AtomicityRegion *r1, AtomicityRegion *r2) {
   return ((r1->lsid[0] == r2->lsid[0]));
 }
 
-static deque<AtomicityRegion *> *g_atomicity_regions;
-static map<StackTrace *, int, StackTrace::Less> *reported_atomicity_stacks_;
+// The recent regions are kept in a window of kAtomicityWindow regions per
+// thread, which owns them, and are indexed by their reader lockset.
+// A new region r3 is checked only against the regions r2 of the other
+// threads with the same reader lockset which wrote or read what r3 wrote,
+// and r1 is looked up in the window of r2's thread.
+// A region which happens-before a new region with the same lockset leaves
+// the index: it can't be r2 for that region, and the threads which keep
+// syncing with the lock's users get past it as well. Each index entry keeps
+// at most kMaxAtomicityRegions regions.
+// Called under ts_lock.
+const size_t kAtomicityWindow = 4;
 const size_t kMaxAtomicityRegions = 8;
 
-static void HandleAtomicityRegion(AtomicityRegion *atomicity_region) {
-  if (!g_atomicity_regions) {
-    g_atomicity_regions = new deque<AtomicityRegion*>;
-    reported_atomicity_stacks_ = new map<StackTrace *, int, StackTrace::Less>;
+struct AtomicityWindow {
+  AtomicityRegion *regions[kAtomicityWindow];  // The newest first.
+  size_t size;
+};
+
+typedef unordered_map<int32_t, vector<AtomicityRegion*> > AtomicityIndex;
+static vector<AtomicityWindow> *g_atomicity_windows;
+static AtomicityIndex *g_atomicity_index;
+// The hashes of the stacks of the regions which have been reported.
+static unordered_set<uint64_t> *reported_atomicity_stacks_;
+
+static uint64_t AtomicityStackHash(StackTrace *stack_trace) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < stack_trace->size(); i++)
+    hash = (hash ^ (uint64_t)stack_trace->Get(i)) * 0x9E3779B97F4A7C15ULL;
+  return hash;
+}
+
+static void RemoveFromAtomicityIndex(AtomicityRegion *r) {
+  AtomicityIndex::iterator it = g_atomicity_index->find(r->lsid[0].raw());
+  if (it == g_atomicity_index->end()) return;
+  vector<AtomicityRegion*> &regions = it->second;
+  for (size_t i = 0; i < regions.size(); i++) {
+    if (regions[i] == r) {
+      regions.erase(regions.begin() + i);
+      break;
+    }
   }
+  if (regions.empty())
+    g_atomicity_index->erase(it);
+}
 
-  if (g_atomicity_regions->size() >= kMaxAtomicityRegions) {
-    AtomicityRegion *to_delete = g_atomicity_regions->back();
-    g_atomicity_regions->pop_back();
+// Puts r into the window of its thread, returns the window.
+static AtomicityWindow *AddToAtomicityWindow(AtomicityRegion *r) {
+  size_t tid = r->tid.raw();
+  if (tid >= g_atomicity_windows->size()) {
+    AtomicityWindow empty_window;
+    memset(&empty_window, 0, sizeof(empty_window));
+    g_atomicity_windows->resize(tid + 1, empty_window);
+  }
+  AtomicityWindow *window = &(*g_atomicity_windows)[tid];
+  if (window->size == kAtomicityWindow) {
+    AtomicityRegion *to_delete = window->regions[--window->size];
+    RemoveFromAtomicityIndex(to_delete);
     if (!to_delete->used) {
       VTS::Unref(to_delete->vts);
       StackTrace::Delete(to_delete->stack_trace);
       delete to_delete;
     }
   }
-  g_atomicity_regions->push_front(atomicity_region);
-  size_t n = g_atomicity_regions->size();
+  for (size_t i = window->size; i > 0; i--)
+    window->regions[i] = window->regions[i - 1];
+  window->regions[0] = r;
+  window->size++;
+  return window;
+}
 
-  if (0) {
-    for (size_t i = 0; i < n; i++) {
-      AtomicityRegion *r = (*g_atomicity_regions)[i];
-      r->Print();
-    }
-  }
-
-  AtomicityRegion *r3 = (*g_atomicity_regions)[0];
-  for (size_t i = 1; i < n; i++) {
-    AtomicityRegion *r2 = (*g_atomicity_regions)[i];
-    if (r2->tid     != r3->tid &&
-        SimilarLockSetForAtomicity(r2, r3) &&
-        !VTS::HappensBeforeCached(r2->vts, r3->vts)) {
-      for (size_t j = i + 1; j < n; j++) {
-        AtomicityRegion *r1 = (*g_atomicity_regions)[j];
-        if (r1->tid != r2->tid) continue;
-        CHECK(r2->lock_era > r1->lock_era);
-        if (r2->lock_era - r1->lock_era > 2) break;
-        if (!SimilarLockSetForAtomicity(r1, r2)) continue;
-        if (StackTrace::Equals(r1->stack_trace, r2->stack_trace)) continue;
-        if (!(r1->access_set[1].empty() &&
-              !r2->access_set[1].empty() &&
-              !r3->access_set[1].empty())) continue;
-        CHECK(r1->n_mops_since_start <= r2->n_mops_since_start);
-        if (r2->n_mops_since_start - r1->n_mops_since_start > 5) continue;
-        if ((*reported_atomicity_stacks_)[r1->stack_trace] > 0) continue;
-
-        (*reported_atomicity_stacks_)[r1->stack_trace]++;
-        (*reported_atomicity_stacks_)[r2->stack_trace]++;
-        (*reported_atomicity_stacks_)[r3->stack_trace]++;
-        r1->used = r2->used = r3->used = true;
-        ThreadSanitizerAtomicityViolationReport *report =
-            new ThreadSanitizerAtomicityViolationReport;
-        report->type = ThreadSanitizerReport::ATOMICITY_VIOLATION;
-        report->tid = TID(0);
-        report->stack_trace = r1->stack_trace;
-        report->r1 = r1;
-        report->r2 = r2;
-        report->r3 = r3;
-        ThreadSanitizerPrintReport(report);
-        break;
-      }
+static void ReportAtomicityViolation(AtomicityRegion *r1, AtomicityRegion *r2,
+                                     AtomicityRegion *r3) {
+  reported_atomicity_stacks_->insert(AtomicityStackHash(r1->stack_trace));
+  reported_atomicity_stacks_->insert(AtomicityStackHash(r2->stack_trace));
+  reported_atomicity_stacks_->insert(AtomicityStackHash(r3->stack_trace));
+  r1->used = r2->used = r3->used = true;
+  ThreadSanitizerAtomicityViolationReport *report =
+      new ThreadSanitizerAtomicityViolationReport;
+  report->type = ThreadSanitizerReport::ATOMICITY_VIOLATION;
+  report->tid = TID(0);
+  report->stack_trace = r1->stack_trace;
+  report->r1 = r1;
+  report->r2 = r2;
+  report->r3 = r3;
+  ThreadSanitizerPrintReport(report);
+}
+
+// Looks for r1 before r2 in r2's window. Returns true if reported.
+static bool CheckAtomicityTriple(AtomicityRegion *r2, AtomicityRegion *r3) {
+  AtomicityWindow &window = (*g_atomicity_windows)[r2->tid.raw()];
+  size_t i = 0;
+  while (i < window.size && window.regions[i] != r2)
+    i++;
+  for (i++; i < window.size; i++) {
+    AtomicityRegion *r1 = window.regions[i];
+    CHECK(r2->lock_era > r1->lock_era);
+    if (r2->lock_era - r1->lock_era > 2) break;
+    if (!SimilarLockSetForAtomicity(r1, r2)) continue;
+    if (StackTrace::Equals(r1->stack_trace, r2->stack_trace)) continue;
+    if (!(r1->access_set[1].empty() &&
+          !r2->access_set[1].empty() &&
+          !r3->access_set[1].empty())) continue;
+    CHECK(r1->n_mops_since_start <= r2->n_mops_since_start);
+    if (r2->n_mops_since_start - r1->n_mops_since_start > 5) continue;
+    if (reported_atomicity_stacks_->count(
+            AtomicityStackHash(r1->stack_trace))) continue;
+    ReportAtomicityViolation(r1, r2, r3);
+    return true;
+  }
+  return false;
+}
+
+static void HandleAtomicityRegion(AtomicityRegion *atomicity_region) {
+  if (!g_atomicity_windows) {
+    g_atomicity_windows = new vector<AtomicityWindow>;
+    g_atomicity_index = new AtomicityIndex;
+    reported_atomicity_stacks_ = new unordered_set<uint64_t>;
+  }
+
+  AtomicityRegion *r3 = atomicity_region;
+  AddToAtomicityWindow(r3);
+  vector<AtomicityRegion*> &regions = (*g_atomicity_index)[r3->lsid[0].raw()];
+
+  for (size_t i = 0; i < regions.size(); ) {
+    AtomicityRegion *r2 = regions[i];
+    if (VTS::HappensBeforeCached(r2->vts, r3->vts)) {
+      // Dominated by r3, retire it from the index.
+      regions.erase(regions.begin() + i);
+      continue;
     }
+    i++;
+    if (r2->tid == r3->tid) continue;
+    if (!r3->access_set[1].Intersects(r2->access_set[0]) &&
+        !r3->access_set[1].Intersects(r2->access_set[1])) continue;
+    if (CheckAtomicityTriple(r2, r3)) break;
   }
+
+  if (regions.size() >= kMaxAtomicityRegions)
+    regions.erase(regions.begin());
+  regions.push_back(r3);
 }
 
+// -------- CachedAddrMap ------------------ {{{1
+// unordered_map from an address to T with a small direct-mapped cache of
+// the recently used elements in front of it. Sync objects which are
+// signalled at high rates are found in the cache w/o hashing into the map.
+// The elements do not move, so a cached pointer stays valid until the
+// element is erased.
+template <class T>
+class CachedAddrMap {
+ public:
+  typedef unordered_map<uintptr_t, T> Map;
+  typedef typename Map::iterator iterator;
+
+  CachedAddrMap() {
+    memset(cache_, 0, sizeof(cache_));
+  }
+
+  // Returns NULL if there is no element for 'a'.
+  T *Find(uintptr_t a) {
+    Entry &e = cache_[Index(a)];
+    if (e.val && e.addr == a)
+      return e.val;
+    iterator it = map_.find(a);
+    if (it == map_.end())
+      return NULL;
+    e.addr = a;
+    e.val = &it->second;
+    return e.val;
+  }
+
+  // Creates a value-initialized element if there is none.
+  T *Get(uintptr_t a) {
+    Entry &e = cache_[Index(a)];
+    if (e.val && e.addr == a)
+      return e.val;
+    e.addr = a;
+    e.val = &map_[a];
+    return e.val;
+  }
+
+  void Erase(uintptr_t a) {
+    Entry &e = cache_[Index(a)];
+    if (e.addr == a)
+      e.val = NULL;
+    map_.erase(a);
+  }
+
+  void clear() {
+    map_.clear();
+    memset(cache_, 0, sizeof(cache_));
+  }
+
+  iterator begin() { return map_.begin(); }
+  iterator end() { return map_.end(); }
+
+ private:
+  enum { kCacheSize = 64 };
+
+  struct Entry {
+    uintptr_t addr;
+    T *val;
+  };
+
+  static size_t Index(uintptr_t a) {
+    return (a ^ (a >> 6)) % kCacheSize;
+  }
+
+  Map map_;
+  Entry cache_[kCacheSize];
+};
+
 // -------- TSanThread ------------------ {{{1
+struct EventSampleBuffer;
+
 struct TSanThread {
  public:
   ThreadLocalStats stats;
 
+  // 'history_ring' is the ring of the thread which had the slot, see
+  // Create(), may be NULL.
   TSanThread(TID tid, TID parent_tid, VTS *vts, StackTrace *creation_context,
-         CallStack *call_stack)
+         CallStack *call_stack, bool own_call_stack,
+         HistoryRing *history_ring)
     : is_running_(true),
+      joined_(false),
+      in_free_slots_(false),
       tid_(tid),
       sid_(0),
+      sid_biased_(false),
+      sid_pending_refs_(0),
       parent_tid_(parent_tid),
+      frontend_tid_(tid_to_slot_ ? slot_to_tid_[tid.raw()] : tid.raw()),
+      parent_frontend_tid_(tid_to_slot_ && parent_tid.valid()
+                           ? Get(parent_tid)->frontend_tid_
+                           : parent_tid.raw()),
+      start_clk_(vts->clk(tid)),
+      parent_clk_(parent_tid.valid() ? vts->clk(parent_tid) : 0),
       max_sp_(0),
       min_sp_(0),
       stack_size_for_ignore_(0),
@@ -4258,17 +7197,44 @@ struct TSanThread {
       wr_lockset_(0),
       expensive_bits_(0),
       vts_at_exit_(NULL),
+      vts_arena_(VtsArena::Acquire()),
+      tree_clock_(NULL),
+      tree_clock_vts_id_(0),
       call_stack_(call_stack),
+      history_ring_(NULL),
+      sid_has_sblock_(false),
+      own_call_stack_(own_call_stack),
+      sblock_done_pc_(0),
+      last_history_stack_(kSizeOfHistoryStackTrace),
+      last_history_stack_size_(0),
+      last_history_stack_id_(0),
       lock_history_(128),
+      lock_order_cache_(),
+      lock_order_cache_generation_(0),
       recent_segments_cache_(G_flags->recent_segments_cache_size),
       inside_atomic_op_(),
       rand_state_((unsigned)(tid.raw() + (uintptr_t)vts
                       + (uintptr_t)creation_context
-                      + (uintptr_t)call_stack)) {
-
+                      + (uintptr_t)call_stack)),
+      event_samples_(NULL) {
+
+    // The ring needs the routine calls and returns as events; a call stack
+    // kept by the instrumented code (tsan_rtl) does not send them.
+    if (g_history_rings && own_call_stack) {
+      if (history_ring)
+        history_ring->Clear();
+      else
+        history_ring = new HistoryRing(G_flags->history_ring);
+      history_ring_ = history_ring;
+      g_history_rings[tid.raw()] = history_ring_;
+    } else {
+      delete history_ring;
+    }
     NewSegmentWithoutUnrefingOld("TSanThread Creation", vts);
     ignore_depth_[0] = ignore_depth_[1] = 0;
 
+    frame_low_ = stack_low_ = kNoStackAccess;
+    frame_lows_ = G_flags->lazy_stack_reset > 0 ? new vector<uintptr_t> : NULL;
     HandleRtnCall(0, 0, IGNORE_BELOW_RTN_UNKNOWN);
     ignore_context_[0] = NULL;
     ignore_context_[1] = NULL;
@@ -4286,8 +7252,36 @@ struct TSanThread {
     ComputeExpensiveBits();
   }
 
+  // The threads are never deleted, an ended thread whose slot is reused is
+  // destroyed and created again in place, see Create().
+  ~TSanThread();
+
+  // Creates the thread in the slot 'tid'. If the slot has been taken from an
+  // ended thread (see NewSlot()), its object is reused in place, along with
+  // its history ring and sample buffer.
+  static TSanThread *Create(TID tid, TID parent_tid, VTS *vts,
+                            StackTrace *creation_context,
+                            CallStack *call_stack, bool own_call_stack) {
+    TSanThread *thr = tid_to_slot_ ? GetIfExists(tid) : NULL;
+    if (!thr) {
+      return new TSanThread(tid, parent_tid, vts, creation_context,
+                            call_stack, own_call_stack, NULL);
+    }
+    HistoryRing *history_ring = thr->history_ring_;
+    EventSampleBuffer *event_samples = thr->event_samples_;
+    thr->history_ring_ = NULL;
+    thr->event_samples_ = NULL;
+    thr->~TSanThread();
+    all_threads_[tid.raw()] = NULL;
+    new (thr) TSanThread(tid, parent_tid, vts, creation_context,
+                         call_stack, own_call_stack, history_ring);
+    thr->event_samples_ = event_samples;
+    return thr;
+  }
+
   TID tid() const { return tid_; }
   TID parent_tid() const { return parent_tid_; }
+  int32_t frontend_tid() const { return frontend_tid_; }
 
   void increment_n_mops_since_start() {
     n_mops_since_start_++;
@@ -4311,6 +7305,7 @@ struct TSanThread {
     CHECK(stack_max - stack_min <= 64 * 1024 * 1024);
     min_sp_ = stack_min;
     max_sp_ = stack_max;
+    frame_low_ = stack_low_ = kNoStackAccess;
     if (G_flags->ignore_stack) {
       min_sp_for_ignore_ = min_sp_;
       stack_size_for_ignore_ = max_sp_ - min_sp_;
@@ -4328,47 +7323,131 @@ struct TSanThread {
     return (a - min_sp_for_ignore_) < stack_size_for_ignore_;
   }
 
+  // --lazy_stack_reset. RTN_EXIT does not tell us the SP, so we use the
+  // accesses instead: frame_low_ is the lowest address of our stack the
+  // current frame has accessed, frame_lows_ keeps these of the callers and
+  // stack_low_ is the lowest address accessed since the last reset.
+  // A frame accesses its own locals and its callers' ones, all of which are
+  // above its SP, so once a callee returns everything below frame_low_ is
+  // dead. The frames are reset in bulk, when --lazy_stack_reset bytes are
+  // dead, see Detector::HandleRtnExit().
+  static const uintptr_t kNoStackAccess = (uintptr_t)-1;
+
+  INLINE void NoteStackAccess(uintptr_t a) {
+    if (a < frame_low_ && MemoryIsInStack(a)) {
+      frame_low_ = a;
+      if (a < stack_low_) stack_low_ = a;
+    }
+  }
+
+  // Returns the dead part of the stack as [*a, *b) and forgets it
+  // or returns false if it is too small to bother.
+  bool GetPoppedStackFrames(uintptr_t *a, uintptr_t *b) {
+    if (frame_low_ == kNoStackAccess || stack_low_ >= frame_low_ ||
+        frame_low_ - stack_low_ < (uintptr_t)G_flags->lazy_stack_reset) {
+      return false;
+    }
+    *a = stack_low_;
+    *b = frame_low_;
+    stack_low_ = frame_low_;
+    return true;
+  }
+
 
   bool Announce() {
     if (announced_) return false;
     announced_ = true;
-    if (tid_ == TID(0)) {
+    AnnounceCreation(frontend_tid_, parent_frontend_tid_, creation_context_,
+                     parent_tid_, parent_clk_);
+    return true;
+  }
+
+  // Prints where the thread 'tid' has been created by 'parent_tid' (frontend
+  // TIDs) and announces the parent, which had the clock 'parent_clk' in
+  // 'parent_slot'.
+  static void AnnounceCreation(int32_t tid, int32_t parent_tid,
+                               StackTrace *creation_context,
+                               TID parent_slot, int32_t parent_clk) {
+    if (tid == 0) {
       Report("INFO: T0 is program's main thread\n");
     } else {
       if (G_flags->announce_threads) {
         Report("INFO: T%d has been created by T%d at this point: {{{\n%s}}}\n",
-               tid_.raw(), parent_tid_.raw(),
-               creation_context_->ToString().c_str());
-        TSanThread * parent = GetIfExists(parent_tid_);
-        CHECK(parent);
-        parent->Announce();
+               tid, parent_tid, creation_context->ToString().c_str());
+        CHECK(tid_to_slot_ || GetIfExists(parent_slot));
+        AnnounceThread(parent_slot, parent_clk);
       } else {
         Report("INFO: T%d has been created by T%d. "
                "Use --announce-threads to see the creation stack.\n",
-               tid_.raw(), parent_tid_.raw());
+               tid, parent_tid);
       }
     }
-    return true;
+  }
+
+  // Announces the thread which had the clock 'clk' in 'slot', see
+  // GetByClock().
+  static void AnnounceThread(TID slot, int32_t clk) {
+    PastThread *past;
+    TSanThread *thr = GetByClock(slot, clk, &past);
+    if (thr) {
+      thr->Announce();
+    } else if (past && !past->announced) {
+      past->announced = true;
+      AnnounceCreation(past->tid, past->parent_tid, past->creation_context,
+                       past->parent_slot, past->parent_clk);
+    }
   }
 
   string ThreadName() const {
+    return FormatThreadName(frontend_tid_, thread_name_);
+  }
+
+  static string FormatThreadName(int32_t tid, const string &thread_name) {
     char buff[100];
-    snprintf(buff, sizeof(buff), "T%d", tid().raw());
+    snprintf(buff, sizeof(buff), "T%d", tid);
     string res = buff;
-    if (thread_name_.length() > 0) {
+    if (thread_name.length() > 0) {
       res += " (";
-      res += thread_name_;
+      res += thread_name;
       res += ")";
     }
     return res;
   }
 
+  // The name of the thread which had the clock 'clk' in 'slot'.
+  static string ThreadName(TID slot, int32_t clk) {
+    PastThread *past;
+    TSanThread *thr = GetByClock(slot, clk, &past);
+    if (thr) return thr->ThreadName();
+    DCHECK(past);
+    return past ? FormatThreadName(past->tid, past->thread_name) : "T?";
+  }
+
+  // The frontend TID of the thread which had the clock 'clk' in 'slot'.
+  static int32_t FrontendTid(TID slot, int32_t clk) {
+    PastThread *past;
+    TSanThread *thr = GetByClock(slot, clk, &past);
+    if (thr) return thr->frontend_tid_;
+    DCHECK(past);
+    return past ? past->tid : -1;
+  }
+
+  // Ditto, for the thread whose VTS was 'vts'.
+  static int32_t FrontendTid(TID slot, const VTS *vts) {
+    if (!tid_to_slot_ || !vts) return slot.raw();
+    return FrontendTid(slot, vts->clk(slot));
+  }
+
   bool is_running() const { return is_running_; }
 
   INLINE void ComputeExpensiveBits() {
     bool has_expensive_flags = G_flags->trace_level > 0 ||
         G_flags->show_stats > 1                      ||
-        G_flags->sample_events > 0;
+        G_flags->sample_events > 0                   ||
+        G_flags->latency_stats                       ||
+        !G_flags->sharing_profile_file.empty()       ||
+        !G_flags->detector_profile.empty()           ||
+        G_flags->lazy_stack_reset > 0;
 
     expensive_bits_ =
         (ignore_depth_[0] != 0) |
@@ -4377,6 +7456,7 @@ struct TSanThread {
   }
 
   int expensive_bits() { return expensive_bits_; }
+  ParkedLines *parked_lines() { return &parked_lines_; }
   int ignore_reads() { return expensive_bits() & 1; }
   int ignore_writes() { return (expensive_bits() >> 1) & 1; }
 
@@ -4423,23 +7503,53 @@ struct TSanThread {
     CHECK(!vts_at_exit_);
     vts_at_exit_ = vts()->Clone();
     CHECK(vts_at_exit_);
+    UnbiasCurrentSid();
     FlushDeadSids();
     ReleaseFreshSids();
-    delete call_stack_;
+    VtsArena::Release(vts_arena_);
+    vts_arena_ = NULL;
+    if (own_call_stack_)
+      delete call_stack_;
     call_stack_ = NULL;
+    delete frame_lows_;
+    frame_lows_ = NULL;
+    parked_lines_.Lock();
+    parked_lines_.UnparkAll();
+    parked_lines_.Unlock();
   }
 
-  // Return the TID of the joined child and it's vts
+  // Return the TID of the joined child and it's vts, which the caller
+  // should Unref. 'joined_tid' is a frontend TID, see NewSlot().
+  // With --reuse_dead_tids *vts_at_exit may be NULL: the child has ended
+  // before a flush and there is nothing left to synchronize with.
   TID HandleThreadJoinAfter(VTS **vts_at_exit, TID joined_tid) {
     CHECK(joined_tid.raw() > 0);
+    if (tid_to_slot_) {
+      TID slot = TidToSlot(joined_tid.raw());
+      if (!slot.valid() || slot_to_tid_[slot.raw()] != joined_tid.raw()) {
+        // The slot has been given to another thread.
+        *vts_at_exit = NULL;
+        map<int32_t, VTS*>::iterator it =
+            unjoined_vts_at_exit_->find(joined_tid.raw());
+        if (it != unjoined_vts_at_exit_->end()) {
+          *vts_at_exit = it->second;
+          unjoined_vts_at_exit_->erase(it);
+        }
+        return joined_tid;
+      }
+      joined_tid = slot;
+    }
     CHECK(GetIfExists(joined_tid) != NULL);
     TSanThread* joined_thread  = TSanThread::Get(joined_tid);
     // Sometimes the joined thread is not truly dead yet.
     // In that case we just take the current vts.
-    if (joined_thread->is_running_)
+    if (joined_thread->is_running_) {
       *vts_at_exit = joined_thread->vts()->Clone();
-    else
-      *vts_at_exit = joined_thread->vts_at_exit_;
+    } else {
+      *vts_at_exit = joined_thread->vts_at_exit_->Clone();
+      joined_thread->joined_ = true;
+      SlotMayBeFree(joined_tid);
+    }
 
     if (*vts_at_exit == NULL) {
       Printf("vts_at_exit==NULL; parent=%d, child=%d\n",
@@ -4467,6 +7577,175 @@ struct TSanThread {
     return all_threads_[tid.raw()];
   }
 
+  // --------- Thread slots (--reuse_dead_tids)
+  // The TIDs of the frontend never repeat, so with many short threads the
+  // VTSs, all_threads_ and everything else indexed by TID grow without
+  // bound. With --reuse_dead_tids the frontend TIDs are mapped to slots,
+  // which are the TIDs used inside (e.g. in VTS and Segment), and the slot
+  // of an ended thread is given to a new thread if
+  //  - the old thread has been joined and the new one starts after that,
+  //    so all the old accesses happen-before the new ones anyway, or
+  //  - none of the segments of the old thread is alive, so none of the old
+  //    accesses is left in the shadow memory.
+  // Either way sharing the TID can not hide a race. The new thread
+  // continues the clock of the old one, so the VTSs which know the old
+  // thread do not happen-after the new one.
+  // The reports name the frontend TIDs: the clock of a segment tells which
+  // of the threads of its slot it belongs to, see GetByClock().
+  // Slot 0 is always the main thread.
+  static const size_t kMaxFreeSlotChecks = 4;
+
+  // Returns the slot of the frontend TID 'tid'.
+  static INLINE TID TidToSlot(int32_t tid) {
+    if (!tid_to_slot_) return TID(tid);
+    DCHECK(tid >= 0 && tid < G_flags->max_n_threads);
+    return TID(tid_to_slot_[tid]);
+  }
+
+  static TSanThread *GetByFrontendTid(int32_t tid) {
+    return Get(TidToSlot(tid));
+  }
+
+  // Returns the slot for a new thread with the frontend TID 'tid' and sets
+  // *clk to the first clock of the thread. 'start_vts' is what the new
+  // thread knows at the start (i.e. its parent's VTS), may be NULL.
+  // The dead thread which had the slot stays in all_threads_ until Create()
+  // reuses it.
+  static TID NewSlot(int32_t tid, const VTS *start_vts, int32_t *clk) {
+    *clk = 1;
+    if (!tid_to_slot_) return TID(tid);
+    CHECK(tid >= 0 && tid < G_flags->max_n_threads);
+    map<int32_t, VTS*>::iterator it = unjoined_vts_at_exit_->find(tid);
+    if (it != unjoined_vts_at_exit_->end()) {
+      VTS::Unref(it->second);
+      unjoined_vts_at_exit_->erase(it);
+    }
+    int32_t slot = tid == 0 ? 0 : TakeFreeSlot(start_vts);
+    if (slot > 0) {
+      TSanThread *old = all_threads_[slot];
+      *clk = old->vts_at_exit_->clk(TID(slot)) + 1;
+      if (!old->joined_) {
+        (*unjoined_vts_at_exit_)[slot_to_tid_[slot]] = old->vts_at_exit_;
+        old->vts_at_exit_ = NULL;
+      }
+      old->Retire();
+      G_stats->Shard()->thread_slot_reuse++;
+    } else if (slot < 0) {
+      slot = max(n_threads_, 1);
+    }
+    tid_to_slot_[tid] = slot;
+    slot_to_tid_[slot] = tid;
+    return TID(slot);
+  }
+
+  // What the reports need of an ended thread after its slot has been given
+  // to another thread, see GetByClock().
+  struct PastThread {
+    int32_t start_clk;
+    int32_t tid;  // The frontend TIDs.
+    int32_t parent_tid;
+    TID parent_slot;
+    int32_t parent_clk;
+    StackTrace *creation_context;
+    string thread_name;
+    bool announced;
+  };
+
+  // Moves what the reports need of this ended thread to past_threads_,
+  // its slot is being given to another thread.
+  void Retire() {
+    if (Segment::NumberOfSegmentsOfTid(tid_) == 0)
+      ForgetPastThreads(tid_);
+    PastThread past = {start_clk_, frontend_tid_, parent_frontend_tid_,
+                       parent_tid_, parent_clk_, creation_context_,
+                       thread_name_, announced_};
+    (*past_threads_)[tid_.raw()].push_back(past);
+    creation_context_ = NULL;
+  }
+
+  // Returns the thread which had the clock 'clk' in 'slot' if it still has
+  // the slot. Otherwise returns NULL and sets *past to what is left of the
+  // thread, or to NULL if it has been forgotten (see ForgetPastThreads()).
+  // The threads of a slot have disjoint clock ranges since a new thread
+  // continues the clock of the old one, see NewSlot().
+  static TSanThread *GetByClock(TID slot, int32_t clk, PastThread **past) {
+    *past = NULL;
+    TSanThread *thr = GetIfExists(slot);
+    if (!tid_to_slot_ || (thr && clk >= thr->start_clk_))
+      return thr;
+    map<int32_t, vector<PastThread> >::iterator it =
+        past_threads_->find(slot.raw());
+    if (it == past_threads_->end()) return NULL;
+    vector<PastThread> &threads = it->second;
+    for (size_t i = threads.size(); i > 0; i--) {
+      if (clk >= threads[i - 1].start_clk) {
+        *past = &threads[i - 1];
+        break;
+      }
+    }
+    return NULL;
+  }
+
+  // Forgets the ended threads which had 'slot' before its current thread.
+  // Called when the slot has no segments left, so only the announcements of
+  // their children may look for them.
+  static void ForgetPastThreads(TID slot) {
+    if (!past_threads_) return;
+    map<int32_t, vector<PastThread> >::iterator it =
+        past_threads_->find(slot.raw());
+    if (it == past_threads_->end()) return;
+    for (size_t i = 0; i < it->second.size(); i++)
+      StackTrace::Delete(it->second[i].creation_context);
+    past_threads_->erase(it);
+  }
+
+  // Drops the references of an ended thread to its segments, so that its
+  // slot can be reused.
+  void ReleaseSegments() {
+    CHECK(!is_running_);
+    recent_segments_cache_.Clear();
+    SID sid = sid_;
+    sid_ = SID();
+    Segment::Unref(sid, "TSanThread::ReleaseSegments");
+    SlotMayBeFree(tid_);
+  }
+
+  // Puts the slot to free_slots_ if its thread has ended and has either
+  // been joined or has no segments left.
+  static void SlotMayBeFree(TID slot) {
+    if (!tid_to_slot_ || slot == TID(0)) return;
+    TSanThread *thr = all_threads_[slot.raw()];
+    if (!thr || thr->is_running_ || thr->in_free_slots_ ||
+        thr->sid_.valid()) {
+      return;
+    }
+    if (!thr->joined_ && Segment::NumberOfSegmentsOfTid(slot) != 0)
+      return;
+    thr->in_free_slots_ = true;
+    free_slots_->push_back(slot.raw());
+  }
+
+  // Removes from free_slots_ and returns a slot which may be given to a new
+  // thread which knows 'start_vts', or returns -1. Only the recently freed
+  // slots are looked at.
+  static int32_t TakeFreeSlot(const VTS *start_vts) {
+    size_t n = free_slots_->size();
+    for (size_t i = n; i > 0 && i + kMaxFreeSlotChecks > n; i--) {
+      int32_t slot = (*free_slots_)[i - 1];
+      TSanThread *thr = all_threads_[slot];
+      DCHECK(thr->in_free_slots_);
+      // With --history_ring the live segments need the ring of the thread.
+      bool reusable = Segment::NumberOfSegmentsOfTid(TID(slot)) == 0 ||
+          (start_vts && !g_history_rings &&
+           start_vts->clk(TID(slot)) >= thr->vts_at_exit_->clk(TID(slot)));
+      if (!reusable) continue;
+      (*free_slots_)[i - 1] = free_slots_->back();
+      free_slots_->pop_back();
+      return slot;
+    }
+    return -1;
+  }
+
   void HandleAccessSet() {
     BitSet *rd_set = lock_era_access_set(false);
     BitSet *wr_set = lock_era_access_set(true);
@@ -4489,10 +7768,54 @@ struct TSanThread {
     HandleAtomicityRegion(atomicity_region);
   }
 
+  // Adds the edges from the held locks to 'lock' to the lock order graph,
+  // reports the cycles.
+  void HandleLockOrder(Lock *lock) {
+    // The reader lockset has the writer locks as well.
+    LID held[16];
+    size_t n_held = LockSet::GetLocks(rd_lockset_, held, TS_ARRAY_SIZE(held));
+    LID to = lock->lid();
+    for (size_t i = 0; i < n_held; i++) {
+      if (held[i] == to) return;  // A recursive lock.
+    }
+    if (lock_order_cache_generation_ != LockOrderGraph::generation()) {
+      // Some of the cached edges may be gone.
+      memset(lock_order_cache_, 0, sizeof(lock_order_cache_));
+      lock_order_cache_generation_ = LockOrderGraph::generation();
+    }
+    for (size_t i = 0; i < n_held; i++) {
+      LID from = held[i];
+      uint64_t key = ((uint64_t)(uint32_t)from.raw() << 32) |
+          (uint32_t)to.raw();
+      uint64_t &cached = lock_order_cache_[
+          (key * 0x9E3779B97F4A7C15ULL >> 32) % kLockOrderCacheSize];
+      if (cached == key) {
+        G_stats->Shard()->lock_order_cache_hit++;
+        continue;
+      }
+      cached = key;
+      if (LockOrderGraph::HasEdge(from, to)) continue;
+      vector<LID> cycle;
+      if (LockOrderGraph::AddEdge(from, to, CreateStackTrace(), &cycle))
+        continue;
+      ThreadSanitizerLockOrderReport *report =
+          new ThreadSanitizerLockOrderReport;
+      report->cycle.swap(cycle);
+      report->type = ThreadSanitizerReport::LOCK_ORDER;
+      report->tid = tid();
+      report->stack_trace = CreateStackTrace();
+      ThreadSanitizerPrintReport(report);
+    }
+  }
+
   // Locks
   void HandleLock(uintptr_t lock_addr, bool is_w_lock) {
+    ScopedLatency latency(LATENCY_LOCK, G_flags->latency_stats);
     Lock *lock = Lock::LookupOrCreate(lock_addr);
 
+    if (G_flags->detect_deadlocks)
+      HandleLockOrder(lock);
+
     if (debug_lock) {
       Printf("T%d lid=%d %sLock   %p; %s\n",
            tid_.raw(), lock->lid().raw(),
@@ -4519,8 +7842,13 @@ struct TSanThread {
       lock->RdLock(CreateStackTrace());
     }
 
+    // The lockset is already updated, so if the wait creates a new segment
+    // it is the one we need. The wait creates nothing if the lock was last
+    // released by us (or by somebody who happens-before us).
+    SID old_sid = sid();
     if (lock->is_pure_happens_before()) {
       if (is_w_lock) {
+        JoinReaderReleases(lock->wr_signal_addr());
         HandleWait(lock->wr_signal_addr());
       } else {
         HandleWait(lock->rd_signal_addr());
@@ -4530,12 +7858,18 @@ struct TSanThread {
     if (G_flags->suggest_happens_before_arcs) {
       lock_history_.OnLock(lock->lid());
     }
-    NewSegmentForLockingEvent();
+    if (sid() == old_sid) {
+      NewSegmentForLockingEvent();
+    } else {
+      G_stats->Shard()->lock_segments_saved++;
+      recent_segments_cache_.Clear();
+    }
     lock_era_access_set_[0].Clear();
     lock_era_access_set_[1].Clear();
   }
 
   void HandleUnlock(uintptr_t lock_addr) {
+    ScopedLatency latency(LATENCY_UNLOCK, G_flags->latency_stats);
     HandleAccessSet();
 
     Lock *lock = Lock::Lookup(lock_addr);
@@ -4561,16 +7895,24 @@ struct TSanThread {
       ReportStackTrace(0, 7);
     }
 
-    if (lock->is_pure_happens_before()) {
+    // The signals share one new segment which is created after the
+    // lockset is updated, so the segment serves as the locking event's one.
+    bool signalled = lock->is_pure_happens_before();
+    if (signalled) {
       // reader unlock signals only to writer lock,
       // writer unlock signals to both.
       if (is_w_lock) {
-        HandleSignal(lock->rd_signal_addr());
+        UpdateSignaller(lock->rd_signal_addr());
+        UpdateSignaller(lock->wr_signal_addr());
+      } else {
+        AddReaderRelease(lock->wr_signal_addr());
       }
-      HandleSignal(lock->wr_signal_addr());
     }
 
     if (!lock->wr_held() && !lock->rd_held()) {
+      if (signalled) {
+        NewSegmentForSignal();
+      }
       ThreadSanitizerBadUnlockReport *report =
           new ThreadSanitizerBadUnlockReport;
       report->type = ThreadSanitizerReport::UNLOCK_NONLOCKED;
@@ -4605,7 +7947,17 @@ struct TSanThread {
       lock_history_.OnUnlock(lock->lid());
     }
 
-    NewSegmentForLockingEvent();
+    if (signalled) {
+      // Every other thread's VTS is unchanged, so the tick is enough.
+      NewSegmentForSignal();
+      G_stats->Shard()->lock_segments_saved += is_w_lock ? 2 : 1;
+      if (debug_happens_before && is_w_lock) {
+        DebugPrintSignal(lock->rd_signal_addr());
+        DebugPrintSignal(lock->wr_signal_addr());
+      }
+    } else {
+      NewSegmentForLockingEvent();
+    }
     lock_era_access_set_[0].Clear();
     lock_era_access_set_[1].Clear();
   }
@@ -4618,17 +7970,22 @@ struct TSanThread {
                        size_t size);
 
   void HandleForgetSignaller(uintptr_t cv) {
-    SignallerMap::iterator it = signaller_map_->find(cv);
-    if (it != signaller_map_->end()) {
+    Signaller *signaller = signaller_map_->Find(cv);
+    if (signaller) {
       if (debug_happens_before) {
         Printf("T%d: ForgetSignaller: %p:\n    %s\n", tid_.raw(), cv,
-            (it->second.vts)->ToString().c_str());
+            (signaller->vts)->ToString().c_str());
         if (G_flags->debug_level >= 1) {
           ReportStackTrace();
         }
       }
-      VTS::Unref(it->second.vts);
-      signaller_map_->erase(it);
+      signaller->Clear();
+      signaller_map_->Erase(cv);
+    }
+    ReaderReleases *releases = reader_release_map_->Find(cv);
+    if (releases) {
+      releases->Clear();
+      reader_release_map_->Erase(cv);
     }
   }
 
@@ -4641,15 +7998,57 @@ struct TSanThread {
   // SIGNAL/WAIT events.
   void HandleWait(uintptr_t cv) {
 
-    SignallerMap::iterator it = signaller_map_->find(cv);
-    if (it != signaller_map_->end()) {
-      const VTS *signaller_vts = it->second.vts;
-      NewSegmentForWait(signaller_vts);
+    Signaller *signaller = signaller_map_->Find(cv);
+    if (signaller) {
+      if (signaller->tree_clock) {
+        NewSegmentForWaitWithTreeClock(signaller->vts,
+                                       signaller->tree_clock);
+      } else {
+        const VTS *signaller_vts = signaller->vts;
+        NewSegmentForWait(signaller_vts);
+      }
+    }
+
+    if (debug_happens_before) {
+      Printf("T%d: Wait: %p:\n    %s %s\n", tid_.raw(),
+             cv,
+             vts()->ToString().c_str(),
+             Segment::ToString(sid()).c_str());
+      if (G_flags->debug_level >= 1) {
+        ReportStackTrace();
+      }
+    }
+  }
+
+  void HandleSignal(uintptr_t cv) {
+    UpdateSignaller(cv);
+    NewSegmentForSignal();
+    if (debug_happens_before) {
+      DebugPrintSignal(cv);
+    }
+  }
+
+  // SIGNAL_MANY/WAIT_MANY events. The same as n SIGNAL/WAIT events on
+  // cvs[0..n), but the whole batch makes one new segment and the waiter
+  // does one VTS join.
+  void HandleWaitMany(const uintptr_t *cvs, size_t n) {
+    FixedArray<const VTS*, 256> vtss(n + 1);
+    size_t n_vtss = 0;
+    vtss[n_vtss++] = vts();
+    for (size_t i = 0; i < n; i++) {
+      Signaller *signaller = signaller_map_->Find(cvs[i]);
+      // We don't want to create a happens-before arc if it will be redundant.
+      if (signaller && !VTS::HappensBeforeCached(signaller->vts, vts()))
+        vtss[n_vtss++] = signaller->vts;
+    }
+    if (n_vtss > 1) {
+      VTS *new_vts = VTS::JoinMany(vtss.begin(), n_vtss, vts_arena_);
+      NewSegment("NewSegmentForWaitMany", new_vts);
     }
 
     if (debug_happens_before) {
-      Printf("T%d: Wait: %p:\n    %s %s\n", tid_.raw(),
-             cv,
+      Printf("T%d: WaitMany: %ld objects, %ld signallers:\n    %s %s\n",
+             tid_.raw(), n, n_vtss - 1,
              vts()->ToString().c_str(),
              Segment::ToString(sid()).c_str());
       if (G_flags->debug_level >= 1) {
@@ -4658,23 +8057,91 @@ struct TSanThread {
     }
   }
 
-  void HandleSignal(uintptr_t cv) {
-    Signaller *signaller = &(*signaller_map_)[cv];
+  void HandleSignalMany(const uintptr_t *cvs, size_t n) {
+    if (n == 0) return;
+    for (size_t i = 0; i < n; i++)
+      UpdateSignaller(cvs[i]);
+    NewSegmentForSignal();
+    if (debug_happens_before) {
+      for (size_t i = 0; i < n; i++)
+        DebugPrintSignal(cvs[i]);
+    }
+  }
+
+  // A reader unlock of a pure happens-before rwlock only has to be seen by
+  // the next writer, so instead of joining our VTS into the signaller of
+  // 'cv' we just keep a reference to it, one per reader thread.
+  // JoinReaderReleases() does the join for the writer in one go.
+  // The caller has to tick our VTS afterwards.
+  void AddReaderRelease(uintptr_t cv) {
+    vector<ReaderRelease> &releases = reader_release_map_->Get(cv)->releases;
+    for (size_t i = 0; i < releases.size(); i++) {
+      if (releases[i].tid == tid()) {
+        // Our previous release, the new one includes it. Unless it was
+        // made by the dead thread which had our slot, see NewSlot().
+        VTS *old_vts = releases[i].vts;
+        if (tid_to_slot_ && !VTS::HappensBeforeCached(old_vts, vts()))
+          releases[i].vts = VTS::Join(old_vts, vts(), vts_arena_);
+        else
+          releases[i].vts = vts()->Clone();
+        VTS::Unref(old_vts);
+        return;
+      }
+    }
+    ReaderRelease release = {tid(), vts()->Clone()};
+    releases.push_back(release);
+  }
+
+  // Moves the reader releases of 'cv' to its signaller.
+  void JoinReaderReleases(uintptr_t cv) {
+    ReaderReleases *releases = reader_release_map_->Find(cv);
+    if (!releases || releases->releases.empty()) return;
+    size_t n = releases->releases.size();
+    G_stats->Shard()->reader_releases_joined += n;
+    Signaller *signaller = signaller_map_->Get(cv);
+    FixedArray<const VTS*, 64> vtss(n + 1);
+    for (size_t i = 0; i < n; i++)
+      vtss[i] = releases->releases[i].vts;
+    if (signaller->vts)
+      vtss[n++] = signaller->vts;
+    VTS *new_vts = n == 1 ? releases->releases[0].vts->Clone()
+                          : VTS::JoinMany(vtss.begin(), n, vts_arena_);
+    signaller->Clear();
+    signaller->vts = new_vts;
+    releases->Clear();
+  }
+
+  // Joins our VTS into the signaller of 'cv'. The caller has to tick
+  // our VTS afterwards.
+  void UpdateSignaller(uintptr_t cv) {
+    Signaller *signaller = signaller_map_->Get(cv);
     if (!signaller->vts) {
       signaller->vts = vts()->Clone();
+      if (G_flags->tree_clocks)
+        signaller->tree_clock = new TreeClock(*GetTreeClock());
+    } else if (signaller->tree_clock &&
+               signaller->tree_clock->IsLessOrEqual(*GetTreeClock())) {
+      // The signaller has nothing we don't know, so the join is our VTS.
+      G_stats->Shard()->tree_clock_copy++;
+      signaller->tree_clock->MonotoneCopy(*GetTreeClock());
+      VTS::Unref(signaller->vts);
+      signaller->vts = vts()->Clone();
     } else {
-      VTS *new_vts = VTS::Join(signaller->vts, vts());
+      VTS *new_vts = VTS::Join(signaller->vts, vts(), vts_arena_);
       VTS::Unref(signaller->vts);
       signaller->vts = new_vts;
+      // A join of two unrelated clocks is not a tree clock.
+      delete signaller->tree_clock;
+      signaller->tree_clock = NULL;
     }
-    NewSegmentForSignal();
-    if (debug_happens_before) {
-      Printf("T%d: Signal: %p:\n    %s %s\n    %s\n", tid_.raw(), cv,
-             vts()->ToString().c_str(), Segment::ToString(sid()).c_str(),
-             (signaller->vts)->ToString().c_str());
-      if (G_flags->debug_level >= 1) {
-        ReportStackTrace();
-      }
+  }
+
+  void DebugPrintSignal(uintptr_t cv) {
+    Printf("T%d: Signal: %p:\n    %s %s\n    %s\n", tid_.raw(), cv,
+           vts()->ToString().c_str(), Segment::ToString(sid()).c_str(),
+           signaller_map_->Find(cv)->vts->ToString().c_str());
+    if (G_flags->debug_level >= 1) {
+      ReportStackTrace();
     }
   }
 
@@ -4688,11 +8155,17 @@ struct TSanThread {
       // Flush the cache if VTS changed - the VTS won't repeat.
       recent_segments_cache_.Clear();
     }
+    UnbiasCurrentSid();
     sid_ = new_sid;
+    sblock_done_pc_ = 0;  // The SID may be a recycled one.
     Segment::Ref(new_sid, "TSanThread::NewSegmentWithoutUnrefingOld");
+    BiasCurrentSid();
 
-    if (kSizeOfHistoryStackTrace > 0) {
-      FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
+    if (history_ring_) {
+      Segment::set_stack_id(sid(), history_ring_->Position());
+      sid_has_sblock_ = false;
+    } else if (kSizeOfHistoryStackTrace > 0) {
+      Segment::set_stack_id(sid(), HistoryStackId());
     }
     if (0)
     Printf("2: %s T%d/S%d old_sid=%d NewSegment: %s\n", call_site,
@@ -4722,10 +8195,18 @@ struct TSanThread {
   void SetTopPc(uintptr_t pc) {
     if (pc) {
       DCHECK(!call_stack_->empty());
+      if (history_ring_ && call_stack_->back() != pc)
+        AddToHistoryRing(HistoryRing::SET_TOP, pc);
       call_stack_->back() = pc;
     }
   }
 
+  bool has_history_ring() const { return history_ring_ != NULL; }
+
+  void AddToHistoryRing(HistoryRing::EntryType type, uintptr_t pc) {
+    history_ring_->Add(type, pc, call_stack_->pcs(), call_stack_->size());
+  }
+
   void NOINLINE HandleSblockEnterSlowLocked() {
     AssertTILHeld();
     FlushStateIfOutOfSegments(this);
@@ -4739,26 +8220,49 @@ struct TSanThread {
   INLINE bool HandleSblockEnter(uintptr_t pc, bool allow_slow_path) {
     DCHECK(G_flags->keep_history);
     if (!pc) return true;
+    ScopedLatency latency(LATENCY_SBLOCK_ENTER, G_flags->latency_stats);
 
     this->stats.events[SBLOCK_ENTER]++;
 
     SetTopPc(pc);
+    if (history_ring_) {
+      // The segment stays. Its accesses happen at or after its first
+      // sblock, so that is the point its history stack is replayed at.
+      if (!sid_has_sblock_) {
+        Segment::set_stack_id(sid(), history_ring_->Position());
+        sid_has_sblock_ = true;
+      }
+      this->stats.history_uses_same_segment++;
+      return true;
+    }
+
+    if (pc == sblock_done_pc_ && sid_ == sblock_done_sid_) {
+      // The same sblock again (e.g. a loop), with no call, return or sync
+      // in between: the segment already has this stack.
+      this->stats.history_uses_same_segment++;
+      this->stats.history_sblock_repeated++;
+      return true;
+    }
 
     bool refill_stack = false;
     SID match = recent_segments_cache_.Search(call_stack_, sid(),
+                                              CurrentSidRefDelta(),
                                               /*OUT*/&refill_stack);
     DCHECK(kSizeOfHistoryStackTrace > 0);
 
     if (match.valid()) {
       // This part is 100% thread-local, no need for locking.
       if (sid_ != match) {
+        UnbiasCurrentSid();
         Segment::Ref(match, "TSanThread::HandleSblockEnter");
         this->AddDeadSid(sid_, "TSanThread::HandleSblockEnter");
         sid_ = match;
+        BiasCurrentSid();
       }
       if (refill_stack) {
         this->stats.history_reuses_segment++;
-        FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
+        Segment::set_stack_id(sid(), HistoryStackId());
+        recent_segments_cache_.Reindex(sid());
       } else {
         this->stats.history_uses_same_segment++;
       }
@@ -4768,11 +8272,13 @@ struct TSanThread {
       fresh_sids_.pop_back();
       Segment::SetupFreshSid(fresh_sid, tid(), vts()->Clone(),
                              rd_lockset_, wr_lockset_);
+      UnbiasCurrentSid();
       this->AddDeadSid(sid_, "TSanThread::HandleSblockEnter-1");
       Segment::Ref(fresh_sid, "TSanThread::HandleSblockEnter-1");
       sid_ = fresh_sid;
+      BiasCurrentSid();
+      Segment::set_stack_id(sid(), HistoryStackId());
       recent_segments_cache_.Push(sid());
-      FillEmbeddedStackTrace(Segment::embedded_stack_trace(sid()));
       this->stats.history_uses_preallocated_segment++;
     } else {
       if (!allow_slow_path) return false;
@@ -4780,6 +8286,10 @@ struct TSanThread {
       // No fresh SIDs available, have to grab a lock and get few.
       HandleSblockEnterSlowLocked();
     }
+    if (own_call_stack_) {
+      sblock_done_pc_ = pc;
+      sblock_done_sid_ = sid_;
+    }
     return true;
   }
 
@@ -4791,16 +8301,49 @@ struct TSanThread {
            signaller_vts->ToString().c_str());
     // We don't want to create a happens-before arc if it will be redundant.
     if (!VTS::HappensBeforeCached(signaller_vts, current_vts)) {
-      VTS *new_vts = VTS::Join(current_vts, signaller_vts);
+      VTS *new_vts = VTS::Join(current_vts, signaller_vts, vts_arena_);
       NewSegment("NewSegmentForWait", new_vts);
     }
     DCHECK(VTS::HappensBeforeCached(signaller_vts, vts()));
   }
 
+  // Same as NewSegmentForWait(signaller_vts), but the tree clock tells us
+  // which components change.
+  void NewSegmentForWaitWithTreeClock(const VTS *signaller_vts,
+                                      const TreeClock *signaller_tree_clock) {
+    TreeClock *tree_clock = GetTreeClock();
+    vector<TreeClock::Entry> &updated = *tree_clock_updated_;
+    updated.clear();
+    G_stats->Shard()->tree_clock_join++;
+    tree_clock->Join(*signaller_tree_clock, &updated);
+    if (updated.empty()) {
+      // The signaller's VTS is not newer than ours, but it may be equal.
+      NewSegmentForWait(signaller_vts);
+      tree_clock_vts_id_ = vts()->uniq_id();
+      return;
+    }
+    sort(updated.begin(), updated.end(), TreeClock::EntryLess);
+    VTS *new_vts = VTS::CopyAndUpdate(vts(), &updated[0], updated.size(),
+                                      vts_arena_);
+    if (TSAN_DEBUG) {
+      VTS *expected = VTS::Join(vts(), signaller_vts);
+      CHECK(new_vts->ToString() == expected->ToString());
+      VTS::Unref(expected);
+    }
+    NewSegment("NewSegmentForWait", new_vts);
+    tree_clock_vts_id_ = vts()->uniq_id();
+  }
+
   void NewSegmentForSignal() {
     VTS *cur_vts = vts();
-    VTS *new_vts = VTS::CopyAndTick(cur_vts, tid());
+    bool tree_clock_in_sync = tree_clock_ &&
+        tree_clock_vts_id_ == cur_vts->uniq_id();
+    VTS *new_vts = VTS::CopyAndTick(cur_vts, tid(), vts_arena_);
     NewSegment("NewSegmentForSignal", new_vts);
+    if (tree_clock_in_sync) {
+      tree_clock_->Increment();
+      tree_clock_vts_id_ = vts()->uniq_id();
+    }
   }
 
   // When creating a child thread, we need to know
@@ -4854,7 +8397,9 @@ struct TSanThread {
     }
   }
 
-  void HandleChildThreadStart(TID child_tid, VTS **vts, StackTrace **ctx) {
+  // 'child_tid' is the frontend TID of the child, returns its slot,
+  // see NewSlot().
+  TID HandleChildThreadStart(TID child_tid, VTS **vts, StackTrace **ctx) {
     TSanThread *parent = this;
     ThreadCreateInfo info;
     if (child_tid_to_create_info_.count(child_tid)) {
@@ -4875,7 +8420,9 @@ struct TSanThread {
       parent->NewSegmentForSignal();
     }
     *ctx = info.ctx;
-    VTS *singleton = VTS::CreateSingleton(child_tid);
+    int32_t child_clk;
+    TID child_slot = NewSlot(child_tid.raw(), info.vts, &child_clk);
+    VTS *singleton = VTS::CreateSingleton(child_slot, child_clk);
     *vts = VTS::Join(singleton, info.vts);
     VTS::Unref(singleton);
     VTS::Unref(info.vts);
@@ -4893,6 +8440,7 @@ struct TSanThread {
 
     // Parent should have ticked its VTS so there should be no h-b.
     DCHECK(!VTS::HappensBefore(parent->vts(), *vts));
+    return child_slot;
   }
 
   // Support for Cyclic Barrier, e.g. pthread_barrier_t.
@@ -4920,13 +8468,13 @@ struct TSanThread {
   // signal and wait (it is unlikely that more than 4 epochs are live at once.
   enum { kNumberOfPossibleBarrierEpochsLiveAtOnce = 4 };
   // Maps the barrier pointer to CyclicBarrierInfo.
-  typedef unordered_map<uintptr_t, CyclicBarrierInfo> CyclicBarrierMap;
+  typedef CachedAddrMap<CyclicBarrierInfo> CyclicBarrierMap;
 
   CyclicBarrierInfo &GetCyclicBarrierInfo(uintptr_t barrier) {
     if (cyclic_barrier_map_ == NULL) {
       cyclic_barrier_map_ = new CyclicBarrierMap;
     }
-    return (*cyclic_barrier_map_)[barrier];
+    return *cyclic_barrier_map_->Get(barrier);
   }
 
   void HandleBarrierInit(uintptr_t barrier, uint32_t n) {
@@ -4946,9 +8494,8 @@ struct TSanThread {
     if (info.calls_before_reset == 0) {
       // We are blocking the first time after reset. Clear the VTS.
       info.calls_before_reset = info.barrier_count;
-      Signaller &signaller = (*signaller_map_)[barrier + epoch];
-      VTS::Unref(signaller.vts);
-      signaller.vts = NULL;
+      Signaller &signaller = *signaller_map_->Get(barrier + epoch);
+      signaller.Clear();
       if (debug_happens_before) {
         Printf("T%d barrier %p (epoch %d) reset\n", tid().raw(),
                barrier, epoch);
@@ -4979,27 +8526,27 @@ struct TSanThread {
   void PopCallStack() {
     CHECK(!call_stack_->empty());
     call_stack_->pop_back();
+    sblock_done_pc_ = 0;
   }
 
   void HandleRtnCall(uintptr_t call_pc, uintptr_t target_pc,
                      IGNORE_BELOW_RTN ignore_below) {
     this->stats.events[RTN_CALL]++;
     if (!call_stack_->empty() && call_pc) {
-      call_stack_->back() = call_pc;
+      SetTopPc(call_pc);
     }
+    if (history_ring_)
+      AddToHistoryRing(HistoryRing::CALL, target_pc);
     call_stack_->push_back(target_pc);
+    sblock_done_pc_ = 0;
+    if (frame_lows_) {
+      frame_lows_->push_back(frame_low_);
+      frame_low_ = kNoStackAccess;
+    }
 
     bool ignore = false;
     if (ignore_below == IGNORE_BELOW_RTN_UNKNOWN) {
-      if (ignore_below_cache_.Lookup(target_pc, &ignore) == false) {
-        ignore = ThreadSanitizerIgnoreAccessesBelowFunction(target_pc);
-        ignore_below_cache_.Insert(target_pc, ignore);
-        G_stats->ignore_below_cache_miss++;
-      } else {
-        // Just in case, check the result of caching.
-        DCHECK(ignore ==
-               ThreadSanitizerIgnoreAccessesBelowFunction(target_pc));
-      }
+      ignore = ThreadSanitizerIgnoreAccessesBelowFunction(target_pc);
     } else {
       DCHECK(ignore_below == IGNORE_BELOW_RTN_YES ||
              ignore_below == IGNORE_BELOW_RTN_NO);
@@ -5017,7 +8564,14 @@ struct TSanThread {
   void HandleRtnExit() {
     this->stats.events[RTN_EXIT]++;
     if (!call_stack_->empty()) {
+      if (history_ring_)
+        AddToHistoryRing(HistoryRing::RETURN, 0);
       call_stack_->pop_back();
+      sblock_done_pc_ = 0;
+      if (frame_lows_ && !frame_lows_->empty()) {
+        frame_low_ = frame_lows_->back();
+        frame_lows_->pop_back();
+      }
       if (fun_r_ignore_) {
         if (--fun_r_ignore_ == 0) {
           set_ignore_all_accesses(false);
@@ -5038,6 +8592,19 @@ struct TSanThread {
     return PcToRtnName(pc, false);
   }
 
+  // Puts the top 'len' pcs of the call stack to 'pcs' (the top first),
+  // zeroes if the stack is shorter.
+  void FillCallStackPcs(uintptr_t *pcs, int len) {
+    size_t size = call_stack_->size();
+    for (int i = 0; i < len; i++)
+      pcs[i] = (size_t)i < size ? (*call_stack_)[size - i - 1] : 0;
+  }
+
+  EventSampleBuffer *event_samples() { return event_samples_; }
+  void set_event_samples(EventSampleBuffer *buffer) {
+    event_samples_ = buffer;
+  }
+
   string CallStackToStringRtnOnly(int len) {
     string res;
     for (int i = 0; i < len; i++) {
@@ -5054,16 +8621,29 @@ struct TSanThread {
     return call_stack_->back();
   }
 
-  INLINE void FillEmbeddedStackTrace(uintptr_t *emb_trace) {
+  // Puts the top kSizeOfHistoryStackTrace frames to G_stack_depot.
+  // A thread keeps coming back with the same stack (an allocation site, a
+  // loop), so the last stack and its id are kept: the same return addresses
+  // again cost a compare instead of a hash and a depot lookup.
+  INLINE uint32_t HistoryStackId() {
     size_t size = min(call_stack_->size(), (size_t)kSizeOfHistoryStackTrace);
     size_t idx = call_stack_->size() - 1;
     uintptr_t *pcs = call_stack_->pcs();
+    uintptr_t *last = &last_history_stack_[0];
+    bool same = size == last_history_stack_size_;
     for (size_t i = 0; i < size; i++, idx--) {
-      emb_trace[i] = pcs[idx];
+      if (last[i] != pcs[idx]) {
+        last[i] = pcs[idx];
+        same = false;
+      }
     }
-    if (size < (size_t) kSizeOfHistoryStackTrace) {
-      emb_trace[size] = 0;
+    if (same) {
+      this->stats.history_stack_cached++;
+      return last_history_stack_id_;
     }
+    last_history_stack_size_ = size;
+    last_history_stack_id_ = G_stack_depot->Put(last, size);
+    return last_history_stack_id_;
   }
 
   INLINE void FillStackTrace(StackTrace *trace, size_t size) {
@@ -5099,10 +8679,35 @@ struct TSanThread {
 
   static void ForgetAllState() {
     // G_flags->debug_level = 2;
+    if (past_threads_) {
+      // The clocks start over, see GetByClock(). The ended threads which
+      // have lost their slots are forgotten along with their segments.
+      for (int i = 0; i < TSanThread::NumberOfThreads(); i++) {
+        TSanThread *thr = Get(TID(i));
+        PastThread *past;
+        if (thr && thr->parent_tid_.valid() &&
+            GetByClock(thr->parent_tid_, thr->parent_clk_, &past) !=
+                Get(thr->parent_tid_)) {
+          thr->parent_clk_ = -1;  // The parent is gone.
+        }
+      }
+      for (int i = 0; i < TSanThread::NumberOfThreads(); i++) {
+        TSanThread *thr = Get(TID(i));
+        if (!thr) continue;
+        thr->start_clk_ = 0;
+        if (thr->parent_clk_ > 0)
+          thr->parent_clk_ = 0;
+      }
+      while (!past_threads_->empty())
+        ForgetPastThreads(TID(past_threads_->begin()->first));
+    }
     for (int i = 0; i < TSanThread::NumberOfThreads(); i++) {
       TSanThread *thr = Get(TID(i));
+      if (!thr) continue;
       thr->recent_segments_cache_.ForgetAllState();
       thr->sid_ = SID();  // Reset the old SID so we don't try to read its VTS.
+      thr->sid_biased_ = false;
+      thr->sid_pending_refs_ = 0;
       VTS *singleton_vts = VTS::CreateSingleton(TID(i), 2);
       if (thr->is_running()) {
         thr->NewSegmentWithoutUnrefingOld("ForgetAllState", singleton_vts);
@@ -5121,8 +8726,19 @@ struct TSanThread {
       }
       thr->dead_sids_.clear();
       thr->fresh_sids_.clear();
+      // The segments of the ended threads are gone.
+      SlotMayBeFree(TID(i));
     }
     signaller_map_->ClearAndDeleteElements();
+    reader_release_map_->ClearAndDeleteElements();
+    if (unjoined_vts_at_exit_) {
+      // Nothing is left to synchronize with, see HandleThreadJoinAfter().
+      for (map<int32_t, VTS*>::iterator it = unjoined_vts_at_exit_->begin();
+           it != unjoined_vts_at_exit_->end(); ++it) {
+        VTS::Unref(it->second);
+      }
+      unjoined_vts_at_exit_->clear();
+    }
   }
 
   static void InitClassMembers() {
@@ -5131,6 +8747,16 @@ struct TSanThread {
     memset(all_threads_, 0, sizeof(TSanThread*) * G_flags->max_n_threads);
     n_threads_          = 0;
     signaller_map_      = new SignallerMap;
+    reader_release_map_ = new ReaderReleaseMap;
+    tree_clock_updated_ = new vector<TreeClock::Entry>;
+    if (G_flags->reuse_dead_tids) {
+      tid_to_slot_ = new int32_t[G_flags->max_n_threads];
+      memset(tid_to_slot_, -1, sizeof(int32_t) * G_flags->max_n_threads);
+      slot_to_tid_ = new int32_t[G_flags->max_n_threads];
+      free_slots_ = new vector<int32_t>;
+      unjoined_vts_at_exit_ = new map<int32_t, VTS*>;
+      past_threads_ = new map<int32_t, vector<PastThread> >;
+    }
   }
 
   BitSet *lock_era_access_set(int is_w) {
@@ -5168,6 +8794,48 @@ struct TSanThread {
     dead_sids_.clear();
   }
 
+  // --------- Biased refcount of the current segment
+  // A thread adds most of the refs to its own current segment (on the fast
+  // path: {0, 0} => {0, cur}, etc.). With --biased_sid_refcount these refs
+  // don't touch the shared counter. Instead the thread counts them in
+  // sid_pending_refs_ and merges them when it leaves the segment (the end
+  // of the 'epoch'), so that the line with the counter is not bounced
+  // between the threads that access the memory.
+  // Other threads still Unref such refs from the shared counter, so it may
+  // lag behind the real number of refs. To keep it positive the thread
+  // adds kSidBias to it while the segment is current.
+  enum { kSidBias = 1 << 24, kMaxPendingSidRefs = kSidBias / 2 };
+
+  INLINE void RefCurrentSid(const char *where) {
+    if (!sid_biased_) {
+      Segment::Ref(sid_, where);
+      return;
+    }
+    if (UNLIKELY(++sid_pending_refs_ == kMaxPendingSidRefs)) {
+      Segment::AddRefs(sid_, sid_pending_refs_);
+      sid_pending_refs_ = 0;
+    }
+  }
+
+  // The number of references to sid_ minus its shared ref_count().
+  INLINE int32_t CurrentSidRefDelta() const {
+    return sid_biased_ ? sid_pending_refs_ - kSidBias : 0;
+  }
+
+  INLINE void BiasCurrentSid() {
+    if (!G_flags->biased_sid_refcount) return;
+    DCHECK(!sid_biased_ && sid_pending_refs_ == 0);
+    Segment::AddRefs(sid_, kSidBias);
+    sid_biased_ = true;
+  }
+
+  INLINE void UnbiasCurrentSid() {
+    if (!sid_biased_) return;
+    Segment::AddRefs(sid_, sid_pending_refs_ - kSidBias);
+    sid_pending_refs_ = 0;
+    sid_biased_ = false;
+  }
+
   INLINE bool HasRoomForDeadSids() const {
     return TS_SERIALIZED ? false :
         dead_sids_.size() < kMaxNumDeadSids - 2;
@@ -5195,11 +8863,22 @@ struct TSanThread {
 
  private:
   bool is_running_;
+  bool joined_;  // The exit VTS has been taken by a join.
+  bool in_free_slots_;  // --reuse_dead_tids, see SlotMayBeFree().
   string thread_name_;
 
   TID    tid_;         // This thread's tid.
   SID    sid_;         // Current segment ID.
+  bool   sid_biased_;  // See RefCurrentSid().
+  int32_t sid_pending_refs_;
   TID    parent_tid_;  // Parent's tid.
+  // The frontend TIDs of this thread and of its parent (tid_ and parent_tid_
+  // are the slots), the first clock of this thread in its slot and the clock
+  // of the parent when it created us, see GetByClock().
+  int32_t frontend_tid_;
+  int32_t parent_frontend_tid_;
+  int32_t start_clk_;
+  int32_t parent_clk_;
   bool   thread_local_copy_of_g_has_expensive_flags_;
   uintptr_t  max_sp_;
   uintptr_t  min_sp_;
@@ -5223,15 +8902,42 @@ struct TSanThread {
   StackTrace *ignore_context_[2];
 
   VTS *vts_at_exit_;
+  VtsArena *vts_arena_;  // NULL after the thread has ended.
+
+  // --tree_clocks: the same clock as vts(), as a tree. Valid only if
+  // tree_clock_vts_id_ is the uniq_id of vts(), see GetTreeClock().
+  TreeClock *tree_clock_;
+  int32_t tree_clock_vts_id_;
 
   CallStack *call_stack_;
+  HistoryRing *history_ring_;  // --history_ring, owned by g_history_rings.
+  bool sid_has_sblock_;  // With history_ring_ only.
+  // The call stack is changed only by our RTN_CALL/RTN_EXIT handlers.
+  bool own_call_stack_;
+  // The last sblock handled by HandleSblockEnter() and the segment it left
+  // us in. Valid until the call stack below the top or the segment change.
+  uintptr_t sblock_done_pc_;
+  SID sblock_done_sid_;
+  // The last stack put to G_stack_depot by HistoryStackId() and its id.
+  vector<uintptr_t> last_history_stack_;
+  size_t last_history_stack_size_;
+  uint32_t last_history_stack_id_;
+  ParkedLines parked_lines_;  // --parked_lines.
+
+  // --lazy_stack_reset, see NoteStackAccess().
+  uintptr_t frame_low_;
+  uintptr_t stack_low_;
+  vector<uintptr_t> *frame_lows_;
 
   vector<SID> dead_sids_;
   vector<SID> fresh_sids_;
 
-  PtrToBoolCache<251> ignore_below_cache_;
-
   LockHistory lock_history_;
+  // --detect_deadlocks: the lock order edges added by this thread,
+  // a direct mapped cache, see HandleLockOrder().
+  static const size_t kLockOrderCacheSize = 64;
+  uint64_t lock_order_cache_[kLockOrderCacheSize];
+  uint32_t lock_order_cache_generation_;  // LockOrderGraph::generation().
   BitSet lock_era_access_set_[2];
   RecentSegmentsCache recent_segments_cache_;
 
@@ -5245,27 +8951,93 @@ struct TSanThread {
 
   prng_t rand_state_;
 
+  // Not yet merged samples of --sample_events, see EventSampler.
+  EventSampleBuffer *event_samples_;
+
   struct Signaller {
     VTS *vts;
+    // --tree_clocks: the same clock as a tree, or NULL. We keep it only
+    // while the signaller is assigned with TreeClock::MonotoneCopy().
+    TreeClock *tree_clock;
+
+    void Clear() {
+      VTS::Unref(vts);
+      vts = NULL;
+      delete tree_clock;
+      tree_clock = NULL;
+    }
+  };
+
+  class SignallerMap: public CachedAddrMap<Signaller> {
+    public:
+     void ClearAndDeleteElements() {
+       for (iterator it = begin(); it != end(); ++it) {
+         it->second.Clear();
+       }
+       clear();
+     }
+  };
+
+  // The reader unlocks of a rwlock not yet joined into its signaller,
+  // see AddReaderRelease().
+  struct ReaderRelease {
+    TID tid;
+    VTS *vts;
+  };
+
+  struct ReaderReleases {
+    vector<ReaderRelease> releases;  // At most one per thread.
+
+    void Clear() {
+      for (size_t i = 0; i < releases.size(); i++)
+        VTS::Unref(releases[i].vts);
+      releases.clear();
+    }
   };
 
-  class SignallerMap: public unordered_map<uintptr_t, Signaller> {
+  class ReaderReleaseMap: public CachedAddrMap<ReaderReleases> {
     public:
      void ClearAndDeleteElements() {
        for (iterator it = begin(); it != end(); ++it) {
-         VTS::Unref(it->second.vts);
+         it->second.Clear();
        }
        clear();
      }
   };
 
+  // Returns the tree clock of this thread. It is rebuilt from vts() if the
+  // latter has been changed w/o using the tree clock. This is correct since
+  // the current time of a thread is never released before it is ticked.
+  TreeClock *GetTreeClock() {
+    if (!tree_clock_)
+      tree_clock_ = new TreeClock;
+    if (tree_clock_vts_id_ != vts()->uniq_id()) {
+      tree_clock_->Reset(tid().raw(), vts()->entries(), vts()->size());
+      tree_clock_vts_id_ = vts()->uniq_id();
+      G_stats->Shard()->tree_clock_reset++;
+    }
+    return tree_clock_;
+  }
+
   // All threads. The main thread has tid 0.
   static TSanThread **all_threads_;
   static int      n_threads_;
 
+  // --reuse_dead_tids, see NewSlot().
+  static int32_t *tid_to_slot_;  // Frontend TID => slot, -1 if none.
+  static int32_t *slot_to_tid_;  // Slot => the frontend TID of its thread.
+  static vector<int32_t> *free_slots_;
+  // The exit VTSs of the threads which have lost their slots before being
+  // joined, by the frontend TID.
+  static map<int32_t, VTS*> *unjoined_vts_at_exit_;
+  static map<int32_t, vector<PastThread> > *past_threads_;  // By slot.
+
   // signaller address -> VTS
   static SignallerMap *signaller_map_;
+  static ReaderReleaseMap *reader_release_map_;
   static CyclicBarrierMap *cyclic_barrier_map_;
+  // Scratch space for NewSegmentForWaitWithTreeClock().
+  static vector<TreeClock::Entry> *tree_clock_updated_;
 };
 
 INLINE static int32_t raw_tid(TSanThread *t) {
@@ -5275,9 +9047,25 @@ INLINE static int32_t raw_tid(TSanThread *t) {
 // TSanThread:: static members
 TSanThread                    **TSanThread::all_threads_;
 int                         TSanThread::n_threads_;
+int32_t                        *TSanThread::tid_to_slot_;
+int32_t                        *TSanThread::slot_to_tid_;
+vector<int32_t>                *TSanThread::free_slots_;
+map<int32_t, VTS*>             *TSanThread::unjoined_vts_at_exit_;
+map<int32_t, vector<TSanThread::PastThread> > *TSanThread::past_threads_;
 TSanThread::SignallerMap       *TSanThread::signaller_map_;
+TSanThread::ReaderReleaseMap   *TSanThread::reader_release_map_;
+vector<TreeClock::Entry>       *TSanThread::tree_clock_updated_;
 TSanThread::CyclicBarrierMap   *TSanThread::cyclic_barrier_map_;
 
+static void ThreadHasNoSegments(TID tid) {
+  TSanThread::ForgetPastThreads(tid);
+  TSanThread::SlotMayBeFree(tid);
+}
+
+static int32_t SlotToFrontendTid(TID slot, const VTS *vts) {
+  return TSanThread::FrontendTid(slot, vts);
+}
+
 
 // -------- TsanAtomicCore ------------------ {{{1
 
@@ -5297,7 +9085,8 @@ class TsanAtomicCore {
   uint64_t HandleRead(TSanThread* thr,
                       uintptr_t a,
                       uint64_t v,
-                      bool is_acquire);
+                      bool is_acquire,
+                      bool is_seq_cst);
 
   void ClearMemoryState(uintptr_t a, uintptr_t b);
 
@@ -5341,6 +9130,19 @@ class TsanAtomicCore {
   typedef map<uintptr_t, Atomic> AtomicMap;
   AtomicMap atomic_map_;
 
+  // A direct-mapped cache of the recently used descriptors in front of
+  // atomic_map_. Lock-free queues hammer a handful of addresses, so most
+  // of the lookups do not go to the map. The map nodes do not move, so
+  // the entries stay valid until ClearMemoryState() removes the atomic.
+  struct AtomicCacheEntry {
+    uintptr_t addr;
+    Atomic* atomic;
+  };
+  static size_t const kAtomicCacheSize = 64;
+  AtomicCacheEntry atomic_cache_ [kAtomicCacheSize];
+
+  Atomic* GetAtomic(uintptr_t a);
+
   void AtomicFixHist(Atomic* atomic,
                      uint64_t prev);
 
@@ -5372,21 +9174,25 @@ void INLINE ClearMemoryStateInOneLine(TSanThread *thr, uintptr_t addr,
     DCHECK(beg < CacheLine::kLineSize);
     DCHECK(end <= CacheLine::kLineSize);
     DCHECK(beg < end);
-    Mask published = line->published();
-    if (UNLIKELY(!published.Empty())) {
-      Mask mask(published.GetRange(beg, end));
-      ClearPublishedAttribute(line, mask);
-    }
+    // The published bits go away here, the ranges in ClearMemoryState().
     Mask old_used = line->ClearRangeAndReturnOldUsed(beg, end);
     UnrefSegmentsInMemoryRange(beg, end, old_used, line);
-    G_cache->ReleaseLine(thr, addr, line, __LINE__);
+    G_cache->ReleaseOrDeleteEmptyLine(thr, addr, line, __LINE__);
   }
 }
 
 // clear memory state for [a,b)
-void NOINLINE ClearMemoryState(TSanThread *thr, uintptr_t a, uintptr_t b) {
+// With 'lazy' the whole lines are reset lazily whatever --lazy_shadow_reset
+// is, provided there is a PendingShadowResets.
+void NOINLINE ClearMemoryState(TSanThread *thr, uintptr_t a, uintptr_t b,
+                               bool lazy = false) {
   if (a == b) return;
   CHECK(a < b);
+  if (UNLIKELY(!g_publish_info_map->empty())) {
+    g_publish_info_map->Unpublish(a, b);
+    CHECK(CheckSanityOfPublishedMemory(__LINE__));
+  }
+
   uintptr_t line1_tag = 0, line2_tag = 0;
   uintptr_t single_line_tag = GetCacheLinesForRange(a, b,
                                                     &line1_tag, &line2_tag);
@@ -5399,9 +9205,26 @@ void NOINLINE ClearMemoryState(TSanThread *thr, uintptr_t a, uintptr_t b) {
   uintptr_t a_tag = CacheLine::ComputeTag(a);
   ClearMemoryStateInOneLine(thr, a, a - a_tag, CacheLine::kLineSize);
 
-  for (uintptr_t tag_i = line1_tag; tag_i < line2_tag;
-       tag_i += CacheLine::kLineSize) {
-    ClearMemoryStateInOneLine(thr, tag_i, 0, CacheLine::kLineSize);
+  if (g_pending_shadow_resets &&
+      (lazy || (G_flags->lazy_shadow_reset > 0 &&
+                line2_tag - line1_tag >=
+                    (uintptr_t)G_flags->lazy_shadow_reset))) {
+    // The whole lines are reset lazily, see PendingShadowResets.
+    uint32_t gen = ++g_shadow_reset_gen;
+    g_pending_shadow_resets->Add(line1_tag, line2_tag, gen);
+    G_stats->Shard()->lazy_reset_ranges++;
+    G_stats->Shard()->lazy_reset_lines +=
+        G_cache->ResetCachedLines(thr, line1_tag, line2_tag, gen);
+  } else {
+    for (uintptr_t tag_i = line1_tag; tag_i < line2_tag; ) {
+      if (!CacheLine::RegionMayBeUsed(tag_i)) {
+        // No line was ever created in this region.
+        tag_i = min(CacheLine::ComputeNextRegion(tag_i), line2_tag);
+        continue;
+      }
+      ClearMemoryStateInOneLine(thr, tag_i, 0, CacheLine::kLineSize);
+      tag_i += CacheLine::kLineSize;
+    }
   }
 
   if (b > line2_tag) {
@@ -5420,15 +9243,62 @@ void NOINLINE ClearMemoryState(TSanThread *thr, uintptr_t a, uintptr_t b) {
   }
 
   g_atomicCore->ClearMemoryState(a, b);
+  Lock::ClearMemoryState(a, b);
 }
 
 // -------- PCQ --------------------- {{{1
+// The VTSs of the PCQ_PUTs not yet matched by a PCQ_GET, in a ring of
+// kMaxPutters entries. When the ring is full the two oldest entries are
+// merged into one with the join of their VTSs which serves both their
+// GETs. The first of these GETs then synchronizes with one PUT too many,
+// which may hide a race but never reports a false one.
+// Called under ts_lock.
 struct PCQ {
+  static const uint32_t kMaxPutters = 64;
+  struct Putter {
+    VTS *vts;
+    uint32_t n_puts;  // The number of PUTs merged into this entry.
+  };
+
   uintptr_t pcq_addr;
-  deque<VTS*> putters;
+  uint32_t head;
+  uint32_t size;
+  Putter putters[kMaxPutters];
+
+  Putter &at(uint32_t i) { return putters[(head + i) % kMaxPutters]; }
+
+  void Put(VTS *vts) {
+    if (size == kMaxPutters) {
+      Putter &first = at(0);
+      Putter &second = at(1);
+      VTS *merged = VTS::Join(first.vts, second.vts);
+      VTS::Unref(first.vts);
+      VTS::Unref(second.vts);
+      second.vts = merged;
+      second.n_puts += first.n_puts;
+      head = (head + 1) % kMaxPutters;
+      size--;
+      G_stats->Shard()->pcq_merges++;
+    }
+    Putter &putter = at(size++);
+    putter.vts = vts;
+    putter.n_puts = 1;
+  }
+
+  // Returns a new reference.
+  VTS *Get() {
+    CHECK(size > 0);
+    Putter &putter = at(0);
+    if (--putter.n_puts > 0)
+      return putter.vts->Clone();
+    VTS *res = putter.vts;
+    head = (head + 1) % kMaxPutters;
+    size--;
+    return res;
+  }
 };
 
-typedef map<uintptr_t, PCQ> PCQMap;
+typedef unordered_map<uintptr_t, PCQ> PCQMap;
 static PCQMap *g_pcq_map;
 
 // -------- Heap info ---------------------- {{{1
@@ -5443,6 +9313,9 @@ struct HeapInfo {
 
   Segment *seg() { return Segment::Get(sid); }
   TID tid() { return seg()->tid(); }
+  int32_t frontend_tid() {
+    return TSanThread::FrontendTid(seg()->tid(), seg()->vts());
+  }
   string StackTraceString() { return Segment::StackTraceString(sid); }
 };
 
@@ -5462,8 +9335,10 @@ static HeapMap<ThreadStackInfo> *G_thread_stack_map;
 static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason) {
   // This is done under the main lock.
   AssertTILHeld();
+  ScopedLatency latency(LATENCY_FLUSH, G_flags->latency_stats);
   size_t start_time = g_last_flush_time = TimeInMilliSeconds();
-  Report("T%d INFO: %s. Flushing state.\n", raw_tid(thr), reason);
+  size_t start_us = TimeInMicroSeconds();
+  Report("T%d INFO: %s. Flushing state.\n", thr->frontend_tid(), reason);
 
   if (TS_SERIALIZED == 0) {
     // We own the lock, but we also must acquire all cache lines
@@ -5484,7 +9359,7 @@ static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason) {
     }
   }
 
-  G_stats->n_forgets++;
+  G_stats->Shard()->n_forgets++;
 
   Segment::ForgetAllState();
   SegmentSet::ForgetAllState();
@@ -5497,26 +9372,144 @@ static void ForgetAllStateAndStartOver(TSanThread *thr, const char *reason) {
 
   for (PCQMap::iterator it = g_pcq_map->begin(); it != g_pcq_map->end(); ++it) {
     PCQ &pcq = it->second;
-    for (deque<VTS*>::iterator it2 = pcq.putters.begin();
-         it2 != pcq.putters.end(); ++it2) {
-      VTS::Unref(*it2);
-      *it2 = VTS::CreateSingleton(TID(0), 1);
+    for (uint32_t i = 0; i < pcq.size; i++) {
+      VTS::Unref(pcq.at(i).vts);
+      pcq.at(i).vts = VTS::CreateSingleton(TID(0), 1);
     }
   }
 
+  // All the lines go away, so does the stale shadow.
+  if (g_pending_shadow_resets)
+    g_pending_shadow_resets->Clear();
+
   // Must be the last one to flush as it effectively releases the
   // cach lines and enables fast path code to run in other threads.
   G_cache->ForgetAllState(thr);
 
+  size_t pause_us = TimeInMicroSeconds() - start_us;
+  G_stats->Shard()->forget_pause_total_us += pause_us;
+  G_stats->forget_pause_max_us = max(G_stats->forget_pause_max_us, pause_us);
+
   size_t stop_time = TimeInMilliSeconds();
   if (TSAN_DEBUG || (stop_time - start_time > 0)) {
-    Report("T%d INFO: Flush took %ld ms\n", raw_tid(thr),
+    Report("T%d INFO: Flush took %ld ms\n", thr->frontend_tid(),
            stop_time - start_time);
   }
 }
 
+// -------- Incremental flush -------- {{{1
+// With --incremental_flush=N we start reclaiming segments before we run out
+// of them. Once more than 7/8 of kMaxSIDBeforeFlush segments are alive,
+// every call reclaims up to N cold cache lines (see
+// Cache::ReclaimColdLines): their shadow values are dropped, and so are the
+// references they hold on segments and segment sets.
+// The threads, locks, heap and the hot lines stay intact, so we lose only
+// the history of the memory which was not touched recently.
+// ForgetAllStateAndStartOver() remains the last resort.
+static void IncrementalFlush(TSanThread *thr, size_t max_lines) {
+  AssertTILHeld();
+  ScopedLatency latency(LATENCY_INCR_FLUSH, G_flags->latency_stats);
+  size_t start_us = TimeInMicroSeconds();
+  size_t n_lines = G_cache->ReclaimColdLines(thr, max_lines);
+  size_t pause_us = TimeInMicroSeconds() - start_us;
+  G_stats->Shard()->incr_flush_slices++;
+  G_stats->Shard()->incr_flush_lines += n_lines;
+  G_stats->Shard()->incr_flush_pause_total_us += pause_us;
+  G_stats->incr_flush_pause_max_us =
+      max(G_stats->incr_flush_pause_max_us, pause_us);
+}
+
+// -------- Shadow reset sweeper -------- {{{1
+// Resets up to 'max_lines' stale lines of the lowest pending range,
+// see PendingShadowResets, and forgets the part of the range it has seen.
+static void SweepPendingShadowResets(TSanThread *thr, size_t max_lines) {
+  AssertTILHeld();
+  uintptr_t a = 0, b = 0;
+  uint32_t gen = 0;
+  if (!g_pending_shadow_resets->GetFirst(&a, &b, &gen)) return;
+  uintptr_t end = G_cache->ResetStaleLines(thr, a, b, gen, max_lines);
+  g_pending_shadow_resets->Remove(a, end);
+  G_stats->Shard()->lazy_reset_swept += (end - a) >> CacheLine::kLineSizeBits;
+}
+
+static const size_t kShadowResetSweepLines = 1024;
+
+// -------- Memory governor -------- {{{1
+// The memory held by the detector, summed over its arenas: the stored cache
+// lines (the compressed ones at their size), the used part of the segment table, the
+// VTS arenas, the stack depot and the cache itself. Unlike GetVmSizeInMb()
+// this needs no system call and leaves out the memory of the program (and
+// of the tool, if any), so with it --max_mem_in_mb is the budget of the
+// detector alone. The counters are read w/o locks.
+static size_t DetectorMemoryInMb() {
+  size_t res = sizeof(Cache);
+  res += CacheLine::StoredBytes(G_cache->NumberOfStoredLines());
+  res += (size_t)Segment::NumberOfSegments() * Segment::kSizeOfSegment;
+  res += VtsArena::AllocatedBytes();
+  res += G_stack_depot->AllocatedBytes();
+  return res >> 20;
+}
+
+// Frees memory w/o forgetting the race-relevant state: recycles the dead
+// segments (and so their VTSes and history stacks), shrinks the SID range
+// and drops the happens-before cache. The same steps
+// FlushStateIfOutOfSegments() takes before a flush.
+static void DropDeadHistory(TSanThread *thr) {
+  AssertTILHeld();
+  thr->FlushDeadSids();
+  SegmentSet::FlushDeferredRecycling();
+  Segment::CompactFreeSids();
+  VTS::FlushHBCache();
+  G_stats->Shard()->mem_gov_drop_history++;
+}
+
+// Compresses the lines which were not fetched from the storage during the
+// last two passes, a quarter of the storage per pass. Nothing is lost.
+static void CompressColdLines(TSanThread *thr) {
+  AssertTILHeld();
+  G_cache->CompressColdLines(thr, G_cache->NumberOfStoredLines() / 4 + 1);
+  G_stats->Shard()->mem_gov_compress++;
+}
+
+// Drops the shadow values of a quarter of the lines which are not in the
+// cache, see IncrementalFlush().
+static void EvictColdLines(TSanThread *thr) {
+  AssertTILHeld();
+  IncrementalFlush(thr, G_cache->NumberOfStoredLines() / 4 + 1);
+  G_stats->Shard()->mem_gov_evict++;
+}
+
 static INLINE void FlushStateIfOutOfSegments(TSanThread *thr) {
-  if (Segment::NumberOfSegments() > kMaxSIDBeforeFlush) {
+  if (UNLIKELY(g_pending_shadow_resets != NULL) &&
+      !g_pending_shadow_resets->empty()) {
+    SweepPendingShadowResets(thr, kShadowResetSweepLines);
+  }
+  if (G_flags->incremental_flush > 0 &&
+      Segment::NumberOfLiveSegments() > (kMaxSIDBeforeFlush / 8) * 7) {
+    IncrementalFlush(thr, G_flags->incremental_flush);
+  }
+  // Free SIDs below the top are reused before the range grows again, so
+  // we are out of SIDs only if (almost) all of them are alive.
+  const int32_t kMaxLiveSegments = kMaxSIDBeforeFlush - kMaxSIDBeforeFlush / 16;
+  bool out_of_sids = Segment::NumberOfSegments() > kMaxSIDBeforeFlush &&
+      Segment::NumberOfLiveSegments() > kMaxLiveSegments;
+  if (out_of_sids) {
+    // Before throwing away everything try to get some SIDs back:
+    // recycle our dead SIDs, drop all cold lines (with --incremental_flush)
+    // and shrink the SID range.
+    thr->FlushDeadSids();
+    while (g_pending_shadow_resets && !g_pending_shadow_resets->empty())
+      SweepPendingShadowResets(thr, G_cache->NumberOfStoredLines() + 1);
+    if (G_flags->incremental_flush > 0)
+      IncrementalFlush(thr, G_cache->NumberOfStoredLines());
+    SegmentSet::FlushDeferredRecycling();
+    Segment::CompactFreeSids();
+    out_of_sids = Segment::NumberOfSegments() > kMaxSIDBeforeFlush &&
+        Segment::NumberOfLiveSegments() > kMaxLiveSegments;
+  }
+  if (out_of_sids ||
+      (ShardedLocking() &&
+       SegmentSet::NumberOfSegmentSets() > (size_t)kMaxSIDBeforeFlush)) {
     // too few sids left -- flush state.
     if (TSAN_DEBUG) {
       G_cache->PrintStorageStats();
@@ -5526,6 +9519,193 @@ static INLINE void FlushStateIfOutOfSegments(TSanThread *thr) {
   }
 }
 
+// -------- Targeted detection ---------------------- {{{1
+// With --target_range=<lo>-<hi> (hex, [lo, hi), may repeat),
+// --target_alloc_site=<wildcard> (may repeat) or the first
+// ANNOTATE_TARGET_MEMORY_RANGE() only the targeted memory is tracked and
+// all other accesses are dropped before they touch the shadow.
+// A heap block is targeted when a function matching --target_alloc_site
+// is on the call stack of its MALLOC (the verdicts are cached per pc) and
+// is untargeted when untargeted memory is allocated over it.
+//
+// The exact ranges are a map under ts_lock. The access path checks a
+// bitmap with one bit per 64-byte line, the line number taken modulo the
+// bitmap size, so it has false positives (accesses 2^24 lines apart
+// share a bit) but no false negatives; reports are checked against the
+// exact ranges. Only the first byte of an access is checked.
+// Untargeting does not clear the bits: when the stale bits outnumber the
+// live ones the bitmap is rebuilt into the spare one and swapped in.
+class TargetFilter {
+ public:
+  TargetFilter() : n_live_lines_(0), n_stale_lines_(0) {
+    for (int i = 0; i < 2; i++) {
+      bitmaps_[i] = new uintptr_t[kWords];
+      memset(bitmaps_[i], 0, kWords * sizeof(uintptr_t));
+    }
+    bitmap_ = bitmaps_[0];
+    site_verdicts_ = new PcToBoolMap<12>;
+  }
+
+  // Lock-free. False means 'a' is surely not targeted.
+  INLINE bool MayBeTarget(uintptr_t a) {
+    uintptr_t bit = Bit(a);
+    const uintptr_t *bitmap = *(uintptr_t *volatile *)&bitmap_;
+    return (bitmap[bit / kBitsPerWord] >> (bit % kBitsPerWord)) & 1;
+  }
+
+  // The rest is under ts_lock.
+  bool IsTarget(uintptr_t a) {
+    map<uintptr_t, uintptr_t>::iterator it = ranges_.upper_bound(a);
+    if (it == ranges_.begin()) return false;
+    --it;
+    return a < it->second;
+  }
+
+  void Add(uintptr_t a, uintptr_t b) {
+    if (a >= b) return;
+    // Merge with the ranges overlapping or adjacent to [a, b).
+    map<uintptr_t, uintptr_t>::iterator it = ranges_.upper_bound(a);
+    if (it != ranges_.begin()) {
+      --it;
+      if (it->second < a) ++it;
+    }
+    while (it != ranges_.end() && it->first <= b) {
+      a = min(a, it->first);
+      b = max(b, it->second);
+      n_live_lines_ -= Lines(it->first, it->second);
+      ranges_.erase(it++);
+    }
+    ranges_[a] = b;
+    n_live_lines_ += Lines(a, b);
+    SetBits(bitmap_, a, b);
+  }
+
+  void Remove(uintptr_t a, uintptr_t b) {
+    if (a >= b) return;
+    map<uintptr_t, uintptr_t>::iterator it = ranges_.upper_bound(a);
+    if (it != ranges_.begin()) --it;
+    while (it != ranges_.end() && it->first < b) {
+      uintptr_t beg = it->first, end = it->second;
+      if (end <= a) {
+        ++it;
+        continue;
+      }
+      n_live_lines_ -= Lines(beg, end);
+      n_stale_lines_ += Lines(beg, end);
+      ranges_.erase(it++);
+      if (beg < a) {
+        ranges_[beg] = a;
+        n_live_lines_ += Lines(beg, a);
+      }
+      if (end > b) {
+        ranges_[b] = end;
+        n_live_lines_ += Lines(b, end);
+      }
+    }
+    if (n_stale_lines_ > n_live_lines_)
+      Rebuild();
+  }
+
+  bool has_alloc_sites() { return !G_flags->target_alloc_site.empty(); }
+
+  // True if a frame of the current call stack of 'thr' (the top is the
+  // pc of the MALLOC event) is in a --target_alloc_site function.
+  bool MatchesAllocSite(TSanThread *thr) {
+    for (size_t i = 0; i < kMaxAllocSiteFrames; i++) {
+      uintptr_t pc = thr->GetCallstackEntry(i);
+      if (pc == 0) break;
+      bool res;
+      if (!site_verdicts_->Lookup(pc, &res)) {
+        string rtn = PcToRtnName(pc, true);
+        res = false;
+        for (size_t j = 0; j < G_flags->target_alloc_site.size(); j++) {
+          if (ThreadSanitizerStringMatch(G_flags->target_alloc_site[j],
+                                         rtn)) {
+            res = true;
+            break;
+          }
+        }
+        site_verdicts_->Insert(pc, res);
+      }
+      if (res) return true;
+    }
+    return false;
+  }
+
+  size_t NumberOfRanges() { return ranges_.size(); }
+
+ private:
+  static const uintptr_t kLineSizeLog = 6;
+  static const uintptr_t kBitsLog = 24;
+  static const uintptr_t kBitsPerWord = sizeof(uintptr_t) * 8;
+  static const uintptr_t kWords = (1UL << kBitsLog) / kBitsPerWord;
+  static const size_t kMaxAllocSiteFrames = 16;
+
+  static uintptr_t Bit(uintptr_t a) {
+    return (a >> kLineSizeLog) & ((1UL << kBitsLog) - 1);
+  }
+
+  static uintptr_t Lines(uintptr_t a, uintptr_t b) {
+    return ((b - 1) >> kLineSizeLog) - (a >> kLineSizeLog) + 1;
+  }
+
+  static void SetBits(uintptr_t *bitmap, uintptr_t a, uintptr_t b) {
+    uintptr_t n = min(Lines(a, b), (uintptr_t)1 << kBitsLog);
+    for (uintptr_t i = 0; i < n; i++) {
+      uintptr_t bit = Bit(a + (i << kLineSizeLog));
+      bitmap[bit / kBitsPerWord] |= (uintptr_t)1 << (bit % kBitsPerWord);
+    }
+  }
+
+  void Rebuild() {
+    uintptr_t *spare = bitmap_ == bitmaps_[0] ? bitmaps_[1] : bitmaps_[0];
+    memset(spare, 0, kWords * sizeof(uintptr_t));
+    for (map<uintptr_t, uintptr_t>::iterator it = ranges_.begin();
+         it != ranges_.end(); ++it) {
+      SetBits(spare, it->first, it->second);
+    }
+    // A reader which still has the old bitmap may drop an access to a
+    // freshly targeted line, or keep one to untargeted memory; both are
+    // short-lived.
+    ReleaseStore((uintptr_t*)&bitmap_, (uintptr_t)spare);
+    n_stale_lines_ = 0;
+  }
+
+  map<uintptr_t, uintptr_t> ranges_;  // [beg, end), disjoint, not adjacent.
+  uintptr_t n_live_lines_;
+  uintptr_t n_stale_lines_;
+  uintptr_t *bitmap_;
+  uintptr_t *bitmaps_[2];
+  PcToBoolMap<12> *site_verdicts_;
+};
+
+// NULL unless the detection is targeted; never freed.
+static TargetFilter *g_target_filter;
+
+// Parses the --target_range flags; exits on a malformed one.
+static void TargetFilterInit() {
+  if (G_flags->target_range.empty() && G_flags->target_alloc_site.empty())
+    return;
+  TargetFilter *filter = new TargetFilter;
+  for (size_t i = 0; i < G_flags->target_range.size(); i++) {
+    const char *str = G_flags->target_range[i].c_str();
+    char *end;
+    uintptr_t lo = my_strtol(str, &end, 16);
+    uintptr_t hi = 0;
+    bool ok = *end == '-';
+    if (ok) {
+      hi = my_strtol(end + 1, &end, 16);
+      ok = *end == 0 && lo < hi;
+    }
+    if (!ok) {
+      Printf("Error: bad --target_range=%s, expected <lo>-<hi> in hex\n", str);
+      exit(1);
+    }
+    filter->Add(lo, hi);
+  }
+  g_target_filter = filter;
+}
+
 // -------- Expected Race ---------------------- {{{1
 typedef  HeapMap<ExpectedRace> ExpectedRacesMap;
 static ExpectedRacesMap *G_expected_races_map;
@@ -5636,6 +9816,109 @@ static const char default_suppressions[] =
 
 ;
 
+// -------- Racey PCs --------------------- {{{1
+// With --ignore_racey_pcs the pcs of the accesses which raced (whether the
+// race was reported, suppressed or on a benign race) are remembered, and
+// their later accesses to racey memory which miss the same-thread fast path
+// skip the state machine, even w/o --skip_racey_accesses. Meant for counters
+// which race by design. Accesses to the other memory go through the state
+// machine as usual, so their shadow values and reports are unaffected.
+// When the map is full the new pcs are not remembered.
+// NULL unless --ignore_racey_pcs; never freed.
+static PcToBoolMap<12> *g_racey_pcs;
+
+static INLINE bool IsRaceyPc(uintptr_t pc) {
+  bool val;
+  return g_racey_pcs->Lookup(pc, &val) && val;
+}
+
+// True if the whole aligned 8-byte chunk of the line around 'offset' is racey.
+// No access to such a chunk can be reported, and since the shadow values are
+// joined and split only within a chunk, its shadow can not affect a report
+// (unless EXPECT_RACE clears a racey bit of the chunk later).
+static INLINE bool IsRaceyChunk(CacheLine *line, uintptr_t offset) {
+  uintptr_t beg = offset & ~(uintptr_t)7;
+  return line->racey().GetRange(beg, beg + 8) == Mask::RangeBits(beg, beg + 8);
+}
+
+// -------- Race PC Filter --------------------- {{{1
+// With --dedup_race_pcs a race is reported at most once per key of
+// (pc, previous access, address class), and a repeated key is rejected
+// before ReportStorage::AddReport() unwinds the stack, describes the memory
+// or looks up the history. This is coarser than the usual deduplication by
+// the whole stack: a pc reached from another context is not reported again.
+// The detector has no pc of the previous access, so the history stack id
+// of its segment stands for it (the smallest one among the segments of the
+// other threads, so the key does not depend on the order of the segment
+// set). With --history_ring the stack id is a ring position, not a stack,
+// and the thread of the segment is used instead.
+// The address class is the stack of the accessing thread, the heap or
+// anything else.
+// A 2^16-bit Bloom filter answers most lookups of new keys; its hits are
+// checked in a hash set. Called under ts_lock.
+class RacePcFilter {
+ public:
+  RacePcFilter() {
+    memset(bloom_, 0, sizeof(bloom_));
+  }
+
+  static uint64_t Key(TSanThread *thr, uintptr_t pc, uintptr_t addr,
+                      bool is_w, ShadowValue old_sval) {
+    uint64_t prev = (uint64_t)-1;
+    AddSegmentSet(thr, old_sval.wr_ssid(), &prev);
+    if (is_w)
+      AddSegmentSet(thr, old_sval.rd_ssid(), &prev);
+    uint64_t addr_class = thr->MemoryIsInStack(addr) ? 1 :
+        G_heap_map->GetInfo(addr) ? 2 : 3;
+    uint64_t key = 0;
+    key = (key ^ pc) * 0x9E3779B97F4A7C15ULL;
+    key = (key ^ prev) * 0x9E3779B97F4A7C15ULL;
+    key = (key ^ addr_class) * 0x9E3779B97F4A7C15ULL;
+    return key;
+  }
+
+  bool Contains(uint64_t key) {
+    if (!BloomBit(key, 0) || !BloomBit(key, 1)) return false;
+    return keys_.count(key) > 0;
+  }
+
+  void Insert(uint64_t key) {
+    SetBloomBit(key, 0);
+    SetBloomBit(key, 1);
+    keys_.insert(key);
+  }
+
+ private:
+  static const size_t kBloomBits = 1 << 16;
+
+  static void AddSegmentSet(TSanThread *thr, SSID ssid, uint64_t *prev) {
+    if (ssid.IsEmpty()) return;
+    for (int s = 0; s < SegmentSet::Size(ssid); s++) {
+      SID sid = SegmentSet::GetSID(ssid, s, __LINE__);
+      Segment *seg = Segment::Get(sid);
+      if (seg->tid() == thr->tid()) continue;
+      uint64_t id = g_history_rings ? seg->tid().raw() :
+          Segment::stack_id(sid);
+      *prev = min(*prev, id);
+    }
+  }
+
+  static size_t BloomIndex(uint64_t key, int i) {
+    return (key >> (i ? 40 : 8)) & (kBloomBits - 1);
+  }
+  bool BloomBit(uint64_t key, int i) {
+    size_t idx = BloomIndex(key, i);
+    return (bloom_[idx / 64] >> (idx % 64)) & 1;
+  }
+  void SetBloomBit(uint64_t key, int i) {
+    size_t idx = BloomIndex(key, i);
+    bloom_[idx / 64] |= 1ULL << (idx % 64);
+  }
+
+  uint64_t bloom_[kBloomBits / 64];
+  unordered_set<uint64_t> keys_;
+};
+
 // -------- Report Storage --------------------- {{{1
 class ReportStorage {
  public:
@@ -5679,6 +9962,21 @@ class ReportStorage {
                           int size,
                           ShadowValue old_sval, ShadowValue new_sval,
                           bool is_published) {
+    ScopedLatency latency(LATENCY_REPORT, G_flags->latency_stats);
+    // A false positive of TargetFilter::MayBeTarget().
+    if (g_target_filter && !g_target_filter->IsTarget(addr))
+      return false;
+    // The expected races still count their hits.
+    bool use_pc_filter = G_flags->dedup_race_pcs && !g_expecting_races &&
+        !G_expected_races_map->GetInfo(addr);
+    uint64_t race_pc_key = 0;
+    if (use_pc_filter) {
+      race_pc_key = RacePcFilter::Key(thr, pc, addr, is_w, old_sval);
+      if (race_pc_filter_.Contains(race_pc_key)) {
+        G_stats->Shard()->race_pc_filter_hit++;
+        return false;
+      }
+    }
     {
       // Check this isn't a "_ZNSs4_Rep20_S_empty_rep_storageE" report.
       uintptr_t offset;
@@ -5722,6 +10020,8 @@ class ReportStorage {
 
     if (is_expected && !G_flags->show_expected_races) return false;
 
+    if (use_pc_filter)
+      race_pc_filter_.Insert(race_pc_key);
     StackTrace *stack_trace = thr->CreateStackTrace(pc);
     if (unwind_cb_) {
       int const maxcnt = 256;
@@ -5773,7 +10073,7 @@ class ReportStorage {
     if (ssid.IsEmpty()) return;
     for (int s = 0; s < SegmentSet::Size(ssid); s++) {
       Segment *seg = SegmentSet::GetSegmentForNonSingleton(ssid, s, __LINE__);
-      TSanThread::Get(seg->tid())->Announce();
+      TSanThread::AnnounceThread(seg->tid(), seg->vts()->clk(seg->tid()));
     }
   }
 
@@ -5794,7 +10094,7 @@ class ReportStorage {
       if (concurrent_sids) {
         concurrent_sids->insert(concurrent_sid);
       }
-      TSanThread *thr2 = TSanThread::Get(seg->tid());
+      int32_t clk2 = seg->vts()->clk(seg->tid());
       if (!printed_header) {
         Report("  %sConcurrent %s happened at (OR AFTER) these points:%s\n",
                c_magenta, descr, c_default);
@@ -5802,7 +10102,7 @@ class ReportStorage {
       }
 
       Report("   %s (%s):\n",
-             thr2->ThreadName().c_str(),
+             TSanThread::ThreadName(seg->tid(), clk2).c_str(),
              TwoLockSetsToString(seg->lsid(false),
                                  seg->lsid(true)).c_str());
       if (G_flags->show_states) {
@@ -5811,7 +10111,10 @@ class ReportStorage {
       LockSet::AddLocksToSet(seg->lsid(false), locks);
       LockSet::AddLocksToSet(seg->lsid(true), locks);
       Report("%s", Segment::StackTraceString(concurrent_sid).c_str());
-      if (!G_flags->pure_happens_before &&
+      // The lock history is gone with the thread if its slot is reused.
+      TSanThread::PastThread *past2;
+      TSanThread *thr2 = TSanThread::GetByClock(seg->tid(), clk2, &past2);
+      if (thr2 && !G_flags->pure_happens_before &&
           G_flags->suggest_happens_before_arcs) {
         set<LID> message_locks;
         // Report("Locks in T%d\n", thr1->tid().raw());
@@ -5824,8 +10127,8 @@ class ReportStorage {
                  " and later acquired by T%d: {%s}\n"
                  "   See http://code.google.com/p/data-race-test/wiki/"
                  "PureHappensBeforeVsHybrid\n",
-                 thr2->tid().raw(),
-                 thr1->tid().raw(),
+                 thr2->frontend_tid(),
+                 thr1->frontend_tid(),
                  SetOfLocksToString(message_locks).c_str());
           locks->insert(message_locks.begin(), message_locks.end());
         }
@@ -5846,7 +10149,9 @@ class ReportStorage {
     for (set<SID>::iterator it = concurrent_sids.begin();
          it != concurrent_sids.end(); ++it) {
       // Take the first pc of the concurrent stack trace.
-      uintptr_t concurrent_pc = *Segment::embedded_stack_trace(*it);
+      size_t size;
+      const uintptr_t *pcs = Segment::history_stack(*it, &size);
+      uintptr_t concurrent_pc = size ? pcs[0] : 0;
       snprintf(buf, 100, ",%p", (void*)concurrent_pc);
       s += buf;
     }
@@ -5854,6 +10159,23 @@ class ReportStorage {
     return s;
   }
 
+  // Symbolizes the history stacks of a race report in one batch.
+  static void PrefetchHistorySymbols(ShadowValue sval) {
+    vector<uintptr_t> pcs;
+    SSID ssids[2] = {sval.wr_ssid(), sval.rd_ssid()};
+    for (int i = 0; i < 2; i++) {
+      if (ssids[i].IsEmpty()) continue;
+      for (int s = 0; s < SegmentSet::Size(ssids[i]); s++) {
+        size_t size;
+        const uintptr_t *trace = Segment::history_stack(
+            SegmentSet::GetSID(ssids[i], s, __LINE__), &size);
+        if (trace)
+          pcs.insert(pcs.end(), trace, trace + size);
+      }
+    }
+    SymbolCache::Prefetch(pcs);
+  }
+
   void PrintRaceReport(ThreadSanitizerDataRaceReport *race) {
     bool short_report = program_finished_;
     if (!short_report) {
@@ -5909,6 +10231,7 @@ class ReportStorage {
     }
     set<SID> concurrent_sids;
     if (G_flags->keep_history) {
+      PrefetchHistorySymbols(race->new_sval);
       PrintConcurrentSegmentSet(race->new_sval.wr_ssid(),
                                 tid, sid, lsid, true, "write(s)", &all_locks,
                                 &concurrent_sids);
@@ -5962,42 +10285,101 @@ class ReportStorage {
 #endif
   }
 
-  bool PrintReport(ThreadSanitizerReport *report) {
-    CHECK(report);
-    // Check if we have a suppression.
-    vector<string> funcs_mangled;
-    vector<string> funcs_demangled;
-    vector<string> objects;
-
-    CHECK(!g_race_verifier_active);
-    CHECK(report->stack_trace);
-    CHECK(report->stack_trace->size());
-    for (size_t i = 0; i < report->stack_trace->size(); i++) {
-      uintptr_t pc = report->stack_trace->Get(i);
-      string img, rtn, file;
-      int line;
-      PcToStrings(pc, false, &img, &rtn, &file, &line);
+  // Gets the frames as the suppressions see them.
+  static void SymbolizeStackTrace(StackTrace *stack_trace,
+                                  vector<string> *funcs_mangled,
+                                  vector<string> *funcs_demangled,
+                                  vector<string> *objects) {
+    for (size_t i = 0; i < stack_trace->size(); i++) {
+      PcSymbols symbols;
+      SymbolCache::Get(stack_trace->Get(i), &symbols);
+      const string &rtn = symbols.rtn_name;
       if (rtn == "(below main)" || rtn == "ThreadSanitizerStartThread")
         break;
 
-      funcs_mangled.push_back(rtn);
-      funcs_demangled.push_back(NormalizeFunctionName(PcToRtnName(pc, true)));
-      objects.push_back(img);
+      funcs_mangled->push_back(rtn);
+      funcs_demangled->push_back(symbols.normalized_rtn_name);
+      objects->push_back(symbols.img_name);
 
       if (rtn == "main")
         break;
     }
+  }
+
+  // Returns true and sets *suppression_name if the report's stack is
+  // suppressed. The verdicts are cached by the hash of the raw PCs,
+  // so a stack is symbolized and matched only once.
+  bool IsSuppressed(ThreadSanitizerReport *report, string *suppression_name) {
+    StackTrace *stack_trace = report->stack_trace;
+    const char *report_name = report->ReportName();
+    uint64_t hash = 0;
+    for (const char *p = report_name; *p; p++)
+      hash = (hash ^ (uint64_t)*p) * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < stack_trace->size(); i++)
+      hash = (hash ^ (uint64_t)stack_trace->Get(i)) * 0x9E3779B97F4A7C15ULL;
+
+    map<uint64_t, SuppressionVerdict>::iterator it =
+        suppression_verdicts_.find(hash);
+    if (it != suppression_verdicts_.end()) {
+      SuppressionVerdict &verdict = it->second;
+      bool same = verdict.report_name == report_name &&
+          verdict.pcs.size() == stack_trace->size();
+      for (size_t i = 0; same && i < stack_trace->size(); i++)
+        same = verdict.pcs[i] == stack_trace->Get(i);
+      if (same) {
+        G_stats->Shard()->suppression_cache_hit++;
+        *suppression_name = verdict.suppression_name;
+        return !suppression_name->empty();
+      }
+      // A hash collision; just don't cache this one.
+    }
+    G_stats->Shard()->suppression_cache_miss++;
+
+    vector<uintptr_t> pcs(stack_trace->size());
+    for (size_t i = 0; i < stack_trace->size(); i++)
+      pcs[i] = stack_trace->Get(i);
+    SymbolCache::Prefetch(pcs);
+    vector<string> funcs_mangled;
+    vector<string> funcs_demangled;
+    vector<string> objects;
+    SymbolizeStackTrace(stack_trace, &funcs_mangled, &funcs_demangled,
+                        &objects);
+    bool res = suppressions_.StackTraceSuppressed("ThreadSanitizer",
+                                                  report_name,
+                                                  funcs_mangled,
+                                                  funcs_demangled,
+                                                  objects,
+                                                  suppression_name);
+    if (!res)
+      suppression_name->clear();
+    if (it == suppression_verdicts_.end()) {
+      SuppressionVerdict &verdict = suppression_verdicts_[hash];
+      verdict.report_name = report_name;
+      verdict.pcs.resize(stack_trace->size());
+      for (size_t i = 0; i < stack_trace->size(); i++)
+        verdict.pcs[i] = stack_trace->Get(i);
+      verdict.suppression_name = *suppression_name;
+    }
+    return res;
+  }
+
+  bool PrintReport(ThreadSanitizerReport *report) {
+    CHECK(report);
+    CHECK(!g_race_verifier_active);
+    CHECK(report->stack_trace);
+    CHECK(report->stack_trace->size());
+    // Check if we have a suppression.
     string suppression_name;
-    if (suppressions_.StackTraceSuppressed("ThreadSanitizer",
-                                           report->ReportName(),
-                                           funcs_mangled,
-                                           funcs_demangled,
-                                           objects,
-                                           &suppression_name)) {
+    if (IsSuppressed(report, &suppression_name)) {
       used_suppressions_[suppression_name]++;
       return false;
     }
 
+    // With --async_reports the output goes to G_report_writer.
+    string captured_output;
+    if (G_report_writer)
+      SetOutputCapture(&captured_output);
+
     // Actually print it.
     if (report->type == ThreadSanitizerReport::UNLOCK_FOREIGN) {
       ThreadSanitizerBadUnlockReport *bad_unlock =
@@ -6005,7 +10387,7 @@ class ReportStorage {
       Report("WARNING: Lock %s was released by thread T%d"
              " which did not acquire this lock: {{{\n%s}}}\n",
              Lock::ToString(bad_unlock->lid).c_str(),
-             bad_unlock->tid.raw(),
+             TSanThread::Get(bad_unlock->tid)->frontend_tid(),
              bad_unlock->stack_trace->ToString().c_str());
     } else if (report->type == ThreadSanitizerReport::UNLOCK_NONLOCKED) {
       ThreadSanitizerBadUnlockReport *bad_unlock =
@@ -6013,7 +10395,7 @@ class ReportStorage {
       Report("WARNING: Unlocking a non-locked lock %s in thread T%d: "
              "{{{\n%s}}}\n",
              Lock::ToString(bad_unlock->lid).c_str(),
-             bad_unlock->tid.raw(),
+             TSanThread::Get(bad_unlock->tid)->frontend_tid(),
              bad_unlock->stack_trace->ToString().c_str());
     } else if (report->type == ThreadSanitizerReport::INVALID_LOCK) {
       ThreadSanitizerInvalidLockReport *invalid_lock =
@@ -6021,8 +10403,27 @@ class ReportStorage {
       Report("WARNING: accessing an invalid lock %p in thread T%d: "
              "{{{\n%s}}}\n",
              invalid_lock->lock_addr,
-             invalid_lock->tid.raw(),
+             TSanThread::Get(invalid_lock->tid)->frontend_tid(),
              invalid_lock->stack_trace->ToString().c_str());
+    } else if (report->type == ThreadSanitizerReport::LOCK_ORDER) {
+      ThreadSanitizerLockOrderReport *lock_order =
+          reinterpret_cast<ThreadSanitizerLockOrderReport*>(report);
+      vector<LID> &cycle = lock_order->cycle;
+      Report("WARNING: Potential deadlock: T%d acquires %s while holding %s,"
+             " the locks of the cycle were acquired in the opposite order"
+             " before: {{{\n%s",
+             TSanThread::Get(lock_order->tid)->frontend_tid(),
+             Lock::ToString(cycle.front()).c_str(),
+             Lock::ToString(cycle.back()).c_str(),
+             lock_order->stack_trace->ToString().c_str());
+      for (size_t i = 0; i + 1 < cycle.size(); i++) {
+        Report("  %s acquired while holding %s:\n%s",
+               Lock::ToString(cycle[i + 1]).c_str(),
+               Lock::ToString(cycle[i]).c_str(),
+               LockOrderGraph::EdgeStack(cycle[i], cycle[i + 1])
+                   ->ToString().c_str());
+      }
+      Report("}}}\n");
     } else if (report->type == ThreadSanitizerReport::ATOMICITY_VIOLATION) {
       ThreadSanitizerAtomicityViolationReport *av =
           reinterpret_cast<ThreadSanitizerAtomicityViolationReport*>(report);
@@ -6053,6 +10454,11 @@ class ReportStorage {
 
     // Generate a suppression.
     if (G_flags->generate_suppressions) {
+      vector<string> funcs_mangled;
+      vector<string> funcs_demangled;
+      vector<string> objects;
+      SymbolizeStackTrace(report->stack_trace, &funcs_mangled,
+                          &funcs_demangled, &objects);
       string supp = "{\n";
       supp += "  <Put your suppression name here>\n";
       supp += string("  ThreadSanitizer:") + report->ReportName() + "\n";
@@ -6072,6 +10478,15 @@ class ReportStorage {
              supp.c_str());
     }
 
+    if (G_report_writer) {
+      SetOutputCapture(NULL);
+      // Reports of the same type with the same top frame are duplicates
+      // when the queue is full.
+      uint64_t key = report->stack_trace->Get(0);
+      for (const char *p = report->ReportName(); *p; p++)
+        key = (key ^ (uint64_t)*p) * 0x9E3779B97F4A7C15ULL;
+      G_report_writer->Put(key, captured_output);
+    }
     return true;
   }
 
@@ -6102,7 +10517,7 @@ class ReportStorage {
                  c_blue,
                  reinterpret_cast<void*>(a),
                  static_cast<long>(t->max_sp() - a),
-                 i,
+                 t->frontend_tid(),
                  reinterpret_cast<void*>(t->min_sp()),
                  reinterpret_cast<void*>(t->max_sp()),
                  c_default
@@ -6121,7 +10536,7 @@ class ReportStorage {
              static_cast<long>(a - heap_info->ptr),
              reinterpret_cast<void*>(heap_info->ptr),
              static_cast<long>(heap_info->size),
-             heap_info->tid().raw(), c_default);
+             heap_info->frontend_tid(), c_default);
       return string(buff) + heap_info->StackTraceString().c_str();
     }
 
@@ -6154,7 +10569,7 @@ class ReportStorage {
                    c_blue,
                    reinterpret_cast<void*>(a),
                    static_cast<int>(diff),
-                   i,
+                   t->frontend_tid(),
                    reinterpret_cast<void*>(t->min_sp()),
                    reinterpret_cast<void*>(t->max_sp()),
                    c_default
@@ -6178,17 +10593,49 @@ class ReportStorage {
 
  private:
   map<StackTrace *, int, StackTrace::Less> reported_stacks_;
+  // See IsSuppressed(). An empty suppression_name means "not suppressed".
+  struct SuppressionVerdict {
+    string report_name;
+    vector<uintptr_t> pcs;
+    string suppression_name;
+  };
+  map<uint64_t, SuppressionVerdict> suppression_verdicts_;
   int n_reports;
   int n_race_reports;
   bool program_finished_;
   ThreadSanitizerSuppressions suppressions_;
   map<string, int> used_suppressions_;
   ThreadSanitizerUnwindCallback unwind_cb_;
+  RacePcFilter race_pc_filter_;
 };
 
 // -------- Event Sampling ---------------- {{{1
 // This class samples (profiles) events.
 // Instances of this class should all be static.
+// A sample is the name of the event and the top pcs of the call stack.
+// Samples go to a per-thread buffer w/o locking or symbolization. A full
+// buffer is merged into the global counters under ts_lock, so the lock is
+// taken once per kEventSampleBufferSize samples, and the pcs are symbolized
+// only in ShowSamples().
+const int kMaxEventSampleDepth = 16;
+const int kEventSampleBufferSize = 4096;
+
+struct EventSample {
+  const char *event_name;
+  uintptr_t pcs[kMaxEventSampleDepth];  // The top frame first.
+
+  struct Less {
+    bool operator() (const EventSample &a, const EventSample &b) const {
+      return memcmp(&a, &b, sizeof(a)) < 0;
+    }
+  };
+};
+
+struct EventSampleBuffer {
+  size_t n;
+  EventSample samples[kEventSampleBufferSize];
+};
+
 class EventSampler {
  public:
 
@@ -6199,23 +10646,61 @@ class EventSampler {
     if ((counter_ & ((1 << G_flags->sample_events) - 1)) != 0)
       return;
 
-    TIL til(ts_lock, 8, need_locking);
-    string pos = thr->CallStackToStringRtnOnly(G_flags->sample_events_depth);
-    (*samples_)[event_name][pos]++;
-    total_samples_++;
-    if (total_samples_ >= print_after_this_number_of_samples_) {
-      print_after_this_number_of_samples_ +=
-          print_after_this_number_of_samples_ / 2;
-      ShowSamples();
-    }
+    EventSampleBuffer *buffer = thr->event_samples();
+    if (!buffer) {
+      buffer = new EventSampleBuffer;
+      buffer->n = 0;
+      thr->set_event_samples(buffer);
+    }
+    EventSample *sample = &buffer->samples[buffer->n++];
+    memset(sample, 0, sizeof(*sample));
+    sample->event_name = event_name;
+    thr->FillCallStackPcs(sample->pcs, Depth());
+    if (buffer->n == kEventSampleBufferSize) {
+      TIL til(ts_lock, 8, need_locking);
+      MergeBuffer(buffer);
+      if (total_samples_ >= print_after_this_number_of_samples_) {
+        print_after_this_number_of_samples_ +=
+            print_after_this_number_of_samples_ / 2;
+        ShowSamples();
+      }
+    }
+  }
+
+  // Merge the samples which are still in the per-thread buffers.
+  // Called at the end of the program, ts_lock must be held.
+  static void MergeAllThreads() {
+    if (G_flags->sample_events == 0) return;
+    for (int i = 0; i < TSanThread::NumberOfThreads(); i++)
+      MergeThread(TSanThread::Get(TID(i)));
+  }
+
+  // Same for one thread, e.g. before its slot is reused.
+  static void MergeThread(TSanThread *thr) {
+    if (thr && thr->event_samples())
+      MergeBuffer(thr->event_samples());
   }
 
   // Show existing samples
   static void ShowSamples() {
     if (G_flags->sample_events == 0) return;
     Printf("ShowSamples: (all samples: %lld)\n", total_samples_);
-    for (SampleMapMap::iterator it1 = samples_->begin();
-         it1 != samples_->end(); ++it1) {
+    // Symbolize and group by the event name.
+    typedef map<string, int> SampleMap;
+    map<string, SampleMap> by_name;
+    for (RawSampleMap::iterator it = samples_->begin();
+         it != samples_->end(); ++it) {
+      string pos;
+      for (int i = 0; i < Depth(); i++) {
+        if (i)
+          pos += " ";
+        if (it->first.pcs[i])
+          pos += PcToRtnName(it->first.pcs[i], false);
+      }
+      by_name[it->first.event_name][pos] += it->second;
+    }
+    for (map<string, SampleMap>::iterator it1 = by_name.begin();
+         it1 != by_name.end(); ++it1) {
       string name = it1->first;
       SampleMap &m = it1->second;
       int total = 0;
@@ -6242,25 +10727,167 @@ class EventSampler {
   }
 
   static void InitClassMembers() {
-    samples_ = new SampleMapMap;
+    samples_ = new RawSampleMap;
     total_samples_ = 0;
     print_after_this_number_of_samples_ = 1000;
   }
 
  private:
+  static int Depth() {
+    return min((int)G_flags->sample_events_depth, kMaxEventSampleDepth);
+  }
+
+  // ts_lock must be held (unless the buffer's thread is not running).
+  static void MergeBuffer(EventSampleBuffer *buffer) {
+    for (size_t i = 0; i < buffer->n; i++)
+      (*samples_)[buffer->samples[i]]++;
+    total_samples_ += buffer->n;
+    buffer->n = 0;
+  }
+
   int counter_;
 
-  typedef map<string, int> SampleMap;
-  typedef map<string, SampleMap> SampleMapMap;
-  static SampleMapMap *samples_;
+  typedef map<EventSample, int, EventSample::Less> RawSampleMap;
+  static RawSampleMap *samples_;
   static int64_t total_samples_;
   static int64_t print_after_this_number_of_samples_;
 };
 
-EventSampler::SampleMapMap *EventSampler::samples_;
+EventSampler::RawSampleMap *EventSampler::samples_;
 int64_t EventSampler::total_samples_;
 int64_t EventSampler::print_after_this_number_of_samples_;
 
+// Defined here since EventSampleBuffer is incomplete in class TSanThread.
+TSanThread::~TSanThread() {
+  CHECK(!is_running_);
+  VTS::Unref(vts_at_exit_);
+  StackTrace::Delete(creation_context_);
+  StackTrace::Delete(ignore_context_[0]);
+  StackTrace::Delete(ignore_context_[1]);
+  delete tree_clock_;
+  delete event_samples_;
+  if (history_ring_) {
+    g_history_rings[tid_.raw()] = NULL;
+    delete history_ring_;
+  }
+  for (map<TID, ThreadCreateInfo>::iterator it =
+           child_tid_to_create_info_.begin();
+       it != child_tid_to_create_info_.end(); ++it) {
+    StackTrace::Delete(it->second.ctx);
+    VTS::Unref(it->second.vts);
+  }
+}
+
+// -------- DetectorProfile --------------- {{{1
+// With --detector_profile=<file>, every --detector_profile_period-th trace
+// is timed and its cycles (times the period) are attributed to the pc of
+// the trace and to the call stack it was executed under. At exit the top
+// traces are printed symbolized, and <file> gets the stacks in the folded
+// format of flamegraph.pl, one "outer;...;inner;trace cycles" per line.
+// The sampling cost is not attributed, but it is there: profiling runs only.
+class DetectorProfile {
+ public:
+  static void InitClassMembers() {
+    if (G_flags->detector_profile.empty()) return;
+    CHECK(G_flags->detector_profile_period > 0);
+    lock_ = new TSLock;
+    samples_ = new SampleMap;
+  }
+
+  static INLINE bool enabled() { return samples_ != NULL; }
+
+  static INLINE bool ShouldSample() {
+    // The counter is racy w/o TS_SERIALIZED, which is fine for sampling.
+    static uintptr_t counter;
+    return (++counter % G_flags->detector_profile_period) == 0;
+  }
+
+  static void AddSample(TSanThread *thr, uintptr_t trace_pc,
+                        uint64_t cycles) {
+    Sample sample;
+    sample.pcs[0] = trace_pc;
+    thr->FillCallStackPcs(sample.pcs + 1, kDepth);
+    TIL til(lock_, 11);
+    (*samples_)[sample] += cycles * G_flags->detector_profile_period;
+  }
+
+  static void Dump() {
+    if (!enabled()) return;
+    map<uintptr_t, uint64_t> by_pc;
+    map<string, uint64_t> folded;
+    uint64_t total = 0;
+    {
+      TIL til(lock_, 11);
+      for (SampleMap::iterator it = samples_->begin();
+           it != samples_->end(); ++it) {
+        const uintptr_t *pcs = it->first.pcs;
+        string stack;
+        for (int i = kDepth; i >= 0; i--) {
+          if (pcs[i] == 0) continue;
+          stack += FrameName(pcs[i]);
+          if (i) stack += ";";
+        }
+        folded[stack] += it->second;
+        by_pc[pcs[0]] += it->second;
+        total += it->second;
+      }
+    }
+    if (total == 0) return;
+
+    string res;
+    for (map<string, uint64_t>::iterator it = folded.begin();
+         it != folded.end(); ++it) {
+      char buff[32];
+      snprintf(buff, sizeof(buff), " %llu\n", (unsigned long long)it->second);
+      res += it->first + buff;
+    }
+    OpenFileWriteStringAndClose(G_flags->detector_profile, res);
+
+    multimap<uint64_t, uintptr_t> top;
+    for (map<uintptr_t, uint64_t>::iterator it = by_pc.begin();
+         it != by_pc.end(); ++it) {
+      top.insert(make_pair(it->second, it->first));
+    }
+    Printf("DetectorProfile: %ld traces, ~%'lld cycles; stacks in %s\n",
+           by_pc.size(), (long long)total, G_flags->detector_profile.c_str());
+    int i = 0;
+    for (multimap<uint64_t, uintptr_t>::reverse_iterator it = top.rbegin();
+         it != top.rend() && i < kTopTraces; ++it, i++) {
+      Printf("  %5.1f%% %p %s\n", it->first * 100.0 / total,
+             it->second, PcToRtnNameAndFilePos(it->second).c_str());
+    }
+  }
+
+ private:
+  static const int kDepth = 16;  // Frames of the call stack kept.
+  static const int kTopTraces = 20;
+
+  // The trace pc, then the call stack, the top first.
+  struct Sample {
+    uintptr_t pcs[kDepth + 1];
+    bool operator< (const Sample &other) const {
+      return memcmp(pcs, other.pcs, sizeof(pcs)) < 0;
+    }
+  };
+  typedef map<Sample, uint64_t> SampleMap;
+
+  static string FrameName(uintptr_t pc) {
+    string rtn = PcToRtnName(pc, true);
+    if (rtn.empty()) {
+      char buff[32];
+      snprintf(buff, sizeof(buff), "%p", (void*)pc);
+      rtn = buff;
+    }
+    return rtn;
+  }
+
+  static TSLock *lock_;
+  static SampleMap *samples_;
+};
+
+TSLock *DetectorProfile::lock_;
+DetectorProfile::SampleMap *DetectorProfile::samples_;
+
 // -------- Detector ---------------------- {{{1
 // Collection of event handlers.
 class Detector {
@@ -6294,6 +10921,128 @@ class Detector {
     }
   }
 
+  // Same as HandleTraceLoop() w/o expensive flags and with locking, but a
+  // cache line is acquired once for all the executed mops of the trace
+  // which fall into it: the fast path runs for them in a row, in the trace
+  // order. The fast path touches only the shadow of its line and does not
+  // change the thread's segment, so the mops on the fast path may be
+  // reordered across lines, but not across a mop which takes the slow path.
+  // So once the fast path fails for mop k (or its line is not available),
+  // the batching of the other lines stops at k, and once the mops before k
+  // are done, k and the rest of the trace go through HandleTraceLoop(), in
+  // order. The mops of the other lines which were batched before the
+  // failure was seen are still ahead of k; this is fine as long as the slow
+  // path of k can not change the thread's segment, i.e. as long as nothing
+  // is published (NewSegmentForWait()), see HandleTrace().
+  // With --parked_lines the lines are looked up among the thread's parked
+  // lines first, and a line the fast path was done with is parked instead
+  // of being released.
+  void HandleTraceByLines(TSanThread *thr, uintptr_t pc, MopInfo *mops,
+                          uintptr_t *tleb, size_t n) {
+    uintptr_t sblock_pc = pc;
+    ParkedLines *parked = NULL;
+    if (TS_SERIALIZED == 0 && G_flags->parked_lines > 0)
+      parked = thr->parked_lines();
+    size_t limit = n;  // The first mop the fast path failed for.
+    for (size_t i = 0; i < limit; i++) {
+      uintptr_t addr = tleb[i];
+      if (addr == 0) continue;  // Not executed or already handled.
+      uintptr_t tag = CacheLine::ComputeTag(addr);
+      if (parked && !parked->Empty() && thr->HasRoomForDeadSids()) {
+        parked->Lock();
+        CacheLine *cache_line = parked->Find(tag);
+        if (cache_line &&
+            thr->HandleSblockEnter(sblock_pc, /*allow_slow_path=*/false)) {
+          sblock_pc = 0;  // don't do SblockEnter any more.
+          HandleMopsInLine(thr, cache_line, mops, tleb, i, &limit);
+        }
+        parked->Unlock();
+        if (cache_line) {
+          if (tleb[i] == 0) continue;
+          break;
+        }
+      }
+      CacheLine *cache_line = Cache::kLineIsLocked();  // Not acquired.
+      if (thr->HasRoomForDeadSids())
+        cache_line = G_cache->TryAcquireLine(thr, addr, __LINE__);
+      if (!Cache::LineIsNullOrLocked(cache_line)) {
+        bool done = false;
+        if (cache_line->tag() == tag &&
+            thr->HandleSblockEnter(sblock_pc, /*allow_slow_path=*/false)) {
+          sblock_pc = 0;  // don't do SblockEnter any more.
+          done = HandleMopsInLine(thr, cache_line, mops, tleb, i, &limit);
+        }
+        if (done && parked) {
+          parked->Lock();
+          G_cache->ParkLine(thr, addr, cache_line, parked);
+          parked->Unlock();
+        } else {
+          G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+        }
+      } else if (cache_line == NULL) {
+        // We grabbed the cache slot but it is empty, release it.
+        G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+      }
+      if (tleb[i] == 0) continue;
+      break;
+    }
+    // The mops before the first one left in the tleb are done.
+    for (size_t i = 0; i < n; i++) {
+      if (tleb[i] == 0) continue;
+      HandleTraceLoop(thr, sblock_pc, mops + i, tleb + i, n - i,
+                      /*expensive_bits=*/0, /*need_locking=*/true);
+      break;
+    }
+  }
+
+  // The fast path for the executed mops i..*limit-1 of a trace which fall
+  // into 'cache_line', see HandleTraceByLines(). Returns false if it failed
+  // for one of them; that one and the rest are left in the tleb, and
+  // *limit is set to that one.
+  INLINE bool HandleMopsInLine(TSanThread *thr, CacheLine *cache_line,
+                               MopInfo *mops, uintptr_t *tleb,
+                               size_t i, size_t *limit) {
+    uintptr_t tag = cache_line->tag();
+    for (size_t j = i; j < *limit; j++) {
+      uintptr_t a = tleb[j];
+      if (a == 0 || CacheLine::ComputeTag(a) != tag) continue;
+      if (UNLIKELY(g_target_filter != NULL) &&
+          !g_target_filter->MayBeTarget(a)) {
+        tleb[j] = 0;
+        continue;
+      }
+      DCHECK(mops[j].size() != 0);
+      if (!DispatchFastAccess(cache_line, thr, a, &mops[j])) {
+        *limit = j;
+        return false;
+      }
+      tleb[j] = 0;
+    }
+    return true;
+  }
+
+  // With --prefetch_shadow, issue the loads of the shadow of the whole
+  // trace before handling its first mop: the cache slots of all the
+  // executed mops first, then the lines found in them. A trace which
+  // touches several cold lines then waits for the memory once, not once
+  // per line. Consecutive mops of the same line are prefetched once.
+  void PrefetchTrace(uintptr_t *tleb, size_t n) {
+    uintptr_t prev_tag = 0;
+    for (size_t i = 0; i < n; i++) {
+      uintptr_t tag = CacheLine::ComputeTag(tleb[i]);
+      if (tleb[i] == 0 || tag == prev_tag) continue;
+      G_cache->PrefetchSlot(tag);
+      prev_tag = tag;
+    }
+    prev_tag = 0;
+    for (size_t i = 0; i < n; i++) {
+      uintptr_t tag = CacheLine::ComputeTag(tleb[i]);
+      if (tleb[i] == 0 || tag == prev_tag) continue;
+      G_cache->PrefetchLine(tleb[i]);
+      prev_tag = tag;
+    }
+  }
+
 #ifdef _MSC_VER
   NOINLINE
   // With MSVC, INLINE would cause the compilation to be insanely slow.
@@ -6308,11 +11057,24 @@ class Detector {
     int expensive_bits = thr->expensive_bits();
 
     if (expensive_bits == 0) {
-      HandleTraceLoop(thr, pc, mops, tleb, n, 0, need_locking);
+      if (G_flags->prefetch_shadow && n > 1)
+        PrefetchTrace(tleb, n);
+      if (need_locking && (n > 1 || G_flags->parked_lines > 0) &&
+          !(TS_ATOMICITY && G_flags->atomicity) &&
+          !INTERNAL_ANNOTATE_UNPROTECTED_READ(g_memory_was_published))
+        HandleTraceByLines(thr, pc, mops, tleb, n);
+      else
+        HandleTraceLoop(thr, pc, mops, tleb, n, 0, need_locking);
     } else {
       if ((expensive_bits & 3) == 3) {
         // everything is ignored, just clear the tleb.
         for (size_t i = 0; i < n; i++) tleb[i] = 0;
+      } else if (UNLIKELY(DetectorProfile::enabled()) &&
+                 DetectorProfile::ShouldSample()) {
+        uintptr_t trace_pc = pc ? pc : mops[0].pc();
+        uint64_t start = ReadTSC();
+        HandleTraceLoop(thr, pc, mops, tleb, n, expensive_bits, need_locking);
+        DetectorProfile::AddSample(thr, trace_pc, ReadTSC() - start);
       } else {
         HandleTraceLoop(thr, pc, mops, tleb, n, expensive_bits, need_locking);
       }
@@ -6330,13 +11092,127 @@ class Detector {
     HandleTrace(thr, &mop, 1, 0/*no sblock*/, &addr, need_locking);
   }
 
+  // An access to [addr, addr+size) which is too large for a MopInfo,
+  // e.g. a REPORT_READ_RANGE/REPORT_WRITE_RANGE from ts_replace.h.
+  // The range is handled as a series of naturally aligned accesses of up
+  // to 8 bytes, but a whole cache line whose eight 8-byte shadow values
+  // are equal (or all new) goes through the state machine only once, see
+  // HandleUniformLine(). So a large memcpy costs per line, not per byte.
+  void HandleMemoryAccessRange(TSanThread *thr, uintptr_t pc,
+                               uintptr_t addr, uintptr_t size,
+                               bool is_w, bool need_locking) {
+    if (size == 0) return;
+    int expensive_bits = thr->expensive_bits();
+    if (expensive_bits & (is_w ? 2 : 1)) return;  // ignored.
+    if ((expensive_bits & 4) || (TS_ATOMICITY && G_flags->atomicity)) {
+      // Keep the stats and tracing exact: access the pieces one by one.
+      for (uintptr_t x = addr, b = addr + size; x < b; ) {
+        uintptr_t s = AlignedAccessSize(x, b);
+        HandleMemoryAccess(thr, pc, x, s, is_w, need_locking);
+        x += s;
+      }
+      return;
+    }
+    TIL til(ts_lock, 4, need_locking);
+    thr->FlushDeadSids();
+    thr->GetSomeFreshSids();
+    uintptr_t b = addr + size;
+    for (uintptr_t tag = CacheLine::ComputeTag(addr); tag < b;
+         tag += CacheLine::kLineSize) {
+      uintptr_t line_beg = max(addr, tag);
+      uintptr_t line_end = min(b, tag + CacheLine::kLineSize);
+      CacheLine *cache_line = G_cache->GetLineOrCreateNew(thr, tag, __LINE__);
+      if (line_beg != tag || line_end != tag + CacheLine::kLineSize ||
+          !HandleUniformLine(thr, cache_line, pc, is_w)) {
+        HandleAccessesInLine(thr, cache_line, pc, line_beg, line_end, is_w);
+      }
+      G_cache->ReleaseLine(thr, tag, cache_line, __LINE__);
+    }
+  }
+
+  // The largest of 8, 4, 2, 1 which is the alignment of 'a' and fits
+  // into [a, b).
+  static INLINE uintptr_t AlignedAccessSize(uintptr_t a, uintptr_t b) {
+    uintptr_t s = 8;
+    while ((a & (s - 1)) || a + s > b)
+      s >>= 1;
+    return s;
+  }
+
+  // Handle [a, b) within 'cache_line' as aligned accesses of up to 8 bytes.
+  void HandleAccessesInLine(TSanThread *thr, CacheLine *cache_line,
+                            uintptr_t pc, uintptr_t a, uintptr_t b,
+                            bool is_w) {
+    for (uintptr_t x = a; x < b; ) {
+      uintptr_t s = AlignedAccessSize(x, b);
+      MopInfo mop(pc, s, is_w, false);
+      HandleAccessGranularityAndExecuteHelper(cache_line, thr, x, &mop,
+                                              /*has_expensive_flags=*/false,
+                                              /*fast_path_only=*/false,
+                                              /*sharded=*/false);
+      x += s;
+    }
+  }
+
+  // Handle an 8-byte access to each 8-byte piece of 'cache_line' if all of
+  // them have 8-byte granularity and equal shadow values (or are all new),
+  // and nothing in the line is published or racey. Then every piece ends
+  // up in the same state: the state machine runs for the first one and
+  // the result is copied to the others. Returns false (and does nothing)
+  // if the line is not uniform.
+  bool HandleUniformLine(TSanThread *thr, CacheLine *cache_line,
+                         uintptr_t pc, bool is_w) {
+    const uintptr_t kPieces = CacheLine::kLineSize / 8;
+    if (!cache_line->published().Empty() || !cache_line->racey().Empty())
+      return false;
+    uint16_t gr = *cache_line->granularity_mask(0);
+    if (gr != 0 && gr != 1) return false;
+    bool has_sval = cache_line->has_shadow_value().Get(0);
+    ShadowValue sval0 = *cache_line->GetValuePointer(0);
+    for (uintptr_t i = 1; i < kPieces; i++) {
+      uintptr_t off = i * 8;
+      if (*cache_line->granularity_mask(off) != gr) return false;
+      if (cache_line->has_shadow_value().Get(off) != has_sval) return false;
+      if (has_sval && *cache_line->GetValuePointer(off) != sval0)
+        return false;
+    }
+
+    MopInfo mop(pc, 8, is_w, false);
+    HandleAccessGranularityAndExecuteHelper(cache_line, thr,
+                                            cache_line->tag(), &mop,
+                                            /*has_expensive_flags=*/false,
+                                            /*fast_path_only=*/false,
+                                            /*sharded=*/false);
+    if (!cache_line->racey().Empty()) {
+      // A race: let every piece report it on its own.
+      HandleAccessesInLine(thr, cache_line, pc, cache_line->tag() + 8,
+                           cache_line->tag() + CacheLine::kLineSize, is_w);
+      return true;
+    }
+    ShadowValue new_sval = *cache_line->GetValuePointer(0);
+    for (uintptr_t i = 1; i < kPieces; i++) {
+      uintptr_t off = i * 8;
+      *cache_line->granularity_mask(off) = 1;
+      ShadowValue *sval_p = has_sval ? cache_line->GetValuePointer(off)
+          : cache_line->AddNewSvalAtOffset(off);
+      ShadowValue old_sval = *sval_p;
+      *sval_p = new_sval;
+      RefAndUnrefTwoSegSetPairsIfDifferent(thr, new_sval.rd_ssid(),
+                                           old_sval.rd_ssid(),
+                                           new_sval.wr_ssid(),
+                                           old_sval.wr_ssid());
+    }
+    return true;
+  }
+
   void ShowUnfreedHeap() {
     // check if there is not deleted memory
     // (for debugging free() interceptors, not for leak detection)
     if (TSAN_DEBUG && G_flags->debug_level >= 1) {
-      for (HeapMap<HeapInfo>::iterator it = G_heap_map->begin();
-           it != G_heap_map->end(); ++it) {
-        HeapInfo &info = it->second;
+      vector<HeapInfo*> infos;
+      G_heap_map->GetAll(&infos);
+      for (size_t i = 0; i < infos.size(); i++) {
+        HeapInfo &info = *infos[i];
         Printf("Not free()-ed memory: %p [%p, %p)\n%s\n",
                info.size, info.ptr, info.ptr + info.size,
                info.StackTraceString().c_str());
@@ -6349,9 +11225,10 @@ class Detector {
     // check if we found all expected races (for unit tests only).
     static int total_missing = 0;
     int this_flush_missing = 0;
-    for (ExpectedRacesMap::iterator it = G_expected_races_map->begin();
-         it != G_expected_races_map->end(); ++it) {
-      ExpectedRace race = it->second;
+    vector<ExpectedRace*> races;
+    G_expected_races_map->GetAll(&races);
+    for (size_t i = 0; i < races.size(); i++) {
+      ExpectedRace race = *races[i];
       if (debug_expected_races) {
         Printf("Checking if expected race fired: %p\n", race.ptr);
       }
@@ -6360,7 +11237,7 @@ class Detector {
           (G_flags->nacl_untrusted == race.is_nacl_untrusted)) {
         ++this_flush_missing;
         Printf("Missing an expected race on %p: %s (annotated at %s)\n",
-               it->first,
+               race.ptr,
                race.description,
                PcToRtnNameAndFilePos(race.pc).c_str());
       }
@@ -6378,31 +11255,55 @@ class Detector {
   }
 
   void HandleProgramEnd() {
+    if (G_report_writer)
+      G_report_writer->Fini();
     FlushExpectedRaces(true);
     // ShowUnfreedHeap();
+    EventSampler::MergeAllThreads();
     EventSampler::ShowSamples();
     ShowStats();
     TraceInfo::PrintTraceProfile();
+    SharingProfile::Dump();
+    DetectorProfile::Dump();
     ShowProcSelfStatus();
     reports_.PrintUsedSuppression();
     reports_.PrintSummary();
     // Report("ThreadSanitizerValgrind: exiting\n");
   }
 
+  // With --max_mem_in_mb, responds to the memory of the detector getting
+  // close to the limit in steps: above 10/16 of it drops the dead history,
+  // above 11/16 also compresses cold lines, above 12/16 evicts them, above
+  // 13/16 forgets all state.
+  // Under Valgrind and on Win32 the memory is VmSize: the tool there shares
+  // the address space limit with the program. Elsewhere it is
+  // DetectorMemoryInMb(). Called under ts_lock.
   void FlushIfOutOfMem(TSanThread *thr) {
-    static int max_vm_size;
+    AssertTILHeld();
+    static int max_mem;
     static int soft_limit;
     const int hard_limit = G_flags->max_mem_in_mb;
     const int minimal_soft_limit = (hard_limit * 13) / 16;
+    const int evict_limit        = (hard_limit * 12) / 16;
+    const int compress_limit     = (hard_limit * 11) / 16;
     const int print_info_limit   = (hard_limit * 12) / 16;
+    const int drop_history_limit = (hard_limit * 10) / 16;
 
     CHECK(hard_limit > 0);
 
-    int vm_size_in_mb = GetVmSizeInMb();
-    if (max_vm_size < vm_size_in_mb) {
-      max_vm_size = vm_size_in_mb;
-      if (max_vm_size > print_info_limit) {
-        Report("INFO: ThreadSanitizer's VmSize: %dM\n", (int)max_vm_size);
+#if defined(TS_VALGRIND) || defined(_WIN32)
+    const bool mem_shrinks = false;
+    const char *mem_name = "VmSize";
+    int mem_in_mb = GetVmSizeInMb();
+#else
+    const bool mem_shrinks = true;
+    const char *mem_name = "memory";
+    int mem_in_mb = DetectorMemoryInMb();
+#endif
+    if (max_mem < mem_in_mb) {
+      max_mem = mem_in_mb;
+      if (max_mem > print_info_limit) {
+        Report("INFO: ThreadSanitizer's %s: %dM\n", mem_name, max_mem);
       }
     }
 
@@ -6410,10 +11311,23 @@ class Detector {
       soft_limit = minimal_soft_limit;
     }
 
-    if (vm_size_in_mb > soft_limit) {
+    if (mem_in_mb > soft_limit) {
       ForgetAllStateAndStartOver(thr,
           "ThreadSanitizer is running close to its memory limit");
-      soft_limit = vm_size_in_mb + 1;
+      // VmSize does not go down after a flush, so wait for it to grow.
+      // Our own memory does, but not below the fixed tables.
+      if (!mem_shrinks)
+        soft_limit = mem_in_mb + 1;
+      else
+        soft_limit = max(minimal_soft_limit, (int)DetectorMemoryInMb() + 1);
+    } else if (mem_in_mb > evict_limit) {
+      DropDeadHistory(thr);
+      EvictColdLines(thr);
+    } else if (mem_in_mb > compress_limit) {
+      DropDeadHistory(thr);
+      CompressColdLines(thr);
+    } else if (mem_in_mb > drop_history_limit) {
+      DropDeadHistory(thr);
     }
   }
 
@@ -6424,24 +11338,18 @@ class Detector {
   }
 
   void FlushIfNeeded(TSanThread *thr) {
-    // Are we out of segment IDs?
-#if defined(TS_VALGRIND) || (defined(_WIN32) && TS_SERIALIZED == 1)
-    // GetVmSizeInMb() is only available on Valgrind and Win32 anyway.
-
-    static int counter;
-#if TS_SERIALIZED == 1
-    counter++;
-#else
-# error The multi-threaded version of FlushIfNeeded is not implemented.
-#endif
-
     // Are we out of memory?
     if (G_flags->max_mem_in_mb > 0) {
-      const int kFreq = 1014 * 32;
-      if ((counter % kFreq) == 0) {  // Don't do it too often.
-        // TODO(kcc): find a way to check memory limit more frequently.
+      // Reading VmSize is a system call, DetectorMemoryInMb() is cheap.
+#if defined(TS_VALGRIND) || defined(_WIN32)
+      const uintptr_t kFreq = 1024 * 32;
+#else
+      const uintptr_t kFreq = 1024 * 4;
+#endif
+      // The counter is racy w/o TS_SERIALIZED, which is fine for sampling.
+      static uintptr_t counter;
+      if ((++counter % kFreq) == 0) {  // Don't do it too often.
         TIL til(ts_lock, 7);
-        AssertTILHeld();
         FlushIfOutOfMem(thr);
       }
     }
@@ -6453,7 +11361,6 @@ class Detector {
       TraceInfo::PrintTraceProfile();
     }
 #endif
-#endif
 
 #if 0  // do we still need it? Hope not..
     size_t flush_period = G_flags->flush_period * 1000;  // milliseconds.
@@ -6475,33 +11382,88 @@ class Detector {
     FlushIfNeeded(thr);
   }
 
+  void INLINE HandleRtnExit(TSanThread *thr) {
+    thr->HandleRtnExit();
+    uintptr_t a = 0, b = 0;
+    if (UNLIKELY(G_flags->lazy_stack_reset > 0) &&
+        thr->GetPoppedStackFrames(&a, &b)) {
+      ResetPoppedStackFrames(thr, a, b);
+    }
+  }
+
+  // The popped frames are reset like a freed buffer, but always lazily:
+  // the lines are reset when fetched or swept, so the segments the dead
+  // frames refer to get recycled and the next frames start clean.
+  NOINLINE void ResetPoppedStackFrames(TSanThread *thr,
+                                       uintptr_t a, uintptr_t b) {
+    TIL til(ts_lock, 9);
+    ClearMemoryState(thr, a, b, /*lazy=*/true);
+    G_stats->Shard()->lazy_stack_resets++;
+    G_stats->Shard()->lazy_stack_reset_bytes += b - a;
+  }
+
+  // Dumps the latency histograms every --latency_stats_period seconds.
+  NOINLINE void MaybePrintLatencyStats() {
+    // The counter is racy w/o TS_SERIALIZED, which is fine for sampling.
+    static uintptr_t counter;
+    if ((++counter % (1024 * 4)) != 0) return;
+    static size_t last_time;
+    size_t period = G_flags->latency_stats_period * 1000;  // milliseconds.
+    size_t cur_time = TimeInMilliSeconds();
+    if (last_time == 0) last_time = cur_time;
+    if (cur_time - last_time < period) return;
+    TIL til(ts_lock, 7);
+    if (cur_time - last_time < period) return;
+    last_time = cur_time;
+    G_stats->PrintLatencyStats();
+  }
+
   void INLINE HandleOneEvent(Event *e) {
     ScopedMallocCostCenter malloc_cc("HandleOneEvent");
 
     DCHECK(e);
     EventType type = e->type();
     DCHECK(type != NOOP);
+    // With --reuse_dead_tids the handlers see the slots, not the frontend
+    // TIDs (except for the TIDs of the children, see NewSlot()).
+    Event slot_event;
+    if (UNLIKELY(G_flags->reuse_dead_tids) && type != THR_START) {
+      slot_event.Init(type, TSanThread::TidToSlot(e->tid()).raw(),
+                      e->pc(), e->a(), e->info());
+      e = &slot_event;
+    }
     TSanThread *thr = NULL;
     if (type != THR_START) {
       thr = TSanThread::Get(TID(e->tid()));
       DCHECK(thr);
       thr->SetTopPc(e->pc());
       thr->stats.events[type]++;
+      if (UNLIKELY(G_flags->latency_stats_period))
+        MaybePrintLatencyStats();
+      // Not only on routine calls: the tsan_rtl builds do not send those.
+      if (G_flags->max_mem_in_mb > 0)
+        FlushIfNeeded(thr);
     }
 
     switch (type) {
       case READ:
-        HandleMemoryAccess(thr, e->pc(), e->a(), e->info(), false, true);
+        if (UNLIKELY(e->info() > MopInfo::kMaxSize))
+          HandleMemoryAccessRange(thr, e->pc(), e->a(), e->info(), false, true);
+        else
+          HandleMemoryAccess(thr, e->pc(), e->a(), e->info(), false, true);
         return;
       case WRITE:
-        HandleMemoryAccess(thr, e->pc(), e->a(), e->info(), true, true);
+        if (UNLIKELY(e->info() > MopInfo::kMaxSize))
+          HandleMemoryAccessRange(thr, e->pc(), e->a(), e->info(), true, true);
+        else
+          HandleMemoryAccess(thr, e->pc(), e->a(), e->info(), true, true);
         return;
       case RTN_CALL:
         HandleRtnCall(TID(e->tid()), e->pc(), e->a(),
                       IGNORE_BELOW_RTN_UNKNOWN);
         return;
       case RTN_EXIT:
-        thr->HandleRtnExit();
+        HandleRtnExit(thr);
         return;
       default: break;
     }
@@ -6513,7 +11475,7 @@ class Detector {
 
     if (UNLIKELY(type == THR_START)) {
         HandleThreadStart(TID(e->tid()), TID(e->info()), (CallStack*)e->pc());
-        TSanThread::Get(TID(e->tid()))->stats.events[type]++;
+        TSanThread::GetByFrontendTid(e->tid())->stats.events[type]++;
         return;
     }
 
@@ -6521,6 +11483,7 @@ class Detector {
 
     // Since we have the lock, get some fresh SIDs.
     thr->GetSomeFreshSids();
+    SegmentSet::FlushDeferredRecycling();
 
     switch (type) {
       case THR_START   : CHECK(0); break;
@@ -6558,6 +11521,12 @@ class Detector {
 
       case SIGNAL      : thr->HandleSignal(e->a());  break;
       case WAIT        : thr->HandleWait(e->a());   break;
+      case SIGNAL_MANY :
+        thr->HandleSignalMany((const uintptr_t*)e->a(), e->info());
+        break;
+      case WAIT_MANY   :
+        thr->HandleWaitMany((const uintptr_t*)e->a(), e->info());
+        break;
 
       case CYCLIC_BARRIER_INIT:
         thr->HandleBarrierInit(e->a(), e->info());
@@ -6629,6 +11598,8 @@ class Detector {
       case NOOP        : CHECK(0);           break;  // can't happen.
       case VERBOSITY   : e->Print(); G_flags->verbosity = e->info(); break;
       case FLUSH_STATE : FlushState(TID(e->tid()));       break;
+      case TARGET_RANGE   : HandleTargetRange(e, true);   break;
+      case UNTARGET_RANGE : HandleTargetRange(e, false);  break;
       default                 : CHECK(0);    break;
     }
   }
@@ -6646,6 +11617,9 @@ class Detector {
   void ShowStats() {
     if (G_flags->show_stats) {
       G_stats->PrintStats();
+      Printf("   Stack depot: %'ld stacks; %'ldM\n",
+             G_stack_depot->NumberOfStacks(),
+             G_stack_depot->AllocatedBytes() >> 20);
       G_cache->PrintStorageStats();
     }
   }
@@ -6655,17 +11629,22 @@ class Detector {
     if (G_flags->verbosity >= 2) {
       e->Print();
     }
-    PCQ pcq;
-    pcq.pcq_addr = e->a();
     CHECK(!g_pcq_map->count(e->a()));
-    (*g_pcq_map)[e->a()] = pcq;
+    PCQ &pcq = (*g_pcq_map)[e->a()];
+    pcq.pcq_addr = e->a();
+    pcq.head = 0;
+    pcq.size = 0;
   }
   void HandlePcqDestroy(Event *e) {
     if (G_flags->verbosity >= 2) {
       e->Print();
     }
-    CHECK(g_pcq_map->count(e->a()));
-    g_pcq_map->erase(e->a());
+    PCQMap::iterator it = g_pcq_map->find(e->a());
+    CHECK(it != g_pcq_map->end());
+    PCQ &pcq = it->second;
+    for (uint32_t i = 0; i < pcq.size; i++)
+      VTS::Unref(pcq.at(i).vts);
+    g_pcq_map->erase(it);
   }
   void HandlePcqPut(Event *e) {
     if (G_flags->verbosity >= 2) {
@@ -6675,7 +11654,7 @@ class Detector {
     CHECK(pcq.pcq_addr == e->a());
     TSanThread *thread = TSanThread::Get(TID(e->tid()));
     VTS *vts = thread->segment()->vts()->Clone();
-    pcq.putters.push_back(vts);
+    pcq.Put(vts);
     thread->NewSegmentForSignal();
   }
   void HandlePcqGet(Event *e) {
@@ -6684,9 +11663,7 @@ class Detector {
     }
     PCQ &pcq = (*g_pcq_map)[e->a()];
     CHECK(pcq.pcq_addr == e->a());
-    CHECK(!pcq.putters.empty());
-    VTS *putter = pcq.putters.front();
-    pcq.putters.pop_front();
+    VTS *putter = pcq.Get();
     CHECK(putter);
     TSanThread *thread = TSanThread::Get(TID(e->tid()));
     thread->NewSegmentForWait(putter);
@@ -6775,12 +11752,11 @@ class Detector {
     if (debug_expected_races) {
       Printf("T%d: EXPECT_RACE: ptr=%p descr='%s'\n", tid.raw(), ptr, descr);
       thread->ReportStackTrace(ptr);
-      int i = 0;
-      for (ExpectedRacesMap::iterator it = G_expected_races_map->begin();
-           it != G_expected_races_map->end(); ++it) {
-        ExpectedRace &x = it->second;
-        Printf("  [%d] %p [0x%lx]\n", i, &x, x.ptr);
-        i++;
+      vector<ExpectedRace*> races;
+      G_expected_races_map->GetAll(&races);
+      for (size_t i = 0; i < races.size(); i++) {
+        ExpectedRace &x = *races[i];
+        Printf("  [%d] %p [0x%lx]\n", (int)i, &x, x.ptr);
       }
     }
   }
@@ -6809,6 +11785,8 @@ class Detector {
     Lock *lock = Lock::LookupOrCreate(e->a());
     CHECK(lock);
     lock->set_is_pure_happens_before(false);
+    // Locksets matter from now on.
+    g_pure_hb_engine = false;
   }
 
   // UNLOCK_OR_INIT
@@ -6886,18 +11864,26 @@ class Detector {
     if (G_flags->verbosity >= 2) e->Print();
   }
 
-  INLINE void RefAndUnrefTwoSegSetPairsIfDifferent(SSID new_ssid1,
+  INLINE void RefSegSet(TSanThread *thr, SSID ssid, const char *where) {
+    if (ssid == SSID(thr->sid()))
+      thr->RefCurrentSid(where);
+    else
+      SegmentSet::Ref(ssid, where);
+  }
+
+  INLINE void RefAndUnrefTwoSegSetPairsIfDifferent(TSanThread *thr,
+                                                   SSID new_ssid1,
                                                    SSID old_ssid1,
                                                    SSID new_ssid2,
                                                    SSID old_ssid2) {
     bool recycle_1 = new_ssid1 != old_ssid1,
          recycle_2 = new_ssid2 != old_ssid2;
     if (recycle_1 && !new_ssid1.IsEmpty()) {
-      SegmentSet::Ref(new_ssid1, "RefAndUnrefTwoSegSetPairsIfDifferent");
+      RefSegSet(thr, new_ssid1, "RefAndUnrefTwoSegSetPairsIfDifferent");
     }
 
     if (recycle_2 && !new_ssid2.IsEmpty()) {
-      SegmentSet::Ref(new_ssid2, "RefAndUnrefTwoSegSetPairsIfDifferent");
+      RefSegSet(thr, new_ssid2, "RefAndUnrefTwoSegSetPairsIfDifferent");
     }
 
     if (recycle_1 && !old_ssid1.IsEmpty()) {
@@ -6912,11 +11898,27 @@ class Detector {
 
   // return true if the current pair of read/write segment sets
   // describes a race.
+  template <bool kPureHB>
   bool NOINLINE CheckIfRace(SSID rd_ssid, SSID wr_ssid) {
     int wr_ss_size = SegmentSet::Size(wr_ssid);
     int rd_ss_size = SegmentSet::Size(rd_ssid);
 
     DCHECK(wr_ss_size >= 2 || (wr_ss_size >= 1 && rd_ss_size >= 1));
+    SegmentSet::PrefetchSegments(rd_ssid);
+
+    if (kPureHB) {
+      // A pure happens-before lock held by two segments (other than two
+      // readers) orders them, so concurrent writers never have a common
+      // lock and only the happens-before test is left.
+      if (wr_ss_size >= 2) return true;
+      SID w_sid = SegmentSet::GetSID(wr_ssid, 0, __LINE__);
+      for (int r = 0; r < rd_ss_size; r++) {
+        SID r_sid = SegmentSet::GetSID(rd_ssid, r, __LINE__);
+        if (!Segment::HappensBeforeOrSameThread(w_sid, r_sid))
+          return true;
+      }
+      return false;
+    }
 
     // check all write-write pairs
     for (int w1 = 0; w1 < wr_ss_size; w1++) {
@@ -6957,6 +11959,8 @@ class Detector {
   // New experimental state machine.
   // Set *res to the new state.
   // Return true if the new state is race.
+  // kPureHB is g_pure_hb_engine, see CheckIfRace().
+  template <bool kPureHB>
   bool INLINE MemoryStateMachine(ShadowValue old_sval, TSanThread *thr,
                                  bool is_w, ShadowValue *res) {
     ShadowValue new_sval;
@@ -6992,7 +11996,7 @@ class Detector {
       new_wr_ssid = old_wr_ssid;
     }
 
-    if (UNLIKELY(G_flags->sample_events > 0)) {
+    if (UNLIKELY(G_flags->sample_events > 0) && !ShardedLocking()) {
       if (new_rd_ssid.IsTuple() || new_wr_ssid.IsTuple()) {
         static EventSampler sampler;
         sampler.Sample(thr, "HasTupleSS", false);
@@ -7007,7 +12011,7 @@ class Detector {
 
     if (new_wr_ssid.IsTuple() ||
         (!new_wr_ssid.IsEmpty() && !new_rd_ssid.IsEmpty())) {
-      return CheckIfRace(new_rd_ssid, new_wr_ssid);
+      return CheckIfRace<kPureHB>(new_rd_ssid, new_wr_ssid);
     }
     return false;
   }
@@ -7018,6 +12022,10 @@ class Detector {
   // Tuple segment sets and check for race.
   // If this function returns true, the ShadowValue *new_sval is updated
   // in the same way as MemoryStateMachine() would have done it. Just faster.
+  // A table keyed by (is_w, rd kind, wr kind) instead of the branches was
+  // tried and was 15-20% slower on ts_benchmark: the branches here are well
+  // predicted and the table lookup has to wait for both classifications,
+  // each of which may need Segment::Get(). See private_mixed in ts_benchmark.
   INLINE bool MemoryStateMachineSameThread(bool is_w, ShadowValue old_sval,
                                            TSanThread *thr,
                                            ShadowValue *new_sval) {
@@ -7036,7 +12044,7 @@ class Detector {
           // no op
           return true;
         }
-        if (tid == Segment::Get(wr_sid)->tid()) {
+        if (tid == Segment::Tid(wr_sid)) {
           // same thread, but the segments are different.
           DCHECK(cur_sid != wr_sid);
           if (is_w) {    // -------------- w: {0, wr} => {0, cur}
@@ -7047,7 +12055,7 @@ class Detector {
             MSM_STAT(3);
             new_sval->set(SSID(cur_sid), wr_ssid);
           }
-          Segment::Ref(cur_sid, "FastPath01");
+          thr->RefCurrentSid("FastPath01");
           return true;
         }
       } else if (wr_ssid.IsEmpty()) {
@@ -7059,7 +12067,7 @@ class Detector {
           MSM_STAT(5);
           new_sval->set(SSID(cur_sid), SSID(0));
         }
-        Segment::Ref(cur_sid, "FastPath00");
+        thr->RefCurrentSid("FastPath00");
         return true;
       }
     } else if (rd_ssid.IsSingleton()) {
@@ -7077,7 +12085,7 @@ class Detector {
           }
           return true;
         }
-        if (tid == Segment::Get(rd_sid)->tid()) {
+        if (tid == Segment::Tid(rd_sid)) {
           // same thread, but the segments are different.
           DCHECK(cur_sid != rd_sid);
           if (is_w) {  // -------------- w: {rd, 0} => {0, cur}
@@ -7087,7 +12095,7 @@ class Detector {
             MSM_STAT(9);
             new_sval->set(SSID(cur_sid), SSID(0));
           }
-          Segment::Ref(cur_sid, "FastPath10");
+          thr->RefCurrentSid("FastPath10");
           thr->AddDeadSid(rd_sid, "FastPath10");
           return true;
         }
@@ -7097,7 +12105,7 @@ class Detector {
         SID wr_sid = wr_ssid.GetSingleton();
         DCHECK(wr_sid != rd_sid);  // By definition of ShadowValue.
         if (cur_sid == rd_sid) {
-          if (tid == Segment::Get(wr_sid)->tid()) {
+          if (tid == Segment::Tid(wr_sid)) {
             if (is_w) {  // -------------- w: {cur, wr} => {0, cur}
               MSM_STAT(10);
               new_sval->set(SSID(0), SSID(cur_sid));
@@ -7109,7 +12117,7 @@ class Detector {
             return true;
           }
         } else if (cur_sid == wr_sid){
-          if (tid == Segment::Get(rd_sid)->tid()) {
+          if (tid == Segment::Tid(rd_sid)) {
             if (is_w) {  // -------------- w: {rd, cur} => {rd, cur}
               MSM_STAT(12);
               // no op
@@ -7120,8 +12128,8 @@ class Detector {
             }
             return true;
           }
-        } else if (tid == Segment::Get(rd_sid)->tid() &&
-                   tid == Segment::Get(wr_sid)->tid()) {
+        } else if (tid == Segment::Tid(rd_sid) &&
+                   tid == Segment::Tid(wr_sid)) {
           if (is_w) {    // -------------- w: {rd, wr} => {0, cur}
             MSM_STAT(14);
             new_sval->set(SSID(0), SSID(cur_sid));
@@ -7131,7 +12139,7 @@ class Detector {
             new_sval->set(SSID(cur_sid), wr_ssid);
           }
           thr->AddDeadSid(rd_sid, "FastPath11");
-          Segment::Ref(cur_sid, "FastPath11");
+          thr->RefCurrentSid("FastPath11");
           return true;
         }
       }
@@ -7141,17 +12149,32 @@ class Detector {
 #undef MSM_STAT
   }
 
-  // return false if we were not able to complete the task (fast_path_only).
+  // return false if we were not able to complete the task (fast_path_only,
+  // or sharded and the access needs ts_lock).
   INLINE bool HandleMemoryAccessHelper(bool is_w,
                                        CacheLine *cache_line,
                                        uintptr_t addr,
                                        uintptr_t size,
                                        uintptr_t pc,
                                        TSanThread *thr,
-                                       bool fast_path_only) {
+                                       bool fast_path_only,
+                                       bool sharded) {
     DCHECK((addr & (size - 1)) == 0);  // size-aligned.
     uintptr_t offset = CacheLine::ComputeOffset(addr);
 
+    // A race on racey memory is never reported again, so unless the memory
+    // is published (which creates happens-before arcs) the state machine
+    // would only update a shadow value nobody looks at. The shadow values
+    // of an 8-byte chunk are joined and split with each other, so the whole
+    // chunk has to be racey, otherwise a stale value could leak into a
+    // report on one of its non-racey bytes. See --skip_racey_accesses.
+    if (UNLIKELY(!cache_line->racey().Empty()) &&
+        G_flags->skip_racey_accesses &&
+        IsRaceyChunk(cache_line, offset) &&
+        !cache_line->published().Get(offset)) {
+      return true;
+    }
+
     ShadowValue old_sval;
     ShadowValue *sval_p = NULL;
 
@@ -7170,30 +12193,52 @@ class Detector {
       res = true;
     } else if (fast_path_only) {
       res = false;
+    } else if (UNLIKELY(g_racey_pcs != NULL) && IsRaceyPc(pc) &&
+               IsRaceyChunk(cache_line, offset) &&
+               !cache_line->published().Get(offset)) {
+      // See --ignore_racey_pcs.
+      res = true;
     } else {
       bool is_published = cache_line->published().Get(offset);
       // We check only the first bit for publishing, oh well.
       if (UNLIKELY(is_published)) {
+        // The publish map is protected by ts_lock.
+        if (sharded) return false;
         const VTS *signaller_vts = GetPublisherVTS(addr);
         CHECK(signaller_vts);
         thr->NewSegmentForWait(signaller_vts);
       }
 
-      bool is_race = MemoryStateMachine(old_sval, thr, is_w, sval_p);
+      if (UNLIKELY(SharingProfile::enabled()) &&
+          !SharingProfile::IsOwnedByThread(old_sval, thr->tid())) {
+        SharingProfile::OnAccess(pc, true);
+      }
+
+      bool is_race = g_pure_hb_engine
+          ? MemoryStateMachine<true>(old_sval, thr, is_w, sval_p)
+          : MemoryStateMachine<false>(old_sval, thr, is_w, sval_p);
 
       // Check for race.
       if (UNLIKELY(is_race)) {
+        if (sharded) {
+          // Races are reported under ts_lock. Undo and let the caller
+          // redo this access in the locked slow path.
+          *sval_p = old_sval;
+          return false;
+        }
         if (thr->ShouldReportRaces()) {
           if (G_flags->report_races && !cache_line->racey().Get(offset)) {
             reports_.AddReport(thr, pc, is_w, addr, size,
                                old_sval, *sval_p, is_published);
           }
           cache_line->racey().SetRange(offset, offset + size);
+          if (UNLIKELY(g_racey_pcs != NULL))
+            g_racey_pcs->Insert(pc, true);
         }
       }
 
       // Ref/Unref segments
-      RefAndUnrefTwoSegSetPairsIfDifferent(sval_p->rd_ssid(),
+      RefAndUnrefTwoSegSetPairsIfDifferent(thr, sval_p->rd_ssid(),
                                            old_sval.rd_ssid(),
                                            sval_p->wr_ssid(),
                                            old_sval.wr_ssid());
@@ -7201,7 +12246,7 @@ class Detector {
     }
 
 
-    if (TSAN_DEBUG && !fast_path_only) {
+    if (TSAN_DEBUG && !fast_path_only && !sharded) {
       // check that the SSIDs/SIDs in the new sval have sane ref counters.
       CHECK(!sval_p->wr_ssid().IsEmpty() || !sval_p->rd_ssid().IsEmpty());
       for (int i = 0; i < 2; i++) {
@@ -7232,7 +12277,7 @@ class Detector {
   INLINE bool HandleAccessGranularityAndExecuteHelper(
       CacheLine *cache_line,
       TSanThread *thr, uintptr_t addr, MopInfo *mop,
-      bool has_expensive_flags, bool fast_path_only) {
+      bool has_expensive_flags, bool fast_path_only, bool sharded) {
     size_t size = mop->size();
     uintptr_t pc = mop->pc();
     bool is_w = mop->is_write();
@@ -7248,7 +12293,7 @@ class Detector {
 
     if        (size == 8 && (off & 7) == 0) {
       if (!gr) {
-        *granularity_mask = gr = 1;  // 0000000000000001
+        *granularity_mask = gr = kGranularity8Bits;
       }
       if (GranularityIs8(off, gr)) {
         if (has_expensive_flags) thr->stats.n_fast_access8++;
@@ -7257,18 +12302,23 @@ class Detector {
       } else {
         if (fast_path_only) return false;
         if (has_expensive_flags) thr->stats.n_slow_access8++;
-        cache_line->Join_1_to_2(off);
-        cache_line->Join_1_to_2(off + 2);
-        cache_line->Join_1_to_2(off + 4);
-        cache_line->Join_1_to_2(off + 6);
-        cache_line->Join_2_to_4(off);
-        cache_line->Join_2_to_4(off + 4);
+        // Only try the joins the granularity mask allows.
+        if (gr & kGranularity1Bits) {
+          cache_line->Join_1_to_2(off);
+          cache_line->Join_1_to_2(off + 2);
+          cache_line->Join_1_to_2(off + 4);
+          cache_line->Join_1_to_2(off + 6);
+        }
+        if (*granularity_mask & kGranularity2Bits) {
+          cache_line->Join_2_to_4(off);
+          cache_line->Join_2_to_4(off + 4);
+        }
         cache_line->Join_4_to_8(off);
         goto slow_path;
       }
     } else if (size == 4 && (off & 3) == 0) {
       if (!gr) {
-        *granularity_mask = gr = 3 << 1;  // 0000000000000110
+        *granularity_mask = gr = kGranularity4Bits;
       }
       if (GranularityIs4(off, gr)) {
         if (has_expensive_flags) thr->stats.n_fast_access4++;
@@ -7278,14 +12328,16 @@ class Detector {
         if (fast_path_only) return false;
         if (has_expensive_flags) thr->stats.n_slow_access4++;
         cache_line->Split_8_to_4(off);
-        cache_line->Join_1_to_2(off);
-        cache_line->Join_1_to_2(off + 2);
+        if (gr & kGranularity1Bits) {
+          cache_line->Join_1_to_2(off);
+          cache_line->Join_1_to_2(off + 2);
+        }
         cache_line->Join_2_to_4(off);
         goto slow_path;
       }
     } else if (size == 2 && (off & 1) == 0) {
       if (!gr) {
-        *granularity_mask = gr = 15 << 3;  // 0000000001111000
+        *granularity_mask = gr = kGranularity2Bits;
       }
       if (GranularityIs2(off, gr)) {
         if (has_expensive_flags) thr->stats.n_fast_access2++;
@@ -7301,7 +12353,7 @@ class Detector {
       }
     } else if (size == 1) {
       if (!gr) {
-        *granularity_mask = gr = 255 << 7;  // 0111111110000000
+        *granularity_mask = gr = kGranularity1Bits;
       }
       if (GranularityIs1(off, gr)) {
         if (has_expensive_flags) thr->stats.n_fast_access1++;
@@ -7335,7 +12387,8 @@ class Detector {
         cache_line->Split_8_to_4(off);
         cache_line->Split_4_to_2(off);
         cache_line->Split_2_to_1(off);
-        if (!HandleMemoryAccessHelper(is_w, cache_line, x, 1, pc, thr, false))
+        if (!HandleMemoryAccessHelper(is_w, cache_line, x, 1, pc, thr,
+                                      false, sharded))
           return false;
       }
       return true;
@@ -7355,20 +12408,84 @@ slow_path:
       if (has_expensive_flags) thr->stats.n_access_slow_iter++;
       off = CacheLine::ComputeOffset(x);
       cache_line->DebugTrace(off, __FUNCTION__, __LINE__);
-      size_t s = 0;
       // How many bytes are we going to access?
-      if     (GranularityIs8(off, gr)) s = 8;
-      else if(GranularityIs4(off, gr)) s = 4;
-      else if(GranularityIs2(off, gr)) s = 2;
-      else                             s = 1;
-      if (!HandleMemoryAccessHelper(is_w, cache_line, x, s, pc, thr, false))
+      size_t s = GranularitySize(off, gr);
+      if (!HandleMemoryAccessHelper(is_w, cache_line, x, s, pc, thr,
+                                    false, sharded))
         return false;
       x += s;
     }
     return true;
 one_call:
     return HandleMemoryAccessHelper(is_w, cache_line, addr, size, pc,
-                                    thr, fast_path_only);
+                                    thr, fast_path_only, sharded);
+  }
+
+  // The fast path of HandleAccessGranularityAndExecuteHelper() (no
+  // expensive flags, not sharded) specialized for one size and access
+  // kind, so that the granularity test, its bits and the state machine
+  // branches on is_w are resolved at compile time. A misaligned access
+  // goes through the generic code. See DispatchFastAccess().
+  template <int kSize, bool kIsW>
+  INLINE bool FastAccess(CacheLine *cache_line, TSanThread *thr,
+                         uintptr_t addr, MopInfo *mop) {
+    uintptr_t off = CacheLine::ComputeOffset(addr);
+    if (UNLIKELY(off & (kSize - 1)))
+      return FastAccessGeneric(cache_line, thr, addr, mop);
+    uint16_t *granularity_mask = cache_line->granularity_mask(off);
+    uint16_t gr = *granularity_mask;
+    if (!gr) {
+      *granularity_mask = gr =
+          kSize == 8 ? kGranularity8Bits : kSize == 4 ? kGranularity4Bits :
+          kSize == 2 ? kGranularity2Bits : kGranularity1Bits;
+    }
+    bool gr_ok =
+        kSize == 8 ? GranularityIs8(off, gr) : kSize == 4 ?
+        GranularityIs4(off, gr) : kSize == 2 ? GranularityIs2(off, gr) :
+        GranularityIs1(off, gr);
+    if (!gr_ok) return false;
+    cache_line->DebugTrace(off, __FUNCTION__, __LINE__);
+    return HandleMemoryAccessHelper(kIsW, cache_line, addr, kSize, mop->pc(),
+                                    thr, /*fast_path_only=*/true,
+                                    /*sharded=*/false);
+  }
+
+  // An aligned 16-byte access (SSE) is two 8-byte ones. The generic code
+  // would handle it byte by byte.
+  template <bool kIsW>
+  INLINE bool FastAccess16(CacheLine *cache_line, TSanThread *thr,
+                           uintptr_t addr, MopInfo *mop) {
+    if (UNLIKELY(CacheLine::ComputeOffset(addr) & 15))
+      return FastAccessGeneric(cache_line, thr, addr, mop);
+    return FastAccess<8, kIsW>(cache_line, thr, addr, mop) &&
+           FastAccess<8, kIsW>(cache_line, thr, addr + 8, mop);
+  }
+
+  NOINLINE bool FastAccessGeneric(CacheLine *cache_line, TSanThread *thr,
+                                  uintptr_t addr, MopInfo *mop) {
+    return HandleAccessGranularityAndExecuteHelper(
+        cache_line, thr, addr, mop, /*has_expensive_flags=*/false,
+        /*fast_path_only=*/true, /*sharded=*/false);
+  }
+
+  // Same as HandleAccessGranularityAndExecuteHelper() with
+  // fast_path_only=true, w/o expensive flags and not sharded.
+  // The switch on (size - 1) * 2 + is_write compiles into a jump table.
+  INLINE bool DispatchFastAccess(CacheLine *cache_line, TSanThread *thr,
+                                 uintptr_t addr, MopInfo *mop) {
+    switch ((mop->size() - 1) * 2 + mop->is_write()) {
+      case 0:  return FastAccess<1, false>(cache_line, thr, addr, mop);
+      case 1:  return FastAccess<1, true>(cache_line, thr, addr, mop);
+      case 2:  return FastAccess<2, false>(cache_line, thr, addr, mop);
+      case 3:  return FastAccess<2, true>(cache_line, thr, addr, mop);
+      case 6:  return FastAccess<4, false>(cache_line, thr, addr, mop);
+      case 7:  return FastAccess<4, true>(cache_line, thr, addr, mop);
+      case 14: return FastAccess<8, false>(cache_line, thr, addr, mop);
+      case 15: return FastAccess<8, true>(cache_line, thr, addr, mop);
+      case 30: return FastAccess16<false>(cache_line, thr, addr, mop);
+      case 31: return FastAccess16<true>(cache_line, thr, addr, mop);
+      default: return FastAccessGeneric(cache_line, thr, addr, mop);
+    }
   }
 
   INLINE bool IsTraced(CacheLine *cache_line, uintptr_t addr,
@@ -7432,7 +12549,8 @@ one_call:
     CacheLine *cache_line = G_cache->GetLineOrCreateNew(thr, addr, __LINE__);
     HandleAccessGranularityAndExecuteHelper(cache_line, thr, addr,
                                             mop, has_expensive_flags,
-                                            /*fast_path_only=*/false);
+                                            /*fast_path_only=*/false,
+                                            /*sharded=*/false);
     bool tracing = IsTraced(cache_line, addr, has_expensive_flags);
     G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
     cache_line = NULL;  // just in case.
@@ -7449,12 +12567,53 @@ one_call:
     }
   }
 
+  // The slow path with sharded locking (--locking_scheme=2).
+  // ts_lock is taken only for a short prologue; the state machine itself runs
+  // under the cache line lock and the per-table shard locks.
+  // Returns false if the access has to be redone under ts_lock
+  // (published memory, races, etc).
+  NOINLINE bool HandleMemoryAccessSharded(TSanThread *thr,
+                                          uintptr_t *sblock_pc,
+                                          uintptr_t addr,
+                                          MopInfo *mop,
+                                          bool has_expensive_flags) {
+    {
+      TIL til(ts_lock, 3);
+      // SegmentSet::vec_ can not grow beyond its reserved size.
+      if (SegmentSet::NumberOfSegmentSets() > (size_t)kMaxSIDBeforeFlush) {
+        ForgetAllStateAndStartOver(thr, "run out of segment set IDs");
+      }
+      thr->HandleSblockEnter(*sblock_pc, /*allow_slow_path=*/true);
+      *sblock_pc = 0;  // don't do SblockEnter any more.
+      thr->FlushDeadSids();
+      thr->GetSomeFreshSids();
+      SegmentSet::FlushDeferredRecycling();
+    }
+    bool res, tracing;
+    {
+      ScopedShardedSection section;
+      CacheLine *cache_line = G_cache->GetLineOrCreateNew(thr, addr, __LINE__);
+      res = HandleAccessGranularityAndExecuteHelper(cache_line, thr, addr,
+                                                    mop, has_expensive_flags,
+                                                    /*fast_path_only=*/false,
+                                                    /*sharded=*/true);
+      tracing = IsTraced(cache_line, addr, has_expensive_flags);
+      G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
+    }
+    if (res && tracing) {
+      DoTrace(thr, addr, mop, /*need_locking=*/true);
+    }
+    return res;
+  }
+
   INLINE bool HandleMemoryAccessInternal(TSanThread *thr,
                                          uintptr_t *sblock_pc,
                                          uintptr_t addr,
                                          MopInfo *mop,
                                          bool has_expensive_flags,
                                          bool need_locking) {
+    if (UNLIKELY(g_target_filter != NULL) && !g_target_filter->MayBeTarget(addr))
+      return false;
 #   define INC_STAT(stat) \
         do { if (has_expensive_flags) (stat)++; } while ((void)0, 0)
     if (TS_ATOMICITY && G_flags->atomicity) {
@@ -7471,6 +12630,8 @@ one_call:
     // On optimized binaries ignoring stack gives nearly nothing.
     // if (thr->IgnoreMemoryIfInStack(addr)) return;
 
+    ScopedLatency latency(LATENCY_MOP_SLOW,
+                          has_expensive_flags && G_flags->latency_stats);
     CacheLine *cache_line = NULL;
     INC_STAT(thr->stats.memory_access_sizes[mop->size() <= 16 ? mop->size() : 17 ]);
     INC_STAT(thr->stats.events[mop->is_write() ? WRITE : READ]);
@@ -7478,6 +12639,10 @@ one_call:
       thr->stats.access_to_first_1g += (addr >> 30) == 0;
       thr->stats.access_to_first_2g += (addr >> 31) == 0;
       thr->stats.access_to_first_4g += ((uint64_t)addr >> 32) == 0;
+      if (SharingProfile::enabled())
+        SharingProfile::OnAccess(mop->pc(), false);
+      if (G_flags->lazy_stack_reset > 0)
+        thr->NoteStackAccess(addr);
     }
 
     int locked_access_case = 0;
@@ -7496,7 +12661,7 @@ one_call:
               bool res = HandleAccessGranularityAndExecuteHelper(
                   cache_line, thr, addr,
                   mop, has_expensive_flags,
-                  /*fast_path_only=*/true);
+                  /*fast_path_only=*/true, /*sharded=*/false);
               bool traced = IsTraced(cache_line, addr, has_expensive_flags);
               // release the line.
               G_cache->ReleaseLine(thr, addr, cache_line, __LINE__);
@@ -7505,6 +12670,7 @@ one_call:
               }
               if (res) {
                 INC_STAT(thr->stats.unlocked_access_ok);
+                latency.set_kind(LATENCY_MOP_FAST);
                 // fast path succeded, we are done.
                 return false;
               } else {
@@ -7538,6 +12704,13 @@ one_call:
       INC_STAT(thr->stats.locked_access[locked_access_case]);
     }
 
+    if (ShardedLocking() && need_locking &&
+        HandleMemoryAccessSharded(thr, sblock_pc, addr, mop,
+                                  has_expensive_flags)) {
+      INC_STAT(thr->stats.sharded_access_ok);
+      return true;
+    }
+
     // Everything below goes under a lock.
     TIL til(ts_lock, 2, need_locking);
     thr->HandleSblockEnter(*sblock_pc, /*allow_slow_path=*/true);
@@ -7579,6 +12752,27 @@ one_call:
   }
 
 
+  // TARGET_RANGE, UNTARGET_RANGE
+  void HandleTargetRange(Event *e, bool target) {
+    TSanThread *thr = TSanThread::Get(TID(e->tid()));
+    uintptr_t a = e->a();
+    uintptr_t b = a + e->info();
+    if (a >= b) return;
+    if (target) {
+      if (g_target_filter == NULL) {
+        // Up to now all the memory was tracked; it keeps its state.
+        TargetFilter *filter = new TargetFilter;
+        filter->Add(a, b);
+        ReleaseStore((uintptr_t*)&g_target_filter, (uintptr_t)filter);
+      } else {
+        g_target_filter->Add(a, b);
+      }
+    } else if (g_target_filter) {
+      g_target_filter->Remove(a, b);
+      ClearMemoryState(thr, a, b);
+    }
+  }
+
   // MALLOC
   void HandleMalloc(Event *e, bool is_mmap) {
     ScopedMallocCostCenter cc("HandleMalloc");
@@ -7604,6 +12798,12 @@ one_call:
     uintptr_t b = a + size;
     CHECK(a <= b);
     ClearMemoryState(thr, a, b);
+    if (g_target_filter && g_target_filter->has_alloc_sites()) {
+      if (g_target_filter->MatchesAllocSite(thr))
+        g_target_filter->Add(a, b);
+      else
+        g_target_filter->Remove(a, b);
+    }
     // update heap_map
     HeapInfo info;
     info.ptr  = a;
@@ -7638,13 +12838,8 @@ one_call:
     if (size && G_flags->free_is_write && !global_ignore) {
       const uintptr_t kMaxWriteSizeOnFree = 2048;
       uintptr_t write_size = min(kMaxWriteSizeOnFree, size);
-      uintptr_t step = sizeof(uintptr_t);
-      // We simulate 4- or 8-byte accesses to make analysis faster.
-      for (uintptr_t i = 0; i < write_size; i += step) {
-        uintptr_t this_size = write_size - i >= step ? step : write_size - i;
-        HandleMemoryAccess(thr, pc, a + i, this_size,
-                           /*is_w=*/true, /*need_locking*/false);
-      }
+      HandleMemoryAccessRange(thr, pc, a, write_size,
+                              /*is_w=*/true, /*need_locking*/false);
     }
   }
 
@@ -7677,6 +12872,9 @@ one_call:
     // has free() in it.
     if (G_flags->keep_history && G_flags->free_is_write) {
       thr->HandleSblockEnter(pc, /*allow_slow_path*/true);
+      // An sblock does not start a segment with --history_ring.
+      if (thr->has_history_ring())
+        thr->HandleSblockEnterSlowLocked();
     }
     ImitateWriteOnFree(thr, a, size, pc);
   }
@@ -7692,15 +12890,19 @@ one_call:
     HeapInfo *h_info = G_heap_map->GetInfo(a);
     uintptr_t size = e->info();
     if (h_info && h_info->ptr == a && h_info->size == size) {
-      // TODO(glider): we may want to handle memory deletion and call
-      // Segment::Unref for all the unmapped memory.
-      Segment::Unref(h_info->sid, __FUNCTION__);
-      G_heap_map->EraseRange(a, a + size);
+      // Also drop the chunks which were carved out of this mapping.
+      vector<HeapInfo> erased;
+      G_heap_map->EraseRange(a, a + size, &erased);
+      for (size_t i = 0; i < erased.size(); i++)
+        Segment::Unref(erased[i].sid, __FUNCTION__);
     }
 
     ThreadStackInfo *ts_info = G_thread_stack_map->GetInfo(a);
     if (ts_info && ts_info->ptr == a && ts_info->size == size)
       G_thread_stack_map->EraseRange(a, a + size);
+
+    // The code which lived here (if any) is gone.
+    SymbolCache::EraseRange(a, a + size);
   }
 
   void HandleThreadStart(TID child_tid, TID parent_tid, CallStack *call_stack) {
@@ -7709,26 +12911,34 @@ one_call:
     //         child_tid.raw(), parent_tid.raw(), pc, getpid());
     VTS *vts = NULL;
     StackTrace *creation_context = NULL;
+    TID slot;
+    int32_t clk;
+    if (parent_tid.valid())
+      parent_tid = TSanThread::TidToSlot(parent_tid.raw());
     if (child_tid == TID(0)) {
       // main thread, we are done.
-      vts = VTS::CreateSingleton(child_tid);
+      slot = TSanThread::NewSlot(child_tid.raw(), NULL, &clk);
+      vts = VTS::CreateSingleton(slot);
     } else if (!parent_tid.valid()) {
       TSanThread::StopIgnoringAccessesInT0BecauseNewThreadStarted();
       Report("INFO: creating thread T%d w/o a parent\n", child_tid.raw());
-      vts = VTS::CreateSingleton(child_tid);
+      slot = TSanThread::NewSlot(child_tid.raw(), NULL, &clk);
+      vts = VTS::CreateSingleton(slot, clk);
     } else {
       TSanThread::StopIgnoringAccessesInT0BecauseNewThreadStarted();
       TSanThread *parent = TSanThread::Get(parent_tid);
       CHECK(parent);
-      parent->HandleChildThreadStart(child_tid, &vts, &creation_context);
+      slot = parent->HandleChildThreadStart(child_tid, &vts, &creation_context);
     }
 
-    if (!call_stack) {
+    bool own_call_stack = call_stack == NULL;
+    if (own_call_stack) {
       call_stack = new CallStack();
     }
-    TSanThread *new_thread = new TSanThread(child_tid, parent_tid,
-                                    vts, creation_context, call_stack);
-    CHECK(new_thread == TSanThread::Get(child_tid));
+    TSanThread *new_thread = TSanThread::Create(slot, parent_tid,
+                                    vts, creation_context, call_stack,
+                                    own_call_stack);
+    CHECK(new_thread == TSanThread::Get(slot));
     if (child_tid == TID(0)) {
       new_thread->set_ignore_all_accesses(true); // until a new thread comes.
     }
@@ -7798,6 +13008,10 @@ one_call:
                child->vts()->ToString().c_str());
       }
       ClearMemoryState(thr, child->min_sp(), child->max_sp());
+      if (G_flags->reuse_dead_tids) {
+        EventSampler::MergeThread(child);
+        child->ReleaseSegments();
+      }
     } else {
       reports_.SetProgramFinished();
     }
@@ -7806,7 +13020,7 @@ one_call:
     if (g_so_far_only_one_thread == false
         && (thr->ignore_reads() || thr->ignore_writes())) {
       Report("WARNING: T%d ended while at least one 'ignore' bit is set: "
-             "ignore_wr=%d ignore_rd=%d\n", tid.raw(),
+             "ignore_wr=%d ignore_rd=%d\n", thr->frontend_tid(),
              thr->ignore_reads(), thr->ignore_writes());
       for (int i = 0; i < 2; i++) {
         StackTrace *context = thr->GetLastIgnoreContext(i);
@@ -7829,10 +13043,14 @@ one_call:
     TSanThread *parent_thr = TSanThread::Get(tid);
     VTS *vts_at_exit = NULL;
     TID child_tid = parent_thr->HandleThreadJoinAfter(&vts_at_exit, TID(e->a()));
-    CHECK(vts_at_exit);
+    if (!vts_at_exit) {
+      CHECK(G_flags->reuse_dead_tids);
+      return;
+    }
     CHECK(parent_thr->sid().valid());
     Segment::AssertLive(parent_thr->sid(),  __LINE__);
     parent_thr->NewSegmentForWait(vts_at_exit);
+    VTS::Unref(vts_at_exit);
     if (debug_thread) {
       Printf("T%d:  THR_JOIN_AFTER T%d  : %s\n", tid.raw(),
              child_tid.raw(), parent_thr->vts()->ToString().c_str());
@@ -8077,7 +13295,11 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   }
 
   FindBoolFlag("ignore_stack", false, args, &G_flags->ignore_stack);
+  FindBoolFlag("coalesce_mops", false, args, &G_flags->coalesce_mops);
   FindIntFlag("keep_history", 1, args, &G_flags->keep_history);
+  FindIntFlag("history_ring", 0, args, &G_flags->history_ring);
+  CHECK(G_flags->history_ring == 0 ||
+        (G_flags->history_ring >= 6 && G_flags->history_ring <= 24));
   FindUIntFlag("segment_set_recycle_queue_size", TSAN_DEBUG ? 10 : 10000, args,
                &G_flags->segment_set_recycle_queue_size);
   FindUIntFlag("recent_segments_cache_size", 10, args,
@@ -8143,6 +13365,21 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   FindIntFlag("dry_run", 0, args, &G_flags->dry_run);
   FindBoolFlag("report_races", true, args, &G_flags->report_races);
   FindIntFlag("locking_scheme", 1, args, &G_flags->locking_scheme);
+  FindBoolFlag("direct_shadow", false, args, &G_flags->direct_shadow);
+  FindIntFlag("parked_lines", 0, args, &G_flags->parked_lines);
+  FindBoolFlag("prefetch_shadow", false, args, &G_flags->prefetch_shadow);
+  G_flags->parked_lines = min(G_flags->parked_lines,
+                              (intptr_t)ParkedLines::kMaxLines);
+  FindBoolFlag("compress_cache_lines", false, args,
+               &G_flags->compress_cache_lines);
+  FindBoolFlag("vts_simd", true, args, &G_flags->vts_simd);
+  FindBoolFlag("delta_vts", false, args, &G_flags->delta_vts);
+  FindBoolFlag("tree_clocks", false, args, &G_flags->tree_clocks);
+  FindBoolFlag("epoch_hb", false, args, &G_flags->epoch_hb);
+  FindBoolFlag("biased_sid_refcount", false, args,
+               &G_flags->biased_sid_refcount);
+  FindBoolFlag("numa", false, args, &G_flags->numa);
+  FindIntFlag("huge_pages", 0, args, &G_flags->huge_pages);
   FindBoolFlag("unlock_on_mutex_destroy", true, args,
                &G_flags->unlock_on_mutex_destroy);
 
@@ -8157,6 +13394,14 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   FindIntFlag("sampling", 0, args, &G_flags->literace_sampling);
   CHECK(G_flags->literace_sampling < 32);
   CHECK(G_flags->literace_sampling >= 0);
+  FindIntFlag("literace_target_overhead", 0, args,
+              &G_flags->literace_target_overhead);
+  CHECK(G_flags->literace_target_overhead >= 0);
+  FindIntFlag("profiled_literace_sampling", 24, args,
+              &G_flags->profiled_literace_sampling);
+  CHECK(G_flags->profiled_literace_sampling < 32);
+  CHECK(G_flags->profiled_literace_sampling >= 0);
+  FindBoolFlag("mop_filter", false, args, &G_flags->mop_filter);
   FindBoolFlag("start_with_global_ignore_on", false, args,
                &G_flags->start_with_global_ignore_on);
 
@@ -8173,6 +13418,7 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindBoolFlag("thread_coverage", false, args, &G_flags->thread_coverage);
   
+  FindBoolFlag("detect_deadlocks", false, args, &G_flags->detect_deadlocks);
   FindBoolFlag("atomicity", false, args, &G_flags->atomicity);
   if (G_flags->atomicity) {
     // When doing atomicity violation checking we should not 
@@ -8182,6 +13428,15 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindBoolFlag("call_coverage", false, args, &G_flags->call_coverage);
   FindStringFlag("dump_events", args, &G_flags->dump_events);
+  FindStringFlag("record_events", args, &G_flags->record_events);
+  FindStringFlag("record_compressor", args, &G_flags->record_compressor);
+  FindBoolFlag("dedup_race_pcs", false, args, &G_flags->dedup_race_pcs);
+  FindBoolFlag("skip_racey_accesses", false, args,
+               &G_flags->skip_racey_accesses);
+  FindBoolFlag("ignore_racey_pcs", false, args, &G_flags->ignore_racey_pcs);
+  FindBoolFlag("async_reports", false, args, &G_flags->async_reports);
+  FindIntFlag("max_queued_reports", 1000, args,
+              &G_flags->max_queued_reports);
   FindBoolFlag("symbolize", true, args, &G_flags->symbolize);
 
   FindIntFlag("trace_addr", 0, args,
@@ -8190,6 +13445,7 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   FindIntFlag("max_mem_in_mb", 0, args, &G_flags->max_mem_in_mb);
   FindBoolFlag("offline", false, args, &G_flags->offline);
   FindBoolFlag("attach_mode", false, args, &G_flags->attach_mode);
+  FindIntFlag("attach_signal", 0, args, &G_flags->attach_signal);
   if (G_flags->max_mem_in_mb == 0) {
     G_flags->max_mem_in_mb = GetMemoryLimitInMb();
   }
@@ -8206,6 +13462,43 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
     G_flags->log_file = log_file_tmp.back();
   }
 
+  vector<string> sharing_profile_file_tmp;
+  FindStringFlag("sharing_profile_file", args, &sharing_profile_file_tmp);
+  if (sharing_profile_file_tmp.size() > 0) {
+    G_flags->sharing_profile_file = sharing_profile_file_tmp.back();
+  }
+
+  vector<string> detector_profile_tmp;
+  FindStringFlag("detector_profile", args, &detector_profile_tmp);
+  if (detector_profile_tmp.size() > 0) {
+    G_flags->detector_profile = detector_profile_tmp.back();
+  }
+  FindIntFlag("detector_profile_period", 64, args,
+              &G_flags->detector_profile_period);
+
+  vector<string> state_snapshot_tmp;
+  FindStringFlag("state_snapshot", args, &state_snapshot_tmp);
+  if (state_snapshot_tmp.size() > 0) {
+    G_flags->state_snapshot = state_snapshot_tmp.back();
+  }
+
+  FindStringFlag("target_range", args, &G_flags->target_range);
+  FindStringFlag("target_alloc_site", args, &G_flags->target_alloc_site);
+
+  vector<string> symbol_cache_file_tmp;
+  FindStringFlag("symbol_cache_file", args, &symbol_cache_file_tmp);
+  if (symbol_cache_file_tmp.size() > 0) {
+    G_flags->symbol_cache_file = symbol_cache_file_tmp.back();
+  }
+
+  FindBoolFlag("fast_win_locks", false, args, &G_flags->fast_win_locks);
+
+  vector<string> pin_cache_file_tmp;
+  FindStringFlag("pin_cache_file", args, &pin_cache_file_tmp);
+  if (pin_cache_file_tmp.size() > 0) {
+    G_flags->pin_cache_file = pin_cache_file_tmp.back();
+  }
+
 #if defined(_WIN32)
   G_flags->tsan_program_name = "tsan.bat";
 #else
@@ -8233,6 +13526,15 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   FindIntFlag("max_sid_before_flush", (kMaxSID * 15) / 16, args, 
               &G_flags->max_sid_before_flush);
   kMaxSIDBeforeFlush = G_flags->max_sid_before_flush;
+  FindIntFlag("incremental_flush", 0, args, &G_flags->incremental_flush);
+  FindIntFlag("lazy_shadow_reset", 0, args, &G_flags->lazy_shadow_reset);
+  FindIntFlag("lazy_stack_reset", 0, args, &G_flags->lazy_stack_reset);
+  FindIntFlag("latency_stats_period", 0, args,
+              &G_flags->latency_stats_period);
+  FindBoolFlag("hw_counters", false, args, &G_flags->hw_counters);
+  FindBoolFlag("latency_stats",
+               G_flags->latency_stats_period > 0 || G_flags->hw_counters,
+               args, &G_flags->latency_stats);
 
   FindIntFlag("num_callers_in_history", kSizeOfHistoryStackTrace, args,
               &G_flags->num_callers_in_history);
@@ -8248,6 +13550,8 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
   FindIntFlag("num_callers", 16, args, &G_flags->num_callers);
 
   G_flags->max_n_threads        = 100000;
+  FindIntFlag("max_goroutine_tids", 0, args, &G_flags->max_goroutine_tids);
+  FindBoolFlag("reuse_dead_tids", false, args, &G_flags->reuse_dead_tids);
 
   if (G_flags->full_output) {
     G_flags->announce_threads = true;
@@ -8259,6 +13563,8 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindIntFlag("race_verifier_sleep_ms", 100, args,
       &G_flags->race_verifier_sleep_ms);
+  FindBoolFlag("race_verifier_adaptive", false, args,
+      &G_flags->race_verifier_adaptive);
   FindStringFlag("race_verifier", args, &G_flags->race_verifier);
   FindStringFlag("race_verifier_extra", args, &G_flags->race_verifier_extra);
   g_race_verifier_active =
@@ -8269,11 +13575,21 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
   FindBoolFlag("nacl_untrusted", false, args, &G_flags->nacl_untrusted);
   FindBoolFlag("threaded_analysis", false, args, &G_flags->threaded_analysis);
+  FindIntFlag("num_analysis_threads", 2, args,
+              &G_flags->num_analysis_threads);
+  CHECK(G_flags->num_analysis_threads > 0);
+  FindBoolFlag("deferred_analysis", false, args, &G_flags->deferred_analysis);
+  FindBoolFlag("batch_sync_requests", false, args,
+               &G_flags->batch_sync_requests);
 
   FindBoolFlag("sched_shake", false, args, &G_flags->sched_shake);
   FindBoolFlag("api_ambush", false, args, &G_flags->api_ambush);
 
   FindBoolFlag("enable_atomic", false, args, &G_flags->enable_atomic);
+  FindBoolFlag("gil_free_allocator", false, args,
+               &G_flags->gil_free_allocator);
+  FindBoolFlag("rtl_allocator", false, args, &G_flags->rtl_allocator);
+  FindBoolFlag("fast_unwind", false, args, &G_flags->fast_unwind);
 
   if (!args->empty()) {
     ReportUnknownFlagAndExit(args->front());
@@ -8298,10 +13614,19 @@ void ThreadSanitizerParseFlags(vector<string> *args) {
 
 // -------- ThreadSanitizer ------------------ {{{1
 
+// The verdicts of the ignore lists, by pc. Filled lazily.
+typedef PcToBoolMap<16> IgnoreVerdictMap;
+static IgnoreVerdictMap *g_want_to_instrument_verdicts;
+static IgnoreVerdictMap *g_create_segments_verdicts;
+static IgnoreVerdictMap *g_ignore_below_verdicts;
+
 // Setup the list of functions/images/files to ignore.
 static void SetupIgnore() {
   g_ignore_lists = new IgnoreLists;
   g_white_lists = new IgnoreLists;
+  g_want_to_instrument_verdicts = new IgnoreVerdictMap;
+  g_create_segments_verdicts = new IgnoreVerdictMap;
+  g_ignore_below_verdicts = new IgnoreVerdictMap;
 
   // Add some major ignore entries so that tsan remains sane
   // even w/o any ignore file. First - for all platforms.
@@ -8430,12 +13755,24 @@ static void SetupIgnore() {
     string str = ThreadSanitizerReadFileToString(file_name, true);
     ReadIgnoresFromString(str, g_white_lists);
   }
+  g_ignore_lists->Compile();
+  g_white_lists->Compile();
 }
 
 void ThreadSanitizerSetUnwindCallback(ThreadSanitizerUnwindCallback cb) {
   G_detector->SetUnwindCallback(cb);
 }
 
+void ThreadSanitizerSetSymbolizeBatchCallback(
+    ThreadSanitizerSymbolizeBatchCallback cb) {
+  SymbolCache::SetBatchCallback(cb);
+}
+
+void ThreadSanitizerAtForkChild() {
+  // The lines created so far are shared with the parent now.
+  g_fork_epoch++;
+}
+
 void ThreadSanitizerNaclUntrustedRegion(uintptr_t mem_start, uintptr_t mem_end) {
   g_nacl_mem_start = mem_start;
   g_nacl_mem_end = mem_end;
@@ -8451,15 +13788,15 @@ bool ThreadSanitizerIgnoreForNacl(uintptr_t addr) {
   return G_flags->nacl_untrusted != AddrIsInNaclUntrustedRegion(addr);
 }
 
-bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
+static bool WantToInstrumentSblock(uintptr_t pc) {
   string img_name, rtn_name, file_name;
   int line_no;
-  G_stats->pc_to_strings++;
+  G_stats->Shard()->pc_to_strings++;
   PcToStrings(pc, false, &img_name, &rtn_name, &file_name, &line_no);
 
-  if (g_white_lists->ignores.size() > 0) {
-    bool in_white_list = TripleVectorMatchKnown(g_white_lists->ignores, 
-                                                rtn_name, img_name, file_name);
+  if (g_white_lists->ignores_matcher.size() > 0) {
+    bool in_white_list = g_white_lists->ignores_matcher.Match(
+        rtn_name, img_name, file_name);
     if (in_white_list) {
       if (debug_ignore) {
         Report("INFO: Whitelisted rtn: %s\n", rtn_name.c_str());
@@ -8476,10 +13813,9 @@ bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
     return false;
   }
 
-  bool ignore = TripleVectorMatchKnown(g_ignore_lists->ignores,
-                                       rtn_name, img_name, file_name) ||
-                TripleVectorMatchKnown(g_ignore_lists->ignores_r,
-                                       rtn_name, img_name, file_name);
+  bool ignore =
+      g_ignore_lists->ignores_matcher.Match(rtn_name, img_name, file_name) ||
+      g_ignore_lists->ignores_r_matcher.Match(rtn_name, img_name, file_name);
   if (debug_ignore) {
     Printf("%s: pc=%p file_name=%s img_name=%s rtn_name=%s ret=%d\n",
            __FUNCTION__, pc, file_name.c_str(), img_name.c_str(),
@@ -8489,34 +13825,38 @@ bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
   return !(ignore || nacl_ignore);
 }
 
+bool ThreadSanitizerWantToInstrumentSblock(uintptr_t pc) {
+  bool ret;
+  if (g_want_to_instrument_verdicts->Lookup(pc, &ret))
+    return ret;
+  ret = WantToInstrumentSblock(pc);
+  g_want_to_instrument_verdicts->Insert(pc, ret);
+  return ret;
+}
+
 bool ThreadSanitizerWantToCreateSegmentsOnSblockEntry(uintptr_t pc) {
-  string rtn_name;
-  rtn_name = PcToRtnName(pc, false);
   if (G_flags->keep_history == 0)
     return false;
-  return !(TripleVectorMatchKnown(g_ignore_lists->ignores_hist,
-                                  rtn_name, "", ""));
+  bool ret;
+  if (g_create_segments_verdicts->Lookup(pc, &ret))
+    return ret;
+  string rtn_name = PcToRtnName(pc, false);
+  ret = !g_ignore_lists->ignores_hist_matcher.Match(rtn_name, "", "");
+  g_create_segments_verdicts->Insert(pc, ret);
+  return ret;
 }
 
 // Returns true if function at "pc" is marked as "fun_r" in the ignore file.
-bool NOINLINE ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc) {
-  ScopedMallocCostCenter cc(__FUNCTION__);
-  typedef unordered_map<uintptr_t, bool> Cache;
-  static Cache *cache = NULL;
-  {
-    TIL ignore_below_lock(ts_ignore_below_lock, 18);
-    if (!cache)
-      cache = new Cache;
-
-    // Fast path - check if we already know the answer.
-    Cache::iterator i = cache->find(pc);
-    if (i != cache->end())
-      return i->second;
-  }
+bool ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc) {
+  // Fast path - check if we already know the answer.
+  bool ret;
+  if (g_ignore_below_verdicts->Lookup(pc, &ret))
+    return ret;
 
+  ScopedMallocCostCenter cc(__FUNCTION__);
+  G_stats->Shard()->ignore_below_cache_miss++;
   string rtn_name = PcToRtnName(pc, false);
-  bool ret =
-      TripleVectorMatchKnown(g_ignore_lists->ignores_r, rtn_name, "", "");
+  ret = g_ignore_lists->ignores_r_matcher.Match(rtn_name, "", "");
 
   if (TSAN_DEBUG) {
     // Heavy test for NormalizeFunctionName: test on all possible inputs in
@@ -8524,15 +13864,156 @@ bool NOINLINE ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc) {
     NormalizeFunctionName(PcToRtnName(pc, true));
   }
 
-  // Grab the lock again
-  TIL ignore_below_lock(ts_ignore_below_lock, 19);
   if (ret && debug_ignore) {
     Report("INFO: ignoring all accesses below the function '%s' (%p)\n",
            PcToRtnNameAndFilePos(pc).c_str(), pc);
   }
-  return ((*cache)[pc] = ret);
+  g_ignore_below_verdicts->Insert(pc, ret);
+  return ret;
 }
 
+// -------- State snapshot ------------------ {{{1
+// --state_snapshot=<file> keeps, from one run to the next, the state the
+// detector derives from the binary alone: the symbols of the pcs
+// (SymbolCache) and the verdicts of the ignore lists. These need the
+// symbolizer, which makes them the slow part of the warm-up. The rest of
+// the state is cheap to build (thread 0, the first segments, the parsed
+// suppressions) or is the run itself, and is full of pointers anyway.
+//
+// The file is read by ThreadSanitizerInit() and written, with what the run
+// has added, by ThreadSanitizerFini(). It is a text file with one entry
+// per line. The first line has a key: a hash of the ignore files and of
+// the flags the symbols and verdicts depend on. A snapshot with another
+// key is not used. The pcs must stay where they were, so the snapshot is
+// useful only when the program is loaded at the same addresses (Valgrind,
+// or a non-PIE binary and no ASLR for the libraries).
+class StateSnapshot {
+ public:
+  static void Load() {
+    string data = ThreadSanitizerReadFileToString(G_flags->state_snapshot,
+                                                  false);
+    if (data.empty()) return;
+    size_t pos = 0;
+    string line;
+    if (!GetLine(data, &pos, &line) || line != KeyLine()) {
+      Report("INFO: --state_snapshot=%s is stale, not using it\n",
+             G_flags->state_snapshot.c_str());
+      return;
+    }
+    size_t n_symbols = 0, n_verdicts = 0;
+    vector<string> fields;
+    while (GetLine(data, &pos, &line)) {
+      SplitTabs(line, &fields);
+      uintptr_t pc = fields.size() >= 2 ? ParsePc(fields[1]) : 0;
+      if (pc == 0) continue;
+      if (fields[0] == "sym" && fields.size() == 9) {
+        PcSymbols symbols;
+        symbols.line_no = my_strtol(fields[2].c_str(), NULL, 10);
+        symbols.img_name = fields[3];
+        symbols.rtn_name = fields[4];
+        symbols.file_name = fields[5];
+        symbols.demangled_rtn_name = fields[6];
+        symbols.normalized_rtn_name = fields[7];
+        symbols.rtn_name_and_file_pos = fields[8];
+        SymbolCache::Insert(pc, symbols);
+        n_symbols++;
+      } else if (fields.size() == 3) {
+        IgnoreVerdictMap *verdicts = VerdictMap(fields[0]);
+        if (!verdicts) continue;
+        verdicts->Insert(pc, fields[2] == "1");
+        n_verdicts++;
+      }
+    }
+    if (G_flags->verbosity >= 1) {
+      Report("INFO: --state_snapshot: %ld symbols, %ld verdicts\n",
+             n_symbols, n_verdicts);
+    }
+  }
+
+  static void Save() {
+    string res = KeyLine() + "\n";
+    char buff[64];
+    vector<pair<uintptr_t, PcSymbols> > symbols;
+    SymbolCache::GetAll(&symbols);
+    for (size_t i = 0; i < symbols.size(); i++) {
+      const PcSymbols &sym = symbols[i].second;
+      snprintf(buff, sizeof(buff), "sym\t%lx\t%d\t",
+               (long)symbols[i].first, sym.line_no);
+      res += buff;
+      res += sym.img_name + "\t" + sym.rtn_name + "\t" + sym.file_name + "\t" +
+          sym.demangled_rtn_name + "\t" + sym.normalized_rtn_name + "\t" +
+          sym.rtn_name_and_file_pos + "\n";
+    }
+    const char *kinds[] = {"ins", "seg", "below"};
+    for (size_t k = 0; k < TS_ARRAY_SIZE(kinds); k++) {
+      vector<pair<uintptr_t, bool> > verdicts;
+      VerdictMap(kinds[k])->GetAll(&verdicts);
+      for (size_t i = 0; i < verdicts.size(); i++) {
+        snprintf(buff, sizeof(buff), "%s\t%lx\t%d\n", kinds[k],
+                 (long)verdicts[i].first, verdicts[i].second);
+        res += buff;
+      }
+    }
+    OpenFileWriteStringAndClose(G_flags->state_snapshot, res);
+  }
+
+ private:
+  static IgnoreVerdictMap *VerdictMap(const string &kind) {
+    if (kind == "ins") return g_want_to_instrument_verdicts;
+    if (kind == "seg") return g_create_segments_verdicts;
+    if (kind == "below") return g_ignore_below_verdicts;
+    return NULL;
+  }
+
+  static string KeyLine() {
+    string key;
+    for (size_t i = 0; i < G_flags->ignore.size(); i++)
+      key += ThreadSanitizerReadFileToString(G_flags->ignore[i], false);
+    for (size_t i = 0; i < G_flags->whitelist.size(); i++)
+      key += ThreadSanitizerReadFileToString(G_flags->whitelist[i], false);
+    for (size_t i = 0; i < G_flags->file_prefix_to_cut.size(); i++)
+      key += G_flags->file_prefix_to_cut[i] + "\n";
+    char buff[100];
+    snprintf(buff, sizeof(buff), "%d %d %d %d %d %d",
+             (int)G_flags->demangle, (int)G_flags->full_stack_frames,
+             (int)G_flags->ignore_unknown_pcs, (int)G_flags->keep_history,
+             (int)G_flags->nacl_untrusted, (int)sizeof(uintptr_t));
+    key += buff;
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a.
+    for (size_t i = 0; i < key.size(); i++)
+      hash = (hash ^ (uint8_t)key[i]) * 1099511628211ULL;
+    snprintf(buff, sizeof(buff), "ThreadSanitizer state snapshot v1 %llx",
+             (unsigned long long)hash);
+    return buff;
+  }
+
+  static bool GetLine(const string &data, size_t *pos, string *line) {
+    if (*pos >= data.size()) return false;
+    size_t end = data.find('\n', *pos);
+    if (end == string::npos) end = data.size();
+    line->assign(data, *pos, end - *pos);
+    *pos = end + 1;
+    return true;
+  }
+
+  static void SplitTabs(const string &line, vector<string> *fields) {
+    fields->clear();
+    size_t start = 0;
+    for (;;) {
+      size_t tab = line.find('\t', start);
+      fields->push_back(line.substr(start, tab - start));
+      if (tab == string::npos) break;
+      start = tab + 1;
+    }
+  }
+
+  static uintptr_t ParsePc(const string &str) {
+    char *end;
+    uintptr_t pc = (uintptr_t)my_strtol(str.c_str(), &end, 16);
+    return *end == 0 ? pc : 0;
+  }
+};
+
 // We intercept a user function with this name
 // and answer the user query with a non-NULL string.
 extern "C" const char *ThreadSanitizerQuery(const char *query) {
@@ -8567,19 +14048,34 @@ extern "C" const char *ThreadSanitizerQuery(const char *query) {
 extern void ThreadSanitizerInit() {
   ScopedMallocCostCenter cc("ThreadSanitizerInit");
   ts_lock = new TSLock;
-  ts_ignore_below_lock = new TSLock;
+  SymbolCache::InitClassMembers();
+  g_sharded_locking = G_flags->locking_scheme == 2;
+  g_pure_hb_engine = G_flags->pure_happens_before;
   g_so_far_only_one_thread = true;
   ANNOTATE_BENIGN_RACE(&g_so_far_only_one_thread, "real benign race");
   CHECK_EQ(sizeof(ShadowValue), 8);
   CHECK(G_flags);
   G_stats        = new Stats;
   SetupIgnore();
+  if (!G_flags->state_snapshot.empty())
+    StateSnapshot::Load();
 
   G_detector     = new Detector;
-  G_cache        = new Cache;
+  // Cache::lines_ is looked up by every thread on every access.
+  if (G_flags->numa || G_flags->huge_pages)
+    G_cache      = new (AllocateTable(sizeof(Cache))) Cache;
+  else
+    G_cache      = new Cache;
   G_expected_races_map = new ExpectedRacesMap;
   G_heap_map           = new HeapMap<HeapInfo>;
   G_thread_stack_map   = new HeapMap<ThreadStackInfo>;
+  G_stack_depot        = new StackDepot;
+  if (G_flags->ignore_racey_pcs)
+    g_racey_pcs = new PcToBoolMap<12>;
+  if (G_flags->history_ring && G_flags->keep_history) {
+    g_history_rings = new HistoryRing*[G_flags->max_n_threads];
+    memset(g_history_rings, 0, G_flags->max_n_threads * sizeof(HistoryRing*));
+  }
   {
     ScopedMallocCostCenter cc1("Segment::InitClassMembers");
     Segment::InitClassMembers();
@@ -8589,11 +14085,20 @@ extern void ThreadSanitizerInit() {
   TSanThread::InitClassMembers();
   Lock::InitClassMembers();
   LockSet::InitClassMembers();
+  if (G_flags->detect_deadlocks)
+    LockOrderGraph::InitClassMembers();
   EventSampler::InitClassMembers();
+  SharingProfile::InitClassMembers();
+  DetectorProfile::InitClassMembers();
+  VtsArena::InitClassMembers();
   VTS::InitClassMembers();
   // TODO(timurrrr): make sure *::InitClassMembers() are called only once for
   // each class
   g_publish_info_map = new PublishInfoMap;
+  if ((G_flags->lazy_shadow_reset > 0 || G_flags->lazy_stack_reset > 0) &&
+      !G_flags->direct_shadow)
+    g_pending_shadow_resets = new PendingShadowResets;
+  TargetFilterInit();
   g_stack_trace_free_list = new StackTraceFreeList;
   g_pcq_map = new PCQMap;
   g_atomicCore = new TsanAtomicCore();
@@ -8633,6 +14138,8 @@ extern void ThreadSanitizerInit() {
 
 extern void ThreadSanitizerFini() {
   G_detector->HandleProgramEnd();
+  if (!G_flags->state_snapshot.empty())
+    StateSnapshot::Save();
 }
 
 extern void ThreadSanitizerDumpAllStacks() {
@@ -8640,14 +14147,14 @@ extern void ThreadSanitizerDumpAllStacks() {
   for (int i = 0; i < TSanThread::NumberOfThreads(); i++) {
     TSanThread *t = TSanThread::Get(TID(i));
     if (!t || !t->is_running()) continue;
-    Report("T%d\n", i);
+    Report("T%d\n", t->frontend_tid());
     t->ReportStackTrace();
   }
   // now print all dead threds.
   for (int i = 0; i < TSanThread::NumberOfThreads(); i++) {
     TSanThread *t = TSanThread::Get(TID(i));
     if (!t || t->is_running()) continue;
-    Report("T%d (not running)\n", i);
+    Report("T%d (not running)\n", t->frontend_tid());
     t->ReportStackTrace();
   }
 }
@@ -8659,12 +14166,13 @@ extern void ThreadSanitizerHandleOneEvent(Event *e) {
 }
 
 TSanThread *ThreadSanitizerGetThreadByTid(int32_t tid) {
-  return TSanThread::Get(TID(tid));
+  return TSanThread::GetByFrontendTid(tid);
 }
 
 extern NOINLINE void ThreadSanitizerHandleTrace(int32_t tid, TraceInfo *trace_info,
                                        uintptr_t *tleb) {
-  ThreadSanitizerHandleTrace(TSanThread::Get(TID(tid)), trace_info, tleb);
+  ThreadSanitizerHandleTrace(TSanThread::GetByFrontendTid(tid), trace_info,
+                             tleb);
 }
 extern NOINLINE void ThreadSanitizerHandleTrace(TSanThread *thr, TraceInfo *trace_info,
                                                 uintptr_t *tleb) {
@@ -8692,17 +14200,19 @@ void NOINLINE ThreadSanitizerHandleRtnCall(int32_t tid, uintptr_t call_pc,
                                          uintptr_t target_pc,
                                          IGNORE_BELOW_RTN ignore_below) {
   // This does locking on a cold path. Hot path in thread-local.
-  G_detector->HandleRtnCall(TID(tid), call_pc, target_pc, ignore_below);
+  G_detector->HandleRtnCall(TSanThread::TidToSlot(tid), call_pc, target_pc,
+                            ignore_below);
 
   if (G_flags->sample_events) {
     static EventSampler sampler;
-    TSanThread *thr = TSanThread::Get(TID(tid));
+    TSanThread *thr = TSanThread::GetByFrontendTid(tid);
     sampler.Sample(thr, "RTN_CALL", true);
   }
 }
 void NOINLINE ThreadSanitizerHandleRtnExit(int32_t tid) {
-  // This is a thread-local operation, no need for locking.
-  TSanThread::Get(TID(tid))->HandleRtnExit();
+  // This is a thread-local operation, no need for locking
+  // (unless some popped frames are to be reset).
+  G_detector->HandleRtnExit(TSanThread::GetByFrontendTid(tid));
 }
 
 static bool ThreadSanitizerPrintReport(ThreadSanitizerReport *report) {
@@ -8749,7 +14259,7 @@ uint64_t ThreadSanitizerHandleAtomicOp(int32_t tid,
     return tsan_atomic_do_op(op, mo, fail_mo, size, a, v, cmp, &newv, &prev);
   } else {
     uint64_t rv = 0;
-    TSanThread* thr = TSanThread::Get(TID(tid));
+    TSanThread* thr = TSanThread::GetByFrontendTid(tid);
     // Just a verification of the parameters.
     tsan_atomic_verify(op, mo, fail_mo, size, a);
 
@@ -8775,14 +14285,16 @@ uint64_t ThreadSanitizerHandleAtomicOp(int32_t tid,
           // from visible sequence of side-effects in the modification order
           // of the variable.
           rv = g_atomicCore->HandleRead(thr, (uintptr_t)a, rv,
-                                        tsan_atomic_is_acquire(mo));
+                                        tsan_atomic_is_acquire(mo),
+                                        mo == tsan_memory_order_seq_cst);
         } else if ((op == tsan_atomic_op_compare_exchange_weak
             || op == tsan_atomic_op_compare_exchange_strong)
             && cmp != rv) {
           // Failed compare_exchange is handled as read, because, well,
           // it's indeed just a read (at least logically).
           g_atomicCore->HandleRead(thr, (uintptr_t)a, rv,
-                                   tsan_atomic_is_acquire(fail_mo));
+                                   tsan_atomic_is_acquire(fail_mo),
+                                   fail_mo == tsan_memory_order_seq_cst);
         } else {
           // For writes and RMW operations it updates modification order
           // of the atomic variable.
@@ -8806,6 +14318,17 @@ uint64_t ThreadSanitizerHandleAtomicOp(int32_t tid,
 
 
 TsanAtomicCore::TsanAtomicCore() {
+  memset(atomic_cache_, 0, sizeof(atomic_cache_));
+}
+
+
+TsanAtomicCore::Atomic* TsanAtomicCore::GetAtomic(uintptr_t a) {
+  AtomicCacheEntry& e = atomic_cache_[(a ^ (a >> 6)) % kAtomicCacheSize];
+  if (e.atomic != 0 && e.addr == a)
+    return e.atomic;
+  e.addr = a;
+  e.atomic = &atomic_map_[a];
+  return e.atomic;
 }
 
 
@@ -8818,7 +14341,7 @@ void TsanAtomicCore::HandleWrite(TSanThread* thr,
                                  bool const is_rmw) {
   PrintfIf(debug_atomic, "HIST(%p): store acquire=%u, release=%u, rmw=%u\n",
            (void*)a, is_acquire, is_release, is_rmw);
-  Atomic* atomic = &atomic_map_[a];
+  Atomic* atomic = GetAtomic(a);
   // Fix modification history if there were untracked accesses.
   AtomicFixHist(atomic, prev);
   AtomicHistoryEntry& hprv = atomic->hist
@@ -8876,19 +14399,33 @@ void TsanAtomicCore::HandleWrite(TSanThread* thr,
 uint64_t TsanAtomicCore::HandleRead(TSanThread* thr,
                                     uintptr_t a,
                                     uint64_t v,
-                                    bool is_acquire) {
+                                    bool is_acquire,
+                                    bool is_seq_cst) {
   PrintfIf(debug_atomic, "HIST(%p): {\n", (void*)a);
 
-  Atomic* atomic = &atomic_map_[a];
+  Atomic* atomic = GetAtomic(a);
   // Fix modification history if there were untracked accesses.
   AtomicFixHist(atomic, v);
   AtomicHistoryEntry* hist0 = 0;
   int32_t seen_seq = 0;
   int32_t const seen_seq0 = atomic->last_seen.clock(thr->tid());
+  if (is_seq_cst) {
+    // Fast path: the operations are serialized, so the latest entry is the
+    // last store in the total order S, and a seq_cst load may always
+    // return it. No need to scan the history.
+    int32_t const idx = atomic->hist_pos - 1;
+    AtomicHistoryEntry& hist = atomic->hist[idx % Atomic::kHistSize];
+    if (hist.tid.raw() != TID::kInvalidTID) {
+      PrintfIf(debug_atomic, "HIST(%p):   replaced: seq_cst\n", (void*)a);
+      if (seen_seq0 < idx)
+        seen_seq = idx;
+      hist0 = &hist;
+    }
+  }
   // Scan modification order of the variable from the latest entry
   // back in time. For each side-effect (write) we determine as to
   // whether we have to yield the value or we can go back in time further.
-  for (int32_t i = 0; i != Atomic::kHistSize; i += 1) {
+  for (int32_t i = 0; hist0 == 0 && i != Atomic::kHistSize; i += 1) {
     int32_t const idx = (atomic->hist_pos - i - 1);
     CHECK(idx >= 0);
     AtomicHistoryEntry& hist = atomic->hist[idx % Atomic::kHistSize];
@@ -8975,7 +14512,13 @@ void TsanAtomicCore::ClearMemoryState(uintptr_t a, uintptr_t b) {
   for (; pos != atomic_map_.end() && pos->first <= b; ++pos) {
     pos->second.reset();
   }
+  if (begin == pos)
+    return;
   atomic_map_.erase(begin, pos);
+  for (size_t i = 0; i != kAtomicCacheSize; i += 1) {
+    if (atomic_cache_[i].addr >= a && atomic_cache_[i].addr <= b)
+      atomic_cache_[i].atomic = 0;
+  }
 }
 
 
@@ -49,6 +49,7 @@ struct FLAGS {
   string           input_type; // for ts_offline.
                                // Possible values: str, bin, decode.
   bool             ignore_stack;
+  bool             coalesce_mops;  // Valgrind only, see SblockMopState.
   intptr_t         verbosity;
   intptr_t         show_stats;  // 0 -- no stats; 1 -- some stats; 2 more stats.
   bool             trace_profile;
@@ -63,9 +64,30 @@ struct FLAGS {
   vector<string>   cut_stack_below;
   string           summary_file;
   string           log_file;
+  string           symbol_cache_file;  // tsan_rtl with BFD only.
+  string           pin_cache_file;  // ts_pin only, see PinCache.
+  bool             fast_win_locks;  // ts_pin on Windows, see ts_pin.cc.
+  string           sharing_profile_file;  // See SharingProfile.
+  string           detector_profile;  // See DetectorProfile.
+  intptr_t         detector_profile_period;  // In traces.
+  string           state_snapshot;  // See StateSnapshot.
+  vector<string>   target_range;  // "<lo>-<hi>", see TargetFilter.
+  vector<string>   target_alloc_site;  // See TargetFilter.
   bool             offline;
   intptr_t         max_n_threads;
-  bool             compress_cache_lines;
+  intptr_t         max_goroutine_tids;  // go_rtl only, 0 - goroutine ids.
+  bool             reuse_dead_tids;  // See TSanThread::NewSlot().
+  bool             compress_cache_lines;  // Compress uniform lines.
+  bool             direct_shadow;  // Two-level shadow table, see Cache.
+  intptr_t         parked_lines;  // Per thread, see ParkedLines.
+  bool             prefetch_shadow;  // See Detector::PrefetchTrace().
+  bool             vts_simd;  // Use SSE4.2/AVX2 VTS kernels if available.
+  bool             delta_vts;  // Store new VTSs as diffs against old ones.
+  bool             tree_clocks;  // Use tree clocks for signal/wait.
+  bool             epoch_hb;  // See VTS::EpochHappensBefore().
+  bool             biased_sid_refcount;  // See TSanThread::RefCurrentSid().
+  bool             numa;  // See AllocateTable(), ShardedFreeList.
+  intptr_t         huge_pages;  // 1: transparent, 2: explicit (MAP_HUGETLB).
   bool             unlock_on_mutex_destroy;
 
   intptr_t         sample_events;
@@ -74,6 +96,7 @@ struct FLAGS {
   intptr_t         num_callers;
 
   intptr_t    keep_history;
+  intptr_t    history_ring;  // log2 of the entries, see HistoryRing.
   bool        pure_happens_before;
   bool        free_is_write;
   bool        exit_after_main;
@@ -98,22 +121,40 @@ struct FLAGS {
   intptr_t     dry_run;
   intptr_t     max_sid;
   intptr_t     max_sid_before_flush;
+  intptr_t     incremental_flush;  // Lines per slice, see IncrementalFlush().
+  intptr_t     lazy_shadow_reset;  // Min range size, see PendingShadowResets.
+  intptr_t     lazy_stack_reset;  // Min dead stack size, see NoteStackAccess().
+  bool         latency_stats;  // See ScopedLatency.
+  intptr_t     latency_stats_period;  // In seconds, 0 means at exit only.
+  bool         hw_counters;  // Perf counters per latency kind, see above.
   intptr_t     max_mem_in_mb;
   intptr_t     num_callers_in_history;
   intptr_t     flush_period;
 
   intptr_t     literace_sampling;
+  intptr_t     literace_target_overhead;  // tsan_rtl: percent, 0 is off.
+  bool         mop_filter;  // tsan_rtl, see "Mop filter" in tsan_rtl.cc.
+  intptr_t     profiled_literace_sampling;  // tsan_rtl, see SharingProfile.
   bool         start_with_global_ignore_on;
 
-  intptr_t     locking_scheme;  // Used for internal experiments with locking.
+  intptr_t     locking_scheme;  // 1: single ts_lock, 2: sharded (see .cc).
 
   bool         report_races;
   bool         thread_coverage;
   bool         atomicity;
+  bool         detect_deadlocks;  // Report cycles in the lock order.
   bool         call_coverage;
   string       dump_events;  // The name of log file. Debug mode only.
+  string       record_events;  // The packed event log to record into.
+  string       record_compressor;  // The command to pipe it through.
+  bool         dedup_race_pcs;  // See RacePcFilter.
+  bool         skip_racey_accesses;  // No state machine on racey memory.
+  bool         ignore_racey_pcs;  // See g_racey_pcs.
+  bool         async_reports;  // tsan_rtl and Pin, see ts_report_writer.h.
+  intptr_t     max_queued_reports;
   bool         symbolize;
-  bool         attach_mode;
+  bool         attach_mode;  // tsan_rtl, see "Attach mode" in tsan_rtl.cc.
+  intptr_t     attach_signal;  // 0 is SIGUSR2.
 
   string       tsan_program_name;
   string       tsan_url;
@@ -127,16 +168,24 @@ struct FLAGS {
   vector<string> race_verifier;
   vector<string> race_verifier_extra;
   intptr_t       race_verifier_sleep_ms;
+  bool           race_verifier_adaptive;
 
   bool nacl_untrusted;
 
   bool threaded_analysis;
+  intptr_t num_analysis_threads;  // Workers for threaded_analysis.
+  bool deferred_analysis;  // Valgrind only, see AnalysisQueue.
+  bool batch_sync_requests;  // Valgrind only, see TsRequestBatch.
 
   bool sched_shake;
   bool api_ambush;
 
   bool enable_atomic;
 
+  bool gil_free_allocator;  // tsan_rtl: no GIL in malloc/free interceptors.
+  bool rtl_allocator;  // tsan_rtl: client heap from a per-thread cache.
+  bool fast_unwind;  // tsan_rtl with BFD: unwind reports by frame pointers.
+
   FLAGS() {
     // Force default verbosity to 0 as we have to carefully work around
     // different -q/--q/-v/--v flags when using Valgrind.
@@ -148,6 +197,10 @@ extern FLAGS *G_flags;
 
 extern bool g_race_verifier_active;
 
+// Set by the tool with --async_reports, see ts_report_writer.h.
+class ReportWriter;
+extern ReportWriter *G_report_writer;
+
 extern bool debug_expected_races;
 extern bool debug_malloc;
 extern bool debug_free;
@@ -214,6 +267,8 @@ void ThreadSanitizerFini();
 void ThreadSanitizerLockAcquire();
 void ThreadSanitizerLockRelease();
 #endif
+// Called in the child process right after fork() with the lock held.
+void ThreadSanitizerAtForkChild();
 void ThreadSanitizerHandleOneEvent(Event *event);
 TSanThread *ThreadSanitizerGetThreadByTid(int32_t tid);
 void ThreadSanitizerHandleTrace(int32_t tid, TraceInfo *trace_info,
@@ -230,6 +285,16 @@ bool ThreadSanitizerIgnoreAccessesBelowFunction(uintptr_t pc);
 typedef int (*ThreadSanitizerUnwindCallback)(uintptr_t* stack, int size, uintptr_t pc);
 void ThreadSanitizerSetUnwindCallback(ThreadSanitizerUnwindCallback cb);
 
+// Symbolizes many pcs at once, as PcToStrings() would do for each of them.
+// Optional: a tool sets it if it can do this faster than one pc at a time.
+// Every output vector gets one element per pc.
+typedef void (*ThreadSanitizerSymbolizeBatchCallback)(
+    const vector<uintptr_t> &pcs, bool demangle,
+    vector<string> *img_names, vector<string> *rtn_names,
+    vector<string> *file_names, vector<int> *line_nos);
+void ThreadSanitizerSetSymbolizeBatchCallback(
+    ThreadSanitizerSymbolizeBatchCallback cb);
+
 /** Atomic operation handler.
  *  @param tid ID of a thread that issues the operation.
  *  @param pc Program counter that should be associated with the operation.
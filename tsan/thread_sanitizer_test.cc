@@ -34,6 +34,29 @@
 #include "ts_heap_info.h"
 #include "ts_simple_cache.h"
 #include "dense_multimap.h"
+#include "ts_tag_map.h"
+#include "ts_tuple_table.h"
+#include "ts_stack_depot.h"
+#include "ts_vts_simd.h"
+#include "ts_tree_clock.h"
+#include "ts_shadow_stack.h"
+#include "ts_history_ring.h"
+#include "ts_packed_events.h"
+
+#include <time.h>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+#endif
+
+// ts_replace.h, counting the reported bytes.
+static size_t replace_read_bytes, replace_write_bytes;
+#define EXTRA_REPLACE_PARAMS
+#define EXTRA_REPLACE_ARGS
+#define REPORT_READ_RANGE(x, size) (replace_read_bytes += (size))
+#define REPORT_WRITE_RANGE(x, size) (replace_write_bytes += (size))
+#define REPLACE_IS_NOT_INSTRUMENTED 1
+#include "ts_replace.h"
 
 // Testing the HeapMap.
 struct TestHeapInfo {
@@ -137,6 +160,54 @@ TEST(ThreadSanitizer, HeapInfoTest) {
 
 }
 
+TEST(ThreadSanitizer, HeapInfoRangeTest) {
+  HeapMap<TestHeapInfo> map;
+  TestHeapInfo *info;
+  // Small chunks spanning page boundaries.
+  map.InsertInfo(0x10ff0, TestHeapInfo(0x10ff0, 0x20, 1));
+  map.InsertInfo(0x11010, TestHeapInfo(0x11010, 0x3000, 2));
+  // A large chunk and a small one carved out of it.
+  map.InsertInfo(0x100000, TestHeapInfo(0x100000, 0x100000, 3));
+  map.InsertInfo(0x180000, TestHeapInfo(0x180000, 0x10, 4));
+  EXPECT_EQ(4U, map.size());
+
+  EXPECT_TRUE((info = map.GetInfo(0x11000)));
+  EXPECT_EQ(1, info->val);
+  EXPECT_TRUE((info = map.GetInfo(0x13fff)));
+  EXPECT_EQ(2, info->val);
+  EXPECT_FALSE(map.GetInfo(0x14010));
+  EXPECT_TRUE((info = map.GetInfo(0x17ff00)));
+  EXPECT_EQ(3, info->val);
+  EXPECT_TRUE((info = map.GetInfo(0x180008)));
+  EXPECT_EQ(4, info->val);
+
+  // Re-inserting at the same address replaces the chunk.
+  map.InsertInfo(0x10ff0, TestHeapInfo(0x10ff0, 0x10, 5));
+  EXPECT_EQ(4U, map.size());
+  EXPECT_FALSE(map.GetInfo(0x11000));
+  EXPECT_TRUE((info = map.GetInfo(0x10ff8)));
+  EXPECT_EQ(5, info->val);
+
+  vector<TestHeapInfo*> all;
+  map.GetAll(&all);
+  ASSERT_EQ(4U, all.size());
+  EXPECT_EQ(5, all[0]->val);
+  EXPECT_EQ(4, all[3]->val);
+
+  // Erase everything which starts inside the large chunk.
+  vector<TestHeapInfo> erased;
+  map.EraseRange(0x100000, 0x200000, &erased);
+  EXPECT_EQ(2U, erased.size());
+  EXPECT_EQ(2U, map.size());
+  EXPECT_FALSE(map.GetInfo(0x180008));
+  EXPECT_FALSE(map.GetInfo(0x100000));
+
+  // A huge range takes the other path.
+  map.EraseRange(0x1000, (uintptr_t)1 << 40);
+  EXPECT_EQ(0U, map.size());
+  EXPECT_FALSE(map.GetInfo(0x12000));
+}
+
 TEST(ThreadSanitizer, PtrToBoolCacheTest) {
   PtrToBoolCache<256> c;
   bool val = false;
@@ -187,6 +258,40 @@ TEST(ThreadSanitizer, PtrToBoolCacheTest) {
   EXPECT_EQ(false, val);
 }
 
+TEST(ThreadSanitizer, PcToBoolMapTest) {
+  PcToBoolMap<10> m;
+  bool val = false;
+  EXPECT_FALSE(m.Lookup(123, &val));
+  EXPECT_FALSE(m.Lookup(0, &val));
+
+  // Unlike PtrToBoolCache, colliding pcs do not evict each other.
+  for (uintptr_t pc = 1; pc <= 600; pc++)
+    m.Insert(pc << 12, pc % 3 == 0);
+  EXPECT_EQ(600U, m.size());
+  for (uintptr_t pc = 1; pc <= 600; pc++) {
+    EXPECT_TRUE(m.Lookup(pc << 12, &val));
+    EXPECT_EQ(pc % 3 == 0, val);
+  }
+  EXPECT_FALSE(m.Lookup(601 << 12, &val));
+
+  vector<pair<uintptr_t, bool> > all;
+  m.GetAll(&all);
+  ASSERT_EQ(600U, all.size());
+  for (size_t i = 0; i < all.size(); i++)
+    EXPECT_EQ((all[i].first >> 12) % 3 == 0, all[i].second);
+
+  // Re-inserting a pc does not take a new slot.
+  m.Insert(1 << 12, false);
+  EXPECT_EQ(600U, m.size());
+
+  // 3/4 full: new pcs are not inserted any more.
+  for (uintptr_t pc = 601; pc <= 1024; pc++)
+    m.Insert(pc << 12, true);
+  EXPECT_EQ(768U, m.size());
+  EXPECT_TRUE(m.Lookup(768 << 12, &val));
+  EXPECT_FALSE(m.Lookup(769 << 12, &val));
+}
+
 TEST(ThreadSanitizer, IntPairToBoolCacheTest) {
   IntPairToBoolCache<257> c;
   bool val = false;
@@ -207,6 +312,95 @@ TEST(ThreadSanitizer, IntPairToBoolCacheTest) {
   }
 }
 
+TEST(ThreadSanitizer, SetAssocIntPairToBoolCacheTest) {
+  SetAssocIntPairToBoolCache<4> c;
+  bool val = false;
+  map<pair<int,int>, bool> m;
+
+  for (int i = 0; i < 1000000; i++) {
+    int a = (rand() % 1024) + 1;
+    int b = (rand() % 1024) + 1;
+
+    if (c.Lookup(a, b, &val)) {
+      EXPECT_EQ(1U, m.count(make_pair(a,b)));
+      EXPECT_EQ(val, m[make_pair(a,b)]);
+    }
+
+    val = (rand() % 2) == 1;
+    c.Insert(a, b, val);
+    m[make_pair(a,b)] = val;
+  }
+
+  // The 4 most recently used pairs of a set stay in it.
+  c.Flush();
+  for (int a = 1; a <= 1000; a++)
+    c.Insert(a, 1, a % 2);
+  for (int a = 997; a <= 1000; a++) {
+    EXPECT_TRUE(c.Lookup(a, 1, &val));
+    EXPECT_EQ(a % 2 == 1, val);
+  }
+  // A lookup makes the pair the most recently used one.
+  c.Flush();
+  c.Insert(1, 1, true);
+  for (int a = 2; a <= 1000; a++) {
+    EXPECT_TRUE(c.Lookup(1, 1, &val));
+    c.Insert(a, 1, false);
+  }
+  EXPECT_TRUE(c.Lookup(1, 1, &val));
+  EXPECT_TRUE(val);
+}
+
+TEST(ThreadSanitizer, SetAssocIntPairToIntCacheTest) {
+  SetAssocIntPairToIntCache<4, /*kAtomic=*/true> c;
+  int32_t val = 0;
+  // Zero and negative keys are valid.
+  EXPECT_FALSE(c.Lookup(0, 0, &val));
+  c.Insert(0, 0, 7);
+  EXPECT_TRUE(c.Lookup(0, 0, &val));
+  EXPECT_EQ(7, val);
+  c.Insert(-1, 0, 8);
+  EXPECT_TRUE(c.Lookup(-1, 0, &val));
+  EXPECT_EQ(8, val);
+  EXPECT_FALSE(c.Lookup(0, -1, &val));
+
+  int n_hits = 0;
+  for (int i = 0; i < 1000000; i++) {
+    int32_t a = (rand() % 1024) - 512;
+    int32_t b = (rand() % 1024) + 1;
+    if (c.Lookup(a, b, &val)) {
+      EXPECT_EQ(a * 3 + b, val);
+      n_hits++;
+    } else {
+      c.Insert(a, b, a * 3 + b);
+    }
+  }
+  EXPECT_GT(n_hits, 0);
+}
+
+TEST(ThreadSanitizer, AtomicIntPairToIntCacheTest) {
+  AtomicIntPairToIntCache<257> c;
+  int32_t val = 0;
+  // Zero and negative keys are valid.
+  EXPECT_FALSE(c.Lookup(0, 0, &val));
+  c.Insert(0, 0, 7);
+  EXPECT_TRUE(c.Lookup(0, 0, &val));
+  EXPECT_EQ(7, val);
+
+  int n_hits = 0;
+  for (int i = 0; i < 1000000; i++) {
+    int32_t a = (rand() % 1024) - 512;
+    int32_t b = (rand() % 1024) + 1;
+    if (c.Lookup(a, b, &val)) {
+      EXPECT_EQ(a * 3 + b, val);
+      n_hits++;
+    }
+    c.Insert(a, b, a * 3 + b);
+  }
+  EXPECT_GT(n_hits, 0);
+  c.Flush();
+  EXPECT_FALSE(c.Lookup(0, 0, &val));
+}
+
 TEST(ThreadSanitizer, DenseMultimapTest) {
   typedef DenseMultimap<int, 3> Map;
 
@@ -254,6 +448,582 @@ TEST(ThreadSanitizer, DenseMultimapTest) {
   Map m9(m8, Map::REMOVE, 1);
   EXPECT_EQ(m9.size(), 5U);
   EXPECT_FALSE(m9.has(1));
+
+  // The probes describe m+{t} and m-{t} w/o building them.
+  int ts[] = {-3, -2, 0, 1, 2, 6};
+  for (size_t i = 0; i < TS_ARRAY_SIZE(ts); i++) {
+    Map with(m7, ts[i]);
+    EXPECT_EQ(Map::HashWith(m7, ts[i]), with.Hash());
+    EXPECT_TRUE(with.EqualsWith(m7, ts[i]));
+    EXPECT_FALSE(m7.EqualsWith(m7, ts[i]));
+    EXPECT_FALSE(with.EqualsWith(m6, ts[i]));
+    if (!m7.has(ts[i])) continue;
+    Map without(m7, Map::REMOVE, ts[i]);
+    EXPECT_EQ(Map::HashWithout(m7, ts[i]), without.Hash());
+    EXPECT_TRUE(without.EqualsWithout(m7, ts[i]));
+    EXPECT_FALSE(with.EqualsWithout(m7, ts[i]));
+  }
+  EXPECT_TRUE(m1 == Map(2, 1));
+  EXPECT_FALSE(m1 == m2);
+
+  // The sets in an arena.
+  Map::Arena arena(4);
+  Map a1(m7, &arena);
+  Map a2(a1, 7, &arena);
+  Map a3(a2, Map::REMOVE, -2, &arena);
+  Map a4(1, 2, &arena);
+  EXPECT_TRUE(a1 == m7);
+  EXPECT_TRUE(a2.EqualsWith(m7, 7));
+  EXPECT_EQ(a3.size(), 7U);
+  EXPECT_FALSE(a3.has(-2));
+  EXPECT_TRUE(a3.has(7));
+  EXPECT_TRUE(a4 == m1);
+}
+
+TEST(ThreadSanitizer, TagMapTest) {
+  TagMap<int> m;
+  static int vals[5000];
+  const uintptr_t kLine = 64;
+  EXPECT_EQ(m.size(), 0U);
+  EXPECT_TRUE(m.Get(0) == NULL);
+
+  // Tag 0 is a valid key.
+  for (int i = 0; i < 5000; i++) {
+    m.Insert(i * kLine, &vals[i]);
+  }
+  EXPECT_EQ(m.size(), 5000U);
+  for (int i = 0; i < 5000; i++) {
+    EXPECT_EQ(m.Get(i * kLine), &vals[i]);
+  }
+  EXPECT_TRUE(m.Get(5000 * kLine) == NULL);
+
+  // Remove every other element and re-insert some of them.
+  for (int i = 0; i < 5000; i += 2) {
+    EXPECT_EQ(m.Erase(i * kLine), &vals[i]);
+  }
+  EXPECT_TRUE(m.Erase(0) == NULL);
+  EXPECT_EQ(m.size(), 2500U);
+  for (int i = 0; i < 5000; i++) {
+    EXPECT_EQ(m.Get(i * kLine), (i % 2) ? &vals[i] : NULL);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    m.Insert(i * kLine, &vals[i]);
+  }
+  EXPECT_EQ(m.size(), 3000U);
+  EXPECT_EQ(m.Get(998 * kLine), &vals[998]);
+  EXPECT_TRUE(m.Get(1000 * kLine) == NULL);
+
+  vector<int*> all;
+  m.GetAll(&all);
+  EXPECT_EQ(all.size(), 3000U);
+
+  m.Clear();
+  EXPECT_EQ(m.size(), 0U);
+  EXPECT_TRUE(m.Get(kLine) == NULL);
+}
+
+// Compare ShadowStack with a plain vector, with frames that do and do not
+// fit into the 32-bit deltas.
+TEST(ThreadSanitizer, ShadowStackTest) {
+  ShadowStack stack;
+  vector<pair<uintptr_t, uintptr_t> > ref;
+  unsigned seed = 1;
+  uintptr_t sp = (uintptr_t)1 << 40;
+  for (int iter = 0; iter < 100000; iter++) {
+    unsigned r = tsan_prng(&seed);
+    if (r % 8 < 5 || ref.empty()) {
+      uintptr_t pc = 0x400000 + tsan_prng(&seed) % 0x10000;
+      if (r % 64 == 0)
+        pc += (uintptr_t)tsan_prng(&seed) << 24;  // Another module.
+      sp -= 8 + tsan_prng(&seed) % 256;
+      if (r % 128 == 1)
+        sp -= (uintptr_t)1 << 33;  // Jump to an alternate stack.
+      stack.Push(pc, sp);
+      ref.push_back(make_pair(pc, sp));
+    } else {
+      uintptr_t new_sp = sp + tsan_prng(&seed) % 1024;
+      if (r % 256 == 2)
+        new_sp = (uintptr_t)1 << 41;  // Everything returns.
+      size_t n = 0;
+      while (n < ref.size() && new_sp >= ref[ref.size() - n - 1].second)
+        n++;
+      ASSERT_EQ(n, stack.Unwind(new_sp));
+      for (; n > 0; n--) {
+        stack.Pop();
+        ref.pop_back();
+      }
+      sp = ref.empty() ? (uintptr_t)1 << 40 : ref.back().second;
+    }
+    ASSERT_EQ(ref.size(), stack.size());
+    if (!ref.empty()) {
+      EXPECT_EQ(ref.back().first, stack.top_pc());
+      EXPECT_EQ(ref.back().second, stack.top_sp());
+    }
+    if (iter % 1000 == 0 && !ref.empty()) {
+      vector<uintptr_t> pcs(ref.size()), sps(ref.size());
+      stack.GetFrames(&pcs[0], &sps[0]);
+      for (size_t i = 0; i < ref.size(); i++) {
+        EXPECT_EQ(ref[i].first, pcs[i]);
+        EXPECT_EQ(ref[i].second, sps[i]);
+      }
+    }
+  }
+  stack.Clear();
+  EXPECT_TRUE(stack.empty());
+  EXPECT_EQ(0U, stack.Unwind(~(uintptr_t)0));
+}
+
+TEST(ThreadSanitizer, TupleTableTest) {
+  TupleTable<4> t;
+  map<vector<int32_t>, int32_t> ref;
+  int32_t key[4];
+  EXPECT_EQ(t.size(), 0U);
+  for (int iter = 0; iter < 100000; iter++) {
+    // Small SID-like values so that there are collisions and repeats.
+    int n = 2 + rand() % 3;
+    for (int i = 0; i < 4; i++)
+      key[i] = i < n ? 1 + rand() % 30 : 0;
+    vector<int32_t> v(key, key + 4);
+    int32_t id = t.Find(key);
+    if (ref.count(v)) {
+      EXPECT_EQ(id, ref[v]);
+      if (rand() % 2) {
+        EXPECT_TRUE(t.Erase(key));
+        ref.erase(v);
+        EXPECT_EQ(t.Find(key), 0);
+      }
+    } else {
+      EXPECT_EQ(id, 0);
+      EXPECT_FALSE(t.Erase(key));
+      id = -1 - iter;
+      t.Insert(key, id);
+      ref[v] = id;
+      EXPECT_EQ(t.Find(key), id);
+    }
+  }
+  EXPECT_EQ(t.size(), ref.size());
+  for (map<vector<int32_t>, int32_t>::iterator it = ref.begin();
+       it != ref.end(); ++it) {
+    EXPECT_EQ(t.Find(&it->first[0]), it->second);
+  }
+  t.Clear();
+  EXPECT_EQ(t.size(), 0U);
+  EXPECT_EQ(t.Find(&ref.begin()->first[0]), 0);
+}
+
+TEST(ThreadSanitizer, StackDepotTest) {
+  StackDepot depot;
+  size_t n = 1;
+  EXPECT_EQ(depot.Put(NULL, 0), 0U);
+  EXPECT_TRUE(depot.Get(0, &n) == NULL);
+  EXPECT_EQ(n, 0U);
+
+  map<vector<uintptr_t>, uint32_t> ids;
+  uintptr_t pcs[20];
+  for (int iter = 0; iter < 100000; iter++) {
+    size_t size = 1 + rand() % 20;
+    for (size_t i = 0; i < size; i++)
+      pcs[i] = 0x1000 + rand() % 4;
+    vector<uintptr_t> v(pcs, pcs + size);
+    uint32_t id = depot.Put(pcs, size);
+    EXPECT_NE(id, 0U);
+    if (ids.count(v)) {
+      EXPECT_EQ(id, ids[v]);
+    }
+    ids[v] = id;
+  }
+  EXPECT_EQ(depot.NumberOfStacks(), ids.size());
+  for (map<vector<uintptr_t>, uint32_t>::iterator it = ids.begin();
+       it != ids.end(); ++it) {
+    const uintptr_t *res = depot.Get(it->second, &n);
+    ASSERT_EQ(n, it->first.size());
+    EXPECT_EQ(0, memcmp(res, &it->first[0], n * sizeof(uintptr_t)));
+  }
+}
+
+TEST(ThreadSanitizer, HistoryRingTest) {
+  const size_t kSizeLog = 10;
+  HistoryRing ring(kSizeLog);
+  vector<uintptr_t> stack;
+  vector<pair<uint32_t, vector<uintptr_t> > > points;
+  uintptr_t pcs[HistoryRing::kMaxFrames];
+  EXPECT_EQ(ring.Replay(ring.Position(), pcs, 10), 0U);
+  for (int iter = 0; iter < 100000; iter++) {
+    int r = rand() % 8;
+    static const uintptr_t kNoPc = 0;
+    if (r < 3 && stack.size() < 200) {
+      uintptr_t pc = 0x1000 + rand() % 100;
+      ring.Add(HistoryRing::CALL, pc, stack.empty() ? &kNoPc : &stack[0],
+               stack.size());
+      stack.push_back(pc);
+    } else if (r < 6 && !stack.empty()) {
+      ring.Add(HistoryRing::RETURN, 0, &stack[0], stack.size());
+      stack.pop_back();
+    } else if (!stack.empty()) {
+      uintptr_t pc = 0x2000 + rand() % 100;
+      ring.Add(HistoryRing::SET_TOP, pc, &stack[0], stack.size());
+      stack.back() = pc;
+    }
+    if (rand() % 16 == 0) {
+      vector<uintptr_t> top(stack.rbegin(),
+                            stack.rbegin() + min(stack.size(), (size_t)10));
+      points.push_back(make_pair(ring.Position(), top));
+    }
+  }
+  // The last half of the ring (at least) is there.
+  size_t n_replayed = 0;
+  for (size_t i = points.size() - (1 << (kSizeLog - 1)) / 16 / 2;
+       i < points.size(); i++) {
+    size_t n = ring.Replay(points[i].first, pcs, 10);
+    if (points[i].second.empty()) continue;
+    ASSERT_EQ(n, points[i].second.size());
+    EXPECT_EQ(0, memcmp(pcs, &points[i].second[0], n * sizeof(uintptr_t)));
+    n_replayed++;
+  }
+  EXPECT_GT(n_replayed, 0U);
+  // The old ones are gone.
+  EXPECT_EQ(ring.Replay(points[0].first, pcs, 10), 0U);
+
+  // A cleared ring starts over.
+  ring.Clear();
+  EXPECT_EQ(ring.Replay(ring.Position(), pcs, 10), 0U);
+  const uintptr_t kNoPc = 0;
+  ring.Add(HistoryRing::CALL, 0x3000, &kNoPc, 0);
+  ASSERT_EQ(ring.Replay(ring.Position(), pcs, 10), 1U);
+  EXPECT_EQ(pcs[0], 0x3000U);
+}
+
+// Checks one set of VTS kernels against the scalar ones.
+static void CheckVtsKernels(const VtsKernels *k) {
+  const size_t kMaxSize = 37;
+  int32_t a[2 * kMaxSize], b[2 * kMaxSize];
+  int32_t res1[2 * kMaxSize], res2[2 * kMaxSize];
+  const VtsKernels *s = &kVtsKernelsScalar;
+  for (int iter = 0; iter < 10000; iter++) {
+    size_t n = 1 + rand() % kMaxSize;
+    for (size_t i = 0; i < n; i++) {
+      a[2 * i] = b[2 * i] = 3 * i;
+      a[2 * i + 1] = 10 + rand() % 3;
+      b[2 * i + 1] = 10 + rand() % 3;
+    }
+    if (rand() % 2) {
+      // Make the tids differ somewhere.
+      b[2 * (rand() % n)] += 1;
+    }
+    bool lt1 = false, gt1 = false, lt2 = false, gt2 = false;
+    size_t r1 = s->CompareEqualTidPrefix(a, b, n, &lt1, &gt1);
+    size_t r2 = k->CompareEqualTidPrefix(a, b, n, &lt2, &gt2);
+    EXPECT_EQ(gt1, gt2);
+    if (!gt1) {
+      EXPECT_EQ(r1, r2);
+      EXPECT_EQ(lt1, lt2);
+    }
+
+    r1 = s->MaxEqualTidPrefix(a, b, res1, n);
+    r2 = k->MaxEqualTidPrefix(a, b, res2, n);
+    EXPECT_EQ(r1, r2);
+    EXPECT_EQ(0, memcmp(res1, res2, r1 * 2 * sizeof(int32_t)));
+
+    int32_t tid = rand() % (3 * n + 1);
+    r1 = s->CopyAndFindTid(a, res1, n, tid);
+    r2 = k->CopyAndFindTid(a, res2, n, tid);
+    EXPECT_EQ(r1, r2);
+    EXPECT_EQ(0, memcmp(res1, res2, n * 2 * sizeof(int32_t)));
+  }
+}
+
+TEST(ThreadSanitizer, VtsKernelsTest) {
+  CheckVtsKernels(&kVtsKernelsScalar);
+  CheckVtsKernels(GetBestVtsKernels());
+#if TS_VTS_SIMD
+  if (CpuHasSSE42()) CheckVtsKernels(&kVtsKernelsSSE);
+  if (CpuHasAVX2()) CheckVtsKernels(&kVtsKernelsAVX2);
+#endif
+}
+
+typedef map<int32_t, int32_t> FlatClock;
+
+static void JoinFlatClock(FlatClock *a, const FlatClock &b,
+                          FlatClock *updated) {
+  for (FlatClock::const_iterator it = b.begin(); it != b.end(); ++it) {
+    int32_t &clk = (*a)[it->first];
+    if (clk < it->second) {
+      clk = it->second;
+      (*updated)[it->first] = it->second;
+    }
+  }
+}
+
+static bool FlatClockLessOrEqual(const FlatClock &a, const FlatClock &b) {
+  for (FlatClock::const_iterator it = a.begin(); it != a.end(); ++it) {
+    FlatClock::const_iterator it_b = b.find(it->first);
+    if (it->second > 0 && (it_b == b.end() || it_b->second < it->second))
+      return false;
+  }
+  return true;
+}
+
+static void ExpectSameClock(const TreeClock &tc, const FlatClock &flat) {
+  vector<TreeClock::Entry> entries;
+  tc.GetAll(&entries);
+  FlatClock res;
+  for (size_t i = 0; i < entries.size(); i++)
+    res[entries[i].tid] = entries[i].clk;
+  EXPECT_TRUE(res == flat);
+}
+
+// Random programs with locks and direct thread-to-thread joins (as in
+// pthread_join); tree clocks must match plain vector clocks.
+TEST(ThreadSanitizer, TreeClockTest) {
+  const int kThreads = 20, kLocks = 5;
+  for (int program = 0; program < 20; program++) {
+    vector<TreeClock> threads(kThreads), locks(kLocks);
+    vector<FlatClock> flat_threads(kThreads), flat_locks(kLocks);
+    for (int t = 0; t < kThreads; t++) {
+      TreeClock::Entry e = {t, 1};
+      threads[t].Reset(t, &e, 1);
+      flat_threads[t][t] = 1;
+    }
+    for (int iter = 0; iter < 2000; iter++) {
+      int t = rand() % kThreads;
+      vector<TreeClock::Entry> updated;
+      FlatClock flat_updated;
+      if (rand() % 4) {
+        // Critical section: acquire, release, tick.
+        int l = rand() % kLocks;
+        threads[t].Join(locks[l], &updated);
+        JoinFlatClock(&flat_threads[t], flat_locks[l], &flat_updated);
+        EXPECT_TRUE(locks[l].IsLessOrEqual(threads[t]));
+        locks[l].MonotoneCopy(threads[t]);
+        flat_locks[l] = flat_threads[t];
+        ExpectSameClock(locks[l], flat_locks[l]);
+      } else {
+        // Join with another thread, which then ticks.
+        int t2 = rand() % kThreads;
+        if (t2 == t) continue;
+        threads[t].Join(threads[t2], &updated);
+        JoinFlatClock(&flat_threads[t], flat_threads[t2], &flat_updated);
+        threads[t2].Increment();
+        flat_threads[t2][t2]++;
+        ExpectSameClock(threads[t2], flat_threads[t2]);
+      }
+      FlatClock res_updated;
+      for (size_t i = 0; i < updated.size(); i++)
+        res_updated[updated[i].tid] = updated[i].clk;
+      EXPECT_TRUE(res_updated == flat_updated);
+      threads[t].Increment();
+      flat_threads[t][t]++;
+      ExpectSameClock(threads[t], flat_threads[t]);
+      int a = rand() % kThreads, b = rand() % kThreads;
+      EXPECT_EQ(FlatClockLessOrEqual(flat_threads[a], flat_threads[b]),
+                threads[a].IsLessOrEqual(threads[b]));
+    }
+  }
+}
+
+// The packed event log must give back the events that were put in it,
+// across the blocks and with pcs and addresses jumping both ways.
+TEST(ThreadSanitizer, PackedEventsTest) {
+  const size_t kEvents = kPackedEventsMaxBlockEvents * 2 + 100;
+  const EventType kTypes[] = {READ, WRITE, WRITER_LOCK, UNLOCK, RTN_CALL};
+  vector<Event> events;
+  srand(1);
+  for (size_t i = 0; i < kEvents; i++) {
+    uintptr_t pc = 0x400000 + (rand() % 1000);
+    uintptr_t a = (i % 7 == 0) ? ~(uintptr_t)rand() : (uintptr_t)rand() * 8;
+    events.push_back(Event(kTypes[rand() % 5], rand() % 100, pc, a, i % 9));
+  }
+  const char kDescr[] = "img rtn file 42";
+  FILE *f = tmpfile();
+  ASSERT_TRUE(f != NULL);
+  {
+    PackedEventWriter writer(f);
+    for (size_t i = 0; i < kEvents; i++) {
+      Event &e = events[i];
+      writer.Put(e.type(), e.tid(), e.pc(), e.a(), e.info());
+      if (i == 10)
+        writer.Put(PC_DESCRIPTION, 0, 0x1234, 0, 0, kDescr, strlen(kDescr));
+    }
+  }
+  vector<uint8_t> data(ftell(f));
+  rewind(f);
+  ASSERT_EQ(data.size(), fread(&data[0], 1, data.size(), f));
+  fclose(f);
+
+  PackedEventDecoder decoder(&data[0], data.size());
+  EXPECT_TRUE(decoder.ReadHeader());
+  vector<Event> res;
+  Event *block = new Event[kPackedEventsMaxBlockEvents];
+  size_t n_blocks = 0;
+  while (size_t n = decoder.ReadBlock(block)) {
+    res.insert(res.end(), block, block + n);
+    n_blocks++;
+  }
+  delete [] block;
+  EXPECT_EQ(3U, n_blocks);
+  ASSERT_EQ(kEvents + 1, res.size());
+  Event &descr = res[11];
+  EXPECT_EQ(PC_DESCRIPTION, descr.type());
+  EXPECT_EQ(0x1234U, descr.pc());
+  EXPECT_EQ(string(kDescr), string((const char*)descr.a(), descr.info()));
+  res.erase(res.begin() + 11);
+  for (size_t i = 0; i < kEvents; i++) {
+    EXPECT_EQ(events[i].type(), res[i].type());
+    EXPECT_EQ(events[i].tid(), res[i].tid());
+    EXPECT_EQ(events[i].pc(), res[i].pc());
+    EXPECT_EQ(events[i].a(), res[i].a());
+    EXPECT_EQ(events[i].info(), res[i].info());
+  }
+
+  // A truncated log ends at the last complete block.
+  PackedEventDecoder truncated(&data[0], data.size() - 1);
+  EXPECT_TRUE(truncated.ReadHeader());
+  block = new Event[kPackedEventsMaxBlockEvents];
+  EXPECT_EQ(kPackedEventsMaxBlockEvents, truncated.ReadBlock(block));
+  EXPECT_EQ(kPackedEventsMaxBlockEvents, truncated.ReadBlock(block));
+  EXPECT_EQ(0U, truncated.ReadBlock(block));
+  delete [] block;
+}
+
+// A CompactEvent must give back the fields of the Event it was made of,
+// including the largest values which fit.
+TEST(ThreadSanitizer, CompactEventTest) {
+  EXPECT_EQ(16U, sizeof(CompactEvent));
+  const uintptr_t kMax = (uintptr_t)CompactEvent::kAddrMask;
+  Event events[] = {
+    Event(READ, 0, 0, 0, 0),
+    Event(WRITE, 1, 0x400123, 0x7fff12345678, 8),
+    Event(RTN_CALL, 0xffff, kMax, kMax, 0xff),
+    Event(UNTARGET_RANGE, 42, 0x1234, 0xdeadbeef, 1),
+  };
+  for (size_t i = 0; i < TS_ARRAY_SIZE(events); i++) {
+    ASSERT_TRUE(CompactEvent::Fits(events[i]));
+    Event res;
+    CompactEvent(events[i]).Unpack(&res);
+    EXPECT_EQ(events[i].type(), res.type());
+    EXPECT_EQ(events[i].tid(), res.tid());
+    EXPECT_EQ(events[i].pc(), res.pc());
+    EXPECT_EQ(events[i].a(), res.a());
+    EXPECT_EQ(events[i].info(), res.info());
+  }
+  EXPECT_FALSE(CompactEvent::Fits(Event(READ, 0x10000, 0, 0, 0)));
+  EXPECT_FALSE(CompactEvent::Fits(Event(READ, 0, kMax + 1, 0, 0)));
+  EXPECT_FALSE(CompactEvent::Fits(Event(READ, 0, 0, ~(uintptr_t)0, 0)));
+  EXPECT_FALSE(CompactEvent::Fits(Event(READ, 0, 0, 0, 0x100)));
+}
+
+// The unwinder must follow the chain and stop at the first frame which
+// is out of the stack, misaligned or below the previous one.
+TEST(ThreadSanitizer, FramePointerUnwindTest) {
+  uintptr_t stack[16] = {};
+  uintptr_t lo = (uintptr_t)&stack[0];
+  uintptr_t hi = (uintptr_t)&stack[16];
+  stack[2] = (uintptr_t)&stack[6];
+  stack[3] = 0x1001;
+  stack[6] = (uintptr_t)&stack[10];
+  stack[7] = 0x1002;
+  stack[10] = 0x10;  // The caller's frame is not on this stack.
+  stack[11] = 0x1003;
+  uintptr_t pcs[8];
+  ASSERT_EQ(3, FramePointerUnwind((uintptr_t)&stack[2], lo, hi, pcs, 8));
+  EXPECT_EQ(0x1001U, pcs[0]);
+  EXPECT_EQ(0x1002U, pcs[1]);
+  EXPECT_EQ(0x1003U, pcs[2]);
+  EXPECT_EQ(2, FramePointerUnwind((uintptr_t)&stack[2], lo, hi, pcs, 2));
+  EXPECT_EQ(1, FramePointerUnwind((uintptr_t)&stack[6], lo,
+                                  (uintptr_t)&stack[10], pcs, 8));
+  EXPECT_EQ(0, FramePointerUnwind((uintptr_t)&stack[15], lo, hi, pcs, 8));
+  EXPECT_EQ(0, FramePointerUnwind(lo + 1, lo, hi, pcs, 8));
+  stack[6] = (uintptr_t)&stack[0];
+  EXPECT_EQ(2, FramePointerUnwind((uintptr_t)&stack[2], lo, hi, pcs, 8));
+}
+
+// The SSE2 loops in ts_replace.h must give the libc results and report
+// exactly the bytes the byte loops would, also for strings which end right
+// before an unmapped page.
+TEST(ThreadSanitizer, ReplaceTest) {
+  const size_t kPage = 4096;
+  char *mem = NULL;
+#if defined(__linux__)
+  mem = (char*)mmap(NULL, 3 * kPage, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(MAP_FAILED, (void*)mem);
+  ASSERT_EQ(0, mprotect(mem + 2 * kPage, kPage, PROT_NONE));
+#else
+  mem = new char[2 * kPage];
+#endif
+  char *dst = new char[2 * kPage];
+  unsigned seed = 1;
+  for (int iter = 0; iter < 20000; iter++) {
+    size_t len = tsan_prng(&seed) % (iter % 8 ? 40 : 200);
+    char *s = (iter % 2) ? mem + 2 * kPage - len - 1
+                         : mem + tsan_prng(&seed) % kPage;
+    for (size_t i = 0; i < len; i++)
+      s[i] = 'a' + tsan_prng(&seed) % 4;
+    s[len] = 0;
+    char c = 'a' + tsan_prng(&seed) % 5;
+    size_t n = tsan_prng(&seed) % (len + 20);
+
+    replace_read_bytes = 0;
+    EXPECT_EQ(strlen(s), Replace_strlen(s));
+    EXPECT_EQ(len + 1, replace_read_bytes);
+    EXPECT_EQ(strchr(s, c), Replace_strchr(s, c));
+    EXPECT_EQ(strrchr(s, c), Replace_strrchr(s, c));
+    EXPECT_EQ(strrchr(s, 0), Replace_strrchr(s, 0));
+    EXPECT_EQ(memchr(s, c, len), Replace_memchr(s, c, len));
+
+    const char *found = strchr(s, c);
+    replace_read_bytes = 0;
+    Replace_strchr(s, c);
+    EXPECT_EQ(found ? found - s + 1 : len + 1, replace_read_bytes);
+
+    char t[256];
+    memcpy(t, s, len + 1);
+    if (len && tsan_prng(&seed) % 2)
+      t[tsan_prng(&seed) % len] = 'a' + tsan_prng(&seed) % 4;
+    int expected = strcmp(s, t);
+    int res = Replace_strcmp(s, t);
+    EXPECT_EQ(expected < 0, res < 0);
+    EXPECT_EQ(expected > 0, res > 0);
+    expected = strncmp(s, t, n);
+    res = Replace_strncmp(s, t, n);
+    EXPECT_EQ(expected < 0, res < 0);
+    EXPECT_EQ(expected > 0, res > 0);
+    expected = memcmp(s, t, len);
+    res = Replace_memcmp((const unsigned char*)s, (const unsigned char*)t,
+                         len);
+    EXPECT_EQ(expected < 0, res < 0);
+    EXPECT_EQ(expected > 0, res > 0);
+
+    memset(dst, 'x', len + 32);
+    replace_write_bytes = 0;
+    EXPECT_EQ(dst + 1, Replace_strcpy(dst + 1, s));
+    EXPECT_EQ(len + 1, replace_write_bytes);
+    EXPECT_STREQ(s, dst + 1);
+    EXPECT_EQ('x', dst[len + 2]);
+    memset(dst, 'x', len + 32);
+    Replace_strncpy(dst, s, n);
+    EXPECT_EQ(0, strncmp(s, dst, n));
+    EXPECT_EQ('x', dst[n]);
+    memset(dst, 'x', len + 32);
+    Replace_memcpy(dst + 3, s, len);
+    EXPECT_EQ(0, memcmp(s, dst + 3, len));
+    EXPECT_EQ('x', dst[len + 3]);
+
+    // Overlapping memmove in both directions.
+    for (size_t i = 0; i < len + 32; i++)
+      dst[i] = t[i] = (char)i;
+    size_t from = tsan_prng(&seed) % 16, to = tsan_prng(&seed) % 16;
+    memmove(t + to, t + from, len);
+    Replace_memmove(dst + to, dst + from, len);
+    EXPECT_EQ(0, memcmp(t, dst, len + 32));
+  }
+  delete [] dst;
+#if defined(__linux__)
+  munmap(mem, 3 * kPage);
+#else
+  delete [] mem;
+#endif
 }
 
 TEST(ThreadSanitizer, NormalizeFunctionNameNotChangingTest) {
@@ -328,6 +1098,11 @@ TEST(ThreadSanitizer, NormalizeFunctionNameChangingTest) {
     "net::(anonymous namespace)::CookieSignature::operator<(net::(anonymous namespace)::CookieSignature const&) const",
         "net::::CookieSignature::operator<",
 
+    "(anonymous namespace)::(anonymous namespace)::Foo<int,  char>::Run(void (***)(int), int (*)(char)) const",
+        "::::Foo::Run",
+
+    "a::operator>>=(int)", "a::operator>>=",
+
     "v8::Handle<v8::Value> (*v8::ToCData<v8::Handle<v8::Value> (*)(v8::Arguments const&)>(v8::internal::Object*))(v8::Arguments const&)",
         "v8::ToCData",
 
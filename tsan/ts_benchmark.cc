@@ -0,0 +1,499 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+
+// A microbenchmark of the detector alone, w/o a tool and a program.
+// Synthetic traces go straight into ThreadSanitizerHandleTrace() and the
+// synchronization into ThreadSanitizerHandleOneEvent(), from one thread,
+// switching between the simulated threads as a serialized tool does.
+// The parallel_* scenarios run each simulated thread on a real one instead;
+// they need a TS_SERIALIZED=0 build (make OFFLINE_SERIALIZED=0 benchmark).
+//
+// Usage: ts_benchmark [--bench_filter=str] [--bench_events=N] [tsan flags]
+// Runs the scenarios whose names contain 'str', each for about N memory
+// accesses, and prints the events/sec and ns/event of each. The scenarios
+// have no races; a report means the detector is broken.
+// On Linux, if the perf counters are usable, the dTLB load misses per 1000
+// events are printed too; compare the runs with and w/o --huge_pages.
+// The kernel_* benchmarks time a building block of the detector alone (and
+// ignore --bench_events); the filter selects them the same way.
+
+// ------------- Includes ------------- {{{1
+#include "thread_sanitizer.h"
+#include "ts_events.h"
+#include "ts_tree_clock.h"
+#include "ts_vts_simd.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+// ------------- Tool API ------------- {{{1
+// The detector's symbolization hooks, ts_offline has the real ones.
+unsigned long offline_line_n;
+
+void PcToStrings(uintptr_t pc, bool demangle,
+                string *img_name, string *rtn_name,
+                string *file_name, int *line_no) {
+  img_name->clear();
+  rtn_name->clear();
+  file_name->clear();
+  *line_no = 0;
+}
+
+string PcToRtnName(uintptr_t pc, bool demangle) {
+  return "";
+}
+
+// ------------- TLB misses ------------- {{{1
+// A perf counter of the dTLB load misses of this thread, or -1.
+static int g_dtlb_fd = -1;
+
+static void OpenDtlbCounter() {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  g_dtlb_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (g_dtlb_fd < 0)
+    Printf("INFO: no dTLB miss counter (perf_event_open failed)\n");
+#endif
+}
+
+static uint64_t ReadDtlbMisses() {
+  uint64_t value = 0;
+#ifdef __linux__
+  if (g_dtlb_fd >= 0 && read(g_dtlb_fd, &value, sizeof(value)) !=
+      sizeof(value))
+    value = 0;
+#endif
+  return value;
+}
+
+// ------------- Scenarios ------------- {{{1
+static const size_t kMopsPerTrace = 8;
+// Traces of a thread before switching to the next one.
+static const size_t kTracesPerSlice = 16;
+
+static int32_t g_next_tid;
+static uintptr_t g_next_base = 1UL << 32;  // Far from anything real.
+
+struct Scenario;
+typedef void (*TraceAddressesFn)(const Scenario &s, int thread,
+                                 size_t iter, uintptr_t *tleb);
+
+struct Scenario {
+  const char *name;
+  int n_threads;
+  bool is_write;
+  // Odd mops of a trace are writes, even ones reads (is_write is ignored).
+  bool mixed_rw;
+  size_t access_size;
+  // Sync around each trace: a lock, or a signal to the next thread and a
+  // wait for the previous one.
+  bool use_lock;
+  bool use_signal_wait;
+  TraceAddressesFn addresses;
+  // Each simulated thread runs on a thread of its own, concurrently with
+  // the others. Only with TS_SERIALIZED=0 (make OFFLINE_SERIALIZED=0
+  // benchmark) and w/o sync around the traces.
+  bool parallel;
+  // Set by RunScenario.
+  uintptr_t base;
+  int32_t first_tid;
+};
+
+// Thread-local data: each thread walks its own 64K.
+static void PrivateAddresses(const Scenario &s, int thread, size_t iter,
+                             uintptr_t *tleb) {
+  uintptr_t region = s.base + ((uintptr_t)thread << 16);
+  for (size_t i = 0; i < kMopsPerTrace; i++)
+    tleb[i] = region + ((iter * kMopsPerTrace + i) * 8 & 0xffff);
+}
+
+// Each thread keeps hitting its own 256 bytes (4 cache lines), e.g. the
+// fields of a thread-local struct; compare with and w/o --parked_lines.
+static void HotAddresses(const Scenario &s, int thread, size_t iter,
+                         uintptr_t *tleb) {
+  uintptr_t region = s.base + ((uintptr_t)thread << 16);
+  for (size_t i = 0; i < kMopsPerTrace; i++)
+    tleb[i] = region + ((iter * kMopsPerTrace + i) * 8 & 0xff);
+}
+
+// Thread-local data packed together: each thread writes its own 64 bytes
+// (one cache line) of an array, so the Cache slots of the threads' lines
+// are neighbors. Run in parallel, see --parked_lines.
+static void PackedAddresses(const Scenario &s, int thread, size_t iter,
+                            uintptr_t *tleb) {
+  uintptr_t line = s.base + thread * 64;
+  for (size_t i = 0; i < kMopsPerTrace; i++)
+    tleb[i] = line + ((iter * kMopsPerTrace + i) * 8 & 63);
+}
+
+// Like PrivateAddresses, but on the odd sweeps of the 64K a read and the
+// following write hit the same address, and every other sweep is shifted
+// by one, so an address of a mixed_rw trace is read, or written, or both.
+// This makes the shadow values go through most of the same-thread
+// transitions of the state machine. It is the scenario a table-driven
+// MemoryStateMachineSameThread was measured with; the table was slower and
+// the state machine was left as it is, see the note there.
+static void MixedAddresses(const Scenario &s, int thread, size_t iter,
+                           uintptr_t *tleb) {
+  uintptr_t region = s.base + ((uintptr_t)thread << 16);
+  size_t sweep = (iter * kMopsPerTrace * 8) >> 16;
+  for (size_t i = 0; i < kMopsPerTrace; i++) {
+    size_t j = (sweep & 1) ? (i & ~1) : i;
+    tleb[i] = region + ((iter * kMopsPerTrace + j + (sweep >> 1)) * 8 & 0xffff);
+  }
+}
+
+// All the threads walk the same 64K.
+static void SharedAddresses(const Scenario &s, int thread, size_t iter,
+                            uintptr_t *tleb) {
+  for (size_t i = 0; i < kMopsPerTrace; i++)
+    tleb[i] = s.base + ((iter * kMopsPerTrace + i) * 8 & 0xffff);
+}
+
+// Each thread writes its own 4 bytes of the same cache lines.
+static void FalseSharingAddresses(const Scenario &s, int thread, size_t iter,
+                                  uintptr_t *tleb) {
+  for (size_t i = 0; i < kMopsPerTrace; i++) {
+    uintptr_t line = (iter * kMopsPerTrace + i) & 1023;
+    tleb[i] = s.base + line * 64 + thread * 4;
+  }
+}
+
+static Scenario g_scenarios[] = {
+  // name          threads write  mixed size lock  sig/wait addresses
+  {"private_write",   4,    true,  false, 8,  false, false, PrivateAddresses},
+  {"private_read",    4,    false, false, 8,  false, false, PrivateAddresses},
+  {"private_hot",     4,    true,  false, 8,  false, false, HotAddresses},
+  {"private_mixed",   4,    false, true,  8,  false, true,  MixedAddresses},
+  {"read_shared",     4,    false, false, 8,  false, false, SharedAddresses},
+  {"lock_protected",  4,    true,  false, 8,  true,  false, SharedAddresses},
+  {"signal_wait",     4,    true,  false, 8,  false, true,  SharedAddresses},
+  {"false_sharing",   16,   true,  false, 4,  false, false,
+   FalseSharingAddresses},
+  {"many_threads",    256,  true,  false, 8,  false, false, PrivateAddresses},
+  {"parallel_packed", 4,    true,  false, 8,  false, false, PackedAddresses,
+   true},
+};
+
+static void Put(EventType type, int32_t tid, uintptr_t pc,
+                uintptr_t a, uintptr_t info) {
+  Event event(type, tid, pc, a, info);
+  ThreadSanitizerHandleOneEvent(&event);
+}
+
+// A thread of a parallel scenario.
+struct ParallelThread {
+  Scenario *s;
+  int t;
+  TraceInfo *trace;
+  size_t n_iters;
+};
+
+static void *ParallelThreadBody(void *arg) {
+  ParallelThread *p = (ParallelThread*)arg;
+  uintptr_t tleb[kMopsPerTrace];
+  for (size_t iter = 0; iter < p->n_iters; iter++) {
+    p->s->addresses(*p->s, p->t, iter, tleb);
+    ThreadSanitizerHandleTrace(p->s->first_tid + p->t, p->trace, tleb);
+  }
+  return NULL;
+}
+
+// Returns the number of events handled.
+static size_t RunScenario(Scenario *s, size_t n_accesses) {
+  if (s->parallel && TS_SERIALIZED) {
+    Printf("%-16s skipped: needs a TS_SERIALIZED=0 build\n", s->name);
+    return 0;
+  }
+  s->base = g_next_base;
+  g_next_base += 1UL << 28;
+  s->first_tid = g_next_tid;
+  g_next_tid += s->n_threads;
+  uintptr_t lock = s->base - 8;
+
+  vector<TraceInfo*> traces(s->n_threads);
+  for (int t = 0; t < s->n_threads; t++) {
+    uintptr_t pc = 0x1000000 + (s - g_scenarios) * 0x10000 + t * 0x100;
+    traces[t] = TraceInfo::NewTraceInfo(kMopsPerTrace, pc);
+    for (size_t i = 0; i < kMopsPerTrace; i++) {
+      bool is_write = s->mixed_rw ? (i & 1) : s->is_write;
+      *traces[t]->GetMop(i) = MopInfo(pc + i, s->access_size, is_write,
+                                      /*create_sblock=*/i == 0);
+    }
+  }
+
+  // The first thread creates the data, the others start after that.
+  int32_t parent = s->first_tid;
+  Put(THR_START, parent, 0, 0, parent ? 0 : -1);
+  for (uintptr_t a = s->base; a < s->base + (1 << 16); a += 8)
+    Put(WRITE, parent, 0x100, a, 8);
+  for (int t = 1; t < s->n_threads; t++)
+    Put(THR_START, s->first_tid + t, 0, 0, parent);
+
+  size_t n_iters = n_accesses / kMopsPerTrace;
+  size_t n_slices = (n_iters + kTracesPerSlice - 1) / kTracesPerSlice;
+  uintptr_t tleb[kMopsPerTrace];
+  size_t n_events = 0;
+  size_t start = TimeInMicroSeconds();
+  uint64_t dtlb_start = ReadDtlbMisses();
+  size_t iter_of_thread = 0;
+  if (s->parallel) {
+    vector<pthread_t> threads(s->n_threads);
+    vector<ParallelThread> args(s->n_threads);
+    for (int t = 0; t < s->n_threads; t++) {
+      ParallelThread arg = {s, t, traces[t], n_iters / s->n_threads};
+      args[t] = arg;
+      CHECK(pthread_create(&threads[t], NULL, ParallelThreadBody,
+                           &args[t]) == 0);
+    }
+    for (int t = 0; t < s->n_threads; t++) {
+      pthread_join(threads[t], NULL);
+      n_events += args[t].n_iters * kMopsPerTrace;
+    }
+    n_slices = 0;
+  }
+  for (size_t slice = 0; slice < n_slices; slice++) {
+    int t = slice % s->n_threads;
+    int32_t tid = s->first_tid + t;
+    if (t == 0 && slice) iter_of_thread += kTracesPerSlice;
+    for (size_t j = 0; j < kTracesPerSlice; j++) {
+      size_t iter = iter_of_thread + j;
+      if (s->use_lock) Put(WRITER_LOCK, tid, 0x200, lock, 0);
+      if (s->use_signal_wait)
+        Put(WAIT, tid, 0x300, lock + (t + s->n_threads - 1) % s->n_threads,
+            0);
+      s->addresses(*s, t, iter, tleb);
+      ThreadSanitizerHandleTrace(tid, traces[t], tleb);
+      if (s->use_lock) Put(UNLOCK, tid, 0x201, lock, 0);
+      if (s->use_signal_wait) Put(SIGNAL, tid, 0x301, lock + t, 0);
+      n_events += kMopsPerTrace + 2 * (s->use_lock || s->use_signal_wait);
+    }
+  }
+  double sec = (TimeInMicroSeconds() - start) / 1e6;
+  uint64_t dtlb_misses = ReadDtlbMisses() - dtlb_start;
+
+  for (int t = s->n_threads - 1; t >= 0; t--)
+    Put(THR_END, s->first_tid + t, 0, 0, 0);
+  for (int t = 0; t < s->n_threads; t++)
+    traces[t]->DeleteTraceInfo(traces[t]);
+
+  if (sec <= 0) sec = 1e-6;
+  Printf("%-16s %4d threads %10ld events %7.3f sec %8.2f Mevents/s "
+         "%7.1f ns/event", s->name, s->n_threads, n_events, sec,
+         n_events / sec / 1e6, sec * 1e9 / n_events);
+  if (g_dtlb_fd >= 0)
+    Printf(" %7.2f dTLB misses/Kevent", dtlb_misses * 1e3 / n_events);
+  Printf("\n");
+  return n_events;
+}
+
+// ------------- Kernels ------------- {{{1
+// The VTS kernels (see ts_vts_simd.h) on VTSs of 8 to 1024 entries which
+// differ in every clock.
+static void KernelVts() {
+  const VtsKernels *kernels[3] = {&kVtsKernelsScalar, NULL, NULL};
+#if TS_VTS_SIMD
+  if (CpuHasSSE42()) kernels[1] = &kVtsKernelsSSE;
+  if (CpuHasAVX2()) kernels[2] = &kVtsKernelsAVX2;
+#endif
+  const size_t kMaxSize = 1024;
+  vector<int32_t> a(2 * kMaxSize), b(2 * kMaxSize), res(2 * kMaxSize);
+  for (size_t i = 0; i < kMaxSize; i++) {
+    a[2 * i] = b[2 * i] = i;
+    a[2 * i + 1] = i;
+    b[2 * i + 1] = i + 1;
+  }
+  for (size_t size = 8; size <= kMaxSize; size *= 2) {
+    size_t n_iter = (1 << 24) / size;
+    Printf("%-16s VTS size %4ld:", "kernel_vts", (long)size);
+    for (int k = 0; k < 3; k++) {
+      if (!kernels[k]) continue;
+      size_t start = TimeInMicroSeconds();
+      size_t sum = 0;
+      for (size_t iter = 0; iter < n_iter; iter++) {
+        bool lt = false, gt = false;
+        sum += kernels[k]->CompareEqualTidPrefix(&a[0], &b[0], size,
+                                                 &lt, &gt);
+        sum += kernels[k]->MaxEqualTidPrefix(&a[0], &b[0], &res[0], size);
+      }
+      CHECK(sum == 2 * size * n_iter);
+      Printf("  %s: %4ld ms", kernels[k]->name,
+             (long)((TimeInMicroSeconds() - start) / 1000));
+    }
+    Printf("\n");
+  }
+}
+
+// Tree clocks (see ts_tree_clock.h) vs flat vector clocks on a hierarchy of
+// thread pools. Each worker synchronizes through the lock of its pool; the
+// first worker of each pool also takes a global lock now and then.
+static void KernelTreeClock() {
+  typedef vector<TreeClock::Entry> Vec;
+  const int kWorkers = 8;
+  for (int n_pools = 8; n_pools <= 128; n_pools *= 4) {
+    int n_threads = n_pools * kWorkers;
+    int n_rounds = (1 << 18) / n_threads;
+    Printf("%-16s threads %4d:", "kernel_tree_clock", n_threads);
+    Vec flat_result;
+    for (int tree = 0; tree < 2; tree++) {
+      vector<TreeClock> threads(n_threads), locks(n_pools + 1);
+      vector<Vec> flat_threads(n_threads), flat_locks(n_pools + 1);
+      for (int t = 0; t < n_threads; t++) {
+        TreeClock::Entry e = {t, 1};
+        threads[t].Reset(t, &e, 1);
+        flat_threads[t].push_back(e);
+      }
+      size_t start = TimeInMicroSeconds();
+      Vec tmp;
+      for (int round = 0; round < n_rounds; round++) {
+        for (int t = 0; t < n_threads; t++) {
+          int l = t / kWorkers;
+          if (t % kWorkers == 0 && round % 64 == 0)
+            l = n_pools;
+          if (tree) {
+            threads[t].Join(locks[l], NULL);
+            locks[l].MonotoneCopy(threads[t]);
+            threads[t].Increment();
+            continue;
+          }
+          // Join of two clocks sorted by tid, then copy and tick.
+          Vec &a = flat_threads[t];
+          const Vec &b = flat_locks[l];
+          tmp.clear();
+          size_t i = 0, j = 0;
+          while (i < a.size() || j < b.size()) {
+            if (j == b.size() || (i < a.size() && a[i].tid < b[j].tid)) {
+              tmp.push_back(a[i++]);
+            } else if (i == a.size() || b[j].tid < a[i].tid) {
+              tmp.push_back(b[j++]);
+            } else {
+              tmp.push_back(a[i].clk > b[j].clk ? a[i] : b[j]);
+              i++;
+              j++;
+            }
+          }
+          a.swap(tmp);
+          flat_locks[l] = a;
+          for (i = 0; i < a.size(); i++) {
+            if (a[i].tid == t) a[i].clk++;
+          }
+        }
+      }
+      Printf("  %s: %5ld ms", tree ? "tree" : "flat",
+             (long)((TimeInMicroSeconds() - start) / 1000));
+      if (!tree) {
+        flat_result = flat_threads[n_threads - 1];
+        continue;
+      }
+      // Both must end up with the same clocks.
+      Vec tree_result;
+      threads[n_threads - 1].GetAll(&tree_result);
+      CHECK(tree_result.size() == flat_result.size());
+      for (size_t i = 0; i < tree_result.size(); i++) {
+        int32_t tid = tree_result[i].tid, clk = 0;
+        for (size_t j = 0; j < flat_result.size(); j++) {
+          if (flat_result[j].tid == tid) clk = flat_result[j].clk;
+        }
+        CHECK(tree_result[i].clk == clk);
+      }
+    }
+    Printf("\n");
+  }
+}
+
+struct KernelBenchmark {
+  const char *name;
+  void (*run)();
+};
+
+static KernelBenchmark g_kernel_benchmarks[] = {
+  {"kernel_vts", KernelVts},
+  {"kernel_tree_clock", KernelTreeClock},
+};
+
+// ------------- main ------------- {{{1
+int main(int argc, char *argv[]) {
+  G_flags = new FLAGS;
+  string filter;
+  size_t n_accesses = 20 << 20;
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.find("--bench_filter=") == 0)
+      filter = arg.substr(strlen("--bench_filter="));
+    else if (arg.find("--bench_events=") == 0)
+      n_accesses = my_strtol(arg.c_str() + strlen("--bench_events="),
+                             NULL, 10);
+    else
+      args.push_back(arg);
+  }
+  ThreadSanitizerParseFlags(&args);
+  ThreadSanitizerInit();
+  OpenDtlbCounter();
+
+  size_t total_events = 0;
+  size_t start = TimeInMicroSeconds();
+  for (size_t i = 0; i < TS_ARRAY_SIZE(g_scenarios); i++) {
+    if (strstr(g_scenarios[i].name, filter.c_str()) == NULL)
+      continue;
+    total_events += RunScenario(&g_scenarios[i], n_accesses);
+  }
+  double sec = (TimeInMicroSeconds() - start) / 1e6;
+  if (sec <= 0) sec = 1e-6;
+  Printf("%-16s %10ld events %7.3f sec %8.2f Mevents/s\n", "total",
+         total_events, sec, total_events / sec / 1e6);
+  for (size_t i = 0; i < TS_ARRAY_SIZE(g_kernel_benchmarks); i++) {
+    if (strstr(g_kernel_benchmarks[i].name, filter.c_str()) == NULL)
+      continue;
+    g_kernel_benchmarks[i].run();
+  }
+
+  ThreadSanitizerFini();
+  if (GetNumberOfFoundErrors() > 0) {
+    Printf("ERROR: the benchmark scenarios should not have races\n");
+    return 1;
+  }
+  return 0;
+}
+// end. {{{1
+// vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
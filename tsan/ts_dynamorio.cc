@@ -86,6 +86,10 @@ static SymbolsTable *sym_tab;
 
 string *g_main_module_path;
 
+// --tleb: buffer the mop addresses in the thread-local event buffer, see
+// InstrumentOneMopInline.
+static bool g_use_tleb;
+
 //--------------- StackFrame ----------------- {{{1
 struct StackFrame {
   uintptr_t pc;
@@ -94,8 +98,41 @@ struct StackFrame {
 };
 
 
+//--------------- Thread local event buffer ----------------- {{{1
+// The mops of one basic block, filled at instrumentation time.
+struct DrMop {
+  uintptr_t pc;
+  uint32_t size;
+  bool is_w;
+};
+
+struct DrBlockInfo {
+  uintptr_t pc;
+  size_t n_mops;
+  DrMop mops[1];  // Actually n_mops.
+
+  static DrBlockInfo *New(uintptr_t pc, size_t n_mops) {
+    size_t size = sizeof(DrBlockInfo) + (n_mops - 1) * sizeof(DrMop);
+    DrBlockInfo *res = (DrBlockInfo*)new uint8_t[size];
+    memset(res, 0, size);
+    res->pc = pc;
+    res->n_mops = n_mops;
+    return res;
+  }
+};
+
+// The instrumented code of a block writes the address of its i-th mop
+// to events[i] (0 means the mop was not executed); the block entry
+// callback processes the previous block's addresses and clears the slots.
+struct DrTleb {
+  static const size_t kMaxMopsPerBlock = 512;
+  uintptr_t events[kMaxMopsPerBlock];
+  DrBlockInfo *block;  // The block whose mops are in events.
+};
+
 //--------------- DrThread ----------------- {{{1
 struct DrThread {
+  DrTleb tleb;  // Must be the first field, the inline stores rely on it.
   int tid;  // A unique 0-based thread id.
   vector<StackFrame> shadow_stack;
 };
@@ -149,6 +186,7 @@ static void PushShadowStack(DrThread &t, uintptr_t pc, uintptr_t target_pc, uint
 static void OnEvent_ThreadInit(void *drcontext) {
   DrThread *t_ptr = new DrThread;
   DrThread &t = *t_ptr;
+  memset(&t.tleb, 0, sizeof(t.tleb));
 
   dr_mutex_lock(g_lock);
   t.tid = g_n_created_threads++;
@@ -161,6 +199,7 @@ static void OnEvent_ThreadInit(void *drcontext) {
 
 static void OnEvent_ThreadExit(void *drcontext) {
   DrThread &t = GetCurrentThread(drcontext);
+  FlushTleb(t);
   dr_printf("T%d %s\n", t.tid, (char*)__FUNCTION__+8);
 }
 
@@ -197,9 +236,23 @@ static void On_Write(uintptr_t pc, size_t size, void *a) {
   On_Mop(pc, size, a, true);
 }
 
+static void FlushTleb(DrThread &t) {
+  DrBlockInfo *block = t.tleb.block;
+  if (!block) return;
+  for (size_t i = 0; i < block->n_mops; i++) {
+    uintptr_t a = t.tleb.events[i];
+    if (!a) continue;
+    DrMop &mop = block->mops[i];
+    On_Mop(mop.pc, mop.size, (void*)a, mop.is_w);
+    t.tleb.events[i] = 0;
+  }
+  t.tleb.block = NULL;
+}
+
 static void On_AnyCall(uintptr_t pc, uintptr_t target_pc, uintptr_t sp, bool is_direct) {
   void *drcontext = dr_get_current_drcontext();
   DrThread &t = GetCurrentThread(drcontext);
+  FlushTleb(t);
   // dr_fprintf(STDOUT, "T%d CALL %p => %p; sp=%p\n", t.tid, pc, target_pc, sp);
   PushShadowStack(t, pc, target_pc, sp);
 }
@@ -212,10 +265,16 @@ static void On_IndirectCall(uintptr_t pc, uintptr_t target_pc, uintptr_t sp) {
   On_AnyCall(pc, target_pc, sp, false);
 }
 
-static void On_TraceEnter(uintptr_t pc, uintptr_t sp) {
+// 'block' is NULL for the entry of a DR trace: its blocks have their own
+// entry callbacks.
+static void On_TraceEnter(uintptr_t pc, uintptr_t sp, DrBlockInfo *block) {
   void *drcontext = dr_get_current_drcontext();
   DrThread &t = GetCurrentThread(drcontext);
   // dr_fprintf(STDOUT, "T%d TRACE:\n%p\n%p\n", t.tid, pc, sp);
+  if (block) {
+    FlushTleb(t);
+    t.tleb.block = block;
+  }
   UpdateShadowStack(t, sp);
 }
 
@@ -228,72 +287,144 @@ opnd_t opnd_create_base_disp_from_dst(opnd_t dst) {
                                OPSZ_lea);
 }
 
-static void InstrumentOneMop(void* drcontext, instrlist_t *bb,
-                             instr_t *instr, opnd_t opnd, bool is_w) {
-  //   opnd_disassemble(drcontext, opnd, 1);
-  //   dr_printf("  -- (%s opnd)\n", is_w ? "write" : "read");
-  void *callback = (void*)(is_w ? On_Write : On_Read);
-  int size = opnd_size_in_bytes(opnd_get_size(opnd));
+static bool IsSupportedMop(opnd_t opnd) {
+  return opnd_is_base_disp(opnd) ||
+#ifdef X86_64
+      opnd_is_rel_addr(opnd) ||
+#endif
+      opnd_is_abs_addr(opnd);
+}
 
+// Inserts 'reg = address of opnd' before instr.
+static void InsertLoadMopAddress(void *drcontext, instrlist_t *bb,
+                                 instr_t *instr, opnd_t opnd, reg_id_t reg) {
   instr_t *tmp_instr = NULL;
-  reg_id_t reg = REG_XAX;
-
-  /* save %xax */
-  dr_save_reg(drcontext, bb, instr, reg, SPILL_SLOT_2);
-
   if (opnd_is_base_disp(opnd)) {
-    /* lea opnd => %xax */
+    /* lea opnd => reg */
     opnd_set_size(&opnd, OPSZ_lea);
     tmp_instr = INSTR_CREATE_lea(drcontext,
                                  opnd_create_reg(reg),
                                  opnd);
-  } else if(
-#ifdef X86_64
-      opnd_is_rel_addr(opnd) ||
-#endif
-      opnd_is_abs_addr(opnd)) {
+  } else {
     tmp_instr = INSTR_CREATE_mov_imm(drcontext,
                                      opnd_create_reg(reg),
                                      OPND_CREATE_INTPTR(opnd_get_addr(opnd)));
   }
-  if (tmp_instr) {
-    // CHECK(tmp_instr);
-    instrlist_meta_preinsert(bb, instr, tmp_instr);
+  instrlist_meta_preinsert(bb, instr, tmp_instr);
+}
 
-    /* clean call */
-    dr_insert_clean_call(drcontext, bb, instr, callback, false,
-                         3,
-                         OPND_CREATE_INTPTR(instr_get_app_pc(instr)),
-                         OPND_CREATE_INT32(size),
-                         opnd_create_reg(reg));
-    /* restore %xax */
-    dr_restore_reg(drcontext, bb, instr, REG_XAX, SPILL_SLOT_2);
-  } else {
+// With --tleb the address of the idx-th mop of the block goes straight to
+// the TLEB instead of a clean call, which saves the whole machine context:
+//   save %xax, %xbx
+//   lea opnd => %xax
+//   %xbx = DrThread* (the tls field)
+//   mov %xax => tleb.events[idx](%xbx)
+//   restore %xbx, %xax
+// None of these instructions change the flags.
+static void InstrumentOneMopInline(void* drcontext, instrlist_t *bb,
+                                   instr_t *instr, opnd_t opnd, bool is_w,
+                                   DrBlockInfo *block, size_t idx) {
+  DrMop &mop = block->mops[idx];
+  mop.pc = (uintptr_t)instr_get_app_pc(instr);
+  mop.size = opnd_size_in_bytes(opnd_get_size(opnd));
+  mop.is_w = is_w;
+
+  dr_save_reg(drcontext, bb, instr, REG_XAX, SPILL_SLOT_2);
+  dr_save_reg(drcontext, bb, instr, REG_XBX, SPILL_SLOT_3);
+  InsertLoadMopAddress(drcontext, bb, instr, opnd, REG_XAX);
+  dr_insert_read_tls_field(drcontext, bb, instr, REG_XBX);
+  int disp = offsetof(DrTleb, events) + idx * sizeof(uintptr_t);
+  instrlist_meta_preinsert(bb, instr,
+      INSTR_CREATE_mov_st(drcontext,
+                          OPND_CREATE_MEMPTR(REG_XBX, disp),
+                          opnd_create_reg(REG_XAX)));
+  dr_restore_reg(drcontext, bb, instr, REG_XBX, SPILL_SLOT_3);
+  dr_restore_reg(drcontext, bb, instr, REG_XAX, SPILL_SLOT_2);
+}
+
+static void InstrumentOneMop(void* drcontext, instrlist_t *bb,
+                             instr_t *instr, opnd_t opnd, bool is_w,
+                             DrBlockInfo *block, size_t *idx) {
+  //   opnd_disassemble(drcontext, opnd, 1);
+  //   dr_printf("  -- (%s opnd)\n", is_w ? "write" : "read");
+  if (!IsSupportedMop(opnd)) {
     dr_printf("%s ????????????????????\n", __FUNCTION__);
+    return;
+  }
+  if (block) {
+    CHECK(*idx < block->n_mops);
+    InstrumentOneMopInline(drcontext, bb, instr, opnd, is_w, block, *idx);
+    (*idx)++;
+    return;
   }
+
+  void *callback = (void*)(is_w ? On_Write : On_Read);
+  int size = opnd_size_in_bytes(opnd_get_size(opnd));
+  reg_id_t reg = REG_XAX;
+
+  /* save %xax */
+  dr_save_reg(drcontext, bb, instr, reg, SPILL_SLOT_2);
+  InsertLoadMopAddress(drcontext, bb, instr, opnd, reg);
+
+  /* clean call */
+  dr_insert_clean_call(drcontext, bb, instr, callback, false,
+                       3,
+                       OPND_CREATE_INTPTR(instr_get_app_pc(instr)),
+                       OPND_CREATE_INT32(size),
+                       opnd_create_reg(reg));
+  /* restore %xax */
+  dr_restore_reg(drcontext, bb, instr, REG_XAX, SPILL_SLOT_2);
 }
 
 static void InstrumentMopInstruction(void *drcontext,
-                                     instrlist_t *bb, instr_t *instr) {
+                                     instrlist_t *bb, instr_t *instr,
+                                     DrBlockInfo *block, size_t *idx) {
   // reads:
   for (int a = 0; a < instr_num_srcs(instr); a++) {
     opnd_t curop = instr_get_src(instr, a);
     if (opnd_is_memory_reference(curop)) {
-      InstrumentOneMop(drcontext, bb, instr, curop, false);
+      InstrumentOneMop(drcontext, bb, instr, curop, false, block, idx);
     }
   }
   // writes:
   for (int a = 0; a < instr_num_dsts(instr); a++) {
     opnd_t curop = instr_get_dst(instr, a);
     if (opnd_is_memory_reference(curop)) {
-      InstrumentOneMop(drcontext, bb, instr, curop, true);
+      InstrumentOneMop(drcontext, bb, instr, curop, true, block, idx);
     }
   }
   //dr_printf("reads: %d writes: %d\n", n_reads, n_writes);
 }
 
+static bool IsCall(instr_t *instr) {
+  return instr_is_call_direct(instr) || instr_is_call_indirect(instr);
+}
+
+// The number of mops InstrumentMopInstruction will find in the block.
+static size_t CountMops(instrlist_t *bb) {
+  size_t res = 0;
+  for (instr_t *instr = instrlist_first(bb); instr != NULL;
+       instr = instr_get_next(instr)) {
+    if (!instr_get_app_pc(instr) || IsCall(instr) ||
+        !(instr_reads_memory(instr) || instr_writes_memory(instr)))
+      continue;
+    for (int a = 0; a < instr_num_srcs(instr); a++) {
+      opnd_t curop = instr_get_src(instr, a);
+      if (opnd_is_memory_reference(curop) && IsSupportedMop(curop))
+        res++;
+    }
+    for (int a = 0; a < instr_num_dsts(instr); a++) {
+      opnd_t curop = instr_get_dst(instr, a);
+      if (opnd_is_memory_reference(curop) && IsSupportedMop(curop))
+        res++;
+    }
+  }
+  return res;
+}
+
 static void InstrumentInstruction(void *drcontext, instrlist_t *bb,
-                                  instr_t *instr) {
+                                  instr_t *instr,
+                                  DrBlockInfo *block, size_t *idx) {
   // instr_disassemble(drcontext, instr, 1);
   // dr_printf("  -- \n");
   if (instr_is_call_direct(instr)) {
@@ -304,12 +435,12 @@ static void InstrumentInstruction(void *drcontext, instrlist_t *bb,
                                   (app_pc)On_IndirectCall, SPILL_SLOT_1);
 
   } else if (instr_reads_memory(instr) || instr_writes_memory(instr)) {
-    InstrumentMopInstruction(drcontext, bb, instr);
+    InstrumentMopInstruction(drcontext, bb, instr, block, idx);
   }
 }
 
-static dr_emit_flags_t OnEvent_Trace(void *drcontext, void *tag,
-                                     instrlist_t *trace, bool translating) {
+static void InsertTraceEnter(void *drcontext, instrlist_t *trace,
+                             DrBlockInfo *block) {
   instr_t *first_instr = NULL;
   for (instr_t *instr = instrlist_first(trace); instr != NULL;
        instr = instr_get_next(instr)) {
@@ -323,11 +454,17 @@ static dr_emit_flags_t OnEvent_Trace(void *drcontext, void *tag,
     // dr_printf("  -- in_trace %p\n", instr_get_app_pc(first_instr));
     dr_insert_clean_call(drcontext, trace, first_instr,
                          (void*)On_TraceEnter, false,
-                         2,
+                         3,
                          OPND_CREATE_INTPTR(instr_get_app_pc(first_instr)),
-                         opnd_create_reg(REG_XSP)
+                         opnd_create_reg(REG_XSP),
+                         OPND_CREATE_INTPTR(block)
                          );
   }
+}
+
+static dr_emit_flags_t OnEvent_Trace(void *drcontext, void *tag,
+                                     instrlist_t *trace, bool translating) {
+  InsertTraceEnter(drcontext, trace, NULL);
   return DR_EMIT_DEFAULT;
 }
 
@@ -415,15 +552,21 @@ static dr_emit_flags_t OnEvent_BB(void* drcontext, void *tag, instrlist_t *bb,
       //print_bb(drcontext, bb, "AFTER");
     }
 
+    DrBlockInfo *block = NULL;
+    size_t n_mops = g_use_tleb ? CountMops(bb) : 0;
+    if (n_mops > 0 && n_mops <= DrTleb::kMaxMopsPerBlock)
+      block = DrBlockInfo::New((uintptr_t)pc, n_mops);
+    // Insert the entry callback first so that it runs before the stores of
+    // the first instruction's mops.
+    InsertTraceEnter(drcontext, bb, block);
+    size_t idx = 0;
     instr_t *instr, *next_instr;
     for (instr = instrlist_first(bb); instr != NULL; instr = next_instr) {
       next_instr = instr_get_next(instr);
       if (instr_get_app_pc(instr))  // don't instrument non-app code
-        InstrumentInstruction(drcontext, bb, instr);
+        InstrumentInstruction(drcontext, bb, instr, block, &idx);
     }
-
-
-    OnEvent_Trace(drcontext, tag, bb, translating);
+    CHECK(!block || idx == n_mops);
   }
 
   return DR_EMIT_DEFAULT;
@@ -472,6 +615,7 @@ DR_EXPORT void dr_init(client_id_t id) {
   if (fname) {
     ReadSymbolsTableFromFile(fname + 10);
   }
+  g_use_tleb = strstr(opstr, "--tleb") != NULL;
 
   // Register events.
   dr_register_exit_event(OnEvent_Exit);
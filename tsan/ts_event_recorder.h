@@ -0,0 +1,159 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_EVENT_RECORDER_
+#define TS_EVENT_RECORDER_
+
+#include "ts_util.h"
+#include "ts_lock.h"
+#include "ts_packed_events.h"
+
+// -------- EventRecorder ------ {{{1
+// With --record_events=file the tools write the events into a packed event
+// log (see ts_packed_events.h) instead of analyzing them; ts_offline
+// --input_type=packed analyzes the log later.
+//
+// Every thread packs its events into its own PackedEventEncoder w/o any
+// locking. The block of a thread is submitted when it is full and after
+// each event other than a memory access or a routine call/exit. A thread
+// reports a synchronization event after it has synchronized, so the order
+// in which the blocks are submitted is a valid order of all the
+// synchronization. The submitted blocks are queued under a short lock; a
+// background thread of the tool calls WriteSome() which writes them in this
+// order, through --record_compressor (e.g. "zstd -q") if it is given.
+// If the writer falls behind by more than kMaxQueuedBytes the submitting
+// threads wait for it.
+class EventRecorder {
+ public:
+  EventRecorder()
+      : out_(NULL), is_pipe_(false), queued_bytes_(0),
+        n_events_(0), n_bytes_(0) { }
+
+  // Returns false if the output could not be opened.
+  bool Init(const string &file_name, const string &compressor) {
+    file_name_ = file_name;
+    if (compressor.empty()) {
+      out_ = fopen(file_name.c_str(), "wb");
+    } else {
+      out_ = popen((compressor + " > " + file_name).c_str(), "w");
+      is_pipe_ = true;
+    }
+    if (!out_) return false;
+    uint8_t header[kPackedEventsHeaderSize];
+    PackedEventsPutHeader(header);
+    Write(header, sizeof(header));
+    return true;
+  }
+
+  // Called only by the owner of 'buf'.
+  // SIGNAL_MANY and WAIT_MANY are recorded as SIGNAL and WAIT events since
+  // their addresses are gone by the time the log is analyzed.
+  void Put(PackedEventEncoder *buf, EventType type, int32_t tid,
+           uintptr_t pc, uintptr_t a, uintptr_t info) {
+    if (type == SIGNAL_MANY || type == WAIT_MANY) {
+      const uintptr_t *objs = (const uintptr_t*)a;
+      for (uintptr_t i = 0; i < info; i++)
+        Put(buf, type == SIGNAL_MANY ? SIGNAL : WAIT, tid, pc, objs[i], 0);
+      return;
+    }
+    buf->Put(type, tid, pc, a, info);
+    if (buf->full() || (type != READ && type != WRITE &&
+                        type != RTN_CALL && type != RTN_EXIT))
+      Submit(buf);
+  }
+
+  // Called only by the owner of 'buf'.
+  void Submit(PackedEventEncoder *buf) {
+    if (buf->n_events() == 0) return;
+    while (*(volatile uintptr_t*)&queued_bytes_ > kMaxQueuedBytes)
+      YIELD();
+    vector<uint8_t> *block = new vector<uint8_t>;
+    size_t n_events = buf->n_events();
+    buf->FinishBlock(block);
+    ScopedLock lock(&lock_);
+    queue_.push_back(block);
+    queued_bytes_ += block->size();
+    n_events_ += n_events;
+  }
+
+  // Writes the submitted blocks, returns how many.
+  size_t WriteSome() {
+    ScopedLock write_lock(&write_lock_);
+    if (!out_) return 0;
+    vector<vector<uint8_t>*> blocks;
+    {
+      ScopedLock lock(&lock_);
+      blocks.swap(queue_);
+    }
+    uintptr_t n_bytes = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      Write(&(*blocks[i])[0], blocks[i]->size());
+      n_bytes += blocks[i]->size();
+      delete blocks[i];
+    }
+    if (!blocks.empty()) {
+      ScopedLock lock(&lock_);
+      queued_bytes_ -= n_bytes;
+    }
+    return blocks.size();
+  }
+
+  // The threads should have submitted their blocks.
+  void Fini() {
+    if (!out_) return;
+    WriteSome();
+    ScopedLock write_lock(&write_lock_);
+    if (is_pipe_)
+      pclose(out_);
+    else
+      fclose(out_);
+    out_ = NULL;
+    Printf("INFO: ThreadSanitizer recorded %ld events (%ld bytes) into %s\n",
+           n_events_, n_bytes_, file_name_.c_str());
+  }
+
+ private:
+  static const uintptr_t kMaxQueuedBytes = 64 << 20;
+
+  void Write(const uint8_t *data, size_t size) {
+    CHECK(fwrite(data, 1, size, out_) == size);
+    n_bytes_ += size;
+  }
+
+  FILE *out_;
+  bool is_pipe_;
+  string file_name_;
+  TSLock lock_;
+  TSLock write_lock_;               // Taken by the writers.
+  vector<vector<uint8_t>*> queue_;  // Protected by lock_.
+  uintptr_t queued_bytes_;          // Protected by lock_.
+  uintptr_t n_events_;              // Protected by lock_.
+  uintptr_t n_bytes_;               // Protected by write_lock_.
+};
+
+// end. {{{1
+#endif  // TS_EVENT_RECORDER_
@@ -37,6 +37,8 @@
 //  * addr, a memory address, a lock address, etc
 //  * size of a memory range
 // Few events contain a string (e.g. SET_THREAD_NAME).
+// SIGNAL_MANY and WAIT_MANY contain a pointer to n addresses which is valid
+// only while the event is handled; they are never written to an event log.
 
 enum EventType {
   NOOP,               // Should not appear.
@@ -93,11 +95,19 @@ enum EventType {
   PC_DESCRIPTION,     // {0, pc, descr_str, 0}, for ts_offline.
   PRINT_MESSAGE,      // {tid, pc, message_str, 0}, for ts_offline.
   FLUSH_EXPECTED_RACES,  // {0, 0, 0, 0}
+  SIGNAL_MANY,        // {tid, pc, objs, n}
+  WAIT_MANY,          // {tid, pc, objs, n}
+  TARGET_RANGE,       // {tid, pc, addr, size}
+  UNTARGET_RANGE,     // {tid, pc, addr, size}
   LAST_EVENT          // Should not appear.
 };
 
 #include "ts_event_names.h"  // generated from this file by sed.
 
+// The tools split the ranges of ANNOTATE_HAPPENS_{BEFORE,AFTER}_ARRAY
+// into SIGNAL_MANY/WAIT_MANY events of at most this many addresses.
+static const size_t kMaxManyEventObjs = 256;
+
 class Event {
  public:
   Event(EventType type, int32_t tid, uintptr_t pc, uintptr_t a, uintptr_t info)
@@ -139,6 +149,51 @@ class Event {
   uintptr_t info_;
 };
 
+// A 16-byte copy of an Event for in-memory event queues (e.g. the shards
+// of ts_offline --threaded_analysis), half the size of an Event on 64-bit.
+// The first word is the pc (48 bits) and the tid (16 bits), the second one
+// is the address (48 bits), the type (8 bits) and the info (8 bits).
+// Only the events which pass Fits() can be packed; the queue's owner
+// handles the other ones the slow way.
+class CompactEvent {
+ public:
+  static const int kAddrBits = 48;
+  static const uint64_t kAddrMask = (1ULL << kAddrBits) - 1;
+
+  static INLINE bool Fits(const Event &e) {
+    return (uint64_t)e.pc() <= kAddrMask && (uint64_t)e.a() <= kAddrMask &&
+        (uint32_t)e.tid() <= 0xffff && e.info() <= 0xff &&
+        (uint32_t)e.type() <= 0xff;
+  }
+
+  CompactEvent() {}  // Not initialized.
+
+  explicit CompactEvent(const Event &e) {
+    DCHECK(Fits(e));
+    pc_tid_ = (uint64_t)e.pc() | ((uint64_t)e.tid() << kAddrBits);
+    a_type_info_ = (uint64_t)e.a() | ((uint64_t)e.type() << kAddrBits) |
+        ((uint64_t)e.info() << (kAddrBits + 8));
+  }
+
+  EventType type()  const {
+    return (EventType)((a_type_info_ >> kAddrBits) & 0xff);
+  }
+  int32_t   tid()   const { return (int32_t)(pc_tid_ >> kAddrBits); }
+  uintptr_t pc()    const { return (uintptr_t)(pc_tid_ & kAddrMask); }
+  uintptr_t a()     const { return (uintptr_t)(a_type_info_ & kAddrMask); }
+  uintptr_t info()  const {
+    return (uintptr_t)(a_type_info_ >> (kAddrBits + 8));
+  }
+
+  void Unpack(Event *e) const {
+    e->Init(type(), tid(), pc(), a(), info());
+  }
+
+ private:
+  uint64_t pc_tid_;
+  uint64_t a_type_info_;
+};
+
 
 // end. {{{1
 #endif  // TS_EVENTS_H_
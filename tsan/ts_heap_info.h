@@ -36,81 +36,297 @@
 // For each heap allocation we create a struct HeapInfo.
 // This struct should have fields 'uintptr_t ptr' and 'uintptr_t size',
 // a default CTOR and a copy CTOR.
+//
+// HeapMap is indexed by pages so that GetInfo() is O(1) on average:
+//  - a small chunk (at most kMaxSmallSize bytes) is registered in each page
+//    it overlaps (at most kMaxSmallSize / kPageSize + 1 pages). A page keeps
+//    the chunks sorted by address; they don't overlap, so a binary search
+//    finds the candidate.
+//  - large chunks (big mallocs, mmaps) are rare and live in a map.
+// The HeapInfo objects are kept in a deque and never move, so the pointers
+// returned by GetInfo() stay valid until the chunk is erased.
+// Not thread-safe: all heap events are handled under the global lock.
 
 template<class HeapInfo>
 class HeapMap {
  public:
-  typedef map<uintptr_t, HeapInfo> map_t;
-  typedef typename map_t::iterator iterator;
+  HeapMap() : pages_(NULL), n_pages_(0), pages_capacity_(0) { Reset(); }
+  ~HeapMap() { Clear(); delete [] pages_; }
 
-  HeapMap() { Reset(); }
-
-  iterator begin() { return ++map_.begin(); }
-  iterator end() { return --map_.end(); }
-
-  size_t size() { return map_.size() - 2; }
+  size_t size() { return infos_.size() - free_idx_.size(); }
 
+  // Replaces the info for 'a' if there was one.
   void InsertInfo(uintptr_t a, HeapInfo info) {
     CHECK(IsValidPtr(a));
     CHECK(info.ptr == a);
-    map_[a] = info;
+    int32_t idx = FindExact(a);
+    if (idx >= 0)
+      EraseIdx(idx);
+    if (free_idx_.empty()) {
+      idx = infos_.size();
+      infos_.push_back(info);
+    } else {
+      idx = free_idx_.back();
+      free_idx_.pop_back();
+      infos_[idx] = info;
+    }
+    is_live_.resize(infos_.size());
+    is_live_[idx] = true;
+    if (IsSmall(info)) {
+      for (uintptr_t p = FirstPage(info); p <= LastPage(info); p++)
+        BucketAdd(GetOrCreateBucket(p), idx);
+    } else {
+      large_[a] = idx;
+    }
   }
 
   void EraseInfo(uintptr_t a) {
     CHECK(IsValidPtr(a));
-    map_.erase(a);
+    int32_t idx = FindExact(a);
+    if (idx >= 0)
+      EraseIdx(idx);
   }
 
-  void EraseRange(uintptr_t start, uintptr_t end) {
+  // Erases all chunks which start in [start, end).
+  // If 'erased' is not NULL, appends the erased infos to it.
+  void EraseRange(uintptr_t start, uintptr_t end,
+                  vector<HeapInfo> *erased = NULL) {
     CHECK(IsValidPtr(start));
     CHECK(IsValidPtr(end));
-    // TODO(glider): the [start, end) range may cover several map_ records.
-    EraseInfo(start);
+    vector<int32_t> to_erase;
+    typename LargeMap::iterator it = large_.lower_bound(start);
+    for (; it != large_.end() && it->first < end; ++it)
+      to_erase.push_back(it->second);
+    uintptr_t first_page = start >> kPageShift;
+    uintptr_t last_page = (end - 1) >> kPageShift;
+    if (last_page - first_page < n_pages_) {
+      for (uintptr_t p = first_page; p <= last_page; p++)
+        CollectStartingIn(FindBucket(p), start, end, &to_erase);
+    } else {
+      // A huge range: cheaper to look at every page we have.
+      for (uintptr_t i = 0; i < pages_capacity_; i++)
+        CollectStartingIn(pages_[i].bucket, start, end, &to_erase);
+    }
+    // A small chunk is found in each of its pages; erase it once.
+    sort(to_erase.begin(), to_erase.end());
+    to_erase.erase(STD::unique(to_erase.begin(), to_erase.end()),
+                   to_erase.end());
+    for (size_t i = 0; i < to_erase.size(); i++) {
+      if (erased) erased->push_back(infos_[to_erase[i]]);
+      EraseIdx(to_erase[i]);
+    }
   }
 
   HeapInfo *GetInfo(uintptr_t a) {
     CHECK(this);
     CHECK(IsValidPtr(a));
-    typename map_t::iterator it = map_.lower_bound(a);
-    CHECK(it != map_.end());
-    if (it->second.ptr == a) {
-      // Exact match. 'a' is the beginning of a heap-allocated address.
-      return &it->second;
-    }
-    CHECK(a < it->second.ptr);
-    CHECK(it != map_.begin());
-    // not an exact match, try the previous iterator.
-    --it;
-    HeapInfo *info = &it->second;
-    CHECK(info->ptr < a);
-    if (info->ptr + info->size > a) {
-      // within the range.
-      return info;
+    int32_t idx = FindIdx(a);
+    return idx >= 0 ? &infos_[idx] : NULL;
+  }
+
+  // Appends pointers to all infos to 'res', sorted by address.
+  void GetAll(vector<HeapInfo*> *res) {
+    size_t first = res->size();
+    for (size_t i = 0; i < infos_.size(); i++) {
+      if (is_live_[i])
+        res->push_back(&infos_[i]);
     }
-    return NULL;
+    sort(res->begin() + first, res->end(), LessByPtr);
   }
 
   void Clear() {
-    map_.clear();
+    for (uintptr_t i = 0; i < pages_capacity_; i++)
+      delete pages_[i].bucket;
+    delete [] pages_;
+    pages_ = NULL;
+    n_pages_ = pages_capacity_ = 0;
+    infos_.clear();
+    is_live_.clear();
+    free_idx_.clear();
+    large_.clear();
     Reset();
   }
 
  private:
+  enum {
+    kPageShift = 12,
+    kPageSize = 1 << kPageShift,
+    kMaxSmallSize = 16 * kPageSize,
+    kInitialPagesCapacity = 1024
+  };
+
+  // Indices in infos_, sorted by ptr.
+  typedef vector<int32_t> Bucket;
+  typedef map<uintptr_t, int32_t> LargeMap;
+
+  // Page number -> Bucket, open addressing. Empty slots have bucket == NULL.
+  struct PageSlot {
+    uintptr_t page;
+    Bucket *bucket;
+  };
+
+  static bool LessByPtr(const HeapInfo *a, const HeapInfo *b) {
+    return a->ptr < b->ptr;
+  }
+
   bool IsValidPtr(uintptr_t a) {
     return a != 0 && a != (uintptr_t) -1;
   }
+
   void Reset() {
-    // Insert a maximal and minimal possible values to make GetInfo simpler.
-    HeapInfo max_info;
-    memset(&max_info, 0, sizeof(HeapInfo));
-    max_info.ptr = (uintptr_t)-1;
-    map_[max_info.ptr] = max_info;
+    pages_capacity_ = kInitialPagesCapacity;
+    pages_ = new PageSlot[pages_capacity_];
+    memset(pages_, 0, pages_capacity_ * sizeof(PageSlot));
+  }
+
+  static bool IsSmall(const HeapInfo &info) {
+    return info.size <= (uintptr_t)kMaxSmallSize;
+  }
+  static uintptr_t FirstPage(const HeapInfo &info) {
+    return info.ptr >> kPageShift;
+  }
+  static uintptr_t LastPage(const HeapInfo &info) {
+    return (info.ptr + (info.size ? info.size - 1 : 0)) >> kPageShift;
+  }
+
+  static uintptr_t PageHash(uintptr_t page) {
+    uint64_t h = (uint64_t)page * 0x9E3779B97F4A7C15ULL;
+    return (uintptr_t)(h >> 32) ^ (uintptr_t)h;
+  }
+
+  uintptr_t FindSlot(uintptr_t page) {
+    uintptr_t mask = pages_capacity_ - 1;
+    uintptr_t i = PageHash(page) & mask;
+    while (pages_[i].bucket && pages_[i].page != page)
+      i = (i + 1) & mask;
+    return i;
+  }
 
-    HeapInfo min_info;
-    memset(&min_info, 0, sizeof(HeapInfo));
-    map_[min_info.ptr] = min_info;
+  Bucket *FindBucket(uintptr_t page) {
+    return pages_[FindSlot(page)].bucket;
   }
-  map_t map_;
+
+  Bucket *GetOrCreateBucket(uintptr_t page) {
+    uintptr_t i = FindSlot(page);
+    if (pages_[i].bucket) return pages_[i].bucket;
+    if ((n_pages_ + 1) * 2 > pages_capacity_) {
+      GrowPages();
+      i = FindSlot(page);
+    }
+    pages_[i].page = page;
+    pages_[i].bucket = new Bucket;
+    n_pages_++;
+    return pages_[i].bucket;
+  }
+
+  void GrowPages() {
+    PageSlot *old_pages = pages_;
+    uintptr_t old_capacity = pages_capacity_;
+    pages_capacity_ *= 2;
+    pages_ = new PageSlot[pages_capacity_];
+    memset(pages_, 0, pages_capacity_ * sizeof(PageSlot));
+    for (uintptr_t j = 0; j < old_capacity; j++) {
+      if (old_pages[j].bucket)
+        pages_[FindSlot(old_pages[j].page)] = old_pages[j];
+    }
+    delete [] old_pages;
+  }
+
+  // Removes an empty bucket; backward shift deletion keeps the probe
+  // sequences w/o tombstones.
+  void RemovePage(uintptr_t page) {
+    uintptr_t mask = pages_capacity_ - 1;
+    uintptr_t i = FindSlot(page);
+    CHECK(pages_[i].bucket);
+    delete pages_[i].bucket;
+    for (uintptr_t j = (i + 1) & mask; pages_[j].bucket; j = (j + 1) & mask) {
+      uintptr_t home = PageHash(pages_[j].page) & mask;
+      bool stays = (i <= j) ? (i < home && home <= j)
+                            : (i < home || home <= j);
+      if (stays) continue;
+      pages_[i] = pages_[j];
+      i = j;
+    }
+    pages_[i].bucket = NULL;
+    n_pages_--;
+  }
+
+  void BucketAdd(Bucket *b, int32_t idx) {
+    uintptr_t ptr = infos_[idx].ptr;
+    typename Bucket::iterator it = b->begin();
+    while (it != b->end() && infos_[*it].ptr < ptr)
+      ++it;
+    b->insert(it, idx);
+  }
+
+  void CollectStartingIn(Bucket *b, uintptr_t start, uintptr_t end,
+                         vector<int32_t> *res) {
+    if (!b) return;
+    for (size_t i = 0; i < b->size(); i++) {
+      uintptr_t ptr = infos_[(*b)[i]].ptr;
+      if (ptr >= start && ptr < end)
+        res->push_back((*b)[i]);
+    }
+  }
+
+  // Returns the index of the chunk with the largest ptr <= 'a' if that
+  // chunk starts at 'a' or contains it, -1 otherwise.
+  int32_t FindIdx(uintptr_t a) {
+    int32_t idx = -1;
+    if (Bucket *b = FindBucket(a >> kPageShift)) {
+      size_t lo = 0, hi = b->size();
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (infos_[(*b)[mid]].ptr <= a) lo = mid + 1;
+        else hi = mid;
+      }
+      if (lo > 0)
+        idx = (*b)[lo - 1];
+    }
+    if (!large_.empty()) {
+      typename LargeMap::iterator it = large_.upper_bound(a);
+      if (it != large_.begin()) {
+        --it;
+        if (idx < 0 || infos_[idx].ptr < it->first)
+          idx = it->second;
+      }
+    }
+    if (idx < 0) return -1;
+    HeapInfo *info = &infos_[idx];
+    if (info->ptr == a || info->ptr + info->size > a)
+      return idx;
+    return -1;
+  }
+
+  int32_t FindExact(uintptr_t a) {
+    int32_t idx = FindIdx(a);
+    return (idx >= 0 && infos_[idx].ptr == a) ? idx : -1;
+  }
+
+  void EraseIdx(int32_t idx) {
+    HeapInfo &info = infos_[idx];
+    if (IsSmall(info)) {
+      for (uintptr_t p = FirstPage(info); p <= LastPage(info); p++) {
+        Bucket *b = FindBucket(p);
+        CHECK(b);
+        b->erase(STD::find(b->begin(), b->end(), idx));
+        if (b->empty())
+          RemovePage(p);
+      }
+    } else {
+      large_.erase(info.ptr);
+    }
+    is_live_[idx] = false;
+    free_idx_.push_back(idx);
+  }
+
+  deque<HeapInfo> infos_;
+  vector<bool> is_live_;
+  vector<int32_t> free_idx_;
+  PageSlot *pages_;
+  uintptr_t n_pages_;
+  uintptr_t pages_capacity_;  // Always a power of two.
+  LargeMap large_;
 };
 
 #endif  // TS_HEAP_INFO_
@@ -0,0 +1,186 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_HISTORY_RING_
+#define TS_HISTORY_RING_
+
+#include "ts_util.h"
+
+// -------- HistoryRing ------ {{{1
+// The last 2^size_log routine calls, returns and top pc changes of a thread
+// (1 byte of type and a pc each), used by --history_ring instead of a stack
+// per segment: a segment keeps only Position() and the stack at it is
+// rebuilt by Replay() when a report needs it.
+//
+// The ring is split into kParts parts; the stack at the start of each part
+// is copied to a snapshot (the top kMaxFrames frames and the depth), so
+// Replay() goes over at most one part. A position the ring has already
+// overwritten can not be replayed.
+//
+// Only the owner thread writes. Replay() may run concurrently (reports are
+// printed from any thread); it checks that the part it has read was not
+// overwritten meanwhile, keeping one part of the ring as a margin.
+class HistoryRing {
+ public:
+  enum EntryType { CALL, RETURN, SET_TOP };
+  static const size_t kParts = 8;
+  static const size_t kMaxFrames = 64;
+
+  explicit HistoryRing(size_t size_log)
+    : size_log_(size_log),
+      part_log_(size_log - 3),  // kParts parts.
+      pos_(0) {
+    CHECK(size_log >= 6 && size_log < 31);
+    pcs_ = new uintptr_t[1 << size_log_];
+    types_ = new uint8_t[1 << size_log_];
+    memset(snapshots_, 0, sizeof(snapshots_));
+  }
+
+  ~HistoryRing() {
+    delete [] pcs_;
+    delete [] types_;
+  }
+
+  // Records an event. 'stack' is the call stack before the event, the
+  // bottom frame first.
+  void Add(EntryType type, uintptr_t pc,
+           const uintptr_t *stack, size_t depth) {
+    uint64_t pos = pos_;
+    if ((pos & ((1 << part_log_) - 1)) == 0)
+      TakeSnapshot(&snapshots_[(pos >> part_log_) % kParts], stack, depth);
+    size_t idx = pos & ((1 << size_log_) - 1);
+    pcs_[idx] = pc;
+    types_[idx] = type;
+    *(volatile uint64_t*)&pos_ = pos + 1;
+  }
+
+  // Forgets all the events, so that the ring can be given to another thread.
+  // The ids taken before must not be replayed afterwards.
+  void Clear() {
+    *(volatile uint64_t*)&pos_ = 0;
+  }
+
+  // The id of the current position, never 0. Ids wrap after 2^31 events,
+  // long after the ring has.
+  uint32_t Position() const {
+    return ((uint32_t)pos_ << 1) | 1;
+  }
+
+  // Puts up to 'max_size' top frames of the stack at 'id' to 'pcs', the top
+  // first. Returns the number of frames, 0 if the position is overwritten.
+  size_t Replay(uint32_t id, uintptr_t *pcs, size_t max_size) const {
+    uint64_t pos = LoadPos();
+    uint64_t delta = ((uint32_t)pos - (id >> 1)) & kIdMask;
+    if (delta > pos) return 0;
+    uint64_t p = pos - delta;
+    uint64_t part = p >> part_log_;
+    if ((part << part_log_) == pos) {
+      // The snapshot of this part is not taken yet, take the previous one.
+      if (part == 0) return 0;
+      part--;
+    }
+    if (!IsIntact(part, pos)) return 0;
+
+    uintptr_t frames[2 * kMaxFrames];
+    const Snapshot &snapshot = snapshots_[part % kParts];
+    size_t n = min(snapshot.n, (size_t)kMaxFrames);
+    memcpy(frames, snapshot.pcs, n * sizeof(uintptr_t));
+    size_t hidden = snapshot.depth - n;  // Frames below 'frames'.
+    for (uint64_t i = part << part_log_; i < p; i++) {
+      size_t idx = i & ((1 << size_log_) - 1);
+      uintptr_t pc = pcs_[idx];
+      switch (types_[idx]) {
+        case CALL:
+          if (n == 2 * kMaxFrames) {
+            memmove(frames, frames + kMaxFrames,
+                    kMaxFrames * sizeof(uintptr_t));
+            n -= kMaxFrames;
+            hidden += kMaxFrames;
+          }
+          frames[n++] = pc;
+          break;
+        case RETURN:
+          if (n) n--;
+          else if (hidden) hidden--;
+          break;
+        case SET_TOP:
+          if (n) {
+            frames[n - 1] = pc;
+          } else if (hidden) {
+            hidden--;
+            frames[n++] = pc;
+          }
+          break;
+      }
+    }
+    if (!IsIntact(part, LoadPos())) return 0;
+    size_t res = min(n, max_size);
+    for (size_t i = 0; i < res; i++)
+      pcs[i] = frames[n - i - 1];
+    return res;
+  }
+
+  size_t AllocatedBytes() const {
+    return sizeof(*this) + ((size_t)1 << size_log_) * (sizeof(uintptr_t) + 1);
+  }
+
+ private:
+  static const uint32_t kIdMask = (1U << 31) - 1;
+
+  struct Snapshot {
+    size_t depth;
+    size_t n;  // min(depth, (size_t)kMaxFrames)
+    uintptr_t pcs[kMaxFrames];  // The top n frames, the bottom one first.
+  };
+
+  static void TakeSnapshot(Snapshot *snapshot,
+                           const uintptr_t *stack, size_t depth) {
+    snapshot->depth = depth;
+    snapshot->n = min(depth, (size_t)kMaxFrames);
+    memcpy(snapshot->pcs, stack + depth - snapshot->n,
+           snapshot->n * sizeof(uintptr_t));
+  }
+
+  uint64_t LoadPos() const {
+    return *(volatile uint64_t*)&pos_;
+  }
+
+  // The part and its snapshot are there and will stay for some time.
+  bool IsIntact(uint64_t part, uint64_t pos) const {
+    return ((part + kParts - 1) << part_log_) >= pos;
+  }
+
+  size_t size_log_;
+  size_t part_log_;
+  uint64_t pos_;  // The number of events recorded.
+  uintptr_t *pcs_;
+  uint8_t *types_;
+  Snapshot snapshots_[kParts];
+};
+
+// end. {{{1
+#endif  // TS_HISTORY_RING_
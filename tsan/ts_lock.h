@@ -38,7 +38,8 @@
 #include "dynamic_annotations.h"
 
 //--------- Simple Lock ------------------ {{{1
-#if defined(TS_VALGRIND) || defined(TS_OFFLINE)
+// ts_offline needs the real locks only for --threaded_analysis.
+#if defined(TS_VALGRIND) || (defined(TS_OFFLINE) && TS_SERIALIZED == 1)
 class TSLock {
  public:
   void Lock() {};
@@ -83,6 +84,13 @@ ALWAYS_INLINE void ReleaseStore(uintptr_t *ptr, uintptr_t value) {
   *ptr = value;
 }
 
+ALWAYS_INLINE bool AtomicCompareAndSwap(uintptr_t *ptr, uintptr_t old_value,
+                                        uintptr_t new_value) {
+  if (*ptr != old_value) return false;
+  *ptr = new_value;
+  return true;
+}
+
 ALWAYS_INLINE int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
   return *ptr += 1;
 }
@@ -91,6 +99,10 @@ ALWAYS_INLINE int32_t NoBarrier_AtomicDecrement(int32_t* ptr) {
   return *ptr -= 1;
 }
 
+ALWAYS_INLINE int32_t NoBarrier_AtomicAdd(int32_t* ptr, int32_t value) {
+  return *ptr += value;
+}
+
 #elif defined(__GNUC__)
 
 ALWAYS_INLINE uintptr_t AtomicExchange(uintptr_t *ptr, uintptr_t new_value) {
@@ -102,6 +114,11 @@ ALWAYS_INLINE void ReleaseStore(uintptr_t *ptr, uintptr_t value) {
   *(volatile uintptr_t*)ptr = value;
 }
 
+ALWAYS_INLINE bool AtomicCompareAndSwap(uintptr_t *ptr, uintptr_t old_value,
+                                        uintptr_t new_value) {
+  return __sync_bool_compare_and_swap(ptr, old_value, new_value);
+}
+
 ALWAYS_INLINE int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
   return __sync_add_and_fetch(ptr, 1);
 }
@@ -110,11 +127,18 @@ ALWAYS_INLINE int32_t NoBarrier_AtomicDecrement(int32_t* ptr) {
   return __sync_sub_and_fetch(ptr, 1);
 }
 
+ALWAYS_INLINE int32_t NoBarrier_AtomicAdd(int32_t* ptr, int32_t value) {
+  return __sync_add_and_fetch(ptr, value);
+}
+
 #elif defined(_MSC_VER)
 uintptr_t AtomicExchange(uintptr_t *ptr, uintptr_t new_value);
 void ReleaseStore(uintptr_t *ptr, uintptr_t value);
+bool AtomicCompareAndSwap(uintptr_t *ptr, uintptr_t old_value,
+                          uintptr_t new_value);
 int32_t NoBarrier_AtomicIncrement(int32_t* ptr);
 int32_t NoBarrier_AtomicDecrement(int32_t* ptr);
+int32_t NoBarrier_AtomicAdd(int32_t* ptr, int32_t value);
 
 #else
 # error "unsupported configuration"
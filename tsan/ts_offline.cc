@@ -35,11 +35,19 @@
 // ------------- Includes ------------- {{{1
 #include "thread_sanitizer.h"
 #include "ts_events.h"
+#include "ts_packed_events.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if TS_SERIALIZED == 0
+# include <pthread.h>
+#endif
 
 // ------------- Globals ------------- {{{1
 static map<string, int> *g_event_type_map;
@@ -51,6 +59,8 @@ struct PcInfo {
 };
 
 static map<uintptr_t, PcInfo> *g_pc_info_map;
+// The pcs of the new '#PC' comments, collected for --input_type=pack.
+static vector<uintptr_t> *g_new_pcs;
 
 unsigned long offline_line_n;
 //------------- Read binary file Utils ------------ {{{1
@@ -127,6 +137,8 @@ static void SkipCommentText(FILE *file) {
       pc_info.file_name = file;
       pc_info.line = line;
       (*g_pc_info_map)[pc] = pc_info;
+      if (g_new_pcs)
+        g_new_pcs->push_back(pc);
       // Printf("***** PC %lx %s\n", pc, rtn);
     }
   }
@@ -301,6 +313,140 @@ static const uint32_t max_unknown_thread = 10000;
 
 static bool known_threads[max_unknown_thread] = {};
 
+//------------- Parallel replay ------------ {{{1
+// With --threaded_analysis (TS_SERIALIZED==0 only) the memory accesses
+// and the routine calls/exits, which ThreadSanitizer handles w/o the
+// global lock, are queued per thread: the events of thread T go to the
+// shard T % --num_analysis_threads. Any other event is a barrier: the
+// shards are first handled in parallel, one worker per shard, and then
+// the event itself. So each thread's events are still seen in the log
+// order and all synchronization is replayed in the log order.
+// The shards are per thread rather than per address since the handling
+// of an access updates the state of its thread.
+// The queued events are CompactEvents; an access which does not fit one
+// (e.g. a huge info) is handled like a barrier.
+class ParallelReplay {
+ public:
+  static void Init() {
+    if (!G_flags->threaded_analysis) return;
+    if (TS_SERIALIZED == 1) {
+      Report("WARNING: --threaded_analysis requires a TS_SERIALIZED=0 build, "
+             "ignoring\n");
+      G_flags->threaded_analysis = false;
+      return;
+    }
+#if TS_SERIALIZED == 0
+    n_shards_ = G_flags->num_analysis_threads;
+    shards_ = new vector<CompactEvent>[n_shards_];
+    pthread_barrier_init(&barrier_, NULL, n_shards_);
+    // The replaying thread handles the shard 0.
+    for (intptr_t i = 1; i < n_shards_; i++) {
+      pthread_t t;
+      CHECK(pthread_create(&t, NULL, Worker, (void*)i) == 0);
+    }
+#endif
+  }
+
+  static INLINE void HandleEvent(Event *event) {
+    if (!shards_) {
+      ThreadSanitizerHandleOneEvent(event);
+      return;
+    }
+    switch (event->type()) {
+      case READ:
+      case WRITE:
+      case RTN_CALL:
+      case RTN_EXIT:
+        if (!CompactEvent::Fits(*event)) break;
+        shards_[event->tid() % n_shards_].push_back(CompactEvent(*event));
+        if (++n_queued_ >= kMaxQueued)
+          Drain();
+        return;
+      default:
+        break;
+    }
+    Drain();
+    ThreadSanitizerHandleOneEvent(event);
+  }
+
+  static void Fini() {
+    if (!shards_) return;
+    Drain();
+#if TS_SERIALIZED == 0
+    exiting_ = true;
+    pthread_barrier_wait(&barrier_);
+#endif
+  }
+
+ private:
+  // Handles the queued events. The small batches do not pay off
+  // waking up the workers.
+  static void Drain() {
+    if (n_queued_ == 0) return;
+    if (n_queued_ < kMinParallel) {
+      for (intptr_t i = 0; i < n_shards_; i++)
+        HandleShard(i);
+    } else {
+#if TS_SERIALIZED == 0
+      pthread_barrier_wait(&barrier_);  // Start.
+      HandleShard(0);
+      pthread_barrier_wait(&barrier_);  // Done.
+#endif
+    }
+    n_queued_ = 0;
+  }
+
+  static void HandleShard(intptr_t i) {
+    vector<CompactEvent> &shard = shards_[i];
+    Event event;
+    for (size_t j = 0; j < shard.size(); j++) {
+      shard[j].Unpack(&event);
+      ThreadSanitizerHandleOneEvent(&event);
+    }
+    shard.clear();
+  }
+
+#if TS_SERIALIZED == 0
+  static void *Worker(void *arg) {
+    intptr_t i = (intptr_t)arg;
+    for (;;) {
+      pthread_barrier_wait(&barrier_);
+      if (exiting_) return NULL;
+      HandleShard(i);
+      pthread_barrier_wait(&barrier_);
+    }
+  }
+
+  static pthread_barrier_t barrier_;
+  static volatile bool exiting_;
+#endif
+
+  static const size_t kMaxQueued = 1 << 16;
+  static const size_t kMinParallel = 1 << 10;
+
+  static vector<CompactEvent> *shards_;
+  static intptr_t n_shards_;
+  static size_t n_queued_;
+};
+
+#if TS_SERIALIZED == 0
+pthread_barrier_t ParallelReplay::barrier_;
+volatile bool ParallelReplay::exiting_;
+#endif
+vector<CompactEvent> *ParallelReplay::shards_;
+intptr_t ParallelReplay::n_shards_;
+size_t ParallelReplay::n_queued_;
+
+static INLINE void ReplayEvent(Event *event) {
+  uint32_t tid = event->tid();
+  if (event->type() == THR_START && tid < max_unknown_thread) {
+    known_threads[tid] = true;
+  }
+  if (tid >= max_unknown_thread || known_threads[tid]) {
+    ParallelReplay::HandleEvent(event);
+  }
+}
+
 INLINE void ReadEventsFromFile(FILE *file, EventReader event_reader_cb) {
   Event event;
   uint64_t n_events = 0;
@@ -308,16 +454,103 @@ INLINE void ReadEventsFromFile(FILE *file, EventReader event_reader_cb) {
   while (event_reader_cb(file, &event)) {
     //event.Print();
     n_events++;
-    uint32_t tid = event.tid();
-    if (event.type() == THR_START && tid < max_unknown_thread) {
-      known_threads[tid] = true;
+    ReplayEvent(&event);
+  }
+  Printf("INFO: ThreadSanitizerOffline: %ld events read\n", n_events);
+}
+//------------- Packed event log ------------ {{{1
+// Converts the str events on 'input' into the packed format.
+// The '#PC' comments become PC_DESCRIPTION events, the '#>' ones are
+// printed right away, as when replaying.
+void PackEventsFromFile(FILE *input, FILE *output) {
+  g_new_pcs = new vector<uintptr_t>;
+  PackedEventWriter writer(output);
+  Event event;
+  uint64_t n_events = 0;
+  offline_line_n = 0;
+  while (ReadOneStrEventFromFile(input, &event)) {
+    for (size_t i = 0; i < g_new_pcs->size(); i++) {
+      uintptr_t pc = (*g_new_pcs)[i];
+      PcInfo &info = (*g_pc_info_map)[pc];
+      char descr[kBufSize];
+      int len = snprintf(descr, sizeof(descr), "%s %s %s %d",
+                         info.img_name.c_str(), info.rtn_name.c_str(),
+                         info.file_name.c_str(), info.line);
+      CHECK(len > 0 && len < kBufSize);
+      writer.Put(PC_DESCRIPTION, 0, pc, 0, 0, descr, len);
     }
-    if (tid >= max_unknown_thread || known_threads[tid]) {
-      ThreadSanitizerHandleOneEvent(&event);
+    g_new_pcs->clear();
+    writer.Put(event.type(), event.tid(), event.pc(), event.a(), event.info());
+    n_events++;
+  }
+  writer.Flush();
+  Printf("INFO: ThreadSanitizerOffline: %ld events packed\n", n_events);
+}
+
+static void HandlePackedString(const Event &event) {
+  string str((const char*)event.a(), event.info());
+  if (event.type() == PRINT_MESSAGE) {
+    Printf("%s\n", str.c_str());
+    return;
+  }
+  char img[kBufSize];
+  char rtn[kBufSize];
+  char file[kBufSize];
+  int line = 0;
+  if (str.size() < (size_t)kBufSize &&
+      sscanf(str.c_str(), "%s %s %s %d", img, rtn, file, &line) == 4 &&
+      event.pc() != 0) {
+    PcInfo pc_info;
+    pc_info.img_name = img;
+    pc_info.rtn_name = rtn;
+    pc_info.file_name = file;
+    pc_info.line = line;
+    (*g_pc_info_map)[event.pc()] = pc_info;
+  }
+}
+
+// Maps the whole file and feeds the decoded blocks to ThreadSanitizer.
+void ReadPackedEventsFromFile(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    Printf("Error: --input_type=packed needs a regular file on stdin\n");
+    exit(5);
+  }
+  size_t size = st.st_size;
+  void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (size && data == MAP_FAILED) {
+    Printf("Error: can not mmap the input (%d)\n", errno);
+    exit(5);
+  }
+  if (size)
+    madvise(data, size, MADV_SEQUENTIAL);
+  PackedEventDecoder decoder((const uint8_t*)data, size);
+  if (!decoder.ReadHeader()) {
+    Printf("Error: the input is not a packed event log of version %d\n",
+           kPackedEventsVersion);
+    exit(5);
+  }
+  Event *events = new Event[kPackedEventsMaxBlockEvents];
+  uint64_t n_events = 0;
+  offline_line_n = 0;
+  while (size_t n = decoder.ReadBlock(events)) {
+    for (size_t i = 0; i < n; i++) {
+      Event &event = events[i];
+      if (PackedEventHasString(event.type())) {
+        HandlePackedString(event);
+        continue;
+      }
+      ReplayEvent(&event);
     }
+    n_events += n;
+    offline_line_n = n_events;
   }
+  delete [] events;
+  if (size)
+    munmap(data, size);
   Printf("INFO: ThreadSanitizerOffline: %ld events read\n", n_events);
 }
+
 //------------- ThreadSanitizer exports ------------ {{{1
 
 void PcToStrings(uintptr_t pc, bool demangle,
@@ -356,6 +589,7 @@ int main(int argc, char *argv[]) {
   vector<string> args(argv + 1, argv + argc);
   ThreadSanitizerParseFlags(&args);
   ThreadSanitizerInit();
+  ParallelReplay::Init();
 
   CHECK(G_flags);
   if (G_flags->input_type == "bin") {
@@ -368,6 +602,17 @@ int main(int argc, char *argv[]) {
       output = stdout;
     }
     DecodeEventsFromFile(stdin, output);
+  } else if (G_flags->input_type == "pack") {
+    FILE* output = stdout;
+    if (G_flags->log_file.size() > 0) {
+      output = fopen(G_flags->log_file.c_str(), "wb");
+      CHECK(output);
+    }
+    PackEventsFromFile(stdin, output);
+    fclose(output);
+    return 0;
+  } else if (G_flags->input_type == "packed") {
+    ReadPackedEventsFromFile(fileno(stdin));
   } else if (G_flags->input_type == "str") {
     ReadEventsFromFile(stdin, ReadOneStrEventFromFile);
   } else {
@@ -375,6 +620,7 @@ int main(int argc, char *argv[]) {
     exit(5);
   }
 
+  ParallelReplay::Fini();
   ThreadSanitizerFini();
   if (G_flags->error_exitcode && GetNumberOfFoundErrors() > 0) {
     return G_flags->error_exitcode;
@@ -0,0 +1,267 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_PACKED_EVENTS_
+#define TS_PACKED_EVENTS_
+
+#include "ts_util.h"
+#include "ts_events.h"
+
+// -------- Packed event log ------ {{{1
+// A compact binary event log for ts_offline (--input_type=packed).
+//
+// The file starts with the 8-byte magic "TSANPACK" and a 32-bit version.
+// Then go the blocks, each decodable on its own:
+//   uint32 n_events, uint32 payload_size,
+//   uint8 n_types, n_types bytes: the EventTypes used in the block,
+//   payload: n_events events.
+// An event is the index of its type in the block's dictionary followed by
+// varints: tid, pc and a (both as zigzag deltas from the previous event of
+// the block) and info. PC_DESCRIPTION and PRINT_MESSAGE are followed by the
+// length and the bytes of their string; the decoder returns them as
+// {tid, pc, string, length}, the string is not 0-terminated.
+// The 32-bit numbers are little-endian.
+//
+// The decoder works on memory (e.g. an mmap-ed file) and does not copy it.
+
+static const char kPackedEventsMagic[8] = {'T','S','A','N','P','A','C','K'};
+static const uint32_t kPackedEventsVersion = 1;
+static const size_t kPackedEventsHeaderSize = 12;
+static const size_t kPackedEventsMaxBlockEvents = 4096;
+
+static INLINE bool PackedEventHasString(EventType type) {
+  return type == PC_DESCRIPTION || type == PRINT_MESSAGE;
+}
+
+static INLINE void PackedEventsPutUint32(uint8_t *p, uint32_t x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// Writes the file header, kPackedEventsHeaderSize bytes.
+static INLINE void PackedEventsPutHeader(uint8_t *p) {
+  memcpy(p, kPackedEventsMagic, sizeof(kPackedEventsMagic));
+  PackedEventsPutUint32(p + sizeof(kPackedEventsMagic), kPackedEventsVersion);
+}
+
+// Packs the events into a block in memory.
+class PackedEventEncoder {
+ public:
+  PackedEventEncoder()
+      : n_events_(0), n_types_(0), prev_pc_(0), prev_a_(0) {
+    memset(type_index_, 0xff, sizeof(type_index_));
+  }
+
+  size_t n_events() const { return n_events_; }
+  bool full() const { return n_events_ == kPackedEventsMaxBlockEvents; }
+
+  // The block must not be full.
+  void Put(EventType type, int32_t tid, uintptr_t pc, uintptr_t a,
+           uintptr_t info, const char *str = NULL, size_t str_len = 0) {
+    CHECK(type < LAST_EVENT);
+    DCHECK(!full());
+    if (type_index_[type] == 0xff) {
+      type_index_[type] = n_types_;
+      types_[n_types_++] = type;
+    }
+    payload_.push_back(type_index_[type]);
+    PutVarint((uint32_t)tid);
+    PutVarint(ZigZag(pc - prev_pc_));
+    PutVarint(ZigZag(a - prev_a_));
+    PutVarint(info);
+    if (PackedEventHasString(type)) {
+      PutVarint(str_len);
+      payload_.insert(payload_.end(), str, str + str_len);
+    }
+    prev_pc_ = pc;
+    prev_a_ = a;
+    n_events_++;
+  }
+
+  // Appends the block to 'out' and starts a new one.
+  void FinishBlock(vector<uint8_t> *out) {
+    if (n_events_ == 0) return;
+    size_t pos = out->size();
+    out->resize(pos + 9 + n_types_);
+    uint8_t *header = &(*out)[pos];
+    PackedEventsPutUint32(header, n_events_);
+    PackedEventsPutUint32(header + 4, payload_.size());
+    header[8] = n_types_;
+    memcpy(header + 9, types_, n_types_);
+    out->insert(out->end(), payload_.begin(), payload_.end());
+    payload_.clear();
+    for (size_t i = 0; i < n_types_; i++)
+      type_index_[types_[i]] = 0xff;
+    n_events_ = n_types_ = 0;
+    prev_pc_ = prev_a_ = 0;
+  }
+
+ private:
+  static uint64_t ZigZag(uintptr_t delta) {
+    int64_t d = (intptr_t)delta;
+    return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+  }
+
+  void PutVarint(uint64_t x) {
+    while (x >= 0x80) {
+      payload_.push_back((uint8_t)(x | 0x80));
+      x >>= 7;
+    }
+    payload_.push_back((uint8_t)x);
+  }
+
+  size_t n_events_;
+  uint8_t n_types_;
+  uint8_t type_index_[LAST_EVENT];  // 0xff if the type is not in types_.
+  uint8_t types_[LAST_EVENT];
+  vector<uint8_t> payload_;
+  uintptr_t prev_pc_;
+  uintptr_t prev_a_;
+};
+
+// Writes a whole packed event log to a file.
+class PackedEventWriter {
+ public:
+  explicit PackedEventWriter(FILE *out) : out_(out) {
+    uint8_t header[kPackedEventsHeaderSize];
+    PackedEventsPutHeader(header);
+    fwrite(header, 1, sizeof(header), out_);
+  }
+
+  ~PackedEventWriter() { Flush(); }
+
+  void Put(EventType type, int32_t tid, uintptr_t pc, uintptr_t a,
+           uintptr_t info, const char *str = NULL, size_t str_len = 0) {
+    encoder_.Put(type, tid, pc, a, info, str, str_len);
+    if (encoder_.full())
+      Flush();
+  }
+
+  void Flush() {
+    encoder_.FinishBlock(&block_);
+    if (block_.empty()) return;
+    fwrite(&block_[0], 1, block_.size(), out_);
+    block_.clear();
+  }
+
+ private:
+  FILE *out_;
+  PackedEventEncoder encoder_;
+  vector<uint8_t> block_;
+};
+
+class PackedEventDecoder {
+ public:
+  PackedEventDecoder(const uint8_t *data, size_t size)
+      : cur_(data), end_(data + size) { }
+
+  // Checks the magic and the version and skips the file header.
+  bool ReadHeader() {
+    if ((size_t)(end_ - cur_) < kPackedEventsHeaderSize ||
+        memcmp(cur_, kPackedEventsMagic, sizeof(kPackedEventsMagic)) != 0 ||
+        GetUint32(cur_ + 8) != kPackedEventsVersion)
+      return false;
+    cur_ += kPackedEventsHeaderSize;
+    return true;
+  }
+
+  // Decodes the next block into 'events', which should have room for
+  // kPackedEventsMaxBlockEvents events. Returns the number of the events,
+  // 0 at the end of the data. A broken block is reported and ends the data.
+  size_t ReadBlock(Event *events) {
+    if ((size_t)(end_ - cur_) < 9) return Broken(cur_ != end_);
+    size_t n_events = GetUint32(cur_);
+    size_t payload_size = GetUint32(cur_ + 4);
+    size_t n_types = cur_[8];
+    const uint8_t *types = cur_ + 9;
+    const uint8_t *p = types + n_types;
+    if (n_events > kPackedEventsMaxBlockEvents ||
+        p > end_ || payload_size > (size_t)(end_ - p))
+      return Broken(true);
+    const uint8_t *payload_end = p + payload_size;
+    uintptr_t pc = 0, a = 0;
+    for (size_t i = 0; i < n_events; i++) {
+      if (p >= payload_end || *p >= n_types) return Broken(true);
+      EventType type = (EventType)types[*p++];
+      uint64_t tid, pc_delta, a_delta, info;
+      if (!GetVarint(&p, payload_end, &tid) ||
+          !GetVarint(&p, payload_end, &pc_delta) ||
+          !GetVarint(&p, payload_end, &a_delta) ||
+          !GetVarint(&p, payload_end, &info))
+        return Broken(true);
+      pc += UnZigZag(pc_delta);
+      a += UnZigZag(a_delta);
+      uintptr_t ev_a = a;
+      if (PackedEventHasString(type)) {
+        if (!GetVarint(&p, payload_end, &info) ||
+            info > (uint64_t)(payload_end - p))
+          return Broken(true);
+        ev_a = (uintptr_t)p;
+        p += info;
+      }
+      events[i].Init(type, (int32_t)tid, pc, ev_a, info);
+    }
+    if (p != payload_end) return Broken(true);
+    cur_ = payload_end;
+    return n_events;
+  }
+
+ private:
+  static uint32_t GetUint32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  static uintptr_t UnZigZag(uint64_t x) {
+    return (uintptr_t)((x >> 1) ^ -(x & 1));
+  }
+
+  static INLINE bool GetVarint(const uint8_t **p, const uint8_t *end,
+                               uint64_t *res) {
+    uint64_t x = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+      uint8_t b = *(*p)++;
+      x |= (uint64_t)(b & 0x7f) << shift;
+      if (b < 0x80) {
+        *res = x;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t Broken(bool report) {
+    if (report)
+      Printf("ERROR: broken packed event log\n");
+    cur_ = end_;
+    return 0;
+  }
+
+  const uint8_t *cur_;
+  const uint8_t *end_;
+};
+
+// end. {{{1
+#endif  // TS_PACKED_EVENTS_
@@ -41,11 +41,15 @@
 #include "ts_lock.h"
 #include "ts_trace_info.h"
 #include "ts_race_verifier.h"
+#include "ts_shadow_stack.h"
+#include "ts_event_recorder.h"
+#include "ts_report_writer.h"
 #include "common_util.h"
 
 
 #if defined(__GNUC__)
 # include <cxxabi.h>  // __cxa_demangle
+# include <link.h>  // ElfW
 # define ATOMIC_READ(a) __sync_add_and_fetch(a, 0)
 
 #elif defined(_MSC_VER)
@@ -113,12 +117,6 @@ static unordered_set<uintptr_t> *g_windows_thread_pool_calback_set;
 static unordered_map<uintptr_t, uintptr_t> *g_windows_thread_pool_wait_object_map;
 #endif
 
-//--------------- StackFrame ----------------- {{{1
-struct StackFrame {
-  uintptr_t pc;
-  uintptr_t sp;
-  StackFrame(uintptr_t p, uintptr_t s) : pc(p), sp(s) { }
-};
 //--------------- InstrumentedCallFrame ----- {{{1
 // Machinery to implement the fast interceptors in PIN
 // (i.e. the ones that don't use PIN_CallApplicationFunction).
@@ -183,15 +181,39 @@ const size_t kThreadLocalEventBufferSize = 2048 - 2;
 // The number of mops should be at least 2 less than the size of TLEB
 // so that we have space to put SBLOCK_ENTER token and the trace_info ptr.
 const size_t kMaxMopsPerTrace = kThreadLocalEventBufferSize - 2;
+// With TS_SERIALIZED==1 a TLEB that gets full is doubled instead of being
+// flushed, up to this many words (4M on x86-64), see TLEBReserve().
+const size_t kMaxThreadLocalEventBufferSize = kThreadLocalEventBufferSize << 8;
 
 REG tls_reg;
 
+// With --call_coverage each thread collects the <call_site,call_target>
+// pairs it executes in a table of its own, a hash of the pair picks the
+// slot. The table is merged into the global set when a pair finds no free
+// slot, when the thread finishes and at the program end, see
+// CallCoverageFlush().
+const size_t kCallCoverageTableSize = 1024;  // Must be a power of two.
+const size_t kCallCoverageProbes = 4;
+
+struct CallCoverageTable {
+  pair<uintptr_t, uintptr_t> edges[kCallCoverageTableSize];  // {0,0} if free.
+  size_t size;
+};
+
+static void CallCoverageFlush(CallCoverageTable *table);
+
 struct PinThread;
 
 struct ThreadLocalEventBuffer {
   PinThread *t;
   size_t size;
-  uintptr_t events[kThreadLocalEventBufferSize];
+  // Must follow |t| and |size|, see OnTraceParallel().
+  uintptr_t inline_events[kThreadLocalEventBufferSize];
+  // Either |inline_events| or a heap buffer of |capacity| words.
+  uintptr_t *events;
+  size_t capacity;
+  // The previous heap buffer, if tls_reg may still point into it.
+  uintptr_t *retired_events;
 };
 
 struct PinThread {
@@ -205,7 +227,7 @@ struct PinThread {
   pthread_t    my_ptid;
   size_t       thread_stack_size_if_known;
   size_t       last_child_stack_size_if_known;
-  vector<StackFrame> shadow_stack;
+  ShadowStack shadow_stack;
   TraceInfo    *trace_info;
   int ignore_accesses;  // if > 0, ignore all memory accesses.
   int ignore_accesses_depth;
@@ -215,6 +237,8 @@ struct PinThread {
   bool         thread_done;
   bool         holding_lock;
   int          n_consumed_events;
+  PackedEventEncoder *record_buf;  // With --record_events.
+  CallCoverageTable *call_coverage;  // With --call_coverage.
 #ifdef _MSC_VER
   enum StartupState {
     STARTING,
@@ -229,6 +253,9 @@ struct PinThread {
 // Array of pin threads, indexed by pin's THREADID.
 static PinThread *g_pin_threads;
 
+// Not NULL with --record_events.
+static EventRecorder *g_recorder;
+
 // If true, ignore all accesses in all threads.
 extern bool global_ignore;
 
@@ -237,13 +264,11 @@ static unordered_set<pthread_t> *g_win_handles_which_are_threads;
 #endif
 
 //-------------------- ts_replace ------------------- {{{1
+// One event for the whole range: ThreadSanitizer handles accesses larger
+// than MopInfo::kMaxSize via HandleMemoryAccessRange().
 static void ReportAccesRange(THREADID tid, uintptr_t pc, EventType type, uintptr_t x, size_t size) {
   if (size && !g_pin_threads[tid].ignore_accesses) {
-    uintptr_t end = x + size;
-    for(uintptr_t a = x; a < end; a += 8) {
-      size_t cur_size = min((uintptr_t)8, end - a);
-      DumpEvent(0, type, tid, pc, a, cur_size);
-    }
+    DumpEvent(0, type, tid, pc, x, size);
   }
 }
 
@@ -252,6 +277,7 @@ static void ReportAccesRange(THREADID tid, uintptr_t pc, EventType type, uintptr
 
 #define EXTRA_REPLACE_PARAMS THREADID tid, uintptr_t pc,
 #define EXTRA_REPLACE_ARGS tid, pc,
+#define REPLACE_IS_NOT_INSTRUMENTED 1
 #include "ts_replace.h"
 
 //------------- ThreadSanitizer exports ------------ {{{1
@@ -304,6 +330,156 @@ string PcToRtnName(uintptr_t pc, bool demangle) {
   return res;
 }
 
+//--------------- Threaded analysis ----------------- {{{1
+// With --threaded_analysis (TS_SERIALIZED==0 only) a flushed trace is not
+// analyzed by the application thread. It is appended to the thread's
+// AnalysisQueue, a single-producer ring, along with its addresses, and
+// --num_analysis_threads internal Pin threads analyze the queued traces.
+// Worker #i is responsible for the queues i, i + n, i + 2n, ...; when
+// these are empty it steals work from the other queues. A queue is consumed
+// by at most one thread at a time, so the detector still sees the traces of
+// each thread in program order, and ThreadSanitizerHandleTrace() takes care
+// of the locking between the traces of different threads.
+// Every other event of a thread first drains its queue (see
+// AnalysisQueueBarrier()), so the synchronization events work as barriers.
+// The same protocol is used by tsan_rtl, see "Asynchronous trace analysis"
+// in tsan_rtl.cc.
+struct AnalysisQueue {
+  static const uintptr_t kSize = 1 << 15;  // Words, a power of two.
+  uintptr_t draining;  // 1 while someone is consuming the queue.
+  uintptr_t head;      // Written only by the owner.
+  uintptr_t tail;      // Written only by the consumer.
+  // A record is [uniq_tid, TraceInfo*, addresses...].
+  uintptr_t buf[kSize];
+  uintptr_t tleb[kThreadLocalEventBufferSize];  // The consumer's copy.
+};
+
+// Indexed by pin's THREADID. A queue is created when a thread with this
+// THREADID starts for the first time and is empty when the thread is done.
+static AnalysisQueue *g_analysis_queues[kMaxThreads];
+// 1 + the maximal THREADID having a queue.
+static uintptr_t g_n_analysis_queues;
+
+static INLINE uintptr_t AcquireLoad(uintptr_t *p) {
+  uintptr_t res = *(volatile uintptr_t*)p;
+#ifdef _MSC_VER
+  _ReadWriteBarrier();
+#else
+  __asm__ __volatile__("" : : : "memory");
+#endif
+  return res;
+}
+
+// Analyzes at most |max_records| records of |q|. If |wait| is false and the
+// queue is being drained by someone else, does nothing.
+// Returns the number of analyzed records.
+static uintptr_t AnalysisQueueDrain(AnalysisQueue *q, uintptr_t max_records,
+                                    bool wait) {
+  while (!AtomicCompareAndSwap(&q->draining, 0, 1)) {
+    if (!wait) return 0;
+    PIN_Yield();
+  }
+  const uintptr_t mask = AnalysisQueue::kSize - 1;
+  uintptr_t tail = q->tail;
+  uintptr_t head = AcquireLoad(&q->head);
+  uintptr_t n_records = 0;
+  for (; tail != head && n_records < max_records; n_records++) {
+    int32_t uniq_tid = (int32_t)q->buf[tail & mask];
+    TraceInfo *trace_info = (TraceInfo*)q->buf[(tail + 1) & mask];
+    size_t n = trace_info->n_mops();
+    for (size_t i = 0; i < n; i++)
+      q->tleb[i] = q->buf[(tail + 2 + i) & mask];
+    ThreadSanitizerHandleTrace(uniq_tid, trace_info, q->tleb);
+    tail += n + 2;
+    ReleaseStore(&q->tail, tail);
+  }
+  ReleaseStore(&q->draining, 0);
+  return n_records;
+}
+
+static INLINE void AnalysisQueuePush(PinThread &t, TraceInfo *trace_info,
+                                     uintptr_t *addresses) {
+  AnalysisQueue *q = g_analysis_queues[t.tid];
+  const uintptr_t mask = AnalysisQueue::kSize - 1;
+  size_t n = trace_info->n_mops();
+  uintptr_t head = q->head;
+  while (head + n + 2 - AcquireLoad(&q->tail) > AnalysisQueue::kSize) {
+    AnalysisQueueDrain(q, 1, /*wait=*/true);
+  }
+  q->buf[head & mask] = t.uniq_tid;
+  q->buf[(head + 1) & mask] = (uintptr_t)trace_info;
+  for (size_t i = 0; i < n; i++)
+    q->buf[(head + 2 + i) & mask] = addresses[i];
+  ReleaseStore(&q->head, head + n + 2);
+}
+
+// Called before an event of |t| other than a trace reaches ThreadSanitizer.
+// The application thread drains the rest of the queue itself rather than
+// waiting for a worker.
+static INLINE void AnalysisQueueBarrier(PinThread &t) {
+  AnalysisQueue *q = g_analysis_queues[t.tid];
+  if (LIKELY(q == NULL)) return;
+  if (AcquireLoad(&q->tail) == q->head) return;
+  AnalysisQueueDrain(q, ~(uintptr_t)0, /*wait=*/true);
+}
+
+static VOID AnalysisWorker(VOID *arg) {
+  uintptr_t idx = (uintptr_t)arg;
+  uintptr_t n_workers = G_flags->num_analysis_threads;
+  while (!PIN_IsProcessExiting()) {
+    uintptr_t n_records = 0;
+    uintptr_t n_queues = AcquireLoad(&g_n_analysis_queues);
+    for (uintptr_t i = idx; i < n_queues; i += n_workers) {
+      if (g_analysis_queues[i])
+        n_records += AnalysisQueueDrain(g_analysis_queues[i], 64, false);
+    }
+    if (n_records == 0) {
+      // Steal: the owner of our queues may be idle, others may be not.
+      for (uintptr_t i = 0; i < n_queues; i++) {
+        if (i % n_workers != idx && g_analysis_queues[i])
+          n_records += AnalysisQueueDrain(g_analysis_queues[i], 64, false);
+      }
+    }
+    if (n_records == 0)
+      PIN_Sleep(1);
+  }
+}
+
+static void StartAnalysisWorkers() {
+  if (!G_flags->threaded_analysis) return;
+  if (TS_SERIALIZED == 1) {
+    Report("WARNING: --threaded_analysis requires a TS_SERIALIZED=0 build, "
+           "ignoring\n");
+    G_flags->threaded_analysis = false;
+    return;
+  }
+  for (intptr_t i = 0; i < G_flags->num_analysis_threads; i++) {
+    PIN_THREAD_UID uid;
+    CHECK(PIN_SpawnInternalThread(AnalysisWorker, (VOID*)i, 0, &uid) !=
+          INVALID_THREADID);
+  }
+}
+
+// Called when a thread starts, before its first event.
+static void CreateAnalysisQueue(THREADID tid) {
+  if (!G_flags->threaded_analysis || g_analysis_queues[tid]) return;
+  AnalysisQueue *q = new AnalysisQueue;
+  memset(q, 0, sizeof(*q));
+  g_analysis_queues[tid] = q;
+  // Thread starts are serialized by pin.
+  if (tid + 1 > g_n_analysis_queues)
+    ReleaseStore(&g_n_analysis_queues, tid + 1);
+}
+
+// Waits until all the queued traces are analyzed.
+static void DrainAllAnalysisQueues() {
+  uintptr_t n_queues = AcquireLoad(&g_n_analysis_queues);
+  for (uintptr_t i = 0; i < n_queues; i++) {
+    if (g_analysis_queues[i])
+      AnalysisQueueDrain(g_analysis_queues[i], ~(uintptr_t)0, true);
+  }
+}
+
 //--------------- ThreadLocalEventBuffer ----------------- {{{1
 // thread local event buffer is an array of uintptr_t.
 // The events are encoded like this:
@@ -347,6 +523,16 @@ static bool DumpEventPlainText(EventType type, int32_t tid, uintptr_t pc,
             (long)pc, img_name.c_str(), rtn_name.c_str(),
             file_name.c_str(), line);
   }
+  if (type == SIGNAL_MANY || type == WAIT_MANY) {
+    // The text log has no arrays, dump the addresses one by one.
+    const uintptr_t *objs = (const uintptr_t*)a;
+    for (uintptr_t i = 0; i < info; i++) {
+      fprintf(log_file, "%s %x %lx %lx %lx\n",
+              kEventNames[type == SIGNAL_MANY ? SIGNAL : WAIT], tid,
+              (long)pc, (long)objs[i], 0L);
+    }
+    return true;
+  }
   fprintf(log_file, "%s %x %lx %lx %lx\n", kEventNames[type], tid,
           (long)pc, (long)a, (long)info);
   return true;
@@ -396,7 +582,8 @@ static void HandleInnerEvent(PinThread &t, uintptr_t event) {
 static INLINE bool WantToIgnoreEvent(PinThread &t, uintptr_t event) {
   if (t.ignore_sync &&
       (event == WRITER_LOCK || event == READER_LOCK || event == UNLOCK ||
-       event == SIGNAL || event == WAIT)) {
+       event == SIGNAL || event == WAIT ||
+       event == SIGNAL_MANY || event == WAIT_MANY)) {
     // do nothing, we are ignoring locks.
     return true;
   } else if (t.ignore_accesses && (event == READ || event == WRITE)) {
@@ -424,22 +611,116 @@ inline size_t ulog2(unsigned x) {
 }
 #endif
 
+// With --record_events the flushed events go to the EventRecorder instead
+// of ThreadSanitizer, see ts_event_recorder.h. The traces are recorded as
+// the READ and WRITE events of their accesses.
+static void TLEBRecord(PinThread &t, ThreadLocalEventBuffer &tleb) {
+  PackedEventEncoder *buf = t.record_buf;
+  DCHECK(buf);
+  size_t i;
+  for (i = 0; i < tleb.size; ) {
+    uintptr_t event = tleb.events[i++];
+    if (event == RTN_EXIT) {
+      g_recorder->Put(buf, RTN_EXIT, t.uniq_tid, 0, 0, 0);
+    } else if (event == RTN_CALL) {
+      uintptr_t call_pc = tleb.events[i++];
+      uintptr_t target_pc = tleb.events[i++];
+      uintptr_t ignore_below = tleb.events[i++];
+      g_recorder->Put(buf, RTN_CALL, t.uniq_tid, call_pc, target_pc,
+                      ignore_below);
+    } else if (event == SBLOCK_ENTER) {
+      TraceInfo *trace_info = (TraceInfo*) tleb.events[i++];
+      size_t n = trace_info->n_mops();
+      if (!t.ignore_accesses) {
+        for (size_t j = 0; j < n; j++) {
+          MopInfo *mop = trace_info->GetMop(j);
+          uintptr_t addr = tleb.events[i + j];
+          if (addr) {
+            g_recorder->Put(buf, mop->is_write() ? WRITE : READ, t.uniq_tid,
+                            mop->pc(), addr, mop->size());
+          }
+        }
+      }
+      i += n;
+    } else if (event == THR_START) {
+      uintptr_t parent = -1;
+      if (t.parent_tid != (THREADID)-1) {
+        parent = g_pin_threads[t.parent_tid].uniq_tid;
+      }
+      g_recorder->Put(buf, THR_START, t.uniq_tid, 0, 0, parent);
+    } else if (event == THR_END) {
+      g_recorder->Put(buf, THR_END, t.uniq_tid, 0, 0, 0);
+      t.thread_done = true;
+      i += 3;  // consume the unneeded data.
+      DCHECK(i == tleb.size);  // should be last event in this tleb.
+    } else if (event > LAST_EVENT) {
+      HandleInnerEvent(t, event);
+    } else {
+      CHECK(event > NOOP && event < LAST_EVENT);
+      uintptr_t pc    = tleb.events[i++];
+      uintptr_t a     = tleb.events[i++];
+      uintptr_t info  = tleb.events[i++];
+      if (!WantToIgnoreEvent(t, event)) {
+        g_recorder->Put(buf, (EventType)event, t.uniq_tid, pc, a, info);
+      }
+    }
+  }
+  DCHECK(i == tleb.size);
+  tleb.size = 0;
+}
+
+static VOID RecorderWorker(VOID *arg) {
+  while (!PIN_IsProcessExiting()) {
+    if (g_recorder->WriteSome() == 0)
+      PIN_Sleep(1);
+  }
+}
+
+static void StartRecorder() {
+  if (G_flags->record_events.empty()) return;
+  g_recorder = new EventRecorder;
+  if (!g_recorder->Init(G_flags->record_events, G_flags->record_compressor)) {
+    Report("ERROR: can not open %s\n", G_flags->record_events.c_str());
+    exit(1);
+  }
+  PIN_THREAD_UID uid;
+  CHECK(PIN_SpawnInternalThread(RecorderWorker, NULL, 0, &uid) !=
+        INVALID_THREADID);
+}
+
+// With --async_reports a background thread prints the reports queued in
+// G_report_writer, see ts_report_writer.h.
+static VOID ReportWriterWorker(VOID *arg) {
+  while (!PIN_IsProcessExiting()) {
+    if (G_report_writer->WriteSome() == 0)
+      PIN_Sleep(1);
+  }
+}
+
+static void StartReportWriter() {
+  if (!G_flags->async_reports) return;
+  G_report_writer = new ReportWriter(G_flags->max_queued_reports);
+  PIN_THREAD_UID uid;
+  CHECK(PIN_SpawnInternalThread(ReportWriterWorker, NULL, 0, &uid) !=
+        INVALID_THREADID);
+}
+
 static INLINE void TLEBFlushUnlocked(ThreadLocalEventBuffer &tleb) {
   if (tleb.size == 0) return;
   PinThread &t = *tleb.t;
   // global_ignore should be always on with race verifier
   DCHECK(!g_race_verifier_active || global_ignore);
-  DCHECK(tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(tleb.size <= tleb.capacity);
   if (TSAN_DEBUG && t.thread_done) {
     Printf("ACHTUNG!!! an event from a dead thread T%d\n", t.tid);
   }
   DCHECK(!t.thread_done);
 
   if (TS_SERIALIZED == 1 || TSAN_DEBUG) {
-    size_t max_idx = TS_ARRAY_SIZE(G_stats->tleb_flush);
+    size_t max_idx = TS_ARRAY_SIZE(G_stats->Shard()->tleb_flush);
     size_t idx = min(ulog2(tleb.size), max_idx - 1);
     CHECK(idx < max_idx);
-    G_stats->tleb_flush[idx]++;
+    G_stats->Shard()->tleb_flush[idx]++;
   }
 
   if (TS_SERIALIZED == 1 && G_flags->offline) {
@@ -448,11 +729,17 @@ static INLINE void TLEBFlushUnlocked(ThreadLocalEventBuffer &tleb) {
     return;
   }
 
+  if (g_recorder) {
+    TLEBRecord(t, tleb);
+    return;
+  }
+
   size_t i;
   for (i = 0; i < tleb.size; ) {
     uintptr_t event = tleb.events[i++];
     DCHECK(!g_race_verifier_active ||
         event == SBLOCK_ENTER || event == EXPECT_RACE || event == THR_START);
+    if (event != SBLOCK_ENTER) AnalysisQueueBarrier(t);
     if (event == RTN_EXIT) {
       if (DumpEventPlainText(RTN_EXIT, t.uniq_tid, 0, 0, 0)) continue;
       ThreadSanitizerHandleRtnExit(t.uniq_tid);
@@ -489,6 +776,8 @@ static INLINE void TLEBFlushUnlocked(ThreadLocalEventBuffer &tleb) {
                                      mop->pc(), addr, mop->size());
             }
           }
+        } else if (G_flags->threaded_analysis) {
+          AnalysisQueuePush(t, trace_info, tleb.events+i);
         } else {
           ThreadSanitizerHandleTrace(t.uniq_tid, trace_info, tleb.events+i);
         }
@@ -523,7 +812,7 @@ static INLINE void TLEBFlushUnlocked(ThreadLocalEventBuffer &tleb) {
   DCHECK(i == tleb.size);
   tleb.size = 0;
   if (TSAN_DEBUG) { // for sanity checking.
-    memset(tleb.events, 0xf0, sizeof(tleb.events));
+    memset(tleb.events, 0xf0, tleb.capacity * sizeof(uintptr_t));
   }
 }
 
@@ -533,15 +822,56 @@ static INLINE void TLEBFlushLocked(PinThread &t) {
     t.tleb.size = 0;
     return;
   }
-  CHECK(t.tleb.size <= kThreadLocalEventBufferSize);
-  G_stats->lock_sites[0]++;
+  CHECK(t.tleb.size <= t.tleb.capacity);
+  G_stats->Shard()->lock_sites[0]++;
   ScopedLock lock(&g_main_ts_lock);
   TLEBFlushUnlocked(t.tleb);
 #else
   TLEBFlushUnlocked(t.tleb);
+  // The caller is going to pass an event to ThreadSanitizer directly.
+  AnalysisQueueBarrier(t);
 #endif
 }
 
+static void TLEBFreeEvents(ThreadLocalEventBuffer &tleb, uintptr_t *events) {
+  if (events && events != tleb.inline_events) free(events);
+}
+
+// Doubles the capacity of |tleb| keeping its events.
+static NOINLINE void TLEBGrow(ThreadLocalEventBuffer &tleb) {
+  size_t capacity = tleb.capacity * 2;
+  uintptr_t *events = (uintptr_t*)malloc(capacity * sizeof(uintptr_t));
+  CHECK(events);
+  memcpy(events, tleb.events, tleb.size * sizeof(uintptr_t));
+  if (tleb.retired_events) {
+    // No trace has started since the last growth, so nobody points here.
+    TLEBFreeEvents(tleb, tleb.events);
+  } else {
+    // The mops of the last trace are written via tls_reg, which is updated
+    // when the next trace starts (see TLEBAddTrace()), so keep this buffer.
+    tleb.retired_events = tleb.events;
+  }
+  tleb.events = events;
+  tleb.capacity = capacity;
+  G_stats->Shard()->tleb_grow++;
+}
+
+// Makes room for |n| more events in the TLEB of |t|.
+// With TS_SERIALIZED==1 the buffer grows rather than gets flushed, so that it
+// is flushed mostly at the synchronization events (which flush the TLEB
+// anyway) instead of every few hundred calls.
+static INLINE void TLEBReserve(PinThread &t, size_t n) {
+  DCHECK(n <= kThreadLocalEventBufferSize);
+  if (LIKELY(t.tleb.size + n <= t.tleb.capacity)) return;
+  if (TS_SERIALIZED == 1 &&
+      t.tleb.capacity * 2 <= kMaxThreadLocalEventBufferSize) {
+    TLEBGrow(t.tleb);
+    return;
+  }
+  TLEBFlushLocked(t);
+  DCHECK(t.tleb.size == 0);
+}
+
 static void TLEBAddRtnCall(PinThread &t, uintptr_t call_pc,
                            uintptr_t target_pc, IGNORE_BELOW_RTN ignore_below) {
   if (TS_SERIALIZED == 0) {
@@ -550,16 +880,13 @@ static void TLEBAddRtnCall(PinThread &t, uintptr_t call_pc,
                                  ignore_below);
     return;
   }
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
-  if (t.tleb.size + 4 > kThreadLocalEventBufferSize) {
-    TLEBFlushLocked(t);
-    DCHECK(t.tleb.size == 0);
-  }
+  DCHECK(t.tleb.size <= t.tleb.capacity);
+  TLEBReserve(t, 4);
   t.tleb.events[t.tleb.size++] = RTN_CALL;
   t.tleb.events[t.tleb.size++] = call_pc;
   t.tleb.events[t.tleb.size++] = target_pc;
   t.tleb.events[t.tleb.size++] = ignore_below;
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(t.tleb.size <= t.tleb.capacity);
 }
 
 static void TLEBAddRtnExit(PinThread &t) {
@@ -568,20 +895,19 @@ static void TLEBAddRtnExit(PinThread &t) {
     ThreadSanitizerHandleRtnExit(t.uniq_tid);
     return;
   }
-  if (t.tleb.size + 1 > kThreadLocalEventBufferSize) {
-    TLEBFlushLocked(t);
-  }
+  TLEBReserve(t, 1);
   t.tleb.events[t.tleb.size++] = RTN_EXIT;
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(t.tleb.size <= t.tleb.capacity);
 }
 
 static INLINE uintptr_t *TLEBAddTrace(PinThread &t) {
   size_t n = t.trace_info->n_mops();
   DCHECK(n > 0);
   if (TS_SERIALIZED == 0) {
-    TLEBFlushLocked(t);
-  } else if (t.tleb.size + 2 + n > kThreadLocalEventBufferSize) {
-    TLEBFlushLocked(t);
+    // No barrier: the previous trace may stay in the analysis queue.
+    TLEBFlushUnlocked(t.tleb);
+  } else {
+    TLEBReserve(t, 2 + n);
   }
   if (TS_SERIALIZED == 1) {
     t.tleb.events[t.tleb.size++] = SBLOCK_ENTER;
@@ -593,12 +919,17 @@ static INLINE uintptr_t *TLEBAddTrace(PinThread &t) {
     t.tleb.size += 2;
   }
   uintptr_t *mop_addresses = &t.tleb.events[t.tleb.size];
+  // The caller points tls_reg to |mop_addresses|.
+  if (t.tleb.retired_events) {
+    TLEBFreeEvents(t.tleb, t.tleb.retired_events);
+    t.tleb.retired_events = NULL;
+  }
   // not every address will be written to. so they will stay 0.
   for (size_t i = 0; i < n; i++) {
     mop_addresses[i] = 0;
   }
   t.tleb.size += n;
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(t.tleb.size <= t.tleb.capacity);
   return mop_addresses;
 }
 
@@ -620,16 +951,15 @@ static void TLEBSimpleEvent(PinThread &t, uintptr_t event) {
     }
     return;
   }
-  if (t.tleb.size + 1 > kThreadLocalEventBufferSize) {
-    TLEBFlushLocked(t);
-  }
+  TLEBReserve(t, 1);
   t.tleb.events[t.tleb.size++] = event;
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(t.tleb.size <= t.tleb.capacity);
 }
 
-static void TLEBAddGenericEventAndFlush(PinThread &t,
-                                        EventType type, uintptr_t pc,
-                                        uintptr_t a, uintptr_t info) {
+// With TS_SERIALIZED==1 the event is handled with the next flush of the TLEB.
+static void TLEBAddGenericEvent(PinThread &t,
+                                EventType type, uintptr_t pc,
+                                uintptr_t a, uintptr_t info) {
   if (TS_SERIALIZED == 0) {
     if (WantToIgnoreEvent(t, type)) return;
     TLEBFlushLocked(t);
@@ -637,16 +967,21 @@ static void TLEBAddGenericEventAndFlush(PinThread &t,
     ThreadSanitizerHandleOneEvent(&e);
     return;
   }
-  if (t.tleb.size + 4 > kThreadLocalEventBufferSize) {
-    TLEBFlushLocked(t);
-  }
+  TLEBReserve(t, 4);
   DCHECK(type > NOOP && type < LAST_EVENT);
   t.tleb.events[t.tleb.size++] = type;
   t.tleb.events[t.tleb.size++] = pc;
   t.tleb.events[t.tleb.size++] = a;
   t.tleb.events[t.tleb.size++] = info;
-  TLEBFlushLocked(t);
-  DCHECK(t.tleb.size <= kThreadLocalEventBufferSize);
+  DCHECK(t.tleb.size <= t.tleb.capacity);
+}
+
+static void TLEBAddGenericEventAndFlush(PinThread &t,
+                                        EventType type, uintptr_t pc,
+                                        uintptr_t a, uintptr_t info) {
+  TLEBAddGenericEvent(t, type, pc, a, info);
+  if (TS_SERIALIZED == 1)
+    TLEBFlushLocked(t);
 }
 
 static void UpdateCallStack(PinThread &t, ADDRINT sp);
@@ -881,10 +1216,14 @@ static void ShowPcAndSp(const char *where, THREADID tid,
 }
 
 static void PrintShadowStack(PinThread &t) {
-  Printf("T%d Shadow stack (%d)\n", t.tid, (int)t.shadow_stack.size());
-  for (int i = t.shadow_stack.size() - 1; i >= 0; i--) {
-    uintptr_t pc = t.shadow_stack[i].pc;
-    uintptr_t sp = t.shadow_stack[i].sp;
+  size_t size = t.shadow_stack.size();
+  Printf("T%d Shadow stack (%d)\n", t.tid, (int)size);
+  vector<uintptr_t> pcs(size), sps(size);
+  if (size)
+    t.shadow_stack.GetFrames(&pcs[0], &sps[0]);
+  for (int i = size - 1; i >= 0; i--) {
+    uintptr_t pc = pcs[i];
+    uintptr_t sp = sps[i];
     Printf("  sp=%ld pc=%lx %s\n", sp, pc, PcToRtnName(pc, true).c_str());
   }
 }
@@ -1072,18 +1411,31 @@ void CallbackForThreadStart(THREADID tid, CONTEXT *ctxt,
 
   CHECK(tid < kMaxThreads);
   PinThread &t = g_pin_threads[tid];
+  // The previous thread with this THREADID is done with its buffers.
+  TLEBFreeEvents(t.tleb, t.tleb.events);
+  TLEBFreeEvents(t.tleb, t.tleb.retired_events);
+  // So is the previous thread's record buffer, which is empty after THR_END.
+  PackedEventEncoder *record_buf = t.record_buf;
+  // And with its call coverage table, which was flushed at its fini.
+  CallCoverageTable *call_coverage = t.call_coverage;
   memset(&t, 0, sizeof(PinThread));
+  if (g_recorder)
+    t.record_buf = record_buf ? record_buf : new PackedEventEncoder;
+  t.call_coverage = call_coverage;
   t.uniq_tid = n_started_threads++;
   t.literace_sampling = G_flags->literace_sampling;
   t.tid = tid;
   t.tleb.t = &t;
+  t.tleb.events = t.tleb.inline_events;
+  t.tleb.capacity = kThreadLocalEventBufferSize;
+  CreateAnalysisQueue(tid);
 #if defined(_MSC_VER)
   t.startup_state = PinThread::STARTING;
 #endif
   ComputeIgnoreAccesses(t);
 
 
-  PIN_SetContextReg(ctxt, tls_reg, (ADDRINT)&t.tleb.events[2]);
+  PIN_SetContextReg(ctxt, tls_reg, (ADDRINT)&t.tleb.inline_events[2]);
 
   t.parent_tid = -1;
   if (has_parent) {
@@ -1259,6 +1611,8 @@ void CallbackForThreadFini(THREADID tid, const CONTEXT *ctxt,
                           INT32 code, void *v) {
   PinThread &t = g_pin_threads[tid];
   t.thread_finished = true;
+  if (t.call_coverage)
+    CallCoverageFlush(t.call_coverage);
   // We can not DumpEvent here,
   // due to possible deadlock with PIN's internal lock.
   if (debug_thread) {
@@ -1707,6 +2061,13 @@ uintptr_t WRAP_NAME(HeapCreate)(WRAP_PARAM4) {
 // it can't be compiled here for some reason.
 #define WAIT_OBJECT_0_ 0
 
+// If |handle| is a handle of a thread, forgets it and returns true.
+static bool EraseWinThreadHandle(uintptr_t handle) {
+  ScopedReentrantClientLock lock(__LINE__);
+  if (!g_win_handles_which_are_threads) return false;
+  return g_win_handles_which_are_threads->erase(handle) > 0;
+}
+
 uintptr_t WRAP_NAME(WaitForSingleObjectEx)(WRAP_PARAM4) {
   if (G_flags->verbosity >= 1) {
     ShowPcAndSp(__FUNCTION__, tid, pc, 0);
@@ -1718,15 +2079,7 @@ uintptr_t WRAP_NAME(WaitForSingleObjectEx)(WRAP_PARAM4) {
   //Printf("T%d after pc=%p %s: %p\n", tid, pc, __FUNCTION__+8, arg0, arg1);
 
   if (ret == WAIT_OBJECT_0_) {
-    bool is_thread_handle = false;
-    {
-      ScopedReentrantClientLock lock(__LINE__);
-      if (g_win_handles_which_are_threads) {
-        is_thread_handle = g_win_handles_which_are_threads->count(arg0) > 0;
-        g_win_handles_which_are_threads->erase(arg0);
-      }
-    }
-    if (is_thread_handle)
+    if (EraseWinThreadHandle(arg0))
       HandleThreadJoinAfter(tid, arg0);
     DumpEvent(ctx, WAIT, tid, pc, arg0, 0);
   }
@@ -1758,15 +2111,7 @@ uintptr_t WRAP_NAME(WaitForMultipleObjectsEx)(WRAP_PARAM6) {
 
     for (int i = start_id; i < start_id + count; i++) {
       uintptr_t handle = ((uintptr_t*)arg1)[i];
-      bool is_thread_handle = false;
-      {
-        ScopedReentrantClientLock lock(__LINE__);
-        if (g_win_handles_which_are_threads) {
-          is_thread_handle = g_win_handles_which_are_threads->count(handle) > 0;
-          g_win_handles_which_are_threads->erase(handle);
-        }
-      }
-      if (is_thread_handle)
+      if (EraseWinThreadHandle(handle))
         HandleThreadJoinAfter(tid, handle);
       DumpEvent(ctx, WAIT, tid, pc, handle, 0);
     }
@@ -1775,6 +2120,125 @@ uintptr_t WRAP_NAME(WaitForMultipleObjectsEx)(WRAP_PARAM6) {
   return ret;
 }
 
+//--------- Fast paths for the locks ------------------ {{{2
+// With --fast_win_locks the critical sections, the SRW locks and
+// WaitForSingleObjectEx are not replaced (PIN_CallApplicationFunction is
+// expensive): an analysis routine at the entry and the fast interceptor
+// machinery at the return (see InstrumentedCallFrame) put their events to
+// the TLEB. An acquisition is only queued, it is handled with the next
+// flush together with the accesses of the thread. A release is flushed when
+// the lock may change hands, so that the acquisition by the next owner
+// can't be handled before it.
+
+// RTL_CRITICAL_SECTION (winnt.h can't be compiled here either).
+struct RtlCriticalSectionLayout {
+  void *debug_info;
+  long lock_count;
+  long recursion_count;
+  void *owning_thread;
+  void *lock_semaphore;
+  uintptr_t spin_count;
+};
+
+static void QueueEventWithSp(uintptr_t sp, EventType type, THREADID tid,
+                             uintptr_t pc, uintptr_t a, uintptr_t info) {
+  if (g_race_verifier_active) return;
+  PinThread &t = g_pin_threads[tid];
+  UpdateCallStack(t, sp);
+  TLEBAddGenericEvent(t, type, pc, a, info);
+}
+
+static void QueueReleaseAndMaybeFlush(FAST_WRAP_PARAM1, bool last_release) {
+  QueueEventWithSp(sp, UNLOCK, tid, pc, arg0, 0);
+  if (last_release && !g_race_verifier_active)
+    TLEBFlushLocked(g_pin_threads[tid]);
+}
+
+static void After_RtlEnterCriticalSection(FAST_WRAP_PARAM_AFTER) {
+  QueueEventWithSp(frame.sp, WRITER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlEnterCriticalSection(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlEnterCriticalSection, arg0);
+}
+
+static void After_RtlTryEnterCriticalSection(FAST_WRAP_PARAM_AFTER) {
+  if (ret)
+    QueueEventWithSp(frame.sp, WRITER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlTryEnterCriticalSection(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlTryEnterCriticalSection, arg0);
+}
+
+static void Before_RtlLeaveCriticalSection(FAST_WRAP_PARAM1) {
+  // A recursive critical section stays with us until the last leave.
+  RtlCriticalSectionLayout *cs = (RtlCriticalSectionLayout*)arg0;
+  QueueReleaseAndMaybeFlush(tid, pc, sp, arg0, cs->recursion_count <= 1);
+}
+
+static void After_RtlAcquireSRWLockExclusive(FAST_WRAP_PARAM_AFTER) {
+  QueueEventWithSp(frame.sp, WRITER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlAcquireSRWLockExclusive(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlAcquireSRWLockExclusive, arg0);
+}
+
+static void After_RtlAcquireSRWLockShared(FAST_WRAP_PARAM_AFTER) {
+  QueueEventWithSp(frame.sp, READER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlAcquireSRWLockShared(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlAcquireSRWLockShared, arg0);
+}
+
+static void After_RtlTryAcquireSRWLockExclusive(FAST_WRAP_PARAM_AFTER) {
+  if (ret & 0xFF)  // See WRAP_NAME(RtlTryAcquireSRWLockExclusive).
+    QueueEventWithSp(frame.sp, WRITER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlTryAcquireSRWLockExclusive(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlTryAcquireSRWLockExclusive, arg0);
+}
+
+static void After_RtlTryAcquireSRWLockShared(FAST_WRAP_PARAM_AFTER) {
+  if (ret & 0xFF)
+    QueueEventWithSp(frame.sp, READER_LOCK, tid, frame.pc, frame.arg[0], 0);
+}
+
+static void Before_RtlTryAcquireSRWLockShared(FAST_WRAP_PARAM1) {
+  PUSH_AFTER_CALLBACK1(After_RtlTryAcquireSRWLockShared, arg0);
+}
+
+static void Before_RtlReleaseSRWLockExclusive(FAST_WRAP_PARAM1) {
+  QueueReleaseAndMaybeFlush(tid, pc, sp, arg0, true);
+}
+
+static void Before_RtlReleaseSRWLockShared(FAST_WRAP_PARAM1) {
+  // We can't tell if other readers still hold it.
+  QueueReleaseAndMaybeFlush(tid, pc, sp, arg0, true);
+}
+
+static void After_WaitForSingleObjectEx(FAST_WRAP_PARAM_AFTER) {
+  if (ret != WAIT_OBJECT_0_) return;
+  uintptr_t handle = frame.arg[0];
+  if (EraseWinThreadHandle(handle)) {
+    HandleThreadJoinAfter(tid, handle);
+    DumpEventWithSp(frame.sp, WAIT, tid, frame.pc, handle, 0);
+    return;
+  }
+  QueueEventWithSp(frame.sp, WAIT, tid, frame.pc, handle, 0);
+}
+
+static void Before_WaitForSingleObjectEx(FAST_WRAP_PARAM1) {
+  if (G_flags->verbosity >= 1) {
+    ShowPcAndSp(__FUNCTION__, tid, pc, 0);
+    Printf("arg0=%lx\n", arg0);
+  }
+  PUSH_AFTER_CALLBACK1(After_WaitForSingleObjectEx, arg0);
+}
+
 #endif  // _MSC_VER
 
 //--------- memory allocation ---------------------- {{{2
@@ -1878,11 +2342,12 @@ uintptr_t WRAP_NAME(free)(WRAP_PARAM4) { CHECK(0); }
 
 //-------- Routines and stack ---------------------- {{{2
 static INLINE void UpdateCallStack(PinThread &t, ADDRINT sp) {
-  while (t.shadow_stack.size() > 0 && sp >= t.shadow_stack.back().sp) {
+  size_t n = t.shadow_stack.Unwind(sp);
+  if (LIKELY(n == 0)) return;
+  CHECK(t.shadow_stack.size() < 1000000);  // stay sane.
+  for (; n > 0; n--) {
     TLEBAddRtnExit(t);
-    size_t size = t.shadow_stack.size();
-    CHECK(size < 1000000);  // stay sane.
-    uintptr_t popped_pc = t.shadow_stack.back().pc;
+    uintptr_t popped_pc = t.shadow_stack.top_pc();
 #ifdef _MSC_VER
     // h-b edge from here to UnregisterWaitEx.
     CHECK(g_windows_thread_pool_calback_set);
@@ -1895,8 +2360,7 @@ static INLINE void UpdateCallStack(PinThread &t, ADDRINT sp) {
     if (debug_rtn) {
       ShowPcAndSp("RET : ", t.tid, popped_pc, sp);
     }
-    t.shadow_stack.pop_back();
-    CHECK(size - 1 == t.shadow_stack.size());
+    t.shadow_stack.Pop();
     if (DEB_PR) {
       Printf("POP SHADOW STACK\n");
       PrintShadowStack(t);
@@ -1916,7 +2380,7 @@ void InsertBeforeEvent_Call(THREADID tid, ADDRINT pc, ADDRINT target,
   DebugOnlyShowPcAndSp(__FUNCTION__, t.tid, pc, sp);
   UpdateCallStack(t, sp);
   TLEBAddRtnCall(t, pc, target, ignore_below);
-  t.shadow_stack.push_back(StackFrame(target, sp));
+  t.shadow_stack.Push(target, sp);
   if (DEB_PR) {
     PrintShadowStack(t);
   }
@@ -1933,7 +2397,7 @@ void InsertBeforeEvent_Call(THREADID tid, ADDRINT pc, ADDRINT target,
 #endif
 }
 
-static void OnTraceSerial(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
+static void PIN_FAST_ANALYSIS_CALL OnTraceSerial(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
     uintptr_t **tls_reg_p) {
   PinThread &t = g_pin_threads[tid];
 
@@ -1948,7 +2412,7 @@ static void OnTraceSerial(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
   *tls_reg_p = TLEBAddTrace(t);
 }
 
-static void OnTraceParallel(uintptr_t *tls_reg, ADDRINT sp, TraceInfo *trace_info) {
+static void PIN_FAST_ANALYSIS_CALL OnTraceParallel(uintptr_t *tls_reg, ADDRINT sp, TraceInfo *trace_info) {
   // Get the thread handler directly from tls_reg.
   PinThread &t = *(PinThread*)(tls_reg - 4);
   t.trace_info = trace_info;
@@ -1971,6 +2435,9 @@ static void OnTraceParallel(uintptr_t *tls_reg, ADDRINT sp, TraceInfo *trace_inf
 static void OnTraceVerifyInternal(PinThread &t, uintptr_t **tls_reg_p) {
   DCHECK(g_race_verifier_active);
   if (t.trace_info) {
+    int sleep_ms = G_flags->race_verifier_adaptive ?
+        RaceVerifierGetSleepTime(t.uniq_tid, t.trace_info->pc()) :
+        G_flags->race_verifier_sleep_ms;
     int need_sleep = 0;
     for (unsigned i = 0; i < t.trace_info->n_mops(); ++i) {
       uintptr_t addr = (*tls_reg_p)[i];
@@ -1984,7 +2451,8 @@ static void OnTraceVerifyInternal(PinThread &t, uintptr_t **tls_reg_p) {
     if (!need_sleep)
       return;
 
-    usleep(G_flags->race_verifier_sleep_ms * 1000);
+    if (sleep_ms)
+      usleep(sleep_ms * 1000);
 
     for (unsigned i = 0; i < t.trace_info->n_mops(); ++i) {
       uintptr_t addr = (*tls_reg_p)[i];
@@ -1996,7 +2464,7 @@ static void OnTraceVerifyInternal(PinThread &t, uintptr_t **tls_reg_p) {
   }
 }
 
-static void OnTraceNoMopsVerify(THREADID tid, ADDRINT sp,
+static void PIN_FAST_ANALYSIS_CALL OnTraceNoMopsVerify(THREADID tid, ADDRINT sp,
     uintptr_t **tls_reg_p) {
   PinThread &t = g_pin_threads[tid];
   DCHECK(g_race_verifier_active);
@@ -2004,7 +2472,7 @@ static void OnTraceNoMopsVerify(THREADID tid, ADDRINT sp,
   t.trace_info = NULL;
 }
 
-static void OnTraceVerify(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
+static void PIN_FAST_ANALYSIS_CALL OnTraceVerify(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
     uintptr_t **tls_reg_p) {
   DCHECK(g_race_verifier_active);
   PinThread &t = g_pin_threads[tid];
@@ -2024,16 +2492,22 @@ static void OnTraceVerify(THREADID tid, ADDRINT sp, TraceInfo *trace_info,
 // 'a' is the actuall address.
 // 'tid' is thread ID, used only in debug mode.
 //
-// In opt mode this is just one instruction! Something like this:
+// The TLEB space for all the mops of a trace is reserved at the trace entry,
+// so the mop callbacks have no bounds checks and no PinThread lookup.
+// In opt mode we use OnMopFast which Pin inlines into the trace; it is just
+// one instruction! Something like this:
 // mov %rcx,(%rdi,%rdx,8)
-static void OnMop(uintptr_t *addr, THREADID tid, ADDRINT idx, ADDRINT a) {
+// Predicated mops use the same callbacks via INS_InsertPredicatedCall:
+// if the predicate is false the slot stays 0.
+static void PIN_FAST_ANALYSIS_CALL OnMop(uintptr_t *addr, THREADID tid,
+                                         ADDRINT idx, ADDRINT a) {
   if (TSAN_DEBUG) {
     PinThread &t= g_pin_threads[tid];
     CHECK(idx < kMaxMopsPerTrace);
     CHECK(idx < t.trace_info->n_mops());
     uintptr_t *ptr = addr + idx;
     CHECK(ptr >= t.tleb.events);
-    CHECK(ptr < t.tleb.events + kThreadLocalEventBufferSize);
+    CHECK(ptr < t.tleb.events + t.tleb.capacity);
     if (a == G_flags->trace_addr) {
       Printf("T%d %s %lx\n", t.tid, __FUNCTION__, a);
     }
@@ -2041,18 +2515,18 @@ static void OnMop(uintptr_t *addr, THREADID tid, ADDRINT idx, ADDRINT a) {
   addr[idx] = a;
 }
 
-static void On_PredicatedMop(BOOL is_running, uintptr_t *addr,
-                             THREADID tid, ADDRINT idx, ADDRINT a) {
-  if (is_running) {
-    OnMop(addr, tid, idx, a);
-  }
+static void PIN_FAST_ANALYSIS_CALL OnMopFast(uintptr_t *addr, ADDRINT idx,
+                                             ADDRINT a) {
+  addr[idx] = a;
 }
 
-static void OnMopCheckIdentStoreBefore(uintptr_t *addr, THREADID tid, ADDRINT idx, ADDRINT a) {
+static void PIN_FAST_ANALYSIS_CALL OnMopCheckIdentStoreBefore(
+    uintptr_t *addr, ADDRINT idx, ADDRINT a) {
   // Write the value of *a to tleb.
   addr[idx] = *(uintptr_t*)a;
 }
-static void OnMopCheckIdentStoreAfter(uintptr_t *addr, THREADID tid, ADDRINT idx, ADDRINT a) {
+static void PIN_FAST_ANALYSIS_CALL OnMopCheckIdentStoreAfter(
+    uintptr_t *addr, ADDRINT idx, ADDRINT a) {
   // Check if the previous value of *a is equal to the new one.
   // If not, we have a regular memory access. If yes, we have an ident operation,
   // which we want to ignore.
@@ -2329,6 +2803,18 @@ static void On_AnnotateFlushState(THREADID tid, ADDRINT pc,
   DumpEvent(0, FLUSH_STATE, tid, pc, 0, 0);
 }
 
+static void On_AnnotateTargetMemoryRange(THREADID tid, ADDRINT pc,
+                                         ADDRINT file, ADDRINT line,
+                                         ADDRINT a, ADDRINT size) {
+  DumpEvent(0, TARGET_RANGE, tid, pc, a, size);
+}
+
+static void On_AnnotateUntargetMemoryRange(THREADID tid, ADDRINT pc,
+                                           ADDRINT file, ADDRINT line,
+                                           ADDRINT a, ADDRINT size) {
+  DumpEvent(0, UNTARGET_RANGE, tid, pc, a, size);
+}
+
 static void On_AnnotateCondVarSignal(THREADID tid, ADDRINT pc,
                                      ADDRINT file, ADDRINT line, ADDRINT obj) {
   DumpEvent(0, SIGNAL, tid, pc, obj, 0);
@@ -2349,6 +2835,47 @@ static void On_AnnotateHappensAfter(THREADID tid, ADDRINT pc,
   DumpEvent(0, WAIT, tid, pc, obj, 0);
 }
 
+static void On_AnnotateHappensBeforeMany(THREADID tid, ADDRINT pc,
+                                         ADDRINT file, ADDRINT line,
+                                         ADDRINT objs, ADDRINT n) {
+  if ((long)n > 0)
+    DumpEvent(0, SIGNAL_MANY, tid, pc, objs, n);
+}
+
+static void On_AnnotateHappensAfterMany(THREADID tid, ADDRINT pc,
+                                        ADDRINT file, ADDRINT line,
+                                        ADDRINT objs, ADDRINT n) {
+  if ((long)n > 0)
+    DumpEvent(0, WAIT_MANY, tid, pc, objs, n);
+}
+
+// The events are handled synchronously, the chunk may live on the stack.
+static void DumpArrayEvents(EventType type, THREADID tid, ADDRINT pc,
+                            ADDRINT array, long n, long elem_size) {
+  uintptr_t objs[kMaxManyEventObjs];
+  while (n > 0) {
+    size_t n_objs = min((size_t)n, kMaxManyEventObjs);
+    for (size_t i = 0; i < n_objs; i++, array += elem_size)
+      objs[i] = array;
+    DumpEvent(0, type, tid, pc, (uintptr_t)objs, n_objs);
+    n -= n_objs;
+  }
+}
+
+static void On_AnnotateHappensBeforeArray(THREADID tid, ADDRINT pc,
+                                          ADDRINT file, ADDRINT line,
+                                          ADDRINT array, ADDRINT n,
+                                          ADDRINT elem_size) {
+  DumpArrayEvents(SIGNAL_MANY, tid, pc, array, n, elem_size);
+}
+
+static void On_AnnotateHappensAfterArray(THREADID tid, ADDRINT pc,
+                                         ADDRINT file, ADDRINT line,
+                                         ADDRINT array, ADDRINT n,
+                                         ADDRINT elem_size) {
+  DumpArrayEvents(WAIT_MANY, tid, pc, array, n, elem_size);
+}
+
 static void On_AnnotateEnableRaceDetection(THREADID tid, ADDRINT pc,
                                         ADDRINT file, ADDRINT line,
                                         ADDRINT enable) {
@@ -2457,6 +2984,195 @@ int WRAP_NAME(RunningOnValgrind)(WRAP_PARAM4) {
   return 1;
 }
 
+//--------- Persistent instrumentation cache ------- {{{1
+// With --pin_cache_file=<path>, the ignore decisions made while instrumenting
+// (ThreadSanitizerWantToInstrumentSblock() for routines and
+// ThreadSanitizerIgnoreAccessesBelowFunction() for direct call targets) are
+// kept in a file shared by the runs. Each of them symbolizes the pc and
+// matches it against the ignore lists, which dominates the instrumentation
+// time of large binaries; the same decisions are made again and again when
+// a test suite runs the same binaries many times.
+//
+// A pc is identified by the build-id of its image and its offset from the
+// image load address, so the entries survive rebuilds of other images and
+// ASLR. Images w/o a build-id are not cached. The decisions also depend on
+// the ignore files and flags; their hash is a part of every key.
+// The TraceInfo objects themselves are not cached: Pin re-instruments the
+// code on every run anyway and counting the mops of a trace is cheap.
+//
+// The file is a sequence of lines
+//   <config-hash>/<build-id>/<offset>/<i|b>\t<0|1>
+// where i is the sblock decision and b is the ignore-below decision.
+// It is read once at startup; the new entries are appended at exit with a
+// single write. Duplicates are harmless.
+// All the accesses happen in the instrumentation callbacks and in main/Fini,
+// which Pin serializes, so there is no lock.
+class PinCache {
+ public:
+  enum Kind {
+    kWantToInstrumentSblock = 'i',
+    kIgnoreAccessesBelowFunction = 'b'
+  };
+
+  static void Init() {
+    const string &path = G_flags->pin_cache_file;
+    if (path.empty()) return;
+    config_hash_ = new string(ConfigHash());
+    entries_ = new map<string, bool>;
+    build_ids_ = new map<UINT32, string>;
+    new_entries_ = new string;
+    string str = ThreadSanitizerReadFileToString(path, false);
+    size_t pos = 0;
+    while (pos < str.size()) {
+      size_t eol = str.find('\n', pos);
+      if (eol == string::npos) break;  // An incomplete last line.
+      size_t tab = str.find('\t', pos);
+      if (tab != string::npos && tab + 2 == eol &&
+          str.compare(pos, config_hash_->size(), *config_hash_) == 0) {
+        (*entries_)[str.substr(pos, tab - pos)] = str[tab + 1] == '1';
+      }
+      pos = eol + 1;
+    }
+    if (G_flags->verbosity >= 1) {
+      Printf("INFO: %ld entries read from --pin_cache_file=%s\n",
+             entries_->size(), path.c_str());
+    }
+  }
+
+  static void OnImageLoad(IMG img) {
+    if (!build_ids_) return;
+    (*build_ids_)[IMG_Id(img)] = GetBuildId(img);
+  }
+
+  static void Fini() {
+    if (!entries_) return;
+    if (G_flags->verbosity >= 1) {
+      Printf("INFO: --pin_cache_file: %ld hits, %ld misses\n",
+             n_hits_, n_misses_);
+    }
+    if (new_entries_->empty()) return;
+    FILE *f = fopen(G_flags->pin_cache_file.c_str(), "a");
+    if (!f) {
+      Report("WARNING: can not open --pin_cache_file=%s\n",
+             G_flags->pin_cache_file.c_str());
+      return;
+    }
+    fwrite(new_entries_->data(), 1, new_entries_->size(), f);
+    fclose(f);
+    new_entries_->clear();
+  }
+
+  static bool WantToInstrumentSblock(uintptr_t pc) {
+    return Get(pc, kWantToInstrumentSblock);
+  }
+
+  static bool IgnoreAccessesBelowFunction(uintptr_t pc) {
+    return Get(pc, kIgnoreAccessesBelowFunction);
+  }
+
+ private:
+  static bool Get(uintptr_t pc, Kind kind) {
+    string key = entries_ ? Key(pc, kind) : "";
+    if (!key.empty()) {
+      map<string, bool>::iterator it = entries_->find(key);
+      if (it != entries_->end()) {
+        n_hits_++;
+        return it->second;
+      }
+      n_misses_++;
+    }
+    bool res = kind == kWantToInstrumentSblock
+        ? ThreadSanitizerWantToInstrumentSblock(pc)
+        : ThreadSanitizerIgnoreAccessesBelowFunction(pc);
+    if (!key.empty()) {
+      (*entries_)[key] = res;
+      *new_entries_ += key + (res ? "\t1\n" : "\t0\n");
+    }
+    return res;
+  }
+
+  // Returns "" if pc can't be cached.
+  static string Key(uintptr_t pc, Kind kind) {
+    IMG img = IMG_FindByAddress(pc);
+    if (!IMG_Valid(img)) return "";
+    map<UINT32, string>::iterator it = build_ids_->find(IMG_Id(img));
+    if (it == build_ids_->end() || it->second.empty()) return "";
+    char buff[64];
+    snprintf(buff, sizeof(buff), "/%lx/%c",
+             (unsigned long)(pc - IMG_LoadOffset(img)), (char)kind);
+    return *config_hash_ + "/" + it->second + buff;
+  }
+
+  // The build-id note of an ELF image. The ELF header is mapped at the
+  // lowest address of the image.
+  static string GetBuildId(IMG img) {
+#if defined(__GNUC__)
+    static const char kHex[] = "0123456789abcdef";
+    const char *base = (const char*)IMG_LowAddress(img);
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr)*)base;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) return "";
+    const ElfW(Phdr) *phdr = (const ElfW(Phdr)*)(base + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; i++, phdr++) {
+      if (phdr->p_type != PT_NOTE) continue;
+      const char *p = (const char*)(IMG_LoadOffset(img) + phdr->p_vaddr);
+      const char *end = p + phdr->p_memsz;
+      while (p + sizeof(ElfW(Nhdr)) <= end) {
+        const ElfW(Nhdr) *note = (const ElfW(Nhdr)*)p;
+        const char *name = p + sizeof(*note);
+        const unsigned char *desc =
+            (const unsigned char*)(name + ((note->n_namesz + 3) & ~3));
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+            memcmp(name, "GNU", 4) == 0) {
+          string res;
+          for (size_t j = 0; j < note->n_descsz; j++) {
+            res += kHex[desc[j] >> 4];
+            res += kHex[desc[j] & 15];
+          }
+          return res;
+        }
+        p = (const char*)desc + ((note->n_descsz + 3) & ~3);
+      }
+    }
+#endif
+    return "";
+  }
+
+  // FNV-1a of everything the cached decisions depend on.
+  static string ConfigHash() {
+    string config = TS_VERSION;
+    for (size_t i = 0; i < G_flags->ignore.size(); i++)
+      config += "\n" + ThreadSanitizerReadFileToString(G_flags->ignore[i],
+                                                       false);
+    config += "\n";
+    for (size_t i = 0; i < G_flags->whitelist.size(); i++)
+      config += "\n" + ThreadSanitizerReadFileToString(G_flags->whitelist[i],
+                                                       false);
+    config += G_flags->ignore_unknown_pcs ? "u" : "";
+    config += G_flags->nacl_untrusted ? "n" : "";
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < config.size(); i++) {
+      hash ^= (unsigned char)config[i];
+      hash *= 16777619U;
+    }
+    char buff[16];
+    snprintf(buff, sizeof(buff), "%08x", hash);
+    return buff;
+  }
+
+  static string *config_hash_;
+  static map<string, bool> *entries_;
+  static map<UINT32, string> *build_ids_;
+  static string *new_entries_;  // Not yet written to the file.
+  static uintptr_t n_hits_, n_misses_;
+};
+
+string *PinCache::config_hash_;
+map<string, bool> *PinCache::entries_;
+map<UINT32, string> *PinCache::build_ids_;
+string *PinCache::new_entries_;
+uintptr_t PinCache::n_hits_;
+uintptr_t PinCache::n_misses_;
+
 //--------- Instrumentation ----------------------- {{{1
 static bool IgnoreImage(IMG img) {
   string name = IMG_Name(img);
@@ -2468,7 +3184,7 @@ static bool IgnoreImage(IMG img) {
 static bool IgnoreRtn(RTN rtn) {
   CHECK(rtn != RTN_Invalid());
   ADDRINT rtn_address = RTN_Address(rtn);
-  if (ThreadSanitizerWantToInstrumentSblock(rtn_address) == false)
+  if (PinCache::WantToInstrumentSblock(rtn_address) == false)
     return true;
   return false;
 }
@@ -2479,7 +3195,7 @@ static bool InstrumentCall(INS ins) {
     IGNORE_BELOW_RTN ignore_below = IGNORE_BELOW_RTN_UNKNOWN;
     if (INS_IsDirectBranchOrCall(ins)) {
       ADDRINT target = INS_DirectBranchOrCallTargetAddress(ins);
-      bool ignore = ThreadSanitizerIgnoreAccessesBelowFunction(target);
+      bool ignore = PinCache::IgnoreAccessesBelowFunction(target);
       ignore_below = ignore ? IGNORE_BELOW_RTN_YES : IGNORE_BELOW_RTN_NO;
     }
     INS_InsertCall(ins, IPOINT_BEFORE,
@@ -2602,12 +3318,14 @@ static void InstrumentMopsInBBl(BBL bbl, RTN rtn, TraceInfo *trace_info, uintptr
           Printf("    size=%ld is_w=%d\n", size, (int)is_write);
         }
         IPOINT point = IPOINT_BEFORE;
-        AFUNPTR on_mop_callback = (AFUNPTR)OnMop;
+        bool pass_tid = TSAN_DEBUG != 0;
+        AFUNPTR on_mop_callback =
+            pass_tid ? (AFUNPTR)OnMop : (AFUNPTR)OnMopFast;
         if (check_ident_store) {
           INS_InsertCall(ins, IPOINT_BEFORE,
             (AFUNPTR)OnMopCheckIdentStoreBefore,
+            IARG_FAST_ANALYSIS_CALL,
             IARG_REG_VALUE, tls_reg,
-            IARG_THREAD_ID,
             IARG_ADDRINT, *mop_idx,
             IARG_MEMORYOP_EA, i,
             IARG_END);
@@ -2615,24 +3333,25 @@ static void InstrumentMopsInBBl(BBL bbl, RTN rtn, TraceInfo *trace_info, uintptr
           // after the insn.
           point = IPOINT_AFTER;
           on_mop_callback = (AFUNPTR)OnMopCheckIdentStoreAfter;
+          pass_tid = false;
         }
 
         MopInfo *mop = trace_info->GetMop(*mop_idx);
         new (mop) MopInfo(INS_Address(ins), size, is_write, false);
-        if (is_predicated) {
+        if (pass_tid) {
           INS_InsertPredicatedCall(ins, point,
-              (AFUNPTR)On_PredicatedMop,
-              IARG_EXECUTING,
+              on_mop_callback,
+              IARG_FAST_ANALYSIS_CALL,
               IARG_REG_VALUE, tls_reg,
               IARG_THREAD_ID,
               IARG_ADDRINT, *mop_idx,
               IARG_MEMORYOP_EA, i,
               IARG_END);
         } else {
-          INS_InsertCall(ins, point,
+          INS_InsertPredicatedCall(ins, point,
               on_mop_callback,
+              IARG_FAST_ANALYSIS_CALL,
               IARG_REG_VALUE, tls_reg,
-              IARG_THREAD_ID,
               IARG_ADDRINT, *mop_idx,
               IARG_MEMORYOP_EA, i,
               IARG_END);
@@ -2718,6 +3437,7 @@ void CallbackForTRACE(TRACE trace, void *v) {
       // TODO(kcc): implement race verifier here.
       INS_InsertCall(head, IPOINT_BEFORE,
                      (AFUNPTR)OnTraceParallel,
+                     IARG_FAST_ANALYSIS_CALL,
                      IARG_REG_VALUE, tls_reg,
                      IARG_REG_VALUE, REG_STACK_PTR,
                      IARG_PTR, trace_info,
@@ -2727,6 +3447,7 @@ void CallbackForTRACE(TRACE trace, void *v) {
                                   OnTraceVerify : OnTraceSerial);
       INS_InsertCall(head, IPOINT_BEFORE,
                      handler,
+                     IARG_FAST_ANALYSIS_CALL,
                      IARG_THREAD_ID,
                      IARG_REG_VALUE, REG_STACK_PTR,
                      IARG_PTR, trace_info,
@@ -2737,6 +3458,7 @@ void CallbackForTRACE(TRACE trace, void *v) {
     if (g_race_verifier_active) {
       INS_InsertCall(head, IPOINT_BEFORE,
                      (AFUNPTR)OnTraceNoMopsVerify,
+                     IARG_FAST_ANALYSIS_CALL,
                      IARG_THREAD_ID,
                      IARG_REG_VALUE, REG_STACK_PTR,
                      IARG_REG_REFERENCE, tls_reg,
@@ -2851,6 +3573,17 @@ void CallbackForTRACE(TRACE trace, void *v) {
 #define INSERT_AFTER_1(name, to_insert) \
     INSERT_AFTER_FN(name, to_insert, IARG_FUNCRET_EXITPOINT_VALUE)
 
+// With --fast_win_locks Before_<name> (see "Fast paths for the locks"),
+// otherwise the replacement WRAP_NAME(name) with n parameters.
+#define WRAPSTD_OR_FAST(n, name) \
+  if (G_flags->fast_win_locks) { \
+    if (RtnMatchesName(rtn_name, #name)) \
+      InformAboutFunctionWrap(rtn, #name); \
+    INSERT_BEFORE_1_SP(#name, Before_##name); \
+  } else { \
+    WRAPSTD##n(name); \
+  }
+
 
 #ifdef _MSC_VER
 void WrapStdCallFunc1(RTN rtn, char *name, AFUNPTR replacement_func) {
@@ -3292,9 +4025,9 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   WRAPSTD2(RtlInitializeCriticalSectionAndSpinCount);
   WRAPSTD3(RtlInitializeCriticalSectionEx);
   WRAPSTD1(RtlDeleteCriticalSection);
-  WRAPSTD1(RtlEnterCriticalSection);
-  WRAPSTD1(RtlTryEnterCriticalSection);
-  WRAPSTD1(RtlLeaveCriticalSection);
+  WRAPSTD_OR_FAST(1, RtlEnterCriticalSection);
+  WRAPSTD_OR_FAST(1, RtlTryEnterCriticalSection);
+  WRAPSTD_OR_FAST(1, RtlLeaveCriticalSection);
   WRAPSTD7(DuplicateHandle);
   WRAPSTD1(SetEvent);
   WRAPSTD4(CreateSemaphoreA);
@@ -3305,12 +4038,12 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   WRAPSTD2(RtlInterlockedPushEntrySList);
 
 #if 1
-  WRAPSTD1(RtlAcquireSRWLockExclusive);
-  WRAPSTD1(RtlAcquireSRWLockShared);
-  WRAPSTD1(RtlTryAcquireSRWLockExclusive);
-  WRAPSTD1(RtlTryAcquireSRWLockShared);
-  WRAPSTD1(RtlReleaseSRWLockExclusive);
-  WRAPSTD1(RtlReleaseSRWLockShared);
+  WRAPSTD_OR_FAST(1, RtlAcquireSRWLockExclusive);
+  WRAPSTD_OR_FAST(1, RtlAcquireSRWLockShared);
+  WRAPSTD_OR_FAST(1, RtlTryAcquireSRWLockExclusive);
+  WRAPSTD_OR_FAST(1, RtlTryAcquireSRWLockShared);
+  WRAPSTD_OR_FAST(1, RtlReleaseSRWLockExclusive);
+  WRAPSTD_OR_FAST(1, RtlReleaseSRWLockShared);
   WRAPSTD1(RtlInitializeSRWLock);
   // For some reason, RtlInitializeSRWLock is aliased to RtlInitializeSRWLock..
   WrapStdCallFunc1(rtn, "RtlRunOnceInitialize",
@@ -3332,7 +4065,7 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   WRAPSTD6(RegisterWaitForSingleObject);
   WRAPSTD2(UnregisterWaitEx);
 
-  WRAPSTD3(WaitForSingleObjectEx);
+  WRAPSTD_OR_FAST(3, WaitForSingleObjectEx);
   WRAPSTD5(WaitForMultipleObjectsEx);
 
   WrapStdCallFunc4(rtn, "VirtualAlloc", (AFUNPTR)(WRAP_NAME(VirtualAlloc)));
@@ -3352,6 +4085,9 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   INSERT_BEFORE_4("AnnotateNewMemory", On_AnnotateNewMemory);
   INSERT_BEFORE_3("AnnotateNoOp", On_AnnotateNoOp);
   INSERT_BEFORE_2("AnnotateFlushState", On_AnnotateFlushState);
+  INSERT_BEFORE_4("AnnotateTargetMemoryRange", On_AnnotateTargetMemoryRange);
+  INSERT_BEFORE_4("AnnotateUntargetMemoryRange",
+                  On_AnnotateUntargetMemoryRange);
 
   INSERT_BEFORE_3("AnnotateCondVarWait", On_AnnotateCondVarWait);
   INSERT_BEFORE_3("AnnotateCondVarSignal", On_AnnotateCondVarSignal);
@@ -3360,6 +4096,10 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   INSERT_BEFORE_3("WTFAnnotateHappensBefore", On_AnnotateHappensBefore);
   INSERT_BEFORE_3("AnnotateHappensAfter", On_AnnotateHappensAfter);
   INSERT_BEFORE_3("WTFAnnotateHappensAfter", On_AnnotateHappensAfter);
+  INSERT_BEFORE_4("AnnotateHappensBeforeMany", On_AnnotateHappensBeforeMany);
+  INSERT_BEFORE_4("AnnotateHappensAfterMany", On_AnnotateHappensAfterMany);
+  INSERT_BEFORE_5("AnnotateHappensBeforeArray", On_AnnotateHappensBeforeArray);
+  INSERT_BEFORE_5("AnnotateHappensAfterArray", On_AnnotateHappensAfterArray);
 
   INSERT_BEFORE_3("AnnotateEnableRaceDetection", On_AnnotateEnableRaceDetection);
   INSERT_BEFORE_0("AnnotateIgnoreReadsBegin", On_AnnotateIgnoreReadsBegin);
@@ -3409,7 +4149,7 @@ static void MaybeInstrumentOneRoutine(IMG img, RTN rtn) {
   // So, if we don't want to get those events (e.g. memcpy inside
   // ld.so or ntdll.dll) we don't wrap them and the regular
   // ignore machinery will make sure we don't get the events.
-  if (ThreadSanitizerWantToInstrumentSblock(RTN_Address(rtn))) {
+  if (PinCache::WantToInstrumentSblock(RTN_Address(rtn))) {
     ReplaceFunc3(img, rtn, "memchr", (AFUNPTR)Replace_memchr);
     ReplaceFunc3(img, rtn, "strchr", (AFUNPTR)Replace_strchr);
     ReplaceFunc3(img, rtn, "index", (AFUNPTR)Replace_strchr);
@@ -3443,6 +4183,7 @@ static void CallbackForIMG(IMG img, void *v) {
     Printf("Started CallbackForIMG %s\n", IMG_Name(img).c_str());
   }
 
+  PinCache::OnImageLoad(img);
   string img_name = IMG_Name(img);
   for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
     for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
@@ -3489,7 +4230,13 @@ static BOOL CallbackForExec(CHILD_PROCESS childProcess, VOID *val) {
 //--------- Fini ---------- {{{1
 static void CallbackForFini(INT32 code, void *v) {
   DumpEvent(0, THR_END, 0, 0, 0, 0);
+  if (g_recorder) {
+    g_recorder->Fini();
+    return;
+  }
+  DrainAllAnalysisQueues();
   ThreadSanitizerFini();
+  PinCache::Fini();
   if (g_race_verifier_active) {
     RaceVerifierFini();
   }
@@ -3509,33 +4256,60 @@ typedef set<pair<uintptr_t, uintptr_t> > CallCoverageSet;
 static CallCoverageSet *call_coverage_set;
 
 static map<uintptr_t, string> *function_names_map;
-static uintptr_t symbolized_functions_cache[1023];
-static pair<uintptr_t, uintptr_t> registered_pairs_cache[1023];
 
+// Called under the client lock.
 static void symbolize_pc(uintptr_t pc) {
-  // Check a simple cache if we already symbolized this pc (racey).
-  size_t idx = pc % TS_ARRAY_SIZE(symbolized_functions_cache);
-  if (symbolized_functions_cache[idx] == pc) return;
-
-  ScopedReentrantClientLock lock(__LINE__);
   CHECK(function_names_map);
   if (function_names_map->count(pc) == 0) {
     (*function_names_map)[pc] = PcToRtnName(pc, false);
   }
-  symbolized_functions_cache[idx] = pc;
 }
 
-static void CallCoverageRegisterCall(uintptr_t from, uintptr_t to) {
-  symbolize_pc(from);
-  symbolize_pc(to);
-
-  // Check if we already registered this pair (racey).
-  size_t idx = (from ^ to) % TS_ARRAY_SIZE(registered_pairs_cache);
-  if (registered_pairs_cache[idx] == make_pair(from,to)) return;
+// Called under the client lock.
+static void CallCoverageAddToSet(uintptr_t from, uintptr_t to) {
+  if (call_coverage_set->insert(make_pair(from, to)).second) {
+    symbolize_pc(from);
+    symbolize_pc(to);
+  }
+}
 
+// Moves the pairs collected by a thread to the global set.
+static void CallCoverageFlush(CallCoverageTable *table) {
+  if (table->size == 0) return;
   ScopedReentrantClientLock lock(__LINE__);
-  call_coverage_set->insert(make_pair(from, to));
-  registered_pairs_cache[idx] = make_pair(from,to);
+  for (size_t i = 0; i < kCallCoverageTableSize; i++) {
+    pair<uintptr_t, uintptr_t> &edge = table->edges[i];
+    if (edge.first == 0 && edge.second == 0) continue;
+    CallCoverageAddToSet(edge.first, edge.second);
+    edge = make_pair(0, 0);
+  }
+  table->size = 0;
+}
+
+static void CallCoverageRegisterCall(THREADID tid,
+                                     uintptr_t from, uintptr_t to) {
+  PinThread &t = g_pin_threads[tid];
+  CallCoverageTable *table = t.call_coverage;
+  if (UNLIKELY(table == NULL)) {
+    table = t.call_coverage = new CallCoverageTable;
+    memset(table, 0, sizeof(*table));
+  }
+  pair<uintptr_t, uintptr_t> edge(from, to);
+  size_t hash = (from * 31) ^ to;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    for (size_t i = 0; i < kCallCoverageProbes; i++) {
+      pair<uintptr_t, uintptr_t> &slot =
+          table->edges[(hash + i) & (kCallCoverageTableSize - 1)];
+      if (slot == edge) return;
+      if (slot.first == 0 && slot.second == 0) {
+        slot = edge;
+        table->size++;
+        return;
+      }
+    }
+    // No room for this pair, make some.
+    CallCoverageFlush(table);
+  }
 }
 
 static void CallCoverageCallbackForTRACE(TRACE trace, void *v) {
@@ -3559,11 +4333,13 @@ static void CallCoverageCallbackForTRACE(TRACE trace, void *v) {
       // If <from, to> is know at instrumentation time, don't instrument.
       ADDRINT to = INS_DirectBranchOrCallTargetAddress(ins);
       ADDRINT from = INS_Address(ins);
-      CallCoverageRegisterCall(from, to);
+      ScopedReentrantClientLock lock(__LINE__);
+      CallCoverageAddToSet(from, to);
     } else {
       // target is dynamic. Need to instrument.
       INS_InsertCall(ins, IPOINT_BEFORE,
                      (AFUNPTR)CallCoverageRegisterCall,
+                     IARG_THREAD_ID,
                      IARG_INST_PTR,
                      IARG_BRANCH_TARGET_ADDR,
                      IARG_END);
@@ -3575,6 +4351,10 @@ static void CallCoverageCallbackForTRACE(TRACE trace, void *v) {
 static void CallCoverageCallbackForFini(INT32 code, void *v) {
   CHECK(call_coverage_set);
   CHECK(function_names_map);
+  for (THREADID tid = 0; tid < kMaxThreads; tid++) {
+    if (g_pin_threads[tid].call_coverage)
+      CallCoverageFlush(g_pin_threads[tid].call_coverage);
+  }
   for (CallCoverageSet::iterator it = call_coverage_set->begin();
        it != call_coverage_set->end(); ++it) {
     string from_name = (*function_names_map)[it->first];
@@ -3631,6 +4411,10 @@ int main(INT32 argc, CHAR **argv) {
   }
 
   ThreadSanitizerInit();
+  PinCache::Init();
+  StartAnalysisWorkers();
+  StartRecorder();
+  StartReportWriter();
 
   if (G_flags->call_coverage) {
     PIN_AddFiniFunction(CallCoverageCallbackForFini, 0);
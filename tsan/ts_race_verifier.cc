@@ -53,7 +53,19 @@ struct PossibleRace {
 };
 
 // pc -> race
-static map<uintptr_t, PossibleRace*>* races_map;
+typedef unordered_map<uintptr_t, PossibleRace*> RacesMap;
+static RacesMap* races_map;
+
+// A pc of a possible race: its racy instruction or one of its concurrent
+// traces. Sorted by pc, so that RaceVerifierGetAddresses finds the pcs of a
+// trace with a binary search. Built by RaceVerifierInit, read-only later.
+struct RacePc {
+  uintptr_t pc;
+  PossibleRace* race;
+  bool is_trace;
+  bool operator<(const RacePc& other) const { return pc < other.pc; }
+};
+static vector<RacePc>* race_pcs;
 
 // Data about a call site.
 struct CallSite {
@@ -67,18 +79,70 @@ struct TypedCallSites {
 };
 
 // data address -> ([write callsites], [read callsites])
-typedef map<uintptr_t, TypedCallSites> AddressMap;
+typedef unordered_map<uintptr_t, TypedCallSites> AddressMap;
+
+// The accesses are split by data address into shards with their own locks,
+// so the threads delaying on different addresses do not contend.
+struct AddressShard {
+  TSLock lock;
+  AddressMap callsites;
+  // data addresses that are ignored (they have already been reported)
+  unordered_set<uintptr_t> ignore_addresses;
+};
+
+static const size_t kNumAddressShards = 64;
+static AddressShard* address_shards;
+
+static AddressShard* GetAddressShard(uintptr_t addr) {
+  return &address_shards[(addr >> 3) % kNumAddressShards];
+}
 
+// Protects the reports and visit_count_map; taken after a shard lock.
 static TSLock racecheck_lock;
-static AddressMap* racecheck_map;
-// data addresses that are ignored (they have already been reported)
-static set<uintptr_t>* ignore_addresses;
 
 // starting pc of the trace -> visit count
 // used to reduce the sleep time for hot traces
-typedef map<uintptr_t, int> VisitCountMap;
+typedef unordered_map<uintptr_t, int> VisitCountMap;
 static VisitCountMap* visit_count_map;
 
+// With --race_verifier_adaptive the sleeps go where they may pay off.
+// A thread sleeps only if some other thread has been inside the verified
+// traces recently, i.e. there is somebody to meet. A trace whose sleeps
+// meet nobody on its data addresses backs off exponentially: after k such
+// sleeps in a row it sleeps only once in 2^k visits. A meeting resets it.
+struct TraceHeat {
+  TraceHeat() : visits(0), misses(0), next_sleep(0) {}
+  int visits;
+  // sleeps in a row that met no other thread
+  int misses;
+  // the visit at which the trace may sleep again
+  int next_sleep;
+};
+typedef unordered_map<uintptr_t, TraceHeat> TraceHeatMap;
+static TraceHeatMap* trace_heat_map;
+
+struct VerifierThread {
+  VerifierThread() : sleep_trace_pc(0), met(false), last_active_ms(0) {}
+  // the trace the thread has slept in last, 0 if accounted for
+  uintptr_t sleep_trace_pc;
+  // whether another thread accessed the same data meanwhile
+  bool met;
+  // when the thread has entered a verified trace last
+  size_t last_active_ms;
+};
+// thread id -> VerifierThread, protected by racecheck_lock
+static vector<VerifierThread>* verifier_threads;
+
+static const int kMaxTraceBackoff = 16;
+
+// racecheck_lock must be held by the current thread.
+static VerifierThread* GetVerifierThread(int thread_id) {
+  CHECK(thread_id >= 0);
+  if ((size_t)thread_id >= verifier_threads->size())
+    verifier_threads->resize(thread_id + 1);
+  return &(*verifier_threads)[thread_id];
+}
+
 static int n_reports;
 
 /**
@@ -90,26 +154,20 @@ static int n_reports;
 bool RaceVerifierGetAddresses(uintptr_t min_pc, uintptr_t max_pc,
     uintptr_t* instrument_pc) {
   uintptr_t pc = 0;
-  for (map<uintptr_t, PossibleRace*>::iterator it = races_map->begin();
-       it != races_map->end(); ++it) {
-    PossibleRace* race = it->second;
-    if (race->reported)
+  RacePc key;
+  key.pc = min_pc;
+  for (vector<RacePc>::iterator it =
+           lower_bound(race_pcs->begin(), race_pcs->end(), key);
+       it != race_pcs->end() && it->pc <= max_pc; ++it) {
+    if (it->race->reported)
       continue;
-    if (race->pc >= min_pc && race->pc <= max_pc) {
-      if (pc) {
-        // Two race candidates in one trace. Just instrument it fully.
-        *instrument_pc = 0;
-        return true;
-      }
-      pc = race->pc;
-    }
-    for (vector<uintptr_t>::iterator it2 = race->traces.begin();
-         it2 != race->traces.end(); ++it2) {
-      if (*it2 >= min_pc && *it2 <= max_pc) {
-        *instrument_pc = 0;
-        return true;
-      }
+    if (it->is_trace || pc) {
+      // A concurrent trace or two race candidates in one trace.
+      // Just instrument it fully.
+      *instrument_pc = 0;
+      return true;
     }
+    pc = it->pc;
   }
   *instrument_pc = pc;
   return !!pc;
@@ -132,10 +190,10 @@ static void UpdateSummary() {
    don't have a ready report - for unexpected races and for
    --race-verifier-extra races.
 
-   racecheck_lock must be held by the current thread.
+   The shard lock of addr must be held by the current thread.
 */
 static void PrintRaceReportEmpty(uintptr_t addr) {
-  TypedCallSites* typedCallSites = &(*racecheck_map)[addr];
+  TypedCallSites* typedCallSites = &GetAddressShard(addr)->callsites[addr];
   vector<CallSite>& writes = typedCallSites->writes;
   vector<CallSite>& reads = typedCallSites->reads;
   for (vector<CallSite>::const_iterator it = writes.begin();
@@ -148,24 +206,24 @@ static void PrintRaceReportEmpty(uintptr_t addr) {
   }
 }
 
-/* Find a PossibleRace that matches current accesses (racecheck_map) to the
-   given data address.
+/* Find a PossibleRace that matches current accesses (the callsites of the
+   address shard) to the given data address.
 
-   racecheck_lock must be held by the current thread.
+   The shard lock of addr must be held by the current thread.
  */
 static PossibleRace* FindRaceForAddr(uintptr_t addr) {
-  TypedCallSites* typedCallSites = &(*racecheck_map)[addr];
+  TypedCallSites* typedCallSites = &GetAddressShard(addr)->callsites[addr];
   vector<CallSite>& writes = typedCallSites->writes;
   vector<CallSite>& reads = typedCallSites->reads;
   for (vector<CallSite>::const_iterator it = writes.begin();
        it != writes.end(); ++ it) {
-    map<uintptr_t, PossibleRace*>::iterator it2 = races_map->find(it->pc);
+    RacesMap::iterator it2 = races_map->find(it->pc);
     if (it2 != races_map->end())
       return it2->second;
   }
   for (vector<CallSite>::const_iterator it = reads.begin();
        it != reads.end(); ++ it) {
-    map<uintptr_t, PossibleRace*>::iterator it2 = races_map->find(it->pc);
+    RacesMap::iterator it2 = races_map->find(it->pc);
     if (it2 != races_map->end())
       return it2->second;
   }
@@ -175,9 +233,10 @@ static PossibleRace* FindRaceForAddr(uintptr_t addr) {
 /* Prints a race report for the given data address, either finding one in a
    matching PossibleRace, or just printing pc's of the mops.
 
-   racecheck_lock must be held by the current thread.
+   The shard lock of addr must be held by the current thread.
 */
 static void PrintRaceReport(uintptr_t addr) {
+  ScopedLock lock(&racecheck_lock);
   PossibleRace* race = FindRaceForAddr(addr);
   if (race) {
     ExpectedRace* expected_race = ThreadSanitizerFindExpectedRace(addr);
@@ -201,7 +260,7 @@ static void PrintRaceReport(uintptr_t addr) {
     }
     // Suppress future reports for this race.
     race->reported = true;
-    ignore_addresses->insert(addr);
+    GetAddressShard(addr)->ignore_addresses.insert(addr);
 
     n_reports++;
   } else {
@@ -228,21 +287,37 @@ bool RaceVerifierStartAccess(int thread_id, uintptr_t addr, uintptr_t pc,
   CallSite callSite;
   callSite.thread_id = thread_id;
   callSite.pc = pc;
-  racecheck_lock.Lock();
+  AddressShard* shard = GetAddressShard(addr);
+  shard->lock.Lock();
 
   if (debug_race_verifier)
     Printf("[%d] pc %p %s addr %p start\n", thread_id, pc,
         is_w ? "write" : "read", addr);
 
-  if (ignore_addresses->count(addr)) {
-    racecheck_lock.Unlock();
+  if (shard->ignore_addresses.count(addr)) {
+    shard->lock.Unlock();
     return false;
   }
 
-  TypedCallSites* typedCallSites = &(*racecheck_map)[addr];
+  TypedCallSites* typedCallSites = &shard->callsites[addr];
   vector<CallSite>& writes = typedCallSites->writes;
   vector<CallSite>& reads = typedCallSites->reads;
   (is_w ? writes : reads).push_back(callSite);
+  if (G_flags->race_verifier_adaptive && writes.size() + reads.size() > 1) {
+    bool met = false;
+    for (size_t i = 0; !met && i < writes.size(); ++i)
+      met = writes[i].thread_id != thread_id;
+    for (size_t i = 0; !met && i < reads.size(); ++i)
+      met = reads[i].thread_id != thread_id;
+    if (met) {
+      // Everybody accessing addr now has met somebody.
+      ScopedLock lock(&racecheck_lock);
+      for (size_t i = 0; i < writes.size(); ++i)
+        GetVerifierThread(writes[i].thread_id)->met = true;
+      for (size_t i = 0; i < reads.size(); ++i)
+        GetVerifierThread(reads[i].thread_id)->met = true;
+    }
+  }
   if (writes.size() > 0 && writes.size() + reads.size() > 1) {
     bool is_race = false;
     for (size_t i = 0; !is_race && i < writes.size(); ++i) {
@@ -256,7 +331,7 @@ bool RaceVerifierStartAccess(int thread_id, uintptr_t addr, uintptr_t pc,
     if (is_race)
       PrintRaceReport(addr);
   }
-  racecheck_lock.Unlock();
+  shard->lock.Unlock();
   return true;
 }
 
@@ -264,26 +339,33 @@ bool RaceVerifierStartAccess(int thread_id, uintptr_t addr, uintptr_t pc,
    returned true. The arguments are exactly the same. */
 void RaceVerifierEndAccess(int thread_id, uintptr_t addr, uintptr_t pc,
     bool is_w) {
-  racecheck_lock.Lock();
+  AddressShard* shard = GetAddressShard(addr);
+  shard->lock.Lock();
 
   if (debug_race_verifier)
     Printf("[%d] pc %p %s addr %p end\n", thread_id, pc,
         is_w ? "write" : "read", addr);
-  if (ignore_addresses->count(addr)) {
-    racecheck_lock.Unlock();
+  if (shard->ignore_addresses.count(addr)) {
+    shard->lock.Unlock();
     return;
   }
 
-  TypedCallSites* typedCallSites = &(*racecheck_map)[addr];
-  vector<CallSite>& vec =
-      is_w ? typedCallSites->writes : typedCallSites->reads;
-  for (int i = vec.size() - 1; i >= 0; --i) {
-    if (vec[i].thread_id == thread_id) {
-      vec.erase(vec.begin() + i);
-      break;
+  AddressMap::iterator it = shard->callsites.find(addr);
+  if (it != shard->callsites.end()) {
+    TypedCallSites* typedCallSites = &it->second;
+    vector<CallSite>& vec =
+        is_w ? typedCallSites->writes : typedCallSites->reads;
+    for (int i = vec.size() - 1; i >= 0; --i) {
+      if (vec[i].thread_id == thread_id) {
+        vec.erase(vec.begin() + i);
+        break;
+      }
     }
+    // Forget the addresses nobody is accessing now.
+    if (typedCallSites->writes.empty() && typedCallSites->reads.empty())
+      shard->callsites.erase(it);
   }
-  racecheck_lock.Unlock();
+  shard->lock.Unlock();
 }
 
 /* Parse a race description that appears in TSan logs after the words
@@ -388,13 +470,60 @@ static void RaceVerifierParseFile(const string& fileName) {
   Printf("Got %d possible races\n", count);
 }
 
+/* The --race_verifier_adaptive version of RaceVerifierGetSleepTime.
+
+   racecheck_lock must be held by the current thread.
+*/
+static int GetAdaptiveSleepTime(int thread_id, uintptr_t trace_pc) {
+  VerifierThread* thr = GetVerifierThread(thread_id);
+  size_t now = TimeInMilliSeconds();
+  thr->last_active_ms = now;
+
+  // Account for the previous sleep of this thread.
+  if (thr->sleep_trace_pc) {
+    TraceHeat& heat = (*trace_heat_map)[thr->sleep_trace_pc];
+    heat.misses = thr->met ? 0 : min(heat.misses + 1, kMaxTraceBackoff);
+    heat.next_sleep = heat.visits + (1 << heat.misses);
+    if (debug_race_verifier && heat.misses == kMaxTraceBackoff)
+      Printf("RaceVerifier: Trace %x: backed off.\n", thr->sleep_trace_pc);
+    thr->sleep_trace_pc = 0;
+  }
+
+  TraceHeat& heat = (*trace_heat_map)[trace_pc];
+  if (++heat.visits < heat.next_sleep)
+    return 0;
+
+  // A thread sleeping in a trace stays active while it sleeps.
+  size_t window_ms = 2 * G_flags->race_verifier_sleep_ms + 10;
+  bool others_active = false;
+  for (size_t i = 0; !others_active && i < verifier_threads->size(); ++i) {
+    const VerifierThread& other = (*verifier_threads)[i];
+    others_active = (int)i != thread_id && other.last_active_ms &&
+        now - other.last_active_ms <= window_ms;
+  }
+  if (!others_active)
+    return 0;
+
+  thr->sleep_trace_pc = trace_pc;
+  thr->met = false;
+  return G_flags->race_verifier_sleep_ms;
+}
+
 /**
  * Return the time to sleep for the given trace.
+ * @param thread_id Thread id.
  * @param trace_pc The starting pc of the trace.
- * @return Time to sleep in ms, or 0 if this trace should be ignored.
+ * @return Time to sleep in ms. If 0, this trace should be ignored, but with
+ *     --race_verifier_adaptive its accesses should still be registered
+ *     (w/o the delay), so that the sleeping threads can meet them.
  */
-int RaceVerifierGetSleepTime(uintptr_t trace_pc) {
+int RaceVerifierGetSleepTime(int thread_id, uintptr_t trace_pc) {
   racecheck_lock.Lock();
+  if (G_flags->race_verifier_adaptive) {
+    int tm = GetAdaptiveSleepTime(thread_id, trace_pc);
+    racecheck_lock.Unlock();
+    return tm;
+  }
   int visit_count = ++(*visit_count_map)[trace_pc];
   int tm;
   if (visit_count < 20) {
@@ -423,10 +552,11 @@ int RaceVerifierGetSleepTime(uintptr_t trace_pc) {
  */
 void RaceVerifierInit(const vector<string>& fileNames,
     const vector<string>& raceInfos) {
-  races_map = new map<uintptr_t, PossibleRace*>();
-  racecheck_map = new AddressMap();
+  races_map = new RacesMap();
+  address_shards = new AddressShard[kNumAddressShards];
   visit_count_map = new VisitCountMap();
-  ignore_addresses = new set<uintptr_t>();
+  trace_heat_map = new TraceHeatMap();
+  verifier_threads = new vector<VerifierThread>();
 
   for (vector<string>::const_iterator it = fileNames.begin();
        it != fileNames.end(); ++it) {
@@ -436,6 +566,23 @@ void RaceVerifierInit(const vector<string>& fileNames,
        it != raceInfos.end(); ++it) {
     RaceVerifierParseRaceInfo(*it);
   }
+
+  race_pcs = new vector<RacePc>();
+  for (RacesMap::iterator it = races_map->begin();
+       it != races_map->end(); ++it) {
+    PossibleRace* race = it->second;
+    RacePc race_pc;
+    race_pc.race = race;
+    race_pc.pc = race->pc;
+    race_pc.is_trace = false;
+    race_pcs->push_back(race_pc);
+    race_pc.is_trace = true;
+    for (size_t i = 0; i < race->traces.size(); ++i) {
+      race_pc.pc = race->traces[i];
+      race_pcs->push_back(race_pc);
+    }
+  }
+  sort(race_pcs->begin(), race_pcs->end());
 }
 
 void RaceVerifierFini() {
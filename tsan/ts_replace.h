@@ -37,15 +37,116 @@
 // REPORT_WRITE_RANGE, REPORT_READ_RANGE, EXTRA_REPLACE_PARAMS,
 // EXTRA_REPLACE_ARGS, NOINLINE
 // See ts_valgrind_intercepts.c and ts_pin.cc.
+//
+// The includer may define REPLACE_IS_NOT_INSTRUMENTED to 1 if the
+// replacements run uninstrumented and their accesses are seen only via
+// REPORT_*_RANGE (Pin, tsan_rtl). Then the string functions, memchr and
+// memcmp may read a whole 16-byte chunk which goes past the byte where they
+// stop (but never into the next page, so this can't fault). Under Valgrind
+// the replacement code is instrumented and the extra bytes would be
+// reported as accesses, so there only memcpy and memmove use SSE2.
+//
+// With SSE2 the loops handle 16 bytes at a time and the byte loops only
+// find the exact position within the last chunk, so the reported ranges
+// are the same as with the plain byte loops.
 
 #ifndef TS_REPLACE_H_
 #define TS_REPLACE_H_
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+# define REPLACE_SSE2 1
+#else
+# define REPLACE_SSE2 0
+#endif
+
+#if REPLACE_SSE2 && defined(REPLACE_IS_NOT_INSTRUMENTED) && \
+    REPLACE_IS_NOT_INSTRUMENTED
+# define REPLACE_SSE2_STR 1
+#else
+# define REPLACE_SSE2_STR 0
+#endif
+
+#if REPLACE_SSE2
+// A 16-byte load at p can't fault if [p, p+16) is in the page of p.
+static inline int ReplaceChunkInPage(const char *p) {
+  return ((size_t)p & 4095) <= 4096 - 16;
+}
+
+// Returns the index of the first byte among the first n bytes of s which
+// may be c (or 0 if zero_too): the bytes before it are neither. The chunks
+// may go past the byte found (and past n), but not into the next page.
+static inline size_t ReplaceSse2Find(const char *s, size_t n, int c,
+                                     int zero_too) {
+  __m128i vc = _mm_set1_epi8((char)c);
+  __m128i vz = _mm_setzero_si128();
+  size_t i = 0;
+  while (i < n) {
+    if (i + 16 <= n && ReplaceChunkInPage(s + i)) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+      __m128i m = _mm_cmpeq_epi8(x, vc);
+      if (zero_too)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, vz));
+      if (_mm_movemask_epi8(m))
+        return i;
+      i += 16;
+      continue;
+    }
+    // Near the end of a page: one byte at a time.
+    if (s[i] == (char)c || (zero_too && s[i] == 0))
+      return i;
+    i++;
+  }
+  return i;
+}
+
+// Returns the index of the first byte where s1 and s2 may differ or end.
+static inline size_t ReplaceSse2FindMismatch(const char *s1, const char *s2,
+                                             size_t n) {
+  __m128i vz = _mm_setzero_si128();
+  size_t i = 0;
+  while (i < n) {
+    if (i + 16 <= n &&
+        ReplaceChunkInPage(s1 + i) && ReplaceChunkInPage(s2 + i)) {
+      __m128i x1 = _mm_loadu_si128((const __m128i*)(s1 + i));
+      __m128i x2 = _mm_loadu_si128((const __m128i*)(s2 + i));
+      __m128i stop = _mm_or_si128(
+          _mm_cmpeq_epi8(_mm_cmpeq_epi8(x1, x2), vz),
+          _mm_cmpeq_epi8(x1, vz));
+      if (_mm_movemask_epi8(stop))
+        return i;
+      i += 16;
+      continue;
+    }
+    if (s1[i] != s2[i] || s1[i] == 0)
+      return i;
+    i++;
+  }
+  return i;
+}
+
+// Copies the first (n & ~15) bytes from src to dst in 16-byte chunks going
+// forward (backward if !forward). Returns the number of bytes copied.
+static inline size_t ReplaceSse2Copy(char *dst, const char *src, size_t n,
+                                     int forward) {
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    size_t off = forward ? i : n - i - 16;
+    _mm_storeu_si128((__m128i*)(dst + off),
+                     _mm_loadu_si128((const __m128i*)(src + off)));
+  }
+  return i;
+}
+#endif  // REPLACE_SSE2
+
 static NOINLINE char *Replace_memchr(EXTRA_REPLACE_PARAMS const char *s,
                                      int c, size_t n) {
-  size_t i;
+  size_t i = 0;
   char *ret = 0;
-  for (i = 0; i < n; i++) {
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Find(s, n, c, 0);
+#endif
+  for (; i < n; i++) {
     if (s[i] == (char)c) {
       ret = (char*)(&s[i]);
       break;
@@ -57,9 +158,12 @@ static NOINLINE char *Replace_memchr(EXTRA_REPLACE_PARAMS const char *s,
 
 static NOINLINE char *Replace_strchr(EXTRA_REPLACE_PARAMS const char *s,
                                      int c) {
-  size_t i;
+  size_t i = 0;
   char *ret = 0;
-  for (i = 0; ; i++) {
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Find(s, (size_t)-1, c, 1);
+#endif
+  for (; ; i++) {
     if (s[i] == (char)c) {
       ret = (char*)(&s[i]);
       break;
@@ -72,9 +176,12 @@ static NOINLINE char *Replace_strchr(EXTRA_REPLACE_PARAMS const char *s,
 
 static NOINLINE char *Replace_strchrnul(EXTRA_REPLACE_PARAMS const char *s,
                                         int c) {
-  size_t i;
+  size_t i = 0;
   char *ret;
-  for (i = 0; ; i++) {
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Find(s, (size_t)-1, c, 1);
+#endif
+  for (; ; i++) {
     if (s[i] == (char)c || s[i] == 0) {
       ret = (char*)(&s[i]);
       break;
@@ -87,20 +194,33 @@ static NOINLINE char *Replace_strchrnul(EXTRA_REPLACE_PARAMS const char *s,
 static NOINLINE char *Replace_strrchr(EXTRA_REPLACE_PARAMS const char *s,
                                       int c) {
   char* ret = 0;
-  size_t i;
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  // Skip the chunks w/o c or 0.
+  for (;;) {
+    i += ReplaceSse2Find(s + i, (size_t)-1, c, 1);
+    if (s[i] == (char)c) ret = (char*)&s[i];
+    if (s[i] == 0) break;
+    i++;
+  }
+#else
   for (i = 0; ; i++) {
     if (s[i] == (char)c) {
       ret = (char*)&s[i];
     }
     if (s[i] == 0) break;
   }
+#endif
   REPORT_READ_RANGE(s, i + 1);
   return ret;
 }
 
 static NOINLINE size_t Replace_strlen(EXTRA_REPLACE_PARAMS const char *s) {
   size_t i = 0;
-  for (i = 0; s[i]; i++) {
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Find(s, (size_t)-1, 0, 1);
+#endif
+  for (; s[i]; i++) {
   }
   REPORT_READ_RANGE(s, i + 1);
   return i;
@@ -108,8 +228,11 @@ static NOINLINE size_t Replace_strlen(EXTRA_REPLACE_PARAMS const char *s) {
 
 static NOINLINE char *Replace_memcpy(EXTRA_REPLACE_PARAMS char *dst,
                                      const char *src, size_t len) {
-  size_t i;
-  for (i = 0; i < len; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2
+  i = ReplaceSse2Copy(dst, src, len, 1);
+#endif
+  for (; i < len; i++) {
     dst[i] = src[i];
   }
   REPORT_READ_RANGE(src, i);
@@ -120,13 +243,19 @@ static NOINLINE char *Replace_memcpy(EXTRA_REPLACE_PARAMS char *dst,
 static NOINLINE char *Replace_memmove(EXTRA_REPLACE_PARAMS char *dst,
                                      const char *src, size_t len) {
 
-  size_t i;
+  size_t i = 0;
   if (dst < src) {
-    for (i = 0; i < len; i++) {
+#if REPLACE_SSE2
+    i = ReplaceSse2Copy(dst, src, len, 1);
+#endif
+    for (; i < len; i++) {
       dst[i] = src[i];
     }
   } else {
-    for (i = 0; i < len; i++) {
+#if REPLACE_SSE2
+    i = ReplaceSse2Copy(dst, src, len, 0);
+#endif
+    for (; i < len; i++) {
       dst[len - i - 1] = src[len - i - 1];
     }
   }
@@ -137,9 +266,16 @@ static NOINLINE char *Replace_memmove(EXTRA_REPLACE_PARAMS char *dst,
 
 static NOINLINE int Replace_memcmp(EXTRA_REPLACE_PARAMS const unsigned char *s1,
                                      const unsigned char *s2, size_t len) {
-  size_t i;
+  size_t i = 0;
   int res = 0;
-  for (i = 0; i < len; i++) {
+#if REPLACE_SSE2_STR
+  for (; i + 16 <= len; i += 16) {
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(s1 + i));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(s2 + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x1, x2)) != 0xffff) break;
+  }
+#endif
+  for (; i < len; i++) {
     if (s1[i] != s2[i]) {
       res = (int)s1[i] - (int)s2[i];
       break;
@@ -152,8 +288,11 @@ static NOINLINE int Replace_memcmp(EXTRA_REPLACE_PARAMS const unsigned char *s1,
 
 static NOINLINE char *Replace_strcpy(EXTRA_REPLACE_PARAMS char *dst,
                                      const char *src) {
-  size_t i;
-  for (i = 0; src[i]; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Copy(dst, src, ReplaceSse2Find(src, (size_t)-1, 0, 1), 1);
+#endif
+  for (; src[i]; i++) {
     dst[i] = src[i];
   }
   dst[i] = 0;
@@ -164,8 +303,11 @@ static NOINLINE char *Replace_strcpy(EXTRA_REPLACE_PARAMS char *dst,
 
 static NOINLINE char *Replace_stpcpy(EXTRA_REPLACE_PARAMS char *dst,
                                      const char *src) {
-  size_t i;
-  for (i = 0; src[i]; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Copy(dst, src, ReplaceSse2Find(src, (size_t)-1, 0, 1), 1);
+#endif
+  for (; src[i]; i++) {
     dst[i] = src[i];
   }
   dst[i] = 0;
@@ -176,8 +318,11 @@ static NOINLINE char *Replace_stpcpy(EXTRA_REPLACE_PARAMS char *dst,
 
 static NOINLINE char *Replace_strncpy(EXTRA_REPLACE_PARAMS char *dst,
                                      const char *src, size_t n) {
-  size_t i;
-  for (i = 0; i < n; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2Copy(dst, src, ReplaceSse2Find(src, n, 0, 1), 1);
+#endif
+  for (; i < n; i++) {
     dst[i] = src[i];
     if (src[i] == 0) break;
   }
@@ -195,8 +340,11 @@ static NOINLINE int Replace_strcmp(EXTRA_REPLACE_PARAMS const char *s1,
                                    const char *s2) {
   unsigned char c1;
   unsigned char c2;
-  size_t i;
-  for (i = 0; ; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2FindMismatch(s1, s2, (size_t)-1);
+#endif
+  for (; ; i++) {
     c1 = (unsigned char)s1[i];
     c2 = (unsigned char)s2[i];
     if (c1 != c2) break;
@@ -213,8 +361,11 @@ static NOINLINE int Replace_strncmp(EXTRA_REPLACE_PARAMS const char *s1,
                                     const char *s2, size_t n) {
   unsigned char c1 = 0;
   unsigned char c2 = 0;
-  size_t i;
-  for (i = 0; i < n; i++) {
+  size_t i = 0;
+#if REPLACE_SSE2_STR
+  i = ReplaceSse2FindMismatch(s1, s2, n);
+#endif
+  for (; i < n; i++) {
     c1 = (unsigned char)s1[i];
     c2 = (unsigned char)s2[i];
     if (c1 != c2) break;
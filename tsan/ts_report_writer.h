@@ -0,0 +1,120 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_REPORT_WRITER_
+#define TS_REPORT_WRITER_
+
+#include "ts_util.h"
+#include "ts_lock.h"
+
+// -------- ReportWriter ------ {{{1
+// With --async_reports the output of a report is collected under the
+// detector's lock (see SetOutputCapture()) and queued here; a background
+// thread of the tool (the LLVM runtime or the Pin tool) calls WriteSome()
+// which prints it. A report still has to be formatted under the lock since
+// it describes the segments and locksets as they are at the moment, but
+// the threads no longer wait for the output of each line to be flushed.
+//
+// The queue holds at most --max_queued_reports reports and Put() never
+// waits for the writer. A report is a duplicate if a report with the same
+// key (the type and the top frame) was put before. When the queue is full
+// the newest queued duplicate is dropped to make room; if there is none,
+// the new report itself is dropped.
+class ReportWriter {
+ public:
+  explicit ReportWriter(size_t max_queued)
+      : max_queued_(max(max_queued, (size_t)1)), finished_(false),
+        n_dropped_(0) {
+    InitOutputCapture();
+  }
+
+  // Returns false if the report was dropped.
+  bool Put(uint64_t key, const string &text) {
+    ScopedLock lock(&lock_);
+    bool is_dup = seen_keys_[key]++ > 0;
+    if (finished_) {
+      PrintUncaptured(text);
+      return true;
+    }
+    if (queue_.size() >= max_queued_) {
+      size_t i = queue_.size();
+      while (i > 0 && !queue_[i - 1].is_dup)
+        i--;
+      n_dropped_++;
+      if (i == 0) return false;
+      delete queue_[i - 1].text;
+      queue_.erase(queue_.begin() + (i - 1));
+    }
+    Entry entry = {new string(text), is_dup};
+    queue_.push_back(entry);
+    return true;
+  }
+
+  // Prints the queued reports, returns how many.
+  size_t WriteSome() {
+    ScopedLock write_lock(&write_lock_);
+    vector<Entry> entries;
+    {
+      ScopedLock lock(&lock_);
+      entries.swap(queue_);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+      PrintUncaptured(*entries[i].text);
+      delete entries[i].text;
+    }
+    return entries.size();
+  }
+
+  // Prints the rest of the queue; the reports put after this are printed
+  // right away.
+  void Fini() {
+    WriteSome();
+    ScopedLock lock(&lock_);
+    finished_ = true;
+    if (n_dropped_)
+      Report("INFO: ThreadSanitizer dropped %ld report(s), the report queue "
+             "was full (--max_queued_reports=%ld)\n",
+             n_dropped_, max_queued_);
+  }
+
+ private:
+  struct Entry {
+    string *text;
+    bool is_dup;
+  };
+
+  size_t max_queued_;
+  TSLock lock_;
+  TSLock write_lock_;            // Taken by the writers.
+  vector<Entry> queue_;          // Protected by lock_.
+  map<uint64_t, int> seen_keys_; // Protected by lock_.
+  bool finished_;                // Protected by lock_.
+  uintptr_t n_dropped_;          // Protected by lock_.
+};
+
+// end. {{{1
+#endif  // TS_REPORT_WRITER_
@@ -0,0 +1,159 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_SHADOW_STACK_
+#define TS_SHADOW_STACK_
+
+#include "ts_util.h"
+
+// -------- ShadowStack ------ {{{1
+// The (pc, sp) stack of the routine calls, as the binary translators see
+// them. A frame is popped when the program's sp gets above (or equal to)
+// the sp of the frame, see Unwind().
+//
+// The frames are stored as 32-bit deltas from the frame below: the pcs of
+// nearby frames are usually in one module and the sps differ by the size of
+// a stack frame. A frame which does not fit (the first one, a jump to
+// another stack, a pc in a far away module) is marked with kEscape and
+// the full values of the frame below go to escapes_.
+// The top frame is kept unpacked, so Push(), Pop() and the check in Unwind()
+// that nothing has returned do not touch the packed frames at all.
+class ShadowStack {
+ public:
+  ShadowStack() : top_pc_(0), top_sp_(0) { }
+
+  size_t size() const { return frames_.size(); }
+  bool empty() const { return frames_.empty(); }
+
+  uintptr_t top_pc() const {
+    DCHECK(!empty());
+    return top_pc_;
+  }
+
+  uintptr_t top_sp() const {
+    DCHECK(!empty());
+    return top_sp_;
+  }
+
+  void Push(uintptr_t pc, uintptr_t sp) {
+    Frame frame;
+    intptr_t pc_delta = (intptr_t)(pc - top_pc_);
+    uintptr_t sp_delta = top_sp_ - sp;
+    if (!empty() && pc_delta != kEscape && pc_delta == (int32_t)pc_delta &&
+        sp <= top_sp_ && sp_delta == (uint32_t)sp_delta) {
+      frame.pc_delta = (int32_t)pc_delta;
+      frame.sp_delta = (uint32_t)sp_delta;
+    } else {
+      frame.pc_delta = kEscape;
+      frame.sp_delta = 0;
+      escapes_.push_back(top_pc_);
+      escapes_.push_back(top_sp_);
+    }
+    frames_.push_back(frame);
+    top_pc_ = pc;
+    top_sp_ = sp;
+  }
+
+  void Pop() {
+    DCHECK(!empty());
+    const Frame &frame = frames_.back();
+    if (frame.pc_delta == kEscape) {
+      top_sp_ = escapes_.back();
+      escapes_.pop_back();
+      top_pc_ = escapes_.back();
+      escapes_.pop_back();
+    } else {
+      top_pc_ -= (intptr_t)frame.pc_delta;
+      top_sp_ += frame.sp_delta;
+    }
+    frames_.pop_back();
+  }
+
+  // Returns the number of the top frames which have returned if the
+  // program's stack pointer is now 'sp', i.e. the frames that the caller
+  // has to Pop(). Looks only at the frames it counts.
+  size_t Unwind(uintptr_t sp) const {
+    if (empty() || sp < top_sp_) return 0;
+    size_t n = frames_.size();
+    size_t i = n;
+    size_t escape = escapes_.size();
+    uintptr_t cur_sp = top_sp_;
+    while (i > 0 && sp >= cur_sp) {
+      const Frame &frame = frames_[--i];
+      if (frame.pc_delta == kEscape) {
+        escape -= 2;
+        cur_sp = escapes_[escape + 1];
+      } else {
+        cur_sp += frame.sp_delta;
+      }
+    }
+    return n - i;
+  }
+
+  // Fills 'pcs' and 'sps' (if not NULL) with size() elements, the bottom
+  // frame first. It unpacks the whole stack, so use it for printing.
+  void GetFrames(uintptr_t *pcs, uintptr_t *sps) const {
+    uintptr_t pc = top_pc_, sp = top_sp_;
+    size_t escape = escapes_.size();
+    for (size_t i = frames_.size(); i > 0; i--) {
+      if (pcs) pcs[i - 1] = pc;
+      if (sps) sps[i - 1] = sp;
+      const Frame &frame = frames_[i - 1];
+      if (frame.pc_delta == kEscape) {
+        escape -= 2;
+        pc = escapes_[escape];
+        sp = escapes_[escape + 1];
+      } else {
+        pc -= (intptr_t)frame.pc_delta;
+        sp += frame.sp_delta;
+      }
+    }
+  }
+
+  void Clear() {
+    frames_.clear();
+    escapes_.clear();
+    top_pc_ = top_sp_ = 0;
+  }
+
+ private:
+  enum { kEscape = -0x7fffffff - 1 };
+
+  // The difference of this frame and the one below.
+  struct Frame {
+    int32_t pc_delta;
+    uint32_t sp_delta;
+  };
+
+  vector<Frame> frames_;
+  vector<uintptr_t> escapes_;  // (pc, sp) pairs.
+  uintptr_t top_pc_;
+  uintptr_t top_sp_;
+};
+
+// end. {{{1
+#endif  // TS_SHADOW_STACK_
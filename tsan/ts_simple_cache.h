@@ -31,6 +31,15 @@
 #define TS_SIMPLE_CACHE_
 
 #include "ts_util.h"
+#include "ts_lock.h"
+
+// Not in the Valgrind tool: it has no libc, which <emmintrin.h> includes.
+#if defined(__SSE2__) && !defined(TS_VALGRIND)
+# define TS_SIMPLE_CACHE_SSE2 1
+# include <emmintrin.h>
+#else
+# define TS_SIMPLE_CACHE_SSE2 0
+#endif
 
 // Few simple 'cache' classes.
 // -------- PtrToBoolCache ------ {{{1
@@ -66,6 +75,94 @@ class PtrToBoolCache {
   uint32_t bits_[(kSize + 31) / 32];
 };
 
+// -------- PcToBoolMap ------ {{{1
+// Maps a pc to a boolean, e.g. the verdict of the ignore lists for it.
+// Unlike PtrToBoolCache it does not forget: open addressing with linear
+// probing over 1 << kSizeLog slots.
+// Lock-free: a slot is claimed by a CAS on its key, then the value is
+// published with a release store; a reader which sees the key before the
+// value treats it as a miss. When the table is 3/4 full Insert() does
+// nothing, so the callers recompute the verdicts of the new pcs.
+template <int kSizeLog>
+class PcToBoolMap {
+ public:
+  PcToBoolMap() {
+    memset(this, 0, sizeof(*this));
+  }
+
+  bool Lookup(uintptr_t pc, bool *val) {
+    if (pc == 0) return false;
+    for (uintptr_t i = Hash(pc); ; i = (i + 1) & kMask) {
+      uintptr_t k = Load(&slots_[i].key);
+      if (k == pc) {
+        uintptr_t v = Load(&slots_[i].val);
+        if (v == kUnknown) return false;
+        *val = v == kTrue;
+        return true;
+      }
+      if (k == 0) return false;
+    }
+  }
+
+  // Inserting the same pc twice is harmless as long as the values agree.
+  void Insert(uintptr_t pc, bool val) {
+    if (pc == 0 || size() >= kSize / 4 * 3) return;
+    for (uintptr_t i = Hash(pc); ; i = (i + 1) & kMask) {
+      uintptr_t k = Load(&slots_[i].key);
+      if (k == 0) {
+        if (AtomicCompareAndSwap(&slots_[i].key, 0, pc)) {
+          NoBarrier_AtomicIncrement(&n_used_);
+          k = pc;
+        } else {
+          k = Load(&slots_[i].key);  // Somebody took it, maybe for this pc.
+        }
+      }
+      if (k == pc) {
+        ReleaseStore(&slots_[i].val, val ? kTrue : kFalse);
+        return;
+      }
+    }
+  }
+
+  size_t size() { return *(volatile int32_t*)&n_used_; }
+
+  // Appends the known verdicts to 'res'.
+  void GetAll(vector<pair<uintptr_t, bool> > *res) {
+    for (uintptr_t i = 0; i < kSize; i++) {
+      uintptr_t k = Load(&slots_[i].key);
+      uintptr_t v = Load(&slots_[i].val);
+      if (k != 0 && v != kUnknown)
+        res->push_back(make_pair(k, v == kTrue));
+    }
+  }
+
+ private:
+  enum {
+    kSize = 1 << kSizeLog,
+    kMask = kSize - 1,
+    kUnknown = 0,
+    kFalse = 1,
+    kTrue = 2
+  };
+
+  struct Slot {
+    uintptr_t key;  // 0 means empty.
+    uintptr_t val;  // kUnknown, kFalse or kTrue.
+  };
+
+  static INLINE uintptr_t Load(uintptr_t *p) {
+    return *(volatile uintptr_t*)p;
+  }
+
+  static INLINE uintptr_t Hash(uintptr_t pc) {
+    uint64_t h = (uint64_t)pc * 0x9E3779B97F4A7C15ULL;
+    return (uintptr_t)(h >> (64 - kSizeLog));
+  }
+
+  Slot slots_[kSize];
+  int32_t n_used_;
+};
+
 // -------- IntPairToBoolCache ------ {{{1
 // Maps two integers to a boolean.
 // The second integer should be less than 1^31.
@@ -105,6 +202,234 @@ class IntPairToBoolCache {
   uint32_t arr_[kSize * 2];
 };
 
+// -------- SetAssocIntPairToIntCache ------ {{{1
+// Maps two integers to an integer. There are 1 << kSetsLog sets of 4
+// entries (64 bytes), the set of a pair is picked by a multiplicative hash
+// and the 4 keys of the set are compared at once (with SSE2).
+// A new entry goes to the front of its set and the last one is evicted.
+// If kAtomic, Lookup() and Insert() may run concurrently w/o locks, as for
+// AtomicIntPairToIntCache: a set is guarded by a sequence number which is
+// odd while the set is being written, a reader misses if the set changed
+// under it and a writer which finds the set busy drops its update. So the
+// value for a given key must never change. Otherwise a hit also moves the
+// entry to the front, so the entries of a set are in the LRU order.
+template <int kSetsLog, bool kAtomic = false>
+class SetAssocIntPairToIntCache {
+ public:
+  static const int kWays = 4;
+
+  SetAssocIntPairToIntCache() {
+    Flush();
+  }
+
+  // If kAtomic, must not run concurrently with other operations.
+  void Flush() {
+    memset(sets_, 0, sizeof(sets_));
+  }
+
+  void Insert(int32_t a, int32_t b, int32_t val) {
+    uint64_t key = Key(a, b);
+    Set *s = &sets_[Idx(key)];
+    if (!kAtomic) {
+      Put(s, key, val);
+      return;
+    }
+    uintptr_t seq = Load(&s->seq);
+    if (seq & 1) return;
+    if (!AtomicCompareAndSwap(&s->seq, seq, seq + 1)) return;
+    Put(s, key, val);
+    ReleaseStore(&s->seq, seq + 2);
+  }
+
+  bool Lookup(int32_t a, int32_t b, int32_t *val) {
+    uint64_t key = Key(a, b);
+    Set *s = &sets_[Idx(key)];
+    if (!kAtomic) {
+      int i = Find(s, key);
+      if (i < 0) return false;
+      *val = s->vals[i];
+      MoveToFront(s, i, key, *val);
+      return true;
+    }
+    uintptr_t seq = Load(&s->seq);
+    if (seq & 1) return false;
+    CompilerBarrier();
+    int i = Find(s, key);
+    int32_t res = i < 0 ? 0 : s->vals[i];
+    CompilerBarrier();
+    if (i < 0 || Load(&s->seq) != seq) return false;
+    *val = res;
+    return true;
+  }
+
+ private:
+  struct Set {
+    uint64_t keys[kWays];  // keys[0..n) are valid.
+    int32_t vals[kWays];
+    uintptr_t seq;  // Used only if kAtomic.
+    int32_t n;
+  };
+
+  static INLINE uint64_t Key(int32_t a, int32_t b) {
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+  }
+
+  static INLINE uint32_t Idx(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - kSetsLog));
+  }
+
+  // Returns the index of 'key' in s->keys[0..n) or -1.
+  static INLINE int Find(const Set *s, uint64_t key) {
+    int n = s->n;
+#if TS_SIMPLE_CACHE_SSE2
+    __m128i k = _mm_set1_epi64x(key);
+    __m128i e0 = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i*)&s->keys[0]), k);
+    __m128i e1 = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i*)&s->keys[2]), k);
+    // A key is equal if both of its halves are.
+    e0 = _mm_and_si128(e0, _mm_shuffle_epi32(e0, _MM_SHUFFLE(2, 3, 0, 1)));
+    e1 = _mm_and_si128(e1, _mm_shuffle_epi32(e1, _MM_SHUFFLE(2, 3, 0, 1)));
+    int m = _mm_movemask_pd(_mm_castsi128_pd(e0)) |
+            (_mm_movemask_pd(_mm_castsi128_pd(e1)) << 2);
+    m &= (1 << n) - 1;
+    if (!m) return -1;
+    return (m & 1) ? 0 : (m & 2) ? 1 : (m & 4) ? 2 : 3;
+#else
+    for (int i = 0; i < n; i++) {
+      if (s->keys[i] == key) return i;
+    }
+    return -1;
+#endif
+  }
+
+  // Puts (key, val) into s->keys[0], shifting s->keys[0..i) by one.
+  static INLINE void MoveToFront(Set *s, int i, uint64_t key, int32_t val) {
+    for (; i > 0; i--) {
+      s->keys[i] = s->keys[i - 1];
+      s->vals[i] = s->vals[i - 1];
+    }
+    s->keys[0] = key;
+    s->vals[0] = val;
+  }
+
+  static INLINE void Put(Set *s, uint64_t key, int32_t val) {
+    int i = Find(s, key);
+    if (i < 0)
+      i = s->n < kWays ? s->n++ : kWays - 1;
+    MoveToFront(s, i, key, val);
+  }
+
+  static INLINE uintptr_t Load(uintptr_t *p) {
+    return *(volatile uintptr_t*)p;
+  }
+
+  // Loads are not reordered with other loads on x86, see ReleaseStore().
+  static INLINE void CompilerBarrier() {
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : : "memory");
+#elif defined(_MSC_VER)
+    _ReadWriteBarrier();
+#endif
+  }
+
+  Set sets_[1 << kSetsLog];
+};
+
+// -------- SetAssocIntPairToBoolCache ------ {{{1
+// Maps two integers to a boolean, see SetAssocIntPairToIntCache.
+template <int kSetsLog>
+class SetAssocIntPairToBoolCache {
+ public:
+  void Flush() {
+    cache_.Flush();
+  }
+  void Insert(uint32_t a, uint32_t b, bool val) {
+    cache_.Insert(a, b, val);
+  }
+  bool Lookup(uint32_t a, uint32_t b, bool *val) {
+    int32_t res;
+    if (!cache_.Lookup(a, b, &res)) return false;
+    *val = res != 0;
+    return true;
+  }
+ private:
+  SetAssocIntPairToIntCache<kSetsLog> cache_;
+};
+
+// -------- AtomicIntPairToIntCache ------ {{{1
+// Maps two integers to an integer.
+// Lookup() and Insert() may run concurrently w/o locks. Each entry is
+// guarded by a sequence number which is odd while the entry is being
+// written. A reader misses if the entry changed under it; a writer which
+// finds the entry busy drops its update.
+// The value for a given key must never change (e.g. the cache memoizes a
+// pure function), otherwise a lookup may return a stale value.
+template <int32_t kSize>
+class AtomicIntPairToIntCache {
+ public:
+  AtomicIntPairToIntCache() {
+    Flush();
+  }
+
+  // Must not run concurrently with other operations.
+  void Flush() {
+    memset(arr_, 0, sizeof(arr_));
+  }
+
+  void Insert(int32_t a, int32_t b, int32_t val) {
+    Entry *e = &arr_[idx(a, b)];
+    uintptr_t seq = Load(&e->seq);
+    if (seq & 1) return;
+    if (!AtomicCompareAndSwap(&e->seq, seq, seq + 1)) return;
+    e->a = a;
+    e->b = b;
+    e->val = val;
+    ReleaseStore(&e->seq, seq + 2);
+  }
+
+  bool Lookup(int32_t a, int32_t b, int32_t *val) {
+    Entry *e = &arr_[idx(a, b)];
+    uintptr_t seq = Load(&e->seq);
+    // 0 means the entry was never written (0 is a valid key).
+    if (seq == 0 || (seq & 1)) return false;
+    CompilerBarrier();
+    volatile Entry *ve = e;
+    bool hit = ve->a == a && ve->b == b;
+    int32_t res = ve->val;
+    CompilerBarrier();
+    if (!hit || Load(&e->seq) != seq) return false;
+    *val = res;
+    return true;
+  }
+
+ private:
+  struct Entry {
+    uintptr_t seq;
+    int32_t a, b, val;
+  };
+
+  static INLINE uintptr_t Load(uintptr_t *p) {
+    return *(volatile uintptr_t*)p;
+  }
+
+  // Loads are not reordered with other loads on x86, see ReleaseStore().
+  static INLINE void CompilerBarrier() {
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : : "memory");
+#elif defined(_MSC_VER)
+    _ReadWriteBarrier();
+#endif
+  }
+
+  uint32_t idx(int32_t a, int32_t b) {
+    return ((uint32_t)a ^ (((uint32_t)b >> 16) | ((uint32_t)b << 16)))
+        % kSize;
+  }
+
+  Entry arr_[kSize];
+};
+
 // end. {{{1
 #endif  // TS_SIMPLE_CACHE_
 // vim:shiftwidth=2:softtabstop=2:expandtab:tw=80
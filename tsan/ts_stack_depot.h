@@ -0,0 +1,199 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_STACK_DEPOT_
+#define TS_STACK_DEPOT_
+
+#include "ts_util.h"
+#include "ts_lock.h"
+
+// -------- StackDepot ------ {{{1
+// Stores each distinct stack trace (an array of PCs) once and gives it a
+// 32-bit id. Id 0 is the empty stack.
+// Stacks are never removed, so an id stays valid until the end.
+//
+// Put() and Get() take no locks and may run concurrently:
+//  - a stack is a node in a hash bucket list; a node is fully written
+//    before it is pushed to the list with a CAS and is never changed after;
+//  - nodes are allocated from chunks by an atomic bump of the chunk offset;
+//  - the id -> node directory is filled before the node is published.
+// Two threads putting the same new stack may race; the loser finds the
+// winner's node on the retry and its own node is wasted.
+class StackDepot {
+ public:
+  StackDepot() {
+    memset(this, 0, sizeof(*this));
+    buckets_ = new uintptr_t[kNumBuckets];
+    memset(buckets_, 0, kNumBuckets * sizeof(uintptr_t));
+    dir_ = new uintptr_t[kDirSize];
+    memset(dir_, 0, kDirSize * sizeof(uintptr_t));
+    n_ids_ = 1;  // Id 0 is reserved for the empty stack.
+  }
+
+  // Returns the id of the stack pcs[0..n-1].
+  uint32_t Put(const uintptr_t *pcs, size_t n) {
+    if (n == 0) return 0;
+    uint32_t hash = Hash(pcs, n);
+    uintptr_t *bucket = &buckets_[hash % kNumBuckets];
+    Node *head = (Node*)Load(bucket);
+    Node *node = Find(head, NULL, hash, pcs, n);
+    if (node) return node->id;
+
+    node = (Node*)Allocate(sizeof(Node) + (n - 1) * sizeof(uintptr_t));
+    node->hash = hash;
+    node->size = n;
+    memcpy(node->pcs, pcs, n * sizeof(uintptr_t));
+    node->id = NoBarrier_AtomicIncrement(&n_ids_) - 1;
+    CHECK(node->id / kDirChunk < (uint32_t)kDirSize);
+    SetNode(node->id, node);
+    for (;;) {
+      node->next = head;
+      if (AtomicCompareAndSwap(bucket, (uintptr_t)head, (uintptr_t)node))
+        break;
+      // Somebody pushed to this bucket; check the new nodes.
+      Node *new_head = (Node*)Load(bucket);
+      Node *other = Find(new_head, head, hash, pcs, n);
+      if (other) return other->id;
+      head = new_head;
+    }
+    NoBarrier_AtomicIncrement(&n_stacks_);
+    return node->id;
+  }
+
+  // Returns the PCs of the stack and sets *n to its size.
+  // Returns NULL and sets *n to 0 for id 0.
+  const uintptr_t *Get(uint32_t id, size_t *n) const {
+    if (id == 0) {
+      *n = 0;
+      return NULL;
+    }
+    uintptr_t *chunk = (uintptr_t*)Load(&dir_[id / kDirChunk]);
+    DCHECK(chunk);
+    Node *node = (Node*)Load(&chunk[id % kDirChunk]);
+    DCHECK(node && node->id == id);
+    *n = node->size;
+    return node->pcs;
+  }
+
+  size_t NumberOfStacks() const { return n_stacks_; }
+  size_t AllocatedBytes() const {
+    return (size_t)n_chunks_ * kChunkSize +
+        (kNumBuckets + kDirSize) * sizeof(uintptr_t);
+  }
+
+ private:
+  enum {
+    kNumBuckets = TSAN_DEBUG ? (1 << 10) : (1 << 16),
+    kDirChunk = 1 << 16,
+    kDirSize = 1 << 15,
+    kChunkSize = 1 << 20
+  };
+
+  struct Node {
+    Node *next;
+    uint32_t hash;
+    uint32_t id;
+    uintptr_t size;
+    uintptr_t pcs[1];  // 'size' elements.
+  };
+
+  struct Chunk {
+    int32_t used;
+    int32_t size;
+    char *mem;
+  };
+
+  static INLINE uintptr_t Load(const uintptr_t *p) {
+    return *(const volatile uintptr_t*)p;
+  }
+
+  static INLINE uint32_t Hash(const uintptr_t *pcs, size_t n) {
+    uint64_t h = n;
+    for (size_t i = 0; i < n; i++)
+      h = (h ^ (uint64_t)pcs[i]) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) ^ (uint32_t)h;
+  }
+
+  // Searches the list from 'node' until 'end'.
+  static Node *Find(Node *node, Node *end, uint32_t hash,
+                    const uintptr_t *pcs, size_t n) {
+    for (; node != end; node = node->next) {
+      if (node->hash == hash && node->size == n &&
+          memcmp(node->pcs, pcs, n * sizeof(uintptr_t)) == 0)
+        return node;
+    }
+    return NULL;
+  }
+
+  void SetNode(uint32_t id, Node *node) {
+    uintptr_t *slot = &dir_[id / kDirChunk];
+    if (Load(slot) == 0) {
+      uintptr_t *chunk = new uintptr_t[kDirChunk];
+      memset(chunk, 0, kDirChunk * sizeof(uintptr_t));
+      if (!AtomicCompareAndSwap(slot, 0, (uintptr_t)chunk))
+        delete [] chunk;
+    }
+    uintptr_t *chunk = (uintptr_t*)Load(slot);
+    ReleaseStore(&chunk[id % kDirChunk], (uintptr_t)node);
+  }
+
+  void *Allocate(size_t size) {
+    size = (size + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    CHECK(size <= kChunkSize);
+    for (;;) {
+      Chunk *c = (Chunk*)Load(&cur_chunk_);
+      if (c) {
+        int32_t end = NoBarrier_AtomicAdd(&c->used, size);
+        if (end <= c->size)
+          return c->mem + end - size;
+      }
+      // The chunk is full (or there is none yet); install a new one.
+      // Chunks are never freed: nodes are immutable and live forever.
+      Chunk *new_c = new Chunk;
+      new_c->used = 0;
+      new_c->size = kChunkSize;
+      new_c->mem = new char[kChunkSize];
+      if (AtomicCompareAndSwap(&cur_chunk_, (uintptr_t)c, (uintptr_t)new_c)) {
+        NoBarrier_AtomicIncrement(&n_chunks_);
+      } else {
+        delete [] new_c->mem;
+        delete new_c;
+      }
+    }
+  }
+
+  uintptr_t *buckets_;  // Heads of the Node lists.
+  uintptr_t *dir_;      // dir_[id / kDirChunk][id % kDirChunk] is a Node.
+  uintptr_t cur_chunk_;
+  int32_t n_ids_;
+  int32_t n_stacks_;
+  int32_t n_chunks_;
+};
+
+// end. {{{1
+#endif  // TS_STACK_DEPOT_
@@ -44,6 +44,7 @@ struct ThreadLocalStats {
   uintptr_t memory_access_sizes[18];
   uintptr_t events[LAST_EVENT];
   uintptr_t unlocked_access_ok;
+  uintptr_t sharded_access_ok;
   uintptr_t n_fast_access1, n_fast_access2, n_fast_access4, n_fast_access8,
             n_slow_access1, n_slow_access2, n_slow_access4, n_slow_access8,
             n_very_slow_access, n_access_slow_iter;
@@ -52,7 +53,8 @@ struct ThreadLocalStats {
   uintptr_t locks_per_trace[16];
   uintptr_t locked_access[8];
   uintptr_t history_uses_same_segment, history_creates_new_segment,
-            history_reuses_segment, history_uses_preallocated_segment;
+            history_reuses_segment, history_uses_preallocated_segment,
+            history_sblock_repeated, history_stack_cached;
 
   uintptr_t msm_branch_count[16];
 
@@ -61,19 +63,206 @@ struct ThreadLocalStats {
   uintptr_t access_to_first_4g;
 };
 
+// --latency_stats: the places we time; see ScopedLatency.
+enum LatencyKind {
+  LATENCY_MOP_FAST,     // A memory access handled w/o the global lock.
+  LATENCY_MOP_SLOW,     // ... with sharded or global locking.
+  LATENCY_SBLOCK_ENTER,
+  LATENCY_LOCK,
+  LATENCY_UNLOCK,
+  LATENCY_REPORT,       // Detector::AddReport().
+  LATENCY_FLUSH,        // ForgetAllStateAndStartOver().
+  LATENCY_INCR_FLUSH,   // One --incremental_flush slice.
+  LATENCY_LAST
+};
+
+// Bucket i counts the samples of [2^i, 2^(i+1)) cycles.
+const int kNumLatencyBuckets = 40;
+
+static inline int LatencyBucket(uint64_t cycles) {
+  int res = 0;
+  while (cycles > 1 && res < kNumLatencyBuckets - 1) {
+    cycles >>= 1;
+    res++;
+  }
+  return res;
+}
+
+// Statistic counters which are not bound to a thread (e.g. the ones
+// updated by VTS or LockSet). Stats keeps a cache line aligned copy of them
+// for every shard of threads (see Stats::Shard()), so that threads don't
+// fight for the same cache lines. The copies are summed up only when the
+// stats are printed.
+struct SharedStats {
+  uintptr_t n_vts_hb;
+  uintptr_t n_vts_hb_cached;
+  uintptr_t n_vts_hb_cached_l1;  // The part of n_vts_hb_cached.
+  uintptr_t n_vts_hb_epoch;
+  uintptr_t n_seg_hb;
+
+  uintptr_t ls_add_to_empty, ls_add_to_singleton, ls_add_to_multi,
+            ls_remove_from_singleton, ls_remove_from_multi,
+            ls_add_cache_hit, ls_add_cache_miss,
+            ls_rem_cache_hit, ls_rem_cache_miss,
+            ls_int_cache_hit, ls_int_cache_miss, ls_intersect_bitset,
+            ls_size_2, ls_size_3, ls_size_4, ls_size_5, ls_size_other;
+
+  uintptr_t cache_new_line;
+  uintptr_t cache_delete_empty_line;
+  uintptr_t cache_fetch;
+  uintptr_t cache_compress;
+  uintptr_t cache_decompress;
+  uintptr_t cache_abandon_inherited;
+  uintptr_t parked_line_park, parked_line_steal;
+
+  uintptr_t mops_total;
+  uintptr_t mops_uniq;
+
+  uintptr_t vts_create_big, vts_create_small,
+            vts_clone, vts_delete_small, vts_delete_big,
+            vts_total_delete, vts_total_create,
+            vts_delta_create, vts_delta_materialize;
+  uintptr_t tree_clock_join, tree_clock_copy, tree_clock_reset;
+
+  uintptr_t ss_create, ss_reuse, ss_find, ss_recycle;
+  uintptr_t ss_size_2, ss_size_3, ss_size_4, ss_size_other;
+
+  uintptr_t sshash_calls, ss_find_locked;
+  uintptr_t ss_add_cache_hit, ss_add_cache_miss,
+            ss_rem_cache_hit, ss_rem_cache_miss;
+
+  uintptr_t seg_create, seg_reuse, seg_compact, seg_compact_trimmed;
+  uintptr_t thread_slot_reuse;
+  uintptr_t lock_segments_saved;
+
+  uintptr_t publish_set, publish_get, publish_clear;
+
+  uintptr_t pc_to_strings;
+
+  uintptr_t stack_trace_create, stack_trace_delete;
+
+  uintptr_t n_forgets;
+  uintptr_t forget_pause_total_us;
+  uintptr_t incr_flush_slices, incr_flush_lines;
+  uintptr_t incr_flush_pause_total_us;
+  uintptr_t lazy_reset_ranges, lazy_reset_lines, lazy_reset_swept;
+  uintptr_t lazy_stack_resets, lazy_stack_reset_bytes;
+  uintptr_t mem_gov_drop_history, mem_gov_compress, mem_gov_evict;
+
+  uintptr_t lock_sites[20];
+
+  uintptr_t tleb_flush[20];
+  uintptr_t tleb_grow;
+
+  uintptr_t ignore_below_cache_miss;
+
+  uintptr_t try_acquire_line_spin;
+  uintptr_t futex_wait;
+  uintptr_t read_proc_self_stats;
+  uintptr_t suppression_cache_hit, suppression_cache_miss;
+  uintptr_t race_pc_filter_hit;
+  uintptr_t pcq_merges;
+  uintptr_t lock_order_edges, lock_order_reorders, lock_order_cache_hit;
+  uintptr_t lock_order_removed;
+  uintptr_t locks_recycled;
+  uintptr_t reader_releases_joined;
+  uintptr_t symbol_cache_hit, symbol_cache_miss;
+
+  uintptr_t latency[LATENCY_LAST][kNumLatencyBuckets];
+  uintptr_t latency_cycles[LATENCY_LAST];
+  uintptr_t hw_counters[LATENCY_LAST][HW_LAST];
+};
+
 // Statistic counters for the entire tool, including aggregated
-// ThreadLocalStats (which are made private so that one can not
-// increment them using the global stats object).
-struct Stats : private ThreadLocalStats {
+// ThreadLocalStats and SharedStats (which are made private so that one can
+// not increment them using the global stats object; use Shard() instead).
+struct Stats : private ThreadLocalStats, private SharedStats {
   Stats() {
     memset(this, 0, sizeof(*this));
-    ANNOTATE_BENIGN_RACE(&vts_clone, "Race on vts_clone");
-    ANNOTATE_BENIGN_RACE(&ignore_below_cache_miss,
-                         "Race on ignore_below_cache_miss");
+    shards_mem_ = new char[sizeof(PaddedSharedStats) * kNumShards +
+                           kCacheLineSize];
+    memset(shards_mem_, 0,
+           sizeof(PaddedSharedStats) * kNumShards + kCacheLineSize);
+    uintptr_t aligned = ((uintptr_t)shards_mem_ + kCacheLineSize - 1) &
+        ~(uintptr_t)(kCacheLineSize - 1);
+    shards_ = (PaddedSharedStats*)aligned;
+    // Threads which share a shard race on it.
+    ANNOTATE_BENIGN_RACE_SIZED(shards_, sizeof(PaddedSharedStats) * kNumShards,
+                               "Race on Stats::shards_");
     ANNOTATE_BENIGN_RACE_SIZED(msm_branch_count, sizeof(msm_branch_count),
                                "Race on msm_branch_count[]");
   }
 
+  // The shard of SharedStats to be updated by the current thread.
+  INLINE SharedStats *Shard() { return &shards_[ShardIndex()].stats; }
+
+  void AddLatency(LatencyKind kind, uint64_t cycles) {
+    SharedStats *shard = Shard();
+    shard->latency[kind][LatencyBucket(cycles)]++;
+    shard->latency_cycles[kind] += cycles;
+  }
+
+  void AddHwCounters(LatencyKind kind, const uint64_t *start,
+                     const uint64_t *end) {
+    SharedStats *shard = Shard();
+    for (int i = 0; i < HW_LAST; i++)
+      shard->hw_counters[kind][i] += end[i] - start[i];
+  }
+
+  static const char *LatencyKindName(int kind) {
+    static const char *kNames[LATENCY_LAST] = {
+      "mop fast", "mop slow", "sblock enter", "lock", "unlock",
+      "report", "flush", "incr flush"
+    };
+    return kNames[kind];
+  }
+
+  void PrintLatencyStats() {
+    Aggregate();
+    bool printed_header = false;
+    for (int kind = 0; kind < LATENCY_LAST; kind++) {
+      uintptr_t n = 0;
+      for (int i = 0; i < kNumLatencyBuckets; i++)
+        n += latency[kind][i];
+      if (n == 0) continue;
+      if (!printed_header) {
+        Printf("   Latency in cycles (count; avg; log2 histogram):\n");
+        printed_header = true;
+      }
+      char buff[1024];
+      int pos = snprintf(buff, sizeof(buff), "    %-12s %ld; avg %ld;",
+                         LatencyKindName(kind), n, latency_cycles[kind] / n);
+      for (int i = 0; i < kNumLatencyBuckets; i++) {
+        if (latency[kind][i] == 0 || pos >= (int)sizeof(buff)) continue;
+        pos += snprintf(buff + pos, sizeof(buff) - pos, " %d:%ld",
+                        i, latency[kind][i]);
+      }
+      Printf("%s\n", buff);
+    }
+    PrintHwCounterStats();
+  }
+
+  // --hw_counters, per call of each of the latency kinds. Expects
+  // Aggregate() done.
+  void PrintHwCounterStats() {
+    bool printed_header = false;
+    for (int kind = 0; kind < LATENCY_LAST; kind++) {
+      uintptr_t n = 0;
+      for (int i = 0; i < kNumLatencyBuckets; i++)
+        n += latency[kind][i];
+      if (n == 0 || hw_counters[kind][HW_CYCLES] == 0) continue;
+      if (!printed_header) {
+        Printf("   HW counters per call (cycles; cache misses; "
+               "branch misses):\n");
+        printed_header = true;
+      }
+      Printf("    %-12s %.1f; %.3f; %.3f\n", LatencyKindName(kind),
+             (double)hw_counters[kind][HW_CYCLES] / n,
+             (double)hw_counters[kind][HW_CACHE_MISSES] / n,
+             (double)hw_counters[kind][HW_BRANCH_MISSES] / n);
+    }
+  }
+
   void Add(const ThreadLocalStats &s) {
     uintptr_t *p1 = (uintptr_t*)this;
     uintptr_t *p2 = (uintptr_t*)&s;
@@ -84,6 +273,7 @@ struct Stats : private ThreadLocalStats {
   }
 
   void PrintStats() {
+    Aggregate();
     PrintEventStats();
     Printf("   VTS: created small/big: %'ld / %'ld; "
            "deleted small/big: %'ld / %'ld; cloned: %'ld\n",
@@ -93,9 +283,16 @@ struct Stats : private ThreadLocalStats {
            vts_total_create,
            vts_total_create / (vts_create_small + vts_create_big + 1),
            vts_total_delete);
+    Printf("   VTS deltas: created: %'ld; materialized: %'ld\n",
+           vts_delta_create, vts_delta_materialize);
+    Printf("   tree clocks: join: %'ld; copy: %'ld; reset: %'ld\n",
+           tree_clock_join, tree_clock_copy, tree_clock_reset);
     Printf("   n_seg_hb        = %'ld\n", n_seg_hb);
     Printf("   n_vts_hb        = %'ld\n", n_vts_hb);
-    Printf("   n_vts_hb_cached = %'ld\n", n_vts_hb_cached);
+    Printf("   n_vts_hb_cached = %'ld (%'ld in the thread's shard)\n",
+           n_vts_hb_cached, n_vts_hb_cached_l1);
+    PrintCacheHits("HB cache", n_vts_hb_cached, n_vts_hb);
+    Printf("   n_vts_hb_epoch  = %'ld\n", n_vts_hb_epoch);
     Printf("   memory access:\n"
            "     1: %'ld / %'ld\n"
            "     2: %'ld / %'ld\n"
@@ -115,20 +312,37 @@ struct Stats : private ThreadLocalStats {
     Printf("   Publish: set: %'ld; get: %'ld; clear: %'ld\n",
            publish_set, publish_get, publish_clear);
 
-    Printf("   PcTo: all: %'ld\n", pc_to_strings);
+    Printf("   PcTo: all: %'ld; symbol cache hit/miss: %'ld %'ld\n",
+           pc_to_strings, symbol_cache_hit, symbol_cache_miss);
 
     Printf("   StackTrace: create: %'ld; delete %'ld\n",
            stack_trace_create, stack_trace_delete);
 
-    Printf("   History segments: same: %'ld; reuse: %'ld; "
-           "preallocated: %'ld; new: %'ld\n",
-           history_uses_same_segment, history_reuses_segment,
-           history_uses_preallocated_segment, history_creates_new_segment);
-    Printf("   Forget all history: %'ld\n", n_forgets);
+    Printf("   History segments: same: %'ld (repeated sblock: %'ld); "
+           "reuse: %'ld; preallocated: %'ld; new: %'ld\n",
+           history_uses_same_segment, history_sblock_repeated,
+           history_reuses_segment, history_uses_preallocated_segment,
+           history_creates_new_segment);
+    Printf("   History stacks: same as the last one of the thread: %'ld\n",
+           history_stack_cached);
+    Printf("   Forget all history: %'ld; pause: total %'ldus, max %'ldus\n",
+           n_forgets, forget_pause_total_us, forget_pause_max_us);
+    Printf("   Incremental flush: slices: %'ld; lines: %'ld; "
+           "pause: total %'ldus, max %'ldus\n",
+           incr_flush_slices, incr_flush_lines,
+           incr_flush_pause_total_us, incr_flush_pause_max_us);
+    Printf("   Lazy shadow reset: ranges: %'ld; lines: %'ld; swept: %'ld\n",
+           lazy_reset_ranges, lazy_reset_lines, lazy_reset_swept);
+    Printf("   Lazy stack reset: resets: %'ld; bytes: %'ld\n",
+           lazy_stack_resets, lazy_stack_reset_bytes);
+    Printf("   Memory governor: history drops: %'ld; line compressions: "
+           "%'ld; line evictions: %'ld\n",
+           mem_gov_drop_history, mem_gov_compress, mem_gov_evict);
 
     PrintStatsForSeg();
     PrintStatsForSS();
     PrintStatsForLS();
+    PrintLatencyStats();
   }
 
   void PrintStatsForSS() {
@@ -138,39 +352,45 @@ struct Stats : private ThreadLocalStats {
     Printf("        sizes: 2: %'ld; 3: %'ld; 4: %'ld; other: %'ld\n",
            ss_size_2, ss_size_3, ss_size_4, ss_size_other);
 
-    // SSEq is called at least (ss_find + ss_recycle) times since
-    // FindExistingOrAlocateAndCopy calls map_.find()
-    // and RecycleOneSegmentSet calls map_.erase(it)
-    // Both find() and erase(it) require at least one call to SSHash and SSEq.
-    //
-    // Apart from SSHash call locations mentioned above,
-    // SSHash is called for each AllocateAndCopy (ss_create + ss_reuse) times
-    // for insert() AFTER it has already been called
-    // by FindExistingOrAlocateAndCopy in case find() returned map_.end().
-    // Hence the factor of 2.
-    uintptr_t sseq_estimated = ss_find + ss_recycle,
-            sshash_estimated = sseq_estimated + 2 * (ss_create + ss_reuse);
-    Printf("   SSHash called %12ld times (vs. %12ld = +%d%%)\n"
-           "   SSEq   called %12ld times (vs. %12ld = +%d%%)\n",
-            sshash_calls, sshash_estimated,
-            (sshash_calls - sshash_estimated)/(sshash_estimated/100 + 1),
-            sseq_calls,   sseq_estimated,
-            (sseq_calls   - sseq_estimated  )/(sseq_estimated/100 + 1));
+    Printf("   SSHash called %12ld times; found under the shard lock: %'ld\n",
+           sshash_calls, ss_find_locked);
+    PrintCacheHits("SegmentSet cache add", ss_add_cache_hit, ss_add_cache_miss);
+    PrintCacheHits("SegmentSet cache rem", ss_rem_cache_hit, ss_rem_cache_miss);
   }
   void PrintStatsForCache() {
+    Aggregate();
     Printf("   Cache:\n"
            "    new       = %'ld\n"
            "    delete    = %'ld\n"
            "    fetch     = %'ld\n"
-           "    storage   = %'ld\n",
+           "    storage   = %'ld\n"
+           "    compress  = %'ld\n"
+           "    decompress= %'ld\n"
+           "    inherited = %'ld\n",
            cache_new_line,
            cache_delete_empty_line, cache_fetch,
-           cache_max_storage_size);
+           cache_max_storage_size,
+           cache_compress, cache_decompress,
+           cache_abandon_inherited);
+    if (parked_line_park)
+      Printf("    parked    = %'ld; stolen: %'ld\n",
+             parked_line_park, parked_line_steal);
   }
 
   void PrintStatsForSeg() {
-    Printf("   Segment: created: %'ld; reused: %'ld\n",
-           seg_create, seg_reuse);
+    Printf("   Segment: created: %'ld; reused: %'ld; "
+           "compacted: %'ld (%'ld SIDs); saved on lock events: %'ld\n",
+           seg_create, seg_reuse, seg_compact, seg_compact_trimmed,
+           lock_segments_saved);
+    if (thread_slot_reuse)
+      Printf("   Thread slots reused: %'ld\n", thread_slot_reuse);
+  }
+
+  static void PrintCacheHits(const char *name, uintptr_t hit,
+                             uintptr_t miss) {
+    uintptr_t all = hit + miss;
+    Printf("   %s: %'ld hits of %'ld (%ld%%)\n", name, hit, all,
+           all ? hit * 100 / all : 0);
   }
 
   void PrintStatsForLS() {
@@ -178,8 +398,12 @@ struct Stats : private ThreadLocalStats {
            ls_add_to_empty, ls_add_to_singleton, ls_add_to_multi);
     Printf("   LockSet rem: 1: %'ld; n : %'ld\n",
            ls_remove_from_singleton, ls_remove_from_multi);
-    Printf("   LockSet cache: add : %'ld; rem : %'ld; fast: %'ld\n",
-           ls_add_cache_hit, ls_rem_cache_hit, ls_cache_fast);
+    PrintCacheHits("LockSet cache add", ls_add_cache_hit, ls_add_cache_miss);
+    PrintCacheHits("LockSet cache rem", ls_rem_cache_hit, ls_rem_cache_miss);
+    PrintCacheHits("LockSet cache intersect",
+                   ls_int_cache_hit, ls_int_cache_miss);
+    Printf("   LockSet intersections by hot lock bits: %'ld\n",
+           ls_intersect_bitset);
     Printf("   LockSet size: 2: %'ld 3: %'ld 4: %'ld 5: %'ld other: %'ld\n",
            ls_size_2, ls_size_3, ls_size_4, ls_size_5, ls_size_other);
   }
@@ -215,6 +439,7 @@ struct Stats : private ThreadLocalStats {
     Printf("lock_sites[*]=%ld\n", total_locks);
     Printf("futex_wait   =%ld\n", futex_wait);
     Printf("unlocked_access_ok =%'ld\n", unlocked_access_ok);
+    Printf("sharded_access_ok  =%'ld\n", sharded_access_ok);
     uintptr_t all_locked_access = 0;
     for (size_t i = 0; i < TS_ARRAY_SIZE(locked_access); i++) {
       uintptr_t t = locked_access[i];
@@ -231,6 +456,7 @@ struct Stats : private ThreadLocalStats {
       if(tleb_flush[i] == 0) continue;
       Printf("tleb_flush[%ld]=%ld\n", i, tleb_flush[i]);
     }
+    if (tleb_grow) Printf("tleb_grow=%ld\n", tleb_grow);
     Printf("IgnoreBelowCache miss=%ld\n", ignore_below_cache_miss);
     for (size_t i = 0; i < TS_ARRAY_SIZE(msm_branch_count); i++) {
       if (msm_branch_count[i])
@@ -238,56 +464,65 @@ struct Stats : private ThreadLocalStats {
     }
     if (read_proc_self_stats)
       Printf("read_proc_self_stats   =%ld\n", read_proc_self_stats);
+    if (suppression_cache_miss)
+      Printf("suppression cache hit/miss: %ld %ld\n",
+             suppression_cache_hit, suppression_cache_miss);
+    if (race_pc_filter_hit)
+      Printf("race_pc_filter_hit     =%ld\n", race_pc_filter_hit);
+    if (pcq_merges)
+      Printf("pcq_merges             =%ld\n", pcq_merges);
+    if (reader_releases_joined)
+      Printf("reader_releases_joined =%ld\n", reader_releases_joined);
+    if (locks_recycled)
+      Printf("locks_recycled         =%ld\n", locks_recycled);
+    if (lock_order_edges)
+      Printf("lock_order: edges=%ld reorders=%ld cache_hit=%ld removed=%ld\n",
+             lock_order_edges, lock_order_reorders, lock_order_cache_hit,
+             lock_order_removed);
   }
 
 
 
-  uintptr_t n_vts_hb;
-  uintptr_t n_vts_hb_cached;
-  uintptr_t n_seg_hb;
-
-  uintptr_t ls_add_to_empty, ls_add_to_singleton, ls_add_to_multi,
-            ls_remove_from_singleton, ls_remove_from_multi,
-            ls_add_cache_hit, ls_rem_cache_hit,
-            ls_cache_fast,
-            ls_size_2, ls_size_3, ls_size_4, ls_size_5, ls_size_other;
-
-  uintptr_t cache_new_line;
-  uintptr_t cache_delete_empty_line;
-  uintptr_t cache_fetch;
+  // Maximums don't add up over the shards, so they live here.
   uintptr_t cache_max_storage_size;
+  uintptr_t forget_pause_max_us;
+  uintptr_t incr_flush_pause_max_us;
+
+ private:
+  // Stats::Shard() for the current thread.
+  // Threads have distinct stacks, so the address of a local variable tells
+  // them apart (we don't have TLS in every build). A thread may use a few
+  // shards and a few threads may share one; this only costs locality.
+  INLINE static uintptr_t ShardIndex() {
+    if (kNumShards == 1) return 0;
+    int local;
+    uint64_t h = ((uintptr_t)&local >> 16) * 0x9E3779B97F4A7C15ULL;
+    return (uintptr_t)(h >> 32) & (kNumShards - 1);
+  }
 
-  uintptr_t mops_total;
-  uintptr_t mops_uniq;
-
-  uintptr_t vts_create_big, vts_create_small,
-            vts_clone, vts_delete_small, vts_delete_big,
-            vts_total_delete, vts_total_create;
-
-  uintptr_t ss_create, ss_reuse, ss_find, ss_recycle;
-  uintptr_t ss_size_2, ss_size_3, ss_size_4, ss_size_other;
-
-  uintptr_t sshash_calls, sseq_calls;
-
-  uintptr_t seg_create, seg_reuse;
-
-  uintptr_t publish_set, publish_get, publish_clear;
-
-  uintptr_t pc_to_strings;
-
-  uintptr_t stack_trace_create, stack_trace_delete;
-
-  uintptr_t n_forgets;
-
-  uintptr_t lock_sites[20];
-
-  uintptr_t tleb_flush[10];
-
-  uintptr_t ignore_below_cache_miss;
+  // Sum the shards up into the SharedStats part of this object.
+  void Aggregate() {
+    SharedStats &total = *this;
+    memset(&total, 0, sizeof(SharedStats));
+    uintptr_t *dst = (uintptr_t*)&total;
+    size_t n = sizeof(SharedStats) / sizeof(uintptr_t);
+    for (size_t shard = 0; shard < kNumShards; shard++) {
+      uintptr_t *src = (uintptr_t*)&shards_[shard].stats;
+      for (size_t i = 0; i < n; i++)
+        dst[i] += src[i];
+    }
+  }
 
-  uintptr_t try_acquire_line_spin;
-  uintptr_t futex_wait;
-  uintptr_t read_proc_self_stats;
+  // Single threaded builds need just one shard.
+  static const size_t kNumShards = TS_SERIALIZED ? 1 : 64;
+  static const size_t kCacheLineSize = 64;
+  struct PaddedSharedStats {
+    SharedStats stats;
+    char padding[kCacheLineSize - sizeof(SharedStats) % kCacheLineSize];
+  };
+  // Allocated with an extra cache line to align it.
+  PaddedSharedStats *shards_;
+  char *shards_mem_;
 };
 
 
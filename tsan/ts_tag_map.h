@@ -0,0 +1,239 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_TAG_MAP_
+#define TS_TAG_MAP_
+
+#include "ts_util.h"
+#include "ts_lock.h"
+
+// -------- TagMap ------ {{{1
+// Maps a tag (an address with the lowest bit clear, e.g. a cache line tag)
+// to a pointer. Open addressing with linear probing, no per-element
+// allocations.
+//
+// Operations on different keys may run concurrently w/o locks: a slot is
+// claimed by a CAS on its key and freed by storing a tombstone.
+// Operations on the same key must not run concurrently (the Cache
+// guarantees this since a tag is accessed only by the owner of its cache
+// slot).
+// When the table becomes half full it is rehashed. Rehashing blocks new
+// operations and waits for the running ones to finish.
+template <class T>
+class TagMap {
+ public:
+  TagMap() {
+    memset(this, 0, sizeof(*this));
+    Allocate(kInitialSizeLog);
+  }
+
+  ~TagMap() {
+    delete [] slots_;
+  }
+
+  // Returns NULL if there is no such key.
+  T *Get(uintptr_t key) {
+    ScopedOp op(this);
+    Slot *slot = Find(key);
+    return slot ? (T*)slot->val : NULL;
+  }
+
+  // The key should not be present.
+  void Insert(uintptr_t key, T *val) {
+    DCHECK((key & 1) == 0);
+    DCHECK(val);
+    {
+      ScopedOp op(this);
+      DCHECK(Find(key) == NULL);
+      uintptr_t mask = capacity_ - 1;
+      for (uintptr_t i = Hash(key) & mask; ; i = (i + 1) & mask) {
+        Slot *slot = &slots_[i];
+        uintptr_t k = Load(&slot->key);
+        if (k != kEmpty && k != kDeleted) continue;
+        if (!AtomicCompareAndSwap(&slot->key, k, key | kUsed)) continue;
+        slot->val = (uintptr_t)val;
+        NoBarrier_AtomicIncrement(&n_used_);
+        if (k == kEmpty)
+          NoBarrier_AtomicIncrement(&n_non_empty_);
+        break;
+      }
+    }
+    if (Load32(&n_non_empty_) * 2 > (int32_t)capacity_)
+      Rehash();
+  }
+
+  // Returns the removed value or NULL if there is no such key.
+  T *Erase(uintptr_t key) {
+    ScopedOp op(this);
+    Slot *slot = Find(key);
+    if (!slot) return NULL;
+    T *res = (T*)slot->val;
+    slot->val = 0;
+    ReleaseStore(&slot->key, kDeleted);
+    NoBarrier_AtomicDecrement(&n_used_);
+    return res;
+  }
+
+  size_t size() { return Load32(&n_used_); }
+
+  // Appends at most 'n' keys to 'res', looking at the slots from *pos on
+  // (and wrapping around), and advances *pos. Looks at no more than 4*n
+  // slots. The keys may be erased concurrently, so the caller has to
+  // re-check them.
+  void GetSomeKeys(uintptr_t *pos, uintptr_t n, vector<uintptr_t> *res) {
+    ScopedOp op(this);
+    uintptr_t mask = capacity_ - 1;
+    uintptr_t n_slots = min((size_t)capacity_, (size_t)n * 4);
+    uintptr_t i = *pos & mask;
+    for (uintptr_t j = 0; j < n_slots && n > 0; j++, i = (i + 1) & mask) {
+      uintptr_t k = Load(&slots_[i].key);
+      if (!(k & kUsed)) continue;
+      res->push_back(k & ~(uintptr_t)kUsed);
+      n--;
+    }
+    *pos = i;
+  }
+
+  // Must not run concurrently with other operations.
+  void GetAll(vector<T*> *res) {
+    for (uintptr_t i = 0; i < capacity_; i++) {
+      if (slots_[i].key & kUsed)
+        res->push_back((T*)slots_[i].val);
+    }
+  }
+
+  // Must not run concurrently with other operations.
+  void Clear() {
+    delete [] slots_;
+    Allocate(kInitialSizeLog);
+  }
+
+ private:
+  enum {
+    kInitialSizeLog = 10,
+    kEmpty = 0,
+    kDeleted = 2,  // Used keys have the lowest bit set, so this is not one.
+    kUsed = 1
+  };
+
+  struct Slot {
+    uintptr_t key;  // kEmpty, kDeleted or (tag | kUsed).
+    uintptr_t val;
+  };
+
+  // Counts the running operations, see Rehash().
+  class ScopedOp {
+   public:
+    explicit ScopedOp(TagMap *map) : map_(map) {
+      for (;;) {
+        NoBarrier_AtomicIncrement(&map_->n_ops_);
+        if (!Load(&map_->rehashing_))
+          break;
+        NoBarrier_AtomicDecrement(&map_->n_ops_);
+        while (Load(&map_->rehashing_))
+          YIELD();
+      }
+    }
+    ~ScopedOp() {
+      NoBarrier_AtomicDecrement(&map_->n_ops_);
+    }
+   private:
+    TagMap *map_;
+  };
+
+  static INLINE uintptr_t Load(uintptr_t *p) {
+    return *(volatile uintptr_t*)p;
+  }
+
+  static INLINE int32_t Load32(int32_t *p) {
+    return *(volatile int32_t*)p;
+  }
+
+  // Tags are aligned so the lowest bits carry no information; mix them.
+  static INLINE uintptr_t Hash(uintptr_t key) {
+    uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return (uintptr_t)(h >> 32) ^ (uintptr_t)h;
+  }
+
+  Slot *Find(uintptr_t key) {
+    uintptr_t mask = capacity_ - 1;
+    for (uintptr_t i = Hash(key) & mask; ; i = (i + 1) & mask) {
+      Slot *slot = &slots_[i];
+      uintptr_t k = Load(&slot->key);
+      if (k == (key | kUsed)) return slot;
+      if (k == kEmpty) return NULL;
+    }
+  }
+
+  void Allocate(uintptr_t size_log) {
+    capacity_ = (uintptr_t)1 << size_log;
+    slots_ = new Slot[capacity_];
+    memset(slots_, 0, capacity_ * sizeof(Slot));
+    n_used_ = n_non_empty_ = 0;
+  }
+
+  // Rebuild the table w/o tombstones. The new capacity is chosen so that the
+  // table is at most 1/4 full, which also shrinks it after many removals.
+  NOINLINE void Rehash() {
+    if (AtomicExchange(&rehashing_, 1)) {
+      // Somebody else is doing it.
+      return;
+    }
+    while (Load32(&n_ops_) != 0)
+      YIELD();
+    if (n_non_empty_ * 2 > (int32_t)capacity_) {
+      Slot *old_slots = slots_;
+      uintptr_t old_capacity = capacity_;
+      uintptr_t size_log = kInitialSizeLog;
+      while (((uintptr_t)1 << size_log) < (uintptr_t)n_used_ * 4)
+        size_log++;
+      Allocate(size_log);
+      uintptr_t mask = capacity_ - 1;
+      for (uintptr_t j = 0; j < old_capacity; j++) {
+        if (!(old_slots[j].key & kUsed)) continue;
+        uintptr_t i = Hash(old_slots[j].key & ~(uintptr_t)kUsed) & mask;
+        while (slots_[i].key != kEmpty)
+          i = (i + 1) & mask;
+        slots_[i] = old_slots[j];
+        n_used_++;
+        n_non_empty_++;
+      }
+      delete [] old_slots;
+    }
+    ReleaseStore(&rehashing_, 0);
+  }
+
+  Slot *slots_;
+  uintptr_t capacity_;  // Always a power of two.
+  int32_t n_used_;
+  int32_t n_non_empty_;  // Used slots plus tombstones.
+  int32_t n_ops_;
+  uintptr_t rehashing_;
+};
+
+// end. {{{1
+#endif  // TS_TAG_MAP_
@@ -41,10 +41,14 @@
 // which corresponds to this Mop (i.e. create an SBLOCK).
 struct MopInfo {
  public:
+  // Larger accesses go to Detector::HandleMemoryAccessRange().
+  static const size_t kMaxSize = 16;
+
   MopInfo(uintptr_t pc, size_t size, bool is_write, bool create_sblock) {
     DCHECK(sizeof(*this) == 8);
     pc_ = pc;
-    if (size > 16) size = 16; // some instructions access more than 16 bytes.
+    // some instructions access more than 16 bytes.
+    if (size > kMaxSize) size = kMaxSize;
     size_minus1_ = size - 1;
     is_write_ = is_write;
     create_sblock_ = create_sblock;
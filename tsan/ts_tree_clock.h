@@ -0,0 +1,298 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_TREE_CLOCK_
+#define TS_TREE_CLOCK_
+
+#include "ts_util.h"
+
+// -------- TreeClock ------ {{{1
+// A vector clock stored as a tree, see
+// U. Mathur, A. Pavlogiannis, H. C. Tunc, M. Viswanathan,
+// "A Tree Clock Data Structure for Causal Orderings in Concurrent
+// Executions", ASPLOS 2022.
+//
+// The root is the thread the clock belongs to (or, for the clock of a
+// synchronization object, the thread that released it last).
+// A node u with parent p and attachment clock aclk(u) says that p learned
+// u's clock (and everything u knew at that time) when p's own clock was
+// aclk(u). Children are kept sorted by decreasing aclk.
+// So if we know p at time >= aclk(u), we know the whole subtree of u and
+// all the younger siblings of u; Join() and MonotoneCopy() skip such
+// subtrees and usually touch only the entries that actually change.
+//
+// This relies on the clocks being 'closed': the clock of thread p at time c
+// must be an upper bound of any clock that contains p:c. This is true for
+// the clocks of threads, provided that the current time of a thread is
+// never released before it is ticked, and for the clocks of sync objects
+// that are only ever assigned with MonotoneCopy().
+class TreeClock {
+ public:
+  struct Entry {
+    int32_t tid;
+    int32_t clk;
+  };
+
+  TreeClock() : root_(-1) { }
+
+  bool empty() const { return root_ < 0; }
+  size_t size() const { return nodes_.size(); }
+  int32_t root_tid() const { return nodes_[root_].tid; }
+  int32_t root_clk() const { return nodes_[root_].clk; }
+
+  // Returns 0 if 'tid' is not present.
+  int32_t Get(int32_t tid) const {
+    int32_t v = Find(tid);
+    return v < 0 ? 0 : nodes_[v].clk;
+  }
+
+  // Makes this the clock of thread 'root_tid' having the given entries.
+  // All entries are attached to the root at its current time, so this is
+  // correct only if that time has not been released yet.
+  void Reset(int32_t root_tid, const Entry *entries, size_t n) {
+    Clear();
+    root_ = GetOrCreate(root_tid);
+    for (size_t i = 0; i < n; i++) {
+      if (entries[i].tid == root_tid)
+        nodes_[root_].clk = entries[i].clk;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (entries[i].tid == root_tid) continue;
+      int32_t v = GetOrCreate(entries[i].tid);
+      nodes_[v].clk = entries[i].clk;
+      nodes_[v].aclk = nodes_[root_].clk;
+      Attach(v, root_);
+    }
+  }
+
+  void Clear() {
+    nodes_.clear();
+    index_.clear();
+    root_ = -1;
+  }
+
+  // Ticks the root.
+  void Increment() {
+    DCHECK(!empty());
+    nodes_[root_].clk++;
+  }
+
+  // Returns true if every entry of this is <= the entry of 'other'. O(1).
+  bool IsLessOrEqual(const TreeClock &other) const {
+    return empty() || root_clk() <= other.Get(root_tid());
+  }
+
+  // this = max(this, other). The updated entries are appended to 'updated'.
+  void Join(const TreeClock &other, vector<Entry> *updated) {
+    DCHECK(!empty());
+    if (other.empty()) return;
+    const Node &z = other.nodes_[other.root_];
+    if (z.clk <= Get(z.tid)) return;
+    CollectUpdatedNodes(other, false);
+    DetachUpdatedNodes(other);
+    for (size_t i = stack_.size(); i-- > 0; ) {
+      const Node &u = other.nodes_[stack_[i]];
+      int32_t v = GetOrCreate(u.tid);
+      DCHECK(v != root_);
+      nodes_[v].clk = u.clk;
+      if (updated) {
+        Entry e = {u.tid, u.clk};
+        updated->push_back(e);
+      }
+      if (stack_[i] == other.root_) {
+        nodes_[v].aclk = nodes_[root_].clk;
+        Attach(v, root_);
+      } else {
+        nodes_[v].aclk = u.aclk;
+        Attach(v, Find(other.nodes_[u.parent].tid));
+      }
+    }
+  }
+
+  // this = other. Requires this <= other.
+  void MonotoneCopy(const TreeClock &other) {
+    DCHECK(IsLessOrEqual(other));
+    if (other.empty()) return;
+    if (empty()) {
+      *this = other;
+      return;
+    }
+    // Our root must end up where 'other' has it, so walk down to it.
+    path_.clear();
+    int32_t w = other.Find(root_tid());
+    CHECK(w >= 0);
+    for (; w >= 0; w = other.nodes_[w].parent)
+      path_.push_back(w);
+    reverse(path_.begin(), path_.end());
+    CollectUpdatedNodes(other, true);
+    DetachUpdatedNodes(other);
+    for (size_t i = stack_.size(); i-- > 0; ) {
+      const Node &u = other.nodes_[stack_[i]];
+      int32_t v = GetOrCreate(u.tid);
+      nodes_[v].clk = u.clk;
+      if (stack_[i] == other.root_) {
+        Detach(v);
+        root_ = v;
+      } else {
+        nodes_[v].aclk = u.aclk;
+        Attach(v, Find(other.nodes_[u.parent].tid));
+      }
+    }
+  }
+
+  // Returns all entries sorted by tid.
+  void GetAll(vector<Entry> *res) const {
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      Entry e = {nodes_[i].tid, nodes_[i].clk};
+      res->push_back(e);
+    }
+    sort(res->begin(), res->end(), EntryLess);
+  }
+
+  static bool EntryLess(const Entry &a, const Entry &b) {
+    return a.tid < b.tid;
+  }
+
+ private:
+  struct Node {
+    int32_t tid;
+    int32_t clk;
+    int32_t aclk;
+    int32_t parent;  // Indices in nodes_, -1 if none.
+    int32_t head;    // The first (most recently attached) child.
+    int32_t next;
+    int32_t prev;
+  };
+
+  struct Frame {
+    int32_t node;
+    int32_t child;  // Next child to look at, -1 when done.
+    int32_t known;  // Our clock of the node's thread.
+  };
+
+  int32_t Find(int32_t tid) const {
+    unordered_map<int32_t, int32_t>::const_iterator it = index_.find(tid);
+    return it == index_.end() ? -1 : it->second;
+  }
+
+  int32_t GetOrCreate(int32_t tid) {
+    int32_t v = Find(tid);
+    if (v >= 0) return v;
+    Node node = {tid, 0, 0, -1, -1, -1, -1};
+    v = nodes_.size();
+    nodes_.push_back(node);
+    index_[tid] = v;
+    return v;
+  }
+
+  void Detach(int32_t v) {
+    Node &n = nodes_[v];
+    if (n.parent < 0) return;
+    if (n.prev >= 0)
+      nodes_[n.prev].next = n.next;
+    else
+      nodes_[n.parent].head = n.next;
+    if (n.next >= 0)
+      nodes_[n.next].prev = n.prev;
+    n.parent = n.prev = n.next = -1;
+  }
+
+  // Inserts 'v' among the children of 'parent' keeping them sorted by
+  // decreasing aclk. Usually 'v' is the youngest and goes first.
+  void Attach(int32_t v, int32_t parent) {
+    DCHECK(parent >= 0);
+    int32_t prev = -1;
+    int32_t cur = nodes_[parent].head;
+    while (cur >= 0 && nodes_[cur].aclk > nodes_[v].aclk) {
+      prev = cur;
+      cur = nodes_[cur].next;
+    }
+    nodes_[v].parent = parent;
+    nodes_[v].prev = prev;
+    nodes_[v].next = cur;
+    if (prev >= 0)
+      nodes_[prev].next = v;
+    else
+      nodes_[parent].head = v;
+    if (cur >= 0)
+      nodes_[cur].prev = v;
+  }
+
+  // Puts into stack_ (in post-order) the nodes of 'other' that have newer
+  // clocks than ours. For a copy, also the nodes we know but which may be
+  // placed differently, and the nodes on path_.
+  // The parent (in 'other') of a node in stack_ is in stack_ too.
+  void CollectUpdatedNodes(const TreeClock &other, bool copy) {
+    stack_.clear();
+    walk_.clear();
+    const Node &z = other.nodes_[other.root_];
+    Frame root = {other.root_, z.head, Get(z.tid)};
+    walk_.push_back(root);
+    while (!walk_.empty()) {
+      Frame &f = walk_.back();
+      if (f.child < 0) {
+        stack_.push_back(f.node);
+        walk_.pop_back();
+        continue;
+      }
+      const Node &c = other.nodes_[f.child];
+      int32_t c_idx = f.child;
+      f.child = c.next;
+      size_t depth = walk_.size();
+      bool on_path = copy && depth < path_.size() &&
+          path_[depth - 1] == f.node && path_[depth] == c_idx;
+      int32_t known = Get(c.tid);
+      if (known < c.clk || on_path) {
+        Frame child = {c_idx, c.head, known};
+        walk_.push_back(child);  // Invalidates 'f'.
+      } else if (c.aclk <= f.known) {
+        f.child = -1;
+      } else if (copy) {
+        stack_.push_back(c_idx);
+      }
+    }
+  }
+
+  void DetachUpdatedNodes(const TreeClock &other) {
+    for (size_t i = 0; i < stack_.size(); i++) {
+      int32_t v = Find(other.nodes_[stack_[i]].tid);
+      if (v >= 0 && v != root_)
+        Detach(v);
+    }
+  }
+
+  vector<Node> nodes_;
+  unordered_map<int32_t, int32_t> index_;  // tid -> index in nodes_.
+  int32_t root_;
+  // Scratch space for Join() and MonotoneCopy().
+  vector<int32_t> stack_;
+  vector<Frame> walk_;
+  vector<int32_t> path_;
+};
+
+// end. {{{1
+#endif  // TS_TREE_CLOCK_
@@ -0,0 +1,224 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_TUPLE_TABLE_
+#define TS_TUPLE_TABLE_
+
+#include "ts_util.h"
+#include "ts_lock.h"
+
+#if defined(__SSE2__) && !defined(TS_VALGRIND)
+# define TS_TUPLE_TABLE_SSE2 1
+# include <emmintrin.h>
+#else
+# define TS_TUPLE_TABLE_SSE2 0
+#endif
+
+// -------- TupleTable ------ {{{1
+// Interns small tuples of int32_t: maps kTupleSize int32_t (e.g. the SIDs
+// of a SegmentSet) to a non-zero int32_t id. The tuples are stored inline,
+// open addressing with linear probing, no per-element allocations.
+//
+// Find() takes no locks and may run concurrently with Insert().
+// Insert() calls must be serialized by the caller.
+// Erase() and Clear() must not run concurrently with other operations.
+//
+// Insert() writes the key first and then publishes the value with a release
+// store, so a reader which sees a non-zero value sees the whole key.
+// Slots are never reused while readers may run (only Erase() frees them).
+// When the table grows, the old slot array is kept alive until the next
+// Erase() or Clear().
+template <int kTupleSize>
+class TupleTable {
+ public:
+  TupleTable() : table_(NULL), n_used_(0) {
+    table_ = NewTable(kInitialSizeLog);
+  }
+
+  ~TupleTable() {
+    FreeRetiredTables();
+    DeleteTable(table_);
+  }
+
+  // Returns 0 if there is no such key.
+  int32_t Find(const int32_t *key) const {
+    Table *t = (Table*)Load((uintptr_t*)&table_);
+    uintptr_t mask = t->capacity - 1;
+    for (uintptr_t i = Hash(key) & mask; ; i = (i + 1) & mask) {
+      uintptr_t val = Load(&t->vals[i]);
+      if (val == 0) return 0;
+      if (KeyEq(t->keys[i].v, key)) return (int32_t)val;
+    }
+  }
+
+  // The key should not be present.
+  void Insert(const int32_t *key, int32_t val) {
+    DCHECK(val != 0);
+    DCHECK(Find(key) == 0);
+    if ((n_used_ + 1) * 2 > table_->capacity)
+      Grow();
+    Table *t = table_;
+    uintptr_t mask = t->capacity - 1;
+    uintptr_t i = Hash(key) & mask;
+    while (t->vals[i] != 0)
+      i = (i + 1) & mask;
+    memcpy(t->keys[i].v, key, sizeof(Key));
+    ReleaseStore(&t->vals[i], (uintptr_t)(uint32_t)val);
+    n_used_++;
+  }
+
+  // Returns false if there is no such key.
+  bool Erase(const int32_t *key) {
+    FreeRetiredTables();
+    Table *t = table_;
+    uintptr_t mask = t->capacity - 1;
+    uintptr_t i = Hash(key) & mask;
+    for (; ; i = (i + 1) & mask) {
+      if (t->vals[i] == 0) return false;
+      if (KeyEq(t->keys[i].v, key)) break;
+    }
+    // Backward shift deletion: move the following entries of the probe
+    // sequence into the hole so that no tombstones are needed.
+    for (uintptr_t j = (i + 1) & mask; t->vals[j] != 0; j = (j + 1) & mask) {
+      uintptr_t home = Hash(t->keys[j].v) & mask;
+      // Move j to i unless home lies cyclically in (i, j].
+      bool stays = (i <= j) ? (i < home && home <= j)
+                            : (i < home || home <= j);
+      if (stays) continue;
+      t->keys[i] = t->keys[j];
+      t->vals[i] = t->vals[j];
+      i = j;
+    }
+    t->vals[i] = 0;
+    n_used_--;
+    return true;
+  }
+
+  void Clear() {
+    FreeRetiredTables();
+    DeleteTable(table_);
+    table_ = NewTable(kInitialSizeLog);
+    n_used_ = 0;
+  }
+
+  size_t size() const { return n_used_; }
+
+  // Tuples are short and their elements are small integers, so hash them
+  // as 64-bit words: one multiply per word and a final fold.
+  static INLINE uintptr_t Hash(const int32_t *key) {
+    uint64_t h = 0;
+    for (int i = 0; i < kTupleSize; i += 2) {
+      uint64_t w = (uint32_t)key[i];
+      if (i + 1 < kTupleSize)
+        w |= (uint64_t)(uint32_t)key[i + 1] << 32;
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    }
+    return (uintptr_t)(h >> 32) ^ (uintptr_t)h;
+  }
+
+ private:
+  enum { kInitialSizeLog = 10 };
+
+  struct Key {
+    int32_t v[kTupleSize];
+  };
+
+  struct Table {
+    uintptr_t capacity;  // Always a power of two.
+    Key *keys;
+    uintptr_t *vals;     // 0 means the slot is empty.
+  };
+
+  static INLINE uintptr_t Load(const uintptr_t *p) {
+    return *(const volatile uintptr_t*)p;
+  }
+
+  static INLINE bool KeyEq(const int32_t *a, const int32_t *b) {
+#if TS_TUPLE_TABLE_SSE2
+    if (kTupleSize == 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)a);
+      __m128i y = _mm_loadu_si128((const __m128i*)b);
+      return _mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) == 0xffff;
+    }
+#endif
+    for (int i = 0; i < kTupleSize; i++) {
+      if (a[i] != b[i]) return false;
+    }
+    return true;
+  }
+
+  static Table *NewTable(uintptr_t size_log) {
+    Table *t = new Table;
+    t->capacity = (uintptr_t)1 << size_log;
+    t->keys = new Key[t->capacity];
+    t->vals = new uintptr_t[t->capacity];
+    memset(t->vals, 0, t->capacity * sizeof(uintptr_t));
+    return t;
+  }
+
+  static void DeleteTable(Table *t) {
+    delete [] t->keys;
+    delete [] t->vals;
+    delete t;
+  }
+
+  void FreeRetiredTables() {
+    for (size_t i = 0; i < retired_.size(); i++)
+      DeleteTable(retired_[i]);
+    retired_.clear();
+  }
+
+  // Copy everything into a table twice as big and publish it.
+  // Readers still looking at the old table see a consistent (if stale)
+  // snapshot, so it is retired rather than deleted.
+  NOINLINE void Grow() {
+    Table *old_t = table_;
+    uintptr_t size_log = 0;
+    while (((uintptr_t)1 << size_log) < old_t->capacity * 2)
+      size_log++;
+    Table *t = NewTable(size_log);
+    uintptr_t mask = t->capacity - 1;
+    for (uintptr_t j = 0; j < old_t->capacity; j++) {
+      if (old_t->vals[j] == 0) continue;
+      uintptr_t i = Hash(old_t->keys[j].v) & mask;
+      while (t->vals[i] != 0)
+        i = (i + 1) & mask;
+      t->keys[i] = old_t->keys[j];
+      t->vals[i] = old_t->vals[j];
+    }
+    ReleaseStore((uintptr_t*)&table_, (uintptr_t)t);
+    retired_.push_back(old_t);
+  }
+
+  Table *table_;
+  uintptr_t n_used_;
+  vector<Table*> retired_;
+};
+
+// end. {{{1
+#endif  // TS_TUPLE_TABLE_
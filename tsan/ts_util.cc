@@ -35,6 +35,19 @@
 #include "ts_stats.h"
 #include "ts_lock.h"
 #include <stdarg.h>
+#if defined(__GNUC__) && !defined(TS_VALGRIND)
+# include <sys/time.h>
+#endif
+#if defined(__linux__) && !defined(TS_VALGRIND)
+# include <sched.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+#if defined(__linux__) && !defined(TS_VALGRIND) && !defined(TS_PIN)
+# include <errno.h>
+# include <linux/perf_event.h>
+# include <unistd.h>
+#endif
 
 FLAGS *G_flags = NULL;
 
@@ -57,6 +70,9 @@ int getpid() { return WINDOWS::GetCurrentProcessId(); }
 size_t TimeInMilliSeconds() {
   return VG_(read_millisecond_timer)();
 }
+size_t TimeInMicroSeconds() {
+  return VG_(read_millisecond_timer)() * 1000;
+}
 #else
 // TODO(kcc): implement this.
 size_t TimeInMilliSeconds() {
@@ -66,6 +82,15 @@ size_t TimeInMilliSeconds() {
   return WINDOWS::timeGetTime();
 #endif
 }
+size_t TimeInMicroSeconds() {
+#ifdef __GNUC__
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (size_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  return (size_t)WINDOWS::timeGetTime() * 1000;
+#endif
+}
 #endif
 
 Stats *G_stats;
@@ -137,11 +162,75 @@ static string RemoveUnsupportedFormat(const char *str) {
 #endif
 }
 
+// The capture needs a TSLock, which is only implemented for the tools
+// (see TSLock below), not for the plain build used by the unit tests.
+#if !defined(TS_VALGRIND) && (defined(TS_OFFLINE) || defined(TS_PIN) || \
+                              defined(TS_LLVM) || defined(TS_GO))
+# define TS_OUTPUT_CAPTURE
+#endif
+
+#ifdef TS_OUTPUT_CAPTURE
+// Created by InitOutputCapture(), before there are other threads.
+static TSLock *output_capture_lock;
+static string *output_capture;  // Protected by output_capture_lock.
+
+// Returns true if the output went into output_capture.
+static bool CaptureOutput(const char *format, va_list args) {
+  if (!output_capture_lock) return false;
+  ScopedLock lock(output_capture_lock);
+  if (!output_capture) return false;
+  char buff[1024];
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int n = vsnprintf(buff, sizeof(buff), format, args_copy);
+  va_end(args_copy);
+  if (n < 0) return true;
+  if ((size_t)n < sizeof(buff)) {
+    output_capture->append(buff, n);
+  } else {
+    vector<char> big_buff(n + 1);
+    vsnprintf(&big_buff[0], big_buff.size(), format, args);
+    output_capture->append(&big_buff[0], n);
+  }
+  return true;
+}
+#endif
+
+void InitOutputCapture() {
+#ifdef TS_OUTPUT_CAPTURE
+  if (!output_capture_lock)
+    output_capture_lock = new TSLock;
+#endif
+}
+
+void SetOutputCapture(string *capture) {
+#ifdef TS_OUTPUT_CAPTURE
+  CHECK(output_capture_lock);
+  ScopedLock lock(output_capture_lock);
+  output_capture = capture;
+#else
+  CHECK(capture == NULL);
+#endif
+}
+
+void PrintUncaptured(const string &str) {
+#ifdef TS_VALGRIND
+  VG_(printf)("%s", str.c_str());
+#else
+  fputs(str.c_str(), G_out);
+  fflush(G_out);
+#endif
+}
+
 static void PrintfImpl(const char *format, va_list args) {
 #ifdef TS_VALGRIND
   VG_(vprintf)(format, args);
 #else
-  vfprintf(G_out, RemoveUnsupportedFormat(format).c_str(), args);
+  string fmt = RemoveUnsupportedFormat(format);
+#ifdef TS_OUTPUT_CAPTURE
+  if (CaptureOutput(fmt.c_str(), args)) return;
+#endif
+  vfprintf(G_out, fmt.c_str(), args);
   fflush(G_out);
 #endif
 }
@@ -223,7 +312,7 @@ MallocCostCenterStack g_malloc_stack;
 size_t GetVmSizeInMb() {
 #ifdef VGO_linux
   const char *path ="/proc/self/statm";  // see 'man proc'
-  uintptr_t counter = G_stats->read_proc_self_stats++;
+  uintptr_t counter = G_stats->Shard()->read_proc_self_stats++;
   if (counter >= 1024 && ((counter & (counter - 1)) == 0))
     Report("INFO: reading %s for %ld'th time\n", path, counter);
   int  fd = ThreadSanitizerOpenFileReadOnly(path, false);
@@ -244,6 +333,207 @@ size_t GetVmSizeInMb() {
 #endif
 }
 
+void ZeroMemoryAndDecommit(void *mem, size_t size) {
+  uintptr_t beg = (uintptr_t)mem, end = beg + size;
+#if defined(__linux__) && !defined(TS_VALGRIND)
+  const uintptr_t kPageSize = 4096;
+  uintptr_t page_beg = (beg + kPageSize - 1) & ~(kPageSize - 1);
+  uintptr_t page_end = end & ~(kPageSize - 1);
+  // The private anonymous pages read back as zeros after MADV_DONTNEED.
+  if (page_beg < page_end &&
+      madvise((void*)page_beg, page_end - page_beg, MADV_DONTNEED) == 0) {
+    memset((void*)beg, 0, page_beg - beg);
+    memset((void*)page_end, 0, end - page_end);
+    return;
+  }
+#endif
+  memset((void*)beg, 0, end - beg);
+}
+
+#if defined(__linux__) && !defined(TS_VALGRIND)
+# ifndef MAP_HUGETLB
+#  define MAP_HUGETLB 0x40000
+# endif
+# ifndef MADV_HUGEPAGE
+#  define MADV_HUGEPAGE 14
+# endif
+static const uintptr_t kHugePageSize = 2 << 20;
+
+static uintptr_t RoundUpToHugePage(uintptr_t x) {
+  return (x + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+// mmap()s at least 'size' bytes. huge_pages: 0 is small pages, 1 is a
+// 2M-aligned region madvise()d for transparent huge pages, 2 is explicit
+// huge pages (MAP_HUGETLB), falling back to 1 if the pool is short of them.
+static void *MapTable(size_t size, int huge_pages, int extra_flags) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | extra_flags;
+  int prot = PROT_READ | PROT_WRITE;
+  if (huge_pages == 0) {
+    void *mem = mmap(NULL, size, prot, flags, -1, 0);
+    CHECK(mem != MAP_FAILED);
+    return mem;
+  }
+  size = RoundUpToHugePage(size);
+  if (huge_pages >= 2) {
+    void *mem = mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED)
+      return mem;
+    if (G_flags->verbosity >= 1)
+      Report("INFO: no explicit huge pages for %ldM, trying "
+             "transparent ones (see /proc/sys/vm/nr_hugepages)\n", size >> 20);
+  }
+  // THP needs 2M-aligned memory: map one huge page more and trim it.
+  uintptr_t mem = (uintptr_t)mmap(NULL, size + kHugePageSize, prot,
+                                  flags, -1, 0);
+  CHECK(mem != (uintptr_t)MAP_FAILED);
+  uintptr_t beg = RoundUpToHugePage(mem);
+  if (beg != mem)
+    munmap((void*)mem, beg - mem);
+  if (beg + size != mem + size + kHugePageSize)
+    munmap((void*)(beg + size), mem + kHugePageSize - beg);
+  if (madvise((void*)beg, size, MADV_HUGEPAGE) != 0 &&
+      G_flags->verbosity >= 1) {
+    Report("INFO: madvise(MADV_HUGEPAGE) failed for %ldM\n", size >> 20);
+  }
+  return (void*)beg;
+}
+#endif
+
+void *AllocateTable(size_t size) {
+#if defined(__linux__) && !defined(TS_VALGRIND)
+  if (G_flags->numa || G_flags->huge_pages) {
+    void *mem = MapTable(size, G_flags->huge_pages, 0);
+    if (G_flags->numa) {
+      // mbind(MPOL_INTERLEAVE) w/o libnuma. The kernel drops the nodes
+      // which are not online or not allowed for us.
+      const int kMpolInterleave = 3;
+      unsigned long all_nodes = ~0UL;
+      if (syscall(__NR_mbind, mem, size, kMpolInterleave, &all_nodes,
+                  sizeof(all_nodes) * 8, 0) != 0 && G_flags->verbosity >= 1) {
+        Report("INFO: mbind(MPOL_INTERLEAVE) failed for %ldM\n", size >> 20);
+      }
+    }
+    return mem;
+  }
+#endif
+  void *mem = calloc(1, size);
+  CHECK(mem);
+  return mem;
+}
+
+void *AllocateFreeListChunk(size_t size) {
+#if defined(__linux__) && !defined(TS_VALGRIND)
+  // Address space only; the pages are committed as the chunks are used.
+  static const uintptr_t kArenaSize = sizeof(void*) == 8 ? (4UL << 30) : 0;
+  static uintptr_t arena_pos, arena_end;
+  if (G_flags->huge_pages && kArenaSize) {
+    if (arena_pos == 0) {
+      // Transparent huge pages only: explicit ones would be all committed.
+      uintptr_t beg = (uintptr_t)MapTable(kArenaSize, 1, MAP_NORESERVE);
+      if (AtomicCompareAndSwap(&arena_pos, 0, beg))
+        ReleaseStore(&arena_end, beg + kArenaSize);
+      else
+        munmap((void*)beg, kArenaSize);
+    }
+    size = (size + 63) & ~63;  // Keep the chunks cache line aligned.
+    for (;;) {
+      uintptr_t pos = arena_pos;
+      if (pos + size > arena_end)
+        break;
+      if (AtomicCompareAndSwap(&arena_pos, pos, pos + size))
+        return (void*)pos;
+    }
+  }
+#endif
+  return new uint8_t[size];
+}
+
+int GetCurrentCpu() {
+#if defined(__linux__) && !defined(TS_VALGRIND) && !defined(TS_PIN)
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+int FramePointerUnwind(uintptr_t bp, uintptr_t stack_lo, uintptr_t stack_hi,
+                       uintptr_t *pcs, int max_len) {
+  // A frame starts with the caller's frame pointer and the return address.
+  const uintptr_t kFrameSize = 2 * sizeof(uintptr_t);
+  int n = 0;
+  while (n < max_len) {
+    if (bp < stack_lo || bp >= stack_hi || stack_hi - bp < kFrameSize ||
+        (bp & (sizeof(uintptr_t) - 1)))
+      break;
+    uintptr_t *frame = (uintptr_t*)bp;
+    if (frame[1] == 0)
+      break;
+    pcs[n++] = frame[1];
+    if (frame[0] <= bp)
+      break;
+    bp = frame[0];
+  }
+  return n;
+}
+
+#if defined(__linux__) && !defined(TS_VALGRIND) && !defined(TS_PIN)
+static int OpenHwCounter(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.exclude_kernel = 1;  // Leaves out most of the cost of read() itself.
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// The group leader of the counters of this thread; -1 if they are not
+// opened yet, -2 if they can't be.
+static __thread int hw_counters_fd = -1;
+#endif
+
+bool ReadHwCounters(uint64_t values[HW_LAST]) {
+  memset(values, 0, sizeof(values[0]) * HW_LAST);
+#if defined(__linux__) && !defined(TS_VALGRIND) && !defined(TS_PIN)
+  if (hw_counters_fd == -1) {
+    // The order is the one of HwCounterKind.
+    int fds[HW_LAST];
+    fds[HW_CYCLES] = OpenHwCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    fds[HW_CACHE_MISSES] = OpenHwCounter(PERF_COUNT_HW_CACHE_MISSES, fds[0]);
+    fds[HW_BRANCH_MISSES] = OpenHwCounter(PERF_COUNT_HW_BRANCH_MISSES, fds[0]);
+    hw_counters_fd = fds[0];
+    for (int i = 0; i < HW_LAST; i++) {
+      if (fds[i] < 0) hw_counters_fd = -2;
+    }
+    if (hw_counters_fd == -2) {
+      int error = errno;
+      for (int i = 0; i < HW_LAST; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+      }
+      static bool reported;  // Once per process is enough, racy or not.
+      if (!reported) {
+        reported = true;
+        Report("INFO: --hw_counters: perf_event_open failed (errno %d)\n",
+               error);
+      }
+    }
+  }
+  if (hw_counters_fd < 0)
+    return false;
+  uint64_t buf[1 + HW_LAST];  // The number of counters, then the values.
+  if (read(hw_counters_fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+    return false;
+  for (int i = 0; i < HW_LAST; i++)
+    values[i] = buf[1 + i];
+  return true;
+#else
+  return false;
+#endif
+}
+
 size_t GetMemoryLimitInMbFromProcSelfLimits() {
 #ifdef VGO_linux
   // Parse the memory limit section of /proc/self/limits.
@@ -268,10 +558,22 @@ size_t GetMemoryLimitInMbFromProcSelfLimits() {
 #endif
 }
 
+// The normalizer runs for every frame of every report and suppression
+// check, so it scans each name a constant number of times and compares
+// in place instead of making substrings.
+
+// Returns true if s has 'word' at pos.
+static INLINE bool HasAt(const string &s, size_t pos, const char *word,
+                         size_t word_len) {
+  return pos + word_len <= s.size() &&
+      memcmp(s.data() + pos, word, word_len) == 0;
+}
+
 static string StripTemplatesFromFunctionName(const string &fname) {
   // Returns "" in case of error.
 
   string ret;
+  ret.reserve(fname.size());
   size_t read_pointer = 0, braces_depth = 0;
 
   while (read_pointer < fname.size()) {
@@ -282,7 +584,7 @@ static string StripTemplatesFromFunctionName(const string &fname) {
         CHECK(fname.size() > 256);
         return "";
       }
-      ret += (fname.c_str() + read_pointer);
+      ret.append(fname, read_pointer, fname.npos);
       break;
     }
 
@@ -292,23 +594,25 @@ static string StripTemplatesFromFunctionName(const string &fname) {
 
     if (next_brace > 0) {
       // We could have found one of the following operators.
-      const char *OP[] = {">>=", "<<=",
-                          ">>", "<<",
-                          ">=", "<=",
-                          "->", "->*",
-                          "<", ">"};
+      static const char *const OP[] = {">>=", "<<=",
+                                       ">>", "<<",
+                                       ">=", "<=",
+                                       "->", "->*",
+                                       "<", ">"};
 
       bool operator_name = false;
       for (size_t i = 0; i < TS_ARRAY_SIZE(OP); i++) {
-        size_t op_offset = ((string)OP[i]).find(fname[next_brace]);
-        if (op_offset == string::npos)
+        const char *op_char = (const char*)strchr(OP[i], fname[next_brace]);
+        if (op_char == NULL)
           continue;
+        size_t op_offset = op_char - OP[i];
+        size_t op_len = strlen(OP[i]);
         if (next_brace >= 8 + op_offset &&  // 8 == strlen("operator");
-            "operator" == fname.substr(next_brace - (8 + op_offset), 8) &&
-            OP[i] == fname.substr(next_brace - op_offset, strlen(OP[i]))) {
+            HasAt(fname, next_brace - (8 + op_offset), "operator", 8) &&
+            HasAt(fname, next_brace - op_offset, OP[i], op_len)) {
           operator_name = true;
           ret += OP[i] + op_offset;
-          next_brace += strlen(OP[i] + op_offset);
+          next_brace += op_len - op_offset;
           read_pointer = next_brace;
           break;
         }
@@ -340,26 +644,41 @@ static string StripTemplatesFromFunctionName(const string &fname) {
   return ret;
 }
 
+// Erases the last 'pattern_len - keep' chars of each 'pattern' in s, also
+// the occurrences which appear after an erasure, in one pass: the output
+// grows in place and is checked after each char. None of our patterns can
+// overlap with itself, so the result is the same as of erasing the first
+// occurrence until there is none.
+static void EraseAll(string *s, const char *pattern, size_t keep) {
+  size_t pattern_len = strlen(pattern);
+  char last = pattern[pattern_len - 1];
+  if (s->find(pattern) == string::npos) return;
+  size_t out = 0;
+  for (size_t in = 0; in < s->size(); in++) {
+    char c = (*s)[in];
+    (*s)[out++] = c;
+    if (c == last && out >= pattern_len &&
+        memcmp(s->data() + out - pattern_len, pattern, pattern_len) == 0)
+      out -= pattern_len - keep;
+  }
+  s->resize(out);
+}
+
 static string StripParametersFromFunctionName(const string &demangled) {
   // Returns "" in case of error.
 
   string fname = demangled;
 
   // Strip stuff like "(***)" and "(anonymous namespace)" -> they are tricky.
+  EraseAll(&fname, ", ", 1);
+  EraseAll(&fname, "(**", 2);
+  EraseAll(&fname, "(*)", 0);
+  EraseAll(&fname, "const()", 5);
   size_t found = fname.npos;
-  while ((found = fname.find(", ")) != fname.npos)
-    fname.erase(found+1, 1);
-  while ((found = fname.find("(**")) != fname.npos)
-    fname.erase(found+2, 1);
-  while ((found = fname.find("(*)")) != fname.npos)
-    fname.erase(found, 3);
-  while ((found = fname.find("const()")) != fname.npos)
-    fname.erase(found+5, 2);
   while ((found = fname.find("const volatile")) != fname.npos &&
          found > 1 && found + 14 == fname.size())
     fname.erase(found-1);
-  while ((found = fname.find("(anonymous namespace)")) != fname.npos)
-    fname.erase(found, 21);
+  EraseAll(&fname, "(anonymous namespace)", 0);
 
   if (fname.find_first_of("(") == fname.npos)
     return fname;
@@ -367,6 +686,7 @@ static string StripParametersFromFunctionName(const string &demangled) {
          count(fname.begin(), fname.end(), ')'));
 
   string ret;
+  ret.reserve(fname.size());
   bool returns_fun_ptr = false;
   size_t braces_depth = 0, read_pointer = 0;
 
@@ -397,7 +717,7 @@ static string StripParametersFromFunctionName(const string &demangled) {
       }
       size_t _const = fname.find(" const", read_pointer);
       if (_const == fname.npos) {
-        ret += (fname.c_str() + read_pointer);
+        ret.append(fname, read_pointer, fname.npos);
       } else {
         CHECK(_const + 6 == fname.size());
         ret.append(fname, read_pointer, _const - read_pointer);
@@ -412,7 +732,7 @@ static string StripParametersFromFunctionName(const string &demangled) {
 
     if (fname[next_brace] == '(') {
       if (next_brace >= 8 && fname[next_brace+1] == ')' &&
-          "operator" == fname.substr(next_brace - 8, 8)) {
+          HasAt(fname, next_brace - 8, "operator", 8)) {
         ret += "()";
         read_pointer = next_brace + 2;
       } else {
@@ -435,22 +755,31 @@ static string StripParametersFromFunctionName(const string &demangled) {
   // And some STL code inserts const& between the return type and the function
   // name.
   // Oh, well...
-  size_t space_or_tick;
-  while (ret != "") {
-    space_or_tick = ret.find_first_of("` ");
+  // The result is ret[begin, end).
+  size_t begin = 0, end = ret.size();
+  while (begin < end) {
+    size_t space_or_tick = ret.find_first_of("` ", begin);
+    if (space_or_tick >= end)
+      space_or_tick = ret.npos;
+    size_t op = space_or_tick == ret.npos ? ret.npos :
+        ret.find("operator", begin);
     if (space_or_tick != ret.npos && ret[space_or_tick] == ' ' &&
-        ret.substr(0, space_or_tick).find("operator") == string::npos) {
-      ret = ret.substr(space_or_tick + 1);
-    } else if (space_or_tick != ret.npos && space_or_tick + 1 == ret.size()) {
-      ret = ret.substr(0, space_or_tick);
+        (op == ret.npos || op + 8 > space_or_tick)) {
+      begin = space_or_tick + 1;
+    } else if (space_or_tick != ret.npos && space_or_tick + 1 == end) {
+      end = space_or_tick;
     } else {
       break;
     }
   }
+  if (begin != 0 || end != ret.size())
+    return ret.substr(begin, end - begin);
   return ret;
 }
 
 string NormalizeFunctionName(const string &demangled) {
+  if (demangled.size() < 2)
+    return demangled;
   if (demangled[1] == '[' && strchr("+-=", demangled[0]) != NULL) {
     // Objective-C function
     return demangled;
@@ -497,7 +826,13 @@ void OpenFileWriteStringAndClose(const string &file_name, const string &str) {
   write(fd, str.c_str(), str.size());
   close(fd);
 #else
-  CHECK(0);
+  FILE *f = fopen(file_name.c_str(), "w");
+  if (!f) {
+    Report("WARNING: can not open file %s\n", file_name.c_str());
+    exit(1);
+  }
+  fwrite(str.c_str(), 1, str.size(), f);
+  fclose(f);
 #endif
 }
 
@@ -749,7 +1084,7 @@ void TSLock::Lock() {
     c = __sync_lock_test_and_set(p, 2);
   }
   ANNOTATE_RWLOCK_ACQUIRED(this, /*is_w*/true);
-  G_stats->futex_wait += n_waits;
+  G_stats->Shard()->futex_wait += n_waits;
 }
 void TSLock::Unlock() {
   ANNOTATE_RWLOCK_RELEASED(this, /*is_w*/true);
@@ -769,8 +1104,10 @@ void TSLock::AssertHeld() {
 }
 #endif
 
-// Simple pthread version compile Go's rtl. No wrapping here
-#if defined (TS_GO)
+// Simple pthread version compile Go's rtl and the TS_SERIALIZED=0
+// ts_offline. No wrapping here
+#if defined (TS_GO) || (defined(TS_OFFLINE) && TS_SERIALIZED == 0)
+#include <pthread.h>
 
 struct TSLock::Rep {
   pthread_mutex_t lock;
@@ -797,7 +1134,7 @@ void TSLock::AssertHeld() {
   DCHECK(rep_->held);
 }
 
-#endif // (TS_GO)
+#endif // (TS_GO) || TS_OFFLINE
 
 //--------------- Atomics ----------------- {{{1
 #if defined (_MSC_VER) && TS_SERIALIZED == 0
@@ -810,6 +1147,12 @@ void ReleaseStore(uintptr_t *ptr, uintptr_t value) {
   // TODO(kcc): anything to add here?
 }
 
+bool AtomicCompareAndSwap(uintptr_t *ptr, uintptr_t old_value,
+                          uintptr_t new_value) {
+  return _InterlockedCompareExchange((volatile WINDOWS::LONG*)ptr,
+                                     new_value, old_value) == old_value;
+}
+
 int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
   return _InterlockedIncrement((volatile WINDOWS::LONG *)ptr);
 }
@@ -817,6 +1160,10 @@ int32_t NoBarrier_AtomicIncrement(int32_t* ptr) {
 int32_t NoBarrier_AtomicDecrement(int32_t* ptr) {
   return _InterlockedDecrement((volatile WINDOWS::LONG *)ptr);
 }
+
+int32_t NoBarrier_AtomicAdd(int32_t* ptr, int32_t value) {
+  return _InterlockedExchangeAdd((volatile WINDOWS::LONG *)ptr, value) + value;
+}
 #endif  // _MSC_VER && TS_SERIALIZED
 //--------------- YIELD ----------------- {{{1
 #if defined (_MSC_VER)
@@ -203,8 +203,10 @@ using STD::unique_copy;
 using STD::count;
 using STD::set_intersection;
 using STD::lower_bound;
+using STD::upper_bound;
 using STD::copy;
 using STD::binary_search;
+using STD::reverse;
 
 #ifdef TS_LLVM
 # include "tsan_rtl_wrap.h"
@@ -254,6 +256,12 @@ int getpid();
 # error "Unknown configuration"
 #endif // TS_VALGRIND
 
+#if defined(__GNUC__)
+# define PREFETCH(p) __builtin_prefetch(p)
+#else
+# define PREFETCH(p) ((void)(p))
+#endif
+
 #define CHECK_GT(X, Y) CHECK((X) >  (Y))
 #define CHECK_LT(X, Y) CHECK((X) < (Y))
 #define CHECK_GE(X, Y) CHECK((X) >= (Y))
@@ -292,6 +300,23 @@ int getpid();
   #error "Unknown Configuration"
 #endif
 
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+// The time stamp counter, in cycles, or 0 if we can't read it cheaply.
+static inline uint64_t ReadTSC() {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+#elif defined(_MSC_VER)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
 // When TS_SERIALIZED==1, all calls to ThreadSanitizer* functions
 // should be serialized somehow. For example:
 //  - Valgrind serializes threads by using a pipe-based semaphore.
@@ -355,12 +380,24 @@ struct ThreadSanitizerReport;
 
 // Time since some moment before the program start.
 extern size_t TimeInMilliSeconds();
+extern size_t TimeInMicroSeconds();
 extern void YIELD();
 extern void PROCESSOR_YIELD();
 
 extern "C" long my_strtol(const char *str, char **end, int base);
 extern void Printf(const char *format, ...);
 
+// Output capture, used by --async_reports (see ts_report_writer.h).
+// InitOutputCapture() should be called while there is only one thread.
+// After SetOutputCapture(&str) the output of Printf() and Report() of all
+// threads is appended to str instead of being printed, until
+// SetOutputCapture(NULL). Only supported by the tools which have a TSLock,
+// i.e. not under Valgrind and not in the plain build of the unit tests.
+extern void InitOutputCapture();
+extern void SetOutputCapture(string *capture);
+// Prints 'str' as is, even while the output is captured.
+extern void PrintUncaptured(const string &str);
+
 // Strip (.*) and <.*>, also handle "function returns a function pointer" case.
 string NormalizeFunctionName(const string &mangled_fname);
 
@@ -370,6 +407,48 @@ string ThreadSanitizerReadFileToString(const string &file_name, bool die_if_fail
 size_t GetVmSizeInMb();
 size_t GetMemoryLimitInMbFromProcSelfLimits();
 
+// Zeroes [mem, mem+size). The whole pages in the range are given back to the
+// OS where possible, so that they are committed again only when touched.
+void ZeroMemoryAndDecommit(void *mem, size_t size);
+
+// Returns 'size' bytes of zeroed memory for one of the big detector tables.
+// With --numa the pages are interleaved over all the NUMA nodes (Linux only)
+// instead of all of them landing on the node of the thread touching them
+// first. With --huge_pages they are huge pages. The memory is never freed.
+void *AllocateTable(size_t size);
+
+// Returns 'size' bytes for a chunk of a FreeList, never freed. With
+// --huge_pages the chunks of all the free lists are carved from one region
+// of transparent huge pages, so the small objects share a few TLB entries.
+// Otherwise, or once the region is used up, it is new[].
+void *AllocateFreeListChunk(size_t size);
+
+// The CPU the calling thread runs on, or -1 if unknown.
+int GetCurrentCpu();
+
+// Follows the frame pointer chain from the frame 'bp' and puts up to
+// 'max_len' return addresses to pcs[]. Stops at the first frame which is
+// not inside [stack_lo, stack_hi), is misaligned or does not go up the
+// stack, so code built without frame pointers gives a short stack rather
+// than a crash. Takes no locks and allocates nothing, so it may be called
+// from a signal handler. Returns the number of pcs.
+int FramePointerUnwind(uintptr_t bp, uintptr_t stack_lo, uintptr_t stack_hi,
+                       uintptr_t *pcs, int max_len);
+
+// --hw_counters: the perf counters of a thread, user mode only.
+enum HwCounterKind {
+  HW_CYCLES,
+  HW_CACHE_MISSES,
+  HW_BRANCH_MISSES,
+  HW_LAST
+};
+
+// Reads the counters of the calling thread into values[], opening them on
+// the first call in the thread (three fds per thread, never closed).
+// Returns false and zeroes values[] where they are not available: w/o
+// perf_event_open, under Valgrind or Pin, or on other OSes.
+bool ReadHwCounters(uint64_t values[HW_LAST]);
+
 // Sets the contents of the file 'file_name' to 'str'.
 void OpenFileWriteStringAndClose(const string &file_name, const string &str);
 
@@ -37,6 +37,7 @@
 #include "thread_sanitizer.h"
 #include "ts_trace_info.h"
 #include "ts_race_verifier.h"
+#include "ts_shadow_stack.h"
 #include "common_util.h"
 
 #include "coregrind/pub_core_basics.h"
@@ -73,6 +74,10 @@ extern "C" void* realloc(void *ptr, size_t size) {
   return VG_(realloc)((HChar*)g_malloc_stack.Top(), ptr, size);
 }
 
+extern "C" void *calloc(size_t n, size_t size) {
+  return VG_(calloc)((HChar*)g_malloc_stack.Top(), n, size);
+}
+
 
 //---------------------- Utils ------------------- {{{1
 
@@ -190,22 +195,19 @@ void GetThreadStack(int tid, uintptr_t *min_addr, uintptr_t *max_addr) {
   *max_addr = stack_max;
 }
 
-struct CallStackRecord {
-  Addr pc;
-  Addr sp;
-#ifdef VGP_arm_linux
-  // We need to store LR in order to keep the shadow stack consistent.
-  Addr lr;
-#endif
-};
-
 const size_t kMaxMopsPerTrace = 2048;
 
 struct ValgrindThread {
   int32_t zero_based_uniq_tid;
   TSanThread *ts_thread;
   uint32_t literace_sampling;
-  vector<CallStackRecord> call_stack;
+  // The pc after the call insn and the sp before the call.
+  ShadowStack call_stack;
+#ifdef VGP_arm_linux
+  // LR of each frame of call_stack; we need it in order to keep the shadow
+  // stack consistent.
+  vector<Addr> call_stack_lr;
+#endif
 
   int ignore_accesses;
   int ignore_sync;
@@ -223,6 +225,12 @@ struct ValgrindThread {
   // End time of the current verification loop.
   unsigned verifier_wakeup_time_ms;
 
+  // --batch_sync_requests: the thread's batch in the guest memory, NULL if
+  // the thread does not batch. request_batch_done of its requests have been
+  // handled; this is non-0 only during a signal handler, see SignalIn().
+  TsRequestBatch *request_batch;
+  size_t request_batch_done;
+
   ValgrindThread() {
     Clear();
   }
@@ -234,10 +242,15 @@ struct ValgrindThread {
     ignore_accesses = 0;
     ignore_sync = 0;
     in_signal_handler = 0;
-    call_stack.clear();
+    call_stack.Clear();
+#ifdef VGP_arm_linux
+    call_stack_lr.clear();
+#endif
     trace_info = NULL;
     verifier_current_pc = 0;
     verifier_wakeup_time_ms = 0;
+    request_batch = NULL;
+    request_batch_done = 0;
   }
 };
 
@@ -288,6 +301,60 @@ void ts_print_debug_usage(void) {
 
 extern int VG_(clo_error_exitcode);
 
+// -------- Deferred analysis ------------ {{{1
+// With --deferred_analysis, FlushMops does not analyze a trace right away
+// but appends {thread, trace_info, addresses} to a bounded queue. The queue
+// is analyzed in one go when it is full (this is the backpressure) and
+// before any other event reaches ThreadSanitizer, so the detector sees the
+// events in the original order. A run of traces w/o calls or sync events
+// (e.g. a hot loop) is then analyzed back to back, which keeps the detector
+// code and data in the caches instead of interleaving it with the guest code
+// of every superblock.
+//
+// Ideally the queue would be consumed by a helper thread running
+// concurrently with the guest (like --threaded_analysis in the Pin tool),
+// but a Valgrind tool can't do that: the core gives tools no way to create
+// threads, and the tool's allocator and the symbolizer the detector calls
+// are not thread-safe. The queue is drained by the guest thread instead.
+struct AnalysisQueue {
+  static const size_t kSize = 1 << 16;  // In words.
+  size_t size;
+  uintptr_t buf[kSize];
+};
+
+static AnalysisQueue *g_analysis_queue;
+
+static void AnalysisQueueDrain() {
+  AnalysisQueue *q = g_analysis_queue;
+  for (size_t i = 0; i < q->size; ) {
+    TSanThread *ts_thread = (TSanThread*)q->buf[i];
+    TraceInfo *trace_info = (TraceInfo*)q->buf[i + 1];
+    ThreadSanitizerHandleTrace(ts_thread, trace_info, &q->buf[i + 2]);
+    i += 2 + trace_info->n_mops();
+  }
+  q->size = 0;
+}
+
+// Called before an event other than a trace reaches ThreadSanitizer.
+static INLINE void AnalysisQueueBarrier() {
+  if (g_analysis_queue && g_analysis_queue->size)
+    AnalysisQueueDrain();
+}
+
+static INLINE void AnalysisQueuePush(TSanThread *ts_thread,
+                                     TraceInfo *trace_info, uintptr_t *tleb) {
+  AnalysisQueue *q = g_analysis_queue;
+  size_t n = trace_info->n_mops();
+  DCHECK(n + 2 <= AnalysisQueue::kSize);
+  if (q->size + n + 2 > AnalysisQueue::kSize)
+    AnalysisQueueDrain();
+  q->buf[q->size] = (uintptr_t)ts_thread;
+  q->buf[q->size + 1] = (uintptr_t)trace_info;
+  for (size_t i = 0; i < n; i++)
+    q->buf[q->size + 2 + i] = tleb[i];
+  q->size += n + 2;
+}
+
 void ts_post_clo_init(void) {
   ScopedMallocCostCenter malloc_cc(__FUNCTION__);
   InitCommandLineOptions();
@@ -346,6 +413,11 @@ void ts_post_clo_init(void) {
     RaceVerifierInit(G_flags->race_verifier, G_flags->race_verifier_extra);
     global_ignore = true;
   }
+
+  if (G_flags->deferred_analysis && !g_race_verifier_active) {
+    g_analysis_queue = new AnalysisQueue;
+    g_analysis_queue->size = 0;
+  }
 }
 
 // Remember, valgrind is essentially single-threaded.
@@ -358,10 +430,27 @@ static void OnStartClientCode(ThreadId vg_tid, ULong nDisp) {
   g_cur_tleb = thr->tleb;
 }
 
+// -------- Batched sync requests ------------ {{{1
+// See TsRequestBatch in ts_valgrind_client_requests.h.
+static void RequestBatchDrain(ValgrindThread *thr);
+
+// Called before anything else the thread does reaches ThreadSanitizer.
+static INLINE void RequestBatchBarrier(ValgrindThread *thr) {
+  if (UNLIKELY(thr->request_batch != NULL) &&
+      thr->request_batch->n > thr->request_batch_done)
+    RequestBatchDrain(thr);
+}
+
+// No other thread may run before the batch of this one is handled.
+static void OnStopClientCode(ThreadId vg_tid, ULong nDisp) {
+  RequestBatchBarrier(&g_valgrind_threads[vg_tid]);
+}
+
 INLINE void FlushMops(ValgrindThread *thr, bool keep_trace_info = false) {
   DCHECK(!g_race_verifier_active || global_ignore);
   TraceInfo *t = thr->trace_info;
   if (!t) return;
+  RequestBatchBarrier(thr);
   if (!keep_trace_info) {
     thr->trace_info = NULL;
   }
@@ -377,34 +466,44 @@ INLINE void FlushMops(ValgrindThread *thr, bool keep_trace_info = false) {
   DCHECK(n > 0);
   uintptr_t *tleb = thr->tleb;
   DCHECK(thr->ts_thread);
+  if (g_analysis_queue) {
+    AnalysisQueuePush(thr->ts_thread, t, tleb);
+    return;
+  }
   ThreadSanitizerHandleTrace(thr->ts_thread, t, tleb);
 }
 
 static void ShowCallStack(ValgrindThread *thr) {
   size_t n = thr->call_stack.size();
+  vector<uintptr_t> pcs(n), sps(n);
+  if (n)
+    thr->call_stack.GetFrames(&pcs[0], &sps[0]);
   Printf("        ");
-  for (size_t i = n - 1; i > n - 10 && i >= 0; i--) {
-    Printf("{pc=%p sp=%p}, ", thr->call_stack[i].pc, thr->call_stack[i].sp);
+  for (size_t i = n; i > 0 && i + 10 > n; i--) {
+    Printf("{pc=%p sp=%p}, ", pcs[i - 1], sps[i - 1]);
   }
   Printf("\n");
 }
 
 static INLINE void UpdateCallStack(ValgrindThread *thr, uintptr_t sp) {
   DCHECK(!g_race_verifier_active);
+  RequestBatchBarrier(thr);
   if (thr->trace_info) FlushMops(thr, true /* keep_trace_info */);
-  vector<CallStackRecord> &call_stack = thr->call_stack;
-  while (!call_stack.empty()) {
-    CallStackRecord &record = call_stack.back();
-    Addr cur_top = record.sp;
-    if (sp < cur_top) break;
-    call_stack.pop_back();
-    int32_t ts_tid = thr->zero_based_uniq_tid;
+  ShadowStack &call_stack = thr->call_stack;
+  int32_t ts_tid = thr->zero_based_uniq_tid;
+  for (size_t n = call_stack.Unwind(sp); n > 0; n--) {
+    uintptr_t pc = call_stack.top_pc();
+    uintptr_t top_sp = call_stack.top_sp();
+    call_stack.Pop();
+#ifdef VGP_arm_linux
+    thr->call_stack_lr.pop_back();
+#endif
+    AnalysisQueueBarrier();
     ThreadSanitizerHandleRtnExit(ts_tid);
     if (debug_rtn) {
       Printf("T%d: [%ld]<< pc=%p sp=%p cur_sp=%p %s\n",
-             ts_tid, thr->call_stack.size(), record.pc,
-             record.sp, sp,
-             PcToRtnNameAndFilePos(record.pc).c_str());
+             ts_tid, call_stack.size(), pc, top_sp, sp,
+             PcToRtnNameAndFilePos(pc).c_str());
       ShowCallStack(thr);
     }
   }
@@ -438,6 +537,7 @@ static void OnTrace(TraceInfo *trace_info) {
 static inline void Put(EventType type, int32_t tid, uintptr_t pc,
                        uintptr_t a, uintptr_t info) {
   if (TSAN_DEBUG && G_flags->dry_run >= 1) return;
+  AnalysisQueueBarrier();
   Event event(type, tid, pc, a, info);
   ThreadSanitizerHandleOneEvent(&event);
 }
@@ -449,27 +549,27 @@ static void rtn_call(Addr sp_post_call_insn, Addr pc_post_call_insn,
   ThreadId vg_tid = GetVgTid();
   ValgrindThread *thr = &g_valgrind_threads[vg_tid];
   int ts_tid = thr->zero_based_uniq_tid;
-  CallStackRecord record;
-  record.pc = pc_post_call_insn;
-  record.sp = sp_post_call_insn + 4;  // sp before call.
-  UpdateCallStack(thr, record.sp);
+  uintptr_t pc = pc_post_call_insn;
+  uintptr_t sp = sp_post_call_insn + 4;  // sp before call.
+  UpdateCallStack(thr, sp);
 #ifdef VGP_arm_linux
-  record.lr = GetVgLr(vg_tid);
+  thr->call_stack_lr.push_back(GetVgLr(vg_tid));
 #endif
-  thr->call_stack.push_back(record);
+  thr->call_stack.Push(pc, sp);
   // If the shadow stack grows too high this usually means it is not cleaned
   // properly. Or this may be a very deep recursion.
   DCHECK(thr->call_stack.size() < 10000);
   uintptr_t call_pc = GetVgPc(vg_tid);
   if (thr->trace_info) FlushMops(thr);
-  ThreadSanitizerHandleRtnCall(ts_tid, call_pc, record.pc,
+  AnalysisQueueBarrier();
+  ThreadSanitizerHandleRtnCall(ts_tid, call_pc, pc,
                                ignore_below);
 
   if (debug_rtn) {
     Printf("T%d: [%ld]>> pc=%p sp=%p %s\n",
-           ts_tid, thr->call_stack.size(), (void*)record.pc,
-           (void*)record.sp,
-           PcToRtnNameAndFilePos(record.pc).c_str());
+           ts_tid, thr->call_stack.size(), (void*)pc,
+           (void*)sp,
+           PcToRtnNameAndFilePos(pc).c_str());
     ShowCallStack(thr);
   }
 }
@@ -498,19 +598,22 @@ void evh__delete_frame ( Addr sp_post_call_insn,
   DCHECK(!g_race_verifier_active);
   ThreadId vg_tid = GetVgTid();
   ValgrindThread *thr = &g_valgrind_threads[vg_tid];
+  RequestBatchBarrier(thr);
   if (thr->trace_info) FlushMops(thr);
-  vector<CallStackRecord> &call_stack = thr->call_stack;
+  ShadowStack &call_stack = thr->call_stack;
   int32_t ts_tid = VgTidToTsTid(vg_tid);
   while (!call_stack.empty()) {
-    CallStackRecord &record = call_stack.back();
-    if (record.lr != pc_post_call_insn) break;
-    call_stack.pop_back();
+    if (thr->call_stack_lr.back() != pc_post_call_insn) break;
+    call_stack.Pop();
+    thr->call_stack_lr.pop_back();
+    AnalysisQueueBarrier();
     ThreadSanitizerHandleRtnExit(ts_tid);
   }
 }
 #endif
 
 void ts_fini(Int exitcode) {
+  AnalysisQueueBarrier();
   ThreadSanitizerFini();
   if (g_race_verifier_active) {
     RaceVerifierFini();
@@ -523,6 +626,8 @@ void ts_fini(Int exitcode) {
 
 void evh__pre_thread_ll_create ( ThreadId parent, ThreadId child ) {
   tl_assert(parent != child);
+  if (parent > 0)
+    RequestBatchBarrier(&g_valgrind_threads[parent]);
   ValgrindThread *thr = &g_valgrind_threads[child];
   //  Printf("thread_create: %d->%d\n", parent, child);
   if (thr->zero_based_uniq_tid != -1) {
@@ -542,6 +647,7 @@ void evh__pre_workq_task_start(ThreadId vg_tid, Addr workitem) {
   uintptr_t pc = GetVgPc(vg_tid);
   int32_t ts_tid = VgTidToTsTid(vg_tid);
   ValgrindThread *thr = &g_valgrind_threads[vg_tid];
+  RequestBatchBarrier(thr);
   FlushMops(thr);
   Put(WAIT, ts_tid, pc, workitem, 0);
 }
@@ -559,6 +665,9 @@ void evh__pre_thread_ll_exit ( ThreadId quit_tid ) {
 //         VgTidToTsTid(quit_tid),
 //         (int)g_valgrind_threads[quit_tid].call_stack.size());
   ValgrindThread *thr = &g_valgrind_threads[quit_tid];
+  // The batch has been handled when the thread stopped running, and its
+  // memory may be gone by now.
+  thr->request_batch = NULL;
   FlushMops(thr);
   Put(THR_END, VgTidToTsTid(quit_tid), 0, 0, 0);
   g_valgrind_threads[quit_tid].zero_based_uniq_tid = -1;
@@ -576,6 +685,107 @@ static inline Bool ignoring_sync(ThreadId vg_tid, uintptr_t addr) {
       ThreadSanitizerIgnoreForNacl(addr);
 }
 
+// TSREQ_{SIGNAL,WAIT}_{MANY,ARRAY}: puts SIGNAL_MANY/WAIT_MANY events for
+// objs[0..n) or, if objs is NULL, for the n elements of 'array'.
+// The ignored addresses are dropped.
+static void PutManyEvents(ThreadId vg_tid, EventType type, int32_t ts_tid,
+                          uintptr_t pc, const uintptr_t *objs,
+                          uintptr_t array, long n, long elem_size) {
+  uintptr_t chunk[kMaxManyEventObjs];
+  size_t n_chunk = 0;
+  for (long i = 0; i < n; i++) {
+    uintptr_t addr = objs ? objs[i] : array + i * elem_size;
+    if (ignoring_sync(vg_tid, addr))
+      continue;
+    chunk[n_chunk++] = addr;
+    if (n_chunk == kMaxManyEventObjs) {
+      Put(type, ts_tid, pc, (uintptr_t)chunk, n_chunk);
+      n_chunk = 0;
+    }
+  }
+  if (n_chunk)
+    Put(type, ts_tid, pc, (uintptr_t)chunk, n_chunk);
+}
+
+// Handles the synchronization requests which may come in a TsRequestBatch.
+// Returns false if 'req' is not one of them.
+static bool HandleSyncRequest(ThreadId vg_tid, int32_t ts_tid, uintptr_t pc,
+                              UWord req, UWord arg1, UWord arg2) {
+  switch (req) {
+    case TSREQ_PTHREAD_RWLOCK_CREATE_POST:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(LOCK_CREATE, ts_tid, pc, /*lock=*/arg1, 0);
+      break;
+    case TSREQ_PTHREAD_RWLOCK_DESTROY_PRE:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(LOCK_DESTROY, ts_tid, pc, /*lock=*/arg1, 0);
+      break;
+    case TSREQ_PTHREAD_RWLOCK_LOCK_POST:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(arg2 ? WRITER_LOCK : READER_LOCK, ts_tid, pc, /*lock=*/arg1, 0);
+      break;
+    case TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(UNLOCK, ts_tid, pc, /*lock=*/arg1, 0);
+      break;
+    case TSREQ_PTHREAD_SPIN_LOCK_INIT_OR_UNLOCK:
+      Put(UNLOCK_OR_INIT, ts_tid, pc, /*lock=*/arg1, 0);
+      break;
+    case TSREQ_SIGNAL:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(SIGNAL, ts_tid, pc, arg1, 0);
+      break;
+    case TSREQ_WAIT:
+      if (ignoring_sync(vg_tid, arg1))
+        break;
+      Put(WAIT, ts_tid, pc, arg1, 0);
+      break;
+    case TSREQ_CYCLIC_BARRIER_INIT:
+      Put(CYCLIC_BARRIER_INIT, ts_tid, pc, arg1, arg2);
+      break;
+    case TSREQ_CYCLIC_BARRIER_WAIT_BEFORE:
+      Put(CYCLIC_BARRIER_WAIT_BEFORE, ts_tid, pc, arg1, 0);
+      break;
+    case TSREQ_CYCLIC_BARRIER_WAIT_AFTER:
+      Put(CYCLIC_BARRIER_WAIT_AFTER, ts_tid, pc, arg1, 0);
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+static void RequestBatchDrain(ValgrindThread *thr) {
+  ThreadId vg_tid = thr - g_valgrind_threads;
+  int32_t ts_tid = VgTidToTsTid(vg_tid);
+  TsRequestBatch *batch = thr->request_batch;
+  size_t n = batch->n;
+  CHECK(n <= TS_REQUEST_BATCH_SIZE);
+  // The mops of the current trace happened after the batched requests.
+  TraceInfo *trace_info = thr->trace_info;
+  thr->trace_info = NULL;
+  for (size_t i = thr->request_batch_done; i < n; i++) {
+    const TsBatchedRequest &req = batch->reqs[i];
+    thr->request_batch_done = i + 1;  // UpdateCallStack() comes back here.
+    // No frame has been pushed since the request, so this gives the stack
+    // the request would have had w/o batching.
+    UpdateCallStack(thr, req.sp);
+    CHECK(HandleSyncRequest(vg_tid, ts_tid, req.pc, req.req,
+                            req.arg1, req.arg2));
+  }
+  // A signal handler may have interrupted an append, see SignalIn().
+  if (!thr->in_signal_handler) {
+    batch->n = 0;
+    thr->request_batch_done = 0;
+  }
+  thr->trace_info = trace_info;
+}
+
 Bool ts_handle_client_request(ThreadId vg_tid, UWord* args, UWord* ret) {
   if (args[0] == VG_USERREQ__NACL_MEM_START) {
     // This will get truncated on x86-32, but we don't support it with NaCl
@@ -599,6 +809,7 @@ Bool ts_handle_client_request(ThreadId vg_tid, UWord* args, UWord* ret) {
     return True;
   }
   ValgrindThread *thr = &g_valgrind_threads[vg_tid];
+  RequestBatchBarrier(thr);
   if (thr->trace_info) FlushMops(thr);
   UpdateCallStack(thr, GetVgSp(vg_tid));
   *ret = 0;
@@ -624,6 +835,7 @@ Bool ts_handle_client_request(ThreadId vg_tid, UWord* args, UWord* ret) {
       g_has_exited_main = true;
       if (G_flags->exit_after_main) {
         Report("INFO: Exited main(); ret=%d\n", (int)args[1]);
+        AnalysisQueueBarrier();
         VG_(show_all_errors)();
         ThreadSanitizerFini();
         if (g_race_verifier_active) {
@@ -728,51 +940,30 @@ Bool ts_handle_client_request(ThreadId vg_tid, UWord* args, UWord* ret) {
     case TSREQ_RESET_STATS:
     case TSREQ_PTH_API_ERROR:
       break;
-    case TSREQ_PTHREAD_RWLOCK_CREATE_POST:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(LOCK_CREATE, ts_tid, pc, /*lock=*/args[1], 0);
-      break;
-    case TSREQ_PTHREAD_RWLOCK_DESTROY_PRE:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(LOCK_DESTROY, ts_tid, pc, /*lock=*/args[1], 0);
-      break;
-    case TSREQ_PTHREAD_RWLOCK_LOCK_POST:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(args[2] ? WRITER_LOCK : READER_LOCK, ts_tid, pc, /*lock=*/args[1], 0);
-      break;
-    case TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(UNLOCK, ts_tid, pc, /*lock=*/args[1], 0);
-      break;
-    case TSREQ_PTHREAD_SPIN_LOCK_INIT_OR_UNLOCK:
-      Put(UNLOCK_OR_INIT, ts_tid, pc, /*lock=*/args[1], 0);
-      break;
     case TSREQ_POSIX_SEM_INIT_POST:
     case TSREQ_POSIX_SEM_DESTROY_PRE:
       break;
-    case TSREQ_SIGNAL:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(SIGNAL, ts_tid, pc, args[1], 0);
+    case TSREQ_SIGNAL_MANY:
+    case TSREQ_WAIT_MANY:
+      PutManyEvents(vg_tid,
+                    args[0] == TSREQ_SIGNAL_MANY ? SIGNAL_MANY : WAIT_MANY,
+                    ts_tid, pc, (const uintptr_t*)args[1], 0, args[2], 0);
       break;
-    case TSREQ_WAIT:
-      if (ignoring_sync(vg_tid, args[1]))
-        break;
-      Put(WAIT, ts_tid, pc, args[1], 0);
+    case TSREQ_SIGNAL_ARRAY:
+    case TSREQ_WAIT_ARRAY:
+      PutManyEvents(vg_tid,
+                    args[0] == TSREQ_SIGNAL_ARRAY ? SIGNAL_MANY : WAIT_MANY,
+                    ts_tid, pc, NULL, args[1], args[2], args[3]);
       break;
-    case TSREQ_CYCLIC_BARRIER_INIT:
-      Put(CYCLIC_BARRIER_INIT, ts_tid, pc, args[1], args[2]);
-      break;
-    case TSREQ_CYCLIC_BARRIER_WAIT_BEFORE:
-      Put(CYCLIC_BARRIER_WAIT_BEFORE, ts_tid, pc, args[1], 0);
-      break;
-    case TSREQ_CYCLIC_BARRIER_WAIT_AFTER:
-      Put(CYCLIC_BARRIER_WAIT_AFTER, ts_tid, pc, args[1], 0);
+    case TSREQ_SET_REQUEST_BATCH:
+      if (G_flags->batch_sync_requests) {
+        thr->request_batch = (TsRequestBatch*)args[1];
+        thr->request_batch_done = 0;
+        *ret = 1;
+      }
       break;
+    case TSREQ_FLUSH_REQUEST_BATCH:
+      break;  // The batch has been handled above.
     case TSREQ_GET_MY_SEGMENT:
       break;
     case TSREQ_GET_THREAD_ID:
@@ -789,12 +980,26 @@ Bool ts_handle_client_request(ThreadId vg_tid, UWord* args, UWord* ret) {
     case TSREQ_FLUSH_STATE:
       Put(FLUSH_STATE, ts_tid, pc, 0, 0);
       break;
-    default: CHECK(0);
+    case TSREQ_TARGET_MEMORY_RANGE:
+      Put(TARGET_RANGE, ts_tid, pc, /*mem=*/args[1], /*size=*/args[2]);
+      break;
+    case TSREQ_UNTARGET_MEMORY_RANGE:
+      Put(UNTARGET_RANGE, ts_tid, pc, /*mem=*/args[1], /*size=*/args[2]);
+      break;
+    default:
+      CHECK(HandleSyncRequest(vg_tid, ts_tid, pc, args[0], args[1], args[2]));
   }
   return True;
 }
 
+// The handler does plain client requests. The requests batched so far are
+// handled first, but the batch is not emptied: the signal may have come in
+// the middle of an append, which completes after the handler returns.
 static void SignalIn(ThreadId vg_tid, Int sigNo, Bool alt_stack) {
+  ValgrindThread *thr = &g_valgrind_threads[vg_tid];
+  RequestBatchBarrier(thr);
+  if (thr->request_batch)
+    thr->request_batch->disabled = 1;
   g_valgrind_threads[vg_tid].in_signal_handler++;
   DCHECK(g_valgrind_threads[vg_tid].in_signal_handler == 1);
 //  int32_t ts_tid = VgTidToTsTid(vg_tid);
@@ -802,6 +1007,9 @@ static void SignalIn(ThreadId vg_tid, Int sigNo, Bool alt_stack) {
 }
 
 static void SignalOut(ThreadId vg_tid, Int sigNo) {
+  ValgrindThread *thr = &g_valgrind_threads[vg_tid];
+  if (thr->request_batch)
+    thr->request_batch->disabled = 0;
   g_valgrind_threads[vg_tid].in_signal_handler--;
   CHECK(g_valgrind_threads[vg_tid].in_signal_handler >= 0);
   DCHECK(g_valgrind_threads[vg_tid].in_signal_handler == 0);
@@ -853,8 +1061,9 @@ static uint32_t OnTraceVerify1() {
   if (!thr->verifier_current_pc) {
     // This is the first iteration of the sleep loop.
     // Register memory accesses.
-    int sleep_time_ms = RaceVerifierGetSleepTime(thr->trace_info->pc());
-    if (!sleep_time_ms) {
+    int sleep_time_ms = RaceVerifierGetSleepTime(thr->zero_based_uniq_tid,
+                                                 thr->trace_info->pc());
+    if (!sleep_time_ms && !G_flags->race_verifier_adaptive) {
       thr->trace_info = NULL;
       return 0;
     }
@@ -1061,6 +1270,113 @@ static void ts_instrument_final_jump (
   }
 }
 
+// State of the mop instrumentation of one superblock.
+//
+// With --coalesce_mops, an access whose address is the same base (an IR
+// temp or a constant) plus an offset that overlaps or directly follows the
+// range of the previous TLEB entry extends that entry instead of taking a
+// new one. E.g. the loads of a->x and a->y become one 16-byte mop. The
+// ranges must be contiguous and fit in MopInfo::kMaxSize, so the size of the
+// entry describes all the bytes it covers. The entry keeps the pc of its
+// first access, so a race on the other bytes is reported at that pc.
+// Side exits, dirty helpers and atomics end the current entry: the accesses
+// after them may not execute or must be seen separately.
+//
+// With --ignore_stack, accesses relative to a value of the guest SP read in
+// this superblock (see gen_Get_SP) are not instrumented at all.
+//
+// The same state goes through both passes of ts_instrument (counting and
+// instrumenting), so they make the same decisions.
+struct SblockMopState {
+  struct AddrDef {
+    bool valid;
+    IRTemp base;       // IRTemp_INVALID for a constant address.
+    intptr_t offset;
+  };
+
+  SblockMopState(IRSB *bbIn, VexGuestLayout *layout)
+      : defs(bbIn->tyenv->types_used),
+        is_sp(bbIn->tyenv->types_used),
+        offset_SP(layout->offset_SP),
+        sizeof_SP(layout->sizeof_SP) {
+    Reset();
+  }
+
+  void Reset() {
+    for (size_t i = 0; i < defs.size(); i++) {
+      defs[i].valid = false;
+      is_sp[i] = false;
+    }
+    EndEntry();
+  }
+
+  void EndEntry() { has_last = false; }
+
+  // Returns false if addr is not a temp or a constant.
+  bool Resolve(IRExpr *addr, AddrDef *res) {
+    res->valid = true;
+    if (addr->tag == Iex_Const) {
+      IRConst *con = addr->Iex.Const.con;
+      if (con->tag != Ico_U32 && con->tag != Ico_U64) return false;
+      res->base = IRTemp_INVALID;
+      res->offset = con->tag == Ico_U32 ? con->Ico.U32 : con->Ico.U64;
+      return true;
+    }
+    if (addr->tag != Iex_RdTmp) return false;
+    IRTemp t = addr->Iex.RdTmp.tmp;
+    if (t < defs.size() && defs[t].valid) {
+      *res = defs[t];
+    } else {
+      res->base = t;
+      res->offset = 0;
+    }
+    return true;
+  }
+
+  // Remembers 'tmp = base + const' and 'tmp = GET(SP)'.
+  void OnWrTmp(IRTemp t, IRExpr *data) {
+    if (t >= defs.size()) return;
+    if (data->tag == Iex_Get && data->Iex.Get.offset == offset_SP &&
+        sizeofIRType(data->Iex.Get.ty) == sizeof_SP) {
+      is_sp[t] = true;
+      return;
+    }
+    if (data->tag == Iex_RdTmp) {
+      Resolve(data, &defs[t]);
+      return;
+    }
+    if (data->tag != Iex_Binop) return;
+    IROp op = data->Iex.Binop.op;
+    bool is_add = op == Iop_Add32 || op == Iop_Add64;
+    bool is_sub = op == Iop_Sub32 || op == Iop_Sub64;
+    AddrDef base, delta;
+    if ((!is_add && !is_sub) ||
+        data->Iex.Binop.arg2->tag != Iex_Const ||
+        !Resolve(data->Iex.Binop.arg1, &base) ||
+        !Resolve(data->Iex.Binop.arg2, &delta))
+      return;
+    defs[t] = base;
+    defs[t].offset += is_add ? delta.offset : -delta.offset;
+  }
+
+  bool IsStack(const AddrDef &def) {
+    return def.base != IRTemp_INVALID && def.base < is_sp.size() &&
+        is_sp[def.base];
+  }
+
+  vector<AddrDef> defs;  // Indexed by IRTemp.
+  vector<bool> is_sp;
+  Int offset_SP;
+  Int sizeof_SP;
+
+  // The TLEB entry which the next access may extend.
+  bool has_last;
+  AddrDef last;
+  intptr_t last_end;
+  bool last_is_write;
+  size_t last_idx;
+};
+
 // Generate exprs/stmts that make g_cur_tleb[idx] = x.
 static void gen_store_to_tleb(IRSB *bbOut, IRTemp tleb_temp,
                               uintptr_t idx, IRExpr *x, IRType tyAddr) {
@@ -1078,6 +1394,7 @@ static void gen_store_to_tleb(IRSB *bbOut, IRTemp tleb_temp,
 }
 
 static void instrument_mem_access ( TraceInfo *trace_info,
+                                    SblockMopState *state,
                                     IRTemp tleb_temp,
                                     uintptr_t pc,
                                     size_t  *trace_idx,
@@ -1109,6 +1426,30 @@ static void instrument_mem_access ( TraceInfo *trace_info,
     check_ident_store = true;
   }
 
+  SblockMopState::AddrDef def;
+  bool resolved = state->Resolve(addr, &def);
+  if (resolved && G_flags->ignore_stack && state->IsStack(def)) {
+    return;
+  }
+
+  if (check_ident_store || !resolved) {
+    state->EndEntry();
+  } else if (G_flags->coalesce_mops && state->has_last &&
+             state->last.base == def.base &&
+             state->last_is_write == (bool)isStore &&
+             def.offset >= state->last.offset &&
+             def.offset <= state->last_end) {
+    intptr_t end = max(state->last_end, def.offset + (intptr_t)szB);
+    if (end - state->last.offset <= (intptr_t)MopInfo::kMaxSize) {
+      state->last_end = end;
+      if (trace_info) {
+        MopInfo *mop = trace_info->GetMop(state->last_idx);
+        new (mop) MopInfo(mop->pc(), end - state->last.offset, isStore, false);
+      }
+      return;
+    }
+  }
+
   size_t next_trace_idx = *trace_idx + 1;
 
   if (next_trace_idx > kMaxMopsPerTrace) {
@@ -1119,6 +1460,14 @@ static void instrument_mem_access ( TraceInfo *trace_info,
     return;
   }
 
+  if (resolved && !check_ident_store) {
+    state->has_last = true;
+    state->last = def;
+    state->last_end = def.offset + szB;
+    state->last_is_write = isStore;
+    state->last_idx = *trace_idx;
+  }
+
   if (!trace_info) {
     // not instrumenting yet.
     *trace_idx = next_trace_idx;
@@ -1173,22 +1522,28 @@ static void instrument_mem_access ( TraceInfo *trace_info,
 }
 
 void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
-                           TraceInfo *trace_info, IRTemp tleb_temp,
+                           TraceInfo *trace_info, SblockMopState *state,
+                           IRTemp tleb_temp,
                            size_t *idx, uintptr_t *cur_pc, bool dtor_head) {
   switch (st->tag) {
     case Ist_NoOp:
     case Ist_AbiHint:
     case Ist_Put:
     case Ist_PutI:
-    case Ist_Exit:
       /* None of these can contain any memory references. */
       break;
 
+    case Ist_Exit:
+      // The accesses after a side exit may not execute.
+      state->EndEntry();
+      break;
+
     case Ist_IMark:
       *cur_pc = st->Ist.IMark.addr;
       break;
 
     case Ist_MBE:
+      state->EndEntry();
       //instrument_memory_bus_event( bbOut, st->Ist.MBE.event );
       switch (st->Ist.MBE.event) {
         case Imbe_Fence:
@@ -1200,10 +1555,11 @@ void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
       break;
 
     case Ist_CAS:
+      state->EndEntry();
       break;
 
     case Ist_Store:
-      instrument_mem_access(trace_info, tleb_temp, *cur_pc, idx,
+      instrument_mem_access(trace_info, state, tleb_temp, *cur_pc, idx,
         bbOut, st,
         st->Ist.Store.addr,
         sizeofIRType(typeOfIRExpr(bbIn->tyenv, st->Ist.Store.data)),
@@ -1215,7 +1571,7 @@ void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
     case Ist_WrTmp: {
       IRExpr* data = st->Ist.WrTmp.data;
       if (data->tag == Iex_Load) {
-        instrument_mem_access(trace_info, tleb_temp, *cur_pc, idx,
+        instrument_mem_access(trace_info, state, tleb_temp, *cur_pc, idx,
             bbOut, st,
             data->Iex.Load.addr,
             sizeofIRType(data->Iex.Load.ty),
@@ -1223,17 +1579,20 @@ void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
             sizeofIRType(hWordTy)
             );
       }
+      state->OnWrTmp(st->Ist.WrTmp.tmp, data);
       break;
     }
 
     case Ist_LLSC: {
       /* Ignore load-linked's and store-conditionals. */
+      state->EndEntry();
       break;
     }
 
     case Ist_Dirty: {
       Int      dataSize;
       IRDirty* d = st->Ist.Dirty.details;
+      state->EndEntry();
       if (d->mFx != Ifx_None) {
         /* This dirty helper accesses memory.  Collect the
            details. */
@@ -1241,13 +1600,13 @@ void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
         tl_assert(d->mSize != 0);
         dataSize = d->mSize;
         if (d->mFx == Ifx_Read || d->mFx == Ifx_Modify) {
-          instrument_mem_access(trace_info, tleb_temp, *cur_pc, idx,
+          instrument_mem_access(trace_info, state, tleb_temp, *cur_pc, idx,
             bbOut, st, d->mAddr, dataSize, False/*!isStore*/, dtor_head,
             sizeofIRType(hWordTy)
           );
         }
         if (d->mFx == Ifx_Write || d->mFx == Ifx_Modify) {
-          instrument_mem_access(trace_info, tleb_temp, *cur_pc, idx,
+          instrument_mem_access(trace_info, state, tleb_temp, *cur_pc, idx,
             bbOut, st, d->mAddr, dataSize, True/*isStore*/, dtor_head,
             sizeofIRType(hWordTy)
           );
@@ -1256,6 +1615,7 @@ void instrument_statement (IRStmt* st, IRSB* bbIn, IRSB* bbOut, IRType hWordTy,
         tl_assert(d->mAddr == NULL);
         tl_assert(d->mSize == 0);
       }
+      state->EndEntry();
       break;
     }
 
@@ -1346,6 +1706,7 @@ static IRSB* ts_instrument ( VgCallbackClosure* closure,
       instrument_memory = false;
   }
 
+  SblockMopState state(bbIn, layout);
   // count mops
   if (instrument_memory) {
     for (i = first; i < bbIn->stmts_used; i++) {
@@ -1356,7 +1717,7 @@ static IRSB* ts_instrument ( VgCallbackClosure* closure,
         cur_pc = st->Ist.IMark.addr;
       if (!instrument_pc || cur_pc == instrument_pc)
         instrument_statement(st, bbIn, bbOut, hWordTy,
-            NULL, tleb_temp, &n_mops, &cur_pc, dtor_head);
+            NULL, &state, tleb_temp, &n_mops, &cur_pc, dtor_head);
     } /* iterate over bbIn->stmts */
   }
   TraceInfo *trace_info = NULL;
@@ -1364,6 +1725,7 @@ static IRSB* ts_instrument ( VgCallbackClosure* closure,
     trace_info = TraceInfo::NewTraceInfo(n_mops, pc);
   }
   size_t n_mops_done = 0;
+  state.Reset();
   bool need_to_insert_on_trace = n_mops > 0 || g_race_verifier_active;
   // instrument mops and copy the rest of BB to the new one.
   for (i = first; i < bbIn->stmts_used; i++) {
@@ -1391,7 +1753,7 @@ static IRSB* ts_instrument ( VgCallbackClosure* closure,
         cur_pc = st->Ist.IMark.addr;
       if (!instrument_pc || cur_pc == instrument_pc)
         instrument_statement(st, bbIn, bbOut, hWordTy,
-            trace_info, tleb_temp, &n_mops_done, &cur_pc, dtor_head);
+            trace_info, &state, tleb_temp, &n_mops_done, &cur_pc, dtor_head);
     }
     addStmtToIRSB( bbOut, st );
   } /* iterate over bbIn->stmts */
@@ -1434,6 +1796,7 @@ void ts_pre_clo_init(void) {
    VG_(track_post_deliver_signal)(&SignalOut);
 
    VG_(track_start_client_code)( OnStartClientCode );
+   VG_(track_stop_client_code)( OnStopClientCode );
 }
 
 VG_DETERMINE_INTERFACE_VERSION(ts_pre_clo_init)
@@ -100,8 +100,40 @@ enum {
   TSREQ_THREAD_SANITIZER_QUERY,
   TSREQ_FLUSH_STATE,
   TSREQ_MUTEX_IS_NOT_PHB,  // The opposite of TSREQ_MUTEX_IS_USED_AS_CONDVAR.
-  TSREQ_FLUSH_EXPECTED_RACES
+  TSREQ_FLUSH_EXPECTED_RACES,
+  TSREQ_SIGNAL_MANY,  // {objs, n}
+  TSREQ_WAIT_MANY,    // {objs, n}
+  TSREQ_SIGNAL_ARRAY,  // {array, n, elem_size}
+  TSREQ_WAIT_ARRAY,    // {array, n, elem_size}
+  TSREQ_TARGET_MEMORY_RANGE,  // {mem, size}
+  TSREQ_UNTARGET_MEMORY_RANGE,  // {mem, size}
+  TSREQ_SET_REQUEST_BATCH,  // {batch}, returns 1 if batching is on.
+  TSREQ_FLUSH_REQUEST_BATCH
 };
+
+// With --batch_sync_requests the intercepts don't do a client request for
+// each synchronization event which returns nothing (lock, unlock, signal,
+// wait, ...). They append it to the thread's TsRequestBatch instead, which
+// the thread registers once with TSREQ_SET_REQUEST_BATCH. The tool reads
+// the batch right from the guest memory and handles it before anything else
+// the thread does: before its mops, calls and returns, before its next
+// client request and when it stops running. Valgrind runs one thread at a
+// time, so ThreadSanitizer still sees all the events in the order they
+// happened. A full batch is flushed with TSREQ_FLUSH_REQUEST_BATCH.
+// The guest fills reqs[n] and only then increments n. While the thread is
+// in a signal handler the tool sets 'disabled' and the handler does plain
+// client requests, so an append interrupted by a signal stays consistent.
+#define TS_REQUEST_BATCH_SIZE 64
+
+typedef struct {
+  unsigned long req, pc, sp, arg1, arg2;
+} TsBatchedRequest;
+
+typedef struct {
+  unsigned long n;
+  unsigned long disabled;
+  TsBatchedRequest reqs[TS_REQUEST_BATCH_SIZE];
+} TsRequestBatch;
 #endif  // TS_VALGRIND_CLIENT_REQUESTS_H_
 // end. {{{1
 // vim:shiftwidth=2:softtabstop=2:expandtab
@@ -196,6 +196,64 @@ static inline int  VALGRIND_TS_SEGMENT_ID(void) {
                     long,_err, char*,_errstr);           \
    } while (0)
 
+//----------- Batched sync requests ----------------- {{{1
+// See TsRequestBatch in ts_valgrind_client_requests.h.
+static __thread TsRequestBatch ts_request_batch;
+// 0: not registered yet, 1: batching, -1: the tool does not batch.
+static __thread int ts_request_batch_state;
+
+static inline int RequestBatchOn(void) {
+  if (ts_request_batch_state == 0) {
+    Word res;
+    VALGRIND_DO_CLIENT_REQUEST(res, 0,
+                               TSREQ_SET_REQUEST_BATCH,
+                               &ts_request_batch, 0, 0, 0, 0);
+    ts_request_batch_state = res ? 1 : -1;
+  }
+  return ts_request_batch_state > 0 && !ts_request_batch.disabled;
+}
+
+// Inlined, so that the wrapper is the top frame, as with a client request.
+static inline __attribute__((always_inline))
+void RequestBatchPut(Word req, Word pc, Word sp, Word arg1, Word arg2) {
+  TsRequestBatch *batch = &ts_request_batch;
+  unsigned long i = batch->n;
+  TsBatchedRequest *r = &batch->reqs[i];
+  r->req = req;
+  r->pc = pc;
+  r->sp = sp;
+  r->arg1 = arg1;
+  r->arg2 = arg2;
+  // The tool may look at the batch at any superblock boundary.
+  __asm__ __volatile__("" : : : "memory");
+  batch->n = i + 1;
+  if (i + 1 == TS_REQUEST_BATCH_SIZE)
+    DO_CREQ_v_v(TSREQ_FLUSH_REQUEST_BATCH);
+}
+
+// The address of the current instruction.
+#define TS_CURRENT_PC() ({ __label__ _here; _here: (Word)&&_here; })
+
+// Same as DO_CREQ_v_WW, but may put the request into the batch.
+// Only for the requests HandleSyncRequest() in ts_valgrind.cc handles.
+#define DO_SYNC_CREQ_v_WW(_creqF, _ty1F,_arg1F, _ty2F,_arg2F) \
+   do {                                                  \
+      Word _sarg1, _sarg2;                               \
+      assert(sizeof(_ty1F) == sizeof(Word));             \
+      assert(sizeof(_ty2F) == sizeof(Word));             \
+      _sarg1 = (Word)(_arg1F);                           \
+      _sarg2 = (Word)(_arg2F);                           \
+      if (RequestBatchOn()) {                            \
+         RequestBatchPut((_creqF), TS_CURRENT_PC(),      \
+                         (Word)&_sarg1, _sarg1, _sarg2); \
+      } else {                                           \
+         DO_CREQ_v_WW((_creqF), Word,_sarg1, Word,_sarg2); \
+      }                                                  \
+   } while (0)
+
+#define DO_SYNC_CREQ_v_W(_creqF, _ty1F,_arg1F)           \
+   DO_SYNC_CREQ_v_WW(_creqF, _ty1F,_arg1F, long,0)
+
 static inline void IGNORE_ALL_ACCESSES_BEGIN(void) {
    DO_CREQ_v_W(TSREQ_IGNORE_ALL_ACCESSES_BEGIN,  void*, NULL);
 }
@@ -308,7 +366,7 @@ MAIN_WRAPPER_DECL {
     CALL_FN_W_WWW(ret, fn, options, item, priority); \
     /* Trigger only on workq_ops(QUEUE_ADD) */ \
     if (options == 1) { \
-      DO_CREQ_v_W(TSREQ_SIGNAL, void*,item); \
+      DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*,item); \
     } \
     return ret; \
   }
@@ -875,7 +933,7 @@ PTH_FUNC(int, pthreadZumutexZuinit, // pthread_mutex_init
    CALL_FN_W_WW(ret, fn, mutex,attr);
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_CREATE_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_CREATE_POST,
                    pthread_mutex_t*,mutex, long,mbRec);
    } else {
       DO_PthAPIerror( "pthread_mutex_init", ret );
@@ -899,7 +957,7 @@ PTH_FUNC(int, pthreadZumutexZudestroy, // pthread_mutex_destroy
       fprintf(stderr, "<< pthread_mxdestroy %p", mutex); fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE,
+   DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE,
                pthread_mutex_t*,mutex);
 
    CALL_FN_W_W(ret, fn, mutex);
@@ -938,7 +996,7 @@ PTH_FUNC(int, pthreadZumutexZulock, // pthread_mutex_lock
 
    if (is_outermost) {
       if ((ret == 0 /*success*/)) {
-         DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+         DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                       pthread_mutex_t*,mutex, long, 1);
       } else {
          DO_PthAPIerror( "pthread_mutex_lock", ret );
@@ -976,7 +1034,7 @@ static int pthread_mutex_trylock_WRK(pthread_mutex_t *mutex)
       this matter?  Not sure, but I don't think so. */
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                   pthread_mutex_t*,mutex, long, 1);
    } else {
       if (ret != EBUSY)
@@ -1018,7 +1076,7 @@ PTH_FUNC(int, pthreadZumutexZutimedlock, // pthread_mutex_timedlock
       this matter?  Not sure, but I don't think so. */
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                   pthread_mutex_t*,mutex, long, 1);
    } else {
       if (ret != ETIMEDOUT)
@@ -1048,7 +1106,7 @@ PTH_FUNC(int, pthreadZumutexZuunlock, // pthread_mutex_unlock
    }
 
    if (is_outermost)
-      DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE,
+      DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE,
                   pthread_mutex_t*,mutex);
 
    CALL_FN_W_W(ret, fn, mutex);
@@ -1077,7 +1135,7 @@ PTH_FUNC(int, pthreadZuspinZuinit, void *lock, int pshared) {
   }
   CALL_FN_W_WW(ret, fn, lock, pshared);
   if (ret == 0)  {
-    DO_CREQ_v_W(TSREQ_PTHREAD_SPIN_LOCK_INIT_OR_UNLOCK, void *, lock);
+    DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_SPIN_LOCK_INIT_OR_UNLOCK, void *, lock);
   }
   if (TRACE_PTH_FNS) {
     fprintf(stderr, " -- %p >>\n", lock);
@@ -1094,7 +1152,7 @@ PTH_FUNC(int, pthreadZuspinZudestroy, void *lock) {
   if (TRACE_PTH_FNS) {
     fprintf(stderr, "<< %s %p", func, lock);
   }
-  DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE, void*, lock);
+  DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE, void*, lock);
   CALL_FN_W_W(ret, fn, lock);
   if (TRACE_PTH_FNS) {
     fprintf(stderr, " -- %p >>\n", lock);
@@ -1113,7 +1171,7 @@ PTH_FUNC(int, pthreadZuspinZulock, void *lock) {
   }
   CALL_FN_W_W(ret, fn, lock);
   if (ret == 0) {
-    DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, lock,
+    DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, lock,
                  long, 1 /*is_w*/);
   }
   if (TRACE_PTH_FNS) {
@@ -1133,7 +1191,7 @@ PTH_FUNC(int, pthreadZuspinZutrylock, void *lock) {
   }
   CALL_FN_W_W(ret, fn, lock);
   if (ret == 0) {
-    DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, lock,
+    DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, lock,
                  long, 1 /*is_w*/);
   }
   if (TRACE_PTH_FNS) {
@@ -1151,7 +1209,7 @@ PTH_FUNC(int, pthreadZuspinZuunlock, void *lock) {
   if (TRACE_PTH_FNS) {
     fprintf(stderr, "<< %s %p", func, lock);
   }
-  DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void*, lock);
+  DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void*, lock);
   CALL_FN_W_W(ret, fn, lock);
   if (TRACE_PTH_FNS) {
     fprintf(stderr, " -- %p >>\n", lock);
@@ -1185,14 +1243,14 @@ static int pthread_cond_wait_WRK(pthread_cond_t* cond, pthread_mutex_t* mutex)
     fflush(stderr);
   }
   if (is_outermost) {
-    DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, pthread_mutex_t*,mutex);
+    DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, pthread_mutex_t*,mutex);
   }
 
   CALL_FN_W_WW(ret, fn, cond,mutex);
 
   if (is_outermost) {
-    DO_CREQ_v_W(TSREQ_WAIT, void *,cond);
-    DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, mutex,
+    DO_SYNC_CREQ_v_W(TSREQ_WAIT, void *,cond);
+    DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *, mutex,
                  long, 1 /*is_w*/);
   }
 
@@ -1248,7 +1306,7 @@ static int pthread_cond_timedwait_WRK(pthread_cond_t* cond,
       for bogus argument values.  In return it tells us whether it
       thinks the mutex is valid or not. */
    if (is_outermost) {
-     DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void *,mutex);
+     DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void *,mutex);
    }
 
 
@@ -1256,9 +1314,9 @@ static int pthread_cond_timedwait_WRK(pthread_cond_t* cond,
 
    if (is_outermost) {
       if (ret == 0) {
-         DO_CREQ_v_W(TSREQ_WAIT, void *, cond);
+         DO_SYNC_CREQ_v_W(TSREQ_WAIT, void *, cond);
       }
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *,mutex,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST, void *,mutex,
                   long, 1 /*is_w*/);
    }
 
@@ -1315,7 +1373,7 @@ static int pthread_cond_signal_WRK(pthread_cond_t* cond)
       fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_SIGNAL,
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL,
                pthread_cond_t*,cond);
 
    CALL_FN_W_W(ret, fn, cond);
@@ -1359,7 +1417,7 @@ static int pthread_cond_broadcast_WRK(pthread_cond_t* cond)
       fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_SIGNAL,
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL,
                pthread_cond_t*,cond);
 
    CALL_FN_W_W(ret, fn, cond);
@@ -1389,7 +1447,7 @@ PTH_FUNC(int, pthreadZucondZubroadcastZAZa, // pthread_cond_broadcast@*
 }
 
 static void do_wait(void *cv) {
-  DO_CREQ_v_W(TSREQ_WAIT, void *, cv);
+  DO_SYNC_CREQ_v_W(TSREQ_WAIT, void *, cv);
 }
 
 /*----------------------------------------------------------------*/
@@ -1410,9 +1468,9 @@ static int pthread_barrier_wait_WRK(pthread_barrier_t* b)
       fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_CYCLIC_BARRIER_WAIT_BEFORE, void*,b);
+   DO_SYNC_CREQ_v_W(TSREQ_CYCLIC_BARRIER_WAIT_BEFORE, void*,b);
    CALL_FN_W_W(ret, fn, b);
-   DO_CREQ_v_W(TSREQ_CYCLIC_BARRIER_WAIT_AFTER, void*,b);
+   DO_SYNC_CREQ_v_W(TSREQ_CYCLIC_BARRIER_WAIT_AFTER, void*,b);
 
    // FIXME: handle ret
    if (TRACE_PTH_FNS) {
@@ -1433,7 +1491,7 @@ PTH_FUNC(int, pthreadZubarrierZuinit, void *b, void *a, unsigned n) {
    int ret;
    OrigFn fn;
    VALGRIND_GET_ORIG_FN(fn);
-   DO_CREQ_v_WW(TSREQ_CYCLIC_BARRIER_INIT, void*,b, unsigned long, n);
+   DO_SYNC_CREQ_v_WW(TSREQ_CYCLIC_BARRIER_INIT, void*,b, unsigned long, n);
    CALL_FN_W_WWW(ret, fn, b, a, n);
    return ret;
 }
@@ -1467,7 +1525,7 @@ static int pthread_rwlock_init_WRK(pthread_rwlock_t *rwl,
    CALL_FN_W_WW(ret, fn, rwl,attr);
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_CREATE_POST,
+      DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_CREATE_POST,
                   pthread_rwlock_t*,rwl);
    } else {
       DO_PthAPIerror( "pthread_rwlock_init", ret );
@@ -1503,7 +1561,7 @@ static int pthread_rwlock_destroy_WRK( pthread_rwlock_t *rwl)
       fprintf(stderr, "<< pthread_rwl_destroy %p", rwl); fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE,
+   DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE,
                pthread_rwlock_t*,rwl);
 
    CALL_FN_W_W(ret, fn, rwl);
@@ -1547,7 +1605,7 @@ static int pthread_rwlock_wrlock_WRK(pthread_rwlock_t* rwlock)
    IGNORE_ALL_SYNC_END();
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                    pthread_rwlock_t*,rwlock, long,1/*isW*/);
    } else {
       DO_PthAPIerror( "pthread_rwlock_wrlock", ret );
@@ -1586,7 +1644,7 @@ static int pthread_rwlock_rdlock_WRK(pthread_rwlock_t* rwlock)
    IGNORE_ALL_SYNC_END();
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                    pthread_rwlock_t*,rwlock, long,0/*!isW*/);
    } else {
       DO_PthAPIerror( "pthread_rwlock_rdlock", ret );
@@ -1630,7 +1688,7 @@ static int pthread_rwlock_trywrlock_WRK(pthread_rwlock_t* rwlock)
       this matter?  Not sure, but I don't think so. */
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                    pthread_rwlock_t*,rwlock, long,1/*isW*/);
    } else {
       if (ret != EBUSY)
@@ -1675,7 +1733,7 @@ static int pthread_rwlock_tryrdlock_WRK(pthread_rwlock_t* rwlock)
       this matter?  Not sure, but I don't think so. */
 
    if (ret == 0 /*success*/) {
-      DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
+      DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,
                    pthread_rwlock_t*,rwlock, long,0/*!isW*/);
    } else {
       if (ret != EBUSY)
@@ -1711,7 +1769,7 @@ static int pthread_rwlock_unlock_WRK(pthread_rwlock_t* rwlock)
       fprintf(stderr, "<< pthread_rwl_unlk %p", rwlock); fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE,
+   DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE,
                pthread_rwlock_t*,rwlock);
 
    IGNORE_ALL_SYNC_BEGIN();
@@ -1849,7 +1907,7 @@ static int sem_wait_WRK(sem_t* sem, const char *name, int is_try)
    CALL_FN_W_W(ret, fn, sem);
 
    if (ret == 0) {
-      DO_CREQ_v_W(TSREQ_WAIT, sem_t*,sem);
+      DO_SYNC_CREQ_v_W(TSREQ_WAIT, sem_t*,sem);
    } else {
       if (!is_try) {
          DO_PthAPIerror( name, errno );
@@ -1898,7 +1956,7 @@ static int sem_post_WRK(OrigFn fn, sem_t* sem)
       fflush(stderr);
    }
 
-   DO_CREQ_v_W(TSREQ_SIGNAL, sem_t*,sem);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, sem_t*,sem);
 
    CALL_FN_W_W(ret, fn, sem);
 
@@ -1958,7 +2016,7 @@ static sem_t *sem_open_WRK(OrigFn fn,
      // But in such case we also need to handle sem_unlink.
      //
      // To avoid this complexity we simply do a SIGNAL here.
-     DO_CREQ_v_W(TSREQ_SIGNAL, sem_t*, ret);
+     DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, sem_t*, ret);
    }
    return ret;
 }
@@ -1988,7 +2046,7 @@ static void *AtExitMagic(void) {
    long    ret;\
    VALGRIND_GET_ORIG_FN(fn);\
    CALL_FN_W_W(ret, fn, callback);\
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, AtExitMagic());\
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, AtExitMagic());\
    return ret;\
 }\
 
@@ -2030,7 +2088,7 @@ LIBC_FUNC(int, epoll_ctl, int epfd, int op, int fd, void *event) {
    VALGRIND_GET_ORIG_FN(fn);
 //   fprintf(stderr, "T%d socket epoll_ctl: %d\n", VALGRIND_TS_THREAD_ID(), epfd);
    o = SocketMagic();
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
    CALL_FN_W_WWWW(ret, fn, epfd, op, fd, event);
    return ret;
 }
@@ -2044,7 +2102,7 @@ LIBC_FUNC(int, epoll_ctl, int epfd, int op, int fd, void *event) {
       fprintf(stderr, "T%d socket send: %d\n", VALGRIND_TS_THREAD_ID(), s); \
    } \
    o = SocketMagic(); \
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
    CALL_FN_W_WWWW(ret, fn, s, buf, len, flags); \
    return ret; \
 } \
@@ -2060,7 +2118,7 @@ LIBC_FUNC(long, send, int s, void *buf, long len, int flags) SEND_BODY
    void *o; \
    VALGRIND_GET_ORIG_FN(fn); \
    o = SocketMagic(); \
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
    CALL_FN_W_WWW(ret, fn, s, msg, flags); \
    return ret; \
 } \
@@ -2148,7 +2206,7 @@ LIBC_FUNC(long, read, int s, void *a2, long count) READ_BODY
    void *o; \
    VALGRIND_GET_ORIG_FN(fn); \
    o = SocketMagic(); \
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o); \
    CALL_FN_W_WWW(ret, fn, s, a2, a3); \
    return ret; \
 } \
@@ -2180,7 +2238,7 @@ LIBC_FUNC(long, writev, int fd, const void *iov, int iovcnt) {
    VALGRIND_GET_ORIG_FN(fn);
 //   fprintf(stderr, "T%d socket writev: %d\n", VALGRIND_TS_THREAD_ID(), fd);
    o = SocketMagic();
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
    CALL_FN_W_WWW(ret, fn, fd, iov, iovcnt);
    return ret;
 }
@@ -2193,7 +2251,7 @@ LIBC_FUNC(long, unlink, void *path) {
    void *o;
    VALGRIND_GET_ORIG_FN(fn);
    o = SocketMagic();
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
    CALL_FN_W_W(ret, fn, path);
    return ret;
 }
@@ -2206,7 +2264,7 @@ static int open_WRK(void *path, int flags, int mode) {
    void *o;
    VALGRIND_GET_ORIG_FN(fn);
    o = SocketMagic();
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
    CALL_FN_W_WWW(ret, fn, path, flags, mode);
    do_wait(o);
    return ret;
@@ -2227,7 +2285,7 @@ LIBC_FUNC(int, rmdir, void *path) {
    void *o;
    VALGRIND_GET_ORIG_FN(fn);
    o = SocketMagic();
-   DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+   DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
    CALL_FN_W_W(ret, fn, path);
    return ret;
 }
@@ -2261,7 +2319,7 @@ LIBC_FUNC(int, lockf, int fd, int cmd, OFF_T offset) {
   VALGRIND_GET_ORIG_FN(fn);
   o = SocketMagic();
   if (cmd == F_ULOCK) {
-    DO_CREQ_v_W(TSREQ_SIGNAL, void*, o);
+    DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, o);
   }
   CALL_FN_W_2WO_T(ret, fn, fd, cmd, offset);
   if (cmd == F_LOCK && ret == 0) {
@@ -2599,32 +2657,42 @@ ANN_FUNC(void, AnnotateFlushState, const char *unused_file, int unused_line) {
   DO_CREQ_v_v(TSREQ_FLUSH_STATE);
 }
 
+ANN_FUNC(void, AnnotateTargetMemoryRange, const char *unused_file,
+         int unused_line, void *mem, long size) {
+  DO_CREQ_v_WW(TSREQ_TARGET_MEMORY_RANGE, void*, mem, long, size);
+}
+
+ANN_FUNC(void, AnnotateUntargetMemoryRange, const char *unused_file,
+         int unused_line, void *mem, long size) {
+  DO_CREQ_v_WW(TSREQ_UNTARGET_MEMORY_RANGE, void*, mem, long, size);
+}
+
 ANN_FUNC(void, AnnotateRWLockCreate, const char *file, int line, void *lock)
 {
   const char *name = "AnnotateRWLockCreate";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, lock, file, line);
-  DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_CREATE_POST, void*, lock, long, 0 /*non recur*/);
+  DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_CREATE_POST, void*, lock, long, 0 /*non recur*/);
 }
 
 ANN_FUNC(void, AnnotateRWLockDestroy, const char *file, int line, void *lock)
 {
   const char *name = "AnnotateRWLockDestroy";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, lock, file, line);
-  DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE, void*, lock);
+  DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_DESTROY_PRE, void*, lock);
 }
 
 ANN_FUNC(void, AnnotateRWLockAcquired, const char *file, int line, void *lock, int is_w)
 {
   const char *name = "AnnotateRWLockAcquired";
   ANN_TRACE("--#%d %s[%p] rw=%d %s:%d\n", tid, name, lock, is_w, file, line);
-  DO_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,  void*,lock,long, (long)is_w);
+  DO_SYNC_CREQ_v_WW(TSREQ_PTHREAD_RWLOCK_LOCK_POST,  void*,lock,long, (long)is_w);
 }
 
 ANN_FUNC(void, AnnotateRWLockReleased, const char *file, int line, void *lock, int is_w)
 {
   const char *name = "AnnotateRWLockReleased";
   ANN_TRACE("--#%d %s[%p] rw=%d %s:%d\n", tid, name, lock, is_w, file, line);
-  DO_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void*, lock);
+  DO_SYNC_CREQ_v_W(TSREQ_PTHREAD_RWLOCK_UNLOCK_PRE, void*, lock);
 }
 
 ANN_FUNC(void, AnnotateCondVarWait, const char *file, int line, void *cv, void *lock)
@@ -2638,28 +2706,28 @@ ANN_FUNC(void, AnnotateCondVarSignal, const char *file, int line, void *cv)
 {
   const char *name = "AnnotateCondVarSignal";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, cv, file, line);
-  DO_CREQ_v_W(TSREQ_SIGNAL, void*,cv);
+  DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*,cv);
 }
 
 ANN_FUNC(void, AnnotateCondVarSignalAll, const char *file, int line, void *cv)
 {
   const char *name = "AnnotateCondVarSignalAll";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, cv, file, line);
-  DO_CREQ_v_W(TSREQ_SIGNAL, void*,cv);
+  DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*,cv);
 }
 
 ANN_FUNC(void, AnnotateHappensBefore, const char *file, int line, void *obj)
 {
   const char *name = "AnnotateHappensBefore";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, obj, file, line);
-  DO_CREQ_v_W(TSREQ_SIGNAL, void*, obj);
+  DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, obj);
 }
 
 ANN_FUNC(void, WTFAnnotateHappensBefore, const char *file, int line, void *obj)
 {
   const char *name = "WTFAnnotateHappensBefore";
   ANN_TRACE("--#%d %s[%p] %s:%d\n", tid, name, obj, file, line);
-  DO_CREQ_v_W(TSREQ_SIGNAL, void*, obj);
+  DO_SYNC_CREQ_v_W(TSREQ_SIGNAL, void*, obj);
 }
 
 ANN_FUNC(void, AnnotateHappensAfter, const char *file, int line, void *obj)
@@ -2676,6 +2744,38 @@ ANN_FUNC(void, WTFAnnotateHappensAfter, const char *file, int line, void *obj)
   do_wait(obj);
 }
 
+ANN_FUNC(void, AnnotateHappensBeforeMany, const char *file, int line,
+         void **objs, long n)
+{
+  const char *name = "AnnotateHappensBeforeMany";
+  ANN_TRACE("--#%d %s[%p,%ld] %s:%d\n", tid, name, objs, n, file, line);
+  DO_CREQ_v_WW(TSREQ_SIGNAL_MANY, void**, objs, long, n);
+}
+
+ANN_FUNC(void, AnnotateHappensAfterMany, const char *file, int line,
+         void **objs, long n)
+{
+  const char *name = "AnnotateHappensAfterMany";
+  ANN_TRACE("--#%d %s[%p,%ld] %s:%d\n", tid, name, objs, n, file, line);
+  DO_CREQ_v_WW(TSREQ_WAIT_MANY, void**, objs, long, n);
+}
+
+ANN_FUNC(void, AnnotateHappensBeforeArray, const char *file, int line,
+         void *array, long n, long elem_size)
+{
+  const char *name = "AnnotateHappensBeforeArray";
+  ANN_TRACE("--#%d %s[%p,%ld] %s:%d\n", tid, name, array, n, file, line);
+  DO_CREQ_v_WWW(TSREQ_SIGNAL_ARRAY, void*, array, long, n, long, elem_size);
+}
+
+ANN_FUNC(void, AnnotateHappensAfterArray, const char *file, int line,
+         void *array, long n, long elem_size)
+{
+  const char *name = "AnnotateHappensAfterArray";
+  ANN_TRACE("--#%d %s[%p,%ld] %s:%d\n", tid, name, array, n, file, line);
+  DO_CREQ_v_WWW(TSREQ_WAIT_ARRAY, void*, array, long, n, long, elem_size);
+}
+
 ANN_FUNC(void, AnnotatePCQCreate, const char *file, int line, void *pcq)
 {
   const char *name = "AnnotatePCQCreate";
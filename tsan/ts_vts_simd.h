@@ -0,0 +1,280 @@
+/* Copyright (c) 2008-2010, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// This file is part of ThreadSanitizer, a dynamic data race detector.
+#ifndef TS_VTS_SIMD_
+#define TS_VTS_SIMD_
+
+#include "ts_util.h"
+
+// Kernels used by VTS::HappensBefore(), VTS::Join() and VTS::CopyAndTick().
+// A VTS is an array of (tid, clk) pairs of int32_t sorted by tid.
+// The two VTSs being compared usually have the same set of tids (or at least
+// a long common prefix), so the kernels handle the longest prefix where
+// the tids are pairwise equal; the callers do the general merge for the rest.
+//
+// There are scalar, SSE4.2 and AVX2 variants; GetBestVtsKernels() picks one
+// using CPUID.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(TS_VALGRIND) && !defined(TS_VTS_NO_SIMD) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define TS_VTS_SIMD 1
+# include <immintrin.h>
+#else
+# define TS_VTS_SIMD 0
+#endif
+
+struct VtsKernels {
+  const char *name;
+  // Scans the pairs 0..n-1 while the tids are equal.
+  // Returns the index of the first pair with different tids (or n).
+  // Sets *a_lt_b if some clk in 'a' is less than the one in 'b'.
+  // Returns early and sets *a_gt_b if some clk in 'a' is greater.
+  size_t (*CompareEqualTidPrefix)(const int32_t *a, const int32_t *b,
+                                  size_t n, bool *a_lt_b, bool *a_gt_b);
+  // Writes max(a[i], b[i]) to res[i] while the tids are equal.
+  // Returns the index of the first pair with different tids (or n).
+  size_t (*MaxEqualTidPrefix)(const int32_t *a, const int32_t *b,
+                              int32_t *res, size_t n);
+  // Copies n pairs from 'a' to 'res' and returns the index of 'tid' (or n).
+  size_t (*CopyAndFindTid)(const int32_t *a, int32_t *res, size_t n,
+                           int32_t tid);
+};
+
+// -------- Scalar ------ {{{1
+static inline size_t CompareEqualTidPrefixScalar(
+    const int32_t *a, const int32_t *b, size_t n,
+    bool *a_lt_b, bool *a_gt_b) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[2 * i] != b[2 * i]) return i;
+    if (a[2 * i + 1] > b[2 * i + 1]) {
+      *a_gt_b = true;
+      return i;
+    }
+    if (a[2 * i + 1] < b[2 * i + 1]) *a_lt_b = true;
+  }
+  return n;
+}
+
+static inline size_t MaxEqualTidPrefixScalar(
+    const int32_t *a, const int32_t *b, int32_t *res, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[2 * i] != b[2 * i]) return i;
+    res[2 * i] = a[2 * i];
+    res[2 * i + 1] = max(a[2 * i + 1], b[2 * i + 1]);
+  }
+  return n;
+}
+
+static inline size_t CopyAndFindTidScalar(
+    const int32_t *a, int32_t *res, size_t n, int32_t tid) {
+  size_t found = n;
+  for (size_t i = 0; i < n; i++) {
+    res[2 * i] = a[2 * i];
+    res[2 * i + 1] = a[2 * i + 1];
+    if (a[2 * i] == tid) found = i;
+  }
+  return found;
+}
+
+static const VtsKernels kVtsKernelsScalar = {
+  "scalar",
+  CompareEqualTidPrefixScalar,
+  MaxEqualTidPrefixScalar,
+  CopyAndFindTidScalar
+};
+
+#if TS_VTS_SIMD
+// -------- SSE4.2 ------ {{{1
+// One 128-bit vector holds 2 pairs: tids in lanes 0 and 2, clks in 1 and 3.
+#define TS_VTS_TARGET_SSE __attribute__((target("sse4.2")))
+#define TS_VTS_TARGET_AVX2 __attribute__((target("avx2")))
+
+TS_VTS_TARGET_SSE static inline size_t CompareEqualTidPrefixSSE(
+    const int32_t *a, const int32_t *b, size_t n,
+    bool *a_lt_b, bool *a_gt_b) {
+  size_t i = 0;
+  __m128i lt = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + 2 * i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + 2 * i));
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vb)));
+    if ((eq & 5) != 5) break;  // Different tids, finish with scalar code.
+    int gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(va, vb)));
+    if (gt & 10) {
+      *a_gt_b = true;
+      return i;
+    }
+    lt = _mm_or_si128(lt, _mm_cmplt_epi32(va, vb));
+  }
+  if (_mm_movemask_ps(_mm_castsi128_ps(lt)) & 10) *a_lt_b = true;
+  return i + CompareEqualTidPrefixScalar(a + 2 * i, b + 2 * i, n - i,
+                                         a_lt_b, a_gt_b);
+}
+
+TS_VTS_TARGET_SSE static inline size_t MaxEqualTidPrefixSSE(
+    const int32_t *a, const int32_t *b, int32_t *res, size_t n) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + 2 * i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + 2 * i));
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vb)));
+    if ((eq & 5) != 5) break;
+    // The tids are equal, so max() keeps them.
+    _mm_storeu_si128((__m128i*)(res + 2 * i), _mm_max_epi32(va, vb));
+  }
+  return i + MaxEqualTidPrefixScalar(a + 2 * i, b + 2 * i, res + 2 * i,
+                                     n - i);
+}
+
+TS_VTS_TARGET_SSE static inline size_t CopyAndFindTidSSE(
+    const int32_t *a, int32_t *res, size_t n, int32_t tid) {
+  size_t i = 0;
+  size_t found = n;
+  __m128i vtid = _mm_set1_epi32(tid);
+  for (; i + 2 <= n; i += 2) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + 2 * i));
+    _mm_storeu_si128((__m128i*)(res + 2 * i), va);
+    int eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vtid)));
+    if (eq & 1) found = i;
+    if (eq & 4) found = i + 1;
+  }
+  size_t rest = CopyAndFindTidScalar(a + 2 * i, res + 2 * i, n - i, tid);
+  return rest < n - i ? i + rest : found;
+}
+
+static const VtsKernels kVtsKernelsSSE = {
+  "sse4.2",
+  CompareEqualTidPrefixSSE,
+  MaxEqualTidPrefixSSE,
+  CopyAndFindTidSSE
+};
+
+// -------- AVX2 ------ {{{1
+// One 256-bit vector holds 4 pairs: tids in even lanes, clks in odd lanes.
+TS_VTS_TARGET_AVX2 static inline size_t CompareEqualTidPrefixAVX2(
+    const int32_t *a, const int32_t *b, size_t n,
+    bool *a_lt_b, bool *a_gt_b) {
+  size_t i = 0;
+  __m256i lt = _mm256_setzero_si256();
+  for (; i + 4 <= n; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + 2 * i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + 2 * i));
+    int eq = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+    if ((eq & 0x55) != 0x55) break;
+    int gt = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(va, vb)));
+    if (gt & 0xaa) {
+      *a_gt_b = true;
+      return i;
+    }
+    lt = _mm256_or_si256(lt, _mm256_cmpgt_epi32(vb, va));
+  }
+  if (_mm256_movemask_ps(_mm256_castsi256_ps(lt)) & 0xaa) *a_lt_b = true;
+  return i + CompareEqualTidPrefixSSE(a + 2 * i, b + 2 * i, n - i,
+                                      a_lt_b, a_gt_b);
+}
+
+TS_VTS_TARGET_AVX2 static inline size_t MaxEqualTidPrefixAVX2(
+    const int32_t *a, const int32_t *b, int32_t *res, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + 2 * i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + 2 * i));
+    int eq = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+    if ((eq & 0x55) != 0x55) break;
+    _mm256_storeu_si256((__m256i*)(res + 2 * i), _mm256_max_epi32(va, vb));
+  }
+  return i + MaxEqualTidPrefixSSE(a + 2 * i, b + 2 * i, res + 2 * i, n - i);
+}
+
+TS_VTS_TARGET_AVX2 static inline size_t CopyAndFindTidAVX2(
+    const int32_t *a, int32_t *res, size_t n, int32_t tid) {
+  size_t i = 0;
+  size_t found = n;
+  __m256i vtid = _mm256_set1_epi32(tid);
+  for (; i + 4 <= n; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + 2 * i));
+    _mm256_storeu_si256((__m256i*)(res + 2 * i), va);
+    int eq = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vtid))) & 0x55;
+    if (eq) found = i + __builtin_ctz(eq) / 2;
+  }
+  size_t rest = CopyAndFindTidSSE(a + 2 * i, res + 2 * i, n - i, tid);
+  return rest < n - i ? i + rest : found;
+}
+
+static const VtsKernels kVtsKernelsAVX2 = {
+  "avx2",
+  CompareEqualTidPrefixAVX2,
+  MaxEqualTidPrefixAVX2,
+  CopyAndFindTidAVX2
+};
+
+// -------- CPUID ------ {{{1
+static inline void VtsCpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs) {
+  __asm__ __volatile__("cpuid"
+                       : "=a"(regs[0]), "=b"(regs[1]),
+                         "=c"(regs[2]), "=d"(regs[3])
+                       : "a"(leaf), "c"(subleaf));
+}
+
+static inline bool CpuHasSSE42() {
+  uint32_t regs[4];
+  VtsCpuid(1, 0, regs);
+  return (regs[2] >> 20) & 1;
+}
+
+static inline bool CpuHasAVX2() {
+  uint32_t regs[4];
+  VtsCpuid(0, 0, regs);
+  if (regs[0] < 7) return false;
+  VtsCpuid(1, 0, regs);
+  // The OS must save the YMM registers (OSXSAVE and XCR0 bits 1, 2).
+  if (!((regs[2] >> 27) & 1)) return false;
+  uint32_t xcr0_lo, xcr0_hi;
+  __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 6) != 6) return false;
+  VtsCpuid(7, 0, regs);
+  return (regs[1] >> 5) & 1;
+}
+#endif  // TS_VTS_SIMD
+
+// Returns the fastest kernels supported by this CPU.
+static inline const VtsKernels *GetBestVtsKernels() {
+#if TS_VTS_SIMD
+  if (CpuHasAVX2()) return &kVtsKernelsAVX2;
+  if (CpuHasSSE42()) return &kVtsKernelsSSE;
+#endif
+  return &kVtsKernelsScalar;
+}
+
+// end. {{{1
+#endif  // TS_VTS_SIMD_
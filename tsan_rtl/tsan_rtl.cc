@@ -31,6 +31,8 @@
 #include "tsan_rtl_symbolize.h"
 #include "ts_trace_info.h"
 #include "ts_lock.h"
+#include "ts_event_recorder.h"
+#include "ts_report_writer.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -56,6 +58,7 @@
     if (size) SPut(READ, tid, pc, (uintptr_t)(x), (size)); } while (0)
 #define REPORT_WRITE_RANGE(x, size) do { \
     if (size) SPut(WRITE, tid, pc, (uintptr_t)(x), (size)); } while (0)
+#define REPLACE_IS_NOT_INSTRUMENTED 1
 #include "ts_replace.h"
 
 using namespace __tsan;
@@ -76,16 +79,21 @@ __thread bool thread_local_show_stats;
 __thread int thread_local_literace;
 
 __thread ThreadInfo INFO;
-__thread tid_t LTID;  // literace TID = TID % kLiteRaceNumTids
+__thread tid_t LTID;  // literace TID, see ClaimLiteRaceTid()
 __thread CallStackPod __attribute__((visibility("default")))
     __tsan_shadow_stack;
-// TODO(glider): these two should be used consistently.
-// kDTLEBSize should also be a multiple of 4096 (page size).
 // The static TLEB is allocated in TLS, so kTLEBSize should not be very big.
+// The instrumented modules record the size of their largest trace, which is
+// checked against kTLEBSize at startup (see ReadModuleTlebInfo()).
 static const size_t kTLEBSize = 4096;
-static const size_t kDTLEBSize = 4096;
-static const size_t kDoubleDTLEBSize = kDTLEBSize * 2;
-static const size_t kDTLEBMemory = kDoubleDTLEBSize * sizeof(uintptr_t);
+// The dynamic TLEB size is taken from the modules, which wrap their index
+// around 2 * dtleb_size. kDefaultDTLEBSize is used if there are no
+// instrumented modules. Each half of the DTLEB should be a multiple of 4096
+// (page size).
+static const size_t kDefaultDTLEBSize = 4096;
+static size_t dtleb_size = kDefaultDTLEBSize;
+static size_t dtleb_double_size = kDefaultDTLEBSize * 2;
+static size_t dtleb_memory = kDefaultDTLEBSize * 2 * sizeof(uintptr_t);
 
 #ifdef TSAN_RTL_X64
 static const uintptr_t kRtnMask = 1L << 63;
@@ -105,6 +113,12 @@ __thread intptr_t DTlebIndex;
 __thread intptr_t OldDTlebIndex;
 #endif
 __thread uintptr_t TLEB[kTLEBSize];
+// The mops batched by the GCC plugin: (addr | flags << kMopBatchFlagsShift),
+// see __tsan_handle_mop_batch().
+static const size_t kMopBatchSize = 64;
+static const int kMopBatchFlagsShift = 58;
+__thread uintptr_t __attribute__((visibility("default")))
+    __tsan_mop_buffer[kMopBatchSize];
 static __thread int INIT = 0;
 #if 0
 static __thread int events = 0;
@@ -126,29 +140,488 @@ static int RTL_INIT = 0;
 static int PTH_INIT = 0;
 static int HAVE_THREAD_0 = 0;
 
-static map<pthread_t, ThreadInfo*> ThreadInfoMap;
-static map<pthread_t, tid_t> Tids;
-static map<tid_t, pthread_t> PThreads;
-static map<tid_t, bool> Finished;
-// TODO(glider): before spawning a new child thread its parent creates a
-// pthread barrier which is used to guarantee that the child has already
-// initialized before exiting pthread_create.
-static map<tid_t, pthread_barrier_t*> ChildThreadStartBarriers;
-// TODO(glider): we shouldn't need InitConds (and maybe FinishConds).
-// How about using barriers here as well?
-static map<pthread_t, pthread_cond_t*> InitConds;
-static map<tid_t, pthread_cond_t*> FinishConds;
 static tid_t max_tid;
 
+// Thread registry {{{1
+// ThreadSanitizer never reuses tids and keeps them below
+// G_flags->max_n_threads, so the per-thread state of the runtime lives in a
+// flat array indexed by tid. It is mmap-ed once at startup: registering and
+// forgetting a thread neither allocates nor walks a tree.
+// The slots are modified under the GIL.
+struct RtlThreadSlot {
+  pthread_t pt;
+  ThreadInfo *info;  // NULL unless the thread has started and not been joined.
+  bool finished;
+  // Before spawning a new child thread its parent creates a pthread barrier
+  // which is used to guarantee that the child has already initialized before
+  // exiting pthread_create.
+  pthread_barrier_t *child_start_barrier;
+  // Created by pthread_join() if the thread hasn't finished yet.
+  // TODO(glider): we shouldn't need it (and finished) as well.
+  pthread_cond_t *finish_cond;
+};
+static RtlThreadSlot *ThreadSlots;
+
+// Maps pthread_t to tid. Open addressing with linear probing over
+// 2 * G_flags->max_n_threads slots. A slot is claimed by a CAS on its key and
+// freed by storing a tombstone, so LookupTid() doesn't need the GIL;
+// InsertPthread() and ErasePthread() are called under the GIL.
+// pthread_join() may see a pthread_t before the child has called InitTid();
+// it then inserts the key with kPendingTid and an init_cond to wait on.
+// TODO(glider): we shouldn't need init_cond.
+// How about using barriers here as well?
+static const uintptr_t kEmptyPthread = 0;
+static const uintptr_t kDeletedPthread = 1;  // pthread_t is a pointer.
+static const tid_t kPendingTid = (tid_t)-1;
+
+struct PthreadTidSlot {
+  uintptr_t pt;  // kEmptyPthread, kDeletedPthread or a pthread_t.
+  tid_t tid;
+  pthread_cond_t *init_cond;
+};
+static PthreadTidSlot *PthreadTids;
+static uintptr_t PthreadTidsMask;
+
+static INLINE uintptr_t PthreadHash(pthread_t pt) {
+  uint64_t h = (uint64_t)pt * 0x9E3779B97F4A7C15ULL;
+  return (uintptr_t)(h >> 32) ^ (uintptr_t)h;
+}
+
+static void InitThreadRegistry() {
+  size_t n_threads = G_flags->max_n_threads;
+  ThreadSlots = (RtlThreadSlot*)sys_mmap(0, n_threads * sizeof(RtlThreadSlot),
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(ThreadSlots != MAP_FAILED);
+  uintptr_t capacity = 1;
+  while (capacity < 2 * n_threads) capacity <<= 1;
+  PthreadTids = (PthreadTidSlot*)sys_mmap(0, capacity * sizeof(PthreadTidSlot),
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(PthreadTids != MAP_FAILED);
+  PthreadTidsMask = capacity - 1;
+}
+
+static INLINE RtlThreadSlot *GetThreadSlot(tid_t tid) {
+  CHECK(tid < (tid_t)G_flags->max_n_threads);
+  return &ThreadSlots[tid];
+}
+
+// Returns NULL if |pt| is unknown. After many thread exits the table may
+// consist of tombstones only, hence the bound on the probe count.
+static PthreadTidSlot *FindPthread(pthread_t pt) {
+  uintptr_t key = (uintptr_t)pt;
+  uintptr_t mask = PthreadTidsMask;
+  uintptr_t i = PthreadHash(pt) & mask;
+  for (uintptr_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    uintptr_t k = *(volatile uintptr_t*)&PthreadTids[i].pt;
+    if (k == key) return &PthreadTids[i];
+    if (k == kEmptyPthread) return NULL;
+  }
+  return NULL;
+}
+
+// Returns kPendingTid if the thread is unknown or hasn't called InitTid().
+static tid_t LookupTid(pthread_t pt) {
+  PthreadTidSlot *slot = FindPthread(pt);
+  return slot ? *(volatile tid_t*)&slot->tid : kPendingTid;
+}
+
+// |pt| should not be present.
+static PthreadTidSlot *InsertPthread(pthread_t pt, tid_t tid) {
+  DCHECK(FindPthread(pt) == NULL);
+  uintptr_t i = PthreadHash(pt) & PthreadTidsMask;
+  for (;; i = (i + 1) & PthreadTidsMask) {
+    PthreadTidSlot *slot = &PthreadTids[i];
+    uintptr_t k = *(volatile uintptr_t*)&slot->pt;
+    if (k != kEmptyPthread && k != kDeletedPthread) continue;
+    // The tid is published before the key.
+    slot->tid = tid;
+    slot->init_cond = NULL;
+    if (__sync_bool_compare_and_swap(&slot->pt, k, (uintptr_t)pt))
+      return slot;
+  }
+}
+
+static void ErasePthread(pthread_t pt) {
+  PthreadTidSlot *slot = FindPthread(pt);
+  if (!slot) return;
+  slot->tid = kPendingTid;
+  __sync_synchronize();
+  slot->pt = kDeletedPthread;
+}
+// }}}
+
+// Asynchronous trace analysis {{{1
+// With --threaded_analysis flush_trace() doesn't analyze the trace on the
+// application thread. It appends the trace and its addresses to the thread's
+// AsyncTraceQueue, a single-producer ring, and returns.
+// --num_analysis_threads workers drain the queues and call
+// ThreadSanitizerHandleTrace(), which takes care of its own locking.
+// Every other call into ThreadSanitizer from an application thread first
+// drains its queue (see AsyncTraceBarrier()), so the detector still sees the
+// events of each thread in program order and the synchronization events work
+// as barriers. The application thread drains the rest of the queue itself
+// rather than waiting for a worker.
+// The call stack of a race report is taken when the trace is analyzed, so it
+// may be ahead of the racey access.
+// Queues are never freed: an exiting thread releases its queue and a new
+// thread takes it over.
+struct AsyncTraceQueue {
+  static const uintptr_t kSize = 1 << 15;  // Words, a power of two.
+  uintptr_t owner;     // 0 if free. Claimed under the GIL.
+  uintptr_t draining;  // 1 while someone is consuming the queue.
+  uintptr_t head;      // Written only by the owner.
+  uintptr_t tail;      // Written only by the consumer.
+  // A record is [TSanThread*, TraceInfo*, addresses...].
+  uintptr_t buf[kSize];
+  uintptr_t tleb[kTLEBSize];  // The consumer's copy of the addresses.
+};
+
+static __thread AsyncTraceQueue *async_trace_queue;
+// Indexed by the queue number, G_flags->max_n_threads.
+static AsyncTraceQueue **AsyncTraceQueues;
+static uintptr_t n_async_trace_queues;
+
+static INLINE uintptr_t AcquireLoad(uintptr_t *p) {
+  uintptr_t res = *(volatile uintptr_t*)p;
+  __asm__ __volatile__("" : : : "memory");
+  return res;
+}
+
+// Analyzes at most |max_records| records of |q|. If |wait| is false and the
+// queue is being drained by someone else, does nothing.
+// Returns the number of analyzed records.
+static uintptr_t AsyncTraceDrain(AsyncTraceQueue *q, uintptr_t max_records,
+                                 bool wait) {
+  while (!AtomicCompareAndSwap(&q->draining, 0, 1)) {
+    if (!wait) return 0;
+    __real_sched_yield();
+  }
+  const uintptr_t mask = AsyncTraceQueue::kSize - 1;
+  uintptr_t tail = q->tail;
+  uintptr_t head = AcquireLoad(&q->head);
+  uintptr_t n_records = 0;
+  for (; tail != head && n_records < max_records; n_records++) {
+    TSanThread *thr = (TSanThread*)q->buf[tail & mask];
+    TraceInfo *trace_info = (TraceInfo*)q->buf[(tail + 1) & mask];
+    size_t n = trace_info->n_mops();
+    for (size_t i = 0; i < n; i++)
+      q->tleb[i] = q->buf[(tail + 2 + i) & mask];
+    ThreadSanitizerHandleTrace(thr, trace_info, q->tleb);
+    tail += n + 2;
+    // The record is freed only after it has been analyzed, so an empty queue
+    // means that all its traces are done with.
+    ReleaseStore(&q->tail, tail);
+  }
+  ReleaseStore(&q->draining, 0);
+  return n_records;
+}
+
+static INLINE void AsyncTracePush(TraceInfo *trace_info, uintptr_t *tleb) {
+  AsyncTraceQueue *q = async_trace_queue;
+  const uintptr_t mask = AsyncTraceQueue::kSize - 1;
+  size_t n = trace_info->n_mops();
+  uintptr_t head = q->head;
+  while (head + n + 2 - AcquireLoad(&q->tail) > AsyncTraceQueue::kSize) {
+    ENTER_RTL();
+    AsyncTraceDrain(q, 1, /*wait=*/true);
+    LEAVE_RTL();
+  }
+  q->buf[head & mask] = (uintptr_t)INFO.thread;
+  q->buf[(head + 1) & mask] = (uintptr_t)trace_info;
+  for (size_t i = 0; i < n; i++) {
+    q->buf[(head + 2 + i) & mask] = tleb[i];
+    tleb[i] = 0;
+  }
+  ReleaseStore(&q->head, head + n + 2);
+}
+
+// Called before the current thread talks to ThreadSanitizer directly.
+static INLINE void AsyncTraceBarrier() {
+  AsyncTraceQueue *q = async_trace_queue;
+  if (LIKELY(q == NULL)) return;
+  if (AcquireLoad(&q->tail) == q->head) return;
+  ENTER_RTL();
+  AsyncTraceDrain(q, ~(uintptr_t)0, /*wait=*/true);
+  LEAVE_RTL();
+}
+
+static void *AsyncTraceWorker(void *arg) {
+  ENTER_RTL();
+  uintptr_t idx = (uintptr_t)arg;
+  uintptr_t n_workers = G_flags->num_analysis_threads;
+  for (;;) {
+    uintptr_t n_records = 0;
+    uintptr_t n_queues = AcquireLoad(&n_async_trace_queues);
+    for (uintptr_t i = idx; i < n_queues; i += n_workers) {
+      n_records += AsyncTraceDrain(AsyncTraceQueues[i], 64, /*wait=*/false);
+    }
+    if (n_records == 0)
+      __real_usleep(100);
+  }
+  return NULL;
+}
+
+static void StartAsyncTraceWorkers() {
+  AsyncTraceQueues = (AsyncTraceQueue**)sys_mmap(
+      0, G_flags->max_n_threads * sizeof(AsyncTraceQueue*),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(AsyncTraceQueues != MAP_FAILED);
+  for (intptr_t i = 0; i < G_flags->num_analysis_threads; i++) {
+    pthread_t pt;
+    CHECK(real_pthread_create(&pt, NULL, AsyncTraceWorker, (void*)i) == 0);
+  }
+}
+
+// Should be called under the GIL.
+static void UnsafeClaimAsyncTraceQueue() {
+  CHECK(async_trace_queue == NULL);
+  AsyncTraceQueue *q = NULL;
+  for (uintptr_t i = 0; i < n_async_trace_queues && !q; i++) {
+    if (AsyncTraceQueues[i]->owner == 0)
+      q = AsyncTraceQueues[i];
+  }
+  if (!q) {
+    CHECK(n_async_trace_queues < (uintptr_t)G_flags->max_n_threads);
+    q = (AsyncTraceQueue*)sys_mmap(0, sizeof(AsyncTraceQueue),
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(q != MAP_FAILED);
+    AsyncTraceQueues[n_async_trace_queues] = q;
+    ReleaseStore(&n_async_trace_queues, n_async_trace_queues + 1);
+  }
+  DCHECK(q->head == q->tail);
+  q->owner = INFO.tid + 1;
+  async_trace_queue = q;
+}
+
+// The queue should be empty, i.e. AsyncTraceBarrier() has been called.
+static void ReleaseAsyncTraceQueue() {
+  AsyncTraceQueue *q = async_trace_queue;
+  if (!q) return;
+  DCHECK(q->head == q->tail);
+  async_trace_queue = NULL;
+  ReleaseStore(&q->owner, 0);
+}
+
+// Waits until all the queued traces are analyzed.
+static void DrainAllAsyncTraceQueues() {
+  uintptr_t n_queues = AcquireLoad(&n_async_trace_queues);
+  for (uintptr_t i = 0; i < n_queues; i++)
+    AsyncTraceDrain(AsyncTraceQueues[i], ~(uintptr_t)0, /*wait=*/true);
+}
+// }}}
+
+// Recording {{{1
+// With --record_events the events go to the EventRecorder instead of
+// ThreadSanitizer (see ts_event_recorder.h) and a background thread writes
+// them out. ThreadSanitizer still sees the thread start and end events,
+// the rest of the runtime needs their TSanThreads.
+static EventRecorder *g_recorder;
+static __thread PackedEventEncoder *record_buf;
+
+// Should be called under ENTER_RTL.
+static void RecordEvent(EventType type, tid_t tid, pc_t pc,
+                        uintptr_t a, uintptr_t info) {
+  if (UNLIKELY(record_buf == NULL))
+    record_buf = new PackedEventEncoder;
+  g_recorder->Put(record_buf, type, tid, pc, a, info);
+}
+
+// Records the accesses of a trace and cleans up the TLEB as
+// ThreadSanitizerHandleTrace() does. Should be called under ENTER_RTL.
+static void RecordTrace(TraceInfo *trace_info, uintptr_t *tleb) {
+  for (size_t i = 0; i < trace_info->n_mops(); i++) {
+    if (tleb[i] == 0) continue;
+    MopInfo *mop = trace_info->GetMop(i);
+    RecordEvent(mop->is_write() ? WRITE : READ, INFO.tid, mop->pc(),
+                tleb[i], mop->size());
+    tleb[i] = 0;
+  }
+}
+
+static void *RecorderWorker(void *arg) {
+  ENTER_RTL();
+  for (;;) {
+    if (g_recorder->WriteSome() == 0)
+      __real_usleep(1000);
+  }
+  return NULL;
+}
+
+static void StartRecorder() {
+  g_recorder = new EventRecorder;
+  if (!g_recorder->Init(G_flags->record_events, G_flags->record_compressor)) {
+    Report("ERROR: can not open %s\n", G_flags->record_events.c_str());
+    __real_exit(2);
+  }
+  pthread_t pt;
+  CHECK(real_pthread_create(&pt, NULL, RecorderWorker, NULL) == 0);
+}
+// }}}
+
+// Asynchronous reports {{{1
+// With --async_reports a background thread prints the reports queued in
+// G_report_writer, see ts_report_writer.h.
+static void *ReportWriterWorker(void *arg) {
+  ENTER_RTL();
+  for (;;) {
+    if (G_report_writer->WriteSome() == 0)
+      __real_usleep(1000);
+  }
+  return NULL;
+}
+
+static void StartReportWriter() {
+  G_report_writer = new ReportWriter(G_flags->max_queued_reports);
+  pthread_t pt;
+  CHECK(real_pthread_create(&pt, NULL, ReportWriterWorker, NULL) == 0);
+}
+// }}}
+
+// LiteRace sampling controller {{{1
+// The instrumented traces keep their LiteRace counters in rows indexed by
+// LTID (see TraceInfoPOD). Instead of tid % kLiteRaceNumTids an LTID is
+// the least used row among the running threads, so short-lived threads do
+// not pile up on the same counters. The LLVM pass aligns every
+// LiteRaceStorage by 64 bytes, so each row is a cache line of its own.
+static int32_t literace_ltid_users[TraceInfoPOD::kLiteRaceNumTids];
+
+static void ClaimLiteRaceTid() {
+  tid_t best = 0;
+  for (tid_t i = 1; i < TraceInfoPOD::kLiteRaceNumTids; i++) {
+    if (literace_ltid_users[i] < literace_ltid_users[best])
+      best = i;
+  }
+  __sync_add_and_fetch(&literace_ltid_users[best], 1);
+  LTID = best;
+}
+
+static void ReleaseLiteRaceTid() {
+  __sync_sub_and_fetch(&literace_ltid_users[LTID], 1);
+}
+
+// With --literace_target_overhead=P every thread tunes its own sampling
+// rate (thread_local_literace, see TraceInfo::LiteRaceUpdate()) so that
+// the analysis of its traces costs about P% of the time it spends outside
+// of the analysis. The rate only changes how fast a trace backs off with
+// its execution count: cold traces are still analyzed every time, and
+// rate 0 analyzes everything. The decision is made once per window of
+// kLiteRaceWindow flushes.
+static const uintptr_t kLiteRaceWindow = 1 << 12;
+static const int kLiteRaceMaxRate = 31;
+static uintptr_t literace_target_overhead;  // Copy of the flag.
+// --profiled_literace_sampling, see bb_flush_sampled().
+static int profiled_literace;
+
+struct LiteRaceWindow {
+  uint64_t start;     // TSC at the beginning of the window.
+  uint64_t analysis;  // TSC cycles spent in the analysis.
+  uintptr_t n_flushes;
+};
+static __thread LiteRaceWindow literace_window;
+
+// Returns the TSC to pass to LiteRaceAnalysisEnd() or 0.
+static INLINE uint64_t LiteRaceAnalysisBegin() {
+  return literace_target_overhead ? ReadTSC() : 0;
+}
+
+static NOINLINE void LiteRaceAdjustRate(uint64_t now) {
+  LiteRaceWindow *w = &literace_window;
+  uint64_t elapsed = now - w->start;
+  if (w->start && elapsed > w->analysis) {
+    uint64_t overhead = w->analysis * 100 / (elapsed - w->analysis);
+    int rate = thread_local_literace;
+    if (overhead > literace_target_overhead && rate < kLiteRaceMaxRate)
+      rate++;
+    else if (overhead * 2 < literace_target_overhead && rate > 0)
+      rate--;
+    if (G_flags->verbosity >= 2 && rate != thread_local_literace) {
+      Printf("T%d: LiteRace overhead %d%%, sampling rate %d => %d\n",
+             INFO.tid, (int)overhead, thread_local_literace, rate);
+    }
+    thread_local_literace = rate;
+  }
+  w->start = now;
+  w->analysis = 0;
+  w->n_flushes = 0;
+}
+
+static INLINE void LiteRaceAnalysisEnd(uint64_t start) {
+  if (!start) return;
+  uint64_t now = ReadTSC();
+  literace_window.analysis += now - start;
+  if (++literace_window.n_flushes >= kLiteRaceWindow)
+    LiteRaceAdjustRate(now);
+}
+// }}}
+
+// Mop filter {{{1
+// Code built with -use-mop-filter checks every access against
+// __tsan_mop_filter, a small direct-mapped table of the accesses the thread
+// has passed to the detector in its current segment, and stores a hit into
+// the TLEB as 0, i.e. as a mop which was not executed. Repeating an access
+// within the same segment doesn't change its shadow state, so the hits
+// need no analysis (a write also covers a later read).
+// With --mop_filter flush_trace() adds the analyzed mops to the table, and
+// SPut() clears it on every event but a memory access, as any of them may
+// start a new segment or change what is ignored.
+static const size_t kMopFilterSize = 256;  // Must match the LLVM pass.
+__thread uint64_t __attribute__((visibility("default")))
+    __tsan_mop_filter[kMopFilterSize];
+static __thread bool mop_filter_dirty;
+static bool mop_filter_enabled;  // Copy of the flag.
+
+static INLINE uint64_t MopFilterKey(uintptr_t addr, uintptr_t size,
+                                    bool is_write) {
+  return ((uint64_t)addr << 5) | ((size - 1) << 1) | is_write;
+}
+
+static INLINE void MopFilterAdd(TraceInfoPOD *trace) {
+  for (size_t i = 0; i < trace->n_mops_; i++) {
+    uintptr_t addr = TLEB[i];
+    if (!addr) continue;
+    MopInfo *mop = &trace->mops_[i];
+    __tsan_mop_filter[(addr >> 3) % kMopFilterSize] =
+        MopFilterKey(addr, mop->size(), mop->is_write());
+  }
+  mop_filter_dirty = true;
+}
+
+static INLINE void MopFilterClear() {
+  if (!mop_filter_dirty) return;
+  memset(__tsan_mop_filter, 0, sizeof(__tsan_mop_filter));
+  mop_filter_dirty = false;
+}
+// }}}
+
 static __thread  sigset_t glob_sig_blocked, glob_sig_old;
 
 // We don't initialize these.
 static struct sigaction signal_actions[NSIG];  // protected by GIL
 static __thread siginfo_t pending_signals[NSIG];
-typedef enum { PSF_NONE = 0, PSF_SIGNAL, PSF_SIGACTION } pending_signal_flag_t;
-static __thread pending_signal_flag_t pending_signal_flags[NSIG];
+// The signals caught by RTLSignalHandler/RTLSignalSigaction and not yet
+// delivered. The signal handlers set the bits (and have_pending_signals),
+// the bits are cleared only with all the signals blocked.
+static const int kSigMaskWords = (NSIG + 63) / 64;
+static __thread uint64_t pending_signal_mask[kSigMaskWords];
+static __thread uint64_t pending_sigaction_mask[kSigMaskWords];
 static __thread bool have_pending_signals;
-static void clear_pending_signals();
+static void deliver_pending_signals();
+
+// Called after every trace, so the common case is just one TLS load.
+static INLINE void clear_pending_signals() {
+  if (UNLIKELY(have_pending_signals))
+    deliver_pending_signals();
+}
+
+static void reset_pending_signals() {
+  memset(pending_signal_mask, 0, sizeof(pending_signal_mask));
+  memset(pending_sigaction_mask, 0, sizeof(pending_sigaction_mask));
+  have_pending_signals = false;
+}
+static void RtlDrainThreadCache();
 
 // Stats {{{1
 #undef ENABLE_STATS
@@ -229,6 +702,29 @@ void GIL::Unlock() {
     clear_pending_signals();
 }
 
+// The malloc/free interceptors report only MALLOC/FREE, which the detector
+// handles under its own lock. A FREE is reported before the memory is
+// actually freed and a MALLOC after it is allocated, so the events of a
+// chunk come in the right order w/o the GIL as well. With
+// --gil_free_allocator the allocator is not serialized by the GIL (the flags
+// are not there yet at the very start, so the GIL is taken then).
+AllocatorGIL::AllocatorGIL()
+    : gil_(!G_flags || !G_flags->gil_free_allocator) {
+  if (gil_)
+    GIL::Lock();
+  else
+    ENTER_RTL();
+}
+
+AllocatorGIL::~AllocatorGIL() {
+  if (gil_) {
+    GIL::Unlock();
+  } else {
+    LEAVE_RTL();
+    clear_pending_signals();
+  }
+}
+
 #if (DEBUG)
 int GIL::GetDepth() {
   return gil_depth;
@@ -262,6 +758,77 @@ static bool isThreadLocalEvent(EventType type) {
   }
 }
 
+// Attach mode {{{1
+// With --attach_mode the runtime starts detached and --attach_signal
+// (SIGUSR2 by default) toggles it, e.g. to sample a server for races for a
+// few minutes at a time. While detached every thread runs with one more
+// level of __tsan_thread_ignore, so the memory accesses are dropped by the
+// check the instrumentation entry points already have, and SPut() drops
+// the other frequent events (see IsDroppedWhileDetached()). The thread,
+// lock, ignore and annotation events still go through, so the detector's
+// threads, locksets and ignore counters are right when we attach; the
+// happens-before arcs created while detached are lost, but they only order
+// the untracked accesses before them.
+// The detector's state is flushed on detach: the heap and the shadow are
+// not updated while we are detached.
+// The signal handler only writes attach_requested; the request is applied
+// by the next SPut() of any thread.
+static volatile sig_atomic_t attach_requested = 1;
+static volatile int rtl_detached;
+
+static bool IsDroppedWhileDetached(EventType type) {
+  switch (type) {
+    case READ:
+    case WRITE:
+    case MALLOC:
+    case FREE:
+    case MMAP:
+    case MUNMAP:
+    case SIGNAL:
+    case WAIT:
+    case SIGNAL_MANY:
+    case WAIT_MANY:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void AttachSignalHandler(int signo) {
+  attach_requested = !attach_requested;
+}
+
+static void InitAttachMode() {
+  if (!G_flags->attach_mode) return;
+  rtl_detached = 1;
+  attach_requested = 0;
+  int signo = G_flags->attach_signal ? G_flags->attach_signal : SIGUSR2;
+  struct sigaction sigact;
+  memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_handler = AttachSignalHandler;
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = SA_RESTART;
+  CHECK(__real_sigaction(signo, &sigact, NULL) == 0);
+  Report("INFO: ThreadSanitizer is detached, send signal %d to attach\n",
+         signo);
+}
+
+static void ApplyAttachRequest() {
+  GIL scoped;
+  bool attach = attach_requested;
+  if (attach == !rtl_detached) return;  // Somebody has applied it.
+  int add = attach ? -1 : 1;
+  for (tid_t i = 0; i < max_tid; i++) {
+    if (ThreadSlots[i].info)
+      *(ThreadSlots[i].info->thread_local_ignore) += add;
+  }
+  rtl_detached = !attach;
+  if (!attach)
+    SPut(FLUSH_STATE, INFO.tid, 0, 0, 0);
+  Report("INFO: ThreadSanitizer %s\n", attach ? "attached" : "detached");
+}
+// }}}
+
 extern void ExSPut(EventType type, tid_t tid, pc_t pc,
                    uintptr_t a, uintptr_t info) {
   SPut(type, tid, pc, a, info);
@@ -279,9 +846,13 @@ INLINE void SPut(EventType type, tid_t tid, pc_t pc,
                  uintptr_t a, uintptr_t info) {
   DCHECK(HAVE_THREAD_0 || ((type == THR_START) && (tid == 0)));
   DCHECK(RTL_INIT == 1);
+  if (UNLIKELY(attach_requested == rtl_detached))
+    ApplyAttachRequest();
+  if (UNLIKELY(rtl_detached) && IsDroppedWhileDetached(type)) return;
 #ifdef USE_DYNAMIC_TLEB
   flush_dtleb_nosegv();
 #endif
+  if (type != READ && type != WRITE) MopFilterClear();
   Event event(type, tid, pc, a, info);
   if (G_flags->verbosity) {
     if ((G_flags->verbosity >= 2) ||
@@ -302,8 +873,13 @@ INLINE void SPut(EventType type, tid_t tid, pc_t pc,
   }
 #endif
 
+  AsyncTraceBarrier();
   ENTER_RTL();
-  {
+  if (UNLIKELY(g_recorder != NULL)) {
+    RecordEvent(type, tid, type == THR_START ? 0 : pc, a, info);
+    if (type == THR_START || type == THR_END)
+      ThreadSanitizerHandleOneEvent(&event);
+  } else {
     ThreadSanitizerHandleOneEvent(&event);
   }
   LEAVE_RTL();
@@ -312,7 +888,7 @@ INLINE void SPut(EventType type, tid_t tid, pc_t pc,
   }
 }
 
-void INLINE flush_trace(TraceInfoPOD *trace) {
+void INLINE flush_trace(TraceInfoPOD *trace, int literace) {
 #ifdef DISABLE_RACE_DETECTION
   return;
 #endif
@@ -346,9 +922,9 @@ void INLINE flush_trace(TraceInfoPOD *trace) {
     // -- 1
     // -- G_flags->literace_sampling
     // -- thread_local_literace
-    if (thread_local_literace) {
-      trace_info->LLVMLiteRaceUpdate(LTID,
-                               thread_local_literace);
+    // -- profiled_literace
+    if (literace) {
+      trace_info->LLVMLiteRaceUpdate(LTID, literace);
     }
     if (DEBUG && G_flags->verbosity >= 2) {
       ENTER_RTL();
@@ -370,7 +946,15 @@ void INLINE flush_trace(TraceInfoPOD *trace) {
       }
       LEAVE_RTL();
     }
-    {
+    if (mop_filter_enabled) MopFilterAdd(trace);
+    uint64_t analysis_start = LiteRaceAnalysisBegin();
+    if (UNLIKELY(g_recorder != NULL)) {
+      ENTER_RTL();
+      RecordTrace(trace_info, TLEB);
+      LEAVE_RTL();
+    } else if (async_trace_queue) {
+      AsyncTracePush(trace_info, TLEB);
+    } else {
       ENTER_RTL();
       DCHECK(__tsan_shadow_stack.pcs_ <= __tsan_shadow_stack.end_);
       ThreadSanitizerHandleTrace(tid,
@@ -378,10 +962,9 @@ void INLINE flush_trace(TraceInfoPOD *trace) {
                                  TLEB);
       LEAVE_RTL();
     }
+    LiteRaceAnalysisEnd(analysis_start);
 
-    // TODO(glider): the instrumentation pass may generate basic blocks that
-    // are larger than sizeof(TLEB). There should be a flag to control this,
-    // because we don't want to check the trace size in runtime.
+    // ReadModuleTlebInfo() has checked that no trace is larger than the TLEB.
     DCHECK(trace->n_mops_ <= kTLEBSize);
     // Check that ThreadSanitizer cleans up the TLEB.
     if (DEBUG) {
@@ -393,7 +976,8 @@ void INLINE flush_trace(TraceInfoPOD *trace) {
 
 // A single-memory-access version of flush_trace. This could be possibly sped up
 // a bit.
-void INLINE flush_single_mop(TraceInfoPOD *trace, uintptr_t addr) {
+void INLINE flush_single_mop(TraceInfoPOD *trace, uintptr_t addr,
+                             int literace) {
 #ifdef DISABLE_RACE_DETECTION
   return;
 #endif
@@ -428,9 +1012,9 @@ void INLINE flush_single_mop(TraceInfoPOD *trace, uintptr_t addr) {
     // -- 1
     // -- G_flags->literace_sampling
     // -- thread_local_literace
-    if (thread_local_literace) {
-      trace_info->LLVMLiteRaceUpdate(LTID,
-                               thread_local_literace);
+    // -- profiled_literace
+    if (literace) {
+      trace_info->LLVMLiteRaceUpdate(LTID, literace);
     }
     if (DEBUG && G_flags->verbosity >= 2) {
       ENTER_RTL();
@@ -450,14 +1034,21 @@ void INLINE flush_single_mop(TraceInfoPOD *trace, uintptr_t addr) {
       }
       LEAVE_RTL();
     }
+    uint64_t analysis_start = LiteRaceAnalysisBegin();
+    AsyncTraceBarrier();
     {
       ENTER_RTL();
       DCHECK(__tsan_shadow_stack.pcs_ <= __tsan_shadow_stack.end_);
-      ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
-                                           trace_info->mops_[0],
-                                           addr);
+      if (UNLIKELY(g_recorder != NULL)) {
+        RecordTrace(trace_info, &addr);
+      } else {
+        ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
+                                             trace_info->mops_[0],
+                                             addr);
+      }
       LEAVE_RTL();
     }
+    LiteRaceAnalysisEnd(analysis_start);
     clear_pending_signals();
   }
 }
@@ -486,6 +1077,12 @@ INLINE void RPut(EventType type, tid_t tid, pc_t pc,
 
 void finalize() {
   ENTER_RTL();
+  DrainAllAsyncTraceQueues();
+  if (g_recorder) {
+    if (record_buf)
+      g_recorder->Submit(record_buf);
+    g_recorder->Fini();
+  }
   // atexit hooks are ran from a single thread.
   ThreadSanitizerFini();
   SymbolizeFini(GetNumberOfFoundErrors());
@@ -601,13 +1198,25 @@ void unsafeMapTls(tid_t tid, pc_t pc) {
 }
 
 #ifdef FLUSH_WITH_SEGV
-int tleb_half = 1;  // 0 or 1, should be 0 after the initial swapTlebHalves.
+// With FLUSH_WITH_SEGV one half of DTLEB is writable and the other one is
+// read-only, so the instrumented code gets a SIGSEGV when it runs past the
+// current half and never has to check DTlebIndex itself.
+static __thread int tleb_half = 1;  // 0 or 1, should be 0 after the initial
+                                    // swapTlebHalves.
+// The SIGSEGV handler flushes DTLEB, which may need more stack than the
+// client has left. Each thread gets an alternate signal stack unless it has
+// one already.
+static const size_t kSegvAltStackSize = 1 << 18;
+static __thread void *segv_alt_stack;
+// The SIGSEGV action installed before initSegvFlush(). The client's own
+// SIGSEGV actions are kept in signal_actions[] (see __wrap_sigaction).
+static struct sigaction prev_segv_action;
 #endif
 
 #ifdef FLUSH_WITH_SEGV
 void swapTlebHalves() {
   tleb_half = 1 - tleb_half;
-  const int kHalf = kDTLEBMemory / 2;
+  const int kHalf = dtleb_memory / 2;
   char *oaddr = (char*)DTLEB + tleb_half * kHalf;
   char *caddr = (char*)DTLEB + (1 - tleb_half) * kHalf;
   mprotect(oaddr, kHalf, PROT_READ | PROT_WRITE);
@@ -618,7 +1227,38 @@ void swapTlebHalves() {
 #endif
 }
 
+static bool IsDTlebFault(void *addr) {
+  return DTLEB && (char*)addr >= (char*)DTLEB &&
+         (char*)addr < (char*)DTLEB + dtleb_memory;
+}
+
+// A SIGSEGV that doesn't come from DTLEB goes to the client's handler or, if
+// there is none, to the one installed before us. If that is missing as well,
+// the default action is restored and the faulting instruction re-executed.
+static void chainSegv(int signo, siginfo_t *siginfo, void *context) {
+  struct sigaction *act = &signal_actions[SIGSEGV];
+  if (act->sa_handler == SIG_DFL || act->sa_handler == SIG_IGN)
+    act = &prev_segv_action;
+  if (act->sa_handler == SIG_DFL || act->sa_handler == SIG_IGN) {
+    // Ignoring a fault would restart the instruction forever.
+    struct sigaction dfl;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    __real_sigaction(SIGSEGV, &dfl, NULL);
+    return;
+  }
+  if (act->sa_flags & SA_SIGINFO) {
+    act->sa_sigaction(signo, siginfo, context);
+  } else {
+    act->sa_handler(signo);
+  }
+}
+
 void segvFlushHandler(int signo, siginfo_t *siginfo, void *context) {
+  if (!IsDTlebFault(siginfo->si_addr)) {
+    chainSegv(signo, siginfo, context);
+    return;
+  }
   ENTER_RTL();
   flush_dtleb_segv();
   swapTlebHalves();
@@ -627,10 +1267,36 @@ void segvFlushHandler(int signo, siginfo_t *siginfo, void *context) {
 
 void initSegvFlush() {
   struct sigaction sigact;
+  memset(&sigact, 0, sizeof(sigact));
   sigact.sa_sigaction = segvFlushHandler;
   sigact.sa_flags = SA_SIGINFO | SA_ONSTACK;
-  // TODO(glider): need to make sure nobody installs his own SEGV handler.
-  __real_sigaction(SIGSEGV, &sigact, NULL);
+  sigemptyset(&sigact.sa_mask);
+  __real_sigaction(SIGSEGV, &sigact, &prev_segv_action);
+}
+
+static void initSegvAltStack() {
+  stack_t ss;
+  if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE))
+    return;
+  segv_alt_stack = sys_mmap(0, kSegvAltStackSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(segv_alt_stack != MAP_FAILED);
+  ss.ss_sp = segv_alt_stack;
+  ss.ss_size = kSegvAltStackSize;
+  ss.ss_flags = 0;
+  CHECK(sigaltstack(&ss, NULL) == 0);
+}
+
+static void freeSegvAltStack() {
+  if (!segv_alt_stack) return;
+  stack_t ss;
+  // The client may have replaced our stack.
+  if (sigaltstack(NULL, &ss) == 0 && ss.ss_sp == segv_alt_stack) {
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, NULL);
+  }
+  sys_munmap(segv_alt_stack, kSegvAltStackSize);
+  segv_alt_stack = NULL;
 }
 #endif
 
@@ -715,10 +1381,7 @@ static bool initialize() {
     pthread_attr_destroy(&attr);
   }
 
-  for (int sig = 0; sig < NSIG; sig++) {
-    pending_signal_flags[sig] = PSF_NONE;
-  }
-  have_pending_signals = false;
+  reset_pending_signals();
 
   SPut(THR_START, 0, (pc_t) &__tsan_shadow_stack, 0, 0);
 
@@ -733,11 +1396,14 @@ static bool initialize() {
     // should be fixed and its tid should be passed in the MMAP event.
     SPut(THR_STACK_TOP, 0, 0,
          (uintptr_t)stack_bottom + stack_size, stack_size);
+    INFO.stack_hi = (uintptr_t)stack_bottom + stack_size;
   } else {
     // Something's gone wrong. ThreadSanitizer will proceed, but if the stack
     // is reused by another thread, false positives will be reported.
     SPut(THR_STACK_TOP, 0, 0, (uintptr_t)&stack_size, stack_size);
+    INFO.stack_hi = (uintptr_t)&stack_size;
   }
+  INFO.stack_lo = INFO.stack_hi - stack_size;
   unsafeMapTls(0, 0);
 #ifdef FLUSH_WITH_SEGV
   initSegvFlush();
@@ -749,27 +1415,70 @@ static bool initialize() {
 INLINE void UnsafeInitTidCommon() {
   ENTER_RTL();
 #ifdef USE_DYNAMIC_TLEB
-  DTLEB = (uintptr_t*)sys_mmap(0, kDTLEBMemory,
+  DTLEB = (uintptr_t*)sys_mmap(0, dtleb_memory,
                                 PROT_READ | PROT_WRITE,
                                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
   DTlebIndex = 0;
   OldDTlebIndex = 0;
   //fprintf(stderr, "Setting OldDTlebIndex to 0 @%d\n", __LINE__);
-  memset(DTLEB, 0, kDTLEBMemory);
+  memset(DTLEB, 0, dtleb_memory);
 #ifdef FLUSH_WITH_SEGV
+  initSegvAltStack();
   swapTlebHalves();
 #endif  // FLUSH_WITH_SEGV
 #endif
   memset(TLEB, 0, kTLEBSize);
   INFO.thread_local_ignore = &__tsan_thread_ignore;
-  __tsan_thread_ignore = !!global_ignore;
+  __tsan_thread_ignore = !!global_ignore + rtl_detached;
   thread_local_show_stats = G_flags->show_stats;
   thread_local_literace = G_flags->literace_sampling;
-  LTID = (INFO.tid % TraceInfoPOD::kLiteRaceNumTids);
+  ClaimLiteRaceTid();
+  if (G_flags->threaded_analysis)
+    UnsafeClaimAsyncTraceQueue();
   LEAVE_RTL();
   INIT = 1;
 }
 
+// Every instrumented module puts a TlebInfo into the tsan_rtl_tleb_info
+// section. Must be in sync with writeModuleTlebInfo() in ThreadSanitizer.cpp.
+struct TlebInfo {
+  uintptr_t max_trace_mops;
+  uintptr_t dtleb_size;  // 0 if the module uses the static TLEB.
+};
+extern char __start_tsan_rtl_tleb_info[] __attribute__((weak));
+extern char __stop_tsan_rtl_tleb_info[] __attribute__((weak));
+
+// Checks that the largest trace fits into the static TLEB, so that
+// flush_trace() doesn't need to, and sets up the size of the dynamic TLEB.
+// Should be called before the first thread allocates its DTLEB.
+static void ReadModuleTlebInfo() {
+  if (!__start_tsan_rtl_tleb_info) return;
+  TlebInfo *beg = (TlebInfo*)__start_tsan_rtl_tleb_info;
+  TlebInfo *end = (TlebInfo*)__stop_tsan_rtl_tleb_info;
+  size_t module_dtleb_size = 0;
+  for (TlebInfo *info = beg; info < end; info++) {
+    if (info->max_trace_mops > kTLEBSize) {
+      Printf("FATAL: a module has a trace of %ld memory operations, "
+             "the TLEB size is %ld\n",
+             info->max_trace_mops, kTLEBSize);
+      CHECK(info->max_trace_mops <= kTLEBSize);
+    }
+    if (!info->dtleb_size) continue;
+    if (module_dtleb_size && module_dtleb_size != info->dtleb_size) {
+      Printf("FATAL: the modules were built with different DTLEB sizes: "
+             "%ld and %ld\n", module_dtleb_size, info->dtleb_size);
+      CHECK(module_dtleb_size == info->dtleb_size);
+    }
+    module_dtleb_size = info->dtleb_size;
+  }
+  if (!module_dtleb_size) return;
+  // Each half of the buffer is mprotect()ed separately.
+  CHECK((module_dtleb_size * sizeof(uintptr_t)) % 4096 == 0);
+  dtleb_size = module_dtleb_size;
+  dtleb_double_size = dtleb_size * 2;
+  dtleb_memory = dtleb_double_size * sizeof(uintptr_t);
+}
+
 static void InitRTLAndTid0() {
   CHECK(INIT == 0);
   GIL scoped;
@@ -781,10 +1490,23 @@ static void InitRTLAndTid0() {
           __real_malloc, __real_free,
           __real_sched_yield, __real_usleep);
   RTL_INIT = 1;
+  InitThreadRegistry();
+  if (G_flags->threaded_analysis)
+    StartAsyncTraceWorkers();
+  if (!G_flags->record_events.empty())
+    StartRecorder();
+  if (G_flags->async_reports)
+    StartReportWriter();
+  literace_target_overhead = G_flags->literace_target_overhead;
+  mop_filter_enabled = G_flags->mop_filter;
+  profiled_literace = G_flags->profiled_literace_sampling;
+  ReadModuleTlebInfo();
+  InitAttachMode();
   // Initialize thread #0.
   INFO.tid = 0;
   max_tid = 1;
   UnsafeInitTidCommon();
+  GetThreadSlot(0)->info = &INFO;
   __tsan::SymbolizeInit();
 }
 
@@ -804,15 +1526,20 @@ INLINE void InitTid() {
   pthread_t pt = pthread_self();
   INFO.tid = max_tid;
   max_tid++;
-  // TODO(glider): remove InitConds.
-  if (InitConds.find(pt) != InitConds.end()) {
-    __real_pthread_cond_signal(InitConds[pt]);
+  RtlThreadSlot *slot = GetThreadSlot(INFO.tid);
+  PthreadTidSlot *pt_slot = FindPthread(pt);
+  // TODO(glider): remove init_cond.
+  if (pt_slot && pt_slot->init_cond) {
+    __real_pthread_cond_signal(pt_slot->init_cond);
   }
   DDPrintf("T%d: pthread_self()=%p\n", INFO.tid, (void*)pt);
   UnsafeInitTidCommon();
-  Tids[pt] = INFO.tid;
-  PThreads[INFO.tid] = pt;
-  ThreadInfoMap[pt] = &INFO;
+  if (pt_slot)
+    *(volatile tid_t*)&pt_slot->tid = INFO.tid;
+  else
+    InsertPthread(pt, INFO.tid);
+  slot->pt = pt;
+  slot->info = &INFO;
 }
 
 INLINE tid_t GetTid() {
@@ -832,12 +1559,12 @@ struct callback_arg {
   pthread_attr_t *attr;
 };
 
-// TODO(glider): we should get rid of Finished[],
-// as FinishConds should guarantee that the thread has finished.
+// TODO(glider): we should get rid of RtlThreadSlot::finished,
+// as finish_cond should guarantee that the thread has finished.
 void dump_finished() {
-  map<tid_t, bool>::iterator iter;
-  for (iter = Finished.begin(); iter != Finished.end(); ++iter) {
-    DDPrintf("Finished[%d] = %d\n", iter->first, iter->second);
+  for (tid_t i = 1; i < max_tid; i++) {
+    if (ThreadSlots[i].info)
+      DDPrintf("Finished[%d] = %d\n", i, ThreadSlots[i].finished);
   }
 }
 
@@ -845,9 +1572,9 @@ void set_global_ignore(bool new_value) {
   GIL scoped;
   global_ignore = new_value;
   int add = new_value ? 1 : -1;
-  map<pthread_t, ThreadInfo*>::iterator iter;
-  for (iter = ThreadInfoMap.begin(); iter != ThreadInfoMap.end(); ++iter) {
-    *(iter->second->thread_local_ignore) += add;
+  for (tid_t i = 1; i < max_tid; i++) {
+    if (ThreadSlots[i].info)
+      *(ThreadSlots[i].info->thread_local_ignore) += add;
   }
 }
 
@@ -862,20 +1589,7 @@ void *pthread_callback(void *arg) {
   DCHECK(INIT == 1);
   DCHECK(tid != 0);
   CHECK(INFO.tid != 0);
-
-#ifdef USE_DYNAMIC_TLEB
-  DTLEB = (uintptr_t*)sys_mmap(0, kDTLEBMemory,
-                                PROT_READ | PROT_WRITE,
-                                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-  DTlebIndex = 0;
-  OldDTlebIndex = 0;
-  //fprintf(stderr, "Setting OldDTlebIndex to 0 @%d\n", __LINE__);
-  memset(DTLEB, '\0', kDTLEBMemory);
-#ifdef FLUSH_WITH_SEGV
-  swapTlebHalves();
-#endif  // FLUSH_WITH_SEGV
-#endif
-  memset(TLEB, '\0', kTLEBSize);
+  // InitTid() has already set up TLEB and DTLEB.
 
   callback_arg *cb_arg = (callback_arg*)arg;
   pthread_worker *routine = cb_arg->routine;
@@ -886,9 +1600,9 @@ void *pthread_callback(void *arg) {
 
   // We already know the child pid -- get the parent condvar to signal.
   tid_t parent = cb_arg->parent;
-  CHECK(ChildThreadStartBarriers.find(parent) !=
-         ChildThreadStartBarriers.end());
-  pthread_barrier_t *parent_barrier = ChildThreadStartBarriers[parent];
+  pthread_barrier_t *parent_barrier =
+      GetThreadSlot(parent)->child_start_barrier;
+  CHECK(parent_barrier);
 
   // Get the stack size and stack top for the current thread.
   // TODO(glider): do something if pthread_getattr_np() is not supported.
@@ -908,10 +1622,7 @@ void *pthread_callback(void *arg) {
     pthread_attr_destroy(&attr);
   }
 
-  for (int sig = 0; sig < NSIG; sig++) {
-    pending_signal_flags[sig] = PSF_NONE;
-  }
-  have_pending_signals = false;
+  reset_pending_signals();
 
   memset(__tsan_shadow_stack.pcs_, 0, kCallStackReserve * sizeof(__tsan_shadow_stack.pcs_[0]));
   __tsan_shadow_stack.end_ = __tsan_shadow_stack.pcs_ + kCallStackReserve;
@@ -928,16 +1639,19 @@ void *pthread_callback(void *arg) {
     SPut(THR_STACK_TOP, tid, pc,
          (uintptr_t)stack_bottom + stack_size, stack_size);
     //SPut(MMAP, tid, pc, (uintptr_t)stack_bottom, stack_size);
+    INFO.stack_hi = (uintptr_t)stack_bottom + stack_size;
   } else {
     // Something's gone wrong. ThreadSanitizer will proceed, but if the stack
     // is reused by another thread, false positives will be reported.
     // &result is the address of a stack allocated var.
     SPut(THR_STACK_TOP, tid, pc, (uintptr_t)&result, stack_size);
+    INFO.stack_hi = (uintptr_t)&result;
   }
+  INFO.stack_lo = INFO.stack_hi - stack_size;
   unsafeMapTls(tid, pc);
   DDPrintf("Before routine() in T%d\n", tid);
 
-  Finished[tid] = false;
+  GetThreadSlot(tid)->finished = false;
 #if (DEBUG)
   dump_finished();
 #endif
@@ -979,30 +1693,39 @@ void *pthread_callback(void *arg) {
   GIL::Unlock();
 
   GIL::Lock();
-  Finished[tid] = true;
+  RtlThreadSlot *slot = GetThreadSlot(tid);
+  slot->finished = true;
 #if (DEBUG)
   dump_finished();
 #endif
   DDPrintf("After routine() in T%d\n", tid);
 
   SPut(THR_END, tid, 0, 0, 0);
-  if (FinishConds.find(tid) != FinishConds.end()) {
+  if (slot->finish_cond) {
     DDPrintf("T%d (child of T%d): Signaling on %p\n",
-             tid, parent, FinishConds[tid]);
-    __real_pthread_cond_signal(FinishConds[tid]);
+             tid, parent, slot->finish_cond);
+    __real_pthread_cond_signal(slot->finish_cond);
   } else {
     DDPrintf("T%d (child of T%d): Not signaling, condvar not ready\n",
              tid, parent);
   }
   // can't process signals after THR_END
   GIL::UnlockNoSignals();
+  // SPut(THR_END) has drained the queue.
+  ReleaseAsyncTraceQueue();
+  RtlDrainThreadCache();
+  ReleaseLiteRaceTid();
 
   // We do ENTER_RTL() here to avoid sending events from wrapped
   // functions (e.g. free()) after this thread has ended.
   // TODO(glider): need to check whether it's 100% legal.
   ENTER_RTL();
 #ifdef USE_DYNAMIC_TLEB
-  sys_munmap(DTLEB, kTLEBSize * 2);
+#ifdef FLUSH_WITH_SEGV
+  freeSegvAltStack();
+#endif
+  sys_munmap(DTLEB, dtleb_memory);
+  DTLEB = NULL;
 #endif
 
   return result;
@@ -1012,14 +1735,12 @@ void *pthread_callback(void *arg) {
 // always called after a lock.
 void unsafe_forget_thread(tid_t tid, tid_t from) {
   DDPrintf("T%d: forgetting about T%d\n", from, tid);
-  CHECK(PThreads.find(tid) != PThreads.end());
-  pthread_t pt = PThreads[tid];
-  Tids.erase(pt);
-  PThreads.erase(tid);
-  Finished.erase(tid);
-  InitConds.erase(pt);
-  FinishConds.erase(tid);
-  ThreadInfoMap.erase(pt);
+  RtlThreadSlot *slot = GetThreadSlot(tid);
+  CHECK(slot->info);
+  ErasePthread(slot->pt);
+  slot->info = NULL;
+  slot->finished = false;
+  slot->finish_cond = NULL;
 }
 
 // To declare a wrapper for foo(bar) you should:
@@ -1076,26 +1797,25 @@ static int tsan_pthread_create(pthread_t *thread,
   pthread_barrier_t *barrier;
   {
     GIL scoped;
-    // |barrier| escapes to the child thread via ChildThreadStartBarriers.
+    // |barrier| escapes to the child thread via child_start_barrier.
     barrier = (pthread_barrier_t*) __real_malloc(sizeof(pthread_barrier_t));
     __real_pthread_barrier_init(barrier, NULL, 2);
-    ChildThreadStartBarriers[tid] = barrier;
-    DDPrintf("Setting ChildThreadStartBarriers[%d]\n", tid);
+    GetThreadSlot(tid)->child_start_barrier = barrier;
+    DDPrintf("Setting child_start_barrier of T%d\n", tid);
   }
   int result = real_pthread_create(thread, attr, pthread_callback, cb_arg);
   tid_t child_tid = 0;
   if (result == 0) {
     __real_pthread_barrier_wait(barrier);
     GIL scoped;  // Should be strictly after pthread_barrier_wait()
-    child_tid = Tids[*thread];
-    ChildThreadStartBarriers.erase(tid);
+    child_tid = LookupTid(*thread);
+    GetThreadSlot(tid)->child_start_barrier = NULL;
     pthread_barrier_destroy(barrier);
     __real_free(barrier);
   } else {
     // Do not wait on the barrier.
     GIL scoped;
-    child_tid = Tids[*thread];
-    ChildThreadStartBarriers.erase(tid);
+    GetThreadSlot(tid)->child_start_barrier = NULL;
     pthread_barrier_destroy(barrier);
     __real_free(barrier);
   }
@@ -1226,26 +1946,288 @@ DECLARE_ALLOC_STATS(__wrap__ZdlPvRKSt9nothrow_t);
 DECLARE_ALLOC_STATS(__wrap__ZdaPv);
 DECLARE_ALLOC_STATS(__wrap__ZdaPvRKSt9nothrow_t);
 
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void __libc_free(void *ptr);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+// With --rtl_allocator the client heap is served by a size-class allocator
+// with per-thread free lists, so a malloc()/free() pair normally takes no
+// lock and doesn't go to libc. Each chunk starts with an RtlChunkHeader
+// holding the requested size, so free() and realloc() need no lookup.
+// Chunks bigger than kRtlMaxClassSize come from libc (still with a header).
+//
+// Our chunks are told from libc's by the magic right before the pointer:
+// libc keeps the chunk size there, which never has the high bits set. So the
+// memory allocated before the flags are parsed, by memalign() & co or inside
+// libc can still be passed to free().
+struct RtlChunkHeader {
+  uintptr_t size;   // As requested by the client.
+  uintptr_t magic;  // kRtlChunkMagic | size class.
+};
+
+struct RtlFreeChunk {
+  RtlFreeChunk *next;
+};
+
+static const uintptr_t kRtlChunkMagic = 0xFA11C0DE00000000ULL;
+static const uintptr_t kRtlChunkMagicMask = 0xFFFFFFFF00000000ULL;
+static const uintptr_t kRtlNumClasses = 30;
+static const uintptr_t kRtlLargeClass = 0xFF;
+static const uintptr_t kRtlMaxClassSize = 1 << 15;  // Header included.
+static const uintptr_t kRtlSpanSize = 1 << 18;
+
+struct RtlCentralFreeList {
+  uintptr_t lock;
+  RtlFreeChunk *head;
+  char *span_pos;
+  char *span_end;
+} __attribute__((aligned(64)));
+
+struct RtlThreadCache {
+  RtlFreeChunk *head[kRtlNumClasses];
+  uintptr_t n_free[kRtlNumClasses];
+};
+
+static RtlCentralFreeList rtl_central_lists[kRtlNumClasses];
+static __thread RtlThreadCache rtl_thread_cache;
+
+// 16, 32, ..., 256, then 384, 512, 768, 1024, ..., 24576, 32768.
+static INLINE uintptr_t RtlClassSize(uintptr_t c) {
+  if (c < 16) return (c + 1) * 16;
+  uintptr_t k = c - 16;
+  uintptr_t lg = 8 + k / 2;
+  return (k & 1) ? (uintptr_t)1 << (lg + 1) : (uintptr_t)3 << (lg - 1);
+}
+
+// |size| includes the header and is at most kRtlMaxClassSize.
+static INLINE uintptr_t RtlSizeClass(uintptr_t size) {
+  if (size <= 256) return (size + 15) / 16 - 1;
+  uintptr_t lg = 63 - __builtin_clzl(size - 1);
+  uintptr_t base = (uintptr_t)1 << lg;
+  return 16 + 2 * (lg - 8) + (size > base + base / 2);
+}
+
+// The number of chunks moved between a thread cache and the central list.
+static INLINE uintptr_t RtlBatchSize(uintptr_t c) {
+  uintptr_t n = (1 << 16) / RtlClassSize(c);
+  return n < 2 ? 2 : (n > 64 ? 64 : n);
+}
+
+static INLINE void RtlSpinLock(uintptr_t *lock) {
+  while (__sync_lock_test_and_set(lock, 1)) {
+    while (*(volatile uintptr_t*)lock)
+      __asm__ __volatile__("pause");
+  }
+}
+
+static INLINE void RtlSpinUnlock(uintptr_t *lock) {
+  __sync_lock_release(lock);
+}
+
+static INLINE bool RtlAllocatorEnabled() {
+  return G_flags && G_flags->rtl_allocator;
+}
+
+static INLINE bool RtlChunkIsOurs(void *ptr) {
+  RtlChunkHeader *h = (RtlChunkHeader*)ptr - 1;
+  return (h->magic & kRtlChunkMagicMask) == kRtlChunkMagic;
+}
+
+// Moves a batch of chunks of class |c| to the thread cache.
+// Returns false if out of memory.
+static NOINLINE bool RtlRefill(RtlThreadCache *cache, uintptr_t c) {
+  RtlCentralFreeList *central = &rtl_central_lists[c];
+  uintptr_t size = RtlClassSize(c);
+  uintptr_t n = RtlBatchSize(c);
+  RtlSpinLock(&central->lock);
+  for (; n > 0 && central->head; n--) {
+    RtlFreeChunk *chunk = central->head;
+    central->head = chunk->next;
+    chunk->next = cache->head[c];
+    cache->head[c] = chunk;
+    cache->n_free[c]++;
+  }
+  for (; n > 0; n--) {
+    if (central->span_pos + size > central->span_end) {
+      // The rest of the old span is lost, which is at most one chunk.
+      char *span = (char*)sys_mmap(0, kRtlSpanSize, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (span == MAP_FAILED) break;
+      central->span_pos = span;
+      central->span_end = span + kRtlSpanSize;
+    }
+    RtlFreeChunk *chunk = (RtlFreeChunk*)central->span_pos;
+    central->span_pos += size;
+    chunk->next = cache->head[c];
+    cache->head[c] = chunk;
+    cache->n_free[c]++;
+  }
+  RtlSpinUnlock(&central->lock);
+  return cache->head[c] != NULL;
+}
+
+// Moves |n| chunks of class |c| from the thread cache to the central list.
+static NOINLINE void RtlDrain(RtlThreadCache *cache, uintptr_t c,
+                              uintptr_t n) {
+  if (n == 0) return;
+  DCHECK(n <= cache->n_free[c]);
+  RtlFreeChunk *first = cache->head[c];
+  RtlFreeChunk *last = first;
+  for (uintptr_t i = 1; i < n; i++)
+    last = last->next;
+  cache->head[c] = last->next;
+  cache->n_free[c] -= n;
+  RtlCentralFreeList *central = &rtl_central_lists[c];
+  RtlSpinLock(&central->lock);
+  last->next = central->head;
+  central->head = first;
+  RtlSpinUnlock(&central->lock);
+}
+
+static void *RtlAlloc(size_t size) {
+  uintptr_t total = size + sizeof(RtlChunkHeader);
+  if (total < size) return NULL;
+  RtlChunkHeader *h;
+  uintptr_t c;
+  if (total > kRtlMaxClassSize) {
+    h = (RtlChunkHeader*)__libc_malloc(total);
+    if (!h) return NULL;
+    c = kRtlLargeClass;
+  } else {
+    c = RtlSizeClass(total);
+    RtlThreadCache *cache = &rtl_thread_cache;
+    if (UNLIKELY(!cache->head[c]) && !RtlRefill(cache, c))
+      return NULL;
+    RtlFreeChunk *chunk = cache->head[c];
+    cache->head[c] = chunk->next;
+    cache->n_free[c]--;
+    h = (RtlChunkHeader*)chunk;
+  }
+  h->size = size;
+  h->magic = kRtlChunkMagic | c;
+  return h + 1;
+}
+
+// |ptr| should be ours.
+static void RtlDealloc(void *ptr) {
+  RtlChunkHeader *h = (RtlChunkHeader*)ptr - 1;
+  uintptr_t c = h->magic & ~kRtlChunkMagicMask;
+  h->magic = 0;
+  if (c == kRtlLargeClass) {
+    __libc_free(h);
+    return;
+  }
+  CHECK(c < kRtlNumClasses);
+  RtlThreadCache *cache = &rtl_thread_cache;
+  RtlFreeChunk *chunk = (RtlFreeChunk*)h;
+  chunk->next = cache->head[c];
+  cache->head[c] = chunk;
+  uintptr_t batch = RtlBatchSize(c);
+  if (++cache->n_free[c] > 2 * batch)
+    RtlDrain(cache, c, batch);
+}
+
+// Returns all the cached chunks of the current thread to the central lists.
+static void RtlDrainThreadCache() {
+  RtlThreadCache *cache = &rtl_thread_cache;
+  for (uintptr_t c = 0; c < kRtlNumClasses; c++)
+    RtlDrain(cache, c, cache->n_free[c]);
+}
+
+// fork() should not happen while another thread holds a central list lock.
+static void RtlLockAllCentralLists() {
+  for (uintptr_t c = 0; c < kRtlNumClasses; c++)
+    RtlSpinLock(&rtl_central_lists[c].lock);
+}
+
+static void RtlUnlockAllCentralLists() {
+  for (uintptr_t c = 0; c < kRtlNumClasses; c++)
+    RtlSpinUnlock(&rtl_central_lists[c].lock);
+}
+
+// The entry points used by the interceptors below. If the allocator is off
+// (or out of memory), RtlTryAlloc() and RtlTryCalloc() return NULL and the
+// interceptor calls the real function.
+static INLINE void *RtlTryAlloc(size_t size) {
+  return RtlAllocatorEnabled() ? RtlAlloc(size) : NULL;
+}
+
+static INLINE void *RtlTryCalloc(size_t nmemb, size_t size) {
+  if (!RtlAllocatorEnabled()) return NULL;
+  if (size && nmemb > (size_t)-1 / size) return NULL;
+  void *res = RtlAlloc(nmemb * size);
+  if (res) memset(res, 0, nmemb * size);
+  return res;
+}
+
+// Frees |ptr| if it is our chunk.
+static INLINE bool RtlFreeIfOurs(void *ptr) {
+  if (!ptr || !RtlChunkIsOurs(ptr)) return false;
+  RtlDealloc(ptr);
+  return true;
+}
+
+static void *RtlReallocOurs(void *ptr, size_t size) {
+  if (size == 0) {
+    RtlDealloc(ptr);
+    return NULL;
+  }
+  RtlChunkHeader *h = (RtlChunkHeader*)ptr - 1;
+  uintptr_t c = h->magic & ~kRtlChunkMagicMask;
+  uintptr_t total = size + sizeof(RtlChunkHeader);
+  if (c != kRtlLargeClass && total > size && total <= RtlClassSize(c)) {
+    h->size = size;
+    return ptr;
+  }
+  void *res = RtlAlloc(size);
+  if (!res) return NULL;
+  memcpy(res, ptr, min((size_t)h->size, size));
+  RtlDealloc(ptr);
+  return res;
+}
+
+// Returns false if the real realloc() should be called instead.
+static INLINE bool RtlTryRealloc(void *ptr, size_t size, void **res) {
+  if (ptr && RtlChunkIsOurs(ptr)) {
+    *res = RtlReallocOurs(ptr, size);
+    return true;
+  }
+  if (!ptr && RtlAllocatorEnabled()) {
+    *res = RtlAlloc(size);
+    return *res != NULL;
+  }
+  return false;
+}
+
+extern "C"
+size_t malloc_usable_size(void *ptr) {
+  if (ptr && RtlChunkIsOurs(ptr)) {
+    RtlChunkHeader *h = (RtlChunkHeader*)ptr - 1;
+    uintptr_t c = h->magic & ~kRtlChunkMagicMask;
+    if (c == kRtlLargeClass) return h->size;
+    return RtlClassSize(c) - sizeof(RtlChunkHeader);
+  }
+  return real_malloc_usable_size(ptr);
+}
+
 // TODO(glider): we may want to eliminate the wrappers to weak functions that
 // we replace (malloc(), free(), realloc()).
 // TODO(glider): we may also want to handle calloc(), pvalloc() and other
 // routines provided by libc.
 // Wrap malloc() calls from the client code.
-extern "C" void *__libc_malloc(size_t size);
-extern "C" void *__libc_calloc(size_t nmemb, size_t size);
-extern "C" void __libc_free(void *ptr);
-extern "C" void *__libc_realloc(void *ptr, size_t size);
 
 extern "C"
 void *calloc(size_t nmemb, size_t size) {
   if (IN_RTL) return __libc_calloc(nmemb, size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(calloc);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)calloc;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __libc_calloc(nmemb, size);
+  void *result = RtlTryCalloc(nmemb, size);
+  if (!result) result = __libc_calloc(nmemb, size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, nmemb * size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1255,13 +2237,14 @@ void *calloc(size_t nmemb, size_t size) {
 extern "C"
 void *__wrap_calloc(size_t nmemb, size_t size) {
   if (IN_RTL) return __real_calloc(nmemb, size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap_calloc);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real_calloc;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real_calloc(nmemb, size);
+  void *result = RtlTryCalloc(nmemb, size);
+  if (!result) result = __real_calloc(nmemb, size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, nmemb * size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1271,14 +2254,15 @@ void *__wrap_calloc(size_t nmemb, size_t size) {
 extern "C"
 void *__wrap_malloc(size_t size) {
   if (IN_RTL) return __real_malloc(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap_malloc);
   void *result;
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real_malloc;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  result = __real_malloc(size);
+  result = RtlTryAlloc(size);
+  if (!result) result = __real_malloc(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1290,14 +2274,15 @@ void *__wrap_malloc(size_t size) {
 extern "C"
 void *malloc(size_t size) {
   if (IN_RTL || !RTL_INIT || !INIT) return __libc_malloc(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(malloc);
   void *result;
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)malloc;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  result = __libc_malloc(size);
+  result = RtlTryAlloc(size);
+  if (!result) result = __libc_malloc(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1307,7 +2292,7 @@ void *malloc(size_t size) {
 extern "C"
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
   if (IN_RTL) return real_posix_memalign(memptr, alignment, size);
-  GIL scoped;
+  AllocatorGIL scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_posix_memalign, 0);
   int result = real_posix_memalign(memptr, alignment, size);
@@ -1319,7 +2304,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
 extern "C"
 void* valloc(size_t size) {
   if (IN_RTL) return real_valloc(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_valloc, 0);
   void* result = real_valloc(size);
@@ -1331,7 +2316,7 @@ void* valloc(size_t size) {
 extern "C"
 void* memalign(size_t boundary, size_t size) {
   if (IN_RTL) return real_memalign(boundary, size);
-  GIL scoped;
+  AllocatorGIL scoped;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)real_memalign, 0);
   void* result = real_memalign(boundary, size);
@@ -1344,8 +2329,11 @@ extern "C"
 void __wrap_free(void *ptr) {
   if (ptr == 0)
     return;
-  if (IN_RTL || INFO.thread == NULL) return __real_free(ptr);
-  GIL scoped;
+  if (IN_RTL || INFO.thread == NULL) {
+    if (!RtlFreeIfOurs(ptr)) __real_free(ptr);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap_free);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real_free;
@@ -1361,15 +2349,18 @@ void __wrap_free(void *ptr) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __real_free(ptr);
+  if (!RtlFreeIfOurs(ptr)) __real_free(ptr);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
 
 extern "C"
 void free(void *ptr) {
-  if (IN_RTL || !RTL_INIT || !INIT) return __libc_free(ptr);
-  GIL scoped;
+  if (IN_RTL || !RTL_INIT || !INIT) {
+    if (!RtlFreeIfOurs(ptr)) __libc_free(ptr);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(free);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)free;
@@ -1379,15 +2370,19 @@ void free(void *ptr) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __libc_free(ptr);
+  if (!RtlFreeIfOurs(ptr)) __libc_free(ptr);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
 
 extern "C"
 void *__wrap_realloc(void *ptr, size_t size) {
-  if (IN_RTL) return __real_realloc(ptr, size);
-  GIL scoped;
+  if (IN_RTL) {
+    void *result;
+    if (RtlTryRealloc(ptr, size, &result)) return result;
+    return __real_realloc(ptr, size);
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap_realloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1397,7 +2392,8 @@ void *__wrap_realloc(void *ptr, size_t size) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  result = __real_realloc(ptr, size);
+  if (!RtlTryRealloc(ptr, size, &result))
+    result = __real_realloc(ptr, size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1406,8 +2402,12 @@ void *__wrap_realloc(void *ptr, size_t size) {
 
 extern "C"
 void *realloc(void *ptr, size_t size) {
-  if (IN_RTL || !RTL_INIT || !INIT) return __libc_realloc(ptr, size);
-  GIL scoped;
+  if (IN_RTL || !RTL_INIT || !INIT) {
+    void *result;
+    if (RtlTryRealloc(ptr, size, &result)) return result;
+    return __libc_realloc(ptr, size);
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(realloc);
   void *result;
   DECLARE_TID_AND_PC();
@@ -1417,7 +2417,8 @@ void *realloc(void *ptr, size_t size) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  result = __libc_realloc(ptr, size);
+  if (!RtlTryRealloc(ptr, size, &result))
+    result = __libc_realloc(ptr, size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1428,13 +2429,14 @@ void *realloc(void *ptr, size_t size) {
 extern "C"
 void *__wrap__Znwj(unsigned int size) {
   if (IN_RTL) return __real__Znwj(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__Znwj);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znwj;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__Znwj(size);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__Znwj(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1444,13 +2446,14 @@ void *__wrap__Znwj(unsigned int size) {
 extern "C"
 void *__wrap__ZnwjRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnwjRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZnwjRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnwjRKSt9nothrow_t;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__ZnwjRKSt9nothrow_t(size, nt);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__ZnwjRKSt9nothrow_t(size, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1460,13 +2463,14 @@ void *__wrap__ZnwjRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znaj(unsigned int size) {
   if (IN_RTL) return __real__Znaj(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__Znaj);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znaj;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__Znaj(size);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__Znaj(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1476,13 +2480,14 @@ void *__wrap__Znaj(unsigned int size) {
 extern "C"
 void *__wrap__ZnajRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnajRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZnajRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnajRKSt9nothrow_t;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__ZnajRKSt9nothrow_t(size, nt);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__ZnajRKSt9nothrow_t(size, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1494,13 +2499,14 @@ void *__wrap__ZnajRKSt9nothrow_t(unsigned size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znwm(unsigned long size) {
   if (IN_RTL) return __real__Znwm(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__Znwm);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znwm;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__Znwm(size);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__Znwm(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1510,13 +2516,14 @@ void *__wrap__Znwm(unsigned long size) {
 extern "C"
 void *__wrap__ZnwmRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnwmRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZnwmRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnwmRKSt9nothrow_t;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__ZnwmRKSt9nothrow_t(size, nt);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__ZnwmRKSt9nothrow_t(size, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1526,13 +2533,14 @@ void *__wrap__ZnwmRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
 extern "C"
 void *__wrap__Znam(unsigned long size) {
   if (IN_RTL) return __real__Znam(size);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__Znam);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__Znam;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__Znam(size);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__Znam(size);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1542,13 +2550,14 @@ void *__wrap__Znam(unsigned long size) {
 extern "C"
 void *__wrap__ZnamRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
   if (IN_RTL) return __real__ZnamRKSt9nothrow_t(size, nt);
-  GIL scoped;
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZnamRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZnamRKSt9nothrow_t;
   RPut(RTN_CALL, tid, pc, mypc, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  void *result = __real__ZnamRKSt9nothrow_t(size, nt);
+  void *result = RtlTryAlloc(size);
+  if (!result) result = __real__ZnamRKSt9nothrow_t(size, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   SPut(MALLOC, tid, mypc, (uintptr_t)result, size);
   RPut(RTN_EXIT, tid, pc, 0, 0);
@@ -1560,8 +2569,11 @@ void *__wrap__ZnamRKSt9nothrow_t(unsigned long size, nothrow_t &nt) {
 
 extern "C"
 void __wrap__ZdlPv(void *ptr) {
-  if (IN_RTL) return __real__ZdlPv(ptr);
-  GIL scoped;
+  if (IN_RTL) {
+    if (!RtlFreeIfOurs(ptr)) __real__ZdlPv(ptr);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZdlPv);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdlPv;
@@ -1570,15 +2582,18 @@ void __wrap__ZdlPv(void *ptr) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __real__ZdlPv(ptr);
+  if (!RtlFreeIfOurs(ptr)) __real__ZdlPv(ptr);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
 
 extern "C"
 void __wrap__ZdlPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
-  if (IN_RTL) return __real__ZdlPvRKSt9nothrow_t(ptr, nt);
-  GIL scoped;
+  if (IN_RTL) {
+    if (!RtlFreeIfOurs(ptr)) __real__ZdlPvRKSt9nothrow_t(ptr, nt);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZdlPvRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdlPvRKSt9nothrow_t;
@@ -1587,15 +2602,18 @@ void __wrap__ZdlPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __real__ZdlPvRKSt9nothrow_t(ptr, nt);
+  if (!RtlFreeIfOurs(ptr)) __real__ZdlPvRKSt9nothrow_t(ptr, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
 
 extern "C"
 void __wrap__ZdaPv(void *ptr) {
-  if (IN_RTL) return __real__ZdaPv(ptr);
-  GIL scoped;
+  if (IN_RTL) {
+    if (!RtlFreeIfOurs(ptr)) __real__ZdaPv(ptr);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZdaPv);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdaPv;
@@ -1604,15 +2622,18 @@ void __wrap__ZdaPv(void *ptr) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __real__ZdaPv(ptr);
+  if (!RtlFreeIfOurs(ptr)) __real__ZdaPv(ptr);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
 
 extern "C"
 void __wrap__ZdaPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
-  if (IN_RTL) return __real__ZdaPvRKSt9nothrow_t(ptr, nt);
-  GIL scoped;
+  if (IN_RTL) {
+    if (!RtlFreeIfOurs(ptr)) __real__ZdaPvRKSt9nothrow_t(ptr, nt);
+    return;
+  }
+  AllocatorGIL scoped;
   RECORD_ALLOC(__wrap__ZdaPvRKSt9nothrow_t);
   DECLARE_TID_AND_PC();
   pc_t const mypc = (pc_t)__real__ZdaPvRKSt9nothrow_t;
@@ -1621,7 +2642,7 @@ void __wrap__ZdaPvRKSt9nothrow_t(void *ptr, nothrow_t &nt) {
   SPut(FREE, tid, mypc, (uintptr_t)ptr, 0);
   if (__tsan_thread_ignore) SPut(IGNORE_WRITES_END, tid, mypc, 0, 0);
   IGNORE_ALL_ACCESSES_AND_SYNC_BEGIN();
-  __real__ZdaPvRKSt9nothrow_t(ptr, nt);
+  if (!RtlFreeIfOurs(ptr)) __real__ZdaPvRKSt9nothrow_t(ptr, nt);
   IGNORE_ALL_ACCESSES_AND_SYNC_END();
   RPut(RTN_EXIT, tid, pc, 0, 0);
 }
@@ -2149,30 +3170,32 @@ int __wrap_pthread_join(pthread_t thread, void **value_ptr) {
   tid_t joined_tid = -1;
   {
     GIL scoped;
-    if (Tids.find(thread) == Tids.end()) {
-      InitConds[thread] = new pthread_cond_t;
-      pthread_cond_init(InitConds[thread], NULL);
-      DDPrintf("T%d: Initializing InitConds[%p]=%p\n",
-               tid, thread, InitConds[thread]);
-      DDPrintf("T%d (parent of %p): Waiting on InitConds[%p]=%p\n",
-               tid, thread, thread, InitConds[thread]);
-      __real_pthread_cond_wait(InitConds[thread], &global_lock);
+    PthreadTidSlot *pt_slot = FindPthread(thread);
+    if (!pt_slot) pt_slot = InsertPthread(thread, kPendingTid);
+    if (pt_slot->tid == kPendingTid) {
+      pthread_cond_t init_cond;
+      pthread_cond_init(&init_cond, NULL);
+      pt_slot->init_cond = &init_cond;
+      DDPrintf("T%d (parent of %p): Waiting on init_cond=%p\n",
+               tid, thread, &init_cond);
+      while (pt_slot->tid == kPendingTid)
+        __real_pthread_cond_wait(&init_cond, &global_lock);
+      pt_slot->init_cond = NULL;
+      pthread_cond_destroy(&init_cond);
     }
-    DCHECK(Tids.find(thread) != Tids.end());
-    joined_tid = Tids[thread];
-    DDPrintf("T%d: Finished[T%d]=%d\n", tid, joined_tid, Finished[joined_tid]);
-    if (Finished.find(joined_tid) == Finished.end()) {
-      Finished[joined_tid] = false;
-      DDPrintf("T%d: setting Finished[T%d]=false\n", tid, joined_tid);
-    }
-    if (!Finished[joined_tid]) {
-      FinishConds[joined_tid] = new pthread_cond_t;
-      pthread_cond_init(FinishConds[joined_tid], NULL);
-      DDPrintf("T%d: Initializing FinishConds[%d]=%p\n",
-               tid, joined_tid, FinishConds[joined_tid]);
-      DDPrintf("T%d (parent of T%d): Waiting on FinishConds[%d]=%p\n",
-               tid, joined_tid, joined_tid, FinishConds[joined_tid]);
-      __real_pthread_cond_wait(FinishConds[joined_tid], &global_lock);
+    joined_tid = pt_slot->tid;
+    RtlThreadSlot *slot = GetThreadSlot(joined_tid);
+    DDPrintf("T%d: Finished[T%d]=%d\n", tid, joined_tid, slot->finished);
+    if (!slot->finished) {
+      pthread_cond_t finish_cond;
+      pthread_cond_init(&finish_cond, NULL);
+      slot->finish_cond = &finish_cond;
+      DDPrintf("T%d (parent of T%d): Waiting on finish_cond=%p\n",
+               tid, joined_tid, &finish_cond);
+      while (!slot->finished)
+        __real_pthread_cond_wait(&finish_cond, &global_lock);
+      slot->finish_cond = NULL;
+      pthread_cond_destroy(&finish_cond);
     }
     unsafe_forget_thread(joined_tid, tid);  // TODO(glider): earlier?
   }
@@ -2504,12 +3527,15 @@ void PrintAllocStats() {
 extern "C"
 pid_t __wrap_fork() {
   CHECK(!IN_RTL);
+  AsyncTraceBarrier();
   GIL scoped;
   ThreadSanitizerLockAcquire();
   pid_t result;
   ENTER_RTL();
   DDPrintf("Before fork() in process %d\n", getpid());
+  RtlLockAllCentralLists();
   result = __real_fork();
+  RtlUnlockAllCentralLists();
   DDPrintf("After fork() in process %d\n", getpid());
   if (result == 0) {
     // Ignore all accesses in the child process. If someone is flushing the
@@ -2527,6 +3553,12 @@ pid_t __wrap_fork() {
     // Haha, all our resources that address the TLS of other threads are valid
     // no more!
     FORKED_CHILD = true;
+    // The analysis threads are gone, so are the other LiteRace users.
+    async_trace_queue = NULL;
+    memset(literace_ltid_users, 0, sizeof(literace_ltid_users));
+    literace_ltid_users[LTID] = 1;
+    // Keep sharing the detector memory with the parent as long as possible.
+    ThreadSanitizerAtForkChild();
     //DECLARE_TID_AND_PC();
     //SPut(FLUSH_STATE, tid, pc, 0, 0);
     LEAVE_RTL();
@@ -2819,30 +3851,36 @@ int __wrap_epoll_wait(int epfd, struct epoll_event *events,
  When a signal is  received, it is put into a thread-local array of pending
  signals (see the comments in RTLSignalHandler).
  Each time we release the global lock, we handle all the pending signals.
- Note that clear_pending_signals() shouldn't be called under GIL, because
+ Note that deliver_pending_signals() shouldn't be called under GIL, because
  the client code may call mmap() or any other function that takes GIL.
 */
-void clear_pending_signals() {
+static NOINLINE void deliver_pending_signals() {
   CHECK(!IN_RTL);  // This is implied by the fact that GIL is not taken.
-  if (!have_pending_signals) return;
   ucontext_t uctx;
   getcontext(&uctx);
-  for (int sig = 0; sig < NSIG; sig++) {
-    if (pending_signal_flags[sig]) {
+  // The handlers run with all the signals blocked, so nothing new is
+  // added while we walk the masks.
+  sigfillset(&glob_sig_blocked);
+  pthread_sigmask(SIG_BLOCK, &glob_sig_blocked, &glob_sig_old);
+  have_pending_signals = false;
+  for (int w = 0; w < kSigMaskWords; w++) {
+    uint64_t pending = pending_signal_mask[w];
+    uint64_t sigaction_bits = pending_sigaction_mask[w];
+    pending_signal_mask[w] = 0;
+    pending_sigaction_mask[w] = 0;
+    while (pending) {
+      int bit = __builtin_ctzll(pending);
+      pending &= pending - 1;
+      int sig = w * 64 + bit;
       DDPrintf("[T%d] Pending signal: %d\n", GetTid(), sig);
-      sigfillset(&glob_sig_blocked);
-      pthread_sigmask(SIG_BLOCK, &glob_sig_blocked, &glob_sig_old);
-      pending_signal_flag_t type = pending_signal_flags[sig];
-      pending_signal_flags[sig] = PSF_NONE;
-      if (type == PSF_SIGACTION) {
+      if ((sigaction_bits >> bit) & 1) {
         signal_actions[sig].sa_sigaction(sig, &pending_signals[sig], &uctx);
-      } else {  // type == PSF_SIGNAL
+      } else {
         signal_actions[sig].sa_handler(sig);
       }
-      pthread_sigmask(SIG_SETMASK, &glob_sig_old, &glob_sig_old);
     }
   }
-  have_pending_signals = false;
+  pthread_sigmask(SIG_SETMASK, &glob_sig_old, &glob_sig_old);
 }
 
 extern "C"
@@ -2862,9 +3900,10 @@ void RTLSignalHandler(int sig) {
     signal_actions[sig].sa_handler(sig);
   } else {
     // We're in TSan code. Let's enqueue the signal
-    if (!pending_signal_flags[sig]) {
+    uint64_t bit = 1ULL << (sig % 64);
+    if (!(pending_signal_mask[sig / 64] & bit)) {
       // pending_signals[sig] is undefined.
-      pending_signal_flags[sig] = PSF_SIGNAL;
+      pending_signal_mask[sig / 64] |= bit;
       have_pending_signals = true;
     }
   }
@@ -2887,9 +3926,11 @@ void RTLSignalSigaction(int sig, siginfo_t* info, void* context) {
     signal_actions[sig].sa_sigaction(sig, info, context);
   } else {
     // We're in TSan code. Let's enqueue the signal
-    if (!pending_signal_flags[sig]) {
+    uint64_t bit = 1ULL << (sig % 64);
+    if (!(pending_signal_mask[sig / 64] & bit)) {
       pending_signals[sig] = *info;
-      pending_signal_flags[sig] = PSF_SIGACTION;
+      pending_sigaction_mask[sig / 64] |= bit;
+      pending_signal_mask[sig / 64] |= bit;
       have_pending_signals = true;
     }
   }
@@ -2904,6 +3945,15 @@ int __wrap_sigaction(int signum, const struct sigaction *act,
   int result;
   DECLARE_TID_AND_PC();
   RPut(RTN_CALL, tid, pc, (uintptr_t)__real_sigaction, 0);
+#ifdef FLUSH_WITH_SEGV
+  if (signum == SIGSEGV) {
+    // segvFlushHandler() stays installed and chains to the client's action.
+    if (oldact) *oldact = signal_actions[SIGSEGV];
+    if (act) signal_actions[SIGSEGV] = *act;
+    RPut(RTN_EXIT, tid, pc, 0, 0);
+    return 0;
+  }
+#endif
   if (act == 0 || (act->sa_handler == SIG_IGN) || (act->sa_handler == SIG_DFL)) {
     result = __real_sigaction(signum, act, oldact);
   } else {
@@ -2979,7 +4029,7 @@ void bb_flush_current(TraceInfoPOD *curr_mops) {
 #ifdef DISABLE_RACE_DETECTION
   return;
 #endif
-  flush_trace(curr_mops);
+  flush_trace(curr_mops, thread_local_literace);
 }
 
 extern "C"
@@ -2987,7 +4037,60 @@ void bb_flush_mop(TraceInfoPOD *curr_mop, uintptr_t addr) {
 #ifdef DISABLE_RACE_DETECTION
   return;
 #endif
-  flush_single_mop(curr_mop, addr);
+  flush_single_mop(curr_mop, addr, thread_local_literace);
+}
+
+// The traces of the routines which have touched only thread-local memory
+// in a profiling run (see SharingProfile in thread_sanitizer.cc) are flushed
+// with these two. Such traces are always sampled, at the rate of
+// --profiled_literace_sampling, even if the instrumentation does not check
+// the LiteRace counters itself.
+extern "C"
+void bb_flush_sampled(TraceInfoPOD *curr_mops) {
+#ifdef DISABLE_RACE_DETECTION
+  return;
+#endif
+  TraceInfo *trace_info = reinterpret_cast<TraceInfo*>(curr_mops);
+  if (trace_info->LiteRaceSkipTraceQuickCheck(LTID)) {
+    memset(TLEB, 0, curr_mops->n_mops_ * sizeof(TLEB[0]));
+    return;
+  }
+  flush_trace(curr_mops, profiled_literace);
+}
+
+extern "C"
+void bb_flush_mop_sampled(TraceInfoPOD *curr_mop, uintptr_t addr) {
+#ifdef DISABLE_RACE_DETECTION
+  return;
+#endif
+  TraceInfo *trace_info = reinterpret_cast<TraceInfo*>(curr_mop);
+  if (trace_info->LiteRaceSkipTraceQuickCheck(LTID)) return;
+  flush_single_mop(curr_mop, addr, profiled_literace);
+}
+
+// Reports |count| accesses of |size| bytes starting at |addr| with the given
+// stride. The instrumentation calls this in the preheader of a simple loop
+// instead of instrumenting the mop in the loop body.
+extern "C"
+void bb_flush_range(pc_t pc, uintptr_t addr, intptr_t stride,
+                    uintptr_t count, uintptr_t size, uintptr_t is_write) {
+#ifdef DISABLE_RACE_DETECTION
+  return;
+#endif
+  if (__tsan_thread_ignore || !count) return;
+  tid_t const tid = INFO.tid;
+  EventType const type = is_write ? WRITE : READ;
+  uintptr_t abs_stride = stride < 0 ? -stride : stride;
+  uintptr_t beg = stride < 0 ? addr - abs_stride * (count - 1) : addr;
+  ENTER_RTL();
+  if (abs_stride <= size) {
+    // The accesses cover [beg, end) w/o gaps.
+    SPut(type, tid, pc, beg, abs_stride * (count - 1) + size);
+  } else {
+    for (uintptr_t i = 0; i < count; i++)
+      SPut(type, tid, pc, beg + i * abs_stride, size);
+  }
+  LEAVE_RTL();
 }
 
 extern "C"
@@ -3004,15 +4107,16 @@ void flush_tleb() {
 void process_dtleb_events(int start, int end) {
 #ifdef TSAN_RTL_X64
   if (start == end) return;
+  AsyncTraceBarrier();
    if (end < start) {
-    end += kDoubleDTLEBSize;
+    end += dtleb_double_size;
   }
   TraceInfoPOD *current_passport = NULL;
   bool is_split = false;
   int current_mop = -1, current_size = 0;
 
   for (int i = start; i < end; ++i) {
-    int iter = i % kDoubleDTLEBSize;
+    int iter = i % dtleb_double_size;
     if (DTLEB[iter] & kRtnMask) {
       if (DTLEB[iter] == kRtnMask) {
         //fprintf(stderr, "DTLEB[%d] = RTN_EXIT\n", iter);
@@ -3037,7 +4141,7 @@ void process_dtleb_events(int start, int end) {
         OldDTlebIndex = iter;
         return;
       }
-      if (iter + current_size > (int)kDoubleDTLEBSize) {
+      if (iter + current_size > (int)dtleb_double_size) {
         // This block is split into two parts. We can't pass it at once, so loop
         // over the mops.
         is_split = true;
@@ -3078,7 +4182,7 @@ void process_dtleb_events(int start, int end) {
 // before the value is written.
 extern "C"
 void flush_dtleb_segv() {
-#if defined(USE_DYNAMIC_TLEB)
+#if defined(FLUSH_WITH_SEGV)
 #if defined(DISABLE_RACE_DETECTION)
   return;
 #endif  // DISABLE_RACE_DETECTION
@@ -3088,9 +4192,9 @@ void flush_dtleb_segv() {
 #ifdef TSAN_RTL_X64
   intptr_t actual_index;  // instead of DTlebIndex.
   if (tleb_half == 1) {
-    actual_index = kDoubleDTLEBSize;
+    actual_index = dtleb_double_size;
   } else {
-    actual_index = kDTLEBSize;
+    actual_index = dtleb_size;
   }
 
   //fprintf(stderr, "flush_dtleb_segv(), actual_index: %ld, OldDTlebIndex: %ld, "
@@ -3100,14 +4204,14 @@ void flush_dtleb_segv() {
   intptr_t start = OldDTlebIndex, end = actual_index;
   //fprintf(stderr, "start=%ld, end=%ld\n", start, end);
   process_dtleb_events(start, end);
-  OldDTlebIndex = end % kDoubleDTLEBSize;
+  OldDTlebIndex = end % dtleb_double_size;
   //fprintf(stderr, "leaving flush_dtleb_segv(): OldDTlebIndex=%ld, actual_index=%ld\n",
   //       OldDTlebIndex, actual_index);
   return;
 #else
   CHECK(0 && "DTLEB not supported for 32-bit targets!");
 #endif  // TSAN_RTL_X64
-#endif  // USE_DYNAMIC_TLEB
+#endif  // FLUSH_WITH_SEGV
 }
 
 #ifdef USE_DYNAMIC_TLEB
@@ -3231,14 +4335,48 @@ void PcToStrings(pc_t pc, bool demangle,
 extern "C" void __attribute__((visibility("default")))
 __tsan_handle_mop(void *addr, unsigned flags) {
   if (IN_RTL + __tsan_thread_ignore == 0) {
+    AsyncTraceBarrier();
     ENTER_RTL();
     void* pc = __builtin_return_address(0);
     uint64_t mop = (uint64_t)(uintptr_t)pc | ((uint64_t)flags) << 58;
     MopInfo mop2;
     memcpy(&mop2, &mop, sizeof(mop));
-    ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
-                                         mop2,
-                                         (uintptr_t)addr);
+    if (UNLIKELY(g_recorder != NULL)) {
+      RecordEvent(mop2.is_write() ? WRITE : READ, INFO.tid, mop2.pc(),
+                  (uintptr_t)addr, mop2.size());
+    } else {
+      ThreadSanitizerHandleOneMemoryAccess(INFO.thread,
+                                           mop2,
+                                           (uintptr_t)addr);
+    }
+    LEAVE_RTL();
+  }
+}
+
+// The GCC plugin stores the addresses of the consecutive mops of a block
+// into __tsan_mop_buffer and calls this once for all of them.
+// The mops have no pcs of their own, the call site is used instead.
+extern "C" void __attribute__((visibility("default")))
+__tsan_handle_mop_batch(unsigned n) {
+  DCHECK(n <= kMopBatchSize);
+  if (IN_RTL + __tsan_thread_ignore == 0) {
+    AsyncTraceBarrier();
+    ENTER_RTL();
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    for (unsigned i = 0; i < n; i++) {
+      uintptr_t entry = __tsan_mop_buffer[i];
+      uint64_t mop = (uint64_t)pc |
+          ((uint64_t)(entry >> kMopBatchFlagsShift)) << 58;
+      MopInfo mop2;
+      memcpy(&mop2, &mop, sizeof(mop));
+      uintptr_t addr = entry & (((uintptr_t)1 << kMopBatchFlagsShift) - 1);
+      if (UNLIKELY(g_recorder != NULL)) {
+        RecordEvent(mop2.is_write() ? WRITE : READ, INFO.tid, mop2.pc(),
+                    addr, mop2.size());
+      } else {
+        ThreadSanitizerHandleOneMemoryAccess(INFO.thread, mop2, addr);
+      }
+    }
     LEAVE_RTL();
   }
 }
@@ -108,6 +108,15 @@ class GIL {
 #endif
 };
 
+// Takes the GIL unless --gil_free_allocator is set.
+class AllocatorGIL {
+ public:
+  AllocatorGIL();
+  ~AllocatorGIL();
+ private:
+  bool gil_;
+};
+
 typedef uintptr_t pc_t;
 typedef uintptr_t tid_t;
 typedef map<pc_t, string> PcToStringMap;
@@ -116,6 +125,9 @@ struct ThreadInfo {
   TSanThread *thread;
   tid_t tid;
   int *thread_local_ignore;
+  // The stack of the thread as passed in THR_STACK_TOP, for --fast_unwind.
+  uintptr_t stack_lo;
+  uintptr_t stack_hi;
 };
 
 tid_t GetTid();
@@ -149,6 +161,10 @@ void flush_dtleb_segv();
 void flush_dtleb_nosegv();
 void bb_flush_current(TraceInfoPOD *curr_mops);
 void bb_flush_mop(TraceInfoPOD *curr_mop, uintptr_t addr);
+void bb_flush_sampled(TraceInfoPOD *curr_mops);
+void bb_flush_mop_sampled(TraceInfoPOD *curr_mop, uintptr_t addr);
+void bb_flush_range(pc_t pc, uintptr_t addr, intptr_t stride,
+                    uintptr_t count, uintptr_t size, uintptr_t is_write);
 void shadow_stack_check(uintptr_t old_v, uintptr_t new_v);
 void *rtl_memcpy(char *dest, const char *src, size_t n);
 void *rtl_memmove(char *dest, const char *src, size_t n);
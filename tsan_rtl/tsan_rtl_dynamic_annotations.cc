@@ -60,6 +60,55 @@ void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfter)(const char *file, int line,
   ExSPut(WAIT, tid, pc, (uintptr_t)cv, 0);
 }
 
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeMany)(
+    const char *file, int line, const volatile void *const *objs, long n) {
+  DECLARE_TID_AND_PC();
+  if (n <= 0) return;
+  eq_sched_shake(shake_atomic_rmw, objs[0]);
+  ExSPut(SIGNAL_MANY, tid, pc, (uintptr_t)objs, n);
+}
+
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterMany)(
+    const char *file, int line, const volatile void *const *objs, long n) {
+  DECLARE_TID_AND_PC();
+  if (n <= 0) return;
+  eq_sched_shake(shake_atomic_rmw, objs[0]);
+  ExSPut(WAIT_MANY, tid, pc, (uintptr_t)objs, n);
+}
+
+static void PutArray(EventType type, tid_t tid, pc_t pc,
+                     const volatile void *array, long n, long elem_size) {
+  uintptr_t objs[kMaxManyEventObjs];
+  uintptr_t addr = (uintptr_t)array;
+  while (n > 0) {
+    size_t n_objs = min((size_t)n, kMaxManyEventObjs);
+    for (size_t i = 0; i < n_objs; i++, addr += elem_size)
+      objs[i] = addr;
+    ExSPut(type, tid, pc, (uintptr_t)objs, n_objs);
+    n -= n_objs;
+  }
+}
+
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensBeforeArray)(
+    const char *file, int line, const volatile void *array, long n,
+    long elem_size) {
+  DECLARE_TID_AND_PC();
+  eq_sched_shake(shake_atomic_rmw, array);
+  PutArray(SIGNAL_MANY, tid, pc, array, n, elem_size);
+}
+
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateHappensAfterArray)(
+    const char *file, int line, const volatile void *array, long n,
+    long elem_size) {
+  DECLARE_TID_AND_PC();
+  eq_sched_shake(shake_atomic_rmw, array);
+  PutArray(WAIT_MANY, tid, pc, array, n, elem_size);
+}
+
 extern "C"
 void DYNAMIC_ANNOTATIONS_NAME(AnnotateCondVarSignal)(const char *file, int line,
                                                      const volatile void *cv) {
@@ -131,6 +180,20 @@ void DYNAMIC_ANNOTATIONS_NAME(AnnotateFlushState)(const char *file, int line) {
   ExSPut(FLUSH_STATE, tid, pc, 0, 0);
 }
 
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateTargetMemoryRange)(
+    const char *file, int line, const volatile void *address, long size) {
+  DECLARE_TID_AND_PC();
+  ExSPut(TARGET_RANGE, tid, pc, (uintptr_t)address, (uintptr_t)size);
+}
+
+extern "C"
+void DYNAMIC_ANNOTATIONS_NAME(AnnotateUntargetMemoryRange)(
+    const char *file, int line, const volatile void *address, long size) {
+  DECLARE_TID_AND_PC();
+  ExSPut(UNTARGET_RANGE, tid, pc, (uintptr_t)address, (uintptr_t)size);
+}
+
 extern "C"
 void DYNAMIC_ANNOTATIONS_NAME(AnnotateNewMemory)(const char *file, int line,
                                                  const volatile void *mem,
@@ -28,26 +28,298 @@
 
 #include "bfd_symbolizer.h"
 #include "thread_sanitizer.h"
+#include "tsan_rtl.h"
 #include "tsan_rtl_symbolize.h"
+#include "tsan_rtl_wrap.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace __tsan;
+
+// -------- Persistent symbol cache --------- {{{1
+// With --symbol_cache_file=<path>, the results of bfds_symbolize() for code
+// are kept in a file shared by all the runs and processes (think of
+// --trace_children with hundreds of forked workers, each of which would
+// otherwise parse the same DWARF again). A pc is identified by the build-id
+// of its module and its offset in it, so the entries stay valid across runs
+// and address space layouts; modules w/o a build-id are not cached.
+//
+// The file is a sequence of lines
+//   <build-id>/<offset>/<d|m>\t<ok>\t<module>\t<symbol>\t<file>\t<line>
+// where d/m tells whether the symbol is demangled. It is mapped and parsed
+// once at startup; new entries are appended with a single O_APPEND write,
+// so concurrent writers don't corrupt the file. Duplicates are harmless.
+
+struct CachedCodeSymbol {
+  bool ok;
+  string module;
+  string symbol;
+  string file;
+  int line;
+};
+
+struct LoadedModule {
+  uintptr_t start, end;  // The executable segment.
+  uintptr_t base;        // dlpi_addr.
+  string build_id;       // Empty if the module has none.
+};
+
+static pthread_mutex_t symbol_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, CachedCodeSymbol> *symbol_cache;
+static vector<LoadedModule> *loaded_modules;
+static int symbol_cache_fd = -1;
+
+class SymbolCacheLock {
+ public:
+  SymbolCacheLock() {
+    __real_pthread_mutex_lock(&symbol_cache_lock);
+  }
+  ~SymbolCacheLock() {
+    __real_pthread_mutex_unlock(&symbol_cache_lock);
+  }
+};
+
+static string GetBuildId(struct dl_phdr_info *info) {
+  static const char kHex[] = "0123456789abcdef";
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) continue;
+    const char *p = (const char*)(info->dlpi_addr + phdr->p_vaddr);
+    const char *end = p + phdr->p_memsz;
+    while (p + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr) *note = (const ElfW(Nhdr)*)p;
+      const char *name = p + sizeof(*note);
+      const unsigned char *desc =
+          (const unsigned char*)(name + ((note->n_namesz + 3) & ~3));
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0) {
+        string res;
+        for (size_t j = 0; j < note->n_descsz; j++) {
+          res += kHex[desc[j] >> 4];
+          res += kHex[desc[j] & 15];
+        }
+        return res;
+      }
+      p = (const char*)desc + ((note->n_descsz + 3) & ~3);
+    }
+  }
+  return "";
+}
+
+static int AddLoadedModule(struct dl_phdr_info *info, size_t, void *) {
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+    LoadedModule module;
+    module.start = info->dlpi_addr + phdr->p_vaddr;
+    module.end = module.start + phdr->p_memsz;
+    module.base = info->dlpi_addr;
+    module.build_id = GetBuildId(info);
+    loaded_modules->push_back(module);
+  }
+  return 0;
+}
+
+// Returns the cache key for pc, or "" if it can't be cached.
+// symbol_cache_lock must be held.
+static string SymbolCacheKey(uintptr_t pc, bool demangle) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    for (size_t i = 0; i < loaded_modules->size(); i++) {
+      LoadedModule &module = (*loaded_modules)[i];
+      if (pc < module.start || pc >= module.end) continue;
+      if (module.build_id.empty()) return "";
+      char buff[64];
+      snprintf(buff, sizeof(buff), "/%lx/%c",
+               (unsigned long)(pc - module.base), demangle ? 'd' : 'm');
+      return module.build_id + buff;
+    }
+    // Not found: maybe a library was loaded since we looked.
+    loaded_modules->clear();
+    dl_iterate_phdr(AddLoadedModule, NULL);
+  }
+  return "";
+}
+
+static void ParseSymbolCacheLine(const char *p, const char *end) {
+  vector<string> fields;
+  const char *field = p;
+  for (; p <= end; p++) {
+    if (p == end || *p == '\t') {
+      fields.push_back(string(field, p - field));
+      field = p + 1;
+    }
+  }
+  if (fields.size() != 6) return;  // E.g. a line cut by a crash.
+  if (symbol_cache->count(fields[0])) return;
+  CachedCodeSymbol &entry = (*symbol_cache)[fields[0]];
+  entry.ok = fields[1] == "1";
+  entry.module = fields[2];
+  entry.symbol = fields[3];
+  entry.file = fields[4];
+  entry.line = atoi(fields[5].c_str());
+}
+
+static void InitSymbolCache() {
+  const string &path = G_flags->symbol_cache_file;
+  if (path.empty()) return;
+  symbol_cache = new map<string, CachedCodeSymbol>;
+  loaded_modules = new vector<LoadedModule>;
+  symbol_cache_fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+  if (symbol_cache_fd < 0) {
+    Report("WARNING: can not open --symbol_cache_file=%s\n", path.c_str());
+    return;
+  }
+  struct stat st;
+  if (fstat(symbol_cache_fd, &st) != 0 || st.st_size == 0) return;
+  size_t size = st.st_size;
+  void *mem = __real_mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+                          symbol_cache_fd, 0);
+  if (mem == MAP_FAILED) return;
+  const char *p = (const char*)mem, *end = p + size;
+  while (p < end) {
+    const char *eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol) break;  // An incomplete last line.
+    ParseSymbolCacheLine(p, eol);
+    p = eol + 1;
+  }
+  __real_munmap(mem, size);
+  if (G_flags->verbosity >= 1) {
+    Printf("INFO: %ld entries read from --symbol_cache_file=%s\n",
+           symbol_cache->size(), path.c_str());
+  }
+}
+
+static bool LookupSymbolCache(const string &key, CachedCodeSymbol *res) {
+  map<string, CachedCodeSymbol>::iterator it = symbol_cache->find(key);
+  if (it == symbol_cache->end()) return false;
+  *res = it->second;
+  return true;
+}
+
+static void AddToSymbolCache(const string &key, const CachedCodeSymbol &entry) {
+  (*symbol_cache)[key] = entry;
+  if (symbol_cache_fd < 0) return;
+  char line_buff[32];
+  snprintf(line_buff, sizeof(line_buff), "%d", entry.line);
+  string line = key + "\t" + (entry.ok ? "1" : "0") + "\t" + entry.module +
+      "\t" + entry.symbol + "\t" + entry.file + "\t" + line_buff + "\n";
+  // Names with tabs or newlines would break the format; don't store them.
+  if (count(line.begin(), line.end(), '\t') != 5 ||
+      count(line.begin(), line.end(), '\n') != 1)
+    return;
+  __real_write(symbol_cache_fd, line.c_str(), line.size());
+}
+
+static void CopyToBuffer(const string &str, char *buff, int buff_size) {
+  if (!buff || buff_size <= 0) return;
+  strncpy(buff, str.c_str(), buff_size - 1);
+  buff[buff_size - 1] = 0;
+}
+
+// -------- Symbolizer --------- {{{1
+
+// Drops the frames above 'pc', i.e. the ones of the runtime.
+// Returns false if 'pc' is not on the stack.
+static bool CutStackAbovePc(uintptr_t* stack, int* count, uintptr_t pc) {
+  for (int i = 0; i < *count; i++) {
+    if (stack[i] == pc) {
+      for (int j = i; j < *count; j++) {
+        stack[j-i] = stack[j];
+      }
+      *count -= i;
+      return true;
+    }
+  }
+  return false;
+}
 
 static int UnwindCallback(uintptr_t* stack, int count, uintptr_t pc) {
+  // --fast_unwind: the frame pointers are good if they lead to 'pc', which
+  // they don't when some frame in between was built without them.
+  if (G_flags->fast_unwind && INFO.stack_hi) {
+    int res = FramePointerUnwind((uintptr_t)__builtin_frame_address(0),
+                                 INFO.stack_lo, INFO.stack_hi, stack, count);
+    if (CutStackAbovePc(stack, &res, pc))
+      return res;
+  }
   int res = bfds_unwind((void**)stack, count, 0);
   if (res <= 0 || res > count)
     return -1;
-  for (int i = 1; i < res; i++) {
-    if (stack[i] == pc) {
-      for (int j = i; j < res; j++) {
-        stack[j-i] = stack[j];
+  CutStackAbovePc(stack, &res, pc);
+  return res;
+}
+
+// See ThreadSanitizerSymbolizeBatchCallback. Consults the symbol cache
+// first and resolves the rest with a single bfds_symbolize_batch().
+static void SymbolizeBatchCallback(const vector<uintptr_t> &pcs, bool demangle,
+                                   vector<string> *img_names,
+                                   vector<string> *rtn_names,
+                                   vector<string> *file_names,
+                                   vector<int> *line_nos) {
+  size_t n = pcs.size();
+  vector<CachedCodeSymbol> res(n);
+  vector<string> keys(n);
+  vector<size_t> missing;
+  {
+    SymbolCacheLock lock;
+    for (size_t i = 0; i < n; i++) {
+      if (symbol_cache) {
+        keys[i] = SymbolCacheKey(pcs[i], demangle);
+        if (!keys[i].empty() && LookupSymbolCache(keys[i], &res[i]))
+          continue;
       }
-      res -= i;
-      break;
+      missing.push_back(i);
     }
   }
-  return res;
+
+  if (!missing.empty()) {
+    const int kBuffSize = 4096;
+    vector<bfds_entry_t> entries(missing.size());
+    vector<char> buff(missing.size() * kBuffSize * 3);
+    for (size_t j = 0; j < missing.size(); j++) {
+      bfds_entry_t &e = entries[j];
+      char *b = &buff[j * kBuffSize * 3];
+      memset(&e, 0, sizeof(e));
+      e.addr = (void*)pcs[missing[j]];
+      e.symbol = b;
+      e.symbol_size = kBuffSize;
+      e.module = b + kBuffSize;
+      e.module_size = kBuffSize;
+      e.filename = b + 2 * kBuffSize;
+      e.filename_size = kBuffSize;
+    }
+    bfds_symbolize_batch(&entries[0], entries.size(),
+                         demangle ? bfds_opt_demangle : bfds_opt_none);
+    SymbolCacheLock lock;
+    for (size_t j = 0; j < missing.size(); j++) {
+      bfds_entry_t &e = entries[j];
+      CachedCodeSymbol &entry = res[missing[j]];
+      entry.ok = e.result == 0;
+      entry.module = entry.ok ? e.module : "";
+      entry.symbol = entry.ok ? e.symbol : "";
+      entry.file = entry.ok ? e.filename : "";
+      entry.line = entry.ok ? e.source_line : 0;
+      if (symbol_cache && !keys[missing[j]].empty())
+        AddToSymbolCache(keys[missing[j]], entry);
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    img_names->push_back(res[i].module);
+    rtn_names->push_back(res[i].symbol);
+    file_names->push_back(res[i].file);
+    line_nos->push_back(res[i].line);
+  }
 }
 
 void __tsan::SymbolizeInit() {
   ThreadSanitizerSetUnwindCallback(UnwindCallback);
+  ThreadSanitizerSetSymbolizeBatchCallback(SymbolizeBatchCallback);
+  InitSymbolCache();
 }
 
 void __tsan::SymbolizeFini(int nerror) {
@@ -72,11 +344,11 @@ bool __tsan::SymbolizeData(void *addr, char *symbol,
   return true;
 }
 
-bool __tsan::SymbolizeCode(void *pc, bool demangle,
-                           char *module, int module_sz,
-                           char *symbol, int symbol_sz,
-                           char *file, int file_sz,
-                           int *line) {
+static bool SymbolizeCodeWithBfd(void *pc, bool demangle,
+                                 char *module, int module_sz,
+                                 char *symbol, int symbol_sz,
+                                 char *file, int file_sz,
+                                 int *line) {
   if (bfds_symbolize((void*)pc,
                      demangle ? bfds_opt_demangle : bfds_opt_none,
                      symbol, symbol_sz,
@@ -98,3 +370,43 @@ bool __tsan::SymbolizeCode(void *pc, bool demangle,
   return true;
 }
 
+bool __tsan::SymbolizeCode(void *pc, bool demangle,
+                           char *module, int module_sz,
+                           char *symbol, int symbol_sz,
+                           char *file, int file_sz,
+                           int *line) {
+  if (!symbol_cache) {
+    return SymbolizeCodeWithBfd(pc, demangle, module, module_sz,
+                                symbol, symbol_sz, file, file_sz, line);
+  }
+
+  CachedCodeSymbol entry;
+  string key;
+  bool found = false;
+  {
+    SymbolCacheLock lock;
+    key = SymbolCacheKey((uintptr_t)pc, demangle);
+    found = !key.empty() && LookupSymbolCache(key, &entry);
+  }
+  if (!found) {
+    // Always ask for everything, the cached entry has to be complete.
+    const int kBuffSize = 4096;
+    char module_buff[kBuffSize], symbol_buff[kBuffSize], file_buff[kBuffSize];
+    entry.ok = SymbolizeCodeWithBfd(pc, demangle, module_buff, kBuffSize,
+                                    symbol_buff, kBuffSize,
+                                    file_buff, kBuffSize, &entry.line);
+    entry.module = module_buff;
+    entry.symbol = symbol_buff;
+    entry.file = file_buff;
+    if (!key.empty()) {
+      SymbolCacheLock lock;
+      AddToSymbolCache(key, entry);
+    }
+  }
+  CopyToBuffer(entry.module, module, module_sz);
+  CopyToBuffer(entry.symbol, symbol, symbol_sz);
+  CopyToBuffer(entry.file, file, file_sz);
+  if (line)
+    *line = entry.line;
+  return entry.ok;
+}
@@ -53,159 +53,116 @@ class DbgInfoLock {
   }
 };
 
-struct LLVMDebugInfo {
-  LLVMDebugInfo()
-    : pc(0), line(0) { }
-  pc_t pc;
-  string symbol;
-  string demangled_symbol;
-  string file;
-  string path;
-  string fullpath;  // = path + "/" + file
-  uintptr_t line;
+// The debug info emitted by the compiler, one record per instrumented pc.
+// Must be in sync with ThreadSanitizer::writeModuleDebugInfo().
+struct PcInfo {
+  uintptr_t pc;
+  uint32_t symbol;  // Offset in the module's symbol table.
+  uint32_t file;  // Offset in the module's file table.
+  uint32_t line;
 };
 
-struct PcInfo {
+struct DbgModule {
+  const char *files;
+  const char *symbols;
+};
+
+struct DbgIndexEntry {
   uintptr_t pc;
-  uintptr_t symbol;
-  uintptr_t path;
-  uintptr_t file;
-  uintptr_t line;
+  const PcInfo *info;
+  uintptr_t module;  // Index in debug_modules.
+  bool operator<(const DbgIndexEntry &other) const { return pc < other.pc; }
 };
 
-static map<pc_t, LLVMDebugInfo> *debug_info = NULL;
-// end of section : start of section
-static map<uintptr_t, uintptr_t> *data_sections = NULL;
+struct WrapperDbgInfo {
+  pc_t pc;
+  const char *symbol;
+  bool operator<(const WrapperDbgInfo &other) const { return pc < other.pc; }
+};
+
+struct DataSection {
+  uintptr_t begin;
+  uintptr_t end;
+  bool operator<(const DataSection &other) const { return end < other.end; }
+};
+
+// The "tsan_rtl_debug_info" section is used in place and nothing is read
+// at startup: the first symbolization request (see LoadDbgInfo()) reads
+// the ELF section headers, collects the records of all modules into
+// debug_index sorted by pc and builds the other tables. Nothing is copied
+// or demangled until a pc is actually looked up, so a process which never
+// reports anything pays nothing.
+static bool dbg_info_loaded = false;
+static const char *debug_info_begin = NULL;
+static const char *debug_info_end = NULL;
+static vector<DbgModule> *debug_modules = NULL;
+static vector<DbgIndexEntry> *debug_index = NULL;
+// The RTL wrappers have no compiler-generated debug info. Sorted by pc.
+static vector<WrapperDbgInfo> *wrapper_dbg_info = NULL;
+// .data, .rodata and .bss of the executable, sorted by end.
+static vector<DataSection> *data_sections = NULL;
+
+// Provided by the linker if any module has been instrumented.
+extern char __start_tsan_rtl_debug_info[] __attribute__((weak));
+extern char __stop_tsan_rtl_debug_info[] __attribute__((weak));
 
 void atexit_callback();
 
-void ReadDbgInfoFromSection(char* start, char* end) {
+static void BuildDbgIndex() {
   if (G_flags->verbosity >= 1) {
-    Printf("ReadDbgInfoFromSection: %p to %p\n", start, end);
+    Printf("BuildDbgIndex: %p to %p\n", debug_info_begin, debug_info_end);
   }
-  DCHECK(IN_RTL); // operator new and map are used below.
-  static const int kDebugInfoMagicNumber = 0xdb914f0;
-  char *p = start;
-  debug_info = new map<pc_t, LLVMDebugInfo>;
+  DCHECK(IN_RTL); // operator new and vector are used below.
+  static const int kDebugInfoMagicNumber = 0xdb914f1;
+  debug_modules = new vector<DbgModule>;
+  debug_index = new vector<DbgIndexEntry>;
+  const char *p = debug_info_begin;
+  const char *end = debug_info_end;
   while (p < end) {
+    // The modules may be separated by alignment padding.
     while ((p < end) && (*((int*)p) != kDebugInfoMagicNumber)) p++;
     if (p >= end) break;
     uintptr_t *head = (uintptr_t*)p;
-    uintptr_t paths_size = head[1];
-    uintptr_t files_size = head[2];
-    uintptr_t symbols_size = head[3];
-    uintptr_t pcs_size = head[4];
-    p += 5 * sizeof(uintptr_t);
-
-    char *paths_raw = p;
-    map<uintptr_t, string> paths;
-    uintptr_t paths_count = 0;
-    char *pstart = paths_raw;
-    for (size_t i = 0; i < paths_size; i++) {
-      if (!pstart) pstart = paths_raw + i;
-      if (paths_raw[i] == '\0') {
-        paths[paths_count++] = string(pstart);
-        DDPrintf("path: %s\n", paths[paths_count-1].c_str());
-        pstart = NULL;
-      }
-    }
-
-    char *files_raw = paths_raw + paths_size;
-    map<uintptr_t, string> files;
-    uintptr_t files_count = 0;
-    char *fstart = files_raw;
-    for (size_t i = 0; i < files_size; i++) {
-      if (!fstart) fstart = files_raw + i;
-      if (files_raw[i] == '\0') {
-        files[files_count++] = string(fstart);
-        DDPrintf("file: %s\n", files[files_count-1].c_str());
-        fstart = NULL;
-      }
-    }
-
-    map<uintptr_t, string> symbols;
-    uintptr_t symbols_count = 0;
-    char *symbols_raw = files_raw + files_size;
-    char *sstart = symbols_raw;
-    for (size_t i = 0; i < symbols_size; i++) {
-      if (!sstart) sstart = symbols_raw + i;
-      if (symbols_raw[i] == '\0') {
-        symbols[symbols_count++] = string(sstart);
-        DDPrintf("symbol: %s\n", symbols[symbols_count-1].c_str());
-        sstart = NULL;
-      }
-    }
-    size_t pad = (uintptr_t)(symbols_raw + symbols_size) % sizeof(uintptr_t);
-    if (pad) pad = sizeof(uintptr_t) - pad;
-    PcInfo *pcs = (PcInfo*)(symbols_raw + symbols_size + pad);
+    uintptr_t files_size = head[1];
+    uintptr_t symbols_size = head[2];
+    uintptr_t pcs_size = head[3];
+    p += 4 * sizeof(uintptr_t);
+
+    DbgModule module;
+    module.files = p;
+    module.symbols = p + files_size;
+    p += files_size + symbols_size;
+    size_t pad = (uintptr_t)p % sizeof(uintptr_t);
+    if (pad) p += sizeof(uintptr_t) - pad;
+    const PcInfo *pcs = (const PcInfo*)p;
+    p += pcs_size * sizeof(PcInfo);
+    CHECK(p <= end);
     for (size_t i = 0; i < pcs_size; i++) {
-      DDPrintf("pc: %p, sym: %s, file: %s, path: %s, line: %d\n",
-             pcs[i].pc, symbols[pcs[i].symbol].c_str(),
-             files[pcs[i].file].c_str(), paths[pcs[i].path].c_str(),
-             pcs[i].line);
-      // If we've already seen this pc, check that it is inside the same
-      // function, but do not update the debug info (it may be different).
-      // TODO(glider): generate more correct debug info.
-      if ((*debug_info).find(pcs[i].pc) != (*debug_info).end()) {
-        if ((*debug_info)[pcs[i].pc].symbol != symbols[pcs[i].symbol]) {
-          DPrintf("ERROR: conflicting symbols for pc %p:\n  %s\n  %s\n",
-                 pcs[i].pc,
-                 (*debug_info)[pcs[i].pc].symbol.c_str(),
-                 symbols[pcs[i].symbol].c_str());
-///          CHECK(false);
-        }
-      } else {
-        (*debug_info)[pcs[i].pc].pc = pcs[i].pc;
-        (*debug_info)[pcs[i].pc].symbol = symbols[pcs[i].symbol];
-#if defined(__GNUC__)
-        char *demangled = NULL;
-        int status;
-        demangled = __cxxabiv1::__cxa_demangle(symbols[pcs[i].symbol].c_str(),
-                                               0, 0, &status);
-        if (demangled) {
-          (*debug_info)[pcs[i].pc].demangled_symbol = demangled;
-          __real_free(demangled);
-        } else {
-          (*debug_info)[pcs[i].pc].demangled_symbol = symbols[pcs[i].symbol];
-        }
-#else
-        (*debug_info)[pcs[i].pc].demangled_symbol = symbols[pcs[i].symbol];
-#endif
-        (*debug_info)[pcs[i].pc].file = files[pcs[i].file];
-        (*debug_info)[pcs[i].pc].path = paths[pcs[i].path];
-        // TODO(glider): move the path-related logic to the compiler.
-        if ((files[pcs[i].file] != "")  && (paths[pcs[i].path] != "")) {
-          if (paths[pcs[i].path][paths[pcs[i].path].size() - 1] != '/') {
-            (*debug_info)[pcs[i].pc].fullpath =
-                paths[pcs[i].path] + "/" + files[pcs[i].file];
-          } else {
-            (*debug_info)[pcs[i].pc].fullpath =
-                paths[pcs[i].path] + files[pcs[i].file];
-          }
-        } else {
-          (*debug_info)[pcs[i].pc].fullpath = files[pcs[i].file];
-        }
-        (*debug_info)[pcs[i].pc].line = pcs[i].line;
-      }
+      DbgIndexEntry entry;
+      entry.pc = pcs[i].pc;
+      entry.info = &pcs[i];
+      entry.module = debug_modules->size();
+      debug_index->push_back(entry);
     }
+    debug_modules->push_back(module);
+  }
+  // If we've seen a pc several times, use its first record (the others may
+  // be different).
+  // TODO(glider): generate more correct debug info.
+  std::stable_sort(debug_index->begin(), debug_index->end());
+  if (G_flags->verbosity >= 1) {
+    Printf("BuildDbgIndex: %ld modules, %ld pcs\n",
+           debug_modules->size(), debug_index->size());
   }
 }
 
 void AddOneWrapperDbgInfo(pc_t pc, const char *symbol) {
-  if (debug_info == 0)
-    return;
   char const* prefix = "__real_";
   size_t const prefix_len = strlen(prefix);
   if (strncmp(symbol, prefix, prefix_len) == 0)
     symbol = symbol + prefix_len;
-  (*debug_info)[pc].pc = pc;
-  (*debug_info)[pc].symbol = symbol;
-  (*debug_info)[pc].demangled_symbol = symbol;
-  (*debug_info)[pc].fullpath = __FILE__;
-  (*debug_info)[pc].file = __FILE__;
-  (*debug_info)[pc].path = "";
-  // TODO(glider): we need exact line numbers.
-  (*debug_info)[pc].line = 0;
+  WrapperDbgInfo info = {pc, symbol};
+  wrapper_dbg_info->push_back(info);
 }
 
 #define WRAPPER_DBG_INFO(fun) AddOneWrapperDbgInfo((pc_t)fun, #fun)
@@ -401,48 +358,65 @@ void ReadElf() {
       if ((strcmp(hdr_strings + name, ".bss") == 0) ||
           (strcmp(hdr_strings + name, ".rodata") == 0) ||
           (strcmp(hdr_strings + name, ".data") == 0)) {
-        (*data_sections)[(uintptr_t)(vma + size)] = (uintptr_t)vma;
+        DataSection section = {(uintptr_t)vma, (uintptr_t)(vma + size)};
+        data_sections->push_back(section);
         DDPrintf("section: %s, data_sections[%p] = %p\n",
                  hdr_strings + name, (uintptr_t)(vma + size), (uintptr_t)vma);
       }
     }
   }
 
-  if (debug_info_section) {
-    // Parse the debug info section.
-    ReadDbgInfoFromSection(debug_info_section,
-                           debug_info_section + debug_info_size);
+  if (debug_info_section && !debug_info_begin) {
+    // The section is not loaded into memory, use the file mapping instead.
+    // The mapping is kept till exit.
+    debug_info_begin = debug_info_section;
+    debug_info_end = debug_info_section + debug_info_size;
+  } else {
+    sys_munmap(map, st.st_size);
   }
   LEAVE_RTL();
-  // Finalize.
-  sys_munmap(map, st.st_size);
   close(fd);
 }
 
+// Builds all the tables on the first request. Called under DbgInfoLock.
+static void LoadDbgInfo() {
+  if (dbg_info_loaded) return;
+  ENTER_RTL();
+  data_sections = new vector<DataSection>;
+  wrapper_dbg_info = new vector<WrapperDbgInfo>;
+  if (__start_tsan_rtl_debug_info) {
+    debug_info_begin = __start_tsan_rtl_debug_info;
+    debug_info_end = __stop_tsan_rtl_debug_info;
+  }
+  ReadElf();
+  std::sort(data_sections->begin(), data_sections->end());
+  AddWrappersDbgInfo();
+  std::stable_sort(wrapper_dbg_info->begin(), wrapper_dbg_info->end());
+  BuildDbgIndex();
+  LEAVE_RTL();
+  dbg_info_loaded = true;
+}
+
 void DumpDataSections() {
-  map<uintptr_t, uintptr_t>::iterator iter = data_sections->begin();
+  DbgInfoLock scoped;
+  LoadDbgInfo();
   Printf("Data sections:\n");
-  while(iter != data_sections->end()) {
-    Printf("[%p, %p]\n", iter->second, iter->first);
-    ++iter;
+  for (size_t i = 0; i < data_sections->size(); i++) {
+    Printf("[%p, %p]\n", (*data_sections)[i].begin, (*data_sections)[i].end);
   }
 }
 
 bool IsAddrFromDataSections(uintptr_t addr) {
-  map<uintptr_t, uintptr_t>::iterator iter = data_sections->lower_bound(addr);
-  if (iter == data_sections->end()) return false;  // lookup failed.
-  if ((iter->first >= addr) && (iter->second <= addr)) {
-    return true;
-  } else {
-    return false;
-  }
+  DbgInfoLock scoped;
+  LoadDbgInfo();
+  DataSection key = {addr, addr};
+  vector<DataSection>::iterator it =
+      std::upper_bound(data_sections->begin(), data_sections->end(), key);
+  return it != data_sections->end() && it->begin <= addr;
 }
 
 void __tsan::SymbolizeInit() {
   CHECK(DBG_INIT == 0);
-  data_sections = new map<uintptr_t, uintptr_t>;
-  ReadElf();
-  AddWrappersDbgInfo();
   DBG_INIT = 1;
 }
 
@@ -469,24 +443,41 @@ bool __tsan::SymbolizeCode(void *pc, bool demangle,
   if (symbol && symbol_sz) symbol[0] = 0;
   if (file && file_sz) file[0] = 0;
   if (line) *line = 0;
-  if (debug_info) {
-    if (debug_info->find((uintptr_t)pc) != debug_info->end()) {
-      if (symbol) {
-        if (demangle) {
-          strncpy(symbol,
-                  (*debug_info)[(uintptr_t)pc].demangled_symbol.c_str(),
-                  symbol_sz);
-        } else {
-          strncpy(symbol,
-                  (*debug_info)[(uintptr_t)pc].symbol.c_str(),
-                  symbol_sz);
-        }
-      }
-      if (file) strncpy(file,
-                        (*debug_info)[(uintptr_t)pc].fullpath.c_str(),
-                        file_sz);
-      if (line) *line = ((*debug_info)[(uintptr_t)pc].line);
+  if (!DBG_INIT) return true;
+  LoadDbgInfo();
+  WrapperDbgInfo wrapper_key = {(pc_t)pc, NULL};
+  vector<WrapperDbgInfo>::iterator wrapper =
+      std::lower_bound(wrapper_dbg_info->begin(), wrapper_dbg_info->end(),
+                       wrapper_key);
+  if (wrapper != wrapper_dbg_info->end() && wrapper->pc == (pc_t)pc) {
+    if (symbol) strncpy(symbol, wrapper->symbol, symbol_sz);
+    if (file) strncpy(file, __FILE__, file_sz);
+    // TODO(glider): we need exact line numbers.
+    return true;
+  }
+  DbgIndexEntry key;
+  key.pc = (uintptr_t)pc;
+  vector<DbgIndexEntry>::iterator it =
+      std::lower_bound(debug_index->begin(), debug_index->end(), key);
+  if (it == debug_index->end() || it->pc != (uintptr_t)pc) return true;
+  const DbgModule &dbg_module = (*debug_modules)[it->module];
+  if (symbol) {
+    const char *mangled = dbg_module.symbols + it->info->symbol;
+#if defined(__GNUC__)
+    char *demangled = NULL;
+    if (demangle) {
+      int status;
+      ENTER_RTL();
+      demangled = __cxxabiv1::__cxa_demangle(mangled, 0, 0, &status);
+      LEAVE_RTL();
     }
+    strncpy(symbol, demangled ? demangled : mangled, symbol_sz);
+    if (demangled) __real_free(demangled);
+#else
+    strncpy(symbol, mangled, symbol_sz);
+#endif
   }
+  if (file) strncpy(file, dbg_module.files + it->info->file, file_sz);
+  if (line) *line = it->info->line;
   return true;
 }
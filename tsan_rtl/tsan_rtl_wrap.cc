@@ -37,6 +37,7 @@ pthread_create_ft       real_pthread_create;
 posix_memalign_ft       real_posix_memalign;
 valloc_ft               real_valloc;
 memalign_ft             real_memalign;
+malloc_usable_size_ft   real_malloc_usable_size;
 
 void WrapInit() {
   real_memchr = (memchr_ft)dlsym(RTLD_NEXT, "memchr");
@@ -44,6 +45,8 @@ void WrapInit() {
   real_posix_memalign = (posix_memalign_ft)dlsym(RTLD_NEXT, "posix_memalign");
   real_valloc = (valloc_ft)dlsym(RTLD_NEXT, "valloc");
   real_memalign = (memalign_ft)dlsym(RTLD_NEXT, "memalign");
+  real_malloc_usable_size =
+      (malloc_usable_size_ft)dlsym(RTLD_NEXT, "malloc_usable_size");
 }
 
 } // namespace __tsan
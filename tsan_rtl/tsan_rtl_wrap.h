@@ -52,6 +52,9 @@ extern valloc_ft real_valloc;
 typedef void* (*memalign_ft)(size_t boundary, size_t size);
 extern memalign_ft real_memalign;
 
+typedef size_t (*malloc_usable_size_ft)(void *ptr);
+extern malloc_usable_size_ft real_malloc_usable_size;
+
 } // namespace __tsan
 
 // Real function prototypes {{{1
@@ -634,6 +634,270 @@ namespace benign_races {
 } // namespace benign_races
 */
 
+// Scaling benchmarks {{{1
+// Unlike the patterns above these are not mixed by the goals solver: each
+// scenario runs alone with a given number of threads, to see how the
+// detector's VTS, SegmentSet and LockSet sizes grow with it.
+//   bigtest --scaling[=NAME] [--threads=8,16,...] [--rounds=R]
+// Each run prints its wall time. The detector's counters (segments, VTS
+// sizes, flushes) are printed by the tool at exit with --show_stats=1, so
+// to get them per point run one scenario and one thread count at a time:
+//   for n in 8 64 512 1024; do
+//     tsan --show_stats=1 bigtest --scaling=barrier_phases --threads=$n
+//   done
+namespace scaling {
+   int n_threads;
+   int n_rounds;
+
+   // A pool of n_threads workers runs n_threads * n_rounds short closures,
+   // each touching its own data and a counter under a common lock.
+   namespace thread_pool {
+      Mutex mu;
+      int counter;
+      int *data;
+
+      void Task(int i) {
+         data[i]++;
+         MutexLock lock(&mu);
+         counter++;
+      }
+
+      void Run() {
+         int n_tasks = n_threads * n_rounds;
+         data = new int[n_tasks];
+         memset(data, 0, n_tasks * sizeof(int));
+         counter = 0;
+         {
+            ThreadPool pool(n_threads);
+            pool.StartWorkers();
+            for (int i = 0; i < n_tasks; i++)
+               pool.Add(NewCallback(Task, i));
+         }
+         CHECK(counter == n_tasks);
+         delete [] data;
+      }
+   }
+
+   // Each thread takes a suffix of kDepth mutexes in order, so there
+   // are kDepth different LockSets of up to kDepth locks, all of them
+   // with the last mutex which protects the data.
+   namespace lock_nesting {
+      const int kDepth = 64;
+      const int kDataSize = 64;
+      Mutex64 mu[kDepth];
+      int data[kDataSize];
+
+      void Worker(void *arg) {
+         int t = (int)(intptr_t)arg;
+         for (int r = 0; r < n_rounds; r++) {
+            int first = (t + r) % kDepth;
+            for (int i = first; i < kDepth; i++)
+               mu[i].Lock();
+            for (int j = 0; j < kDataSize; j++)
+               data[j]++;
+            for (int i = kDepth - 1; i >= first; i--)
+               mu[i].Unlock();
+         }
+      }
+   }
+
+   // A ring of threads, one condition variable each: in every round a
+   // thread publishes its data, signals its own CV and waits on the one
+   // of the next thread. Each wait adds a thread to the VTS of the waiter.
+   namespace many_condvars {
+      struct Context {
+         Mutex64 mu;
+         CondVar cv;
+         int round;  // Protected by mu.
+      } *contexts;
+      int *data;  // [thread][round], written once.
+
+      void Worker(void *arg) {
+         int t = (int)(intptr_t)arg;
+         Context *mine = &contexts[t];
+         Context *next = &contexts[(t + 1) % n_threads];
+         int *next_data = data + ((t + 1) % n_threads) * n_rounds;
+         for (int r = 0; r < n_rounds; r++) {
+            data[t * n_rounds + r] = r;
+            mine->mu.Lock();
+            mine->round = r + 1;
+            mine->cv.SignalAll();
+            mine->mu.Unlock();
+
+            next->mu.Lock();
+            while (next->round <= r)
+               next->cv.Wait(&next->mu);
+            next->mu.Unlock();
+            CHECK(next_data[r] == r);
+         }
+      }
+
+      void Run();
+   }
+
+#ifndef NO_BARRIER
+   // All the threads write their slots, meet at a barrier, read the slots
+   // of their neighbours and meet again: every phase makes the VTS of each
+   // thread n_threads long.
+   namespace barrier_phases {
+      Barrier *barrier;
+      int *slots;
+
+      void Worker(void *arg) {
+         int t = (int)(intptr_t)arg;
+         for (int r = 0; r < n_rounds; r++) {
+            slots[t] = r;
+            barrier->Block();
+            CHECK(slots[(t + 1) % n_threads] == r);
+            barrier->Block();
+         }
+      }
+   }
+#endif
+
+   // Each thread allocates, writes and frees blocks of different sizes;
+   // every 8th block is passed to the next thread which frees it.
+   namespace heap_churn {
+      const int kBlocksPerRound = 64;
+      ProducerConsumerQueue **queues;
+
+      void Worker(void *arg) {
+         int t = (int)(intptr_t)arg;
+         ProducerConsumerQueue *mine = queues[t];
+         ProducerConsumerQueue *next = queues[(t + 1) % n_threads];
+         for (int r = 0; r < n_rounds; r++) {
+            for (int i = 0; i < kBlocksPerRound; i++) {
+               int size = 16 << ((t + r + i) % 9);
+               char *block = (char*)malloc(size);
+               memset(block, t, size);
+               if (i % 8 == 0)
+                  next->Put(block);
+               else
+                  free(block);
+            }
+            void *received;
+            while (mine->TryGet(&received))
+               free(received);
+         }
+      }
+   }
+
+   // Starts n_threads threads running worker and joins them.
+   void RunThreads(void (*worker)(void *)) {
+      std::vector<MyThread*> threads(n_threads);
+      for (int t = 0; t < n_threads; t++) {
+         threads[t] = new MyThread(worker, (void*)(intptr_t)t);
+         threads[t]->Start();
+      }
+      for (int t = 0; t < n_threads; t++) {
+         threads[t]->Join();
+         delete threads[t];
+      }
+   }
+
+   void many_condvars::Run() {
+      contexts = new Context[n_threads];
+      for (int t = 0; t < n_threads; t++)
+         contexts[t].round = 0;
+      data = new int[n_threads * n_rounds];
+      RunThreads(Worker);
+      delete [] data;
+      delete [] contexts;
+   }
+
+   void RunLockNesting() {
+      RunThreads(lock_nesting::Worker);
+   }
+
+#ifndef NO_BARRIER
+   void RunBarrierPhases() {
+      barrier_phases::barrier = new Barrier(n_threads);
+      barrier_phases::slots = new int[n_threads];
+      RunThreads(barrier_phases::Worker);
+      delete [] barrier_phases::slots;
+      delete barrier_phases::barrier;
+   }
+#endif
+
+   void RunHeapChurn() {
+      heap_churn::queues = new ProducerConsumerQueue*[n_threads];
+      for (int t = 0; t < n_threads; t++)
+         heap_churn::queues[t] = new ProducerConsumerQueue(0);
+      RunThreads(heap_churn::Worker);
+      for (int t = 0; t < n_threads; t++) {
+         void *received;
+         while (heap_churn::queues[t]->TryGet(&received))
+            free(received);
+         delete heap_churn::queues[t];
+      }
+      delete [] heap_churn::queues;
+   }
+
+   struct Scenario {
+      const char *name;
+      void (*run)();
+   } scenarios[] = {
+      {"thread_pool",    thread_pool::Run},
+      {"lock_nesting",   RunLockNesting},
+      {"many_condvars",  many_condvars::Run},
+#ifndef NO_BARRIER
+      {"barrier_phases", RunBarrierPhases},
+#endif
+      {"heap_churn",     RunHeapChurn},
+   };
+
+   int Main(int argc, const char **argv) {
+      const char *only = NULL;
+      std::vector<int> thread_counts;
+      n_rounds = 100;
+      for (int i = 1; i < argc; i++) {
+         const char *arg = argv[i];
+         if (!strncmp(arg, "--scaling=", 10)) {
+            only = arg + 10;
+         } else if (!strncmp(arg, "--threads=", 10)) {
+            for (const char *p = arg + 10; *p; p++) {
+               thread_counts.push_back(atoi(p));
+               while (p[1] && *p != ',')
+                  p++;
+            }
+         } else if (!strncmp(arg, "--rounds=", 9)) {
+            n_rounds = atoi(arg + 9);
+         } else if (strcmp(arg, "--scaling")) {
+            fprintf(stderr, "Unknown flag \"%s\"\n", arg);
+            return 1;
+         }
+      }
+      if (thread_counts.empty()) {
+         for (int n = 8; n <= 1024; n *= 2)
+            thread_counts.push_back(n);
+      }
+      CHECK(n_rounds > 0);
+
+      int n_runs = 0;
+      for (size_t i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+         if (only && strcmp(only, scenarios[i].name))
+            continue;
+         for (size_t j = 0; j < thread_counts.size(); j++) {
+            n_threads = thread_counts[j];
+            CHECK(n_threads >= 2);
+            long start = GetTimeInMs();
+            scenarios[i].run();
+            long end = GetTimeInMs();
+            printf("*RESULT bigtest_%s: threads= %d rounds= %d time= %d ms\n",
+                   scenarios[i].name, n_threads, n_rounds,
+                   (int)(end - start));
+            fflush(stdout);
+            n_runs++;
+         }
+      }
+      if (n_runs == 0) {
+         fprintf(stderr, "No scaling scenario \"%s\"\n", only);
+         return 1;
+      }
+      return 0;
+   }
+} // namespace scaling
+
 typedef std::map<std::string, StatType> StatMap;
 StatMap statNames;
 int nThreads = 2;
@@ -707,6 +971,8 @@ void RegisterStatNames() {
 }
 
 int main(int argc, const char **argv) {
+   if (argc >= 2 && !strncmp(argv[1], "--scaling", 9))
+      return scaling::Main(argc, argv);
    long init = GetTimeInMs();
    RegisterStatNames();
    const char *default_goals[] = {"N_THREADS=20", "N_MEM_ACCESSES_K=130000",
@@ -719,7 +985,9 @@ int main(int argc, const char **argv) {
       goal_list = default_goals;
       goal_cnt  = sizeof(default_goals) / sizeof(*default_goals);
    } else if (argc == 2 && !strcmp(argv[1], "--help")) {
-      printf("Usage: bigtest [PARAM=VALUE] ...\n  Available params: ");
+      printf("Usage: bigtest [PARAM=VALUE] ...\n"
+             "       bigtest --scaling[=NAME] [--threads=N,...] [--rounds=R]\n"
+             "  Available params: ");
       for (StatMap::iterator i = statNames.begin(); i != statNames.end(); i++) {
          printf ("%s%s", (i == statNames.begin()) ? "" : ", ",
                          (*i).first.c_str());
@@ -8526,5 +8526,56 @@ TEST(PositiveTests, LibcStringFunctions) {
 
 }  // namespace
 
+namespace NegativeTests_HappensAfterArray {  // {{{1
+// Each worker publishes its own element, the main thread acquires all of
+// them with one ANNOTATE_HAPPENS_AFTER_ARRAY or ANNOTATE_HAPPENS_AFTER_MANY.
+const int kNumWorkers = 4;
+int data[kNumWorkers];
+StealthNotification *n[kNumWorkers];
+int worker_counter;
+Mutex mu;
+
+void Worker() {
+  int i;
+  {
+    MutexLock lock(&mu);
+    i = worker_counter++;
+  }
+  data[i] = i + 1;
+  ANNOTATE_HAPPENS_BEFORE(&data[i]);
+  n[i]->signal();
+}
+
+void RunWorkers(bool use_many) {
+  worker_counter = 0;
+  for (int i = 0; i < kNumWorkers; i++)
+    n[i] = new StealthNotification;
+  MyThreadArray t(Worker, Worker, Worker, Worker);
+  t.Start();
+  for (int i = 0; i < kNumWorkers; i++)
+    n[i]->wait();
+  if (use_many) {
+    void *objs[kNumWorkers];
+    for (int i = 0; i < kNumWorkers; i++)
+      objs[i] = &data[i];
+    ANNOTATE_HAPPENS_AFTER_MANY(objs, kNumWorkers);
+  } else {
+    ANNOTATE_HAPPENS_AFTER_ARRAY(data, kNumWorkers);
+  }
+  for (int i = 0; i < kNumWorkers; i++) {
+    EXPECT_EQ(i + 1, data[i]);
+    data[i] = 0;
+  }
+  t.Join();
+  for (int i = 0; i < kNumWorkers; i++)
+    delete n[i];
+}
+
+TEST(NegativeTests, HappensAfterArray) {
+  RunWorkers(false);
+  RunWorkers(true);
+}
+}  // namespace
+
 // End {{{1
  // vim:shiftwidth=2:softtabstop=2:expandtab:foldmethod=marker